@@ -5,6 +5,7 @@
 
 #include <chiaki/common.h>
 #include <chiaki/log.h>
+#include <chiaki/config.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -12,6 +13,12 @@ extern "C" {
 
 CHIAKI_EXPORT int chiaki_cli_cmd_discover(ChiakiLog *log, int argc, char *argv[]);
 CHIAKI_EXPORT int chiaki_cli_cmd_wakeup(ChiakiLog *log, int argc, char *argv[]);
+CHIAKI_EXPORT int chiaki_cli_cmd_haptics_bench(ChiakiLog *log, int argc, char *argv[]);
+CHIAKI_EXPORT int chiaki_cli_cmd_stream(ChiakiLog *log, int argc, char *argv[]);
+CHIAKI_EXPORT int chiaki_cli_cmd_pool_bench(ChiakiLog *log, int argc, char *argv[]);
+#if CHIAKI_LIB_ENABLE_FFMPEG_DECODER
+CHIAKI_EXPORT int chiaki_cli_cmd_decode_bench(ChiakiLog *log, int argc, char *argv[]);
+#endif
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,421 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#include <chiaki-cli.h>
+
+#include <chiaki/ffmpegdecoder.h>
+#include <chiaki/time.h>
+
+#include <argp.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static char doc[] = "Replay a raw Annex B H.264/H.265 stream through the video decoder and report decode latency per threading mode.";
+
+#define ARG_KEY_CODEC 'c'
+#define ARG_KEY_FPS 'f'
+#define ARG_KEY_THREADS 't'
+#define ARG_KEY_MODE 'm'
+#define ARG_KEY_HW 'w'
+
+static struct argp_option options[] = {
+	{ "codec", ARG_KEY_CODEC, "Codec", 0, "h264 or h265 (default: from the file extension, else h264)", 0 },
+	{ "fps", ARG_KEY_FPS, "FPS", 0, "Feed frames at this rate like a live stream, 0 for as fast as possible (default: 60)", 0 },
+	{ "threads", ARG_KEY_THREADS, "Count", 0, "Decoder thread count for the slice and frame modes, 0 for automatic (default: 0)", 0 },
+	{ "mode", ARG_KEY_MODE, "Mode", 0, "Only run one of default, slice, frame, low-delay", 0 },
+	{ "hw", ARG_KEY_HW, "Decoder", 0, "Name of a hardware decoder to use, e.g. vaapi", 0 },
+	{ 0 }
+};
+
+typedef struct arguments
+{
+	const char *file;
+	const char *codec;
+	unsigned long fps;
+	int threads;
+	const char *mode;
+	const char *hw;
+} Arguments;
+
+static int parse_opt(int key, char *arg, struct argp_state *state)
+{
+	Arguments *arguments = state->input;
+
+	switch(key)
+	{
+		case ARG_KEY_CODEC:
+			arguments->codec = arg;
+			break;
+		case ARG_KEY_FPS:
+			arguments->fps = strtoul(arg, NULL, 10);
+			break;
+		case ARG_KEY_THREADS:
+			arguments->threads = atoi(arg);
+			break;
+		case ARG_KEY_MODE:
+			arguments->mode = arg;
+			break;
+		case ARG_KEY_HW:
+			arguments->hw = arg;
+			break;
+		case ARGP_KEY_ARG:
+			if(arguments->file)
+				argp_usage(state);
+			arguments->file = arg;
+			break;
+		default:
+			return ARGP_ERR_UNKNOWN;
+	}
+
+	return 0;
+}
+
+static struct argp argp = { options, parse_opt, "FILE", doc, 0, 0, 0 };
+
+typedef struct access_unit_t
+{
+	uint8_t *buf;
+	size_t size;
+} AccessUnit;
+
+typedef struct bench_mode_t
+{
+	const char *name;
+	ChiakiFfmpegDecoderThreading threading;
+	bool low_delay;
+} BenchMode;
+
+static const BenchMode bench_modes[] = {
+	{ "default", CHIAKI_FFMPEG_DECODER_THREADING_DEFAULT, false },
+	{ "slice", CHIAKI_FFMPEG_DECODER_THREADING_SLICE, false },
+	{ "frame", CHIAKI_FFMPEG_DECODER_THREADING_FRAME, false },
+	{ "low-delay", CHIAKI_FFMPEG_DECODER_THREADING_SLICE, true }
+};
+
+typedef struct bench_t
+{
+	ChiakiFfmpegDecoder decoder;
+	ChiakiMutex mutex;
+	ChiakiCond cond;
+	size_t frames;
+	int32_t frames_lost;
+	uint64_t frames_replaced;
+	uint64_t *decode_us;
+	uint64_t *queue_us;
+	size_t samples_size;
+} Bench;
+
+static void bench_frame_available(ChiakiFfmpegDecoder *decoder, void *user)
+{
+	Bench *bench = user;
+	ChiakiFfmpegDecoderFrameStats stats;
+	int32_t frames_lost = 0;
+	AVFrame *frame = chiaki_ffmpeg_decoder_pull_frame_stats(decoder, &frames_lost, &stats);
+	if(!frame)
+		return;
+	chiaki_ffmpeg_frame_free(&frame);
+
+	chiaki_mutex_lock(&bench->mutex);
+	if(bench->frames < bench->samples_size)
+	{
+		bench->decode_us[bench->frames] = stats.decode_us;
+		bench->queue_us[bench->frames] = stats.queue_us;
+	}
+	bench->frames++;
+	bench->frames_lost += frames_lost;
+	bench->frames_replaced += stats.frames_replaced;
+	chiaki_mutex_unlock(&bench->mutex);
+	chiaki_cond_signal(&bench->cond);
+}
+
+static ChiakiErrorCode read_file(const char *path, uint8_t **buf, size_t *size)
+{
+	FILE *f = fopen(path, "rb");
+	if(!f)
+		return CHIAKI_ERR_UNKNOWN;
+	ChiakiErrorCode err = CHIAKI_ERR_UNKNOWN;
+	if(fseek(f, 0, SEEK_END) != 0)
+		goto beach;
+	long len = ftell(f);
+	if(len <= 0 || fseek(f, 0, SEEK_SET) != 0)
+		goto beach;
+	*buf = malloc((size_t)len);
+	if(!*buf)
+	{
+		err = CHIAKI_ERR_MEMORY;
+		goto beach;
+	}
+	if(fread(*buf, 1, (size_t)len, f) != (size_t)len)
+	{
+		free(*buf);
+		goto beach;
+	}
+	*size = (size_t)len;
+	err = CHIAKI_ERR_SUCCESS;
+beach:
+	fclose(f);
+	return err;
+}
+
+/**
+ * Split a raw stream into access units, which is what the video receiver passes to the decoder.
+ */
+static ChiakiErrorCode split_access_units(ChiakiCodec codec, uint8_t *data, size_t size, AccessUnit **aus, size_t *aus_count)
+{
+	*aus = NULL;
+	*aus_count = 0;
+	AVCodecParserContext *parser = av_parser_init(chiaki_codec_is_h265(codec) ? AV_CODEC_ID_H265 : AV_CODEC_ID_H264);
+	if(!parser)
+		return CHIAKI_ERR_UNKNOWN;
+	AVCodecContext *parser_ctx = avcodec_alloc_context3(NULL);
+	if(!parser_ctx)
+	{
+		av_parser_close(parser);
+		return CHIAKI_ERR_MEMORY;
+	}
+
+	ChiakiErrorCode err = CHIAKI_ERR_SUCCESS;
+	size_t capacity = 0;
+	bool flushed = false;
+	while(!flushed)
+	{
+		uint8_t *out;
+		int out_size;
+		int consumed = av_parser_parse2(parser, parser_ctx, &out, &out_size,
+				data, size > INT_MAX ? INT_MAX : (int)size, AV_NOPTS_VALUE, AV_NOPTS_VALUE, 0);
+		if(consumed < 0)
+		{
+			err = CHIAKI_ERR_INVALID_DATA;
+			break;
+		}
+		flushed = size == 0;
+		data += consumed;
+		size -= consumed;
+		if(out_size <= 0)
+			continue;
+
+		if(*aus_count == capacity)
+		{
+			capacity = capacity ? capacity * 2 : 0x400;
+			AccessUnit *n = realloc(*aus, capacity * sizeof(AccessUnit));
+			if(!n)
+			{
+				err = CHIAKI_ERR_MEMORY;
+				break;
+			}
+			*aus = n;
+		}
+		AccessUnit *au = &(*aus)[*aus_count];
+		au->buf = malloc(out_size);
+		if(!au->buf)
+		{
+			err = CHIAKI_ERR_MEMORY;
+			break;
+		}
+		memcpy(au->buf, out, out_size);
+		au->size = out_size;
+		(*aus_count)++;
+	}
+
+	avcodec_free_context(&parser_ctx);
+	av_parser_close(parser);
+	return err;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a;
+	uint64_t y = *(const uint64_t *)b;
+	return x < y ? -1 : x > y;
+}
+
+static double percentile_ms(const uint64_t *sorted, size_t count, unsigned int p)
+{
+	if(!count)
+		return 0.0;
+	size_t i = (count * p + 99) / 100;
+	return (double)sorted[i ? i - 1 : 0] / 1000.0;
+}
+
+static void print_latency(const char *name, uint64_t *samples, size_t count)
+{
+	qsort(samples, count, sizeof(uint64_t), cmp_u64);
+	printf("    %-7s p50 %7.2f  p95 %7.2f  p99 %7.2f  max %7.2f ms\n", name,
+			percentile_ms(samples, count, 50), percentile_ms(samples, count, 95),
+			percentile_ms(samples, count, 99), count ? (double)samples[count - 1] / 1000.0 : 0.0);
+}
+
+#define DRAIN_TIMEOUT_MS 1000
+
+static int run_mode(ChiakiLog *log, const Arguments *arguments, ChiakiCodec codec, const BenchMode *mode, AccessUnit *aus, size_t aus_count)
+{
+	Bench bench = { 0 };
+	bench.samples_size = aus_count;
+	bench.decode_us = calloc(aus_count, sizeof(uint64_t));
+	bench.queue_us = calloc(aus_count, sizeof(uint64_t));
+	if(!bench.decode_us || !bench.queue_us)
+		goto error_samples;
+	if(chiaki_mutex_init(&bench.mutex, false) != CHIAKI_ERR_SUCCESS)
+		goto error_samples;
+	if(chiaki_cond_init(&bench.cond) != CHIAKI_ERR_SUCCESS)
+		goto error_mutex;
+
+	ChiakiFfmpegDecoderOptions options;
+	chiaki_ffmpeg_decoder_options_default(&options);
+	options.threading = mode->threading;
+	options.thread_count = arguments->threads;
+	options.low_delay = options.fast = mode->low_delay;
+	ChiakiErrorCode err = chiaki_ffmpeg_decoder_init(&bench.decoder, log, codec, arguments->hw, NULL,
+			bench_frame_available, &bench, &options);
+	if(err != CHIAKI_ERR_SUCCESS)
+	{
+		fprintf(stderr, "Failed to init decoder for mode %s: %s\n", mode->name, chiaki_error_string(err));
+		goto error_cond;
+	}
+
+	size_t rejected = 0;
+	uint64_t interval_us = arguments->fps ? 1000000 / arguments->fps : 0;
+	uint64_t start_us = chiaki_time_now_monotonic_us();
+	chiaki_mutex_lock(&bench.mutex);
+	for(size_t i=0; i<aus_count; i++)
+	{
+		// the cond is also signaled for every decoded frame, so keep waiting until the frame is due
+		uint64_t due_us = start_us + i * interval_us;
+		for(uint64_t now_us = chiaki_time_now_monotonic_us(); due_us > now_us + 1000; now_us = chiaki_time_now_monotonic_us())
+			chiaki_cond_timedwait(&bench.cond, &bench.mutex, (due_us - now_us) / 1000);
+		chiaki_mutex_unlock(&bench.mutex);
+		if(!chiaki_ffmpeg_decoder_video_sample_cb(aus[i].buf, aus[i].size, 0, false, &bench.decoder))
+			rejected++;
+		chiaki_mutex_lock(&bench.mutex);
+	}
+
+	// wait until no more frames come out of the decoder
+	uint64_t end_us = chiaki_time_now_monotonic_us();
+	while(bench.frames + bench.frames_replaced + rejected < aus_count)
+	{
+		size_t frames = bench.frames;
+		chiaki_cond_timedwait(&bench.cond, &bench.mutex, DRAIN_TIMEOUT_MS);
+		if(bench.frames == frames)
+			break;
+		end_us = chiaki_time_now_monotonic_us();
+	}
+	chiaki_mutex_unlock(&bench.mutex);
+
+	chiaki_ffmpeg_decoder_fini(&bench.decoder);
+
+	size_t samples = bench.frames < bench.samples_size ? bench.frames : bench.samples_size;
+	double secs = (double)(end_us - start_us) / 1000000.0;
+	if(options.thread_count)
+		printf("%s (%s, %d threads):\n", mode->name, chiaki_ffmpeg_decoder_threading_name(mode->threading), options.thread_count);
+	else
+		printf("%s (%s):\n", mode->name, chiaki_ffmpeg_decoder_threading_name(mode->threading));
+	printf("    %zu of %zu frames decoded, %llu replaced, %zu rejected, %d lost, %.1f fps\n",
+			bench.frames, aus_count, (unsigned long long)bench.frames_replaced, rejected, (int)bench.frames_lost,
+			secs > 0.0 ? (double)bench.frames / secs : 0.0);
+	print_latency("decode", bench.decode_us, samples);
+	print_latency("queue", bench.queue_us, samples);
+
+	chiaki_cond_fini(&bench.cond);
+	chiaki_mutex_fini(&bench.mutex);
+	free(bench.decode_us);
+	free(bench.queue_us);
+	return 0;
+
+error_cond:
+	chiaki_cond_fini(&bench.cond);
+error_mutex:
+	chiaki_mutex_fini(&bench.mutex);
+error_samples:
+	free(bench.decode_us);
+	free(bench.queue_us);
+	return 1;
+}
+
+CHIAKI_EXPORT int chiaki_cli_cmd_decode_bench(ChiakiLog *log, int argc, char *argv[])
+{
+	Arguments arguments = { 0 };
+	arguments.fps = 60;
+	error_t argp_r = argp_parse(&argp, argc, argv, ARGP_IN_ORDER, NULL, &arguments);
+	if(argp_r != 0)
+		return 1;
+
+	if(!arguments.file)
+	{
+		fprintf(stderr, "No file specified, see --help.\n");
+		return 1;
+	}
+
+	ChiakiCodec codec = CHIAKI_CODEC_H264;
+	const char *ext = strrchr(arguments.file, '.');
+	if(arguments.codec)
+	{
+		if(strcmp(arguments.codec, "h265") == 0 || strcmp(arguments.codec, "hevc") == 0)
+			codec = CHIAKI_CODEC_H265;
+		else if(strcmp(arguments.codec, "h264") != 0)
+		{
+			fprintf(stderr, "Unknown codec %s, see --help.\n", arguments.codec);
+			return 1;
+		}
+	}
+	else if(ext && (strcmp(ext, ".h265") == 0 || strcmp(ext, ".265") == 0 || strcmp(ext, ".hevc") == 0))
+		codec = CHIAKI_CODEC_H265;
+
+	const BenchMode *only_mode = NULL;
+	if(arguments.mode)
+	{
+		for(size_t i=0; i<sizeof(bench_modes) / sizeof(bench_modes[0]); i++)
+		{
+			if(strcmp(arguments.mode, bench_modes[i].name) == 0)
+				only_mode = &bench_modes[i];
+		}
+		if(!only_mode)
+		{
+			fprintf(stderr, "Unknown mode %s, see --help.\n", arguments.mode);
+			return 1;
+		}
+	}
+
+	uint8_t *data;
+	size_t size;
+	ChiakiErrorCode err = read_file(arguments.file, &data, &size);
+	if(err != CHIAKI_ERR_SUCCESS)
+	{
+		fprintf(stderr, "Failed to read %s: %s\n", arguments.file, chiaki_error_string(err));
+		return 1;
+	}
+
+	AccessUnit *aus;
+	size_t aus_count;
+	err = split_access_units(codec, data, size, &aus, &aus_count);
+	free(data);
+	int r = 1;
+	if(err != CHIAKI_ERR_SUCCESS)
+	{
+		fprintf(stderr, "Failed to parse %s: %s\n", arguments.file, chiaki_error_string(err));
+		goto beach;
+	}
+	if(!aus_count)
+	{
+		fprintf(stderr, "No frames found in %s\n", arguments.file);
+		goto beach;
+	}
+
+	if(arguments.fps)
+		printf("%zu frames of %s at %lu fps\n", aus_count, chiaki_codec_name(codec), arguments.fps);
+	else
+		printf("%zu frames of %s at full speed\n", aus_count, chiaki_codec_name(codec));
+	r = 0;
+	for(size_t i=0; i<sizeof(bench_modes) / sizeof(bench_modes[0]); i++)
+	{
+		if(only_mode && only_mode != &bench_modes[i])
+			continue;
+		r |= run_mode(log, &arguments, codec, &bench_modes[i], aus, aus_count);
+	}
+
+beach:
+	for(size_t i=0; i<aus_count; i++)
+		free(aus[i].buf);
+	free(aus);
+	return r;
+}
@@ -0,0 +1,119 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#include <chiaki-cli.h>
+
+#include <chiaki/hapticsresampler.h>
+#include <chiaki/time.h>
+
+#include <argp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static char doc[] = "Measure the per-packet cost of upsampling DualSense haptics from 3 kHz to 48 kHz.";
+
+#define ARG_KEY_PACKETS 'n'
+#define ARG_KEY_GAIN 'g'
+
+static struct argp_option options[] = {
+	{ "packets", ARG_KEY_PACKETS, "Count", 0, "Number of packets to resample (default: 1000000)", 0 },
+	{ "gain", ARG_KEY_GAIN, "Gain", 0, "Haptics intensity between 0 and 2 (default: 1)", 0 },
+	{ 0 }
+};
+
+typedef struct arguments
+{
+	unsigned long packets;
+	float gain;
+} Arguments;
+
+static int parse_opt(int key, char *arg, struct argp_state *state)
+{
+	Arguments *arguments = state->input;
+
+	switch(key)
+	{
+		case ARG_KEY_PACKETS:
+			arguments->packets = strtoul(arg, NULL, 10);
+			break;
+		case ARG_KEY_GAIN:
+			arguments->gain = strtof(arg, NULL);
+			break;
+		case ARGP_KEY_ARG:
+			argp_usage(state);
+			break;
+		default:
+			return ARGP_ERR_UNKNOWN;
+	}
+
+	return 0;
+}
+
+static struct argp argp = { options, parse_opt, NULL, doc, 0, 0, 0 };
+
+#define PACKET_FRAMES 30 // 120 byte packets of stereo 16 bit frames, as sent by the console
+#define BATCH_PACKETS 1000 // packets per timed batch, single packets are too short for the clock
+
+static int cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *)a;
+	double y = *(const double *)b;
+	return x < y ? -1 : x > y;
+}
+
+CHIAKI_EXPORT int chiaki_cli_cmd_haptics_bench(ChiakiLog *log, int argc, char *argv[])
+{
+	Arguments arguments = { 0 };
+	arguments.packets = 1000000;
+	arguments.gain = 1.0f;
+	error_t argp_r = argp_parse(&argp, argc, argv, ARGP_IN_ORDER, NULL, &arguments);
+	if(argp_r != 0)
+		return 1;
+
+	size_t batches = (arguments.packets + BATCH_PACKETS - 1) / BATCH_PACKETS;
+	if(!batches)
+		batches = 1;
+	double *samples = calloc(batches, sizeof(double));
+	if(!samples)
+		return 1;
+
+	// a second of input, so the data isn't trivially cached in a single packet
+	static int16_t in[CHIAKI_HAPTICS_RESAMPLER_RATE_IN * CHIAKI_HAPTICS_RESAMPLER_CHANNELS_IN];
+	for(size_t i=0; i<sizeof(in) / sizeof(in[0]); i++)
+		in[i] = (int16_t)(rand() - RAND_MAX / 2);
+	static int16_t out[PACKET_FRAMES * CHIAKI_HAPTICS_RESAMPLER_RATIO * CHIAKI_HAPTICS_RESAMPLER_CHANNELS_OUT];
+
+	ChiakiHapticsResampler resampler;
+	chiaki_haptics_resampler_init(&resampler);
+	chiaki_haptics_resampler_set_gain(&resampler, arguments.gain);
+
+	size_t offset = 0;
+	uint32_t checksum = 0;
+	for(size_t b=0; b<batches; b++)
+	{
+		uint64_t start = chiaki_time_now_monotonic_us();
+		for(size_t p=0; p<BATCH_PACKETS; p++)
+		{
+			chiaki_haptics_resampler_process(&resampler, out, in + offset * CHIAKI_HAPTICS_RESAMPLER_CHANNELS_IN, PACKET_FRAMES);
+			offset = (offset + PACKET_FRAMES) % CHIAKI_HAPTICS_RESAMPLER_RATE_IN;
+			checksum += (uint16_t)out[p % (sizeof(out) / sizeof(out[0]))]; // keep the work observable
+		}
+		samples[b] = (double)(chiaki_time_now_monotonic_us() - start) * 1000.0 / BATCH_PACKETS;
+	}
+
+	qsort(samples, batches, sizeof(double), cmp_double);
+	double sum = 0.0;
+	for(size_t b=0; b<batches; b++)
+		sum += samples[b];
+	printf("%zu packets of %u frames, gain %.2f (checksum %08x)\n",
+			batches * BATCH_PACKETS, PACKET_FRAMES, resampler.gain, (unsigned int)checksum);
+	printf("    per packet: mean %.1f  p50 %.1f  p99 %.1f  max %.1f ns\n",
+			sum / batches, samples[batches / 2], samples[(batches * 99) / 100 < batches ? (batches * 99) / 100 : batches - 1],
+			samples[batches - 1]);
+	printf("    real time share at %u packets/s: %.4f%%\n",
+			CHIAKI_HAPTICS_RESAMPLER_RATE_IN / PACKET_FRAMES,
+			sum / batches * (CHIAKI_HAPTICS_RESAMPLER_RATE_IN / PACKET_FRAMES) / 1e9 * 100.0);
+
+	free(samples);
+	return 0;
+}
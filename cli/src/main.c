@@ -13,7 +13,14 @@ static const char doc[] =
 	"\v"
 	"Supported commands are:\n"
 	"  discover    Discover Consoles.\n"
-	"  wakeup      Send Wakeup Packet.\n";
+	"  wakeup      Send Wakeup Packet.\n"
+	"  stream      Stream from a registered console to a file or pipe.\n"
+	"  haptics-bench  Measure the cost of resampling haptics.\n"
+	"  pool-bench  Emulate the key stream load of several sessions on a worker pool.\n"
+#if CHIAKI_LIB_ENABLE_FFMPEG_DECODER
+	"  decode-bench  Replay a recorded stream through the video decoder.\n"
+#endif
+	;
 
 #define ARG_KEY_VERBOSE 'v'
 
@@ -61,6 +68,16 @@ static int parse_opt(int key, char *arg, struct argp_state *state)
 				exit(call_subcmd(state, "discover", chiaki_cli_cmd_discover));
 			else if(strcmp(arg, "wakeup") == 0)
 				exit(call_subcmd(state, "wakeup", chiaki_cli_cmd_wakeup));
+			else if(strcmp(arg, "stream") == 0)
+				exit(call_subcmd(state, "stream", chiaki_cli_cmd_stream));
+			else if(strcmp(arg, "haptics-bench") == 0)
+				exit(call_subcmd(state, "haptics-bench", chiaki_cli_cmd_haptics_bench));
+			else if(strcmp(arg, "pool-bench") == 0)
+				exit(call_subcmd(state, "pool-bench", chiaki_cli_cmd_pool_bench));
+#if CHIAKI_LIB_ENABLE_FFMPEG_DECODER
+			else if(strcmp(arg, "decode-bench") == 0)
+				exit(call_subcmd(state, "decode-bench", chiaki_cli_cmd_decode_bench));
+#endif
 			// fallthrough
 		case ARGP_KEY_END:
 			argp_usage(state);
@@ -0,0 +1,280 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#include <chiaki-cli.h>
+
+#include <chiaki/gkcrypt.h>
+#include <chiaki/ecdh.h>
+#include <chiaki/metrics.h>
+#include <chiaki/session.h>
+#include <chiaki/thread.h>
+#include <chiaki/time.h>
+#include <chiaki/workerpool.h>
+
+#include <argp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef _WIN32
+#include <sys/resource.h>
+#endif
+
+static char doc[] = "Emulate the key stream load of several sessions in one process, with threads of their own or a shared worker pool."
+	"\v"
+	"Only the key stream generators are emulated, none of the networking, congestion control or video handling\n"
+	"of a real session. To measure real sessions sharing a pool, use stream with several --credentials and --pool.\n";
+
+#define ARG_KEY_SESSIONS 'n'
+#define ARG_KEY_THREADS 't'
+#define ARG_KEY_NO_POOL 1000
+#define ARG_KEY_BITRATE 'b'
+#define ARG_KEY_DURATION 'd'
+
+static struct argp_option options[] = {
+	{ "sessions", ARG_KEY_SESSIONS, "Count", 0, "Number of emulated sessions (default: 4)", 0 },
+	{ "threads", ARG_KEY_THREADS, "Count", 0, "Worker pool threads, 0 for one per core (default: 0)", 0 },
+	{ "no-pool", ARG_KEY_NO_POOL, NULL, 0, "Give every key stream its own thread, like sessions without a pool", 0 },
+	{ "bitrate", ARG_KEY_BITRATE, "Kbps", 0, "Received bitrate per session (default: 30000)", 0 },
+	{ "duration", ARG_KEY_DURATION, "Seconds", 0, "How long to run (default: 5)", 0 },
+	{ 0 }
+};
+
+typedef struct arguments
+{
+	unsigned int sessions;
+	unsigned int threads;
+	bool no_pool;
+	unsigned long bitrate;
+	unsigned long duration;
+} Arguments;
+
+static int parse_opt(int key, char *arg, struct argp_state *state)
+{
+	Arguments *arguments = state->input;
+
+	switch(key)
+	{
+		case ARG_KEY_SESSIONS:
+			arguments->sessions = (unsigned int)strtoul(arg, NULL, 10);
+			break;
+		case ARG_KEY_THREADS:
+			arguments->threads = (unsigned int)strtoul(arg, NULL, 10);
+			break;
+		case ARG_KEY_NO_POOL:
+			arguments->no_pool = true;
+			break;
+		case ARG_KEY_BITRATE:
+			arguments->bitrate = strtoul(arg, NULL, 10);
+			break;
+		case ARG_KEY_DURATION:
+			arguments->duration = strtoul(arg, NULL, 10);
+			break;
+		case ARGP_KEY_ARG:
+			argp_usage(state);
+			break;
+		default:
+			return ARGP_ERR_UNKNOWN;
+	}
+
+	return 0;
+}
+
+static struct argp argp = { options, parse_opt, NULL, doc, 0, 0, 0 };
+
+#define PACKET_SIZE 1400 // payload of a typical av packet
+#define FEEDBACK_SIZE 32 // what the client encrypts itself, every tick
+
+typedef struct bench_t Bench;
+
+typedef struct bench_session_t
+{
+	Bench *bench;
+	ChiakiGKCrypt *gkcrypt_local;
+	ChiakiGKCrypt *gkcrypt_remote;
+	ChiakiThread thread;
+	uint64_t bytes;
+} BenchSession;
+
+struct bench_t
+{
+	ChiakiMutex mutex;
+	ChiakiCond cond;
+	bool stop;
+	double bytes_per_us;
+};
+
+/**
+ * Stands in for the takion receive thread of a session: pulls key stream at the rate packets would arrive.
+ */
+static void *session_thread_func(void *user)
+{
+	BenchSession *session = user;
+	Bench *bench = session->bench;
+	uint8_t buf[PACKET_SIZE];
+	uint64_t key_pos_remote = 0;
+	uint64_t key_pos_local = 0;
+	uint64_t start = chiaki_time_now_monotonic_us();
+
+	chiaki_mutex_lock(&bench->mutex);
+	while(!bench->stop)
+	{
+		chiaki_mutex_unlock(&bench->mutex);
+		uint64_t due = (uint64_t)((double)(chiaki_time_now_monotonic_us() - start) * bench->bytes_per_us);
+		while(session->bytes + PACKET_SIZE <= due)
+		{
+			chiaki_gkcrypt_get_key_stream(session->gkcrypt_remote, key_pos_remote, buf, PACKET_SIZE);
+			key_pos_remote += PACKET_SIZE;
+			session->bytes += PACKET_SIZE;
+		}
+		chiaki_gkcrypt_get_key_stream(session->gkcrypt_local, key_pos_local, buf, FEEDBACK_SIZE);
+		key_pos_local += FEEDBACK_SIZE;
+		chiaki_mutex_lock(&bench->mutex);
+		if(!bench->stop)
+			chiaki_cond_timedwait(&bench->cond, &bench->mutex, 1);
+	}
+	chiaki_mutex_unlock(&bench->mutex);
+	return NULL;
+}
+
+static double cpu_time_s()
+{
+#ifdef _WIN32
+	return 0.0;
+#else
+	struct rusage usage;
+	if(getrusage(RUSAGE_SELF, &usage) < 0)
+		return 0.0;
+	return (double)(usage.ru_utime.tv_sec + usage.ru_stime.tv_sec)
+		+ (double)(usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+#endif
+}
+
+CHIAKI_EXPORT int chiaki_cli_cmd_pool_bench(ChiakiLog *log, int argc, char *argv[])
+{
+	Arguments arguments = { 0 };
+	arguments.sessions = 4;
+	arguments.bitrate = 30000;
+	arguments.duration = 5;
+	error_t argp_r = argp_parse(&argp, argc, argv, ARGP_IN_ORDER, NULL, &arguments);
+	if(argp_r != 0)
+		return 1;
+	if(!arguments.sessions)
+		return 1;
+
+	// every miss would be logged as a warning otherwise, they are counted below
+	ChiakiLog quiet_log;
+	chiaki_log_init(&quiet_log, CHIAKI_LOG_ERROR, log->cb, log->user);
+
+	int r = 1;
+	ChiakiMetrics *metrics = chiaki_metrics_new();
+	if(!metrics)
+		return 1;
+	BenchSession *sessions = calloc(arguments.sessions, sizeof(BenchSession));
+	if(!sessions)
+		goto error_metrics;
+
+	ChiakiWorkerPool *pool = NULL;
+	if(!arguments.no_pool)
+	{
+		pool = chiaki_worker_pool_new(&quiet_log, arguments.threads);
+		if(!pool)
+			goto error_sessions;
+	}
+
+	Bench bench;
+	bench.stop = false;
+	bench.bytes_per_us = (double)arguments.bitrate * 1000.0 / 8.0 / 1e6;
+	chiaki_mutex_init(&bench.mutex, false);
+	chiaki_cond_init(&bench.cond);
+
+	uint8_t handshake_key[CHIAKI_HANDSHAKE_KEY_SIZE];
+	uint8_t ecdh_secret[CHIAKI_ECDH_SECRET_SIZE];
+	memset(handshake_key, 0x42, sizeof(handshake_key));
+	memset(ecdh_secret, 0x23, sizeof(ecdh_secret));
+
+	unsigned int created = 0;
+	unsigned int running = 0;
+	uint64_t start = chiaki_time_now_monotonic_ms();
+	double cpu_start = cpu_time_s();
+	for(; created < arguments.sessions; created++)
+	{
+		BenchSession *session = &sessions[created];
+		session->bench = &bench;
+		session->gkcrypt_local = chiaki_gkcrypt_new(&quiet_log, CHIAKI_GKCRYPT_KEY_BUF_BLOCKS_DEFAULT, pool, 2, handshake_key, ecdh_secret);
+		session->gkcrypt_remote = chiaki_gkcrypt_new(&quiet_log, CHIAKI_GKCRYPT_KEY_BUF_BLOCKS_DEFAULT, pool, 3, handshake_key, ecdh_secret);
+		if(!session->gkcrypt_local || !session->gkcrypt_remote)
+		{
+			CHIAKI_LOGE(log, "Failed to create key streams for session %u", created);
+			chiaki_gkcrypt_free(session->gkcrypt_local);
+			chiaki_gkcrypt_free(session->gkcrypt_remote);
+			goto error_run;
+		}
+		session->gkcrypt_local->metrics = metrics;
+		session->gkcrypt_remote->metrics = metrics;
+	}
+
+	// the key buffers are filled in the background first, only the steady state is measured
+	chiaki_mutex_lock(&bench.mutex);
+	chiaki_cond_timedwait(&bench.cond, &bench.mutex, 500);
+	chiaki_mutex_unlock(&bench.mutex);
+	chiaki_metrics_reset(metrics);
+
+	cpu_start = cpu_time_s();
+	start = chiaki_time_now_monotonic_ms();
+	for(; running < created; running++)
+	{
+		if(chiaki_thread_create(&sessions[running].thread, session_thread_func, &sessions[running]) != CHIAKI_ERR_SUCCESS)
+		{
+			CHIAKI_LOGE(log, "Failed to create thread for session %u", running);
+			goto error_run;
+		}
+	}
+
+	chiaki_mutex_lock(&bench.mutex);
+	uint64_t end = start + arguments.duration * 1000;
+	for(uint64_t now = start; now < end; now = chiaki_time_now_monotonic_ms())
+		chiaki_cond_timedwait(&bench.cond, &bench.mutex, end - now);
+	chiaki_mutex_unlock(&bench.mutex);
+	r = 0;
+
+error_run:
+	chiaki_mutex_lock(&bench.mutex);
+	bench.stop = true;
+	chiaki_mutex_unlock(&bench.mutex);
+	chiaki_cond_broadcast(&bench.cond);
+	for(unsigned int i=0; i<running; i++)
+		chiaki_thread_join(&sessions[i].thread, NULL);
+	double elapsed_s = (double)(chiaki_time_now_monotonic_ms() - start) / 1000.0;
+	double cpu_s = cpu_time_s() - cpu_start;
+
+	if(r == 0)
+	{
+		ChiakiMetricsSnapshot snapshot;
+		chiaki_metrics_snapshot(metrics, &snapshot);
+		uint64_t bytes = 0;
+		for(unsigned int i=0; i<created; i++)
+			bytes += sessions[i].bytes;
+		unsigned int background_threads = pool ? chiaki_worker_pool_thread_count(pool) : created * 2;
+		printf("%u sessions at %lu kbps, %s: %u background threads on %u cores\n",
+				created, arguments.bitrate, pool ? "shared pool" : "own threads",
+				background_threads, chiaki_worker_pool_cpu_count());
+		printf("    received: %.1f Mbps per session\n",
+				(double)bytes * 8.0 / 1e6 / elapsed_s / created);
+		printf("    key stream misses: %.0f\n", snapshot.values[CHIAKI_METRIC_KEYSTREAM_MISSES].value);
+		printf("    cpu: %.2f s in %.2f s (%.1f%% of a core)\n", cpu_s, elapsed_s, cpu_s / elapsed_s * 100.0);
+	}
+
+	for(unsigned int i=0; i<created; i++)
+	{
+		chiaki_gkcrypt_free(sessions[i].gkcrypt_local);
+		chiaki_gkcrypt_free(sessions[i].gkcrypt_remote);
+	}
+	chiaki_cond_fini(&bench.cond);
+	chiaki_mutex_fini(&bench.mutex);
+	chiaki_worker_pool_free(pool);
+error_sessions:
+	free(sessions);
+error_metrics:
+	chiaki_metrics_free(metrics);
+	return r;
+}
@@ -0,0 +1,1080 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#include <chiaki-cli.h>
+
+#include <chiaki/config.h>
+#include <chiaki/session.h>
+#include <chiaki/metrics.h>
+#include <chiaki/thread.h>
+#include <chiaki/time.h>
+#include <chiaki/workerpool.h>
+
+#if CHIAKI_LIB_ENABLE_FFMPEG_DECODER
+#include <chiaki/ffmpegdecoder.h>
+#include <chiaki/recorder.h>
+#include <libavutil/imgutils.h>
+#include <libavutil/pixdesc.h>
+#endif
+
+#include <argp.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <io.h>
+struct iovec
+{
+	void *iov_base;
+	size_t iov_len;
+};
+#else
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#endif
+
+static char doc[] =
+	"Stream from a registered console without any GUI and write the video to a file or pipe."
+	"\v"
+	"Formats:\n"
+	"  raw     The elementary H.264/H.265 stream as received, Annex B.\n"
+#if CHIAKI_LIB_ENABLE_FFMPEG_DECODER
+	"  mkv     Video and audio copied into Matroska, without decoding.\n"
+	"  mp4     Video and audio copied into fragmented MP4, without decoding.\n"
+	"  frames  Decoded frames in the decoder's pixel format, planes one after another,\n"
+	"          without padding. Size and format are logged when they change.\n"
+#endif
+	"\n"
+	"The credentials file has one key=value per line, lines starting with # are ignored:\n"
+	"  host=192.168.1.2      optional, --host takes precedence\n"
+	"  target=ps5            ps4 or ps5 (default: ps4)\n"
+	"  regist_key=a1b2c3d4   as shown after registration\n"
+	"  rp_key=<32 hex digits>\n"
+	"\n"
+	"Give --credentials several times to stream from several consoles at once, each to the --output\n"
+	"in the same position. --pool lets these sessions share the threads for their background work.\n"
+	"With several sessions, the metrics port is counted up by one and the stats file gets the number\n"
+	"of the session appended for every session after the first.\n";
+
+#define ARG_KEY_HOST 'h'
+#define ARG_KEY_CREDENTIALS 'c'
+#define ARG_KEY_OUTPUT 'o'
+#define ARG_KEY_FORMAT 'f'
+#define ARG_KEY_RESOLUTION 'r'
+#define ARG_KEY_FPS 'F'
+#define ARG_KEY_DURATION 'd'
+#define ARG_KEY_STATS 's'
+#define ARG_KEY_CODEC 0x100
+#define ARG_KEY_BITRATE 0x101
+#define ARG_KEY_PIN 0x102
+#define ARG_KEY_METRICS_PORT 0x103
+#define ARG_KEY_POOL 0x104
+
+#define STREAM_SESSIONS_MAX 16
+
+static struct argp_option options[] = {
+	{ "host", ARG_KEY_HOST, "Host", 0, "Host to connect to, if not in the credentials file", 0 },
+	{ "credentials", ARG_KEY_CREDENTIALS, "File", 0, "Registration of the console, see below, may be given several times", 0 },
+	{ "output", ARG_KEY_OUTPUT, "Path", 0, "File or pipe to write to, - for stdout (default: -), once for every --credentials", 0 },
+	{ "format", ARG_KEY_FORMAT, "Format", 0, "raw"
+#if CHIAKI_LIB_ENABLE_FFMPEG_DECODER
+		", mkv, mp4 or frames (default: from the extension of the output, else raw)"
+#endif
+		, 0 },
+	{ "resolution", ARG_KEY_RESOLUTION, "Height", 0, "360, 540, 720 or 1080 (default: 720)", 0 },
+	{ "fps", ARG_KEY_FPS, "FPS", 0, "30 or 60 (default: 60)", 0 },
+	{ "codec", ARG_KEY_CODEC, "Codec", 0, "h264, h265 or h265-hdr, PS5 only for h265 (default: h264)", 0 },
+	{ "bitrate", ARG_KEY_BITRATE, "kbps", 0, "Video bitrate (default: from the resolution)", 0 },
+	{ "duration", ARG_KEY_DURATION, "Seconds", 0, "Stop after this long, 0 to run until interrupted (default: 0)", 0 },
+	{ "pin", ARG_KEY_PIN, "PIN", 0, "Login PIN, if the console asks for one", 0 },
+	{ "stats", ARG_KEY_STATS, "File", 0, "Append the session metrics as JSON lines every second and a summary at the end", 0 },
+	{ "metrics-port", ARG_KEY_METRICS_PORT, "Port", 0, "Serve the session metrics for Prometheus on 127.0.0.1", 0 },
+	{ "pool", ARG_KEY_POOL, "Threads", 0, "Run the background work of all sessions on a shared worker pool, 0 for one thread per core", 0 },
+	{ 0 }
+};
+
+typedef enum stream_format_t
+{
+	STREAM_FORMAT_AUTO,
+	STREAM_FORMAT_RAW,
+#if CHIAKI_LIB_ENABLE_FFMPEG_DECODER
+	STREAM_FORMAT_MKV,
+	STREAM_FORMAT_MP4,
+	STREAM_FORMAT_FRAMES
+#endif
+} StreamFormat;
+
+typedef struct arguments
+{
+	const char *host;
+	const char *credentials[STREAM_SESSIONS_MAX];
+	size_t credentials_count;
+	const char *outputs[STREAM_SESSIONS_MAX];
+	size_t outputs_count;
+	StreamFormat format;
+	ChiakiVideoResolutionPreset resolution;
+	ChiakiVideoFPSPreset fps;
+	ChiakiCodec codec;
+	unsigned int bitrate;
+	unsigned long duration_s;
+	const char *pin;
+	const char *stats;
+	uint16_t metrics_port;
+	bool pool;
+	unsigned int pool_threads;
+} Arguments;
+
+static int parse_opt(int key, char *arg, struct argp_state *state)
+{
+	Arguments *arguments = state->input;
+
+	switch(key)
+	{
+		case ARG_KEY_HOST:
+			arguments->host = arg;
+			break;
+		case ARG_KEY_CREDENTIALS:
+			if(arguments->credentials_count == STREAM_SESSIONS_MAX)
+				argp_error(state, "At most %d sessions are supported", STREAM_SESSIONS_MAX);
+			arguments->credentials[arguments->credentials_count++] = arg;
+			break;
+		case ARG_KEY_OUTPUT:
+			if(arguments->outputs_count == STREAM_SESSIONS_MAX)
+				argp_error(state, "At most %d sessions are supported", STREAM_SESSIONS_MAX);
+			arguments->outputs[arguments->outputs_count++] = arg;
+			break;
+		case ARG_KEY_FORMAT:
+			if(strcmp(arg, "raw") == 0)
+				arguments->format = STREAM_FORMAT_RAW;
+#if CHIAKI_LIB_ENABLE_FFMPEG_DECODER
+			else if(strcmp(arg, "mkv") == 0)
+				arguments->format = STREAM_FORMAT_MKV;
+			else if(strcmp(arg, "mp4") == 0)
+				arguments->format = STREAM_FORMAT_MP4;
+			else if(strcmp(arg, "frames") == 0)
+				arguments->format = STREAM_FORMAT_FRAMES;
+#endif
+			else
+				argp_error(state, "Unknown format \"%s\"", arg);
+			break;
+		case ARG_KEY_RESOLUTION:
+			if(strcmp(arg, "360") == 0 || strcmp(arg, "360p") == 0)
+				arguments->resolution = CHIAKI_VIDEO_RESOLUTION_PRESET_360p;
+			else if(strcmp(arg, "540") == 0 || strcmp(arg, "540p") == 0)
+				arguments->resolution = CHIAKI_VIDEO_RESOLUTION_PRESET_540p;
+			else if(strcmp(arg, "720") == 0 || strcmp(arg, "720p") == 0)
+				arguments->resolution = CHIAKI_VIDEO_RESOLUTION_PRESET_720p;
+			else if(strcmp(arg, "1080") == 0 || strcmp(arg, "1080p") == 0)
+				arguments->resolution = CHIAKI_VIDEO_RESOLUTION_PRESET_1080p;
+			else
+				argp_error(state, "Unsupported resolution \"%s\"", arg);
+			break;
+		case ARG_KEY_FPS:
+			if(strcmp(arg, "30") == 0)
+				arguments->fps = CHIAKI_VIDEO_FPS_PRESET_30;
+			else if(strcmp(arg, "60") == 0)
+				arguments->fps = CHIAKI_VIDEO_FPS_PRESET_60;
+			else
+				argp_error(state, "Unsupported fps \"%s\"", arg);
+			break;
+		case ARG_KEY_CODEC:
+			if(strcmp(arg, "h264") == 0)
+				arguments->codec = CHIAKI_CODEC_H264;
+			else if(strcmp(arg, "h265") == 0)
+				arguments->codec = CHIAKI_CODEC_H265;
+			else if(strcmp(arg, "h265-hdr") == 0)
+				arguments->codec = CHIAKI_CODEC_H265_HDR;
+			else
+				argp_error(state, "Unknown codec \"%s\"", arg);
+			break;
+		case ARG_KEY_BITRATE:
+			arguments->bitrate = (unsigned int)strtoul(arg, NULL, 10);
+			break;
+		case ARG_KEY_DURATION:
+			arguments->duration_s = strtoul(arg, NULL, 10);
+			break;
+		case ARG_KEY_PIN:
+			arguments->pin = arg;
+			break;
+		case ARG_KEY_STATS:
+			arguments->stats = arg;
+			break;
+		case ARG_KEY_METRICS_PORT:
+			arguments->metrics_port = (uint16_t)strtoul(arg, NULL, 10);
+			break;
+		case ARG_KEY_POOL:
+			arguments->pool = true;
+			arguments->pool_threads = (unsigned int)strtoul(arg, NULL, 10);
+			break;
+		case ARGP_KEY_ARG:
+			argp_usage(state);
+			break;
+		default:
+			return ARGP_ERR_UNKNOWN;
+	}
+
+	return 0;
+}
+
+static struct argp argp = { options, parse_opt, NULL, doc, 0, 0, 0 };
+
+typedef struct credentials_t
+{
+	char host[256];
+	bool ps5;
+	char regist_key[CHIAKI_SESSION_AUTH_SIZE];
+	uint8_t morning[0x10];
+	bool regist_key_set;
+	bool morning_set;
+} Credentials;
+
+static bool parse_hex(const char *str, uint8_t *buf, size_t buf_size)
+{
+	if(strlen(str) != buf_size * 2)
+		return false;
+	for(size_t i = 0; i < buf_size; i++)
+	{
+		unsigned int v;
+		if(!isxdigit((unsigned char)str[i * 2]) || !isxdigit((unsigned char)str[i * 2 + 1])
+				|| sscanf(str + i * 2, "%2x", &v) != 1)
+			return false;
+		buf[i] = (uint8_t)v;
+	}
+	return true;
+}
+
+static char *strip(char *str)
+{
+	while(isspace((unsigned char)*str))
+		str++;
+	char *end = str + strlen(str);
+	while(end > str && isspace((unsigned char)end[-1]))
+		end--;
+	*end = '\0';
+	return str;
+}
+
+static bool read_credentials(const char *path, Credentials *creds)
+{
+	memset(creds, 0, sizeof(*creds));
+	FILE *f = fopen(path, "r");
+	if(!f)
+	{
+		fprintf(stderr, "Failed to open credentials file %s: %s\n", path, strerror(errno));
+		return false;
+	}
+
+	bool success = true;
+	char line[512];
+	unsigned int line_nr = 0;
+	while(fgets(line, sizeof(line), f))
+	{
+		line_nr++;
+		char *l = strip(line);
+		if(!*l || *l == '#')
+			continue;
+		char *eq = strchr(l, '=');
+		if(!eq)
+		{
+			fprintf(stderr, "%s:%u: expected key=value\n", path, line_nr);
+			success = false;
+			break;
+		}
+		*eq = '\0';
+		char *key = strip(l);
+		char *value = strip(eq + 1);
+
+		if(strcmp(key, "host") == 0)
+			snprintf(creds->host, sizeof(creds->host), "%s", value);
+		else if(strcmp(key, "target") == 0)
+		{
+			if(strcmp(value, "ps5") == 0)
+				creds->ps5 = true;
+			else if(strcmp(value, "ps4") == 0)
+				creds->ps5 = false;
+			else
+			{
+				fprintf(stderr, "%s:%u: target must be ps4 or ps5\n", path, line_nr);
+				success = false;
+				break;
+			}
+		}
+		else if(strcmp(key, "regist_key") == 0)
+		{
+			size_t len = strlen(value);
+			if(!len || len > sizeof(creds->regist_key))
+			{
+				fprintf(stderr, "%s:%u: regist_key must be 1 to %zu characters\n", path, line_nr, sizeof(creds->regist_key));
+				success = false;
+				break;
+			}
+			memset(creds->regist_key, 0, sizeof(creds->regist_key));
+			memcpy(creds->regist_key, value, len);
+			creds->regist_key_set = true;
+		}
+		else if(strcmp(key, "rp_key") == 0)
+		{
+			if(!parse_hex(value, creds->morning, sizeof(creds->morning)))
+			{
+				fprintf(stderr, "%s:%u: rp_key must be %zu hex digits\n", path, line_nr, sizeof(creds->morning) * 2);
+				success = false;
+				break;
+			}
+			creds->morning_set = true;
+		}
+		else
+			fprintf(stderr, "%s:%u: ignoring unknown key \"%s\"\n", path, line_nr, key);
+	}
+	fclose(f);
+
+	if(success && (!creds->regist_key_set || !creds->morning_set))
+	{
+		fprintf(stderr, "Credentials file %s must contain regist_key and rp_key\n", path);
+		success = false;
+	}
+	return success;
+}
+
+typedef struct stream_t
+{
+	ChiakiLog *log;
+	Credentials creds;
+	const char *host;
+	const char *output;
+	const char *stats;
+	char stats_buf[1024];
+	uint16_t metrics_port;
+	ChiakiSession session;
+	bool session_initialized;
+	bool session_started;
+	uint64_t start_ms;
+	StreamFormat format;
+	int fd;
+	bool close_fd;
+	ChiakiMetricsExporter metrics_exporter;
+	bool metrics_exporter_started;
+
+	// shared by all streams, so one thread can wait for any of them
+	ChiakiMutex *mutex;
+	ChiakiCond *cond;
+	bool stopping;
+	bool quit;
+	ChiakiQuitReason quit_reason;
+	char quit_reason_str[256];
+	bool connected;
+	uint64_t connected_us;
+	bool login_pin_requested;
+	bool login_pin_incorrect;
+	bool output_failed;
+	bool startup_received;
+	ChiakiStartupTimeline startup;
+
+	// only touched by the thread writing to fd
+	uint64_t units_written;
+	uint64_t bytes_written;
+
+#if CHIAKI_LIB_ENABLE_FFMPEG_DECODER
+	ChiakiFfmpegDecoder decoder;
+	bool decoder_initialized;
+	ChiakiRecorder *recorder;
+	int frame_width;
+	int frame_height;
+	int frame_format;
+	struct iovec *iov;
+	size_t iov_size;
+#endif
+} Stream;
+
+static volatile sig_atomic_t stop_requested = 0;
+
+static void stop_signal_handler(int sig)
+{
+	(void)sig;
+	stop_requested = 1;
+}
+
+static void output_fail(Stream *stream, const char *what, const char *reason)
+{
+	chiaki_mutex_lock(stream->mutex);
+	bool first = !stream->output_failed;
+	stream->output_failed = true;
+	chiaki_mutex_unlock(stream->mutex);
+	chiaki_cond_signal(stream->cond);
+	if(first)
+		CHIAKI_LOGE(stream->log, "Writing %s failed: %s", what, reason);
+}
+
+/**
+ * Write all of iov in as few syscalls as possible, straight from the buffers of the caller.
+ * @return false if the output is gone, e.g. the reading end of a pipe was closed
+ */
+static bool output_write(Stream *stream, struct iovec *iov, size_t iovcnt)
+{
+	while(iovcnt)
+	{
+#ifdef _WIN32
+		int r = _write(stream->fd, iov->iov_base, (unsigned int)iov->iov_len);
+#else
+		ssize_t r = writev(stream->fd, iov, iovcnt > IOV_MAX ? IOV_MAX : (int)iovcnt);
+#endif
+		if(r < 0)
+		{
+			if(errno == EINTR)
+				continue;
+			return false;
+		}
+		stream->bytes_written += (uint64_t)r;
+		// skip what was written completely, the rest of a partially written one is retried
+		size_t written = (size_t)r;
+		while(iovcnt && written >= iov->iov_len)
+		{
+			written -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if(iovcnt)
+		{
+			iov->iov_base = (uint8_t *)iov->iov_base + written;
+			iov->iov_len -= written;
+		}
+	}
+	return true;
+}
+
+static bool video_sample_raw_cb(uint8_t *buf, size_t buf_size, int32_t frames_lost, bool frame_recovered, void *user)
+{
+	(void)frames_lost;
+	(void)frame_recovered;
+	Stream *stream = user;
+	struct iovec iov = { buf, buf_size };
+	if(!output_write(stream, &iov, 1))
+		output_fail(stream, "video", strerror(errno));
+	else
+		stream->units_written++;
+	// a failed write is not the console's fault, so never report it as a corrupt frame
+	return true;
+}
+
+#if CHIAKI_LIB_ENABLE_FFMPEG_DECODER
+static bool video_sample_recorded_cb(uint8_t *buf, size_t buf_size, int32_t frames_lost, bool frame_recovered, void *user)
+{
+	// the recorder gets the frames directly from the video receiver, only whether it still writes them is checked here
+	(void)buf;
+	(void)buf_size;
+	(void)frames_lost;
+	(void)frame_recovered;
+	Stream *stream = user;
+	ChiakiRecorderStats stats;
+	chiaki_recorder_get_stats(stream->recorder, &stats);
+	if(stats.failed)
+		output_fail(stream, "recording", "the recorder gave up");
+	return true;
+}
+
+static void decode_feedback_cb(uint64_t sample, bool success, void *user)
+{
+	chiaki_session_video_sample_decoded(user, sample, success);
+}
+
+/**
+ * Write the visible part of every plane, one iovec per plane if its rows are contiguous, else one per row.
+ */
+static bool write_frame(Stream *stream, const AVFrame *frame)
+{
+	const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(frame->format);
+	if(!desc || (desc->flags & (AV_PIX_FMT_FLAG_HWACCEL | AV_PIX_FMT_FLAG_BITSTREAM | AV_PIX_FMT_FLAG_PAL)))
+	{
+		CHIAKI_LOGE(stream->log, "Decoded frames have a pixel format that can't be written");
+		errno = EINVAL;
+		return false;
+	}
+
+	if(frame->width != stream->frame_width || frame->height != stream->frame_height || frame->format != stream->frame_format)
+	{
+		stream->frame_width = frame->width;
+		stream->frame_height = frame->height;
+		stream->frame_format = frame->format;
+		CHIAKI_LOGI(stream->log, "Writing frames of %dx%d %s", frame->width, frame->height, desc->name);
+	}
+
+	int planes = av_pix_fmt_count_planes(frame->format);
+	size_t iov_needed = 0;
+	for(int i = 0; i < planes; i++)
+		iov_needed += (size_t)frame->height;
+	if(iov_needed > stream->iov_size)
+	{
+		struct iovec *iov = realloc(stream->iov, iov_needed * sizeof(struct iovec));
+		if(!iov)
+		{
+			errno = ENOMEM;
+			return false;
+		}
+		stream->iov = iov;
+		stream->iov_size = iov_needed;
+	}
+
+	size_t iovcnt = 0;
+	for(int i = 0; i < planes; i++)
+	{
+		bool chroma = (i == 1 || i == 2) && !(desc->flags & AV_PIX_FMT_FLAG_RGB);
+		int height = chroma ? AV_CEIL_RSHIFT(frame->height, desc->log2_chroma_h) : frame->height;
+		int row_size = av_image_get_linesize(frame->format, frame->width, i);
+		if(row_size <= 0)
+		{
+			errno = EINVAL;
+			return false;
+		}
+		if(frame->linesize[i] == row_size)
+		{
+			stream->iov[iovcnt].iov_base = frame->data[i];
+			stream->iov[iovcnt].iov_len = (size_t)row_size * (size_t)height;
+			iovcnt++;
+			continue;
+		}
+		for(int y = 0; y < height; y++)
+		{
+			stream->iov[iovcnt].iov_base = frame->data[i] + (ptrdiff_t)y * frame->linesize[i];
+			stream->iov[iovcnt].iov_len = (size_t)row_size;
+			iovcnt++;
+		}
+	}
+	return output_write(stream, stream->iov, iovcnt);
+}
+
+static void frame_available_cb(ChiakiFfmpegDecoder *decoder, void *user)
+{
+	Stream *stream = user;
+	chiaki_mutex_lock(stream->mutex);
+	bool failed = stream->output_failed;
+	chiaki_mutex_unlock(stream->mutex);
+
+	int32_t frames_lost;
+	AVFrame *frame = chiaki_ffmpeg_decoder_pull_frame(decoder, &frames_lost);
+	if(!frame)
+		return;
+	if(failed)
+		goto beach;
+
+	if(!write_frame(stream, frame))
+		output_fail(stream, "frame", strerror(errno));
+	else
+		stream->units_written++;
+
+beach:
+	chiaki_ffmpeg_frame_free(&frame);
+}
+#endif
+
+static void event_cb(ChiakiEvent *event, void *user)
+{
+	Stream *stream = user;
+	switch(event->type)
+	{
+		case CHIAKI_EVENT_CONNECTED:
+			CHIAKI_LOGI(stream->log, "Connected to %s", stream->host);
+			chiaki_mutex_lock(stream->mutex);
+			stream->connected = true;
+			stream->connected_us = chiaki_time_now_monotonic_us();
+			chiaki_mutex_unlock(stream->mutex);
+			break;
+		case CHIAKI_EVENT_LOGIN_PIN_REQUEST:
+			chiaki_mutex_lock(stream->mutex);
+			stream->login_pin_requested = true;
+			stream->login_pin_incorrect = event->login_pin_request.pin_incorrect;
+			chiaki_mutex_unlock(stream->mutex);
+			chiaki_cond_signal(stream->cond);
+			break;
+		case CHIAKI_EVENT_STARTUP_TIMELINE:
+			chiaki_mutex_lock(stream->mutex);
+			stream->startup_received = true;
+			stream->startup = event->startup_timeline;
+			chiaki_mutex_unlock(stream->mutex);
+			break;
+		case CHIAKI_EVENT_QUIT:
+			chiaki_mutex_lock(stream->mutex);
+			stream->quit = true;
+			stream->quit_reason = event->quit.reason;
+			snprintf(stream->quit_reason_str, sizeof(stream->quit_reason_str), "%s",
+					event->quit.reason_str ? event->quit.reason_str : "");
+			chiaki_mutex_unlock(stream->mutex);
+			chiaki_cond_signal(stream->cond);
+			break;
+		default:
+			break;
+	}
+}
+
+static bool open_output(Stream *stream, const char *path)
+{
+	if(strcmp(path, "-") == 0)
+	{
+		stream->fd = 1;
+		stream->close_fd = false;
+	}
+	else
+	{
+#ifdef _WIN32
+		stream->fd = _open(path, _O_WRONLY | _O_CREAT | _O_TRUNC | _O_BINARY, 0644);
+#else
+		stream->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+#endif
+		if(stream->fd < 0)
+		{
+			fprintf(stderr, "Failed to open %s: %s\n", path, strerror(errno));
+			return false;
+		}
+		stream->close_fd = true;
+	}
+
+#if defined(__linux__) && defined(F_SETPIPE_SZ)
+	// a bigger pipe buffer lets a slow reader lag a few frames behind without blocking the session
+	struct stat st;
+	if(fstat(stream->fd, &st) == 0 && S_ISFIFO(st.st_mode))
+		fcntl(stream->fd, F_SETPIPE_SZ, 1024 * 1024);
+#endif
+	return true;
+}
+
+static void append_summary(Stream *stream, const char *path, uint64_t duration_ms)
+{
+	FILE *f = fopen(path, "a");
+	if(!f)
+	{
+		CHIAKI_LOGE(stream->log, "Failed to open %s for the summary: %s", path, strerror(errno));
+		return;
+	}
+	fprintf(f, "{\"summary\":true,\"host\":\"%s\",\"quit_reason\":\"%s\",\"connected\":%s,\"duration_ms\":%llu,\"units_written\":%llu,\"bytes_written\":%llu,\"output_failed\":%s",
+			stream->host,
+			chiaki_quit_reason_string(stream->quit_reason),
+			stream->connected ? "true" : "false",
+			(unsigned long long)duration_ms,
+			(unsigned long long)stream->units_written,
+			(unsigned long long)stream->bytes_written,
+			stream->output_failed ? "true" : "false");
+	if(stream->startup_received)
+	{
+		fprintf(f, ",\"startup\":{\"complete\":%s,\"total_us\":%llu",
+				stream->startup.complete ? "true" : "false",
+				(unsigned long long)stream->startup.total_us);
+		for(size_t i=0; i<CHIAKI_STARTUP_PHASE_COUNT; i++)
+			fprintf(f, ",\"%s_us\":%llu", chiaki_startup_phase_string((ChiakiStartupPhase)i),
+					(unsigned long long)stream->startup.phase_us[i]);
+		fprintf(f, "}");
+	}
+#if CHIAKI_LIB_ENABLE_FFMPEG_DECODER
+	if(stream->recorder)
+	{
+		ChiakiRecorderStats stats;
+		chiaki_recorder_get_stats(stream->recorder, &stats);
+		fprintf(f, ",\"recorder\":{\"failed\":%s,\"video_frames\":%llu,\"audio_frames\":%llu,\"bytes\":%llu,\"packets_dropped\":%llu}",
+				stats.failed ? "true" : "false",
+				(unsigned long long)stats.video_frames,
+				(unsigned long long)stats.audio_frames,
+				(unsigned long long)stats.bytes,
+				(unsigned long long)stats.packets_dropped);
+	}
+#endif
+	fprintf(f, "}\n");
+	fclose(f);
+}
+
+/**
+ * Open the output and start the session, everything done so far is cleaned up by stream_fini() if this fails.
+ */
+static bool stream_start(Stream *stream, const Arguments *arguments, ChiakiWorkerPool *pool)
+{
+	ChiakiLog *log = stream->log;
+	StreamFormat format = stream->format;
+
+#if CHIAKI_LIB_ENABLE_FFMPEG_DECODER
+	bool container = format == STREAM_FORMAT_MKV || format == STREAM_FORMAT_MP4;
+#else
+	bool container = false;
+#endif
+	// the recorder opens the output itself
+	if(!container && !open_output(stream, stream->output))
+		return false;
+
+	ChiakiConnectInfo connect_info;
+	memset(&connect_info, 0, sizeof(connect_info));
+	connect_info.ps5 = stream->creds.ps5;
+	connect_info.host = stream->host;
+	memcpy(connect_info.regist_key, stream->creds.regist_key, sizeof(connect_info.regist_key));
+	memcpy(connect_info.morning, stream->creds.morning, sizeof(connect_info.morning));
+	chiaki_connect_video_profile_preset(&connect_info.video_profile, arguments->resolution, arguments->fps);
+	connect_info.video_profile.codec = arguments->codec;
+	if(arguments->bitrate)
+		connect_info.video_profile.bitrate = arguments->bitrate;
+	connect_info.video_profile_auto_downgrade = true;
+	connect_info.enable_keyboard = false;
+	connect_info.enable_dualsense = false;
+	// nothing plays the audio, only the containers keep it
+	connect_info.audio_video_disabled = container ? CHIAKI_NONE_DISABLED : CHIAKI_AUDIO_DISABLED;
+	connect_info.auto_regist = false;
+	connect_info.holepunch_session = NULL;
+	connect_info.packet_loss_max = 0.05;
+	connect_info.worker_pool = pool;
+
+	ChiakiErrorCode err = chiaki_session_init(&stream->session, &connect_info, log);
+	if(err != CHIAKI_ERR_SUCCESS)
+	{
+		fprintf(stderr, "Session init for %s failed: %s\n", stream->host, chiaki_error_string(err));
+		return false;
+	}
+	stream->session_initialized = true;
+	chiaki_session_set_event_cb(&stream->session, event_cb, stream);
+
+	switch(format)
+	{
+#if CHIAKI_LIB_ENABLE_FFMPEG_DECODER
+		case STREAM_FORMAT_MKV:
+		case STREAM_FORMAT_MP4:
+		{
+			stream->recorder = chiaki_recorder_new(log, stream->session.metrics);
+			if(!stream->recorder)
+			{
+				fprintf(stderr, "Failed to create recorder\n");
+				return false;
+			}
+			// avio understands pipe:1 as stdout
+			const char *path = strcmp(stream->output, "-") == 0 ? "pipe:1" : stream->output;
+			err = chiaki_recorder_start(stream->recorder, path,
+					format == STREAM_FORMAT_MP4 ? CHIAKI_RECORDER_FORMAT_MP4 : CHIAKI_RECORDER_FORMAT_MKV);
+			if(err != CHIAKI_ERR_SUCCESS)
+			{
+				fprintf(stderr, "Failed to start recording: %s\n", chiaki_error_string(err));
+				return false;
+			}
+			chiaki_session_set_recorder(&stream->session, stream->recorder);
+			chiaki_session_set_video_sample_cb(&stream->session, video_sample_recorded_cb, stream);
+			break;
+		}
+		case STREAM_FORMAT_FRAMES:
+		{
+			ChiakiFfmpegDecoderOptions decoder_options;
+			chiaki_ffmpeg_decoder_options_default(&decoder_options);
+			decoder_options.threading = CHIAKI_FFMPEG_DECODER_THREADING_SLICE;
+			err = chiaki_ffmpeg_decoder_init(&stream->decoder, log, arguments->codec, NULL, NULL,
+					frame_available_cb, stream, &decoder_options);
+			if(err != CHIAKI_ERR_SUCCESS)
+			{
+				fprintf(stderr, "Decoder init failed: %s\n", chiaki_error_string(err));
+				return false;
+			}
+			stream->decoder_initialized = true;
+			stream->decoder.metrics = stream->session.metrics;
+			chiaki_ffmpeg_decoder_set_feedback_cb(&stream->decoder, decode_feedback_cb, &stream->session);
+			chiaki_session_set_video_sample_cb(&stream->session, chiaki_ffmpeg_decoder_video_sample_cb, &stream->decoder);
+			break;
+		}
+#endif
+		default:
+			chiaki_session_set_video_sample_cb(&stream->session, video_sample_raw_cb, stream);
+			break;
+	}
+
+	if(stream->stats || stream->metrics_port)
+	{
+		char labels[300];
+		snprintf(labels, sizeof(labels), "host=\"%s\"", stream->host);
+		err = chiaki_metrics_exporter_start(&stream->metrics_exporter, log, stream->session.metrics, stream->metrics_port,
+				stream->stats, 1000, labels);
+		if(err == CHIAKI_ERR_SUCCESS)
+			stream->metrics_exporter_started = true;
+		else
+			CHIAKI_LOGW(log, "Failed to start metrics exporter: %s", chiaki_error_string(err));
+	}
+
+	stream->start_ms = chiaki_time_now_monotonic_ms();
+	err = chiaki_session_start(&stream->session);
+	if(err != CHIAKI_ERR_SUCCESS)
+	{
+		fprintf(stderr, "Session start for %s failed: %s\n", stream->host, chiaki_error_string(err));
+		return false;
+	}
+	stream->session_started = true;
+	return true;
+}
+
+/**
+ * Answer a login PIN request or stop the session if it should not go on anymore.
+ * Must be called with stream->mutex locked, which is released while calling into the session.
+ */
+static void stream_check(Stream *stream, const char *pin, unsigned long duration_s)
+{
+	if(stream->stopping)
+		return;
+
+	if(stream->login_pin_requested)
+	{
+		stream->login_pin_requested = false;
+		if(pin && !stream->login_pin_incorrect)
+		{
+			chiaki_mutex_unlock(stream->mutex);
+			chiaki_session_set_login_pin(&stream->session, (const uint8_t *)pin, strlen(pin));
+			chiaki_mutex_lock(stream->mutex);
+			return;
+		}
+		CHIAKI_LOGE(stream->log, stream->login_pin_incorrect ? "Login PIN was incorrect" : "Console requires a login PIN, pass it with --pin");
+	}
+	else if(stop_requested)
+		CHIAKI_LOGI(stream->log, "Interrupted, stopping");
+	else if(stream->output_failed)
+		CHIAKI_LOGE(stream->log, "Output for %s is gone, stopping", stream->host);
+	else if(duration_s && stream->connected
+			&& chiaki_time_now_monotonic_us() - stream->connected_us >= (uint64_t)duration_s * 1000000)
+		CHIAKI_LOGI(stream->log, "Duration reached, stopping");
+	else
+		return;
+
+	stream->stopping = true;
+	chiaki_mutex_unlock(stream->mutex);
+	chiaki_session_stop(&stream->session);
+	chiaki_mutex_lock(stream->mutex);
+}
+
+static void stream_fini(Stream *stream)
+{
+	if(stream->metrics_exporter_started)
+		chiaki_metrics_exporter_stop(&stream->metrics_exporter);
+#if CHIAKI_LIB_ENABLE_FFMPEG_DECODER
+	if(stream->recorder)
+	{
+		chiaki_recorder_stop(stream->recorder);
+		// it may also give up on the frames still queued when stopping
+		ChiakiRecorderStats recorder_stats;
+		chiaki_recorder_get_stats(stream->recorder, &recorder_stats);
+		if(recorder_stats.failed)
+			stream->output_failed = true;
+	}
+#endif
+	// after the exporter stopped, so the summary is the last line
+	if(stream->stats && stream->start_ms)
+		append_summary(stream, stream->stats, chiaki_time_now_monotonic_ms() - stream->start_ms);
+#if CHIAKI_LIB_ENABLE_FFMPEG_DECODER
+	if(stream->decoder_initialized)
+	{
+		chiaki_ffmpeg_decoder_set_feedback_cb(&stream->decoder, NULL, NULL);
+		chiaki_ffmpeg_decoder_fini(&stream->decoder);
+	}
+#endif
+	if(stream->session_initialized)
+		chiaki_session_fini(&stream->session);
+#if CHIAKI_LIB_ENABLE_FFMPEG_DECODER
+	if(stream->recorder)
+		chiaki_recorder_free(stream->recorder);
+	free(stream->iov);
+#endif
+	if(stream->close_fd)
+#ifdef _WIN32
+		_close(stream->fd);
+#else
+		close(stream->fd);
+#endif
+}
+
+CHIAKI_EXPORT int chiaki_cli_cmd_stream(ChiakiLog *log, int ac, char *av[])
+{
+	Arguments arguments = { 0 };
+	arguments.resolution = CHIAKI_VIDEO_RESOLUTION_PRESET_720p;
+	arguments.fps = CHIAKI_VIDEO_FPS_PRESET_60;
+	arguments.codec = CHIAKI_CODEC_H264;
+	error_t argp_r = argp_parse(&argp, ac, av, ARGP_IN_ORDER, NULL, &arguments);
+	if(argp_r != 0)
+		return 1;
+
+	size_t streams_count = arguments.credentials_count;
+	if(!streams_count)
+	{
+		fprintf(stderr, "No credentials file specified.\n");
+		return 1;
+	}
+	if(streams_count > 1 && arguments.host)
+	{
+		fprintf(stderr, "--host can only be used with a single credentials file.\n");
+		return 1;
+	}
+	if(arguments.outputs_count > streams_count || (streams_count > 1 && arguments.outputs_count < streams_count))
+	{
+		fprintf(stderr, "Every credentials file needs exactly one output.\n");
+		return 1;
+	}
+	if(!arguments.outputs_count)
+		arguments.outputs[arguments.outputs_count++] = "-";
+	size_t stdout_count = 0;
+	for(size_t i=0; i<arguments.outputs_count; i++)
+	{
+		if(strcmp(arguments.outputs[i], "-") == 0)
+			stdout_count++;
+	}
+	if(stdout_count > 1)
+	{
+		fprintf(stderr, "Only one session can write to stdout.\n");
+		return 1;
+	}
+
+	Stream *streams = calloc(streams_count, sizeof(Stream));
+	if(!streams)
+		return 1;
+
+	int ret = 1;
+	for(size_t i=0; i<streams_count; i++)
+	{
+		Stream *stream = &streams[i];
+		stream->log = log;
+		stream->fd = -1;
+		stream->quit_reason = CHIAKI_QUIT_REASON_NONE;
+#if CHIAKI_LIB_ENABLE_FFMPEG_DECODER
+		stream->frame_format = AV_PIX_FMT_NONE;
+#endif
+		if(!read_credentials(arguments.credentials[i], &stream->creds))
+			goto error_streams;
+		stream->host = arguments.host ? arguments.host : stream->creds.host;
+		if(!*stream->host)
+		{
+			fprintf(stderr, "No host specified in %s.\n", arguments.credentials[i]);
+			goto error_streams;
+		}
+		if(!stream->creds.ps5 && arguments.codec != CHIAKI_CODEC_H264)
+		{
+			fprintf(stderr, "PS4 only supports h264.\n");
+			goto error_streams;
+		}
+		stream->output = arguments.outputs[i];
+
+		stream->format = arguments.format;
+		if(stream->format == STREAM_FORMAT_AUTO)
+		{
+			stream->format = STREAM_FORMAT_RAW;
+#if CHIAKI_LIB_ENABLE_FFMPEG_DECODER
+			const char *ext = strrchr(stream->output, '.');
+			if(ext && strcmp(ext, ".mkv") == 0)
+				stream->format = STREAM_FORMAT_MKV;
+			else if(ext && strcmp(ext, ".mp4") == 0)
+				stream->format = STREAM_FORMAT_MP4;
+#endif
+		}
+
+		if(arguments.stats && i)
+		{
+			snprintf(stream->stats_buf, sizeof(stream->stats_buf), "%s.%zu", arguments.stats, i);
+			stream->stats = stream->stats_buf;
+		}
+		else
+			stream->stats = arguments.stats;
+		stream->metrics_port = arguments.metrics_port ? (uint16_t)(arguments.metrics_port + i) : 0;
+	}
+
+	// written to from the receiving threads, a reader going away must not kill the process before the session is stopped cleanly
+#ifndef _WIN32
+	signal(SIGPIPE, SIG_IGN);
+#endif
+	stop_requested = 0;
+	signal(SIGINT, stop_signal_handler);
+	signal(SIGTERM, stop_signal_handler);
+
+	ChiakiMutex mutex;
+	ChiakiCond cond;
+	ChiakiErrorCode err = chiaki_mutex_init(&mutex, false);
+	if(err != CHIAKI_ERR_SUCCESS)
+		goto error_streams;
+	err = chiaki_cond_init(&cond);
+	if(err != CHIAKI_ERR_SUCCESS)
+		goto error_mutex;
+
+	ChiakiWorkerPool *pool = NULL;
+	if(arguments.pool)
+	{
+		pool = chiaki_worker_pool_new(log, arguments.pool_threads);
+		if(!pool)
+		{
+			fprintf(stderr, "Failed to create worker pool\n");
+			goto error_cond;
+		}
+		CHIAKI_LOGI(log, "Sharing %u worker pool threads between %zu sessions",
+				chiaki_worker_pool_thread_count(pool), streams_count);
+	}
+
+	bool start_failed = false;
+	for(size_t i=0; i<streams_count; i++)
+	{
+		streams[i].mutex = &mutex;
+		streams[i].cond = &cond;
+		if(!stream_start(&streams[i], &arguments, pool))
+		{
+			start_failed = true;
+			break;
+		}
+	}
+
+	chiaki_mutex_lock(&mutex);
+	if(start_failed)
+	{
+		// the ones already running are useless without the others
+		for(size_t i=0; i<streams_count; i++)
+		{
+			Stream *stream = &streams[i];
+			if(!stream->session_started)
+				continue;
+			stream->stopping = true;
+			chiaki_mutex_unlock(&mutex);
+			chiaki_session_stop(&stream->session);
+			chiaki_mutex_lock(&mutex);
+		}
+	}
+	while(true)
+	{
+		bool running = false;
+		for(size_t i=0; i<streams_count; i++)
+		{
+			Stream *stream = &streams[i];
+			if(!stream->session_started || stream->quit)
+				continue;
+			running = true;
+			stream_check(stream, arguments.pin, arguments.duration_s);
+		}
+		if(!running)
+			break;
+		chiaki_cond_timedwait(&cond, &mutex, 100);
+	}
+	chiaki_mutex_unlock(&mutex);
+
+	for(size_t i=0; i<streams_count; i++)
+	{
+		Stream *stream = &streams[i];
+		if(!stream->session_started)
+			continue;
+		chiaki_session_join(&stream->session);
+		if(stream->quit_reason_str[0])
+			CHIAKI_LOGI(log, "Session with %s quit: %s, %s", stream->host,
+					chiaki_quit_reason_string(stream->quit_reason), stream->quit_reason_str);
+		else
+			CHIAKI_LOGI(log, "Session with %s quit: %s", stream->host, chiaki_quit_reason_string(stream->quit_reason));
+	}
+
+	ret = start_failed ? 1 : 0;
+	for(size_t i=0; i<streams_count; i++)
+	{
+		Stream *stream = &streams[i];
+		stream_fini(stream);
+		if(chiaki_quit_reason_is_error(stream->quit_reason) || stream->output_failed)
+			ret = 1;
+	}
+
+	// all lanes are gone with the sessions
+	if(pool)
+		chiaki_worker_pool_free(pool);
+error_cond:
+	chiaki_cond_fini(&cond);
+error_mutex:
+	chiaki_mutex_fini(&mutex);
+error_streams:
+	free(streams);
+	return ret;
+}
@@ -59,6 +59,13 @@ enum class Decoder
 	Pi
 };
 
+enum class DecoderThreading
+{
+	Default,
+	Slice,
+	Frame
+};
+
 enum class PlaceboPreset {
 	Fast,
 	Default,
@@ -229,6 +236,17 @@ class Settings : public QObject
 		QRect GetStreamGeometry() const;
 		void SetStreamGeometry(QRect geometry);
 
+		/**
+		 * Network profiles measured by earlier sessions, by console and network path.
+		 * @return false if there is none for key or it is older than max_age_days
+		 */
+		bool GetNetworkProfile(const QString &key, ChiakiNetworkProfile *profile, int max_age_days = 7) const;
+		/**
+		 * @param measured_now false to keep the date of the last full measurement, so the profile still expires
+		 */
+		void SetNetworkProfile(const QString &key, const ChiakiNetworkProfile &profile, bool measured_now = true);
+		void RemoveNetworkProfile(const QString &key);
+
 		bool GetRemotePlayAsk() const           { return settings.value("settings/remote_play_ask", true).toBool(); }
 		void SetRemotePlayAsk(bool asked)       { settings.setValue("settings/remote_play_ask", asked); }
 
@@ -329,6 +347,15 @@ class Settings : public QObject
 		QString GetHardwareDecoder() const;
 		void SetHardwareDecoder(const QString &hw_decoder);
 
+		DecoderThreading GetDecoderThreading() const;
+		void SetDecoderThreading(DecoderThreading threading);
+
+		/**
+		 * Trade decoding accuracy and throughput for latency in software decoding (low delay and fast flags)
+		 */
+		bool GetDecoderLowDelay() const;
+		void SetDecoderLowDelay(bool enabled);
+
 		WindowType GetWindowType() const;
 		void SetWindowType(WindowType type);
 
@@ -365,6 +392,12 @@ class Settings : public QObject
 		 */
 		unsigned int GetAudioBufferSize() const;
 		void SetAudioBufferSize(unsigned int size);
+
+		/**
+		 * Whether received audio goes through an adaptive jitter buffer with loss concealment
+		 */
+		bool GetAudioJitterBuffer() const;
+		void SetAudioJitterBuffer(bool enabled);
 		
 		QString GetAudioOutDevice() const;
 		void SetAudioOutDevice(QString device_name);
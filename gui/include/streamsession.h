@@ -6,7 +6,13 @@
 #include <chiaki/session.h>
 #include <chiaki/opusdecoder.h>
 #include <chiaki/opusencoder.h>
+#include <chiaki/micpipeline.h>
 #include <chiaki/ffmpegdecoder.h>
+#include <chiaki/metrics.h>
+#include <chiaki/recorder.h>
+#include <chiaki/audioring.h>
+#include <chiaki/hapticsresampler.h>
+#include <chiaki/echoring.h>
 
 #if CHIAKI_LIB_ENABLE_PI_DECODER
 #include <chiaki/pidecoder.h>
@@ -38,8 +44,9 @@
 #include <QTimer>
 #include <QQueue>
 #include <QElapsedTimer>
+
+#include <atomic>
 #if CHIAKI_GUI_ENABLE_SPEEX
-#include <QQueue>
 #include <speex/speex_echo.h>
 #include <speex/speex_preprocess.h>
 #endif
@@ -68,6 +75,7 @@ struct StreamSessionConnectInfo
 	Decoder decoder;
 	QString hw_decoder;
 	AVBufferRef *hw_device_ctx;
+	ChiakiFfmpegDecoderOptions decoder_options;
 	QString audio_out_device;
 	QString audio_in_device;
 	uint32_t log_level_mask;
@@ -81,6 +89,7 @@ struct StreamSessionConnectInfo
 	ChiakiConnectVideoProfile video_profile;
 	double packet_loss_max;
 	unsigned int audio_buffer_size;
+	bool audio_jitter_buffer;
 	int audio_volume;
 	bool fullscreen;
 	bool zoom;
@@ -110,6 +119,9 @@ struct StreamSessionConnectInfo
 	uint dpad_touch_shortcut2;
 	uint dpad_touch_shortcut3;
 	uint dpad_touch_shortcut4;
+	QString network_profile_key; // empty if the network path couldn't be determined
+	bool network_profile_cached;
+	ChiakiNetworkProfile network_profile;
 
 	StreamSessionConnectInfo() {}
 	StreamSessionConnectInfo(
@@ -127,13 +139,6 @@ struct StreamSessionConnectInfo
 			bool stretch);
 };
 
-struct MicBuf
-{
-	int16_t *buf;
-	uint32_t size_bytes;
-	uint32_t current_byte;
-};
-
 class StreamSession : public QObject
 {
 	friend class StreamSessionPrivate;
@@ -160,7 +165,7 @@ class StreamSession : public QObject
 		bool allow_unmute;
 		int input_block;
 		QString host;
-		int audio_volume;
+		std::atomic<int> audio_volume; // read by the audio device callback
 		double measured_bitrate = 0;
 		double average_packet_loss = 0;
 		QList<double> packet_loss_history;
@@ -222,6 +227,9 @@ class StreamSession : public QObject
 		RumbleHapticsIntensity rumble_haptics_intensity;
 		bool start_mic_unmuted;
 		bool session_started;
+		bool metrics_exporter_started;
+		ChiakiMetricsExporter metrics_exporter;
+		ChiakiRecorder *recorder;
 
 		ChiakiFfmpegDecoder *ffmpeg_decoder;
 		void TriggerFfmpegFrameAvailable();
@@ -233,8 +241,11 @@ class StreamSession : public QObject
 		QString audio_in_device_name;
 		SDL_AudioDeviceID audio_out;
 		SDL_AudioDeviceID audio_in;
+		ChiakiAudioRing *audio_out_ring;
 		size_t audio_out_sample_size;
-		bool audio_out_drain_queue;
+		unsigned int audio_out_rate;
+		uint64_t audio_out_latency_us; // held by the device after leaving the ring
+		bool audio_jitter_buffer;
 		size_t haptics_buffer_size;
 		unsigned int audio_buffer_size;
 		ChiakiHolepunchSession holepunch_session;
@@ -242,16 +253,21 @@ class StreamSession : public QObject
 		SpeexEchoState *echo_state;
 		SpeexPreprocessState *preprocess_state;
 		bool speech_processing_enabled;
-		uint8_t *echo_resampler_buf, *mic_resampler_buf;
-		QQueue<int16_t *> echo_to_cancel;
+		ChiakiEchoRing *echo_ring; // played audio as mono by play time, the reference to cancel from the mic
+		int16_t *echo_ref_buf, *echo_out_buf, *mic_stereo_buf; // one allocation of a mic frame each, owned by echo_ref_buf
 #endif
 		SDL_AudioDeviceID haptics_output;
-		uint8_t *haptics_resampler_buf;
-		MicBuf mic_buf;
+		ChiakiAudioRing *haptics_ring; // 3 kHz stereo packets as received, resampled by the device callback
+		ChiakiHapticsResampler haptics_resampler;
+		int16_t haptics_pending[CHIAKI_HAPTICS_RESAMPLER_RATIO * CHIAKI_HAPTICS_RESAMPLER_CHANNELS_OUT];
+		size_t haptics_pending_frames;
+		ChiakiMicPipeline mic_pipeline;
 		QMap<Qt::Key, int> key_map;
 		QElapsedTimer connect_timer;
 
 		void PushAudioFrame(int16_t *buf, size_t samples_count);
+		static void AudioOutCallback(void *user, Uint8 *stream, int len);
+		static void HapticsOutCallback(void *user, Uint8 *stream, int len);
 		void PushHapticsFrame(uint8_t *buf, size_t buf_size);
 		void CantDisplayMessage(bool cant_display);
 		ChiakiErrorCode InitiatePsnConnection(QString psn_token);
@@ -266,6 +282,9 @@ class StreamSession : public QObject
 #endif
 		void AdjustAdaptiveTriggerPacket(uint8_t *buf, uint8_t type);
 		void WaitHaptics();
+#if CHIAKI_GUI_ENABLE_SPEEX
+		int16_t *ProcessMicFrame(int16_t *pcm, uint64_t capture_us);
+#endif
 
 	private slots:
 		void InitAudio(unsigned int channels, unsigned int rate);
@@ -294,10 +313,18 @@ class StreamSession : public QObject
 		void ToggleMute();
 		void SetLoginPIN(const QString &pin);
 		void GoHome();
+		/**
+		 * Start recording the stream as it is received to the movies directory, or stop the running recording.
+		 */
+		void ToggleRecording();
 		QString GetHost() { return host; }
 		bool GetConnected() { return connected; }
 		double GetMeasuredBitrate()	{ return measured_bitrate; }
 		double GetAveragePacketLoss()	{ return average_packet_loss; }
+		/**
+		 * @return received audio waiting in the jitter buffer and the output device queue in milliseconds
+		 */
+		double GetAudioLatency();
 		bool GetMuted()	{ return muted; }
 		void SetMuted(bool enable)	{ if (enable != muted) ToggleMute(); }
 		void SetAudioVolume(int volume) { audio_volume = volume; }
@@ -308,6 +335,7 @@ class StreamSession : public QObject
 		ChiakiLog *GetChiakiLog()				{ return log.GetChiakiLog(); }
 		QList<Controller *> GetControllers()	{ return controllers.values(); }
 		ChiakiFfmpegDecoder *GetFfmpegDecoder()	{ return ffmpeg_decoder; }
+		ChiakiMetrics *GetMetrics()	{ return session.metrics; }
 #if CHIAKI_LIB_ENABLE_PI_DECODER
 		ChiakiPiDecoder *GetPiDecoder()	{ return pi_decoder; }
 #endif
@@ -317,7 +345,6 @@ class StreamSession : public QObject
 		void HandleMouseReleaseEvent(QMouseEvent *event);
 		void HandleMousePressEvent(QMouseEvent *event);
 		void HandleMouseMoveEvent(QMouseEvent *event, qreal width, qreal height);
-		void ReadMic(const QByteArray &micdata);
 
 		void BlockInput(bool block) { input_block = block ? 1 : 2; SendFeedbackState(); }
 
@@ -333,6 +360,7 @@ class StreamSession : public QObject
 		void DataHolepunchProgress(bool finished);
 		void AutoRegistSucceeded(const ChiakiRegisteredHost &host);
 		void NicknameReceived(QString nickname);
+		void NetworkProfileChanged(unsigned int mtu_in, unsigned int mtu_out, quint64 rtt_us, bool valid, bool cached);
 		void ConnectedChanged();
 		void MeasuredBitrateChanged();
 		void AveragePacketLossChanged();
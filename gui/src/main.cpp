@@ -19,6 +19,7 @@ int main(int argc, char *argv[]) { return real_main(argc, argv); }
 #include <chiaki/session.h>
 #include <chiaki/regist.h>
 #include <chiaki/base64.h>
+#include <chiaki/trace.h>
 
 #include <stdio.h>
 #include <string.h>
@@ -98,6 +99,10 @@ int real_main(int argc, char *argv[])
 		return 1;
 	}
 
+	// Per-frame latency tracing, written to the given file on Ctrl+T and when the session quits
+	if(qEnvironmentVariableIsSet("CHIAKI_TRACE_FILE"))
+		chiaki_trace_set_enabled(true);
+
     SDL_SetHint(SDL_HINT_APP_NAME, "chiaki-ng");
 
 	if(SDL_Init(SDL_INIT_AUDIO) < 0)
@@ -7,6 +7,7 @@
 #include "psntoken.h"
 #include "systemdinhibit.h"
 #include "chiaki/remote/holepunch.h"
+#include "chiaki/trace.h"
 #if CHIAKI_GUI_ENABLE_STEAM_SHORTCUT
 #include "steamtools.h"
 #endif
@@ -782,15 +783,15 @@ void QmlBackend::createSession(const StreamSessionConnectInfo &connect_info)
 #endif
         };
         if (frame->hw_frames_ctx && (!zero_copy_formats.contains(frame->format) || disable_zero_copy)) {
-            AVFrame *sw_frame = av_frame_alloc();
-            if (av_hwframe_transfer_data(sw_frame, frame, 0) < 0) {
+            AVFrame *sw_frame = chiaki_ffmpeg_frame_alloc();
+            if (!sw_frame || av_hwframe_transfer_data(sw_frame, frame, 0) < 0) {
                 qCWarning(chiakiGui) << "Failed to transfer frame from hardware";
-                av_frame_unref(frame);
-                av_frame_free(&sw_frame);
+                chiaki_ffmpeg_frame_free(&frame);
+                chiaki_ffmpeg_frame_free(&sw_frame);
                 return;
             }
             av_frame_copy_props(sw_frame, frame);
-            av_frame_unref(frame);
+            chiaki_ffmpeg_frame_free(&frame);
             frame = sw_frame;
         }
         QMetaObject::invokeMethod(window, std::bind(&QmlMainWindow::presentFrame, window, frame, frames_lost));
@@ -808,6 +809,9 @@ void QmlBackend::createSession(const StreamSessionConnectInfo &connect_info)
         chiaki_log_ctx = nullptr;
         chiaki_log_mutex.unlock();
 
+        if (chiaki_trace_enabled())
+            writeTrace();
+
         session->deleteLater();
         session = nullptr;
         emit sessionChanged(session);
@@ -835,6 +839,15 @@ void QmlBackend::createSession(const StreamSessionConnectInfo &connect_info)
 
     connect(session, &StreamSession::NicknameReceived, this, &QmlBackend::checkNickname);
 
+    connect(session, &StreamSession::NetworkProfileChanged, this, [this, connect_info](unsigned int mtu_in, unsigned int mtu_out, quint64 rtt_us, bool valid, bool cached) {
+        if (connect_info.network_profile_key.isEmpty())
+            return;
+        if (valid)
+            settings->SetNetworkProfile(connect_info.network_profile_key, { mtu_in, mtu_out, rtt_us }, !cached);
+        else
+            settings->RemoveNetworkProfile(connect_info.network_profile_key);
+    });
+
     connect(session, &StreamSession::AutoRegistSucceeded, this, &QmlBackend::finishAutoRegister);
 
     connect(session, &StreamSession::ConnectedChanged, this, [this]() {
@@ -1287,6 +1300,18 @@ void QmlBackend::connectToHost(int index, QString nickname)
     }
 }
 
+void QmlBackend::writeTrace()
+{
+    QString path = qEnvironmentVariable("CHIAKI_TRACE_FILE");
+    if (path.isEmpty())
+        return;
+    ChiakiErrorCode err = chiaki_trace_write_chrome_json(path.toUtf8().constData());
+    if (err == CHIAKI_ERR_SUCCESS)
+        qCInfo(chiakiGui) << "Wrote trace to" << path;
+    else
+        qCWarning(chiakiGui) << "Failed to write trace to" << path << ":" << chiaki_error_string(err);
+}
+
 void QmlBackend::stopSession(bool sleep)
 {
     if (!session)
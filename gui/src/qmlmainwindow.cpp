@@ -2,6 +2,7 @@
 #include "qmlbackend.h"
 #include "qmlsvgprovider.h"
 #include "chiaki/log.h"
+#include "chiaki/trace.h"
 #include "streamsession.h"
 
 #include <qpa/qplatformnativeinterface.h>
@@ -302,11 +303,14 @@ void QmlMainWindow::show()
 
 void QmlMainWindow::presentFrame(AVFrame *frame, int32_t frames_lost)
 {
+    CHIAKI_TRACE_INSTANT(CHIAKI_TRACE_STAGE_PRESENT_FRAME, chiaki_ffmpeg_decoder_frame_trace_index(frame));
     frame_mutex.lock();
     if (av_frame) {
         qCDebug(chiakiGui) << "Dropping rendering frame";
         dropped_frames_current++;
-        av_frame_free(&av_frame);
+        if (session)
+            chiaki_metrics_counter_inc(session->GetMetrics(), CHIAKI_METRIC_VIDEO_FRAMES_DROPPED);
+        chiaki_ffmpeg_frame_free(&av_frame);
     }
     av_frame = frame;
     frame_mutex.unlock();
@@ -852,6 +856,9 @@ void QmlMainWindow::render()
     }
     frame_mutex.unlock();
 
+    const int64_t trace_frame = chiaki_ffmpeg_decoder_frame_trace_index(frame);
+    CHIAKI_TRACE_BEGIN(CHIAKI_TRACE_STAGE_RENDER, trace_frame);
+
     if (frame) {
         struct pl_avframe_params avparams = {
             .frame = frame,
@@ -866,12 +873,13 @@ void QmlMainWindow::render()
                 backend->disableZeroCopy();
             }
         }
-        av_frame_free(&frame);
+        chiaki_ffmpeg_frame_free(&frame);
     }
 
     struct pl_swapchain_frame sw_frame = {};
     if (!pl_swapchain_start_frame(placebo_swapchain, &sw_frame)) {
         qCWarning(chiakiGui) << "Failed to start Placebo frame!";
+        CHIAKI_TRACE_END(CHIAKI_TRACE_STAGE_RENDER, trace_frame);
         return;
     }
 
@@ -1061,6 +1069,7 @@ void QmlMainWindow::render()
         qCWarning(chiakiGui) << "Failed to submit Placebo frame!";
 
     pl_swapchain_swap_buffers(placebo_swapchain);
+    CHIAKI_TRACE_END(CHIAKI_TRACE_STAGE_RENDER, trace_frame);
 }
 
 bool QmlMainWindow::handleShortcut(QKeyEvent *event)
@@ -1097,6 +1106,14 @@ bool QmlMainWindow::handleShortcut(QKeyEvent *event)
     case Qt::Key_O:
         emit menuRequested();
         return true;
+    case Qt::Key_T:
+        if (chiaki_trace_enabled() && backend)
+            backend->writeTrace();
+        return true;
+    case Qt::Key_R:
+        if (session)
+            session->ToggleRecording();
+        return true;
     case Qt::Key_Q:
 #ifndef Q_OS_MACOS
         close();
@@ -40,10 +40,16 @@ SessionLog::SessionLog(StreamSession *session, uint32_t level_mask, const QStrin
 	}
 
 	CHIAKI_LOGI(&log, "Chiaki Version " CHIAKI_VERSION);
+
+	// Keep console and file I/O off the stream threads
+	ChiakiErrorCode err = chiaki_log_async_start(&log);
+	if(err != CHIAKI_ERR_SUCCESS)
+		CHIAKI_LOGW(&log, "Failed to start asynchronous logging: %s", chiaki_error_string(err));
 }
 
 SessionLog::~SessionLog()
 {
+	chiaki_log_async_stop(&log);
 	delete file;
 }
 
@@ -55,7 +61,7 @@ void SessionLog::Log(ChiakiLogLevel level, const char *msg)
 	{
 		static const QString date_format = "yyyy-MM-dd HH:mm:ss:zzzzzz";
 		QString str = QString("[%1] [%2] %3\n").arg(
-				QDateTime::currentDateTime().toString(date_format),
+				QDateTime::fromMSecsSinceEpoch(chiaki_log_timestamp_ms()).toString(date_format),
 				QString(chiaki_log_level_char(level)),
 				msg);
 
@@ -7,6 +7,7 @@
 #include <QUrl>
 #include <QKeySequence>
 #include <QCoreApplication>
+#include <QDateTime>
 
 #include <chiaki/config.h>
 
@@ -325,6 +326,33 @@ void Settings::SetStreamGeometry(QRect geometry)
 	settings.setValue("settings/stream_geometry", geometry);
 }
 
+bool Settings::GetNetworkProfile(const QString &key, ChiakiNetworkProfile *profile, int max_age_days) const
+{
+	QString group = QStringLiteral("network_profiles/%1/").arg(key);
+	QDateTime measured = settings.value(group + "measured").toDateTime();
+	if(!measured.isValid() || measured.addDays(max_age_days) < QDateTime::currentDateTimeUtc())
+		return false;
+	profile->mtu_in = settings.value(group + "mtu_in").toUInt();
+	profile->mtu_out = settings.value(group + "mtu_out").toUInt();
+	profile->rtt_us = settings.value(group + "rtt_us").toULongLong();
+	return profile->mtu_in && profile->mtu_out;
+}
+
+void Settings::SetNetworkProfile(const QString &key, const ChiakiNetworkProfile &profile, bool measured_now)
+{
+	QString group = QStringLiteral("network_profiles/%1/").arg(key);
+	settings.setValue(group + "mtu_in", profile.mtu_in);
+	settings.setValue(group + "mtu_out", profile.mtu_out);
+	settings.setValue(group + "rtt_us", QVariant::fromValue(profile.rtt_us));
+	if(measured_now || !settings.value(group + "measured").toDateTime().isValid())
+		settings.setValue(group + "measured", QDateTime::currentDateTimeUtc());
+}
+
+void Settings::RemoveNetworkProfile(const QString &key)
+{
+	settings.remove(QStringLiteral("network_profiles/%1").arg(key));
+}
+
 static const QMap<RumbleHapticsIntensity, QString> intensities = {
 	{ RumbleHapticsIntensity::Off, "Off" },
 	{ RumbleHapticsIntensity::VeryWeak, "Very weak"},
@@ -671,6 +699,35 @@ void Settings::SetHardwareDecoder(const QString &hw_decoder)
 	settings.setValue("settings/hw_decoder", hw_decoder);
 }
 
+static const QMap<DecoderThreading, QString> decoder_threading_values = {
+	{ DecoderThreading::Default, "default" },
+	{ DecoderThreading::Slice, "slice" },
+	{ DecoderThreading::Frame, "frame" }
+};
+
+static const DecoderThreading decoder_threading_default = DecoderThreading::Default;
+
+DecoderThreading Settings::GetDecoderThreading() const
+{
+	auto v = settings.value("settings/decoder_threading", decoder_threading_values[decoder_threading_default]).toString();
+	return decoder_threading_values.key(v, decoder_threading_default);
+}
+
+void Settings::SetDecoderThreading(DecoderThreading threading)
+{
+	settings.setValue("settings/decoder_threading", decoder_threading_values[threading]);
+}
+
+bool Settings::GetDecoderLowDelay() const
+{
+	return settings.value("settings/decoder_low_delay", false).toBool();
+}
+
+void Settings::SetDecoderLowDelay(bool enabled)
+{
+	settings.setValue("settings/decoder_low_delay", enabled);
+}
+
 int Settings::GetAudioVolume() const
 {
 	return settings.value("settings/audio_volume", SDL_MIX_MAXVOLUME).toInt();
@@ -712,6 +769,16 @@ void Settings::SetAudioBufferSize(unsigned int size)
 	settings.setValue("settings/audio_buffer_size", size);
 }
 
+bool Settings::GetAudioJitterBuffer() const
+{
+	return settings.value("settings/audio_jitter_buffer", true).toBool();
+}
+
+void Settings::SetAudioJitterBuffer(bool enabled)
+{
+	settings.setValue("settings/audio_jitter_buffer", enabled);
+}
+
 unsigned int Settings::GetWifiDroppedNotif() const
 {
 	return settings.value("settings/wifi_dropped_notif_percent", 3).toUInt();
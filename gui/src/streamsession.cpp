@@ -9,10 +9,15 @@
 #include <chiaki/remote/holepunch.h>
 #include <chiaki/session.h>
 #include <chiaki/time.h>
+#include <chiaki/audio.h>
 #include "../../lib/src/utils.h"
 
 #include <QKeyEvent>
 #include <QtMath>
+#include <QDateTime>
+#include <QCryptographicHash>
+#include <QDir>
+#include <QStandardPaths>
 
 #include <cstring>
 
@@ -34,14 +39,12 @@
 #define HAPTIC_RUMBLE_MIN_STRENGTH 100
 
 #define MICROPHONE_SAMPLES 480
+#define ECHO_HISTORY_MS 1000
 #ifdef Q_OS_LINUX
 #define DUALSENSE_AUDIO_DEVICE_NEEDLE "DualSense"
 #else
 #define DUALSENSE_AUDIO_DEVICE_NEEDLE "Wireless Controller"
 #endif
-#if CHIAKI_GUI_ENABLE_SPEEX
-#define ECHO_QUEUE_MAX 40
-#endif
 
 static bool isLocalAddress(QString host)
 {
@@ -86,6 +89,19 @@ StreamSessionConnectInfo::StreamSessionConnectInfo(
 	decoder = settings->GetDecoder();
 	hw_decoder = settings->GetHardwareDecoder();
 	hw_device_ctx = nullptr;
+	chiaki_ffmpeg_decoder_options_default(&decoder_options);
+	switch(settings->GetDecoderThreading())
+	{
+		case DecoderThreading::Slice:
+			decoder_options.threading = CHIAKI_FFMPEG_DECODER_THREADING_SLICE;
+			break;
+		case DecoderThreading::Frame:
+			decoder_options.threading = CHIAKI_FFMPEG_DECODER_THREADING_FRAME;
+			break;
+		default:
+			break;
+	}
+	decoder_options.low_delay = settings->GetDecoderLowDelay();
 	audio_out_device = settings->GetAudioOutDevice();
 	audio_in_device = settings->GetAudioInDevice();
 	log_level_mask = settings->GetLogLevelMask();
@@ -104,6 +120,7 @@ StreamSessionConnectInfo::StreamSessionConnectInfo(
 	this->morning = std::move(morning);
 	this->initial_login_pin = std::move(initial_login_pin);
 	audio_buffer_size = settings->GetAudioBufferSize();
+	audio_jitter_buffer = settings->GetAudioJitterBuffer();
 	this->fullscreen = fullscreen;
 	this->zoom = zoom;
 	this->stretch = stretch;
@@ -141,11 +158,26 @@ StreamSessionConnectInfo::StreamSessionConnectInfo(
 	this->dpad_touch_shortcut4 = settings->GetDpadTouchShortcut4();
 	if(this->dpad_touch_shortcut4 > 0)
 		this->dpad_touch_shortcut4 = 1 << (this->dpad_touch_shortcut4 - 1);
+
+	// measurements of earlier sessions are reused while the console is reached the same way
+	network_profile_cached = false;
+	memset(&network_profile, 0, sizeof(network_profile));
+	QByteArray fingerprint_host = this->host.toUtf8();
+	char fingerprint[CHIAKI_NETWORK_FINGERPRINT_SIZE];
+	if(chiaki_network_fingerprint(this->duid.isEmpty() ? fingerprint_host.constData() : nullptr, fingerprint, sizeof(fingerprint)) == CHIAKI_ERR_SUCCESS)
+	{
+		QByteArray id = (this->duid.isEmpty() ? this->host : this->duid).toUtf8() + '|' + fingerprint;
+		network_profile_key = QCryptographicHash::hash(id, QCryptographicHash::Sha1).toHex();
+		network_profile_cached = settings->GetNetworkProfile(network_profile_key, &network_profile);
+	}
 }
 
 static void AudioSettingsCb(uint32_t channels, uint32_t rate, void *user);
 static void AudioFrameCb(int16_t *buf, size_t samples_count, void *user);
 static void HapticsFrameCb(uint8_t *buf, size_t buf_size, void *user);
+#if CHIAKI_GUI_ENABLE_SPEEX
+static int16_t *MicProcessCb(int16_t *pcm, size_t frames, uint64_t capture_us, void *user);
+#endif
 #ifdef Q_OS_MACOS
 static void MacMicRequestCb(Authorization authorization, void *user);
 #endif
@@ -158,6 +190,7 @@ static void SessionSetsuCb(SetsuEvent *event, void *user);
 static void SessionSDeckCb(SDeckEvent *event, void *user);
 #endif
 static void FfmpegFrameCb(ChiakiFfmpegDecoder *decoder, void *user);
+static void FfmpegDecodeFeedbackCb(uint64_t sample, bool success, void *user);
 
 StreamSession::StreamSession(const StreamSessionConnectInfo &connect_info, QObject *parent)
 	: QObject(parent),
@@ -168,19 +201,26 @@ StreamSession::StreamSession(const StreamSessionConnectInfo &connect_info, QObje
 #endif
 	audio_out(0),
 	audio_in(0),
+	audio_out_ring(nullptr),
+	audio_out_latency_us(0),
 	haptics_output(0),
 	haptics_handheld(0),
 	session_started(false),
+	metrics_exporter_started(false),
+	recorder(nullptr),
 #if CHIAKI_GUI_ENABLE_STEAMDECK_NATIVE
 	sdeck_haptics_senderl(nullptr),
 	sdeck_haptics_senderr(nullptr),
 	sdeck(nullptr),
 #endif
 #if CHIAKI_GUI_ENABLE_SPEEX
-	echo_resampler_buf(nullptr),
-	mic_resampler_buf(nullptr),
+	echo_ring(nullptr),
+	echo_ref_buf(nullptr),
+	echo_out_buf(nullptr),
+	mic_stereo_buf(nullptr),
 #endif
-	haptics_resampler_buf(nullptr),
+	haptics_ring(nullptr),
+	haptics_pending_frames(0),
 	holepunch_session(nullptr),
 	rumble_multiplier(1),
 	ps5_rumble_intensity(0x00),
@@ -189,7 +229,7 @@ StreamSession::StreamSession(const StreamSessionConnectInfo &connect_info, QObje
 	rumble_haptics_on(false)
 {
     auto test = connect_info.regist_key.constData();
-    mic_buf.buf = nullptr;
+	memset(&mic_pipeline, 0, sizeof(mic_pipeline));
     connected = false;
 	muted = true;
 	mic_connected = false;
@@ -220,7 +260,7 @@ StreamSession::StreamSession(const StreamSessionConnectInfo &connect_info, QObje
 				chiaki_log_sniffer_get_log(&sniffer),
 				chiaki_target_is_ps5(connect_info.target) ? connect_info.video_profile.codec : CHIAKI_CODEC_H264,
 				connect_info.hw_decoder.isEmpty() ? NULL : connect_info.hw_decoder.toUtf8().constData(),
-				connect_info.hw_device_ctx, FfmpegFrameCb, this);
+				connect_info.hw_device_ctx, FfmpegFrameCb, this, &connect_info.decoder_options);
 		if(err != CHIAKI_ERR_SUCCESS)
 		{
 			QString log = QString::fromUtf8(chiaki_log_sniffer_get_buffer(&sniffer));
@@ -237,7 +277,15 @@ StreamSession::StreamSession(const StreamSessionConnectInfo &connect_info, QObje
 	audio_out_device_name = connect_info.audio_out_device;
 	audio_in_device_name = connect_info.audio_in_device;
 
-	chiaki_opus_decoder_init(&opus_decoder, log.GetChiakiLog());
+	err = chiaki_opus_decoder_init(&opus_decoder, log.GetChiakiLog());
+	if(err != CHIAKI_ERR_SUCCESS)
+		throw ChiakiException("Failed to initialize Opus Decoder: " + QString::fromLocal8Bit(chiaki_error_string(err)));
+	audio_jitter_buffer = connect_info.audio_jitter_buffer;
+	if(audio_jitter_buffer && chiaki_opus_decoder_enable_jitter_buffer(&opus_decoder) != CHIAKI_ERR_SUCCESS)
+	{
+		CHIAKI_LOGE(GetChiakiLog(), "Failed to enable audio jitter buffer");
+		audio_jitter_buffer = false;
+	}
 	chiaki_opus_encoder_init(&opus_encoder, log.GetChiakiLog());
 #if CHIAKI_GUI_ENABLE_SPEEX
 	speech_processing_enabled = connect_info.speech_processing_enabled;
@@ -254,6 +302,10 @@ StreamSession::StreamSession(const StreamSessionConnectInfo &connect_info, QObje
 		speex_preprocess_ctl(preprocess_state, SPEEX_PREPROCESS_SET_ECHO_SUPPRESS, &echo_suppress_level);
 		speex_preprocess_ctl(preprocess_state, SPEEX_PREPROCESS_GET_ECHO_SUPPRESS, &echo_suppress_level);
 		CHIAKI_LOGI(GetChiakiLog(), "Echo suppress level is %i dB", echo_suppress_level);
+		// Must cover the output ring, the device buffer and the time until the mic frame is processed
+		echo_ring = chiaki_echo_ring_new(48000, 48000 * ECHO_HISTORY_MS / 1000);
+		if(!echo_ring)
+			CHIAKI_LOGE(GetChiakiLog(), "Failed to allocate Echo Ring, echo cancellation disabled");
 		CHIAKI_LOGI(GetChiakiLog(), "Started microphone echo cancellation and noise suppression");
 	}
 #endif
@@ -272,6 +324,7 @@ StreamSession::StreamSession(const StreamSessionConnectInfo &connect_info, QObje
 	chiaki_connect_info.packet_loss_max = connect_info.packet_loss_max;
 	chiaki_connect_info.auto_regist = connect_info.auto_regist;
 	chiaki_connect_info.audio_video_disabled = connect_info.audio_video_disabled;
+	chiaki_connect_info.network_profile = connect_info.network_profile_cached ? &connect_info.network_profile : nullptr;
 
 	dpad_touch_shortcut1 = connect_info.dpad_touch_shortcut1;
 	dpad_touch_shortcut2 = connect_info.dpad_touch_shortcut2;
@@ -351,6 +404,7 @@ StreamSession::StreamSession(const StreamSessionConnectInfo &connect_info, QObje
 	display_sink.cantdisplay_cb = CantDisplayCb;
 	chiaki_session_ctrl_set_display_sink(&session, &display_sink);
 	chiaki_opus_decoder_set_cb(&opus_decoder, AudioSettingsCb, AudioFrameCb, this);
+	opus_decoder.metrics = session.metrics;
 	ChiakiAudioSink audio_sink;
 	chiaki_opus_decoder_get_sink(&opus_decoder, &audio_sink);
 	chiaki_session_set_audio_sink(&session, &audio_sink);
@@ -384,6 +438,38 @@ StreamSession::StreamSession(const StreamSessionConnectInfo &connect_info, QObje
 
 	chiaki_session_set_event_cb(&session, EventCb, this);
 
+	if(ffmpeg_decoder)
+	{
+		ffmpeg_decoder->metrics = session.metrics;
+		chiaki_ffmpeg_decoder_set_feedback_cb(ffmpeg_decoder, FfmpegDecodeFeedbackCb, &session);
+	}
+
+	// Live metrics for scraping, Prometheus text on 127.0.0.1:CHIAKI_METRICS_PORT and/or JSON lines appended to CHIAKI_METRICS_FILE
+	uint16_t metrics_port = qEnvironmentVariableIntValue("CHIAKI_METRICS_PORT");
+	QByteArray metrics_file = qgetenv("CHIAKI_METRICS_FILE");
+	if(metrics_port || !metrics_file.isEmpty())
+	{
+		QByteArray metrics_labels = QStringLiteral("host=\"%1\"").arg(host).toUtf8();
+		err = chiaki_metrics_exporter_start(&metrics_exporter, GetChiakiLog(), session.metrics, metrics_port,
+				metrics_file.isEmpty() ? nullptr : metrics_file.constData(), 1000, metrics_labels.constData());
+		if(err == CHIAKI_ERR_SUCCESS)
+			metrics_exporter_started = true;
+		else
+			CHIAKI_LOGW(GetChiakiLog(), "Failed to start metrics exporter: %s", chiaki_error_string(err));
+	}
+
+	recorder = chiaki_recorder_new(GetChiakiLog(), session.metrics);
+	if(recorder)
+	{
+		chiaki_session_set_recorder(&session, recorder);
+		// Record the whole session, e.g. for automated test runs
+		QByteArray record_file = qgetenv("CHIAKI_RECORD_FILE");
+		if(!record_file.isEmpty())
+			chiaki_recorder_start(recorder, record_file.constData(), chiaki_recorder_format_from_path(record_file.constData()));
+	}
+	else
+		CHIAKI_LOGW(GetChiakiLog(), "Failed to create recorder");
+
 #if CHIAKI_GUI_ENABLE_SDL_GAMECONTROLLER
 	connect(ControllerManager::GetInstance(), &ControllerManager::AvailableControllersUpdated, this, &StreamSession::UpdateGamepads);
 	connect(this, &StreamSession::DualSenseIntensityChanged, ControllerManager::GetInstance(), &ControllerManager::SetDualSenseIntensity);
@@ -481,16 +567,40 @@ StreamSession::~StreamSession()
 		SDL_CloseAudioDevice(audio_out);
 	if(audio_in)
 		SDL_CloseAudioDevice(audio_in);
+	chiaki_mic_pipeline_stop(&mic_pipeline);
 	if(session_started)
 		chiaki_session_join(&session);
+	if(metrics_exporter_started)
+		chiaki_metrics_exporter_stop(&metrics_exporter);
+	if(ffmpeg_decoder)
+		chiaki_ffmpeg_decoder_set_feedback_cb(ffmpeg_decoder, nullptr, nullptr);
 	chiaki_session_fini(&session);
+	chiaki_recorder_free(recorder);
 	chiaki_opus_decoder_fini(&opus_decoder);
+	// only after the session and the decoder are gone, both can still push frames until then
+	if(audio_out_ring)
+	{
+		ChiakiAudioRingStats stats;
+		chiaki_audio_ring_get_stats(audio_out_ring, &stats);
+		CHIAKI_LOGI(log.GetChiakiLog(), "Audio Output Ring: %llu frames underrun, %llu frames overrun, drift correction %d ppm",
+				(unsigned long long)stats.underrun_frames, (unsigned long long)stats.overrun_frames, (int)stats.drift_ppm);
+		chiaki_audio_ring_free(audio_out_ring);
+		audio_out_ring = nullptr;
+	}
 	chiaki_opus_encoder_fini(&opus_encoder);
 #if CHIAKI_GUI_ENABLE_SPEEX
 	if(speech_processing_enabled)
 	{
 		speex_echo_state_destroy(echo_state);
 		speex_preprocess_state_destroy(preprocess_state);
+		if(echo_ring)
+		{
+			ChiakiEchoRingStats stats;
+			chiaki_echo_ring_get_stats(echo_ring, &stats);
+			CHIAKI_LOGI(GetChiakiLog(), "Echo Ring: %llu of %llu reference samples missing, last offset %lld us",
+					(unsigned long long)stats.samples_missing, (unsigned long long)stats.samples_read, (long long)stats.offset_us);
+			chiaki_echo_ring_free(echo_ring);
+		}
 	}
 #endif
 #if CHIAKI_GUI_ENABLE_SDL_GAMECONTROLLER
@@ -508,6 +618,12 @@ StreamSession::~StreamSession()
 	setsu_free(setsu);
 #endif
 #if CHIAKI_GUI_ENABLE_STEAMDECK_NATIVE
+	SDeckHapticStats sdeck_haptic_stats;
+	if(sdeck && sdeck_haptic_get_stats(sdeck, &sdeck_haptic_stats) == 0 && sdeck_haptic_stats.blocks)
+		CHIAKI_LOGI(log.GetChiakiLog(), "Steam Deck Haptics analysis: %llu blocks, %.1f us average, %.1f us max",
+				(unsigned long long)sdeck_haptic_stats.blocks,
+				(double)sdeck_haptic_stats.total_ns / sdeck_haptic_stats.blocks / 1000.0,
+				(double)sdeck_haptic_stats.max_ns / 1000.0);
 	sdeck_free(sdeck);
 #endif
 #if CHIAKI_LIB_ENABLE_PI_DECODER
@@ -537,10 +653,10 @@ StreamSession::~StreamSession()
 		SDL_CloseAudioDevice(haptics_output);
 		haptics_output = 0;
 	}
-	if (haptics_resampler_buf)
+	if (haptics_ring)
 	{
-		free(haptics_resampler_buf);
-		haptics_resampler_buf = nullptr;
+		chiaki_audio_ring_free(haptics_ring);
+		haptics_ring = nullptr;
 	}
 #if CHIAKI_GUI_ENABLE_STEAMDECK_NATIVE
 	if (sdeck_haptics_senderl)
@@ -554,25 +670,9 @@ StreamSession::~StreamSession()
 		sdeck_haptics_senderr = nullptr;
 	}
 #endif
-	if(mic_buf.buf)
-	{
-		free(mic_buf.buf);
-		mic_buf.buf = nullptr;
-	}
 #if CHIAKI_GUI_ENABLE_SPEEX
-	if(speech_processing_enabled)
-	{
-		if(mic_resampler_buf)
-		{
-			free(mic_resampler_buf);
-			mic_resampler_buf = nullptr;
-		}
-		if(echo_resampler_buf)
-		{
-			free(echo_resampler_buf);
-			echo_resampler_buf = nullptr;
-		}
-	}
+	free(echo_ref_buf);
+	echo_ref_buf = echo_out_buf = mic_stereo_buf = nullptr;
 #endif
 }
 
@@ -636,6 +736,9 @@ void StreamSession::ToggleMute()
 	});
 	if(audio_in)
 		SDL_PauseAudioDevice(audio_in, muted);
+	// don't send what was captured before muting once unmuted again
+	if(muted)
+		chiaki_mic_pipeline_flush(&mic_pipeline);
 	emit MutedChanged();
 }
 
@@ -650,6 +753,25 @@ void StreamSession::GoHome()
 	chiaki_session_go_home(&session);
 }
 
+void StreamSession::ToggleRecording()
+{
+	if(!recorder)
+		return;
+	ChiakiRecorderStats stats;
+	chiaki_recorder_get_stats(recorder, &stats);
+	if(stats.recording)
+	{
+		chiaki_recorder_stop(recorder);
+		return;
+	}
+	QString dir = QStandardPaths::writableLocation(QStandardPaths::MoviesLocation);
+	QDir().mkpath(dir);
+	QString path = QStringLiteral("%1/chiaki-%2.mkv").arg(dir, QDateTime::currentDateTime().toString("yyyyMMdd-HHmmss"));
+	ChiakiErrorCode err = chiaki_recorder_start(recorder, QDir::toNativeSeparators(path).toUtf8().constData(), CHIAKI_RECORDER_FORMAT_MKV);
+	if(err != CHIAKI_ERR_SUCCESS)
+		CHIAKI_LOGE(GetChiakiLog(), "Failed to start recording: %s", chiaki_error_string(err));
+}
+
 void StreamSession::HandleMousePressEvent(QMouseEvent *event)
 {
 	// left button for touchpad gestures, others => touchpad click
@@ -1094,14 +1216,23 @@ void StreamSession::InitAudio(unsigned int channels, unsigned int rate)
 	if(start_mic_unmuted)
 		ToggleMute();
 	if(audio_out)
+	{
 		SDL_CloseAudioDevice(audio_out);
+		audio_out = 0;
+	}
+	chiaki_audio_ring_free(audio_out_ring);
+	audio_out_ring = nullptr;
 
 	SDL_AudioSpec spec = {0};
 	spec.freq = rate;
 	spec.channels = channels;
 	spec.format = AUDIO_S16SYS;
 	audio_out_sample_size = sizeof(int16_t) * channels;
+	audio_out_rate = rate;
+	audio_out_latency_us = 0;
 	spec.samples = audio_buffer_size / audio_out_sample_size;
+	spec.callback = AudioOutCallback;
+	spec.userdata = this;
 
 	SDL_AudioSpec obtained;
 	audio_out = SDL_OpenAudioDevice(audio_out_device_name.isEmpty() ? nullptr : qUtf8Printable(audio_out_device_name), false, &spec, &obtained, false);
@@ -1121,7 +1252,16 @@ void StreamSession::InitAudio(unsigned int channels, unsigned int rate)
 	if(audio_out_device_name.isEmpty())
 		audio_out_device_name = "Auto";
 
-	audio_out_drain_queue = false;
+	// Hold one and a half device buffers in the ring, with room for half a second before dropping
+	audio_out_ring = chiaki_audio_ring_new(channels, rate / 2, (size_t)obtained.samples * 3 / 2);
+	if(!audio_out_ring)
+	{
+		CHIAKI_LOGE(log.GetChiakiLog(), "Failed to allocate Audio Output Ring");
+		SDL_CloseAudioDevice(audio_out);
+		audio_out = 0;
+		return;
+	}
+	audio_out_latency_us = (uint64_t)obtained.samples * 1000000 / rate;
 
 	SDL_PauseAudioDevice(audio_out, 0);
 
@@ -1132,49 +1272,42 @@ void StreamSession::InitAudio(unsigned int channels, unsigned int rate)
 void StreamSession::InitMic(unsigned int channels, unsigned int rate)
 {
 	if(audio_in)
+	{
 		SDL_CloseAudioDevice(audio_in);
+		audio_in = 0;
+	}
 
-	mic_buf.buf = nullptr;
+	chiaki_mic_pipeline_stop(&mic_pipeline);
 #if CHIAKI_GUI_ENABLE_SPEEX
-	mic_resampler_buf = nullptr;
-	echo_resampler_buf = nullptr;
+	free(echo_ref_buf);
+	echo_ref_buf = echo_out_buf = mic_stereo_buf = nullptr;
 #endif
 
-	mic_buf.current_byte = 0;
-	int16_t mic_buf_size = channels * MICROPHONE_SAMPLES;
-	mic_buf.size_bytes = mic_buf_size * sizeof(int16_t);
-	mic_buf.buf = (int16_t*) calloc(mic_buf_size, sizeof(int16_t));
-	if(!mic_buf.buf)
-	{
-		CHIAKI_LOGE(GetChiakiLog(), "Could not allocate memory for mic buf, aborting mic startup");
-		return;
-	}
-
+	ChiakiMicPipelineProcessCallback process_cb = nullptr;
 #if CHIAKI_GUI_ENABLE_SPEEX
 	if(speech_processing_enabled)
 	{
-		SDL_AudioCVT cvt;
-		SDL_BuildAudioCVT(&cvt, AUDIO_S16SYS, 1, 48000, AUDIO_S16SYS, 2, 48000);
-		cvt.len = mic_buf.size_bytes;
-		mic_resampler_buf = (uint8_t*) calloc(cvt.len * cvt.len_mult, sizeof(uint8_t));
-		if(!mic_resampler_buf)
+		// mono echo reference, mono cancelled output and the stereo frame for the encoder
+		echo_ref_buf = (int16_t *)calloc(MICROPHONE_SAMPLES * 4, sizeof(int16_t));
+		if(!echo_ref_buf)
 		{
-			CHIAKI_LOGE(GetChiakiLog(), "Mic resampler buf could not be created, aborting mic startup");
-			return;
-		}
-
-		SDL_AudioCVT cvt2;
-		SDL_BuildAudioCVT(&cvt2, AUDIO_S16SYS, 2, 48000, AUDIO_S16SYS, 1, 48000);
-		cvt2.len = cvt.len * cvt.len_ratio;
-		echo_resampler_buf = (uint8_t*) calloc(cvt2.len * cvt2.len_mult, sizeof(uint8_t));
-		if(!echo_resampler_buf)
-		{
-			CHIAKI_LOGE(GetChiakiLog(), "Echo resampler buf could not be created, aborting mic startup");
+			CHIAKI_LOGE(GetChiakiLog(), "Speech processing bufs could not be created, aborting mic startup");
 			return;
 		}
+		echo_out_buf = echo_ref_buf + MICROPHONE_SAMPLES;
+		mic_stereo_buf = echo_ref_buf + MICROPHONE_SAMPLES * 2;
+		process_cb = MicProcessCb;
 	}
 #endif
 
+	// Capture, speech processing, encoding and sending all happen on the pipeline thread, away from the UI
+	ChiakiErrorCode err = chiaki_mic_pipeline_start(&mic_pipeline, GetChiakiLog(), &opus_encoder, channels, rate, process_cb, this, session.metrics);
+	if(err != CHIAKI_ERR_SUCCESS)
+	{
+		CHIAKI_LOGE(GetChiakiLog(), "Failed to start Mic pipeline: %s, aborting mic startup", chiaki_error_string(err));
+		return;
+	}
+
 	SDL_AudioSpec spec = {0};
 	spec.freq = rate;
 	spec.channels = channels;
@@ -1182,8 +1315,8 @@ void StreamSession::InitMic(unsigned int channels, unsigned int rate)
 	spec.samples = audio_buffer_size / 4;
 	spec.callback = [](void *userdata, Uint8 *stream, int len) {
 		auto s = static_cast<StreamSession*>(userdata);
-		QByteArray data(reinterpret_cast<char*>(stream), len);
-		QMetaObject::invokeMethod(s, std::bind(&StreamSession::ReadMic, s, data));
+		chiaki_mic_pipeline_push(&s->mic_pipeline, reinterpret_cast<const int16_t *>(stream),
+				(size_t)len / (sizeof(int16_t) * s->mic_pipeline.channels), chiaki_time_now_monotonic_us());
 	};
 	spec.userdata = this;
 
@@ -1210,110 +1343,22 @@ void StreamSession::InitMic(unsigned int channels, unsigned int rate)
 			qPrintable(audio_in_device_name), obtained.channels, obtained.freq, obtained.size);
 }
 
-void StreamSession::ReadMic(const QByteArray &micdata)
-{
 #if CHIAKI_GUI_ENABLE_SPEEX
-	int16_t echo_buf[mic_buf.size_bytes / sizeof(int16_t)];
-#endif
-	uint32_t mic_bytes_left = mic_buf.size_bytes - mic_buf.current_byte;
-	// Don't send mic data if muted
-	if(muted)
-		return;
-	qint64 bytes_read = micdata.size();
-	const char * micdataread = micdata.constData();
-	if(bytes_read == 0)
-		return;
-	if(bytes_read < mic_bytes_left)
-	{
-		memcpy((uint8_t *)mic_buf.buf + mic_buf.current_byte, (uint8_t *)micdataread, bytes_read);
-		mic_buf.current_byte += bytes_read;
-	}
-	else
+int16_t *StreamSession::ProcessMicFrame(int16_t *pcm, uint64_t capture_us)
+{
+	// the mic is mono here, processed with SPEEX and then duplicated to the stereo frame the encoder expects
+	int16_t *processed = pcm;
+	if(echo_ring && chiaki_echo_ring_read(echo_ring, echo_ref_buf, MICROPHONE_SAMPLES, capture_us))
 	{
-		memcpy((uint8_t *)mic_buf.buf + mic_buf.current_byte, (uint8_t *)micdataread, mic_bytes_left);
-#if CHIAKI_GUI_ENABLE_SPEEX
-		SDL_AudioCVT cvt;
-		if(speech_processing_enabled)
-		{
-			// change samples to stereo after processing with SPEEX
-			SDL_BuildAudioCVT(&cvt, AUDIO_S16SYS, 1, 48000, AUDIO_S16SYS, 2, 48000);
-			cvt.len = mic_buf.size_bytes;
-			cvt.buf = mic_resampler_buf;
-			if(!echo_to_cancel.isEmpty())
-			{
-				int16_t *echo = echo_to_cancel.dequeue();
-				speex_echo_cancellation(echo_state, mic_buf.buf, echo, echo_buf);
-				speex_preprocess_run(preprocess_state, echo_buf);
-				memcpy((uint8_t *)mic_resampler_buf, (uint8_t *)echo_buf, mic_buf.size_bytes);
-				if(SDL_ConvertAudio(&cvt) != 0)
-				{
-					CHIAKI_LOGE(log.GetChiakiLog(), "Failed to resample mic audio: %s", SDL_GetError());
-					return;
-				}
-				chiaki_opus_encoder_frame((int16_t *)mic_resampler_buf, &opus_encoder);
-			}
-			else
-			{
-				speex_preprocess_run(preprocess_state, (int16_t *)mic_buf.buf);
-				memcpy((uint8_t *)mic_resampler_buf, (uint8_t *)mic_buf.buf, mic_buf.size_bytes);
-				if(SDL_ConvertAudio(&cvt) != 0)
-				{
-					CHIAKI_LOGE(log.GetChiakiLog(), "Failed to resample mic audio: %s", SDL_GetError());
-					return;
-				}
-				chiaki_opus_encoder_frame((int16_t *)mic_resampler_buf, &opus_encoder);
-			}
-		}
-		else
-			chiaki_opus_encoder_frame(mic_buf.buf, &opus_encoder);
-#else
-	    chiaki_opus_encoder_frame(mic_buf.buf, &opus_encoder);
-#endif
-		bytes_read -= mic_bytes_left;
-		uint32_t frames = bytes_read / mic_buf.size_bytes;
-		for (int i = 0; i < frames; i++)
-		{
-			memcpy((uint8_t *)mic_buf.buf, (uint8_t *)micdataread + mic_bytes_left + i * mic_buf.size_bytes, mic_buf.size_bytes);
-#if CHIAKI_GUI_ENABLE_SPEEX
-		if(speech_processing_enabled)
-		{
-			if(!echo_to_cancel.isEmpty())
-			{
-				int16_t *echo = echo_to_cancel.dequeue();
-				speex_echo_cancellation(echo_state, mic_buf.buf, echo, echo_buf);
-				speex_preprocess_run(preprocess_state, echo_buf);
-				memcpy((uint8_t *)mic_resampler_buf, (uint8_t *)echo_buf, mic_buf.size_bytes);
-				if(SDL_ConvertAudio(&cvt) != 0)
-				{
-					CHIAKI_LOGE(log.GetChiakiLog(), "Failed to resample mic audio: %s", SDL_GetError());
-					return;
-				}
-				chiaki_opus_encoder_frame((int16_t *)mic_resampler_buf, &opus_encoder);
-			}
-			else
-			{
-				speex_preprocess_run(preprocess_state, (int16_t *)mic_buf.buf);
-				memcpy((uint8_t *)mic_resampler_buf, (uint8_t *)mic_buf.buf, mic_buf.size_bytes);
-				if(SDL_ConvertAudio(&cvt) != 0)
-				{
-					CHIAKI_LOGE(log.GetChiakiLog(), "Failed to resample mic audio: %s", SDL_GetError());
-					return;
-				}
-				chiaki_opus_encoder_frame((int16_t *)mic_resampler_buf, &opus_encoder);
-			}
-		}
-		else
-			chiaki_opus_encoder_frame(mic_buf.buf, &opus_encoder);
-#else
-	    chiaki_opus_encoder_frame(mic_buf.buf, &opus_encoder);
-#endif
-		}
-		mic_buf.current_byte = bytes_read % mic_buf.size_bytes;
-		if(mic_buf.current_byte == 0)
-			return;
-		memcpy((uint8_t *)mic_buf.buf, (uint8_t *)micdataread + mic_bytes_left + frames * mic_buf.size_bytes, mic_buf.current_byte);
+		speex_echo_cancellation(echo_state, pcm, echo_ref_buf, echo_out_buf);
+		processed = echo_out_buf;
 	}
+	speex_preprocess_run(preprocess_state, processed);
+	chiaki_audio_s16_upmix(mic_stereo_buf, processed, MICROPHONE_SAMPLES);
+	return mic_stereo_buf;
 }
+#endif
+
 void StreamSession::InitHaptics()
 {
 	haptics_output = 0;
@@ -1322,7 +1367,9 @@ void StreamSession::InitHaptics()
 	sdeck_haptics_senderr = nullptr;
 	sdeck_haptics_senderl = nullptr;
 #endif
-	haptics_resampler_buf = nullptr;
+	chiaki_audio_ring_free(haptics_ring);
+	haptics_ring = nullptr;
+	haptics_pending_frames = 0;
 #ifdef Q_OS_LINUX
 	// Haptics work most reliably with Pipewire, so try to use that if available
 	SDL_SetHint("SDL_AUDIODRIVER", "pipewire");
@@ -1338,12 +1385,11 @@ void StreamSession::InitHaptics()
 	}
 #endif
 
-	SDL_AudioCVT cvt;
-	SDL_BuildAudioCVT(&cvt, AUDIO_S16SYS, 4, 3000, AUDIO_S16SYS, 4, 48000);
-	cvt.len = 240;  // 10 16bit stereo samples
-	haptics_resampler_buf = (uint8_t*) calloc(cvt.len * cvt.len_mult, sizeof(uint8_t));
-	if(!haptics_resampler_buf)
-		CHIAKI_LOGE(log.GetChiakiLog(),"Haptics resampler buf could not be allocated");
+	chiaki_haptics_resampler_init(&haptics_resampler);
+	// Room for 2 packets of 30 frames, anything beyond that would only add latency
+	haptics_ring = chiaki_audio_ring_new(CHIAKI_HAPTICS_RESAMPLER_CHANNELS_IN, 64, 0);
+	if(!haptics_ring)
+		CHIAKI_LOGE(log.GetChiakiLog(),"Haptics ring could not be allocated");
 }
 
 void StreamSession::DisconnectHaptics()
@@ -1407,9 +1453,9 @@ void StreamSession::ConnectHaptics()
 		CHIAKI_LOGW(this->log.GetChiakiLog(), "Haptics already connected to an attached DualSense controller, ignoring additional controllers.");
 		return;
 	}
-	if (!haptics_resampler_buf)
+	if (!haptics_ring)
 	{
-		CHIAKI_LOGW(this->log.GetChiakiLog(), "Haptics resampler buf wasn't allocated, can't use haptics.");
+		CHIAKI_LOGW(this->log.GetChiakiLog(), "Haptics ring wasn't allocated, can't use haptics.");
 		return;
 	}
 #ifdef Q_OS_MACOS
@@ -1417,11 +1463,14 @@ void StreamSession::ConnectHaptics()
 #endif
 	SDL_AudioSpec want, have;
 	SDL_zero(want);
-	want.freq = 48000;
+	want.freq = CHIAKI_HAPTICS_RESAMPLER_RATE_OUT;
 	want.format = AUDIO_S16SYS;
-	want.channels = 4;
+	want.channels = CHIAKI_HAPTICS_RESAMPLER_CHANNELS_OUT;
 	want.samples = haptics_buffer_size;
-	want.callback = NULL;
+	want.callback = HapticsOutCallback;
+	want.userdata = this;
+	haptics_pending_frames = 0;
+	chiaki_haptics_resampler_reset(&haptics_resampler);
 
 	const char *device_name = nullptr;
 	for (int i=0; i < SDL_GetNumAudioDevices(0); i++)
@@ -1552,51 +1601,51 @@ void StreamSession::ConnectSdeckHaptics()
 }
 #endif
 
+double StreamSession::GetAudioLatency()
+{
+	double latency_ms = 0.0;
+	ChiakiAudioJitterBufferStats stats;
+	if(chiaki_opus_decoder_get_jitter_buffer_stats(&opus_decoder, &stats))
+		latency_ms += (double)stats.latency_us / 1000.0;
+	if(audio_out_ring && audio_out_rate)
+		latency_ms += (double)chiaki_audio_ring_fill(audio_out_ring) * 1000.0 / audio_out_rate;
+	return latency_ms;
+}
+
+static uint16_t AudioGain(int volume)
+{
+	return volume >= SDL_MIX_MAXVOLUME ? CHIAKI_AUDIO_GAIN_UNITY : (uint16_t)(volume * CHIAKI_AUDIO_GAIN_UNITY / SDL_MIX_MAXVOLUME);
+}
+
+void StreamSession::AudioOutCallback(void *user, Uint8 *stream, int len)
+{
+	auto session = reinterpret_cast<StreamSession *>(user);
+	chiaki_audio_ring_read(session->audio_out_ring, (int16_t *)stream,
+			(size_t)len / session->audio_out_sample_size, AudioGain(session->audio_volume));
+}
+
 void StreamSession::PushAudioFrame(int16_t *og_buf, size_t samples_count)
 {
-	if(!audio_out || !audio_volume)
+	if(!audio_out_ring || !audio_volume)
 		return;
 
-	// 2 Channels per sample
-	int16_t buf[samples_count * 2];
-	SDL_memset(buf, 0, sizeof(buf));
-
-	// qDebug() << "Audio queue" << (SDL_GetQueuedAudioSize(audio_out) / audio_out_sample_size / samples_count) * 10 << "ms";
-	// Start draining queue when the latency gets too high
-	if(SDL_GetQueuedAudioSize(audio_out) > 3 * audio_buffer_size)
-		audio_out_drain_queue = true;
+	// The ring resamples slightly to hold its target fill, compensating the drift between the console's and the device's clock.
+	// If it still overflows, e.g. after a stall of the device, the excess is dropped.
+	chiaki_audio_ring_write_compensated(audio_out_ring, og_buf, samples_count);
+	size_t fill = chiaki_audio_ring_fill(audio_out_ring);
+	chiaki_metrics_gauge_set(session.metrics, CHIAKI_METRIC_AUDIO_QUEUE_MS,
+			audio_out_rate ? (double)fill * 1000.0 / audio_out_rate : 0.0);
 
-	if(audio_out_drain_queue)
-	{
-		// Stop when the queue is smaller than configured buffer size
-		if(SDL_GetQueuedAudioSize(audio_out) >= audio_buffer_size)
-			return;
-		audio_out_drain_queue = false;
-	}
-	if(audio_volume < SDL_MIX_MAXVOLUME)
-		SDL_MixAudioFormat((uint8_t *)buf, (uint8_t *)og_buf, AUDIO_S16SYS, sizeof(buf), audio_volume);
-	else
-		memcpy(buf, og_buf, sizeof(buf));
 #if CHIAKI_GUI_ENABLE_SPEEX
-	// change samples to mono for processing with SPEEX
-	if(echo_resampler_buf && speech_processing_enabled && !muted)
-	{
-		SDL_AudioCVT cvt;
-		SDL_BuildAudioCVT(&cvt, AUDIO_S16SYS, 2, 48000, AUDIO_S16SYS, 1, 48000);
-		cvt.len = mic_buf.size_bytes * 2;
-		cvt.buf = echo_resampler_buf;
-		memcpy(echo_resampler_buf, buf, mic_buf.size_bytes * 2);
-		if(SDL_ConvertAudio(&cvt) != 0)
-		{
-			CHIAKI_LOGE(log.GetChiakiLog(), "Failed to resample echo audio: %s", SDL_GetError());
-			return;
-		}
-		if(echo_to_cancel.size() >= ECHO_QUEUE_MAX)
-			echo_to_cancel.dequeue();
-		echo_to_cancel.enqueue((int16_t *)echo_resampler_buf);
+	// Keep what is played as mono at the volume it is played at, stamped with the time it will leave the speakers,
+	// so the mic frames can be matched with the echo they actually picked up.
+	if(echo_ring && mic_connected && audio_out_rate == 48000 && audio_out_sample_size == 2 * sizeof(int16_t))
+	{
+		size_t ahead = fill > samples_count ? fill - samples_count : 0;
+		uint64_t play_time_us = chiaki_time_now_monotonic_us() + ahead * 1000000 / audio_out_rate + audio_out_latency_us;
+		chiaki_echo_ring_write_stereo(echo_ring, og_buf, samples_count, AudioGain(audio_volume), play_time_us);
 	}
 #endif
-	SDL_QueueAudio(audio_out, buf, samples_count * audio_out_sample_size);
 }
 
 #ifdef Q_OS_MACOS
@@ -1734,49 +1783,43 @@ void StreamSession::PushHapticsFrame(uint8_t *buf, size_t buf_size)
 		return;
 	if(ps5_rumble_intensity < 0)
 		return;
-	SDL_AudioCVT cvt;
-	// Haptics samples are coming in at 3KHZ, but the DualSense expects 48KHZ
-	SDL_BuildAudioCVT(&cvt, AUDIO_S16SYS, 4, 3000, AUDIO_S16SYS, 4, 48000);
-	cvt.len = buf_size * 2;
-	cvt.buf = haptics_resampler_buf;
-	// Remix to 4 channels
-	if(haptic_override > 0.99 && haptic_override < 1.01)
-	{
-		for (int i=0; i < buf_size; i+=4)
-		{
-			SDL_memset(haptics_resampler_buf + i * 2, 0, 4);
-			SDL_memcpy(haptics_resampler_buf + (i * 2) + 4, buf + i, 4);
-		}
-	}
-	else
-	{
-		for (int i=0; i < buf_size; i+=4)
-		{
-			SDL_memset(haptics_resampler_buf + i * 2, 0, 4);
-			SDL_memcpy(haptics_resampler_buf + (i * 2) + 4, buf + i, 4);
-			int16_t amplitudel = (*reinterpret_cast<int16_t *>(haptics_resampler_buf + (i * 2) + 4));
-			int32_t adjustedl = static_cast<int32_t>(amplitudel) * haptic_override;
-			adjustedl = (adjustedl > INT16_MAX) ? INT16_MAX : adjustedl;
-			amplitudel = (adjustedl < INT16_MIN) ? INT16_MIN : adjustedl;
-			(*reinterpret_cast<int16_t *>(haptics_resampler_buf + (i * 2) + 4)) = amplitudel;
-			int16_t amplituder = (*reinterpret_cast<int16_t *>(haptics_resampler_buf + (i * 2) + 6));
-			int32_t adjustedr = static_cast<int32_t>(amplituder) * haptic_override;
-			adjustedr = (adjustedr > INT16_MAX) ? INT16_MAX : adjustedr;
-			amplituder = (adjustedr < INT16_MIN) ? INT16_MIN : adjustedr;
-			(*reinterpret_cast<int16_t *>(haptics_resampler_buf + (i * 2) + 6)) = amplituder;
-		}
-	}
-	// Resample to 48kHZ
-	if (SDL_ConvertAudio(&cvt) != 0)
-	{
-		CHIAKI_LOGE(log.GetChiakiLog(), "Failed to resample haptics audio: %s", SDL_GetError());
-		return;
-	}
+	// Only hand the packet over here, resampling happens in the device callback, off the network thread
+	chiaki_audio_ring_write(haptics_ring, (const int16_t *)buf, buf_size / (CHIAKI_HAPTICS_RESAMPLER_CHANNELS_IN * sizeof(int16_t)));
+}
 
-	if (SDL_QueueAudio(haptics_output, cvt.buf, cvt.len_cvt) < 0)
-	{
-		CHIAKI_LOGE(log.GetChiakiLog(), "Failed to submit haptics audio to device: %s", SDL_GetError());
-		return;
+void StreamSession::HapticsOutCallback(void *user, Uint8 *stream, int len)
+{
+	auto session = reinterpret_cast<StreamSession *>(user);
+	const size_t frame_size = CHIAKI_HAPTICS_RESAMPLER_CHANNELS_OUT * sizeof(int16_t);
+	int16_t *out = reinterpret_cast<int16_t *>(stream);
+	size_t frames = (size_t)len / frame_size;
+	chiaki_haptics_resampler_set_gain(&session->haptics_resampler, session->haptic_override);
+
+	// Rest of the last input frame, if the previous call ended in the middle of it
+	size_t n = frames < session->haptics_pending_frames ? frames : session->haptics_pending_frames;
+	memcpy(out, session->haptics_pending + (CHIAKI_HAPTICS_RESAMPLER_RATIO - session->haptics_pending_frames) * CHIAKI_HAPTICS_RESAMPLER_CHANNELS_OUT, n * frame_size);
+	session->haptics_pending_frames -= n;
+	out += n * CHIAKI_HAPTICS_RESAMPLER_CHANNELS_OUT;
+	frames -= n;
+
+	// Underruns are read as silence, which also keeps the resampler's history continuous
+	int16_t in[32 * CHIAKI_HAPTICS_RESAMPLER_CHANNELS_IN];
+	while(frames >= CHIAKI_HAPTICS_RESAMPLER_RATIO)
+	{
+		size_t in_frames = frames / CHIAKI_HAPTICS_RESAMPLER_RATIO;
+		if(in_frames > 32)
+			in_frames = 32;
+		chiaki_audio_ring_read(session->haptics_ring, in, in_frames, CHIAKI_AUDIO_GAIN_UNITY);
+		chiaki_haptics_resampler_process(&session->haptics_resampler, out, in, in_frames);
+		out += in_frames * CHIAKI_HAPTICS_RESAMPLER_RATIO * CHIAKI_HAPTICS_RESAMPLER_CHANNELS_OUT;
+		frames -= in_frames * CHIAKI_HAPTICS_RESAMPLER_RATIO;
+	}
+	if(frames)
+	{
+		chiaki_audio_ring_read(session->haptics_ring, in, 1, CHIAKI_AUDIO_GAIN_UNITY);
+		chiaki_haptics_resampler_process(&session->haptics_resampler, session->haptics_pending, in, 1);
+		memcpy(out, session->haptics_pending, frames * frame_size);
+		session->haptics_pending_frames = CHIAKI_HAPTICS_RESAMPLER_RATIO - frames;
 	}
 }
 
@@ -1819,6 +1862,10 @@ void StreamSession::Event(ChiakiEvent *event)
 		case CHIAKI_EVENT_NICKNAME_RECEIVED:
 			emit NicknameReceived(event->server_nickname);
 			break;
+		case CHIAKI_EVENT_NETWORK_PROFILE:
+			emit NetworkProfileChanged(event->network_profile.profile.mtu_in, event->network_profile.profile.mtu_out,
+					event->network_profile.profile.rtt_us, event->network_profile.valid, event->network_profile.cached);
+			break;
 		case CHIAKI_EVENT_RUMBLE: {
 			if(ps5_rumble_intensity < 0)
 				return;
@@ -2208,6 +2255,9 @@ class StreamSessionPrivate
 
 		static void PushAudioFrame(StreamSession *session, int16_t *buf, size_t samples_count)	{ session->PushAudioFrame(buf, samples_count); }
 		static void PushHapticsFrame(StreamSession *session, uint8_t *buf, size_t buf_size)	{ session->PushHapticsFrame(buf, buf_size); }
+#if CHIAKI_GUI_ENABLE_SPEEX
+		static int16_t *ProcessMicFrame(StreamSession *session, int16_t *pcm, uint64_t capture_us)	{ return session->ProcessMicFrame(pcm, capture_us); }
+#endif
 #ifdef Q_OS_MACOS
 		static void SetMicAuthorization(StreamSession *session, Authorization authorization)                 { session->SetMicAuthorization(authorization); }
 #endif
@@ -2234,6 +2284,14 @@ static void AudioFrameCb(int16_t *buf, size_t samples_count, void *user)
 	StreamSessionPrivate::PushAudioFrame(session, buf, samples_count);
 }
 
+#if CHIAKI_GUI_ENABLE_SPEEX
+static int16_t *MicProcessCb(int16_t *pcm, size_t frames, uint64_t capture_us, void *user)
+{
+	auto session = reinterpret_cast<StreamSession *>(user);
+	return StreamSessionPrivate::ProcessMicFrame(session, pcm, capture_us);
+}
+#endif
+
 #ifdef Q_OS_MACOS
 static void MacMicRequestCb(Authorization authorization, void *user)
 {
@@ -2281,3 +2339,8 @@ static void FfmpegFrameCb(ChiakiFfmpegDecoder *decoder, void *user)
 	auto session = reinterpret_cast<StreamSession *>(user);
 	StreamSessionPrivate::TriggerFfmpegFrameAvailable(session);
 }
+
+static void FfmpegDecodeFeedbackCb(uint64_t sample, bool success, void *user)
+{
+	chiaki_session_video_sample_decoded(reinterpret_cast<ChiakiSession *>(user), sample, success);
+}
@@ -34,6 +34,27 @@ static inline size_t chiaki_audio_header_frame_buf_size(ChiakiAudioHeader *audio
 	return audio_header->frame_size * audio_header->channels * sizeof(int16_t);
 }
 
+#define CHIAKI_AUDIO_GAIN_UNITY 0x8000
+
+/**
+ * dst[i] = src[i] * gain / CHIAKI_AUDIO_GAIN_UNITY, vectorized with SSE2 or NEON where available.
+ * dst and src may be the same buffer.
+ * @param gain Q15, CHIAKI_AUDIO_GAIN_UNITY or above copies src unchanged
+ */
+CHIAKI_EXPORT void chiaki_audio_s16_gain(int16_t *dst, const int16_t *src, size_t samples, uint16_t gain);
+
+/**
+ * Mix interleaved stereo frames down to mono and apply gain in the same pass:
+ * dst[i] = (src[2i] + src[2i + 1]) / 2 * gain / CHIAKI_AUDIO_GAIN_UNITY
+ * @param gain Q15, clamped to CHIAKI_AUDIO_GAIN_UNITY
+ */
+CHIAKI_EXPORT void chiaki_audio_s16_downmix_gain(int16_t *dst, const int16_t *src, size_t frames, uint16_t gain);
+
+/**
+ * Duplicate mono samples into interleaved stereo frames.
+ */
+CHIAKI_EXPORT void chiaki_audio_s16_upmix(int16_t *dst, const int16_t *src, size_t frames);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,107 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#ifndef CHIAKI_AUDIOJITTERBUFFER_H
+#define CHIAKI_AUDIOJITTERBUFFER_H
+
+#include "common.h"
+#include "thread.h"
+#include "seqnum.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define CHIAKI_AUDIO_JITTER_BUFFER_SIZE 0x40 // frames, must be a power of 2
+#define CHIAKI_AUDIO_JITTER_BUFFER_UNIT_SIZE_MAX 0x100 // audio units are at most 0xff bytes
+#define CHIAKI_AUDIO_JITTER_BUFFER_TARGET_MIN 2
+#define CHIAKI_AUDIO_JITTER_BUFFER_TARGET_MAX 20
+#define CHIAKI_AUDIO_JITTER_BUFFER_CONCEAL_MAX 5 // consecutive concealed frames with nothing buffered before rebuffering
+
+typedef enum chiaki_audio_jitter_buffer_result_t
+{
+	CHIAKI_AUDIO_JITTER_BUFFER_NONE, // still buffering, output nothing
+	CHIAKI_AUDIO_JITTER_BUFFER_FRAME, // the frame itself
+	CHIAKI_AUDIO_JITTER_BUFFER_FEC, // the frame is missing, this is the following one to recover it from with in-band FEC
+	CHIAKI_AUDIO_JITTER_BUFFER_PLC // the frame is missing, conceal it
+} ChiakiAudioJitterBufferResult;
+
+typedef struct chiaki_audio_jitter_buffer_stats_t
+{
+	uint64_t latency_us; // currently buffered audio
+	uint64_t target_us;
+	uint64_t jitter_us; // smoothed interarrival jitter (RFC 3550)
+	uint64_t frames_played;
+	uint64_t frames_fec;
+	uint64_t frames_concealed;
+	uint64_t frames_late; // arrived after they were due
+	uint64_t frames_dropped; // dropped to bring the latency down to the target
+	uint64_t underruns;
+} ChiakiAudioJitterBufferStats;
+
+typedef struct chiaki_audio_jitter_buffer_slot_t
+{
+	bool valid;
+	ChiakiSeqNum16 index;
+	size_t size;
+	uint8_t buf[CHIAKI_AUDIO_JITTER_BUFFER_UNIT_SIZE_MAX];
+} ChiakiAudioJitterBufferSlot;
+
+/**
+ * Adaptive jitter buffer for encoded audio frames.
+ *
+ * Frames are pushed as they arrive, in any order and possibly multiple times (source and redundant units),
+ * and popped at a steady rate of one per frame duration by the playout clock.
+ * The target delay follows the measured interarrival jitter.
+ */
+typedef struct chiaki_audio_jitter_buffer_t
+{
+	ChiakiMutex mutex;
+	uint64_t frame_us;
+	ChiakiAudioJitterBufferSlot slots[CHIAKI_AUDIO_JITTER_BUFFER_SIZE];
+
+	bool started; // whether anything was pushed since the last reset
+	bool playing; // false while (re)buffering up to the target
+	bool advanced; // whether anything was popped since the last reset, frames before next_index are late from then on
+	ChiakiSeqNum16 next_index; // next frame to pop
+	ChiakiSeqNum16 newest_index;
+
+	uint64_t arrival_us; // arrival of newest_index
+	uint64_t jitter_us_q4; // fixed point, 4 fractional bits
+	unsigned int target;
+	unsigned int conceal_run;
+	unsigned int above_target_run;
+
+	ChiakiAudioJitterBufferStats stats;
+} ChiakiAudioJitterBuffer;
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_audio_jitter_buffer_init(ChiakiAudioJitterBuffer *jb, uint64_t frame_us);
+CHIAKI_EXPORT void chiaki_audio_jitter_buffer_fini(ChiakiAudioJitterBuffer *jb);
+
+/**
+ * Drop everything buffered and start over, e.g. when the stream parameters change.
+ */
+CHIAKI_EXPORT void chiaki_audio_jitter_buffer_reset(ChiakiAudioJitterBuffer *jb, uint64_t frame_us);
+
+/**
+ * @param now_us monotonic arrival time
+ * @return false if the frame was rejected because it is late, too large or too far ahead
+ */
+CHIAKI_EXPORT bool chiaki_audio_jitter_buffer_push(ChiakiAudioJitterBuffer *jb, ChiakiSeqNum16 index, const uint8_t *buf, size_t buf_size, uint64_t now_us);
+
+/**
+ * Take the data for the next frame period.
+ * @param buf at least CHIAKI_AUDIO_JITTER_BUFFER_UNIT_SIZE_MAX bytes, filled for CHIAKI_AUDIO_JITTER_BUFFER_FRAME and CHIAKI_AUDIO_JITTER_BUFFER_FEC
+ * @param index optional, receives the frame the period is for, also if it is concealed
+ */
+CHIAKI_EXPORT ChiakiAudioJitterBufferResult chiaki_audio_jitter_buffer_pop(ChiakiAudioJitterBuffer *jb, uint8_t *buf, size_t *buf_size, ChiakiSeqNum16 *index);
+
+CHIAKI_EXPORT void chiaki_audio_jitter_buffer_get_stats(ChiakiAudioJitterBuffer *jb, ChiakiAudioJitterBufferStats *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // CHIAKI_AUDIOJITTERBUFFER_H
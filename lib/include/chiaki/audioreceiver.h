@@ -9,6 +9,7 @@
 #include "takion.h"
 #include "thread.h"
 #include "packetstats.h"
+#include "seqnum.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -16,6 +17,7 @@ extern "C" {
 
 typedef void (*ChiakiAudioSinkHeader)(ChiakiAudioHeader *header, void *user);
 typedef void (*ChiakiAudioSinkFrame)(uint8_t *buf, size_t buf_size, void *user);
+typedef void (*ChiakiAudioSinkFrameIndex)(ChiakiSeqNum16 frame_index, uint8_t *buf, size_t buf_size, void *user);
 
 /**
  * Sink that receives Audio encoded as Opus
@@ -25,6 +27,12 @@ typedef struct chiaki_audio_sink_t
 	void *user;
 	ChiakiAudioSinkHeader header_cb;
 	ChiakiAudioSinkFrame frame_cb;
+
+	/**
+	 * Optional, for audio only. If set, it is called instead of frame_cb with every unit as it arrives,
+	 * including redundant copies and units arriving out of order, to be sorted out by a jitter buffer.
+	 */
+	ChiakiAudioSinkFrameIndex frame_index_cb;
 } ChiakiAudioSink;
 
 typedef struct chiaki_audio_receiver_t
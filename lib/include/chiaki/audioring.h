@@ -0,0 +1,77 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#ifndef CHIAKI_AUDIORING_H
+#define CHIAKI_AUDIORING_H
+
+#include "common.h"
+
+#include <stdint.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define CHIAKI_AUDIO_RING_CHANNELS_MAX 8
+#define CHIAKI_AUDIO_RING_DRIFT_PPM_MAX 5000 // largest rate correction applied by chiaki_audio_ring_write_compensated()
+
+/**
+ * Lock-free single producer, single consumer ring of interleaved 16 bit PCM frames
+ * between the thread decoding audio and the callback of the audio device.
+ *
+ * The producer can compensate for the clock drift between the console and the local audio device
+ * by resampling slightly, holding the fill level of the ring at a target.
+ */
+typedef struct chiaki_audio_ring_t ChiakiAudioRing;
+
+typedef struct chiaki_audio_ring_stats_t
+{
+	size_t capacity_frames;
+	size_t target_frames;
+	size_t fill_frames;
+	size_t fill_min; // lowest and highest fill seen by the consumer since the last call
+	size_t fill_max;
+	size_t fill_avg; // smoothed fill seen by the producer
+	int32_t drift_ppm; // current correction, positive if the producer is consuming input faster than nominal
+	uint64_t underrun_frames; // silence the consumer had to insert
+	uint64_t overrun_frames; // frames the producer had to drop because the ring was full
+} ChiakiAudioRingStats;
+
+/**
+ * @param capacity_frames rounded up to a power of 2
+ * @param target_frames fill level to hold with chiaki_audio_ring_write_compensated()
+ */
+CHIAKI_EXPORT ChiakiAudioRing *chiaki_audio_ring_new(unsigned int channels, size_t capacity_frames, size_t target_frames);
+CHIAKI_EXPORT void chiaki_audio_ring_free(ChiakiAudioRing *ring);
+
+/**
+ * Producer only.
+ * @return number of frames written, less than frames if the ring is full
+ */
+CHIAKI_EXPORT size_t chiaki_audio_ring_write(ChiakiAudioRing *ring, const int16_t *buf, size_t frames);
+
+/**
+ * Producer only. Like chiaki_audio_ring_write(), but resamples by up to CHIAKI_AUDIO_RING_DRIFT_PPM_MAX
+ * so the fill level converges on the target.
+ * @return number of frames written after resampling
+ */
+CHIAKI_EXPORT size_t chiaki_audio_ring_write_compensated(ChiakiAudioRing *ring, const int16_t *buf, size_t frames);
+
+/**
+ * Consumer only, e.g. the audio device callback. Always fills all of buf, with silence if the ring runs dry.
+ * @param gain applied while copying, see chiaki_audio_s16_gain()
+ */
+CHIAKI_EXPORT void chiaki_audio_ring_read(ChiakiAudioRing *ring, int16_t *buf, size_t frames, uint16_t gain);
+
+CHIAKI_EXPORT size_t chiaki_audio_ring_fill(ChiakiAudioRing *ring);
+
+/**
+ * Safe from any thread. Resets fill_min and fill_max.
+ */
+CHIAKI_EXPORT void chiaki_audio_ring_get_stats(ChiakiAudioRing *ring, ChiakiAudioRingStats *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // CHIAKI_AUDIORING_H
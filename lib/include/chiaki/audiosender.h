@@ -14,6 +14,7 @@
 extern "C" {
 #endif
 
+#define CHIAKI_AUDIO_SENDER_FEC_UNITS 2 // previous frames repeated in every packet
 
 typedef struct chiaki_audio_sender_t
 {
@@ -23,11 +24,10 @@ typedef struct chiaki_audio_sender_t
 	ChiakiTakion *takion;
 	uint16_t buf_size_per_unit;
 	uint16_t buf_stride_per_unit;
-	uint8_t *frame_buf;
-	uint8_t *framea;
-	uint8_t *frameb;
-	size_t frame_buf_size;
+	uint8_t *history; // last CHIAKI_AUDIO_SENDER_FEC_UNITS opus frames, frame n in slot n % CHIAKI_AUDIO_SENDER_FEC_UNITS
+	uint64_t frames_count; // opus frames ever passed in
 	uint8_t *filled_packet_buf;
+	size_t filled_packet_header_size;
 	ChiakiSeqNum16 frame_index;
 } ChiakiAudioSender;
 
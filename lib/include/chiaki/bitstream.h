@@ -4,6 +4,7 @@
 #define CHIAKI_BITSTREAM_H
 
 #include <stdint.h>
+#include <stddef.h>
 
 #include "common.h"
 #include "log.h"
@@ -49,10 +50,53 @@ typedef struct chiaki_bitstream_slice_t
 	unsigned reference_frame;
 } ChiakiBitstreamSlice;
 
+#define CHIAKI_BITSTREAM_NALUS_MAX 32
+
+typedef struct chiaki_bitstream_nalu_t
+{
+	uint32_t offset; // of the NAL unit header, right after the start code
+	uint32_t size; // up to the next start code, without the start code itself
+	uint8_t start_code_size; // 3 or 4
+	uint8_t type; // nal_unit_type
+} ChiakiBitstreamNalu;
+
+/**
+ * Positions of all NAL units in a frame, built once by chiaki_bitstream_index()
+ * so everything that looks into the frame afterwards doesn't have to scan it again.
+ */
+typedef struct chiaki_bitstream_nal_index_t
+{
+	ChiakiBitstreamNalu nalus[CHIAKI_BITSTREAM_NALUS_MAX];
+	size_t nalus_count;
+	int slice; // index of the first VCL NAL unit in nalus, -1 if there is none
+	bool truncated; // there were more than CHIAKI_BITSTREAM_NALUS_MAX NAL units, the last one extends to the end of the frame
+} ChiakiBitstreamNalIndex;
+
 CHIAKI_EXPORT void chiaki_bitstream_init(ChiakiBitstream *bitstream, ChiakiLog *log, ChiakiCodec codec);
 CHIAKI_EXPORT bool chiaki_bitstream_header(ChiakiBitstream *bitstream, uint8_t *data, unsigned size);
-CHIAKI_EXPORT bool chiaki_bitstream_slice(ChiakiBitstream *bitstream, uint8_t *data, unsigned size, ChiakiBitstreamSlice *slice);
-CHIAKI_EXPORT bool chiaki_bitstream_slice_set_reference_frame(ChiakiBitstream *bitstream, uint8_t *data, unsigned size, unsigned reference_frame);
+
+/**
+ * @return offset of the first 00 00 01 start code prefix in data, or size if there is none
+ */
+CHIAKI_EXPORT size_t chiaki_bitstream_find_start_code(const uint8_t *data, size_t size);
+
+/**
+ * Find all NAL units of an Annex B frame in a single pass.
+ * A zero byte right before a start code prefix is counted as part of a 4 byte start code.
+ */
+CHIAKI_EXPORT void chiaki_bitstream_index(ChiakiBitstream *bitstream, const uint8_t *data, size_t size, ChiakiBitstreamNalIndex *index);
+
+/**
+ * @return whether the first slice in index starts a new coded video sequence that references nothing before it:
+ * an IDR picture for H.264 or an IRAP picture (BLA, IDR, CRA) for H.265
+ */
+CHIAKI_EXPORT bool chiaki_bitstream_index_idr(ChiakiCodec codec, const ChiakiBitstreamNalIndex *index);
+
+/**
+ * Parse the header of the first slice in index, which must have been built from data.
+ */
+CHIAKI_EXPORT bool chiaki_bitstream_slice(ChiakiBitstream *bitstream, uint8_t *data, const ChiakiBitstreamNalIndex *index, ChiakiBitstreamSlice *slice);
+CHIAKI_EXPORT bool chiaki_bitstream_slice_set_reference_frame(ChiakiBitstream *bitstream, uint8_t *data, const ChiakiBitstreamNalIndex *index, unsigned reference_frame);
 
 #ifdef __cplusplus
 }
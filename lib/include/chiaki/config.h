@@ -1,9 +0,0 @@
-// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
-
-#ifndef CHIAKI_CONFIG_H
-#define CHIAKI_CONFIG_H
-
-#define CHIAKI_LIB_ENABLE_OPUS 1
-#define CHIAKI_LIB_ENABLE_PI_DECODER 0
-
-#endif // CHIAKI_CONFIG_H
@@ -6,6 +6,7 @@
 #include "takion.h"
 #include "thread.h"
 #include "packetstats.h"
+#include "workerpool.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -17,14 +18,18 @@ typedef struct chiaki_congestion_control_t
 	ChiakiPacketStats *stats;
 	ChiakiThread thread;
 	ChiakiBoolPredCond stop_cond;
+	ChiakiWorkerLane *lane; // running on a shared pool instead of thread if not NULL
 	double packet_loss;
 	double packet_loss_max;
 } ChiakiCongestionControl;
 
-CHIAKI_EXPORT ChiakiErrorCode chiaki_congestion_control_start(ChiakiCongestionControl *control, ChiakiTakion *takion, ChiakiPacketStats *stats, double packet_loss_max);
+/**
+ * @param pool if not NULL, send the congestion packets from a timer on this pool instead of a thread of its own
+ */
+CHIAKI_EXPORT ChiakiErrorCode chiaki_congestion_control_start(ChiakiCongestionControl *control, ChiakiTakion *takion, ChiakiPacketStats *stats, double packet_loss_max, ChiakiWorkerPool *pool);
 
 /**
- * Stop control and join the thread
+ * Stop control and join the thread, or wait for a run on the pool to finish
  */
 CHIAKI_EXPORT ChiakiErrorCode chiaki_congestion_control_stop(ChiakiCongestionControl *control);
 
@@ -0,0 +1,60 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#ifndef CHIAKI_ECHORING_H
+#define CHIAKI_ECHORING_H
+
+#include "common.h"
+
+#include <stdint.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * History of the mono signal sent to the speakers, indexed by the time it is played,
+ * as the reference for acoustic echo cancellation of the microphone.
+ *
+ * The thread playing audio writes, the thread processing the microphone reads the samples
+ * that were playing at the capture time of each microphone frame. Lock-free, the writer
+ * never waits and the reader gets silence for anything it can't be sure about.
+ */
+typedef struct chiaki_echo_ring_t ChiakiEchoRing;
+
+typedef struct chiaki_echo_ring_stats_t
+{
+	uint64_t samples_read;
+	uint64_t samples_missing; // read as silence, because nothing was played at that time or it was already overwritten
+	int64_t offset_us; // last read position relative to the newest sample, negative is in the past
+} ChiakiEchoRingStats;
+
+/**
+ * @param capacity_samples history to keep, rounded up to a power of 2
+ */
+CHIAKI_EXPORT ChiakiEchoRing *chiaki_echo_ring_new(unsigned int rate, size_t capacity_samples);
+CHIAKI_EXPORT void chiaki_echo_ring_free(ChiakiEchoRing *ring);
+
+/**
+ * Writer only. Mixes the frames down to mono with the playback gain applied directly into the ring.
+ * @param play_time_us monotonic time at which the first frame will be played
+ */
+CHIAKI_EXPORT void chiaki_echo_ring_write_stereo(ChiakiEchoRing *ring, const int16_t *frames, size_t count, uint16_t gain, uint64_t play_time_us);
+
+/**
+ * Reader only.
+ * @param time_us monotonic time at which the first requested sample was played
+ * @return number of samples that were actually available, the rest of buf is silence
+ */
+CHIAKI_EXPORT size_t chiaki_echo_ring_read(ChiakiEchoRing *ring, int16_t *buf, size_t samples, uint64_t time_us);
+
+/**
+ * Reader only.
+ */
+CHIAKI_EXPORT void chiaki_echo_ring_get_stats(ChiakiEchoRing *ring, ChiakiEchoRingStats *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // CHIAKI_ECHORING_H
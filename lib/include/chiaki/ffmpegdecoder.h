@@ -4,6 +4,8 @@
 #include <chiaki/config.h>
 #include <chiaki/log.h>
 #include <chiaki/thread.h>
+#include <chiaki/trace.h>
+#include <chiaki/metrics.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -15,10 +17,79 @@ typedef struct chiaki_ffmpeg_decoder_t ChiakiFfmpegDecoder;
 
 typedef void (*ChiakiFfmpegFrameAvailable)(ChiakiFfmpegDecoder *decover, void *user);
 
+/**
+ * Outcome of decoding a video sample, called from the decode thread.
+ * @param sample number of the call of chiaki_ffmpeg_decoder_video_sample_cb() with it, counting from 0
+ */
+typedef void (*ChiakiFfmpegDecodeFeedback)(uint64_t sample, bool success, void *user);
+
+#define CHIAKI_FFMPEG_DECODER_PACKET_QUEUE_SIZE 16 // must be a power of 2
+#define CHIAKI_FFMPEG_DECODER_FRAME_QUEUE_SIZE 4
+
+/**
+ * What to do with incoming frames when the decode thread has fallen behind and the packet queue is full.
+ */
+typedef enum chiaki_ffmpeg_decoder_drop_policy_t
+{
+	/**
+	 * Keep every frame, the receiving thread waits until the decode thread has made room.
+	 */
+	CHIAKI_FFMPEG_DECODER_DROP_DRAIN,
+
+	/**
+	 * Reject frames until the next IDR/IRAP frame and skip everything still queued before it.
+	 * Rejected frames are reported as failed to the video receiver, which reports them as corrupt to the console.
+	 */
+	CHIAKI_FFMPEG_DECODER_DROP_SKIP_TO_IDR
+} ChiakiFfmpegDecoderDropPolicy;
+
+typedef enum chiaki_ffmpeg_decoder_threading_t
+{
+	CHIAKI_FFMPEG_DECODER_THREADING_DEFAULT, // leave libavcodec's defaults
+	CHIAKI_FFMPEG_DECODER_THREADING_SLICE, // lowest latency, but only scales with the number of slices per frame
+	CHIAKI_FFMPEG_DECODER_THREADING_FRAME // highest throughput, but delays every frame by up to thread_count - 1 frames
+} ChiakiFfmpegDecoderThreading;
+
+CHIAKI_EXPORT const char *chiaki_ffmpeg_decoder_threading_name(ChiakiFfmpegDecoderThreading threading);
+
+typedef struct chiaki_ffmpeg_decoder_options_t
+{
+	ChiakiFfmpegDecoderThreading threading;
+	int thread_count; // 0 to let libavcodec choose from the number of cores, ignored for CHIAKI_FFMPEG_DECODER_THREADING_DEFAULT
+	bool low_delay; // AV_CODEC_FLAG_LOW_DELAY, disables frame threading in libavcodec
+	bool fast; // AV_CODEC_FLAG2_FAST, allows speedups that are not bit-exact
+	ChiakiFfmpegDecoderDropPolicy drop_policy;
+} ChiakiFfmpegDecoderOptions;
+
+/**
+ * Defaults matching the behavior before options existed: libavcodec threading defaults, no flags, drain.
+ */
+CHIAKI_EXPORT void chiaki_ffmpeg_decoder_options_default(ChiakiFfmpegDecoderOptions *options);
+
+typedef struct chiaki_ffmpeg_decoder_frame_stats_t
+{
+	uint64_t queue_us; // time the packet waited for the decode thread
+	uint64_t decode_us; // time from sending the packet to the codec until the frame came out
+	uint64_t frames_replaced; // decoded frames that were replaced by newer ones before being pulled
+	// the following are 0 if the packet of the frame is unknown, like queue_us and decode_us
+	uint64_t sample; // number of the video sample callback call with the frame, as for chiaki_session_video_sample_decoded()
+	uint64_t enqueue_us; // monotonic time the sample was passed to the decoder, right after the frame was received
+	uint64_t decoded_us; // monotonic time the frame came out of the codec
+} ChiakiFfmpegDecoderFrameStats;
+
+typedef struct chiaki_ffmpeg_decoder_worker_t ChiakiFfmpegDecoderWorker;
+
+/**
+ * Decodes on its own thread, so a slow decode never stalls the thread receiving the stream.
+ *
+ * chiaki_ffmpeg_decoder_video_sample_cb() copies each frame into a bounded lock-free packet queue,
+ * decoded frames are collected in a frame queue of CHIAKI_FFMPEG_DECODER_FRAME_QUEUE_SIZE
+ * and frame_available_cb is called from the decode thread.
+ */
 struct chiaki_ffmpeg_decoder_t
 {
 	ChiakiLog *log;
-	ChiakiMutex mutex;
+	ChiakiMutex mutex; // guards the frame queue, frames_lost, frame_recovered and feedback_cb
 	const AVCodec *av_codec;
 	AVCodecContext *codec_context;
 	enum AVPixelFormat hw_pix_fmt;
@@ -30,16 +101,57 @@ struct chiaki_ffmpeg_decoder_t
 	int32_t frames_lost;
 	bool frame_recovered;
 	int32_t session_bitrate_kbps;
+	ChiakiMetrics *metrics; // optional, set by the owner to record decode times
+	ChiakiFfmpegDecodeFeedback feedback_cb; // optional, see chiaki_ffmpeg_decoder_set_feedback_cb()
+	void *feedback_cb_user;
+	ChiakiFfmpegDecoderDropPolicy drop_policy; // initialized from the options, may be changed by the owner before the stream starts
+	ChiakiFfmpegDecoderWorker *worker;
 };
 
 CHIAKI_EXPORT ChiakiErrorCode chiaki_ffmpeg_decoder_init(ChiakiFfmpegDecoder *decoder, ChiakiLog *log,
 		ChiakiCodec codec, const char *hw_decoder_name, AVBufferRef *hw_device_ctx,
-		ChiakiFfmpegFrameAvailable frame_available_cb, void *frame_available_cb_user);
+		ChiakiFfmpegFrameAvailable frame_available_cb, void *frame_available_cb_user,
+		const ChiakiFfmpegDecoderOptions *options);
 CHIAKI_EXPORT void chiaki_ffmpeg_decoder_fini(ChiakiFfmpegDecoder *decoder);
 CHIAKI_EXPORT bool chiaki_ffmpeg_decoder_video_sample_cb(uint8_t *buf, size_t buf_size, int32_t frames_lost, bool frame_recovered, void *user);
+
+/**
+ * Report the outcome of each sample, e.g. to chiaki_session_video_sample_decoded().
+ * Once this returns, the previous callback is not called anymore, so it can be reset to NULL before whatever it reports to goes away.
+ */
+CHIAKI_EXPORT void chiaki_ffmpeg_decoder_set_feedback_cb(ChiakiFfmpegDecoder *decoder, ChiakiFfmpegDecodeFeedback cb, void *user);
+
+/**
+ * Take the newest decoded frame, older frames that have not been pulled yet are discarded.
+ * @return a frame owned by the caller, to be released with chiaki_ffmpeg_frame_free(),
+ * or NULL if no new frame was decoded since the last call
+ */
 CHIAKI_EXPORT AVFrame *chiaki_ffmpeg_decoder_pull_frame(ChiakiFfmpegDecoder *decoder, int32_t *frames_lost);
+
+/**
+ * Like chiaki_ffmpeg_decoder_pull_frame(), additionally filling stats for the returned frame if not NULL.
+ */
+CHIAKI_EXPORT AVFrame *chiaki_ffmpeg_decoder_pull_frame_stats(ChiakiFfmpegDecoder *decoder, int32_t *frames_lost, ChiakiFfmpegDecoderFrameStats *stats);
 CHIAKI_EXPORT enum AVPixelFormat chiaki_ffmpeg_decoder_get_pixel_format(ChiakiFfmpegDecoder *decoder);
 
+/**
+ * Drop-in replacements for av_frame_alloc()/av_frame_free() that recycle AVFrames through a small process-wide pool,
+ * shared by the decoder and whoever consumes its frames (e.g. for hardware transfers), independent of any decoder's lifetime.
+ * The image buffers themselves are already recycled by the buffer pools of libavcodec when a frame is unreferenced.
+ */
+CHIAKI_EXPORT AVFrame *chiaki_ffmpeg_frame_alloc();
+CHIAKI_EXPORT void chiaki_ffmpeg_frame_free(AVFrame **frame);
+
+/**
+ * @return the frame index a decoded frame belongs to if tracing was enabled when it was pushed, else CHIAKI_TRACE_FRAME_NONE
+ */
+static inline int64_t chiaki_ffmpeg_decoder_frame_trace_index(AVFrame *frame)
+{
+	if(!frame || frame->pts == AV_NOPTS_VALUE)
+		return CHIAKI_TRACE_FRAME_NONE;
+	return frame->pts;
+}
+
 #ifdef __cplusplus
 }
 #endif
@@ -14,15 +14,60 @@
 extern "C" {
 #endif
 
+#define CHIAKI_STREAM_STATS_WINDOW_US 2000000
+#define CHIAKI_STREAM_STATS_WINDOW_FRAMES_MAX 512 // must be a power of 2, enough for 240 fps over the whole window
+
+typedef struct chiaki_stream_stats_sample_t
+{
+	uint64_t ts_us;
+	uint32_t size;
+} ChiakiStreamStatsSample;
+
+/**
+ * Time-based sliding window over the completed video frames.
+ * Updating is O(1) amortized per frame, everything derived is computed in chiaki_stream_stats_window().
+ */
 typedef struct chiaki_stream_stats_t
 {
-	uint64_t frames;
-	uint64_t bytes;
+	uint64_t frames; // total since the last reset
+	uint64_t bytes; // total since the last reset
+
+	ChiakiStreamStatsSample samples[CHIAKI_STREAM_STATS_WINDOW_FRAMES_MAX]; // ring buffer
+	uint64_t samples_head; // total number of samples ever written, the next one goes to samples_head % size
+
+	uint64_t iframe_last_ts_us;
+	uint64_t iframe_last_size;
+	uint64_t iframe_interval_us; // between the last two I-frames, 0 if unknown
 } ChiakiStreamStats;
 
+typedef struct chiaki_stream_stats_window_t
+{
+	uint64_t frames; // frames in the window
+	uint64_t span_us; // time between the oldest and newest frame in the window
+	uint64_t bitrate; // bits per second
+	double fps;
+	uint64_t frame_size_p50;
+	uint64_t frame_size_p95;
+	uint64_t frame_size_max;
+	uint64_t iframe_size; // size of the last I-frame, 0 if none was seen yet
+	uint64_t iframe_interval_us; // between the last two I-frames, 0 if unknown
+} ChiakiStreamStatsWindow;
+
 CHIAKI_EXPORT void chiaki_stream_stats_reset(ChiakiStreamStats *stats);
 CHIAKI_EXPORT void chiaki_stream_stats_frame(ChiakiStreamStats *stats, uint64_t size);
-CHIAKI_EXPORT uint64_t chiaki_stream_stats_bitrate(ChiakiStreamStats *stats, uint64_t framerate);
+CHIAKI_EXPORT void chiaki_stream_stats_frame_at(ChiakiStreamStats *stats, uint64_t size, uint64_t ts_us);
+
+/**
+ * Mark the frame last passed to chiaki_stream_stats_frame() as an I-frame.
+ */
+CHIAKI_EXPORT void chiaki_stream_stats_iframe(ChiakiStreamStats *stats);
+
+/**
+ * Derive the current statistics from the window ending at now_us.
+ * Frames older than CHIAKI_STREAM_STATS_WINDOW_US before now_us are not considered.
+ */
+CHIAKI_EXPORT void chiaki_stream_stats_window_at(ChiakiStreamStats *stats, uint64_t now_us, ChiakiStreamStatsWindow *window);
+CHIAKI_EXPORT void chiaki_stream_stats_window(ChiakiStreamStats *stats, ChiakiStreamStatsWindow *window);
 
 struct chiaki_frame_unit_t;
 typedef struct chiaki_frame_unit_t ChiakiFrameUnit;
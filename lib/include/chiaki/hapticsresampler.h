@@ -0,0 +1,61 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#ifndef CHIAKI_HAPTICSRESAMPLER_H
+#define CHIAKI_HAPTICSRESAMPLER_H
+
+#include "common.h"
+
+#include <stdint.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define CHIAKI_HAPTICS_RESAMPLER_RATE_IN 3000
+#define CHIAKI_HAPTICS_RESAMPLER_RATE_OUT 48000
+#define CHIAKI_HAPTICS_RESAMPLER_RATIO (CHIAKI_HAPTICS_RESAMPLER_RATE_OUT / CHIAKI_HAPTICS_RESAMPLER_RATE_IN)
+#define CHIAKI_HAPTICS_RESAMPLER_TAPS 8 // per phase
+#define CHIAKI_HAPTICS_RESAMPLER_CHANNELS_IN 2
+#define CHIAKI_HAPTICS_RESAMPLER_CHANNELS_OUT 4
+#define CHIAKI_HAPTICS_RESAMPLER_DELAY (CHIAKI_HAPTICS_RESAMPLER_TAPS / 2) // input frames
+#define CHIAKI_HAPTICS_RESAMPLER_GAIN_MAX 2.0f
+
+/**
+ * Upsamples the stereo 3 kHz haptics stream of the console to the 4 channel 48 kHz layout
+ * of the DualSense audio device, with the haptics on channels 2 and 3 and silence on 0 and 1.
+ *
+ * Polyphase FIR with precomputed windowed sinc taps. The gain is folded into the taps
+ * and the output is clamped while packing, so everything happens in a single pass,
+ * vectorized with SSE2 or NEON where available.
+ */
+typedef struct chiaki_haptics_resampler_t
+{
+	float gain;
+	int16_t taps[CHIAKI_HAPTICS_RESAMPLER_RATIO * CHIAKI_HAPTICS_RESAMPLER_TAPS]; // scaled by gain, Q14, layout depends on the kernel
+	int16_t history[CHIAKI_HAPTICS_RESAMPLER_CHANNELS_IN][CHIAKI_HAPTICS_RESAMPLER_TAPS - 1]; // last input frames, oldest first
+} ChiakiHapticsResampler;
+
+CHIAKI_EXPORT void chiaki_haptics_resampler_init(ChiakiHapticsResampler *resampler);
+
+/**
+ * @param gain clamped to [0, CHIAKI_HAPTICS_RESAMPLER_GAIN_MAX]
+ */
+CHIAKI_EXPORT void chiaki_haptics_resampler_set_gain(ChiakiHapticsResampler *resampler, float gain);
+
+/**
+ * Forget the history, e.g. after a gap in the input.
+ */
+CHIAKI_EXPORT void chiaki_haptics_resampler_reset(ChiakiHapticsResampler *resampler);
+
+/**
+ * @param out receives in_frames * CHIAKI_HAPTICS_RESAMPLER_RATIO frames of CHIAKI_HAPTICS_RESAMPLER_CHANNELS_OUT channels
+ * @param in interleaved frames of CHIAKI_HAPTICS_RESAMPLER_CHANNELS_IN channels
+ */
+CHIAKI_EXPORT void chiaki_haptics_resampler_process(ChiakiHapticsResampler *resampler, int16_t *out, const int16_t *in, size_t in_frames);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // CHIAKI_HAPTICSRESAMPLER_H
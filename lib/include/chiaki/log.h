@@ -5,8 +5,14 @@
 
 #include <stdint.h>
 #include <stdlib.h>
+#include <stdbool.h>
 
 #include "common.h"
+#include <chiaki/config.h>
+
+#ifndef __cplusplus
+#include <stdatomic.h>
+#endif
 
 #ifdef __cplusplus
 extern "C" {
@@ -26,16 +32,50 @@ CHIAKI_EXPORT char chiaki_log_level_char(ChiakiLogLevel level);
 
 typedef void (*ChiakiLogCb)(ChiakiLogLevel level, const char *msg, void *user);
 
+typedef struct chiaki_log_async_t ChiakiLogAsync;
+
 typedef struct chiaki_log_t
 {
 	uint32_t level_mask;
 	ChiakiLogCb cb;
 	void *user;
+	ChiakiLogAsync *async;
 } ChiakiLog;
 
 CHIAKI_EXPORT void chiaki_log_init(ChiakiLog *log, uint32_t level_mask, ChiakiLogCb cb, void *user);
 CHIAKI_EXPORT void chiaki_log_set_level(ChiakiLog *log, uint32_t level_mask);
 
+#define CHIAKI_LOG_ASYNC_MSG_SIZE 0x200
+#define CHIAKI_LOG_ASYNC_QUEUE_SIZE 0x400
+
+/**
+ * Deliver messages of log asynchronously.
+ *
+ * Afterwards, the logging thread only formats the message into a bounded lock-free queue
+ * (truncated to CHIAKI_LOG_ASYNC_MSG_SIZE) and a background thread invokes the callback.
+ * If the queue is full, messages are dropped and the number of dropped messages is reported as a warning.
+ *
+ * Must not be called while other threads may be logging into log.
+ */
+CHIAKI_EXPORT ChiakiErrorCode chiaki_log_async_start(ChiakiLog *log);
+
+/**
+ * Deliver all pending messages and go back to invoking the callback synchronously.
+ * Must not be called while other threads may be logging into log.
+ */
+CHIAKI_EXPORT void chiaki_log_async_stop(ChiakiLog *log);
+
+/**
+ * @return the total number of messages dropped because the queue was full
+ */
+CHIAKI_EXPORT uint64_t chiaki_log_async_dropped(ChiakiLog *log);
+
+/**
+ * Wall clock time in ms since the epoch when the message currently being delivered was logged.
+ * Only meaningful inside a ChiakiLogCb, returns the current time for synchronous logs.
+ */
+CHIAKI_EXPORT uint64_t chiaki_log_timestamp_ms();
+
 /**
  * Logging callback (ChiakiLogCb) that prints to stdout
  */
@@ -51,6 +91,60 @@ CHIAKI_EXPORT void chiaki_log_hexdump_raw(ChiakiLog *log, ChiakiLogLevel level,
 #define CHIAKI_LOGW(log, ...) do { chiaki_log((log), CHIAKI_LOG_WARNING, __VA_ARGS__); } while(0)
 #define CHIAKI_LOGE(log, ...) do { chiaki_log((log), CHIAKI_LOG_ERROR, __VA_ARGS__); } while(0)
 
+#ifndef __cplusplus
+/**
+ * Token bucket state of a single rate-limited log site, see chiaki_log_rate_limit().
+ * Zero-initialized (e.g. static) state is a full bucket.
+ */
+typedef struct chiaki_log_rate_limit_t
+{
+	atomic_uint_fast64_t state; // (last refill in ms << 8) | tokens
+	atomic_uint_fast64_t suppressed;
+} ChiakiLogRateLimit;
+
+#define CHIAKI_LOG_RATE_LIMIT_BURST 10
+#define CHIAKI_LOG_RATE_LIMIT_REFILL_MS 200
+
+/**
+ * Decide whether a message of a hot-path log site should be emitted.
+ *
+ * Every site may emit CHIAKI_LOG_RATE_LIMIT_BURST messages at once and one more every CHIAKI_LOG_RATE_LIMIT_REFILL_MS.
+ * Messages beyond that are counted and, when the site is allowed to log again,
+ * a single "Suppressed N similar messages" line is emitted in their place.
+ * Messages filtered by the level mask neither consume tokens nor count as suppressed.
+ *
+ * Safe to call from multiple threads with the same rl.
+ *
+ * @return true if the caller should log now
+ */
+CHIAKI_EXPORT bool chiaki_log_rate_limit(ChiakiLog *log, ChiakiLogLevel level, ChiakiLogRateLimit *rl);
+
+/**
+ * Log through a token bucket owned by the call site, for messages that may be triggered per packet.
+ * To rate-limit a message together with a hexdump, use chiaki_log_rate_limit() with a static ChiakiLogRateLimit directly.
+ */
+#define CHIAKI_LOG_RL(log, level, ...) do { \
+		static ChiakiLogRateLimit chiaki_log_rl_; \
+		if(chiaki_log_rate_limit((log), (level), &chiaki_log_rl_)) \
+			chiaki_log((log), (level), __VA_ARGS__); \
+	} while(0)
+
+/*
+ * Verbose and debug hot-path sites are only compiled in if CHIAKI_LIB_ENABLE_HOT_PATH_VERBOSE_LOGS is set,
+ * which is off for release builds by default. The disabled variants still type-check their arguments.
+ */
+#if CHIAKI_LIB_ENABLE_HOT_PATH_VERBOSE_LOGS
+#define CHIAKI_LOGD_RL(log, ...) CHIAKI_LOG_RL(log, CHIAKI_LOG_DEBUG, __VA_ARGS__)
+#define CHIAKI_LOGV_RL(log, ...) CHIAKI_LOG_RL(log, CHIAKI_LOG_VERBOSE, __VA_ARGS__)
+#else
+#define CHIAKI_LOGD_RL(log, ...) do { if(0) chiaki_log((log), CHIAKI_LOG_DEBUG, __VA_ARGS__); } while(0)
+#define CHIAKI_LOGV_RL(log, ...) do { if(0) chiaki_log((log), CHIAKI_LOG_VERBOSE, __VA_ARGS__); } while(0)
+#endif
+#define CHIAKI_LOGI_RL(log, ...) CHIAKI_LOG_RL(log, CHIAKI_LOG_INFO, __VA_ARGS__)
+#define CHIAKI_LOGW_RL(log, ...) CHIAKI_LOG_RL(log, CHIAKI_LOG_WARNING, __VA_ARGS__)
+#define CHIAKI_LOGE_RL(log, ...) CHIAKI_LOG_RL(log, CHIAKI_LOG_ERROR, __VA_ARGS__)
+#endif
+
 typedef struct chiaki_log_sniffer_t
 {
 	ChiakiLog *forward_log; // The original log, where everything is forwarded
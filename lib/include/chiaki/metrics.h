@@ -0,0 +1,158 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#ifndef CHIAKI_METRICS_H
+#define CHIAKI_METRICS_H
+
+#include "common.h"
+#include "log.h"
+#include "thread.h"
+#include "sock.h"
+#include "stoppipe.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Live stream metrics of a session.
+ *
+ * Updating a metric is lock-free and safe from any thread, so it can be done on the hot path.
+ * All update functions accept a NULL registry and do nothing in that case.
+ */
+
+typedef enum chiaki_metric_t
+{
+	// counters
+	CHIAKI_METRIC_VIDEO_FRAMES = 0,
+	CHIAKI_METRIC_VIDEO_BYTES,
+	CHIAKI_METRIC_VIDEO_FRAMES_LOST,
+	CHIAKI_METRIC_VIDEO_FRAMES_RECOVERED,
+	CHIAKI_METRIC_VIDEO_DECODE_FAILURES,
+	CHIAKI_METRIC_VIDEO_RECOVERY_REQUESTS,
+	CHIAKI_METRIC_VIDEO_RECOVERY_IDR_WAITS,
+	CHIAKI_METRIC_VIDEO_FRAMES_DROPPED,
+	CHIAKI_METRIC_FEC_ATTEMPTS,
+	CHIAKI_METRIC_FEC_SUCCESSES,
+	CHIAKI_METRIC_KEYSTREAM_MISSES,
+	CHIAKI_METRIC_AUDIO_FRAMES,
+	CHIAKI_METRIC_AUDIO_FRAMES_CONCEALED,
+	CHIAKI_METRIC_MIC_FRAMES,
+	CHIAKI_METRIC_MIC_FRAMES_DROPPED,
+	CHIAKI_METRIC_RECORDER_BYTES,
+	CHIAKI_METRIC_RECORDER_PACKETS_DROPPED,
+
+	// gauges
+	CHIAKI_METRIC_BITRATE_MBPS,
+	CHIAKI_METRIC_FPS,
+	CHIAKI_METRIC_PACKET_LOSS,
+	CHIAKI_METRIC_RTT_MS,
+	CHIAKI_METRIC_SEND_BUFFER_PACKETS,
+	CHIAKI_METRIC_AUDIO_QUEUE_MS,
+	CHIAKI_METRIC_AUDIO_JITTER_BUFFER_MS,
+
+	// histograms
+	CHIAKI_METRIC_DECODE_TIME_MS,
+	CHIAKI_METRIC_MIC_LATENCY_MS,
+
+	CHIAKI_METRIC_COUNT
+} ChiakiMetric;
+
+typedef enum chiaki_metric_type_t
+{
+	CHIAKI_METRIC_TYPE_COUNTER,
+	CHIAKI_METRIC_TYPE_GAUGE,
+	CHIAKI_METRIC_TYPE_HISTOGRAM
+} ChiakiMetricType;
+
+#define CHIAKI_METRICS_HISTOGRAM_BUCKETS_MAX 12
+
+CHIAKI_EXPORT const char *chiaki_metric_name(ChiakiMetric metric);
+CHIAKI_EXPORT const char *chiaki_metric_help(ChiakiMetric metric);
+CHIAKI_EXPORT ChiakiMetricType chiaki_metric_type(ChiakiMetric metric);
+
+/**
+ * @return upper bounds of the histogram buckets, excluding the implicit +Inf bucket, or NULL if metric is not a histogram
+ */
+CHIAKI_EXPORT const double *chiaki_metric_histogram_bounds(ChiakiMetric metric, size_t *count);
+
+typedef struct chiaki_metrics_t ChiakiMetrics;
+
+typedef struct chiaki_metric_value_t
+{
+	double value; // counters and gauges
+	// histograms only, buckets are not cumulative and the last one is +Inf
+	uint64_t count;
+	double sum;
+	uint64_t buckets[CHIAKI_METRICS_HISTOGRAM_BUCKETS_MAX + 1];
+} ChiakiMetricValue;
+
+typedef struct chiaki_metrics_snapshot_t
+{
+	uint64_t timestamp_ms; // wall clock
+	ChiakiMetricValue values[CHIAKI_METRIC_COUNT];
+} ChiakiMetricsSnapshot;
+
+CHIAKI_EXPORT ChiakiMetrics *chiaki_metrics_new();
+CHIAKI_EXPORT void chiaki_metrics_free(ChiakiMetrics *metrics);
+CHIAKI_EXPORT void chiaki_metrics_reset(ChiakiMetrics *metrics);
+
+CHIAKI_EXPORT void chiaki_metrics_counter_add(ChiakiMetrics *metrics, ChiakiMetric metric, uint64_t value);
+static inline void chiaki_metrics_counter_inc(ChiakiMetrics *metrics, ChiakiMetric metric) { chiaki_metrics_counter_add(metrics, metric, 1); }
+CHIAKI_EXPORT void chiaki_metrics_gauge_set(ChiakiMetrics *metrics, ChiakiMetric metric, double value);
+CHIAKI_EXPORT void chiaki_metrics_histogram_observe(ChiakiMetrics *metrics, ChiakiMetric metric, double value);
+
+/**
+ * Take a consistent-enough copy of all metrics for polling.
+ * Individual values are read atomically, but the snapshot as a whole is not taken under a lock.
+ */
+CHIAKI_EXPORT void chiaki_metrics_snapshot(ChiakiMetrics *metrics, ChiakiMetricsSnapshot *snapshot);
+
+/**
+ * Format a snapshot in the Prometheus text exposition format.
+ * @param labels optional label set without braces added to every sample, e.g. "instance=\"kiosk-12\""
+ * @param buf_size input: size of buf, output: number of bytes written, excluding the terminating null
+ * @return CHIAKI_ERR_BUF_TOO_SMALL if buf was not large enough
+ */
+CHIAKI_EXPORT ChiakiErrorCode chiaki_metrics_format_prometheus(const ChiakiMetricsSnapshot *snapshot, const char *labels, char *buf, size_t *buf_size);
+
+/**
+ * Format a snapshot as a single line of JSON, including the trailing newline.
+ * @param buf_size input: size of buf, output: number of bytes written, excluding the terminating null
+ */
+CHIAKI_EXPORT ChiakiErrorCode chiaki_metrics_format_json(const ChiakiMetricsSnapshot *snapshot, char *buf, size_t *buf_size);
+
+/**
+ * Background thread exporting a metrics registry.
+ * It can serve the Prometheus text format over HTTP on localhost and/or append JSON lines to a file.
+ */
+typedef struct chiaki_metrics_exporter_t
+{
+	ChiakiLog *log;
+	ChiakiMetrics *metrics;
+	char *labels;
+	chiaki_socket_t listen_sock;
+	FILE *json_file;
+	uint64_t json_interval_ms;
+	uint64_t json_last_ms;
+	ChiakiStopPipe stop_pipe;
+	ChiakiThread thread;
+} ChiakiMetricsExporter;
+
+/**
+ * @param port if non-zero, serve the Prometheus text format on 127.0.0.1:port
+ * @param json_path if not NULL, append one JSON line every json_interval_ms to this file
+ * @param labels optional Prometheus labels, see chiaki_metrics_format_prometheus()
+ */
+CHIAKI_EXPORT ChiakiErrorCode chiaki_metrics_exporter_start(ChiakiMetricsExporter *exporter, ChiakiLog *log, ChiakiMetrics *metrics,
+		uint16_t port, const char *json_path, uint64_t json_interval_ms, const char *labels);
+CHIAKI_EXPORT void chiaki_metrics_exporter_stop(ChiakiMetricsExporter *exporter);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // CHIAKI_METRICS_H
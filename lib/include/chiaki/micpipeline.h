@@ -0,0 +1,100 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#ifndef CHIAKI_MICPIPELINE_H
+#define CHIAKI_MICPIPELINE_H
+
+#include <chiaki/config.h>
+#if CHIAKI_LIB_ENABLE_OPUS
+
+#include "common.h"
+#include "log.h"
+#include "thread.h"
+#include "audioring.h"
+#include "opusencoder.h"
+#include "metrics.h"
+
+#include <stdint.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Called on the pipeline thread for every complete frame before it is encoded, e.g. for echo cancellation.
+ * @param pcm frame_size captured frames, may be modified in place
+ * @param capture_us monotonic capture time of the first frame
+ * @return the frame to encode, in the channel layout of the encoder, or NULL to skip it
+ */
+typedef int16_t *(*ChiakiMicPipelineProcessCallback)(int16_t *pcm, size_t frames, uint64_t capture_us, void *user);
+
+typedef struct chiaki_mic_pipeline_stats_t
+{
+	uint64_t frames_sent;
+	uint64_t frames_dropped; // captured frames lost because the pipeline thread fell behind
+	uint64_t latency_us_last; // from capturing the last sample of a frame until it was handed to takion
+	uint64_t latency_us_avg;
+	uint64_t latency_us_max;
+} ChiakiMicPipelineStats;
+
+/**
+ * Capture -> process -> encode -> send on a dedicated thread.
+ *
+ * The capture callback of the audio device only copies into a preallocated ring and wakes the thread,
+ * which cuts the captured audio into encoder frames, runs the process callback and sends the result
+ * through the opus encoder. Nothing is allocated after start.
+ */
+typedef struct chiaki_mic_pipeline_t
+{
+	ChiakiLog *log;
+	ChiakiOpusEncoder *encoder;
+	ChiakiMetrics *metrics;
+	unsigned int channels;
+	unsigned int rate;
+	size_t frame_size; // frames per encoder frame
+	ChiakiMicPipelineProcessCallback process_cb;
+	void *process_cb_user;
+
+	ChiakiAudioRing *ring;
+	int16_t *frame_buf;
+	ChiakiThread thread;
+	ChiakiMutex mutex; // protects everything below
+	ChiakiCond cond;
+	bool should_stop;
+	uint64_t flush_until; // captured frames up to here are discarded
+	uint64_t captured_frames; // frames ever accepted into the ring
+	uint64_t capture_end_us; // capture time after the last accepted frame
+	uint64_t read_frames; // frames taken out of the ring by the pipeline thread
+	ChiakiMicPipelineStats stats;
+} ChiakiMicPipeline;
+
+/**
+ * @param encoder must already be set up with chiaki_opus_encoder_header() and stay valid until stopped
+ * @param channels captured channels, must match the encoder if process_cb is NULL
+ * @param metrics optional
+ */
+CHIAKI_EXPORT ChiakiErrorCode chiaki_mic_pipeline_start(ChiakiMicPipeline *pipeline, ChiakiLog *log, ChiakiOpusEncoder *encoder,
+		unsigned int channels, unsigned int rate, ChiakiMicPipelineProcessCallback process_cb, void *process_cb_user, ChiakiMetrics *metrics);
+CHIAKI_EXPORT void chiaki_mic_pipeline_stop(ChiakiMicPipeline *pipeline);
+
+/**
+ * To be called from the capture callback of the audio device. Never waits for the encoder,
+ * if the pipeline falls behind by more than about half a second, the excess is dropped.
+ * @param capture_end_us monotonic capture time after the last frame in pcm
+ */
+CHIAKI_EXPORT void chiaki_mic_pipeline_push(ChiakiMicPipeline *pipeline, const int16_t *pcm, size_t frames, uint64_t capture_end_us);
+
+/**
+ * Discard captured audio that was not encoded yet, e.g. when muting.
+ */
+CHIAKI_EXPORT void chiaki_mic_pipeline_flush(ChiakiMicPipeline *pipeline);
+
+CHIAKI_EXPORT void chiaki_mic_pipeline_get_stats(ChiakiMicPipeline *pipeline, ChiakiMicPipelineStats *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
+
+#endif // CHIAKI_MICPIPELINE_H
@@ -0,0 +1,44 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#ifndef CHIAKI_NETPROFILE_H
+#define CHIAKI_NETPROFILE_H
+
+#include "common.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * What senkusha measures for a network path, see chiaki_senkusha_run().
+ */
+typedef struct chiaki_network_profile_t
+{
+	uint32_t mtu_in;
+	uint32_t mtu_out;
+	uint64_t rtt_us;
+} ChiakiNetworkProfile;
+
+#define CHIAKI_NETWORK_FINGERPRINT_SIZE 256
+
+/**
+ * Describe the network path to a console, so a ChiakiNetworkProfile measured on it can be reused
+ * for as long as the description stays the same.
+ *
+ * It consists of the kind of connection, the local interface the console is reached through with its hardware address
+ * and the hardware address of the default gateway of that interface, where the platform makes it available.
+ *
+ * @param host address of the console, or NULL for holepunch connections, where the interface of the default route is used
+ * @param out receives a zero-terminated string, CHIAKI_NETWORK_FINGERPRINT_SIZE is always enough
+ */
+CHIAKI_EXPORT ChiakiErrorCode chiaki_network_fingerprint(const char *host, char *out, size_t out_size);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // CHIAKI_NETPROFILE_H
@@ -7,6 +7,8 @@
 #if CHIAKI_LIB_ENABLE_OPUS
 
 #include "audioreceiver.h"
+#include "audiojitterbuffer.h"
+#include "metrics.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -18,6 +20,7 @@ typedef void (*ChiakiOpusDecoderFrameCallback)(int16_t *buf, size_t samples_coun
 typedef struct chiaki_opus_decoder_t
 {
 	ChiakiLog *log;
+	ChiakiMutex mutex; // guards opus_decoder, audio_header and pcm_buf
 	struct OpusDecoder *opus_decoder;
 	ChiakiAudioHeader audio_header;
 	int16_t *pcm_buf;
@@ -26,12 +29,34 @@ typedef struct chiaki_opus_decoder_t
 	ChiakiOpusDecoderSettingsCallback settings_cb;
 	ChiakiOpusDecoderFrameCallback frame_cb;
 	void *cb_user;
+
+	ChiakiMetrics *metrics; // optional, set by the owner to record concealed frames and the jitter buffer latency
+
+	ChiakiAudioJitterBuffer *jitter_buffer; // NULL unless enabled
+	bool playout_thread_running;
+	ChiakiBoolPredCond playout_cond; // pred is set to stop the playout thread, the mutex guards playout_frame_us
+	uint64_t playout_frame_us;
+	ChiakiThread playout_thread;
 } ChiakiOpusDecoder;
 
-CHIAKI_EXPORT void chiaki_opus_decoder_init(ChiakiOpusDecoder *decoder, ChiakiLog *log);
+CHIAKI_EXPORT ChiakiErrorCode chiaki_opus_decoder_init(ChiakiOpusDecoder *decoder, ChiakiLog *log);
 CHIAKI_EXPORT void chiaki_opus_decoder_fini(ChiakiOpusDecoder *decoder);
 CHIAKI_EXPORT void chiaki_opus_decoder_get_sink(ChiakiOpusDecoder *decoder, ChiakiAudioSink *sink);
 
+/**
+ * Put an adaptive jitter buffer between the audio receiver and the decoder.
+ * Frames are then decoded on a playout thread at a steady rate, missing frames are recovered with Opus in-band FEC
+ * from the following frame if it already arrived, or concealed with Opus PLC, and frame_cb is called from that thread.
+ *
+ * Must be called before chiaki_opus_decoder_get_sink().
+ */
+CHIAKI_EXPORT ChiakiErrorCode chiaki_opus_decoder_enable_jitter_buffer(ChiakiOpusDecoder *decoder);
+
+/**
+ * @return false if the jitter buffer is not enabled
+ */
+CHIAKI_EXPORT bool chiaki_opus_decoder_get_jitter_buffer_stats(ChiakiOpusDecoder *decoder, ChiakiAudioJitterBufferStats *stats);
+
 static inline void chiaki_opus_decoder_set_cb(ChiakiOpusDecoder *decoder, ChiakiOpusDecoderSettingsCallback settings_cb, ChiakiOpusDecoderFrameCallback frame_cb, void *user)
 {
 	decoder->settings_cb = settings_cb;
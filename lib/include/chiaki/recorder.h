@@ -0,0 +1,120 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#ifndef CHIAKI_RECORDER_H
+#define CHIAKI_RECORDER_H
+
+#include <chiaki/config.h>
+
+#include "common.h"
+#include "log.h"
+#include "audio.h"
+#include "seqnum.h"
+#include "bitstream.h"
+#include "metrics.h"
+
+#include <stdint.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Records the stream as it is received, without decoding or encoding anything:
+ * the H.264/HEVC frames and Opus audio are muxed as they are into a file by libavformat.
+ *
+ * The session pushes packets from the threads receiving them, which only copy them into a bounded queue,
+ * a writer thread does everything that touches the disk. If it falls behind, packets are dropped
+ * instead of stalling the stream, video until the next keyframe.
+ *
+ * The recorder remembers the stream headers, so recordings can be started and stopped
+ * at any time while it is attached to a session with chiaki_session_set_recorder().
+ */
+typedef struct chiaki_recorder_t ChiakiRecorder;
+
+#if CHIAKI_LIB_ENABLE_FFMPEG_DECODER
+
+#define CHIAKI_RECORDER_QUEUE_SIZE 512 // packets, about 2s of video and audio at 60fps
+#define CHIAKI_RECORDER_QUEUE_BYTES_MAX (64 * 1024 * 1024)
+
+typedef enum chiaki_recorder_format_t
+{
+	CHIAKI_RECORDER_FORMAT_MKV,
+	CHIAKI_RECORDER_FORMAT_MP4 // fragmented, so whatever was written so far stays playable if the client dies
+} ChiakiRecorderFormat;
+
+CHIAKI_EXPORT const char *chiaki_recorder_format_name(ChiakiRecorderFormat format);
+
+/**
+ * @return the format matching the extension of path, MKV if it is not .mp4
+ */
+CHIAKI_EXPORT ChiakiRecorderFormat chiaki_recorder_format_from_path(const char *path);
+
+typedef struct chiaki_recorder_stats_t
+{
+	bool recording;
+	bool failed; // writing failed and the recording was given up, until the next start
+	uint64_t video_frames; // written to the current or last recording
+	uint64_t audio_frames;
+	uint64_t bytes;
+	uint64_t packets_dropped; // because the queue was full
+	uint64_t duration_us;
+} ChiakiRecorderStats;
+
+/**
+ * @param metrics optional
+ */
+CHIAKI_EXPORT ChiakiRecorder *chiaki_recorder_new(ChiakiLog *log, ChiakiMetrics *metrics);
+
+/**
+ * Stops the recording if there is one. Must not be attached to a session anymore that is still running.
+ */
+CHIAKI_EXPORT void chiaki_recorder_free(ChiakiRecorder *recorder);
+
+/**
+ * Start writing to path, replacing an existing file. The recording begins with the next keyframe,
+ * which the session requests from the console right away.
+ * The file is opened on the writer thread, failing to do so shows in the stats and the log.
+ */
+CHIAKI_EXPORT ChiakiErrorCode chiaki_recorder_start(ChiakiRecorder *recorder, const char *path, ChiakiRecorderFormat format);
+
+/**
+ * Write everything still queued, finish the file and wait for the writer thread.
+ * Does nothing if not recording.
+ */
+CHIAKI_EXPORT void chiaki_recorder_stop(ChiakiRecorder *recorder);
+
+CHIAKI_EXPORT void chiaki_recorder_get_stats(ChiakiRecorder *recorder, ChiakiRecorderStats *stats);
+
+/**
+ * Called by the video receiver with the header of every new video profile.
+ * @param index of buf
+ */
+CHIAKI_EXPORT void chiaki_recorder_video_header(ChiakiRecorder *recorder, ChiakiCodec codec, unsigned int width, unsigned int height,
+		const uint8_t *buf, size_t buf_size, const ChiakiBitstreamNalIndex *index);
+
+/**
+ * Called by the video receiver with every complete frame.
+ * @param index of buf
+ * @param arrival_us monotonic time the frame was completed
+ * @return true once after a recording was started and is waiting for a keyframe, to request one
+ */
+CHIAKI_EXPORT bool chiaki_recorder_video_frame(ChiakiRecorder *recorder, const uint8_t *buf, size_t buf_size,
+		const ChiakiBitstreamNalIndex *index, uint64_t arrival_us);
+
+CHIAKI_EXPORT void chiaki_recorder_audio_header(ChiakiRecorder *recorder, const ChiakiAudioHeader *header);
+
+/**
+ * Called by the audio receiver with every new Opus frame, in order, with gaps for lost ones.
+ * @param arrival_us monotonic time the frame was received
+ */
+CHIAKI_EXPORT void chiaki_recorder_audio_frame(ChiakiRecorder *recorder, ChiakiSeqNum16 frame_index,
+		const uint8_t *buf, size_t buf_size, uint64_t arrival_us);
+
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // CHIAKI_RECORDER_H
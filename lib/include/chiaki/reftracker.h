@@ -0,0 +1,125 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#ifndef CHIAKI_REFTRACKER_H
+#define CHIAKI_REFTRACKER_H
+
+#include "common.h"
+#include "thread.h"
+#include "seqnum.h"
+#include "metrics.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define CHIAKI_REF_TRACKER_WINDOW 64 // frames that can be looked up, one bit each
+
+typedef enum chiaki_ref_recovery_t
+{
+	CHIAKI_REF_RECOVERY_NONE, // a recovery decided on earlier is still in progress, nothing to do
+	CHIAKI_REF_RECOVERY_REQUEST, // report the corrupt frames, so the console sends a new IDR frame
+	CHIAKI_REF_RECOVERY_WAIT_IDR // the next regular IDR frame arrives no later than a requested one would
+} ChiakiRefRecovery;
+
+typedef struct chiaki_ref_tracker_stats_t
+{
+	uint64_t rewrites; // frames decoded from a substituted older reference
+	uint64_t requests;
+	uint64_t idr_waits;
+	uint64_t decode_failures; // frames the decoder reported as failed after accepting them
+	uint64_t iframe_interval_us; // measured between regular IDR frames, 0 if not known yet
+} ChiakiRefTrackerStats;
+
+/**
+ * Which of the recent frames are intact and usable as references, and how to recover when one is not.
+ *
+ * Frames are marked when the video sample callback accepts them and unmarked again when the decoder
+ * reports that it failed on them, together with all frames after them.
+ * Decoder feedback may come from any thread, everything else is called from the video receiver.
+ */
+typedef struct chiaki_ref_tracker_t
+{
+	ChiakiMutex mutex;
+	ChiakiMetrics *metrics;
+
+	bool empty;
+	ChiakiSeqNum16 newest; // frame of bit 0 in usable
+	uint64_t usable; // bit i is set if frame newest - i can be referenced
+
+	// frame index of every video sample by sample number, -1 for samples that are not frames
+	int32_t samples[CHIAKI_REF_TRACKER_WINDOW];
+	uint64_t samples_count;
+
+	uint64_t frame_us; // when the newest frame was submitted
+	uint64_t frame_interval_us; // smoothed
+	uint64_t iframe_us; // when the last IDR frame was submitted, 0 if none yet
+	uint64_t iframe_interval_us; // smoothed, 0 until two regular IDR frames were seen
+
+	ChiakiRefRecovery recovery; // in progress until an IDR frame arrives or recovery_until_us
+	uint64_t recovery_until_us;
+
+	ChiakiRefTrackerStats stats;
+} ChiakiRefTracker;
+
+/**
+ * @param metrics optional
+ */
+CHIAKI_EXPORT ChiakiErrorCode chiaki_ref_tracker_init(ChiakiRefTracker *tracker, ChiakiMetrics *metrics);
+CHIAKI_EXPORT void chiaki_ref_tracker_fini(ChiakiRefTracker *tracker);
+
+/**
+ * Forget all frames and samples, e.g. for a new stream.
+ */
+CHIAKI_EXPORT void chiaki_ref_tracker_reset(ChiakiRefTracker *tracker);
+
+/**
+ * To be called right before every call of the video sample callback.
+ * @param frame index of the frame in the sample or -1 if it is something else, like the stream header
+ * @return number of the sample, counting from 0
+ */
+CHIAKI_EXPORT uint64_t chiaki_ref_tracker_sample(ChiakiRefTracker *tracker, int32_t frame);
+
+/**
+ * The video sample callback accepted frame.
+ */
+CHIAKI_EXPORT void chiaki_ref_tracker_submitted(ChiakiRefTracker *tracker, ChiakiSeqNum16 frame, bool idr, uint64_t now_us);
+
+/**
+ * Decoder feedback for a sample returned by chiaki_ref_tracker_sample().
+ */
+CHIAKI_EXPORT void chiaki_ref_tracker_sample_decoded(ChiakiRefTracker *tracker, uint64_t sample, bool success);
+
+/**
+ * @return frame index of a sample returned by chiaki_ref_tracker_sample(),
+ * -1 if it is not a frame or more than CHIAKI_REF_TRACKER_WINDOW samples old
+ */
+CHIAKI_EXPORT int32_t chiaki_ref_tracker_sample_frame(ChiakiRefTracker *tracker, uint64_t sample);
+
+CHIAKI_EXPORT bool chiaki_ref_tracker_have(ChiakiRefTracker *tracker, ChiakiSeqNum16 frame);
+
+/**
+ * Count a frame whose missing reference was replaced by an older intact frame.
+ */
+CHIAKI_EXPORT void chiaki_ref_tracker_rewritten(ChiakiRefTracker *tracker);
+
+/**
+ * Decide how to recover from frames that can not be decoded and could not be repaired by rewriting their reference.
+ *
+ * Requesting an IDR frame takes about a round trip plus the time to encode and send it.
+ * If a regular IDR frame is due before that, it is cheaper to wait for it than to
+ * make the console send an extra one.
+ *
+ * @param rtt_us measured round trip time
+ */
+CHIAKI_EXPORT ChiakiRefRecovery chiaki_ref_tracker_recovery(ChiakiRefTracker *tracker, uint64_t rtt_us, uint64_t now_us);
+
+CHIAKI_EXPORT void chiaki_ref_tracker_get_stats(ChiakiRefTracker *tracker, ChiakiRefTrackerStats *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // CHIAKI_REFTRACKER_H
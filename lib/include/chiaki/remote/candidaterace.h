@@ -0,0 +1,139 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#ifndef CHIAKI_CANDIDATERACE_H
+#define CHIAKI_CANDIDATERACE_H
+
+#include "../common.h"
+#include "../log.h"
+#include "../sock.h"
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#ifdef _WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#else
+#include <sys/socket.h>
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define CHIAKI_CANDIDATE_RACE_NEVER UINT64_MAX
+#define CHIAKI_CANDIDATE_RACE_NONE SIZE_MAX
+
+/**
+ * A local socket and a remote address that are probed for connectivity.
+ * All times are in us since the start of the race, CHIAKI_CANDIDATE_RACE_NEVER if it didn't happen.
+ */
+typedef struct chiaki_candidate_race_pair_t
+{
+	chiaki_socket_t sock;
+	struct sockaddr_storage addr;
+	socklen_t addr_len;
+	unsigned int priority; // lower is probed first
+	void *user;
+
+	unsigned int probes;
+	uint64_t next_probe_us;
+	uint64_t first_probe_us;
+	uint64_t last_probe_us;
+	uint64_t first_reply_us;
+	uint64_t validated_us;
+} ChiakiCandidateRacePair;
+
+typedef struct chiaki_candidate_race_t ChiakiCandidateRace;
+
+/**
+ * Send a probe for the pair, pair->probes is the number of probes sent before.
+ */
+typedef void (*ChiakiCandidateRaceProbeCb)(ChiakiCandidateRace *race, size_t pair, void *user);
+
+/**
+ * Read one datagram from a readable socket and report what it means with
+ * chiaki_candidate_race_replied(), chiaki_candidate_race_validated() or chiaki_candidate_race_abort().
+ */
+typedef void (*ChiakiCandidateRaceReadCb)(ChiakiCandidateRace *race, chiaki_socket_t sock, void *user);
+
+/**
+ * Probes candidate pairs Happy-Eyeballs style until the first one is validated:
+ * each priority starts stagger_ms after the one before, so a better pair that answers quickly wins
+ * without the others being probed at all, and probes of a pair are resent with backoff.
+ *
+ * Everything runs on the thread calling chiaki_candidate_race_run(), including the callbacks.
+ */
+struct chiaki_candidate_race_t
+{
+	ChiakiLog *log;
+	ChiakiCandidateRaceProbeCb probe_cb;
+	ChiakiCandidateRaceReadCb read_cb;
+	void *cb_user;
+
+	uint64_t stagger_ms; // between priorities
+	uint64_t resend_ms; // first interval between probes of a pair, doubled after each one
+	uint64_t resend_max_ms;
+	uint64_t timeout_ms; // for a reply on any pair
+	uint64_t reply_timeout_ms; // for a validation after the first reply, if that ends after timeout_ms
+
+	ChiakiCandidateRacePair *pairs;
+	size_t pairs_count;
+	size_t pairs_size;
+
+	chiaki_socket_t *socks; // waited on for reads
+	size_t socks_count;
+	size_t socks_size;
+
+	bool running;
+	uint64_t start_us; // monotonic
+	uint64_t first_reply_us;
+	size_t validated; // pair index or CHIAKI_CANDIDATE_RACE_NONE
+	chiaki_socket_t validated_sock; // the reply validating the pair came in on
+	ChiakiErrorCode abort_err;
+};
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_candidate_race_init(ChiakiCandidateRace *race, ChiakiLog *log,
+		ChiakiCandidateRaceProbeCb probe_cb, ChiakiCandidateRaceReadCb read_cb, void *cb_user);
+CHIAKI_EXPORT void chiaki_candidate_race_fini(ChiakiCandidateRace *race);
+
+/**
+ * Wait for reads on sock without probing from it, e.g. for sockets that only send probes from the probe callback.
+ */
+CHIAKI_EXPORT ChiakiErrorCode chiaki_candidate_race_add_socket(ChiakiCandidateRace *race, chiaki_socket_t sock);
+
+/**
+ * Stop waiting on sock, must be called before closing it during the race.
+ */
+CHIAKI_EXPORT void chiaki_candidate_race_remove_socket(ChiakiCandidateRace *race, chiaki_socket_t sock);
+
+/**
+ * Add a pair, also possible from the callbacks while the race is running.
+ * Its first probe is due when its priority starts, or right away if that is over.
+ *
+ * @param index optional, receives the index of the pair in race->pairs
+ */
+CHIAKI_EXPORT ChiakiErrorCode chiaki_candidate_race_add_pair(ChiakiCandidateRace *race, chiaki_socket_t sock,
+		const struct sockaddr *addr, socklen_t addr_len, unsigned int priority, void *user, size_t *index);
+
+CHIAKI_EXPORT void chiaki_candidate_race_replied(ChiakiCandidateRace *race, size_t pair);
+CHIAKI_EXPORT void chiaki_candidate_race_validated(ChiakiCandidateRace *race, size_t pair, chiaki_socket_t sock);
+CHIAKI_EXPORT void chiaki_candidate_race_abort(ChiakiCandidateRace *race, ChiakiErrorCode err);
+
+/**
+ * @return CHIAKI_ERR_SUCCESS with race->validated set, CHIAKI_ERR_HOST_UNREACH if no pair was validated in time
+ * or the error given to chiaki_candidate_race_abort()
+ */
+CHIAKI_EXPORT ChiakiErrorCode chiaki_candidate_race_run(ChiakiCandidateRace *race);
+
+/**
+ * Log the probe timeline of every pair.
+ */
+CHIAKI_EXPORT void chiaki_candidate_race_log_timeline(ChiakiCandidateRace *race, ChiakiLogLevel level);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // CHIAKI_CANDIDATERACE_H
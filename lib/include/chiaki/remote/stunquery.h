@@ -0,0 +1,113 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#ifndef CHIAKI_STUNQUERY_H
+#define CHIAKI_STUNQUERY_H
+
+#include "../common.h"
+#include "../log.h"
+#include "../sock.h"
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#ifdef _WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#else
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define CHIAKI_STUN_QUERY_MAPPINGS_MAX 4
+#define CHIAKI_STUN_QUERY_BATCH 4 // default for servers asked at once when any answer will do
+#define CHIAKI_STUN_HEADER_SIZE 20
+#define CHIAKI_STUN_TRANSACTION_ID_SIZE 12
+
+typedef struct chiaki_stun_server_t
+{
+	char *host;
+	uint16_t port;
+} ChiakiStunServer;
+
+/**
+ * Address and port a STUN server saw a request coming from.
+ */
+typedef struct chiaki_stun_mapping_t
+{
+	char addr[INET6_ADDRSTRLEN];
+	uint16_t port;
+	size_t server; // index in the servers of the query
+} ChiakiStunMapping;
+
+typedef struct chiaki_stun_transaction_t ChiakiStunTransaction;
+
+/**
+ * Binding requests sent from one socket to a list of servers.
+ *
+ * With mappings_wanted = 1, up to batch servers are asked at once and the first good answer wins.
+ * With more, that many servers are asked at once and their mappings are kept in the order the requests were sent,
+ * which is what the NAT allocated them in, for servers that did not answer the next ones in the list are asked.
+ */
+typedef struct chiaki_stun_query_t
+{
+	chiaki_socket_t sock;
+	int family; // AF_INET or AF_INET6
+	const ChiakiStunServer *servers;
+	size_t servers_count;
+	size_t mappings_wanted;
+	size_t batch; // CHIAKI_STUN_QUERY_BATCH after init, 1 if the mapping must be the latest one the NAT allocated
+
+	ChiakiStunMapping mappings[CHIAKI_STUN_QUERY_MAPPINGS_MAX];
+	size_t mappings_count;
+	bool sock_failed; // sending failed, the socket should not be used anymore
+
+	// state of chiaki_stun_query_run()
+	ChiakiStunTransaction *transactions; // one per server
+	size_t next_server;
+	unsigned int round;
+	uint64_t round_start_ms;
+	bool done;
+} ChiakiStunQuery;
+
+CHIAKI_EXPORT void chiaki_stun_query_init(ChiakiStunQuery *query, chiaki_socket_t sock, int family,
+		const ChiakiStunServer *servers, size_t servers_count, size_t mappings_wanted);
+
+/**
+ * Run all queries at the same time, e.g. one for IPv4 and one for IPv6, until each of them has its mappings,
+ * ran out of servers or timeout_ms passed.
+ *
+ * @return CHIAKI_ERR_SUCCESS if every query got all of its mappings, CHIAKI_ERR_TIMEOUT if at least one did not
+ */
+CHIAKI_EXPORT ChiakiErrorCode chiaki_stun_query_run(ChiakiLog *log, ChiakiStunQuery *queries, size_t queries_count, uint64_t timeout_ms);
+
+/**
+ * Write a binding request with a random transaction id to buf of CHIAKI_STUN_HEADER_SIZE bytes.
+ */
+CHIAKI_EXPORT void chiaki_stun_binding_request(uint8_t *buf);
+
+/**
+ * Parse a binding response to request, which is the CHIAKI_STUN_HEADER_SIZE bytes sent.
+ */
+CHIAKI_EXPORT ChiakiErrorCode chiaki_stun_parse_binding_response(ChiakiLog *log, const uint8_t *request,
+		const uint8_t *buf, size_t buf_size, char *addr, size_t addr_size, uint16_t *port);
+
+/**
+ * Build the binding response a STUN server would send for request when it came from mapped,
+ * to stand in for a server locally.
+ *
+ * @return size of the response in out, 0 if request is not a binding request or out is too small
+ */
+CHIAKI_EXPORT size_t chiaki_stun_binding_response(const uint8_t *request, size_t request_size,
+		const struct sockaddr *mapped, uint8_t *out, size_t out_size);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // CHIAKI_STUNQUERY_H
@@ -4,6 +4,7 @@
 #define CHIAKI_SENKUSHA_H
 
 #include "takion.h"
+#include "netprofile.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -41,7 +42,20 @@ typedef struct senkusha_t
 
 CHIAKI_EXPORT ChiakiErrorCode chiaki_senkusha_init(ChiakiSenkusha *senkusha, ChiakiSession *session);
 CHIAKI_EXPORT void chiaki_senkusha_fini(ChiakiSenkusha *senkusha);
-CHIAKI_EXPORT ChiakiErrorCode chiaki_senkusha_run(ChiakiSenkusha *senkusha, uint32_t *mtu_in, uint32_t *mtu_out, uint64_t *rtt_us, chiaki_socket_t *sock);
+
+/**
+ * @param cached optional profile measured on the same network path before.
+ * If given, fewer pings are sent and the MTU tests start at its values, so a profile that still holds is confirmed with one probe each.
+ * Otherwise they search downwards from there like the full tests.
+ */
+CHIAKI_EXPORT ChiakiErrorCode chiaki_senkusha_run(ChiakiSenkusha *senkusha, const ChiakiNetworkProfile *cached, uint32_t *mtu_in, uint32_t *mtu_out, uint64_t *rtt_us, chiaki_socket_t *sock);
+
+/**
+ * Where the MTU tests of chiaki_senkusha_run() start searching downwards from.
+ * @param cached optional, ignored if its MTUs are outside of what the tests can measure
+ * @return whether cached was used
+ */
+CHIAKI_EXPORT bool chiaki_senkusha_mtu_max(const ChiakiNetworkProfile *cached, uint32_t *mtu_in_max, uint32_t *mtu_out_max);
 
 #ifdef __cplusplus
 }
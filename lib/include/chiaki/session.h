@@ -17,6 +17,11 @@
 #include "remote/holepunch.h"
 #include "remote/rudp.h"
 #include "regist.h"
+#include "metrics.h"
+#include "bitstream.h"
+#include "recorder.h"
+#include "workerpool.h"
+#include "netprofile.h"
 
 #include <stdint.h>
 
@@ -88,6 +93,8 @@ typedef struct chiaki_connect_info_t
 	chiaki_socket_t *rudp_sock;
 	uint8_t psn_account_id[CHIAKI_PSN_ACCOUNT_ID_SIZE];
 	double packet_loss_max;
+	ChiakiWorkerPool *worker_pool; // optional, shared by several sessions for background work instead of threads of their own
+	const ChiakiNetworkProfile *network_profile; // optional, from CHIAKI_EVENT_NETWORK_PROFILE of an earlier session on the same network path
 } ChiakiConnectInfo;
 
 
@@ -121,6 +128,35 @@ typedef struct chiaki_quit_event_t
 	const char *reason_str;
 } ChiakiQuitEvent;
 
+typedef enum {
+	CHIAKI_STARTUP_PHASE_SESSION_REQUEST, // including PSN registration for remote connections
+	CHIAKI_STARTUP_PHASE_CTRL, // until the session id is received, without the time in LOGIN_PIN
+	CHIAKI_STARTUP_PHASE_LOGIN_PIN, // waiting for the user to enter the PIN
+	CHIAKI_STARTUP_PHASE_HOLEPUNCH,
+	CHIAKI_STARTUP_PHASE_SENKUSHA,
+	CHIAKI_STARTUP_PHASE_TAKION_CONNECT,
+	CHIAKI_STARTUP_PHASE_BIG_BANG,
+	CHIAKI_STARTUP_PHASE_STREAMINFO,
+	CHIAKI_STARTUP_PHASE_FIRST_FRAME, // from streaminfo until the first complete video frame
+	CHIAKI_STARTUP_PHASE_COUNT
+} ChiakiStartupPhase;
+
+CHIAKI_EXPORT const char *chiaki_startup_phase_string(ChiakiStartupPhase phase);
+
+typedef struct chiaki_startup_timeline_t
+{
+	uint64_t phase_us[CHIAKI_STARTUP_PHASE_COUNT]; // 0 for phases that were skipped
+	uint64_t total_us; // from the session thread starting until the first frame or the quit
+	bool complete; // false if the session quit before the first frame
+} ChiakiStartupTimeline;
+
+typedef struct chiaki_network_profile_event_t
+{
+	ChiakiNetworkProfile profile;
+	bool valid; // false if the profile the session was started with turned out not to fit the network anymore
+	bool cached; // measured starting from the cached profile, which can't detect a grown MTU, so its age should be kept
+} ChiakiNetworkProfileEvent;
+
 typedef struct chiaki_keyboard_event_t
 {
 	const char *text_str;
@@ -162,6 +198,8 @@ typedef enum {
 	CHIAKI_EVENT_LED_COLOR,
 	CHIAKI_EVENT_HAPTIC_INTENSITY,
 	CHIAKI_EVENT_TRIGGER_INTENSITY,
+	CHIAKI_EVENT_STARTUP_TIMELINE, // once per start, with the first frame or before CHIAKI_EVENT_QUIT
+	CHIAKI_EVENT_NETWORK_PROFILE, // after measuring the network, and if the first frames show the cached profile was wrong
 } ChiakiEventType;
 
 typedef struct chiaki_event_t
@@ -185,6 +223,8 @@ typedef struct chiaki_event_t
 		} data_holepunch;
 		ChiakiDualSenseEffectIntensity intensity;
 		char server_nickname[0x20];
+		ChiakiStartupTimeline startup_timeline;
+		ChiakiNetworkProfileEvent network_profile;
 	};
 } ChiakiEvent;
 
@@ -215,6 +255,8 @@ typedef struct chiaki_session_t
 		bool enable_keyboard;
 		bool enable_dualsense;
 		uint8_t psn_account_id[CHIAKI_PSN_ACCOUNT_ID_SIZE];
+		bool network_profile_set;
+		ChiakiNetworkProfile network_profile;
 	} connect_info;
 
 	ChiakiTarget target;
@@ -226,6 +268,7 @@ typedef struct chiaki_session_t
 	uint32_t mtu_in;
 	uint32_t mtu_out;
 	uint64_t rtt_us;
+	bool network_profile_cached; // senkusha started from connect_info.network_profile, which the first frames still have to confirm
 	ChiakiECDH ecdh;
 
 	ChiakiQuitReason quit_reason;
@@ -238,6 +281,7 @@ typedef struct chiaki_session_t
 	ChiakiAudioSink audio_sink;
 	ChiakiAudioSink haptics_sink;
 	ChiakiCtrlDisplaySink display_sink;
+	ChiakiRecorder *recorder;
 
 	ChiakiThread session_thread;
 
@@ -261,6 +305,15 @@ typedef struct chiaki_session_t
 	ChiakiRudp rudp;
 
 	ChiakiLog *log;
+	ChiakiMetrics *metrics;
+	ChiakiWorkerPool *worker_pool;
+
+	ChiakiMutex startup_mutex; // guards the startup fields, phases end on both the session and the takion thread
+	ChiakiStartupTimeline startup_timeline;
+	ChiakiStartupPhase startup_phase;
+	uint64_t startup_start_us;
+	uint64_t startup_phase_start_us;
+	bool startup_finished;
 
 	ChiakiStreamConnection stream_connection;
 
@@ -283,6 +336,27 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_session_keyboard_reject(ChiakiSession *sess
 CHIAKI_EXPORT ChiakiErrorCode chiaki_session_keyboard_accept(ChiakiSession *session);
 CHIAKI_EXPORT ChiakiErrorCode chiaki_session_go_home(ChiakiSession *session);
 
+/**
+ * NAL units of the buffer currently passed to the video sample callback, so consumers
+ * like recording don't have to look for start codes again.
+ * Only valid while called from within the video sample callback.
+ */
+CHIAKI_EXPORT const ChiakiBitstreamNalIndex *chiaki_session_video_sample_nal_index(ChiakiSession *session);
+
+/**
+ * Decoder feedback, so frames the decoder failed on are not used as references anymore
+ * and recovery starts without waiting for the frames after them.
+ * May be called from any thread.
+ * @param sample number of the call of the video sample callback with the frame, counting from 0
+ */
+CHIAKI_EXPORT void chiaki_session_video_sample_decoded(ChiakiSession *session, uint64_t sample, bool success);
+
+/**
+ * @param sample as for chiaki_session_video_sample_decoded()
+ * @return index of the frame in the sample, -1 if it is not a frame or too long ago
+ */
+CHIAKI_EXPORT int32_t chiaki_session_video_sample_frame_index(ChiakiSession *session, uint64_t sample);
+
 static inline void chiaki_session_set_event_cb(ChiakiSession *session, ChiakiEventCallback cb, void *user)
 {
 	session->event_cb = cb;
@@ -319,6 +393,16 @@ static inline void chiaki_session_ctrl_set_display_sink(ChiakiSession *session,
 	session->display_sink = *sink;
 }
 
+/**
+ * Feed the received video and audio to recorder, which then records whenever chiaki_recorder_start() is called.
+ * Must be set before the session is started and outlive it.
+ * @param recorder optional
+ */
+static inline void chiaki_session_set_recorder(ChiakiSession *session, ChiakiRecorder *recorder)
+{
+	session->recorder = recorder;
+}
+
 #ifdef __cplusplus
 }
 #endif
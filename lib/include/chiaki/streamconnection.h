@@ -11,6 +11,7 @@
 #include "audioreceiver.h"
 #include "videoreceiver.h"
 #include "congestioncontrol.h"
+#include "reftracker.h"
 
 #include <stdbool.h>
 
@@ -41,6 +42,7 @@ typedef struct chiaki_stream_connection_t
 	ChiakiPacketStats packet_stats;
 	ChiakiAudioReceiver *audio_receiver;
 	ChiakiVideoReceiver *video_receiver;
+	ChiakiRefTracker ref_tracker; // outlives video_receiver, so decoder feedback arriving late is safe
 	ChiakiAudioReceiver *haptics_receiver;
 	double packet_loss_max;
 	uint8_t motion_counter[4];
@@ -77,6 +79,7 @@ typedef struct chiaki_stream_connection_t
 	char *remote_disconnect_reason;
 
 	double measured_bitrate;
+	ChiakiStreamStatsWindow stream_stats_window; // video stream statistics as of the last connection quality message
 } ChiakiStreamConnection;
 
 CHIAKI_EXPORT ChiakiErrorCode chiaki_stream_connection_init(ChiakiStreamConnection *stream_connection, ChiakiSession *session, double packet_loss_max);
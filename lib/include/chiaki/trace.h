@@ -0,0 +1,104 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#ifndef CHIAKI_TRACE_H
+#define CHIAKI_TRACE_H
+
+#include "common.h"
+#include <chiaki/config.h>
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Per-frame latency trace points.
+ *
+ * Events are written into per-thread rings without locking and can be exported
+ * as Chrome trace JSON at any time, which can be opened in chrome://tracing or ui.perfetto.dev.
+ * While tracing is disabled, every trace point costs a single load of chiaki_trace_active.
+ */
+
+typedef enum chiaki_trace_stage_t
+{
+	CHIAKI_TRACE_STAGE_VIDEO_UNIT_FIRST = 0,
+	CHIAKI_TRACE_STAGE_VIDEO_UNIT_LAST,
+	CHIAKI_TRACE_STAGE_FEC,
+	CHIAKI_TRACE_STAGE_BITSTREAM_PARSE,
+	CHIAKI_TRACE_STAGE_DECODER_QUEUE,
+	CHIAKI_TRACE_STAGE_DECODER_SEND_PACKET,
+	CHIAKI_TRACE_STAGE_DECODER_FRAME,
+	CHIAKI_TRACE_STAGE_DECODER_PULL_FRAME,
+	CHIAKI_TRACE_STAGE_PRESENT_FRAME,
+	CHIAKI_TRACE_STAGE_RENDER,
+	CHIAKI_TRACE_STAGE_AUDIO_FRAME,
+	CHIAKI_TRACE_STAGE_AUDIO_DECODE,
+	CHIAKI_TRACE_STAGE_FEEDBACK_STATE,
+	CHIAKI_TRACE_STAGE_FEEDBACK_HISTORY,
+	CHIAKI_TRACE_STAGE_COUNT
+} ChiakiTraceStage;
+
+typedef enum chiaki_trace_phase_t
+{
+	CHIAKI_TRACE_PHASE_BEGIN = 'B',
+	CHIAKI_TRACE_PHASE_END = 'E',
+	CHIAKI_TRACE_PHASE_INSTANT = 'i'
+} ChiakiTracePhase;
+
+#define CHIAKI_TRACE_FRAME_NONE (-1)
+
+/**
+ * Non-zero while trace points are recorded. Only read this, use chiaki_trace_set_enabled() to change it.
+ */
+CHIAKI_EXPORT extern volatile int chiaki_trace_active;
+
+CHIAKI_EXPORT const char *chiaki_trace_stage_name(ChiakiTraceStage stage);
+
+CHIAKI_EXPORT void chiaki_trace_set_enabled(bool enabled);
+static inline bool chiaki_trace_enabled() { return chiaki_trace_active != 0; }
+
+/**
+ * Record a single event in the ring of the calling thread.
+ * Use the CHIAKI_TRACE_* macros instead, which skip the call while tracing is disabled.
+ */
+CHIAKI_EXPORT void chiaki_trace_event(ChiakiTraceStage stage, ChiakiTracePhase phase, int64_t frame_index);
+
+/**
+ * Frame index the calling thread is currently working on.
+ * This is used to key trace points in code that does not know about frame indices itself,
+ * e.g. the decoder called from the video sample callback.
+ */
+CHIAKI_EXPORT void chiaki_trace_set_frame_context(int64_t frame_index);
+CHIAKI_EXPORT int64_t chiaki_trace_frame_context();
+
+/**
+ * Write all events currently held in the thread rings as Chrome trace JSON.
+ * Safe to call while other threads are still recording, events overwritten during export are skipped.
+ */
+CHIAKI_EXPORT ChiakiErrorCode chiaki_trace_write_chrome_json(const char *path);
+
+/**
+ * Drop all events recorded so far.
+ * Safe to call while other threads are still recording, their events from before the call are cut off without being touched.
+ */
+CHIAKI_EXPORT void chiaki_trace_clear();
+
+#if CHIAKI_LIB_ENABLE_TRACE
+#define CHIAKI_TRACE_EVENT(stage, phase, frame) do { if(chiaki_trace_active) chiaki_trace_event((stage), (phase), (int64_t)(frame)); } while(0)
+#define CHIAKI_TRACE_SET_FRAME(frame) do { if(chiaki_trace_active) chiaki_trace_set_frame_context((int64_t)(frame)); } while(0)
+#else
+#define CHIAKI_TRACE_EVENT(stage, phase, frame) do { } while(0)
+#define CHIAKI_TRACE_SET_FRAME(frame) do { } while(0)
+#endif
+
+#define CHIAKI_TRACE_BEGIN(stage, frame) CHIAKI_TRACE_EVENT(stage, CHIAKI_TRACE_PHASE_BEGIN, frame)
+#define CHIAKI_TRACE_END(stage, frame) CHIAKI_TRACE_EVENT(stage, CHIAKI_TRACE_PHASE_END, frame)
+#define CHIAKI_TRACE_INSTANT(stage, frame) CHIAKI_TRACE_EVENT(stage, CHIAKI_TRACE_PHASE_INSTANT, frame)
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // CHIAKI_TRACE_H
@@ -31,8 +31,11 @@ typedef struct chiaki_video_receiver_t
 	ChiakiPacketStats *packet_stats;
 
 	int32_t frames_lost;
-	int32_t reference_frames[16];
+	bool first_frame_passed; // to the video sample callback, which ends the startup of the session
+	uint32_t network_profile_frames; // complete frames so far while confirming a cached network profile
+	bool network_profile_checked;
 	ChiakiBitstream bitstream;
+	ChiakiBitstreamNalIndex nal_index; // of the frame currently being passed to the video sample callback
 } ChiakiVideoReceiver;
 
 CHIAKI_EXPORT void chiaki_video_receiver_init(ChiakiVideoReceiver *video_receiver, struct chiaki_session_t *session, ChiakiPacketStats *packet_stats);
@@ -0,0 +1,95 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#ifndef CHIAKI_WORKERPOOL_H
+#define CHIAKI_WORKERPOOL_H
+
+#include "common.h"
+#include "log.h"
+#include "thread.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef void (*ChiakiWorkerTaskFunc)(void *user);
+
+/**
+ * Unit of work, embedded by its owner so posting never allocates.
+ * Posting a task that is already queued does nothing, so it can be used to kick its owner
+ * from hot paths without piling up work.
+ */
+typedef struct chiaki_worker_task_t
+{
+	ChiakiWorkerTaskFunc func;
+	void *user;
+	// owned by the pool
+	bool queued;
+	struct chiaki_worker_task_t *next;
+} ChiakiWorkerTask;
+
+static inline void chiaki_worker_task_init(ChiakiWorkerTask *task, ChiakiWorkerTaskFunc func, void *user)
+{
+	task->func = func;
+	task->user = user;
+	task->queued = false;
+	task->next = NULL;
+}
+
+/**
+ * A fixed set of threads shared by any number of sessions, replacing the threads that each session
+ * would otherwise keep mostly idle for background work.
+ *
+ * Work is posted to lanes. Tasks of one lane run one at a time in the order they were posted,
+ * so the owner of a lane can treat it like its own thread. Lanes with pending tasks take turns,
+ * one task each, so a lane with a lot of work can't starve the others.
+ */
+typedef struct chiaki_worker_pool_t ChiakiWorkerPool;
+typedef struct chiaki_worker_lane_t ChiakiWorkerLane;
+
+/**
+ * @param threads 0 for as many as there are cores
+ */
+CHIAKI_EXPORT ChiakiWorkerPool *chiaki_worker_pool_new(ChiakiLog *log, unsigned int threads);
+
+/**
+ * All lanes must have been freed before.
+ */
+CHIAKI_EXPORT void chiaki_worker_pool_free(ChiakiWorkerPool *pool);
+
+CHIAKI_EXPORT unsigned int chiaki_worker_pool_thread_count(ChiakiWorkerPool *pool);
+
+/**
+ * @return number of cores available to the process, at least 1
+ */
+CHIAKI_EXPORT unsigned int chiaki_worker_pool_cpu_count();
+
+CHIAKI_EXPORT ChiakiWorkerLane *chiaki_worker_lane_new(ChiakiWorkerPool *pool);
+
+/**
+ * Drop pending tasks, stop the timer and wait for a task that is currently running.
+ * The other lanes are not affected. Must not be called from a task of the same lane.
+ */
+CHIAKI_EXPORT void chiaki_worker_lane_free(ChiakiWorkerLane *lane);
+
+/**
+ * Queue task to run on the pool, unless it is already queued.
+ * A task that is currently running is queued again.
+ * May be called from any thread, including tasks of the lane itself.
+ */
+CHIAKI_EXPORT void chiaki_worker_lane_post(ChiakiWorkerLane *lane, ChiakiWorkerTask *task);
+
+/**
+ * Run func every interval_ms on the lane, the first time interval_ms from now.
+ * If a run is late, the following ones are not made up for.
+ * @param interval_ms 0 to stop the timer
+ */
+CHIAKI_EXPORT void chiaki_worker_lane_set_timer(ChiakiWorkerLane *lane, uint64_t interval_ms, ChiakiWorkerTaskFunc func, void *user);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // CHIAKI_WORKERPOOL_H
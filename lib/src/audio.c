@@ -2,6 +2,16 @@
 
 #include <chiaki/audio.h>
 
+#include <string.h>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define AUDIO_GAIN_SSE2 1
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define AUDIO_GAIN_NEON 1
+#endif
+
 #ifdef _WIN32
 #include <winsock2.h>
 #else
@@ -38,3 +48,83 @@ void chiaki_audio_header_set(ChiakiAudioHeader * audio_header, uint8_t channels,
 	audio_header->frame_size = frame_size;
 	audio_header->unknown = 1;
 }
+
+CHIAKI_EXPORT void chiaki_audio_s16_gain(int16_t *dst, const int16_t *src, size_t samples, uint16_t gain)
+{
+	if(gain >= CHIAKI_AUDIO_GAIN_UNITY)
+	{
+		if(dst != src)
+			memmove(dst, src, samples * sizeof(int16_t));
+		return;
+	}
+
+	size_t i = 0;
+#if AUDIO_GAIN_SSE2
+	// (x * gain) >> 15 in 32 bits, gain is paired with 0 so each madd lane is a single product
+	__m128i g = _mm_set1_epi32(gain);
+	__m128i zero = _mm_setzero_si128();
+	for(; i + 8 <= samples; i += 8)
+	{
+		__m128i x = _mm_loadu_si128((const __m128i *)(src + i));
+		__m128i lo = _mm_madd_epi16(_mm_unpacklo_epi16(x, zero), g);
+		__m128i hi = _mm_madd_epi16(_mm_unpackhi_epi16(x, zero), g);
+		lo = _mm_srai_epi32(lo, 15);
+		hi = _mm_srai_epi32(hi, 15);
+		_mm_storeu_si128((__m128i *)(dst + i), _mm_packs_epi32(lo, hi));
+	}
+#elif AUDIO_GAIN_NEON
+	// (2 * x * gain) >> 16 == (x * gain) >> 15
+	for(; i + 8 <= samples; i += 8)
+		vst1q_s16(dst + i, vqdmulhq_n_s16(vld1q_s16(src + i), (int16_t)gain));
+#endif
+	for(; i < samples; i++)
+		dst[i] = (int16_t)(((int32_t)src[i] * (int32_t)gain) >> 15);
+}
+
+CHIAKI_EXPORT void chiaki_audio_s16_downmix_gain(int16_t *dst, const int16_t *src, size_t frames, uint16_t gain)
+{
+	// half the gain per channel, so the sum of both stays within Q15
+	int16_t h = (int16_t)((gain > CHIAKI_AUDIO_GAIN_UNITY ? CHIAKI_AUDIO_GAIN_UNITY : gain) >> 1);
+	size_t i = 0;
+#if AUDIO_GAIN_SSE2
+	__m128i g = _mm_set1_epi16(h);
+	for(; i + 8 <= frames; i += 8)
+	{
+		__m128i lo = _mm_madd_epi16(_mm_loadu_si128((const __m128i *)(src + 2 * i)), g);
+		__m128i hi = _mm_madd_epi16(_mm_loadu_si128((const __m128i *)(src + 2 * i + 8)), g);
+		_mm_storeu_si128((__m128i *)(dst + i), _mm_packs_epi32(_mm_srai_epi32(lo, 15), _mm_srai_epi32(hi, 15)));
+	}
+#elif AUDIO_GAIN_NEON
+	for(; i + 8 <= frames; i += 8)
+	{
+		int16x8x2_t lr = vld2q_s16(src + 2 * i);
+		int32x4_t lo = vmulq_n_s32(vaddl_s16(vget_low_s16(lr.val[0]), vget_low_s16(lr.val[1])), h);
+		int32x4_t hi = vmulq_n_s32(vaddl_s16(vget_high_s16(lr.val[0]), vget_high_s16(lr.val[1])), h);
+		vst1q_s16(dst + i, vcombine_s16(vshrn_n_s32(lo, 15), vshrn_n_s32(hi, 15)));
+	}
+#endif
+	for(; i < frames; i++)
+		dst[i] = (int16_t)((((int32_t)src[2 * i] + (int32_t)src[2 * i + 1]) * h) >> 15);
+}
+
+CHIAKI_EXPORT void chiaki_audio_s16_upmix(int16_t *dst, const int16_t *src, size_t frames)
+{
+	size_t i = 0;
+#if AUDIO_GAIN_SSE2
+	for(; i + 8 <= frames; i += 8)
+	{
+		__m128i x = _mm_loadu_si128((const __m128i *)(src + i));
+		_mm_storeu_si128((__m128i *)(dst + 2 * i), _mm_unpacklo_epi16(x, x));
+		_mm_storeu_si128((__m128i *)(dst + 2 * i + 8), _mm_unpackhi_epi16(x, x));
+	}
+#elif AUDIO_GAIN_NEON
+	for(; i + 8 <= frames; i += 8)
+	{
+		int16x8_t x = vld1q_s16(src + i);
+		int16x8x2_t lr = { { x, x } };
+		vst2q_s16(dst + 2 * i, lr);
+	}
+#endif
+	for(; i < frames; i++)
+		dst[2 * i] = dst[2 * i + 1] = src[i];
+}
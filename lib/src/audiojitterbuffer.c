@@ -0,0 +1,231 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#include <chiaki/audiojitterbuffer.h>
+
+#include <string.h>
+
+#define SLOT_MASK (CHIAKI_AUDIO_JITTER_BUFFER_SIZE - 1)
+
+// pops in a row with more than TARGET_HYSTERESIS frames above the target before one frame is dropped
+#define TARGET_HYSTERESIS 2
+#define ADAPT_FRAMES 25
+
+// the target covers this many times the jitter
+#define JITTER_FACTOR 3
+
+static void jitter_buffer_clear(ChiakiAudioJitterBuffer *jb, uint64_t frame_us)
+{
+	for(size_t i=0; i<CHIAKI_AUDIO_JITTER_BUFFER_SIZE; i++)
+		jb->slots[i].valid = false;
+	jb->frame_us = frame_us ? frame_us : 1;
+	jb->started = false;
+	jb->playing = false;
+	jb->advanced = false;
+	jb->next_index = 0;
+	jb->newest_index = 0;
+	jb->arrival_us = 0;
+	jb->jitter_us_q4 = 0;
+	jb->target = CHIAKI_AUDIO_JITTER_BUFFER_TARGET_MIN;
+	jb->conceal_run = 0;
+	jb->above_target_run = 0;
+}
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_audio_jitter_buffer_init(ChiakiAudioJitterBuffer *jb, uint64_t frame_us)
+{
+	jitter_buffer_clear(jb, frame_us);
+	memset(&jb->stats, 0, sizeof(jb->stats));
+	return chiaki_mutex_init(&jb->mutex, false);
+}
+
+CHIAKI_EXPORT void chiaki_audio_jitter_buffer_fini(ChiakiAudioJitterBuffer *jb)
+{
+	chiaki_mutex_fini(&jb->mutex);
+}
+
+CHIAKI_EXPORT void chiaki_audio_jitter_buffer_reset(ChiakiAudioJitterBuffer *jb, uint64_t frame_us)
+{
+	chiaki_mutex_lock(&jb->mutex);
+	jitter_buffer_clear(jb, frame_us);
+	chiaki_mutex_unlock(&jb->mutex);
+}
+
+/**
+ * Number of frames from next_index up to and including newest_index, whether they arrived or not.
+ */
+static unsigned int jitter_buffer_depth(ChiakiAudioJitterBuffer *jb)
+{
+	if(!jb->started || chiaki_seq_num_16_gt(jb->next_index, jb->newest_index))
+		return 0;
+	return (ChiakiSeqNum16)(jb->newest_index - jb->next_index) + 1;
+}
+
+static void jitter_buffer_store(ChiakiAudioJitterBuffer *jb, ChiakiSeqNum16 index, const uint8_t *buf, size_t buf_size)
+{
+	ChiakiAudioJitterBufferSlot *slot = &jb->slots[index & SLOT_MASK];
+	if(slot->valid && slot->index == index)
+		return; // redundant copy
+	slot->valid = true;
+	slot->index = index;
+	slot->size = buf_size;
+	memcpy(slot->buf, buf, buf_size);
+}
+
+static void jitter_buffer_update_jitter(ChiakiAudioJitterBuffer *jb, ChiakiSeqNum16 index, uint64_t now_us)
+{
+	// RFC 3550 6.4.1, with the frame index as the media timestamp
+	int64_t expected_us = (int64_t)(ChiakiSeqNum16)(index - jb->newest_index) * (int64_t)jb->frame_us;
+	int64_t d = (int64_t)(now_us - jb->arrival_us) - expected_us;
+	if(d < 0)
+		d = -d;
+	int64_t jitter = (int64_t)jb->jitter_us_q4;
+	jitter += ((d << 4) - jitter) / 16;
+	jb->jitter_us_q4 = (uint64_t)jitter;
+
+	uint64_t jitter_us = jb->jitter_us_q4 >> 4;
+	uint64_t target = 1 + (JITTER_FACTOR * jitter_us + jb->frame_us - 1) / jb->frame_us;
+	if(target < CHIAKI_AUDIO_JITTER_BUFFER_TARGET_MIN)
+		target = CHIAKI_AUDIO_JITTER_BUFFER_TARGET_MIN;
+	else if(target > CHIAKI_AUDIO_JITTER_BUFFER_TARGET_MAX)
+		target = CHIAKI_AUDIO_JITTER_BUFFER_TARGET_MAX;
+	jb->target = (unsigned int)target;
+}
+
+CHIAKI_EXPORT bool chiaki_audio_jitter_buffer_push(ChiakiAudioJitterBuffer *jb, ChiakiSeqNum16 index, const uint8_t *buf, size_t buf_size, uint64_t now_us)
+{
+	if(buf_size > CHIAKI_AUDIO_JITTER_BUFFER_UNIT_SIZE_MAX)
+		return false;
+
+	chiaki_mutex_lock(&jb->mutex);
+	bool r = true;
+
+	if(!jb->started)
+		goto restart;
+
+	if(chiaki_seq_num_16_lt(index, jb->next_index))
+	{
+		if(jb->advanced || (ChiakiSeqNum16)(jb->newest_index - index) >= CHIAKI_AUDIO_JITTER_BUFFER_SIZE)
+		{
+			jb->stats.frames_late++;
+			r = false;
+			goto beach;
+		}
+		// still buffering, this just arrived out of order
+		jb->next_index = index;
+	}
+	else if((ChiakiSeqNum16)(index - jb->next_index) >= CHIAKI_AUDIO_JITTER_BUFFER_SIZE)
+	{
+		// the stream jumped ahead, nothing buffered is useful anymore
+		for(size_t i=0; i<CHIAKI_AUDIO_JITTER_BUFFER_SIZE; i++)
+			jb->slots[i].valid = false;
+		goto restart;
+	}
+
+	if(chiaki_seq_num_16_gt(index, jb->newest_index))
+	{
+		jitter_buffer_update_jitter(jb, index, now_us);
+		jb->newest_index = index;
+		jb->arrival_us = now_us;
+	}
+	jitter_buffer_store(jb, index, buf, buf_size);
+	goto beach;
+
+restart:
+	jb->started = true;
+	jb->playing = false;
+	jb->advanced = false;
+	jb->next_index = index;
+	jb->newest_index = index;
+	jb->arrival_us = now_us;
+	jitter_buffer_store(jb, index, buf, buf_size);
+beach:
+	chiaki_mutex_unlock(&jb->mutex);
+	return r;
+}
+
+CHIAKI_EXPORT ChiakiAudioJitterBufferResult chiaki_audio_jitter_buffer_pop(ChiakiAudioJitterBuffer *jb, uint8_t *buf, size_t *buf_size, ChiakiSeqNum16 *index)
+{
+	chiaki_mutex_lock(&jb->mutex);
+	ChiakiAudioJitterBufferResult r = CHIAKI_AUDIO_JITTER_BUFFER_NONE;
+	if(!jb->started)
+		goto beach;
+
+	unsigned int depth = jitter_buffer_depth(jb);
+	if(!jb->playing)
+	{
+		if(depth < jb->target)
+			goto beach;
+		jb->playing = true;
+		jb->conceal_run = 0;
+		jb->above_target_run = 0;
+	}
+
+	if(depth > jb->target + TARGET_HYSTERESIS)
+	{
+		if(++jb->above_target_run >= ADAPT_FRAMES)
+		{
+			// latency has been too high for a while, skip one frame to catch up
+			jb->slots[jb->next_index & SLOT_MASK].valid = false;
+			jb->next_index++;
+			jb->advanced = true;
+			jb->stats.frames_dropped++;
+			jb->above_target_run = 0;
+			depth--;
+		}
+	}
+	else
+		jb->above_target_run = 0;
+
+	if(!depth)
+	{
+		if(++jb->conceal_run > CHIAKI_AUDIO_JITTER_BUFFER_CONCEAL_MAX)
+		{
+			jb->playing = false;
+			jb->stats.underruns++;
+			goto beach;
+		}
+	}
+	else
+		jb->conceal_run = 0;
+
+	ChiakiAudioJitterBufferSlot *slot = &jb->slots[jb->next_index & SLOT_MASK];
+	ChiakiAudioJitterBufferSlot *slot_next = &jb->slots[(ChiakiSeqNum16)(jb->next_index + 1) & SLOT_MASK];
+	if(slot->valid && slot->index == jb->next_index)
+	{
+		memcpy(buf, slot->buf, slot->size);
+		*buf_size = slot->size;
+		r = CHIAKI_AUDIO_JITTER_BUFFER_FRAME;
+		jb->stats.frames_played++;
+	}
+	else if(slot_next->valid && slot_next->index == (ChiakiSeqNum16)(jb->next_index + 1))
+	{
+		// keep the next frame in its slot, it is still decoded normally afterwards
+		memcpy(buf, slot_next->buf, slot_next->size);
+		*buf_size = slot_next->size;
+		r = CHIAKI_AUDIO_JITTER_BUFFER_FEC;
+		jb->stats.frames_fec++;
+	}
+	else
+	{
+		r = CHIAKI_AUDIO_JITTER_BUFFER_PLC;
+		jb->stats.frames_concealed++;
+	}
+	if(index)
+		*index = jb->next_index;
+	slot->valid = false;
+	jb->next_index++;
+	jb->advanced = true;
+
+beach:
+	chiaki_mutex_unlock(&jb->mutex);
+	return r;
+}
+
+CHIAKI_EXPORT void chiaki_audio_jitter_buffer_get_stats(ChiakiAudioJitterBuffer *jb, ChiakiAudioJitterBufferStats *stats)
+{
+	chiaki_mutex_lock(&jb->mutex);
+	*stats = jb->stats;
+	stats->latency_us = (uint64_t)jitter_buffer_depth(jb) * jb->frame_us;
+	stats->target_us = (uint64_t)jb->target * jb->frame_us;
+	stats->jitter_us = jb->jitter_us_q4 >> 4;
+	chiaki_mutex_unlock(&jb->mutex);
+}
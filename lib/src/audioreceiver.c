@@ -1,7 +1,11 @@
 // SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
 
+#include <chiaki/config.h>
+
 #include <chiaki/audioreceiver.h>
 #include <chiaki/session.h>
+#include <chiaki/trace.h>
+#include <chiaki/time.h>
 
 #include <string.h>
 
@@ -25,9 +29,6 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_audio_receiver_init(ChiakiAudioReceiver *au
 
 CHIAKI_EXPORT void chiaki_audio_receiver_fini(ChiakiAudioReceiver *audio_receiver)
 {
-#ifdef CHIAKI_LIB_ENABLE_OPUS
-	opus_decoder_destroy(audio_receiver->opus_decoder);
-#endif
 	chiaki_mutex_fini(&audio_receiver->mutex);
 }
 
@@ -44,6 +45,10 @@ CHIAKI_EXPORT void chiaki_audio_receiver_stream_info(ChiakiAudioReceiver *audio_
 
 	if(audio_receiver->session->audio_sink.header_cb)
 		audio_receiver->session->audio_sink.header_cb(audio_header, audio_receiver->session->audio_sink.user);
+#if CHIAKI_LIB_ENABLE_FFMPEG_DECODER
+	if(audio_receiver->session->recorder)
+		chiaki_recorder_audio_header(audio_receiver->session->recorder, audio_header);
+#endif
 
 	chiaki_mutex_unlock(&audio_receiver->mutex);
 }
@@ -109,18 +114,52 @@ CHIAKI_EXPORT void chiaki_audio_receiver_av_packet(ChiakiAudioReceiver *audio_re
 		chiaki_packet_stats_push_seq(audio_receiver->packet_stats, packet->frame_index);
 }
 
+static void record_frame(ChiakiAudioReceiver *audio_receiver, ChiakiSeqNum16 frame_index, uint8_t *buf, size_t buf_size)
+{
+#if CHIAKI_LIB_ENABLE_FFMPEG_DECODER
+	if(audio_receiver->session->recorder)
+		chiaki_recorder_audio_frame(audio_receiver->session->recorder, frame_index, buf, buf_size, chiaki_time_now_monotonic_us());
+#endif
+}
+
 static void chiaki_audio_receiver_frame(ChiakiAudioReceiver *audio_receiver, ChiakiSeqNum16 frame_index, bool is_haptics, uint8_t *buf, size_t buf_size)
 {
 	chiaki_mutex_lock(&audio_receiver->mutex);
 
+	ChiakiAudioSink *audio_sink = &audio_receiver->session->audio_sink;
+	if(!is_haptics && audio_sink->frame_index_cb)
+	{
+		if(chiaki_seq_num_16_gt(frame_index, audio_receiver->frame_index_prev))
+		{
+			audio_receiver->frame_index_prev = frame_index;
+			CHIAKI_TRACE_INSTANT(CHIAKI_TRACE_STAGE_AUDIO_FRAME, frame_index);
+			chiaki_metrics_counter_inc(audio_receiver->session->metrics, CHIAKI_METRIC_AUDIO_FRAMES);
+			record_frame(audio_receiver, frame_index, buf, buf_size);
+		}
+		audio_sink->frame_index_cb(frame_index, buf, buf_size, audio_sink->user);
+		goto beach;
+	}
+
 	if(!chiaki_seq_num_16_gt(frame_index, audio_receiver->frame_index_prev))
 		goto beach;
 	audio_receiver->frame_index_prev = frame_index;
 
+	if(!is_haptics)
+	{
+		CHIAKI_TRACE_INSTANT(CHIAKI_TRACE_STAGE_AUDIO_FRAME, frame_index);
+		chiaki_metrics_counter_inc(audio_receiver->session->metrics, CHIAKI_METRIC_AUDIO_FRAMES);
+		record_frame(audio_receiver, frame_index, buf, buf_size);
+	}
 	if(is_haptics && audio_receiver->session->haptics_sink.frame_cb)
 		audio_receiver->session->haptics_sink.frame_cb(buf, buf_size, audio_receiver->session->haptics_sink.user);
 	else if(!is_haptics && audio_receiver->session->audio_sink.frame_cb)
+	{
+		// the same thread handles video, whose frame context must survive this
+		int64_t frame_context = chiaki_trace_frame_context();
+		CHIAKI_TRACE_SET_FRAME(frame_index);
 		audio_receiver->session->audio_sink.frame_cb(buf, buf_size, audio_receiver->session->audio_sink.user);
+		CHIAKI_TRACE_SET_FRAME(frame_context);
+	}
 
 beach:
 	chiaki_mutex_unlock(&audio_receiver->mutex);
@@ -0,0 +1,226 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#include <chiaki/audioring.h>
+#include <chiaki/audio.h>
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+// smoothing of the fill level for the drift controller, 1/2^FILL_AVG_SHIFT per write
+#define FILL_AVG_SHIFT 6
+// correction in ppm per frame of deviation from the target, relative to the target
+#define DRIFT_GAIN_PPM 20000
+
+struct chiaki_audio_ring_t
+{
+	unsigned int channels;
+	size_t capacity; // frames, power of 2
+	size_t target;
+	int16_t *buf;
+
+	atomic_size_t head; // frames ever written
+	atomic_size_t tail; // frames ever read
+
+	// consumer statistics
+	atomic_size_t fill_min;
+	atomic_size_t fill_max;
+	atomic_uint_fast64_t underrun_frames;
+
+	// producer state
+	atomic_uint_fast64_t overrun_frames;
+	atomic_size_t fill_avg;
+	atomic_int_fast32_t drift_ppm;
+	uint64_t fill_avg_q; // FILL_AVG_SHIFT fractional bits
+	bool fill_avg_valid;
+	double resample_pos; // position of the next output frame, 0 is prev_frame, 1 the first frame of the next write
+	int16_t prev_frame[CHIAKI_AUDIO_RING_CHANNELS_MAX];
+};
+
+CHIAKI_EXPORT ChiakiAudioRing *chiaki_audio_ring_new(unsigned int channels, size_t capacity_frames, size_t target_frames)
+{
+	if(!channels || channels > CHIAKI_AUDIO_RING_CHANNELS_MAX || !capacity_frames)
+		return NULL;
+	size_t capacity = 1;
+	while(capacity < capacity_frames)
+		capacity <<= 1;
+
+	ChiakiAudioRing *ring = CHIAKI_NEW(ChiakiAudioRing);
+	if(!ring)
+		return NULL;
+	ring->buf = calloc(capacity * channels, sizeof(int16_t));
+	if(!ring->buf)
+	{
+		free(ring);
+		return NULL;
+	}
+	ring->channels = channels;
+	ring->capacity = capacity;
+	ring->target = target_frames < capacity ? target_frames : capacity;
+	atomic_init(&ring->head, 0);
+	atomic_init(&ring->tail, 0);
+	atomic_init(&ring->fill_min, SIZE_MAX);
+	atomic_init(&ring->fill_max, 0);
+	atomic_init(&ring->underrun_frames, 0);
+	atomic_init(&ring->overrun_frames, 0);
+	atomic_init(&ring->fill_avg, 0);
+	atomic_init(&ring->drift_ppm, 0);
+	ring->fill_avg_q = 0;
+	ring->fill_avg_valid = false;
+	ring->resample_pos = 1.0;
+	memset(ring->prev_frame, 0, sizeof(ring->prev_frame));
+	return ring;
+}
+
+CHIAKI_EXPORT void chiaki_audio_ring_free(ChiakiAudioRing *ring)
+{
+	if(!ring)
+		return;
+	free(ring->buf);
+	free(ring);
+}
+
+CHIAKI_EXPORT size_t chiaki_audio_ring_fill(ChiakiAudioRing *ring)
+{
+	size_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+	size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+	return head - tail;
+}
+
+CHIAKI_EXPORT size_t chiaki_audio_ring_write(ChiakiAudioRing *ring, const int16_t *buf, size_t frames)
+{
+	size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+	size_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+	size_t space = ring->capacity - (head - tail);
+	size_t n = frames < space ? frames : space;
+
+	size_t offset = head & (ring->capacity - 1);
+	size_t first = ring->capacity - offset;
+	if(first > n)
+		first = n;
+	memcpy(ring->buf + offset * ring->channels, buf, first * ring->channels * sizeof(int16_t));
+	memcpy(ring->buf, buf + first * ring->channels, (n - first) * ring->channels * sizeof(int16_t));
+
+	atomic_store_explicit(&ring->head, head + n, memory_order_release);
+	if(n < frames)
+		atomic_fetch_add_explicit(&ring->overrun_frames, frames - n, memory_order_relaxed);
+	return n;
+}
+
+/**
+ * Update the smoothed fill level and derive the resampling step from it.
+ * @return input frames to advance per output frame
+ */
+static double drift_step(ChiakiAudioRing *ring, size_t fill)
+{
+	if(!ring->fill_avg_valid)
+	{
+		ring->fill_avg_q = (uint64_t)fill << FILL_AVG_SHIFT;
+		ring->fill_avg_valid = true;
+	}
+	else
+		ring->fill_avg_q = ring->fill_avg_q - (ring->fill_avg_q >> FILL_AVG_SHIFT) + fill;
+	size_t fill_avg = (size_t)(ring->fill_avg_q >> FILL_AVG_SHIFT);
+	atomic_store_explicit(&ring->fill_avg, fill_avg, memory_order_relaxed);
+
+	int64_t ppm = 0;
+	if(ring->target)
+		ppm = ((int64_t)fill_avg - (int64_t)ring->target) * DRIFT_GAIN_PPM / (int64_t)ring->target;
+	if(ppm > CHIAKI_AUDIO_RING_DRIFT_PPM_MAX)
+		ppm = CHIAKI_AUDIO_RING_DRIFT_PPM_MAX;
+	else if(ppm < -CHIAKI_AUDIO_RING_DRIFT_PPM_MAX)
+		ppm = -CHIAKI_AUDIO_RING_DRIFT_PPM_MAX;
+	atomic_store_explicit(&ring->drift_ppm, (int_fast32_t)ppm, memory_order_relaxed);
+	return 1.0 + (double)ppm / 1000000.0;
+}
+
+CHIAKI_EXPORT size_t chiaki_audio_ring_write_compensated(ChiakiAudioRing *ring, const int16_t *buf, size_t frames)
+{
+	if(!frames)
+		return 0;
+	size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+	size_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+	double step = drift_step(ring, head - tail);
+	size_t space = ring->capacity - (head - tail);
+
+	// linear interpolation over prev_frame followed by buf
+	unsigned int channels = ring->channels;
+	size_t mask = ring->capacity - 1;
+	double pos = ring->resample_pos - 1.0; // relative to buf[0], -1 is prev_frame
+	size_t n = 0;
+	uint64_t dropped = 0;
+	for(; pos < (double)(frames - 1) + 1e-9; pos += step)
+	{
+		if(n == space)
+		{
+			dropped++;
+			continue;
+		}
+		double i_f = pos < 0.0 ? -1.0 : (double)(size_t)pos;
+		ptrdiff_t i = (ptrdiff_t)i_f;
+		float f = (float)(pos - i_f);
+		const int16_t *a = i < 0 ? ring->prev_frame : buf + (size_t)i * channels;
+		const int16_t *b = buf + (size_t)(i + 1) * channels;
+		if(i + 1 >= (ptrdiff_t)frames)
+			b = a;
+		int16_t *out = ring->buf + ((head + n) & mask) * channels;
+		for(unsigned int c=0; c<channels; c++)
+		{
+			float v = (float)a[c] + ((float)b[c] - (float)a[c]) * f;
+			out[c] = (int16_t)(v < 0.0f ? v - 0.5f : v + 0.5f);
+		}
+		n++;
+	}
+	ring->resample_pos = pos - (double)(frames - 1);
+	memcpy(ring->prev_frame, buf + (frames - 1) * channels, channels * sizeof(int16_t));
+
+	atomic_store_explicit(&ring->head, head + n, memory_order_release);
+	if(dropped)
+		atomic_fetch_add_explicit(&ring->overrun_frames, dropped, memory_order_relaxed);
+	return n;
+}
+
+CHIAKI_EXPORT void chiaki_audio_ring_read(ChiakiAudioRing *ring, int16_t *buf, size_t frames, uint16_t gain)
+{
+	size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+	size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+	size_t fill = head - tail;
+
+	if(fill < atomic_load_explicit(&ring->fill_min, memory_order_relaxed))
+		atomic_store_explicit(&ring->fill_min, fill, memory_order_relaxed);
+	if(fill > atomic_load_explicit(&ring->fill_max, memory_order_relaxed))
+		atomic_store_explicit(&ring->fill_max, fill, memory_order_relaxed);
+
+	size_t n = frames < fill ? frames : fill;
+	size_t offset = tail & (ring->capacity - 1);
+	size_t first = ring->capacity - offset;
+	if(first > n)
+		first = n;
+	unsigned int channels = ring->channels;
+	chiaki_audio_s16_gain(buf, ring->buf + offset * channels, first * channels, gain);
+	chiaki_audio_s16_gain(buf + first * channels, ring->buf, (n - first) * channels, gain);
+	atomic_store_explicit(&ring->tail, tail + n, memory_order_release);
+
+	if(n < frames)
+	{
+		memset(buf + n * channels, 0, (frames - n) * channels * sizeof(int16_t));
+		atomic_fetch_add_explicit(&ring->underrun_frames, frames - n, memory_order_relaxed);
+	}
+}
+
+CHIAKI_EXPORT void chiaki_audio_ring_get_stats(ChiakiAudioRing *ring, ChiakiAudioRingStats *stats)
+{
+	stats->capacity_frames = ring->capacity;
+	stats->target_frames = ring->target;
+	stats->fill_frames = chiaki_audio_ring_fill(ring);
+	stats->fill_min = atomic_exchange_explicit(&ring->fill_min, SIZE_MAX, memory_order_relaxed);
+	stats->fill_max = atomic_exchange_explicit(&ring->fill_max, 0, memory_order_relaxed);
+	if(stats->fill_min == SIZE_MAX)
+		stats->fill_min = stats->fill_max = stats->fill_frames; // no reads since the last call
+	stats->fill_avg = atomic_load_explicit(&ring->fill_avg, memory_order_relaxed);
+	stats->drift_ppm = (int32_t)atomic_load_explicit(&ring->drift_ppm, memory_order_relaxed);
+	stats->underrun_frames = atomic_load_explicit(&ring->underrun_frames, memory_order_relaxed);
+	stats->overrun_frames = atomic_load_explicit(&ring->overrun_frames, memory_order_relaxed);
+}
@@ -12,36 +12,35 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_audio_sender_init(ChiakiAudioSender *audio_
     audio_sender->ps5 = session->connect_info.ps5;
     audio_sender->takion = &(session->stream_connection.takion);
     audio_sender->frame_index = 0;
+    audio_sender->frames_count = 0;
     audio_sender->buf_size_per_unit = 40;
     audio_sender->buf_stride_per_unit = ((audio_sender->buf_size_per_unit + 0xf) / 0x10) * 0x10;
-    audio_sender->framea = NULL;
-    audio_sender->frameb = NULL;
-    audio_sender->frame_buf_size = 3 * audio_sender->buf_size_per_unit;
-    audio_sender->frame_buf = malloc(audio_sender->frame_buf_size);
-    if(!audio_sender->frame_buf)
+    audio_sender->filled_packet_header_size = 19 + (audio_sender->ps5 ? 1 : 0);
+    audio_sender->history = malloc(CHIAKI_AUDIO_SENDER_FEC_UNITS * audio_sender->buf_size_per_unit);
+    if(!audio_sender->history)
         return CHIAKI_ERR_MEMORY;
-    audio_sender->filled_packet_buf = malloc(audio_sender->frame_buf_size + 20);
+    audio_sender->filled_packet_buf = malloc(audio_sender->filled_packet_header_size + (1 + CHIAKI_AUDIO_SENDER_FEC_UNITS) * audio_sender->buf_size_per_unit);
     if(!audio_sender->filled_packet_buf)
+    {
+        free(audio_sender->history);
         return CHIAKI_ERR_MEMORY;
+    }
 
     ChiakiErrorCode err = chiaki_mutex_init(&audio_sender->mutex, false);
     if(err != CHIAKI_ERR_SUCCESS)
+    {
+        free(audio_sender->filled_packet_buf);
+        free(audio_sender->history);
         return err;
+    }
 
     return CHIAKI_ERR_SUCCESS;
 }
 
 CHIAKI_EXPORT void chiaki_audio_sender_fini(ChiakiAudioSender *audio_sender)
 {
-#ifdef CHIAKI_LIB_ENABLE_OPUS
-	opus_encoder_destroy(audio_sender->opus_decoder);
-#endif
-    free(audio_sender->frame_buf);
+    free(audio_sender->history);
     free(audio_sender->filled_packet_buf);
-    if(audio_sender->framea)
-        free(audio_sender->framea);
-    if(audio_sender->frameb)
-        free(audio_sender->frameb);
     chiaki_mutex_fini(&audio_sender->mutex);
 }
 
@@ -51,66 +50,51 @@ CHIAKI_EXPORT void chiaki_audio_sender_opus_data(ChiakiAudioSender *audio_sender
     // if no audio the packet will have only 3 encoded units because there is no entropy in the packet, otherwise should be max of 40
     if(opus_sender_size != audio_sender->buf_size_per_unit)
         return;
+    size_t unit_size = audio_sender->buf_size_per_unit;
+    uint64_t n = audio_sender->frames_count++;
+
+    // The packet carries the current frame as its source unit, followed by the two before it as fec units,
+    // oldest first, so a single lost packet can be restored from the next one.
+    // Until there are enough frames, the current one stands in for the missing ones, like the console does it.
+    if(n == 0)
+    {
+        for(size_t i = 0; i < CHIAKI_AUDIO_SENDER_FEC_UNITS; i++)
+            memcpy(audio_sender->history + i * unit_size, opus_sender, unit_size);
+    }
+
     uint8_t packet_type = 3; // TAKION_PACKET_TYPE_AUDIO
     uint16_t packet_index = htons(audio_sender->frame_index);
     uint16_t frame_index = htons(audio_sender->frame_index + 1);
     uint32_t unit_index = 0;
-    uint32_t units_in_frame_total = 3;
+    uint32_t units_in_frame_total = 1 + CHIAKI_AUDIO_SENDER_FEC_UNITS;
     uint32_t units_in_frame_fec_raw = 10273;
     uint32_t units_number = htonl((units_in_frame_fec_raw & 0xffff) | (((units_in_frame_total - 1) & 0xff) << 0x10) | ((unit_index & 0xff) << 0x18));
     uint32_t key_pos = htonl(0);
     uint8_t codec = 5;
     uint32_t gmac = htonl(0);
-    uint8_t zero_byte = 0;
-    bool is_ps5 = audio_sender->ps5;
-    uint8_t ps5_packet = 0;
-    if(is_ps5)
-        ps5_packet = 1;
 
-    if(!audio_sender->frameb)
-    {
-        audio_sender->frameb = malloc(audio_sender->buf_size_per_unit);
-        if(!audio_sender->frameb)
-        {
-            CHIAKI_LOGE(audio_sender->log, "Error allocating audio frameb");
-            return;
-        }
-        memcpy(audio_sender->frameb, opus_sender, opus_sender_size);
-        return;
-    }
-    if(!audio_sender->framea)
+    uint8_t *buf = audio_sender->filled_packet_buf;
+    buf[0] = packet_type;
+    *(chiaki_unaligned_uint16_t *)(buf + 1) = packet_index;
+    *(chiaki_unaligned_uint16_t *)(buf + 3) = frame_index;
+    *(chiaki_unaligned_uint32_t *)(buf + 5) = units_number;
+    buf[9] = codec;
+    *(chiaki_unaligned_uint32_t *)(buf + 10) = gmac;
+    *(chiaki_unaligned_uint32_t *)(buf + 14) = key_pos;
+    memset(buf + 18, 0, audio_sender->filled_packet_header_size - 18);
+
+    uint8_t *units = buf + audio_sender->filled_packet_header_size;
+    memcpy(units, opus_sender, unit_size);
+    for(size_t i = 0; i < CHIAKI_AUDIO_SENDER_FEC_UNITS; i++)
     {
-        audio_sender->framea = malloc(audio_sender->buf_size_per_unit);
-        if(!audio_sender->framea)
-        {
-            CHIAKI_LOGE(audio_sender->log, "Error allocating audio framea");
-            return;
-        }
-        memcpy(audio_sender->framea, opus_sender, opus_sender_size);
-        return;
+        // slot of frame n - CHIAKI_AUDIO_SENDER_FEC_UNITS + i
+        size_t slot = (size_t)((n + i) % CHIAKI_AUDIO_SENDER_FEC_UNITS);
+        memcpy(units + (1 + i) * unit_size, audio_sender->history + slot * unit_size, unit_size);
     }
-    memcpy(audio_sender->frame_buf, audio_sender->frameb, audio_sender->buf_size_per_unit);
-    memcpy(audio_sender->frame_buf + audio_sender->buf_size_per_unit, audio_sender->framea, audio_sender->buf_size_per_unit);
-    memcpy(audio_sender->frame_buf + 2 * audio_sender->buf_size_per_unit, opus_sender, opus_sender_size);
-    memcpy(audio_sender->frame_buf, opus_sender, opus_sender_size);
-    memcpy(audio_sender->framea, opus_sender, opus_sender_size);
-    memcpy(audio_sender->frameb, audio_sender->framea, audio_sender->buf_size_per_unit);
-
-    uint32_t filled_packet_size = audio_sender->frame_buf_size + 19 + ps5_packet;
+    chiaki_audio_sender_frame(audio_sender, buf, audio_sender->filled_packet_header_size + (1 + CHIAKI_AUDIO_SENDER_FEC_UNITS) * unit_size);
 
-    audio_sender->filled_packet_buf[0] = packet_type;
-    *(chiaki_unaligned_uint16_t *)(audio_sender->filled_packet_buf + 1) = packet_index;
-    *(chiaki_unaligned_uint16_t *)(audio_sender->filled_packet_buf + 3) = frame_index;
-    *(chiaki_unaligned_uint32_t *)(audio_sender->filled_packet_buf + 5) = units_number;
-    audio_sender->filled_packet_buf[9] = codec;
-    *(chiaki_unaligned_uint32_t *)(audio_sender->filled_packet_buf + 10) = gmac;
-    *(chiaki_unaligned_uint32_t *)(audio_sender->filled_packet_buf + 14) = key_pos;
-    audio_sender->filled_packet_buf[18] = zero_byte;
-    if(is_ps5)
-        audio_sender->filled_packet_buf[19] = zero_byte;
-    memcpy(audio_sender->filled_packet_buf + 19 + ps5_packet, audio_sender->frame_buf, audio_sender->frame_buf_size);
-	chiaki_audio_sender_frame(audio_sender, audio_sender->filled_packet_buf, filled_packet_size);
-    return;
+    // overwrites frame n - CHIAKI_AUDIO_SENDER_FEC_UNITS, which was just sent for the last time
+    memcpy(audio_sender->history + (n % CHIAKI_AUDIO_SENDER_FEC_UNITS) * unit_size, opus_sender, unit_size);
 }
 
 static void chiaki_audio_sender_frame(ChiakiAudioSender *audio_sender, uint8_t *buf, size_t buf_size)
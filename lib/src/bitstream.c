@@ -6,6 +6,14 @@
 
 #include "vl_rbsp.h"
 
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define START_CODE_SSE2 1
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define START_CODE_NEON 1
+#endif
+
 static bool skip_startcode(struct vl_vlc *vlc)
 {
 	vl_vlc_fillbits(vlc);
@@ -153,15 +161,10 @@ sps_start:
 	return true;
 }
 
-static bool slice_h264(ChiakiBitstream *bitstream, uint8_t *data, unsigned size, ChiakiBitstreamSlice *slice)
+static bool slice_h264(ChiakiBitstream *bitstream, uint8_t *data, const ChiakiBitstreamNalu *nalu, ChiakiBitstreamSlice *slice)
 {
 	struct vl_vlc vlc = {0};
-	vl_vlc_init(&vlc, data, size);
-	if(!skip_startcode(&vlc))
-	{
-		CHIAKI_LOGW(bitstream->log, "parse_slice_h264: No startcode found");
-		return false;
-	}
+	vl_vlc_init(&vlc, data + nalu->offset, nalu->size);
 
 	vl_vlc_eatbits(&vlc, 1); // forbidden_zero_bit
 	vl_vlc_eatbits(&vlc, 2); // nal_ref_idc
@@ -224,16 +227,10 @@ static bool slice_h264(ChiakiBitstream *bitstream, uint8_t *data, unsigned size,
 	return true;
 }
 
-static bool slice_h265(ChiakiBitstream *bitstream, uint8_t *data, unsigned size, ChiakiBitstreamSlice *slice)
+static bool slice_h265(ChiakiBitstream *bitstream, uint8_t *data, const ChiakiBitstreamNalu *nalu, ChiakiBitstreamSlice *slice)
 {
 	struct vl_vlc vlc = {0};
-	vl_vlc_init(&vlc, data, size);
-
-	if(!skip_startcode(&vlc))
-	{
-		CHIAKI_LOGW(bitstream->log, "parse_slice_h265: No startcode found");
-		return false;
-	}
+	vl_vlc_init(&vlc, data + nalu->offset, nalu->size);
 
 	vl_vlc_eatbits(&vlc, 1); // forbidden_zero_bit
 	unsigned nal_unit_type = vl_vlc_get_uimsbf(&vlc, 6);
@@ -299,15 +296,10 @@ static bool slice_h265(ChiakiBitstream *bitstream, uint8_t *data, unsigned size,
 	return true;
 }
 
-static bool slice_set_reference_frame_h265(ChiakiBitstream *bitstream, uint8_t *data, unsigned size, unsigned reference_frame)
+static bool slice_set_reference_frame_h265(ChiakiBitstream *bitstream, uint8_t *data, const ChiakiBitstreamNalu *nalu, unsigned reference_frame)
 {
 	struct vl_vlc vlc = {0};
-	vl_vlc_init(&vlc, data, size);
-	if(!skip_startcode(&vlc))
-	{
-		CHIAKI_LOGW(bitstream->log, "slice_set_reference_frame_h265: No startcode found");
-		return false;
-	}
+	vl_vlc_init(&vlc, data + nalu->offset, nalu->size);
 
 	vl_vlc_eatbits(&vlc, 1); // forbidden_zero_bit
 	unsigned nal_unit_type = vl_vlc_get_uimsbf(&vlc, 6);
@@ -389,18 +381,131 @@ bool chiaki_bitstream_header(ChiakiBitstream *bitstream, uint8_t *data, unsigned
 	}
 }
 
-bool chiaki_bitstream_slice(ChiakiBitstream *bitstream, uint8_t *data, unsigned size, ChiakiBitstreamSlice *slice)
+size_t chiaki_bitstream_find_start_code(const uint8_t *data, size_t size)
+{
+	size_t i = 0;
+#if START_CODE_SSE2
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i one = _mm_set1_epi8(1);
+	for(; i + 18 <= size; i += 16)
+	{
+		__m128i b0 = _mm_loadu_si128((const __m128i *)(data + i));
+		__m128i b1 = _mm_loadu_si128((const __m128i *)(data + i + 1));
+		__m128i b2 = _mm_loadu_si128((const __m128i *)(data + i + 2));
+		__m128i m = _mm_and_si128(_mm_and_si128(_mm_cmpeq_epi8(b0, zero), _mm_cmpeq_epi8(b1, zero)), _mm_cmpeq_epi8(b2, one));
+		unsigned int mask = (unsigned int)_mm_movemask_epi8(m);
+		if(mask)
+		{
+			while(!(mask & 1))
+			{
+				mask >>= 1;
+				i++;
+			}
+			return i;
+		}
+	}
+#elif START_CODE_NEON
+	const uint8x16_t one = vdupq_n_u8(1);
+	for(; i + 18 <= size; i += 16)
+	{
+		uint8x16_t b0 = vld1q_u8(data + i);
+		uint8x16_t b1 = vld1q_u8(data + i + 1);
+		uint8x16_t b2 = vld1q_u8(data + i + 2);
+		// b0 | b1 | (b2 ^ 1) is zero exactly at a start code
+		uint8x16_t m = vceqq_u8(vorrq_u8(vorrq_u8(b0, b1), veorq_u8(b2, one)), vdupq_n_u8(0));
+		uint64x2_t m64 = vreinterpretq_u64_u8(m);
+		if(vgetq_lane_u64(m64, 0) | vgetq_lane_u64(m64, 1))
+			break; // it is somewhere in these 16, the loop below finds where
+	}
+#endif
+	// the 01 is rarer than the zeros, so let memchr skip ahead to it
+	while(i + 3 <= size)
+	{
+		const uint8_t *one_byte = memchr(data + i + 2, 0x01, size - i - 2);
+		if(!one_byte)
+			break;
+		size_t j = (size_t)(one_byte - data);
+		if(!data[j - 1] && !data[j - 2])
+			return j - 2;
+		i = j - 1;
+	}
+	return size;
+}
+
+static uint8_t nalu_type(ChiakiCodec codec, uint8_t header)
+{
+	if(codec == CHIAKI_CODEC_H264)
+		return header & 0x1f;
+	return (header >> 1) & 0x3f;
+}
+
+static bool nalu_type_is_slice(ChiakiCodec codec, uint8_t type)
 {
+	if(codec == CHIAKI_CODEC_H264)
+		return type >= 1 && type <= 5;
+	return type < 32;
+}
+
+void chiaki_bitstream_index(ChiakiBitstream *bitstream, const uint8_t *data, size_t size, ChiakiBitstreamNalIndex *index)
+{
+	index->nalus_count = 0;
+	index->slice = -1;
+	index->truncated = false;
+
+	size_t start = chiaki_bitstream_find_start_code(data, size);
+	while(start < size)
+	{
+		size_t offset = start + 3;
+		size_t next = chiaki_bitstream_find_start_code(data + offset, size - offset) + offset;
+		ChiakiBitstreamNalu *nalu = &index->nalus[index->nalus_count];
+		nalu->offset = (uint32_t)offset;
+		nalu->start_code_size = start > 0 && !data[start - 1] ? 4 : 3;
+		if(nalu->start_code_size == 4 && index->nalus_count)
+			index->nalus[index->nalus_count - 1].size--; // that zero belongs to the start code, not the previous NAL unit
+		nalu->size = (uint32_t)(next - offset);
+		nalu->type = offset < size ? nalu_type(bitstream->codec, data[offset]) : 0;
+		if(index->slice < 0 && nalu->size && nalu_type_is_slice(bitstream->codec, nalu->type))
+			index->slice = (int)index->nalus_count;
+		index->nalus_count++;
+
+		if(next < size && index->nalus_count == CHIAKI_BITSTREAM_NALUS_MAX)
+		{
+			nalu->size = (uint32_t)(size - offset);
+			index->truncated = true;
+			break;
+		}
+		start = next;
+	}
+}
+
+bool chiaki_bitstream_index_idr(ChiakiCodec codec, const ChiakiBitstreamNalIndex *index)
+{
+	if(index->slice < 0)
+		return false;
+	uint8_t type = index->nalus[index->slice].type;
+	if(codec == CHIAKI_CODEC_H264)
+		return type == 5;
+	return type >= 16 && type <= 21;
+}
+
+bool chiaki_bitstream_slice(ChiakiBitstream *bitstream, uint8_t *data, const ChiakiBitstreamNalIndex *index, ChiakiBitstreamSlice *slice)
+{
+	if(index->slice < 0)
+	{
+		CHIAKI_LOGW(bitstream->log, "chiaki_bitstream_slice: No slice NAL unit found");
+		return false;
+	}
+	const ChiakiBitstreamNalu *nalu = &index->nalus[index->slice];
 	if(bitstream->codec == CHIAKI_CODEC_H264)
-		return slice_h264(bitstream, data, size, slice);
+		return slice_h264(bitstream, data, nalu, slice);
 	else
-		return slice_h265(bitstream, data, size, slice);
+		return slice_h265(bitstream, data, nalu, slice);
 }
 
-bool chiaki_bitstream_slice_set_reference_frame(ChiakiBitstream *bitstream, uint8_t *data, unsigned size, unsigned reference_frame)
+bool chiaki_bitstream_slice_set_reference_frame(ChiakiBitstream *bitstream, uint8_t *data, const ChiakiBitstreamNalIndex *index, unsigned reference_frame)
 {
-	if(bitstream->codec == CHIAKI_CODEC_H264)
+	if(bitstream->codec == CHIAKI_CODEC_H264 || index->slice < 0)
 		return false;
 	else
-		return slice_set_reference_frame_h265(bitstream, data, size, reference_frame);
+		return slice_set_reference_frame_h265(bitstream, data, &index->nalus[index->slice], reference_frame);
 }
@@ -4,6 +4,32 @@
 
 #define CONGESTION_CONTROL_INTERVAL_MS 200
 
+static void congestion_control_send(ChiakiCongestionControl *control)
+{
+	uint64_t received;
+	uint64_t lost;
+	chiaki_packet_stats_get(control->stats, true, &received, &lost);
+	ChiakiTakionCongestionPacket packet = { 0 };
+	uint64_t total = received + lost;
+	control->packet_loss = total > 0 ? (double)lost / total : 0;
+	if(control->packet_loss > control->packet_loss_max)
+	{
+		CHIAKI_LOGW(control->takion->log, "Increasing received packets to reduce hit on stream quality");
+		lost = total * control->packet_loss_max;
+		received = total - lost;
+	}
+	packet.received = (uint16_t)received;
+	packet.lost = (uint16_t)lost;
+	CHIAKI_LOGV(control->takion->log, "Sending Congestion Control Packet, received: %u, lost: %u",
+		(unsigned int)packet.received, (unsigned int)packet.lost);
+	chiaki_takion_send_congestion(control->takion, &packet);
+}
+
+static void congestion_control_timer_func(void *user)
+{
+	congestion_control_send(user);
+}
+
 static void *congestion_control_thread_func(void *user)
 {
 	ChiakiCongestionControl *control = user;
@@ -17,36 +43,29 @@ static void *congestion_control_thread_func(void *user)
 		err = chiaki_bool_pred_cond_timedwait(&control->stop_cond, CONGESTION_CONTROL_INTERVAL_MS);
 		if(err != CHIAKI_ERR_TIMEOUT)
 			break;
-
-		uint64_t received;
-		uint64_t lost;
-		chiaki_packet_stats_get(control->stats, true, &received, &lost);
-		ChiakiTakionCongestionPacket packet = { 0 };
-		uint64_t total = received + lost;
-		control->packet_loss = total > 0 ? (double)lost / total : 0;
-		if(control->packet_loss > control->packet_loss_max)
-		{
-			CHIAKI_LOGW(control->takion->log, "Increasing received packets to reduce hit on stream quality");
-			lost = total * control->packet_loss_max;
-			received = total - lost;
-		}
-		packet.received = (uint16_t)received;
-		packet.lost = (uint16_t)lost;
-		CHIAKI_LOGV(control->takion->log, "Sending Congestion Control Packet, received: %u, lost: %u",
-			(unsigned int)packet.received, (unsigned int)packet.lost);
-		chiaki_takion_send_congestion(control->takion, &packet);
+		congestion_control_send(control);
 	}
 
 	chiaki_bool_pred_cond_unlock(&control->stop_cond);
 	return NULL;
 }
 
-CHIAKI_EXPORT ChiakiErrorCode chiaki_congestion_control_start(ChiakiCongestionControl *control, ChiakiTakion *takion, ChiakiPacketStats *stats, double packet_loss_max)
+CHIAKI_EXPORT ChiakiErrorCode chiaki_congestion_control_start(ChiakiCongestionControl *control, ChiakiTakion *takion, ChiakiPacketStats *stats, double packet_loss_max, ChiakiWorkerPool *pool)
 {
 	control->takion = takion;
 	control->stats = stats;
 	control->packet_loss_max = packet_loss_max;
 	control->packet_loss = 0;
+	control->lane = NULL;
+
+	if(pool)
+	{
+		control->lane = chiaki_worker_lane_new(pool);
+		if(!control->lane)
+			return CHIAKI_ERR_MEMORY;
+		chiaki_worker_lane_set_timer(control->lane, CONGESTION_CONTROL_INTERVAL_MS, congestion_control_timer_func, control);
+		return CHIAKI_ERR_SUCCESS;
+	}
 
 	ChiakiErrorCode err = chiaki_bool_pred_cond_init(&control->stop_cond);
 	if(err != CHIAKI_ERR_SUCCESS)
@@ -66,6 +85,13 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_congestion_control_start(ChiakiCongestionCo
 
 CHIAKI_EXPORT ChiakiErrorCode chiaki_congestion_control_stop(ChiakiCongestionControl *control)
 {
+	if(control->lane)
+	{
+		chiaki_worker_lane_free(control->lane);
+		control->lane = NULL;
+		return CHIAKI_ERR_SUCCESS;
+	}
+
 	ChiakiErrorCode err = chiaki_bool_pred_cond_signal(&control->stop_cond);
 	if(err != CHIAKI_ERR_SUCCESS)
 		return err;
@@ -0,0 +1,180 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#include <chiaki/echoring.h>
+#include <chiaki/audio.h>
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+// play time deviation at which the time mapping is set again instead of smoothed, e.g. after a gap in playback
+#define REANCHOR_US 5000
+// smoothing of the time mapping, 1/2^ORIGIN_AVG_SHIFT of the deviation per write
+#define ORIGIN_AVG_SHIFT 4
+#define ORIGIN_INVALID INT64_MIN
+
+struct chiaki_echo_ring_t
+{
+	unsigned int rate;
+	uint64_t capacity; // samples, power of 2
+	int16_t *buf;
+
+	atomic_uint_fast64_t head; // samples ever written
+	atomic_uint_fast64_t write_end; // head plus the samples currently being written, set before touching buf
+	// play time of sample index i in us is (origin_q + i * 1000000) / rate,
+	// kept in a single value so the reader never sees a mapping from two different writes
+	atomic_int_fast64_t origin_q;
+
+	// reader statistics
+	uint64_t samples_read;
+	uint64_t samples_missing;
+	int64_t offset_us;
+};
+
+CHIAKI_EXPORT ChiakiEchoRing *chiaki_echo_ring_new(unsigned int rate, size_t capacity_samples)
+{
+	if(!rate || !capacity_samples)
+		return NULL;
+	uint64_t capacity = 1;
+	while(capacity < capacity_samples)
+		capacity <<= 1;
+
+	ChiakiEchoRing *ring = CHIAKI_NEW(ChiakiEchoRing);
+	if(!ring)
+		return NULL;
+	ring->buf = calloc(capacity, sizeof(int16_t));
+	if(!ring->buf)
+	{
+		free(ring);
+		return NULL;
+	}
+	ring->rate = rate;
+	ring->capacity = capacity;
+	atomic_init(&ring->head, 0);
+	atomic_init(&ring->write_end, 0);
+	atomic_init(&ring->origin_q, ORIGIN_INVALID);
+	ring->samples_read = 0;
+	ring->samples_missing = 0;
+	ring->offset_us = 0;
+	return ring;
+}
+
+CHIAKI_EXPORT void chiaki_echo_ring_free(ChiakiEchoRing *ring)
+{
+	if(!ring)
+		return;
+	free(ring->buf);
+	free(ring);
+}
+
+CHIAKI_EXPORT void chiaki_echo_ring_write_stereo(ChiakiEchoRing *ring, const int16_t *frames, size_t count, uint16_t gain, uint64_t play_time_us)
+{
+	if(!count)
+		return;
+	if(count > ring->capacity)
+	{
+		// only the end would survive anyway
+		size_t skip = count - (size_t)ring->capacity;
+		frames += 2 * skip;
+		play_time_us += (uint64_t)skip * 1000000 / ring->rate;
+		count = (size_t)ring->capacity;
+	}
+
+	uint64_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+
+	int64_t play_q = (int64_t)play_time_us * ring->rate;
+	int64_t origin_new = play_q - (int64_t)head * 1000000;
+	int64_t origin = atomic_load_explicit(&ring->origin_q, memory_order_relaxed);
+	if(origin != ORIGIN_INVALID)
+	{
+		int64_t dev = origin_new - origin;
+		int64_t reanchor = (int64_t)REANCHOR_US * ring->rate;
+		if(dev < reanchor && dev > -reanchor)
+			origin_new = origin + dev / (1 << ORIGIN_AVG_SHIFT);
+	}
+
+	// readers discard whatever they copied from positions that may have been overwritten meanwhile
+	atomic_store_explicit(&ring->write_end, head + count, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+
+	size_t off = (size_t)(head & (ring->capacity - 1));
+	size_t first = (size_t)ring->capacity - off;
+	if(first > count)
+		first = count;
+	chiaki_audio_s16_downmix_gain(ring->buf + off, frames, first, gain);
+	if(first < count)
+		chiaki_audio_s16_downmix_gain(ring->buf, frames + 2 * first, count - first, gain);
+
+	atomic_store_explicit(&ring->head, head + count, memory_order_release);
+	atomic_store_explicit(&ring->origin_q, origin_new, memory_order_release);
+}
+
+static int64_t floor_div(int64_t a, int64_t b)
+{
+	int64_t q = a / b;
+	return (a % b != 0 && (a < 0) != (b < 0)) ? q - 1 : q;
+}
+
+CHIAKI_EXPORT size_t chiaki_echo_ring_read(ChiakiEchoRing *ring, int16_t *buf, size_t samples, uint64_t time_us)
+{
+	int64_t origin = atomic_load_explicit(&ring->origin_q, memory_order_acquire);
+	int64_t head = (int64_t)atomic_load_explicit(&ring->head, memory_order_acquire);
+	ring->samples_read += samples;
+	if(origin == ORIGIN_INVALID)
+	{
+		memset(buf, 0, samples * sizeof(int16_t));
+		ring->samples_missing += samples;
+		return 0;
+	}
+
+	int64_t start = floor_div((int64_t)time_us * ring->rate - origin, 1000000);
+	int64_t end = start + (int64_t)samples;
+	ring->offset_us = (start - head) * 1000000 / (int64_t)ring->rate;
+
+	int64_t lo = head - (int64_t)ring->capacity;
+	if(lo < start)
+		lo = start;
+	if(lo < 0)
+		lo = 0;
+	int64_t hi = end < head ? end : head;
+	if(hi <= lo)
+	{
+		memset(buf, 0, samples * sizeof(int16_t));
+		ring->samples_missing += samples;
+		return 0;
+	}
+
+	memset(buf, 0, (size_t)(lo - start) * sizeof(int16_t));
+	memset(buf + (hi - start), 0, (size_t)(end - hi) * sizeof(int16_t));
+	for(int64_t i = lo; i < hi;)
+	{
+		size_t off = (size_t)((uint64_t)i & (ring->capacity - 1));
+		size_t n = (size_t)ring->capacity - off;
+		if((int64_t)n > hi - i)
+			n = (size_t)(hi - i);
+		memcpy(buf + (i - start), ring->buf + off, n * sizeof(int16_t));
+		i += (int64_t)n;
+	}
+
+	// anything the writer may have started overwriting during the copy is not trustworthy
+	atomic_thread_fence(memory_order_acquire);
+	int64_t valid = (int64_t)atomic_load_explicit(&ring->write_end, memory_order_relaxed) - (int64_t)ring->capacity;
+	if(lo < valid)
+	{
+		int64_t torn_end = hi < valid ? hi : valid;
+		memset(buf + (lo - start), 0, (size_t)(torn_end - lo) * sizeof(int16_t));
+		lo = torn_end;
+	}
+
+	size_t available = (size_t)(hi - lo);
+	ring->samples_missing += samples - available;
+	return available;
+}
+
+CHIAKI_EXPORT void chiaki_echo_ring_get_stats(ChiakiEchoRing *ring, ChiakiEchoRingStats *stats)
+{
+	stats->samples_read = ring->samples_read;
+	stats->samples_missing = ring->samples_missing;
+	stats->offset_us = ring->offset_us;
+}
@@ -1,6 +1,7 @@
 // SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
 
 #include <chiaki/feedbacksender.h>
+#include <chiaki/trace.h>
 
 #define FEEDBACK_STATE_TIMEOUT_MIN_MS 8 // minimum time to wait between sending 2 packets
 #define FEEDBACK_STATE_TIMEOUT_MAX_MS 200 // maximum time to wait between sending 2 packets
@@ -122,6 +123,7 @@ static void feedback_sender_send_state(ChiakiFeedbackSender *feedback_sender)
 	state.orient_z = feedback_sender->controller_state.orient_z;
 	state.orient_w = feedback_sender->controller_state.orient_w;
 
+	CHIAKI_TRACE_INSTANT(CHIAKI_TRACE_STAGE_FEEDBACK_STATE, feedback_sender->state_seq_num);
 	ChiakiErrorCode err = chiaki_takion_send_feedback_state(feedback_sender->takion, feedback_sender->state_seq_num++, &state);
 	if(err != CHIAKI_ERR_SUCCESS)
 		CHIAKI_LOGE(feedback_sender->log, "FeedbackSender failed to send Feedback State");
@@ -157,6 +159,7 @@ static void feedback_sender_send_history_packet(ChiakiFeedbackSender *feedback_s
 
 	//CHIAKI_LOGD(feedback_sender->log, "Feedback History:");
 	//chiaki_log_hexdump(feedback_sender->log, CHIAKI_LOG_DEBUG, buf, buf_size);
+	CHIAKI_TRACE_INSTANT(CHIAKI_TRACE_STAGE_FEEDBACK_HISTORY, feedback_sender->history_seq_num);
 	chiaki_takion_send_feedback_history(feedback_sender->takion, feedback_sender->history_seq_num++, buf, buf_size);
 }
 
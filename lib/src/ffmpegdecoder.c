@@ -1,9 +1,142 @@
 
 #include <chiaki/ffmpegdecoder.h>
+#include <chiaki/bitstream.h>
+#include <chiaki/trace.h>
+#include <chiaki/time.h>
 
 #include <libavcodec/avcodec.h>
 #include <libavutil/pixdesc.h>
 
+#include <string.h>
+#include <limits.h>
+#include <stdatomic.h>
+
+#define PACKET_QUEUE_MASK (CHIAKI_FFMPEG_DECODER_PACKET_QUEUE_SIZE - 1)
+#define IN_FLIGHT_SIZE 0x20 // packets sent to the codec that we can still match frames to, must be a power of 2
+#define WAIT_TIMEOUT_MS 100
+
+_Static_assert((CHIAKI_FFMPEG_DECODER_PACKET_QUEUE_SIZE & PACKET_QUEUE_MASK) == 0, "Packet queue size must be a power of 2");
+
+typedef struct decoder_packet_slot_t
+{
+	AVPacket *packet;
+	bool frame_recovered;
+	bool keep; // contains parameter sets, never skipped
+	int64_t trace_frame;
+	uint64_t sample;
+	uint64_t enqueue_us;
+} DecoderPacketSlot;
+
+typedef struct decoder_in_flight_t
+{
+	int64_t trace_frame;
+	uint64_t sample;
+	uint64_t enqueue_us;
+	uint64_t dequeue_us;
+	uint64_t send_us;
+} DecoderInFlight;
+
+typedef struct decoder_frame_slot_t
+{
+	AVFrame *frame;
+	ChiakiFfmpegDecoderFrameStats stats;
+} DecoderFrameSlot;
+
+struct chiaki_ffmpeg_decoder_worker_t
+{
+	ChiakiFfmpegDecoder *decoder;
+	bool hevc;
+
+	/*
+	 * Single producer (the thread calling chiaki_ffmpeg_decoder_video_sample_cb()),
+	 * single consumer (the decode thread) ring.
+	 * Slots in [tail, head) belong to the decode thread, all others to the producer.
+	 */
+	DecoderPacketSlot packets[CHIAKI_FFMPEG_DECODER_PACKET_QUEUE_SIZE];
+	atomic_uint_fast64_t packets_head;
+	atomic_uint_fast64_t packets_tail;
+	atomic_uint_fast64_t skip_until; // the decode thread skips all packets before this one
+
+	// producer only
+	bool skipping;
+	uint64_t samples_count;
+
+	// decode thread only
+	int64_t packet_seq;
+	DecoderInFlight in_flight[IN_FLIGHT_SIZE];
+	AVFrame *frame_spare;
+
+	// guarded by decoder->mutex
+	DecoderFrameSlot frames[CHIAKI_FFMPEG_DECODER_FRAME_QUEUE_SIZE];
+	size_t frames_begin;
+	size_t frames_count;
+
+	atomic_uint waiters;
+	atomic_bool stop;
+	ChiakiMutex wait_mutex;
+	ChiakiCond wait_cond;
+	ChiakiThread thread;
+};
+
+static void *decoder_thread_func(void *user);
+
+#define FRAME_POOL_SIZE 0x10
+#define PACKET_BUF_ALIGN 0x10000 // packet buffers are allocated in these steps so they can be reused for most following frames
+
+static _Atomic(AVFrame *) frame_pool[FRAME_POOL_SIZE];
+
+CHIAKI_EXPORT AVFrame *chiaki_ffmpeg_frame_alloc()
+{
+	for(size_t i=0; i<FRAME_POOL_SIZE; i++)
+	{
+		if(!atomic_load_explicit(&frame_pool[i], memory_order_relaxed))
+			continue;
+		AVFrame *frame = atomic_exchange_explicit(&frame_pool[i], NULL, memory_order_acquire);
+		if(frame)
+			return frame;
+	}
+	return av_frame_alloc();
+}
+
+CHIAKI_EXPORT void chiaki_ffmpeg_frame_free(AVFrame **frame)
+{
+	if(!*frame)
+		return;
+	av_frame_unref(*frame);
+	for(size_t i=0; i<FRAME_POOL_SIZE; i++)
+	{
+		AVFrame *expected = NULL;
+		if(atomic_compare_exchange_strong_explicit(&frame_pool[i], &expected, *frame, memory_order_release, memory_order_relaxed))
+		{
+			*frame = NULL;
+			return;
+		}
+	}
+	av_frame_free(frame);
+}
+
+CHIAKI_EXPORT const char *chiaki_ffmpeg_decoder_threading_name(ChiakiFfmpegDecoderThreading threading)
+{
+	switch(threading)
+	{
+		case CHIAKI_FFMPEG_DECODER_THREADING_SLICE:
+			return "slice";
+		case CHIAKI_FFMPEG_DECODER_THREADING_FRAME:
+			return "frame";
+		default:
+			return "default";
+	}
+}
+
+CHIAKI_EXPORT void chiaki_ffmpeg_decoder_options_default(ChiakiFfmpegDecoderOptions *options)
+{
+	options->threading = CHIAKI_FFMPEG_DECODER_THREADING_DEFAULT;
+	options->thread_count = 0;
+	options->low_delay = false;
+	options->fast = false;
+	options->drop_policy = CHIAKI_FFMPEG_DECODER_DROP_DRAIN;
+}
+
 static enum AVCodecID chiaki_codec_av_codec_id(ChiakiCodec codec)
 {
 	switch(codec)
@@ -18,8 +151,16 @@ static enum AVCodecID chiaki_codec_av_codec_id(ChiakiCodec codec)
 
 CHIAKI_EXPORT ChiakiErrorCode chiaki_ffmpeg_decoder_init(ChiakiFfmpegDecoder *decoder, ChiakiLog *log,
 		ChiakiCodec codec, const char *hw_decoder_name, AVBufferRef *hw_device_ctx,
-		ChiakiFfmpegFrameAvailable frame_available_cb, void *frame_available_cb_user)
+		ChiakiFfmpegFrameAvailable frame_available_cb, void *frame_available_cb_user,
+		const ChiakiFfmpegDecoderOptions *options)
 {
+	ChiakiFfmpegDecoderOptions options_default;
+	if(!options)
+	{
+		chiaki_ffmpeg_decoder_options_default(&options_default);
+		options = &options_default;
+	}
+
 	ChiakiErrorCode err = chiaki_mutex_init(&decoder->mutex, false);
 	if(err != CHIAKI_ERR_SUCCESS)
 		return err;
@@ -30,6 +171,10 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_ffmpeg_decoder_init(ChiakiFfmpegDecoder *de
 	decoder->hdr_enabled = codec == CHIAKI_CODEC_H265_HDR;
 	decoder->frames_lost = 0;
 	decoder->frame_recovered = false;
+	decoder->metrics = NULL;
+	decoder->feedback_cb = NULL;
+	decoder->feedback_cb_user = NULL;
+	decoder->drop_policy = options->drop_policy;
 
 	decoder->hw_device_ctx = hw_device_ctx ? av_buffer_ref(hw_device_ctx) : NULL;
 	decoder->hw_pix_fmt = AV_PIX_FMT_NONE;
@@ -83,16 +228,76 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_ffmpeg_decoder_init(ChiakiFfmpegDecoder *de
 			goto error_codec_context;
 		}
 		decoder->codec_context->hw_device_ctx = av_buffer_ref(decoder->hw_device_ctx);
+		// the frame queue keeps decoded surfaces alive, so the decoder's surface pool needs room for them on top of its own
+		decoder->codec_context->extra_hw_frames = CHIAKI_FFMPEG_DECODER_FRAME_QUEUE_SIZE;
 		CHIAKI_LOGI(log, "Using hardware decoder \"%s\" with pix_fmt=%s", hw_decoder_name, av_get_pix_fmt_name(decoder->hw_pix_fmt));
 	}
 
+	if(options->threading != CHIAKI_FFMPEG_DECODER_THREADING_DEFAULT)
+	{
+		decoder->codec_context->thread_type = options->threading == CHIAKI_FFMPEG_DECODER_THREADING_FRAME ? FF_THREAD_FRAME : FF_THREAD_SLICE;
+		decoder->codec_context->thread_count = options->thread_count;
+	}
+	if(options->low_delay)
+		decoder->codec_context->flags |= AV_CODEC_FLAG_LOW_DELAY;
+	if(options->fast)
+		decoder->codec_context->flags2 |= AV_CODEC_FLAG2_FAST;
+	CHIAKI_LOGI(log, "FFMPEG decoder threading: %s, threads: %d%s%s",
+			chiaki_ffmpeg_decoder_threading_name(options->threading), decoder->codec_context->thread_count,
+			options->low_delay ? ", low delay" : "", options->fast ? ", fast" : "");
+
 	if(avcodec_open2(decoder->codec_context, decoder->av_codec, NULL) < 0)
 	{
 		CHIAKI_LOGE(log, "Failed to open codec context");
 		goto error_codec_context;
 	}
+
+	ChiakiFfmpegDecoderWorker *worker = calloc(1, sizeof(ChiakiFfmpegDecoderWorker));
+	if(!worker)
+		goto error_codec_context;
+	decoder->worker = worker;
+	worker->decoder = decoder;
+	worker->hevc = av_codec == AV_CODEC_ID_H265;
+	atomic_init(&worker->packets_head, 0);
+	atomic_init(&worker->packets_tail, 0);
+	atomic_init(&worker->skip_until, 0);
+	atomic_init(&worker->waiters, 0);
+	atomic_init(&worker->stop, false);
+	for(size_t i=0; i<CHIAKI_FFMPEG_DECODER_PACKET_QUEUE_SIZE; i++)
+	{
+		worker->packets[i].packet = av_packet_alloc();
+		if(!worker->packets[i].packet)
+		{
+			CHIAKI_LOGE(log, "Failed to alloc AVPacket");
+			goto error_packets;
+		}
+	}
+
+	err = chiaki_mutex_init(&worker->wait_mutex, false);
+	if(err != CHIAKI_ERR_SUCCESS)
+		goto error_packets;
+	err = chiaki_cond_init(&worker->wait_cond);
+	if(err != CHIAKI_ERR_SUCCESS)
+		goto error_wait_mutex;
+	err = chiaki_thread_create(&worker->thread, decoder_thread_func, worker);
+	if(err != CHIAKI_ERR_SUCCESS)
+	{
+		CHIAKI_LOGE(log, "Failed to create decoder thread");
+		goto error_wait_cond;
+	}
+	chiaki_thread_set_name(&worker->thread, "Chiaki Decoder");
+
 	chiaki_mutex_unlock(&decoder->mutex);
 	return CHIAKI_ERR_SUCCESS;
+error_wait_cond:
+	chiaki_cond_fini(&worker->wait_cond);
+error_wait_mutex:
+	chiaki_mutex_fini(&worker->wait_mutex);
+error_packets:
+	for(size_t i=0; i<CHIAKI_FFMPEG_DECODER_PACKET_QUEUE_SIZE; i++)
+		av_packet_free(&worker->packets[i].packet);
+	free(worker);
+	decoder->worker = NULL;
 error_codec_context:
 	if(decoder->hw_device_ctx)
 		av_buffer_unref(&decoder->hw_device_ctx);
@@ -103,8 +308,61 @@ error_mutex:
 	return CHIAKI_ERR_UNKNOWN;
 }
 
+static void worker_wake(ChiakiFfmpegDecoderWorker *worker)
+{
+	// the other side increments waiters before checking the queue, so either it sees our update or we see it waiting
+	if(!atomic_load(&worker->waiters))
+		return;
+	chiaki_mutex_lock(&worker->wait_mutex);
+	chiaki_cond_broadcast(&worker->wait_cond);
+	chiaki_mutex_unlock(&worker->wait_mutex);
+}
+
+static bool worker_queue_full(ChiakiFfmpegDecoderWorker *worker, uint64_t head)
+{
+	return head - atomic_load(&worker->packets_tail) >= CHIAKI_FFMPEG_DECODER_PACKET_QUEUE_SIZE;
+}
+
+static bool worker_queue_empty(ChiakiFfmpegDecoderWorker *worker, uint64_t tail)
+{
+	return atomic_load(&worker->packets_head) == tail;
+}
+
+/**
+ * @return false if the decoder is being stopped
+ */
+static bool worker_wait(ChiakiFfmpegDecoderWorker *worker, bool (*check)(ChiakiFfmpegDecoderWorker *, uint64_t), uint64_t pos)
+{
+	if(!check(worker, pos))
+		return !atomic_load(&worker->stop);
+	chiaki_mutex_lock(&worker->wait_mutex);
+	atomic_fetch_add(&worker->waiters, 1);
+	while(check(worker, pos) && !atomic_load(&worker->stop))
+		chiaki_cond_timedwait(&worker->wait_cond, &worker->wait_mutex, WAIT_TIMEOUT_MS);
+	atomic_fetch_sub(&worker->waiters, 1);
+	chiaki_mutex_unlock(&worker->wait_mutex);
+	return !atomic_load(&worker->stop);
+}
+
 CHIAKI_EXPORT void chiaki_ffmpeg_decoder_fini(ChiakiFfmpegDecoder *decoder)
 {
+	ChiakiFfmpegDecoderWorker *worker = decoder->worker;
+	chiaki_mutex_lock(&worker->wait_mutex);
+	atomic_store(&worker->stop, true);
+	chiaki_cond_broadcast(&worker->wait_cond);
+	chiaki_mutex_unlock(&worker->wait_mutex);
+	chiaki_thread_join(&worker->thread, NULL);
+	chiaki_cond_fini(&worker->wait_cond);
+	chiaki_mutex_fini(&worker->wait_mutex);
+
+	for(size_t i=0; i<CHIAKI_FFMPEG_DECODER_PACKET_QUEUE_SIZE; i++)
+		av_packet_free(&worker->packets[i].packet);
+	for(size_t i=0; i<worker->frames_count; i++)
+		chiaki_ffmpeg_frame_free(&worker->frames[(worker->frames_begin + i) % CHIAKI_FFMPEG_DECODER_FRAME_QUEUE_SIZE].frame);
+	chiaki_ffmpeg_frame_free(&worker->frame_spare);
+	free(worker);
+	decoder->worker = NULL;
+
 	chiaki_mutex_lock(&decoder->mutex);
 	avcodec_free_context(&decoder->codec_context);
 	if(decoder->hw_device_ctx)
@@ -113,89 +371,335 @@ CHIAKI_EXPORT void chiaki_ffmpeg_decoder_fini(ChiakiFfmpegDecoder *decoder)
 	chiaki_mutex_fini(&decoder->mutex);
 }
 
+/**
+ * Find out whether an Annex B frame can be decoded on its own (IDR or other IRAP slices)
+ * and whether it carries parameter sets that must never be dropped.
+ * Only the NAL headers up to the first slice are looked at.
+ */
+static void packet_sync_info(bool hevc, const uint8_t *buf, size_t buf_size, bool *idr, bool *params)
+{
+	*idr = false;
+	*params = false;
+	for(size_t start = chiaki_bitstream_find_start_code(buf, buf_size); start + 3 < buf_size;)
+	{
+		size_t offset = start + 3;
+		uint8_t header = buf[offset];
+		if(hevc)
+		{
+			unsigned type = (header >> 1) & 0x3f;
+			if(type >= 32 && type <= 34) // VPS, SPS, PPS
+				*params = true;
+			else if(type < 32) // slice
+			{
+				*idr = type >= 16 && type <= 21;
+				return;
+			}
+		}
+		else
+		{
+			unsigned type = header & 0x1f;
+			if(type == 7 || type == 8) // SPS, PPS
+				*params = true;
+			else if(type >= 1 && type <= 5) // slice
+			{
+				*idr = type == 5;
+				return;
+			}
+		}
+		start = chiaki_bitstream_find_start_code(buf + offset, buf_size - offset) + offset;
+	}
+}
+
+/**
+ * Copy buf into packet, reusing the packet's previous buffer unless the codec still holds a reference to it or it is too small.
+ */
+static bool packet_fill(AVPacket *packet, const uint8_t *buf, size_t buf_size)
+{
+	if(buf_size > INT_MAX - PACKET_BUF_ALIGN - AV_INPUT_BUFFER_PADDING_SIZE)
+		return false;
+	if(packet->buf && av_buffer_is_writable(packet->buf) && packet->buf->size >= buf_size + AV_INPUT_BUFFER_PADDING_SIZE)
+	{
+		packet->data = packet->buf->data;
+		packet->size = buf_size;
+		packet->pts = AV_NOPTS_VALUE;
+		packet->dts = AV_NOPTS_VALUE;
+		packet->flags = 0;
+	}
+	else
+	{
+		av_packet_unref(packet);
+		size_t alloc_size = (buf_size + PACKET_BUF_ALIGN - 1) & ~(size_t)(PACKET_BUF_ALIGN - 1);
+		if(av_new_packet(packet, alloc_size) < 0)
+			return false;
+		packet->size = buf_size;
+	}
+	memcpy(packet->data, buf, buf_size);
+	memset(packet->data + buf_size, 0, AV_INPUT_BUFFER_PADDING_SIZE);
+	return true;
+}
+
+static void decode_feedback(ChiakiFfmpegDecoder *decoder, uint64_t sample, bool success)
+{
+	chiaki_mutex_lock(&decoder->mutex);
+	if(decoder->feedback_cb)
+		decoder->feedback_cb(sample, success, decoder->feedback_cb_user);
+	chiaki_mutex_unlock(&decoder->mutex);
+}
+
+CHIAKI_EXPORT void chiaki_ffmpeg_decoder_set_feedback_cb(ChiakiFfmpegDecoder *decoder, ChiakiFfmpegDecodeFeedback cb, void *user)
+{
+	chiaki_mutex_lock(&decoder->mutex);
+	decoder->feedback_cb = cb;
+	decoder->feedback_cb_user = user;
+	chiaki_mutex_unlock(&decoder->mutex);
+}
+
+static void add_frames_lost(ChiakiFfmpegDecoder *decoder, int32_t frames_lost)
+{
+	chiaki_mutex_lock(&decoder->mutex);
+	decoder->frames_lost += frames_lost;
+	chiaki_mutex_unlock(&decoder->mutex);
+}
+
 CHIAKI_EXPORT bool chiaki_ffmpeg_decoder_video_sample_cb(uint8_t *buf, size_t buf_size, int32_t frames_lost, bool frame_recovered, void *user)
 {
 	ChiakiFfmpegDecoder *decoder = user;
+	ChiakiFfmpegDecoderWorker *worker = decoder->worker;
+	uint64_t sample = worker->samples_count++;
+	if(frames_lost)
+		add_frames_lost(decoder, frames_lost);
+
+	uint64_t head = atomic_load_explicit(&worker->packets_head, memory_order_relaxed);
+	bool keep = false;
+	if(decoder->drop_policy == CHIAKI_FFMPEG_DECODER_DROP_SKIP_TO_IDR
+		&& (worker->skipping || worker_queue_full(worker, head)))
+	{
+		bool idr;
+		packet_sync_info(worker->hevc, buf, buf_size, &idr, &keep);
+		if(!idr && !keep)
+		{
+			if(!worker->skipping)
+				CHIAKI_LOGW_RL(decoder->log, "Decoder is falling behind, skipping to the next IDR frame");
+			worker->skipping = true;
+			add_frames_lost(decoder, 1);
+			chiaki_metrics_counter_inc(decoder->metrics, CHIAKI_METRIC_VIDEO_FRAMES_DROPPED);
+			return false;
+		}
+		if(idr)
+		{
+			// everything still queued before this frame is obsolete now
+			atomic_store(&worker->skip_until, head);
+			worker->skipping = false;
+			worker_wake(worker);
+		}
+	}
 
+	if(!worker_wait(worker, worker_queue_full, head))
+		return false;
+
+	DecoderPacketSlot *slot = &worker->packets[head & PACKET_QUEUE_MASK];
+	if(!packet_fill(slot->packet, buf, buf_size))
+	{
+		CHIAKI_LOGE(decoder->log, "Failed to alloc packet buffer");
+		return false;
+	}
+	slot->frame_recovered = frame_recovered;
+	slot->keep = keep;
+	slot->trace_frame = CHIAKI_TRACE_FRAME_NONE;
+	slot->sample = sample;
+#if CHIAKI_LIB_ENABLE_TRACE
+	// carry the frame index through the decoder so present/render trace points can be keyed by it
+	if(chiaki_trace_enabled())
+		slot->trace_frame = chiaki_trace_frame_context();
+#endif
+	slot->enqueue_us = chiaki_time_now_monotonic_us();
+	atomic_store(&worker->packets_head, head + 1);
+	CHIAKI_TRACE_INSTANT(CHIAKI_TRACE_STAGE_DECODER_QUEUE, slot->trace_frame);
+	worker_wake(worker);
+	return true;
+}
+
+static void frame_queue_push(ChiakiFfmpegDecoderWorker *worker, AVFrame *frame, const ChiakiFfmpegDecoderFrameStats *stats)
+{
+	ChiakiFfmpegDecoder *decoder = worker->decoder;
 	chiaki_mutex_lock(&decoder->mutex);
-	decoder->frames_lost += frames_lost;
-	decoder->frame_recovered = frame_recovered;
-	AVPacket *packet = av_packet_alloc();
-	packet->data = buf;
-	packet->size = buf_size;
-	int r;
-send_packet:
-	r = avcodec_send_packet(decoder->codec_context, packet);
-	if(r != 0)
+	if(worker->frames_count == CHIAKI_FFMPEG_DECODER_FRAME_QUEUE_SIZE)
 	{
-		if(r == AVERROR(EAGAIN))
+		// nobody pulled for a while, drop the oldest frame
+		DecoderFrameSlot *oldest = &worker->frames[worker->frames_begin];
+		uint64_t replaced = oldest->stats.frames_replaced + 1;
+		chiaki_ffmpeg_frame_free(&oldest->frame);
+		worker->frames_begin = (worker->frames_begin + 1) % CHIAKI_FFMPEG_DECODER_FRAME_QUEUE_SIZE;
+		worker->frames_count--;
+		worker->frames[worker->frames_begin].stats.frames_replaced += replaced;
+	}
+	DecoderFrameSlot *slot = &worker->frames[(worker->frames_begin + worker->frames_count) % CHIAKI_FFMPEG_DECODER_FRAME_QUEUE_SIZE];
+	slot->frame = frame;
+	slot->stats = *stats;
+	worker->frames_count++;
+	chiaki_mutex_unlock(&decoder->mutex);
+}
+
+/**
+ * @return number of frames received
+ */
+static size_t receive_frames(ChiakiFfmpegDecoderWorker *worker)
+{
+	ChiakiFfmpegDecoder *decoder = worker->decoder;
+	size_t received = 0;
+	while(true)
+	{
+		if(!worker->frame_spare)
 		{
-			CHIAKI_LOGE(decoder->log, "AVCodec internal buffer is full removing frames before pushing");
-			AVFrame *frame = av_frame_alloc();
-			if(!frame)
+			worker->frame_spare = chiaki_ffmpeg_frame_alloc();
+			if(!worker->frame_spare)
 			{
 				CHIAKI_LOGE(decoder->log, "Failed to alloc AVFrame");
-				goto hell;
-			}
-			r = avcodec_receive_frame(decoder->codec_context, frame);
-			av_frame_free(&frame);
-			if(r != 0)
-			{
-				CHIAKI_LOGE(decoder->log, "Failed to pull frame");
-				goto hell;
+				break;
 			}
-			goto send_packet;
 		}
-		else
+		int r = avcodec_receive_frame(decoder->codec_context, worker->frame_spare);
+		if(r)
+		{
+			if(r != AVERROR(EAGAIN) && r != AVERROR_EOF)
+				CHIAKI_LOGE(decoder->log, "Decoding with FFMPEG failed");
+			break;
+		}
+		AVFrame *frame = worker->frame_spare;
+		worker->frame_spare = NULL;
+
+		// pts carries the index of the packet the frame was decoded from
+		ChiakiFfmpegDecoderFrameStats stats = { 0 };
+		int64_t trace_frame = CHIAKI_TRACE_FRAME_NONE;
+		if(frame->pts != AV_NOPTS_VALUE && frame->pts < worker->packet_seq && worker->packet_seq - frame->pts <= IN_FLIGHT_SIZE)
+		{
+			DecoderInFlight *in_flight = &worker->in_flight[frame->pts & (IN_FLIGHT_SIZE - 1)];
+			stats.decoded_us = chiaki_time_now_monotonic_us();
+			stats.queue_us = in_flight->dequeue_us - in_flight->enqueue_us;
+			stats.decode_us = stats.decoded_us - in_flight->send_us;
+			stats.sample = in_flight->sample;
+			stats.enqueue_us = in_flight->enqueue_us;
+			trace_frame = in_flight->trace_frame;
+			chiaki_metrics_histogram_observe(decoder->metrics, CHIAKI_METRIC_DECODE_TIME_MS, (double)stats.decode_us / 1000.0);
+			decode_feedback(decoder, in_flight->sample, !frame->decode_error_flags);
+		}
+		frame->pts = trace_frame == CHIAKI_TRACE_FRAME_NONE ? AV_NOPTS_VALUE : trace_frame;
+		CHIAKI_TRACE_INSTANT(CHIAKI_TRACE_STAGE_DECODER_FRAME, trace_frame);
+
+		frame_queue_push(worker, frame, &stats);
+		received++;
+		decoder->frame_available_cb(decoder, decoder->frame_available_cb_user);
+	}
+	return received;
+}
+
+static void decode_packet(ChiakiFfmpegDecoderWorker *worker, DecoderPacketSlot *slot, uint64_t dequeue_us)
+{
+	ChiakiFfmpegDecoder *decoder = worker->decoder;
+	int64_t seq = worker->packet_seq++;
+	DecoderInFlight *in_flight = &worker->in_flight[seq & (IN_FLIGHT_SIZE - 1)];
+	in_flight->trace_frame = slot->trace_frame;
+	in_flight->sample = slot->sample;
+	in_flight->enqueue_us = slot->enqueue_us;
+	in_flight->dequeue_us = dequeue_us;
+	in_flight->send_us = chiaki_time_now_monotonic_us();
+	slot->packet->pts = seq;
+
+	while(true)
+	{
+		CHIAKI_TRACE_BEGIN(CHIAKI_TRACE_STAGE_DECODER_SEND_PACKET, slot->trace_frame);
+		int r = avcodec_send_packet(decoder->codec_context, slot->packet);
+		CHIAKI_TRACE_END(CHIAKI_TRACE_STAGE_DECODER_SEND_PACKET, slot->trace_frame);
+		if(r == AVERROR(EAGAIN))
+		{
+			// output is full, collect what is there before pushing more
+			if(receive_frames(worker))
+				continue;
+			CHIAKI_LOGE(decoder->log, "AVCodec refuses input without producing output");
+			decode_feedback(decoder, slot->sample, false);
+		}
+		else if(r != 0)
 		{
 			char errbuf[128];
 			av_make_error_string(errbuf, sizeof(errbuf), r);
 			CHIAKI_LOGE(decoder->log, "Failed to push frame: %s", errbuf);
-			goto hell;
+			decode_feedback(decoder, slot->sample, false);
 		}
+		break;
 	}
-	av_packet_free(&packet);
-	chiaki_mutex_unlock(&decoder->mutex);
-
-	decoder->frame_available_cb(decoder, decoder->frame_available_cb_user);
-	return true;
-hell:
-	av_packet_free(&packet);
-	chiaki_mutex_unlock(&decoder->mutex);
-	return false;
+	receive_frames(worker);
 }
 
-CHIAKI_EXPORT AVFrame *chiaki_ffmpeg_decoder_pull_frame(ChiakiFfmpegDecoder *decoder, int32_t *frames_lost)
+static void *decoder_thread_func(void *user)
 {
-	chiaki_mutex_lock(&decoder->mutex);
-	// always try to pull as much as possible and return only the very last frame
-	AVFrame *frame_last = NULL;
-	AVFrame *frame = NULL;
+	ChiakiFfmpegDecoderWorker *worker = user;
+	ChiakiFfmpegDecoder *decoder = worker->decoder;
 	while(true)
 	{
-		AVFrame *next_frame;
-		if(frame_last)
+		uint64_t tail = atomic_load_explicit(&worker->packets_tail, memory_order_relaxed);
+		if(!worker_wait(worker, worker_queue_empty, tail))
+			break;
+
+		DecoderPacketSlot *slot = &worker->packets[tail & PACKET_QUEUE_MASK];
+		uint64_t dequeue_us = chiaki_time_now_monotonic_us();
+		bool skip = tail < atomic_load(&worker->skip_until) && !slot->keep;
+
+		if(skip)
 		{
-			av_frame_unref(frame_last);
-			next_frame = frame_last;
+			add_frames_lost(decoder, 1);
+			chiaki_metrics_counter_inc(decoder->metrics, CHIAKI_METRIC_VIDEO_FRAMES_DROPPED);
+			decode_feedback(decoder, slot->sample, false);
 		}
 		else
 		{
-			next_frame = av_frame_alloc();
-			if(!next_frame)
-				break;
+			if(slot->frame_recovered)
+			{
+				chiaki_mutex_lock(&decoder->mutex);
+				decoder->frame_recovered = true;
+				chiaki_mutex_unlock(&decoder->mutex);
+			}
+			decode_packet(worker, slot, dequeue_us);
 		}
-		frame_last = frame;
-		frame = next_frame;
-		int r = avcodec_receive_frame(decoder->codec_context, frame);
-		if(r)
+
+		// the packet keeps its buffer for packet_fill() to reuse
+		atomic_store(&worker->packets_tail, tail + 1);
+		worker_wake(worker);
+	}
+	return NULL;
+}
+
+CHIAKI_EXPORT AVFrame *chiaki_ffmpeg_decoder_pull_frame(ChiakiFfmpegDecoder *decoder, int32_t *frames_lost)
+{
+	return chiaki_ffmpeg_decoder_pull_frame_stats(decoder, frames_lost, NULL);
+}
+
+CHIAKI_EXPORT AVFrame *chiaki_ffmpeg_decoder_pull_frame_stats(ChiakiFfmpegDecoder *decoder, int32_t *frames_lost, ChiakiFfmpegDecoderFrameStats *stats)
+{
+	ChiakiFfmpegDecoderWorker *worker = decoder->worker;
+	chiaki_mutex_lock(&decoder->mutex);
+	CHIAKI_TRACE_BEGIN(CHIAKI_TRACE_STAGE_DECODER_PULL_FRAME, CHIAKI_TRACE_FRAME_NONE);
+	// return only the very last frame
+	AVFrame *frame = NULL;
+	if(worker->frames_count)
+	{
+		uint64_t replaced = 0;
+		while(worker->frames_count > 1)
 		{
-			if(r != AVERROR(EAGAIN))
-				CHIAKI_LOGE(decoder->log, "Decoding with FFMPEG failed");
-			av_frame_free(&frame);
-			frame = frame_last;
-			break;
+			DecoderFrameSlot *oldest = &worker->frames[worker->frames_begin];
+			replaced += oldest->stats.frames_replaced + 1;
+			chiaki_ffmpeg_frame_free(&oldest->frame);
+			worker->frames_begin = (worker->frames_begin + 1) % CHIAKI_FFMPEG_DECODER_FRAME_QUEUE_SIZE;
+			worker->frames_count--;
+		}
+		DecoderFrameSlot *newest = &worker->frames[worker->frames_begin];
+		frame = newest->frame;
+		newest->frame = NULL;
+		if(stats)
+		{
+			*stats = newest->stats;
+			stats->frames_replaced += replaced;
 		}
+		worker->frames_count = 0;
 	}
 	*frames_lost = decoder->frames_lost;
 	if(frame && decoder->frame_recovered)
@@ -204,6 +708,7 @@ CHIAKI_EXPORT AVFrame *chiaki_ffmpeg_decoder_pull_frame(ChiakiFfmpegDecoder *dec
 		frame->decode_error_flags |= 1;
 	}
 	decoder->frames_lost = 0;
+	CHIAKI_TRACE_END(CHIAKI_TRACE_STAGE_DECODER_PULL_FRAME, chiaki_ffmpeg_decoder_frame_trace_index(frame));
 	chiaki_mutex_unlock(&decoder->mutex);
 
 	return frame;
@@ -3,9 +3,12 @@
 #include <chiaki/frameprocessor.h>
 #include <chiaki/fec.h>
 #include <chiaki/video.h>
+#include <chiaki/trace.h>
+#include <chiaki/time.h>
 
 #include <jerasure.h>
 
+#include <stdlib.h>
 #include <string.h>
 #include <assert.h>
 
@@ -17,21 +20,97 @@ CHIAKI_EXPORT void chiaki_stream_stats_reset(ChiakiStreamStats *stats)
 {
 	stats->frames = 0;
 	stats->bytes = 0;
+	stats->samples_head = 0;
+	stats->iframe_last_ts_us = 0;
+	stats->iframe_last_size = 0;
+	stats->iframe_interval_us = 0;
 }
 
 CHIAKI_EXPORT void chiaki_stream_stats_frame(ChiakiStreamStats *stats, uint64_t size)
+{
+	chiaki_stream_stats_frame_at(stats, size, chiaki_time_now_monotonic_us());
+}
+
+CHIAKI_EXPORT void chiaki_stream_stats_frame_at(ChiakiStreamStats *stats, uint64_t size, uint64_t ts_us)
 {
 	stats->frames++;
 	stats->bytes += size;
-	//float br = (float)chiaki_stream_stats_bitrate(stats, 60) / 1000000.0f;
-	//CHIAKI_LOGD(NULL, "bitrate: %f", br);
+	ChiakiStreamStatsSample *sample = &stats->samples[stats->samples_head & (CHIAKI_STREAM_STATS_WINDOW_FRAMES_MAX - 1)];
+	sample->ts_us = ts_us;
+	sample->size = size > UINT32_MAX ? UINT32_MAX : (uint32_t)size;
+	stats->samples_head++;
+}
+
+CHIAKI_EXPORT void chiaki_stream_stats_iframe(ChiakiStreamStats *stats)
+{
+	if(!stats->samples_head)
+		return;
+	ChiakiStreamStatsSample *sample = &stats->samples[(stats->samples_head - 1) & (CHIAKI_STREAM_STATS_WINDOW_FRAMES_MAX - 1)];
+	if(stats->iframe_last_ts_us && sample->ts_us > stats->iframe_last_ts_us)
+		stats->iframe_interval_us = sample->ts_us - stats->iframe_last_ts_us;
+	stats->iframe_last_ts_us = sample->ts_us;
+	stats->iframe_last_size = sample->size;
+}
+
+static int stream_stats_size_cmp(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *)a;
+	uint32_t y = *(const uint32_t *)b;
+	return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+static uint64_t stream_stats_percentile(const uint32_t *sorted, size_t count, unsigned int p)
+{
+	// nearest-rank
+	size_t rank = (count * p + 99) / 100;
+	return sorted[rank ? rank - 1 : 0];
+}
+
+CHIAKI_EXPORT void chiaki_stream_stats_window_at(ChiakiStreamStats *stats, uint64_t now_us, ChiakiStreamStatsWindow *window)
+{
+	memset(window, 0, sizeof(*window));
+	window->iframe_size = stats->iframe_last_size;
+	window->iframe_interval_us = stats->iframe_interval_us;
+
+	uint64_t start = stats->samples_head > CHIAKI_STREAM_STATS_WINDOW_FRAMES_MAX
+		? stats->samples_head - CHIAKI_STREAM_STATS_WINDOW_FRAMES_MAX
+		: 0;
+	while(start < stats->samples_head
+		&& stats->samples[start & (CHIAKI_STREAM_STATS_WINDOW_FRAMES_MAX - 1)].ts_us + CHIAKI_STREAM_STATS_WINDOW_US < now_us)
+		start++;
+
+	size_t count = (size_t)(stats->samples_head - start);
+	if(!count)
+		return;
+
+	uint32_t sizes[CHIAKI_STREAM_STATS_WINDOW_FRAMES_MAX];
+	uint64_t bytes = 0;
+	for(size_t i=0; i<count; i++)
+	{
+		sizes[i] = stats->samples[(start + i) & (CHIAKI_STREAM_STATS_WINDOW_FRAMES_MAX - 1)].size;
+		bytes += sizes[i];
+	}
+
+	const ChiakiStreamStatsSample *oldest = &stats->samples[start & (CHIAKI_STREAM_STATS_WINDOW_FRAMES_MAX - 1)];
+	const ChiakiStreamStatsSample *newest = &stats->samples[(stats->samples_head - 1) & (CHIAKI_STREAM_STATS_WINDOW_FRAMES_MAX - 1)];
+	window->frames = count;
+	window->span_us = newest->ts_us > oldest->ts_us ? newest->ts_us - oldest->ts_us : 0;
+	if(window->span_us)
+	{
+		// the oldest frame only marks the start of the span, its data arrived before it
+		window->fps = (double)(count - 1) * 1000000.0 / (double)window->span_us;
+		window->bitrate = ((bytes - oldest->size) * 8 * 1000000) / window->span_us;
+	}
+
+	qsort(sizes, count, sizeof(sizes[0]), stream_stats_size_cmp);
+	window->frame_size_p50 = stream_stats_percentile(sizes, count, 50);
+	window->frame_size_p95 = stream_stats_percentile(sizes, count, 95);
+	window->frame_size_max = sizes[count - 1];
 }
 
-CHIAKI_EXPORT uint64_t chiaki_stream_stats_bitrate(ChiakiStreamStats *stats, uint64_t framerate)
+CHIAKI_EXPORT void chiaki_stream_stats_window(ChiakiStreamStats *stats, ChiakiStreamStatsWindow *window)
 {
-	if (stats->frames == 0)
-		return 0;
-	return (stats->bytes * 8 * framerate) / stats->frames;
+	chiaki_stream_stats_window_at(stats, chiaki_time_now_monotonic_us(), window);
 }
 
 #define UNIT_SLOTS_MAX 256
@@ -157,20 +236,20 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_frame_processor_put_unit(ChiakiFrameProcess
 
 	if(!packet->data_size)
 	{
-		CHIAKI_LOGW(frame_processor->log, "Unit is empty");
+		CHIAKI_LOGW_RL(frame_processor->log, "Unit is empty");
 		return CHIAKI_ERR_INVALID_DATA;
 	}
 
 	if(packet->data_size > frame_processor->buf_size_per_unit)
 	{
-		CHIAKI_LOGW(frame_processor->log, "Unit is bigger than pre-calculated size!");
+		CHIAKI_LOGW_RL(frame_processor->log, "Unit is bigger than pre-calculated size!");
 		return CHIAKI_ERR_INVALID_DATA;
 	}
 
 	ChiakiFrameUnit *unit = frame_processor->unit_slots + packet->unit_index;
 	if(unit->data_size)
 	{
-		CHIAKI_LOGW(frame_processor->log, "Received duplicate unit");
+		CHIAKI_LOGW_RL(frame_processor->log, "Received duplicate unit");
 		return CHIAKI_ERR_INVALID_DATA;
 	}
 
@@ -276,7 +355,9 @@ CHIAKI_EXPORT ChiakiFrameProcessorFlushResult chiaki_frame_processor_flush(Chiak
 	ChiakiFrameProcessorFlushResult result = CHIAKI_FRAME_PROCESSOR_FLUSH_RESULT_SUCCESS;
 	if(frame_processor->units_source_received < frame_processor->units_source_expected)
 	{
+		CHIAKI_TRACE_BEGIN(CHIAKI_TRACE_STAGE_FEC, chiaki_trace_frame_context());
 		ChiakiErrorCode err = chiaki_frame_processor_fec(frame_processor);
+		CHIAKI_TRACE_END(CHIAKI_TRACE_STAGE_FEC, chiaki_trace_frame_context());
 		if(err == CHIAKI_ERR_SUCCESS)
 			result = CHIAKI_FRAME_PROCESSOR_FLUSH_RESULT_FEC_SUCCESS;
 		else
@@ -289,7 +370,7 @@ CHIAKI_EXPORT ChiakiFrameProcessorFlushResult chiaki_frame_processor_flush(Chiak
 		ChiakiFrameUnit *unit = frame_processor->unit_slots + i;
 		if(!unit->data_size)
 		{
-			CHIAKI_LOGW(frame_processor->log, "Missing unit %#llx", (unsigned long long)i);
+			CHIAKI_LOGW_RL(frame_processor->log, "Missing unit %#llx", (unsigned long long)i);
 			continue;
 		}
 		if(unit->data_size < 2)
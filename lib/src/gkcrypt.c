@@ -24,10 +24,12 @@
 static ChiakiErrorCode gkcrypt_gen_key_iv(ChiakiGKCrypt *gkcrypt, uint8_t index, const uint8_t *handshake_key, const uint8_t *ecdh_secret);
 
 static void *gkcrypt_thread_func(void *user);
+static void gkcrypt_task_func(void *user);
 
-CHIAKI_EXPORT ChiakiErrorCode chiaki_gkcrypt_init(ChiakiGKCrypt *gkcrypt, ChiakiLog *log, size_t key_buf_chunks, uint8_t index, const uint8_t *handshake_key, const uint8_t *ecdh_secret)
+CHIAKI_EXPORT ChiakiErrorCode chiaki_gkcrypt_init(ChiakiGKCrypt *gkcrypt, ChiakiLog *log, size_t key_buf_chunks, ChiakiWorkerPool *pool, uint8_t index, const uint8_t *handshake_key, const uint8_t *ecdh_secret)
 {
 	gkcrypt->log = log;
+	gkcrypt->metrics = NULL;
 	gkcrypt->index = index;
 
 	gkcrypt->key_buf_size = key_buf_chunks * KEY_BUF_CHUNK_SIZE;
@@ -36,6 +38,8 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_gkcrypt_init(ChiakiGKCrypt *gkcrypt, Chiaki
 	gkcrypt->key_buf_start_offset = 0;
 	gkcrypt->last_key_pos = 0;
 	gkcrypt->key_buf_thread_stop = false;
+	gkcrypt->key_buf_lane = NULL;
+	chiaki_worker_task_init(&gkcrypt->key_buf_task, gkcrypt_task_func, gkcrypt);
 
 	ChiakiErrorCode err;
 	if(gkcrypt->key_buf_size)
@@ -70,7 +74,18 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_gkcrypt_init(ChiakiGKCrypt *gkcrypt, Chiaki
 	gkcrypt->key_gmac_index_current = 0;
 	memcpy(gkcrypt->key_gmac_current, gkcrypt->key_gmac_base, sizeof(gkcrypt->key_gmac_current));
 
-	if(gkcrypt->key_buf)
+	if(gkcrypt->key_buf && pool)
+	{
+		gkcrypt->key_buf_lane = chiaki_worker_lane_new(pool);
+		if(!gkcrypt->key_buf_lane)
+		{
+			err = CHIAKI_ERR_MEMORY;
+			goto error_key_buf_cond;
+		}
+		// fill the buffer right away, like the thread would
+		chiaki_worker_lane_post(gkcrypt->key_buf_lane, &gkcrypt->key_buf_task);
+	}
+	else if(gkcrypt->key_buf)
 	{
 		err = chiaki_thread_create(&gkcrypt->key_buf_thread, gkcrypt_thread_func, gkcrypt);
 		if(err != CHIAKI_ERR_SUCCESS)
@@ -101,7 +116,10 @@ CHIAKI_EXPORT void chiaki_gkcrypt_fini(ChiakiGKCrypt *gkcrypt)
 		gkcrypt->key_buf_thread_stop = true;
 		chiaki_mutex_unlock(&gkcrypt->key_buf_mutex);
 		chiaki_cond_signal(&gkcrypt->key_buf_cond);
-		chiaki_thread_join(&gkcrypt->key_buf_thread, NULL);
+		if(gkcrypt->key_buf_lane)
+			chiaki_worker_lane_free(gkcrypt->key_buf_lane);
+		else
+			chiaki_thread_join(&gkcrypt->key_buf_thread, NULL);
 		chiaki_cond_fini(&gkcrypt->key_buf_cond);
 		chiaki_mutex_fini(&gkcrypt->key_buf_mutex);
 		chiaki_aligned_free(gkcrypt->key_buf);
@@ -298,6 +316,7 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_gkcrypt_get_key_stream(ChiakiGKCrypt *gkcry
 	if(key_pos < gkcrypt->key_buf_key_pos_min
 		|| key_pos + buf_size >= gkcrypt->key_buf_key_pos_min + gkcrypt->key_buf_populated)
 	{
+		chiaki_metrics_counter_inc(gkcrypt->metrics, CHIAKI_METRIC_KEYSTREAM_MISSES);
 		CHIAKI_LOGW(gkcrypt->log, "Requested key stream for key pos %#llx on GKCrypt %d, but it's not in the buffer:"
 				" key buf size %#llx, start offset: %#llx, populated: %#llx, min key pos: %#llx, last key pos: %#llx",
 				(unsigned long long)key_pos,
@@ -328,7 +347,12 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_gkcrypt_get_key_stream(ChiakiGKCrypt *gkcry
 	}
 
 	if(signal)
-		chiaki_cond_signal(&gkcrypt->key_buf_cond);
+	{
+		if(gkcrypt->key_buf_lane)
+			chiaki_worker_lane_post(gkcrypt->key_buf_lane, &gkcrypt->key_buf_task);
+		else
+			chiaki_cond_signal(&gkcrypt->key_buf_cond);
+	}
 
 	return err;
 }
@@ -498,6 +522,31 @@ static ChiakiErrorCode gkcrypt_generate_next_chunk(ChiakiGKCrypt *gkcrypt)
 	return err;
 }
 
+/**
+ * Make room in the key buffer if necessary and generate the next chunk, called with key_buf_mutex locked.
+ */
+static ChiakiErrorCode gkcrypt_key_buf_step(ChiakiGKCrypt *gkcrypt)
+{
+	if(gkcrypt->last_key_pos > gkcrypt->key_buf_key_pos_min + gkcrypt->key_buf_populated)
+	{
+		// skip ahead if the last key pos is already beyond our buffer
+		uint64_t key_pos = (gkcrypt->last_key_pos / KEY_BUF_CHUNK_SIZE) * KEY_BUF_CHUNK_SIZE;
+		CHIAKI_LOGW(gkcrypt->log, "Already requested a higher key pos than in the buffer, skipping ahead from min %#llx to %#llx",
+					(unsigned long long)gkcrypt->key_buf_key_pos_min,
+					(unsigned long long)key_pos);
+		gkcrypt->key_buf_key_pos_min = key_pos;
+		gkcrypt->key_buf_start_offset = 0;
+		gkcrypt->key_buf_populated = 0;
+	}
+	else if(gkcrypt->key_buf_populated == gkcrypt->key_buf_size)
+	{
+		gkcrypt->key_buf_start_offset = (gkcrypt->key_buf_start_offset + KEY_BUF_CHUNK_SIZE) % gkcrypt->key_buf_size;
+		gkcrypt->key_buf_key_pos_min += KEY_BUF_CHUNK_SIZE;
+		gkcrypt->key_buf_populated -= KEY_BUF_CHUNK_SIZE;
+	}
+	return gkcrypt_generate_next_chunk(gkcrypt);
+}
+
 static void *gkcrypt_thread_func(void *user)
 {
 	ChiakiGKCrypt *gkcrypt = user;
@@ -522,24 +571,7 @@ static void *gkcrypt_thread_func(void *user)
 					(unsigned long long)gkcrypt->last_key_pos);
 		*/
 
-		if(gkcrypt->last_key_pos > gkcrypt->key_buf_key_pos_min + gkcrypt->key_buf_populated)
-		{
-			// skip ahead if the last key pos is already beyond our buffer
-			uint64_t key_pos = (gkcrypt->last_key_pos / KEY_BUF_CHUNK_SIZE) * KEY_BUF_CHUNK_SIZE;
-			CHIAKI_LOGW(gkcrypt->log, "Already requested a higher key pos than in the buffer, skipping ahead from min %#llx to %#llx",
-						(unsigned long long)gkcrypt->key_buf_key_pos_min,
-						(unsigned long long)key_pos);
-			gkcrypt->key_buf_key_pos_min = key_pos;
-			gkcrypt->key_buf_start_offset = 0;
-			gkcrypt->key_buf_populated = 0;
-		}
-		else if(gkcrypt->key_buf_populated == gkcrypt->key_buf_size)
-		{
-			gkcrypt->key_buf_start_offset = (gkcrypt->key_buf_start_offset + KEY_BUF_CHUNK_SIZE) % gkcrypt->key_buf_size;
-			gkcrypt->key_buf_key_pos_min += KEY_BUF_CHUNK_SIZE;
-			gkcrypt->key_buf_populated -= KEY_BUF_CHUNK_SIZE;
-		}
-		err = gkcrypt_generate_next_chunk(gkcrypt);
+		err = gkcrypt_key_buf_step(gkcrypt);
 		if(err != CHIAKI_ERR_SUCCESS)
 			break;
 	}
@@ -548,6 +580,22 @@ static void *gkcrypt_thread_func(void *user)
 	return NULL;
 }
 
+static void gkcrypt_task_func(void *user)
+{
+	ChiakiGKCrypt *gkcrypt = user;
+	bool more = false;
+
+	// one chunk per turn, so the key streams of all sessions on the pool advance evenly
+	chiaki_mutex_lock(&gkcrypt->key_buf_mutex);
+	if(!gkcrypt->key_buf_thread_stop && key_buf_mutex_pred(gkcrypt)
+			&& gkcrypt_key_buf_step(gkcrypt) == CHIAKI_ERR_SUCCESS)
+		more = !gkcrypt->key_buf_thread_stop && key_buf_mutex_pred(gkcrypt);
+	chiaki_mutex_unlock(&gkcrypt->key_buf_mutex);
+
+	if(more)
+		chiaki_worker_lane_post(gkcrypt->key_buf_lane, &gkcrypt->key_buf_task);
+}
+
 CHIAKI_EXPORT void chiaki_key_state_init(ChiakiKeyState *state)
 {
 	state->prev = 0;
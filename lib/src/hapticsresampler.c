@@ -0,0 +1,202 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#include <chiaki/hapticsresampler.h>
+
+#include <string.h>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define HAPTICS_RESAMPLER_SSE2 1
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define HAPTICS_RESAMPLER_NEON 1
+#endif
+
+#define RATIO CHIAKI_HAPTICS_RESAMPLER_RATIO
+#define TAPS CHIAKI_HAPTICS_RESAMPLER_TAPS
+#define TAPS_SHIFT 14
+#define BLOCK_FRAMES 64
+
+/**
+ * Blackman windowed sinc with a cutoff at the input Nyquist frequency, split into RATIO phases.
+ * out[n * RATIO + p] = sum_k prototype[p][k] * in[n - k], each phase sums to 1 << TAPS_SHIFT.
+ */
+static const int16_t prototype[RATIO][TAPS] = {
+	{ 0, 0, 0, 0, 16384, 0, 0, 0 },
+	{ 0, 26, -192, 866, 16263, -716, 156, -19 },
+	{ 0, 61, -416, 1875, 15900, -1280, 275, -31 },
+	{ -1, 102, -666, 3012, 15311, -1694, 358, -38 },
+	{ -3, 150, -935, 4258, 14515, -1968, 407, -40 },
+	{ -7, 202, -1210, 5589, 13532, -2111, 427, -38 },
+	{ -11, 257, -1478, 6976, 12393, -2141, 422, -34 },
+	{ -16, 310, -1723, 8385, 11131, -2073, 398, -28 },
+	{ -22, 359, -1928, 9783, 9783, -1928, 359, -22 },
+	{ -28, 398, -2073, 11131, 8385, -1723, 310, -16 },
+	{ -34, 422, -2141, 12393, 6976, -1478, 257, -11 },
+	{ -38, 427, -2111, 13532, 5589, -1210, 202, -7 },
+	{ -40, 407, -1968, 14515, 4258, -935, 150, -3 },
+	{ -38, 358, -1694, 15311, 3012, -666, 102, -1 },
+	{ -31, 275, -1280, 15900, 1875, -416, 61, 0 },
+	{ -19, 156, -716, 16263, 866, -192, 26, 0 }
+};
+
+CHIAKI_EXPORT void chiaki_haptics_resampler_init(ChiakiHapticsResampler *resampler)
+{
+	chiaki_haptics_resampler_reset(resampler);
+	resampler->gain = -1.0f;
+	chiaki_haptics_resampler_set_gain(resampler, 1.0f);
+}
+
+CHIAKI_EXPORT void chiaki_haptics_resampler_reset(ChiakiHapticsResampler *resampler)
+{
+	memset(resampler->history, 0, sizeof(resampler->history));
+}
+
+/**
+ * Position of prototype[p][k] in resampler->taps
+ */
+static size_t tap_index(size_t p, size_t k)
+{
+#if HAPTICS_RESAMPLER_SSE2
+	// pairs of taps for 4 phases per vector, matching the pairs of input frames loaded as one int32,
+	// the older frame of the pair in the low half
+	return ((k / 2) * RATIO + p) * 2 + (1 - k % 2);
+#elif HAPTICS_RESAMPLER_NEON
+	// all phases for one tap next to each other
+	return k * RATIO + p;
+#else
+	return p * TAPS + k;
+#endif
+}
+
+CHIAKI_EXPORT void chiaki_haptics_resampler_set_gain(ChiakiHapticsResampler *resampler, float gain)
+{
+	if(!(gain > 0.0f)) // also catches NaN
+		gain = 0.0f;
+	else if(gain > CHIAKI_HAPTICS_RESAMPLER_GAIN_MAX)
+		gain = CHIAKI_HAPTICS_RESAMPLER_GAIN_MAX;
+	if(gain == resampler->gain)
+		return;
+	resampler->gain = gain;
+	int32_t sum_target = (int32_t)((float)(1 << TAPS_SHIFT) * gain + 0.5f);
+	for(size_t p=0; p<RATIO; p++)
+	{
+		int32_t taps[TAPS];
+		int32_t sum = 0;
+		size_t k_max = 0;
+		for(size_t k=0; k<TAPS; k++)
+		{
+			float v = (float)prototype[p][k] * gain;
+			taps[k] = (int32_t)(v < 0.0f ? v - 0.5f : v + 0.5f);
+			sum += taps[k];
+			if(prototype[p][k] > prototype[p][k_max])
+				k_max = k;
+		}
+		// keep the gain of all phases equal, rounding differences between them would show up as images at multiples of the input rate
+		taps[k_max] += sum_target - sum;
+		for(size_t k=0; k<TAPS; k++)
+			resampler->taps[tap_index(p, k)] = taps[k] > INT16_MAX ? INT16_MAX : (taps[k] < INT16_MIN ? INT16_MIN : (int16_t)taps[k]);
+	}
+}
+
+/**
+ * @param x planar input of one block per channel, preceded by TAPS - 1 frames of history
+ */
+static void process_block(ChiakiHapticsResampler *resampler, int16_t *out, int16_t x[CHIAKI_HAPTICS_RESAMPLER_CHANNELS_IN][TAPS - 1 + BLOCK_FRAMES], size_t frames)
+{
+	const int16_t *taps = resampler->taps;
+#if HAPTICS_RESAMPLER_SSE2
+	const __m128i round = _mm_set1_epi32(1 << (TAPS_SHIFT - 1));
+	const __m128i zero = _mm_setzero_si128();
+	for(size_t i=0; i<frames; i++)
+	{
+		__m128i r[CHIAKI_HAPTICS_RESAMPLER_CHANNELS_IN][RATIO / 8];
+		for(size_t c=0; c<CHIAKI_HAPTICS_RESAMPLER_CHANNELS_IN; c++)
+		{
+			__m128i acc[RATIO / 4] = { round, round, round, round };
+			for(size_t j=0; j<TAPS / 2; j++)
+			{
+				int32_t pair;
+				memcpy(&pair, &x[c][TAPS - 2 + i - 2 * j], sizeof(pair));
+				__m128i xv = _mm_set1_epi32(pair);
+				for(size_t q=0; q<RATIO / 4; q++)
+					acc[q] = _mm_add_epi32(acc[q], _mm_madd_epi16(xv, _mm_loadu_si128((const __m128i *)(taps + (j * RATIO + q * 4) * 2))));
+			}
+			for(size_t q=0; q<RATIO / 8; q++)
+				r[c][q] = _mm_packs_epi32(_mm_srai_epi32(acc[2 * q], TAPS_SHIFT), _mm_srai_epi32(acc[2 * q + 1], TAPS_SHIFT));
+		}
+		__m128i *o = (__m128i *)(out + i * RATIO * CHIAKI_HAPTICS_RESAMPLER_CHANNELS_OUT);
+		for(size_t q=0; q<RATIO / 8; q++)
+		{
+			__m128i lr_lo = _mm_unpacklo_epi16(r[0][q], r[1][q]);
+			__m128i lr_hi = _mm_unpackhi_epi16(r[0][q], r[1][q]);
+			_mm_storeu_si128(o++, _mm_unpacklo_epi32(zero, lr_lo));
+			_mm_storeu_si128(o++, _mm_unpackhi_epi32(zero, lr_lo));
+			_mm_storeu_si128(o++, _mm_unpacklo_epi32(zero, lr_hi));
+			_mm_storeu_si128(o++, _mm_unpackhi_epi32(zero, lr_hi));
+		}
+	}
+#elif HAPTICS_RESAMPLER_NEON
+	const int16x4_t zero = vdup_n_s16(0);
+	for(size_t i=0; i<frames; i++)
+	{
+		int16x4_t r[CHIAKI_HAPTICS_RESAMPLER_CHANNELS_IN][RATIO / 4];
+		for(size_t c=0; c<CHIAKI_HAPTICS_RESAMPLER_CHANNELS_IN; c++)
+		{
+			int32x4_t acc[RATIO / 4] = { vdupq_n_s32(0), vdupq_n_s32(0), vdupq_n_s32(0), vdupq_n_s32(0) };
+			for(size_t k=0; k<TAPS; k++)
+			{
+				int16_t xv = x[c][TAPS - 1 + i - k];
+				for(size_t q=0; q<RATIO / 4; q++)
+					acc[q] = vmlal_n_s16(acc[q], vld1_s16(taps + k * RATIO + q * 4), xv);
+			}
+			for(size_t q=0; q<RATIO / 4; q++)
+				r[c][q] = vqrshrn_n_s32(acc[q], TAPS_SHIFT);
+		}
+		int16_t *o = out + i * RATIO * CHIAKI_HAPTICS_RESAMPLER_CHANNELS_OUT;
+		for(size_t q=0; q<RATIO / 4; q++)
+		{
+			int16x4x4_t frame = { { zero, zero, r[0][q], r[1][q] } };
+			vst4_s16(o + q * 4 * CHIAKI_HAPTICS_RESAMPLER_CHANNELS_OUT, frame);
+		}
+	}
+#else
+	for(size_t i=0; i<frames; i++)
+	{
+		int16_t *o = out + i * RATIO * CHIAKI_HAPTICS_RESAMPLER_CHANNELS_OUT;
+		for(size_t p=0; p<RATIO; p++)
+		{
+			o[0] = o[1] = 0;
+			for(size_t c=0; c<CHIAKI_HAPTICS_RESAMPLER_CHANNELS_IN; c++)
+			{
+				int32_t acc = 1 << (TAPS_SHIFT - 1);
+				for(size_t k=0; k<TAPS; k++)
+					acc += (int32_t)taps[p * TAPS + k] * x[c][TAPS - 1 + i - k];
+				acc >>= TAPS_SHIFT;
+				o[2 + c] = acc > INT16_MAX ? INT16_MAX : (acc < INT16_MIN ? INT16_MIN : (int16_t)acc);
+			}
+			o += CHIAKI_HAPTICS_RESAMPLER_CHANNELS_OUT;
+		}
+	}
+#endif
+}
+
+CHIAKI_EXPORT void chiaki_haptics_resampler_process(ChiakiHapticsResampler *resampler, int16_t *out, const int16_t *in, size_t in_frames)
+{
+	int16_t x[CHIAKI_HAPTICS_RESAMPLER_CHANNELS_IN][TAPS - 1 + BLOCK_FRAMES];
+	while(in_frames)
+	{
+		size_t frames = in_frames < BLOCK_FRAMES ? in_frames : BLOCK_FRAMES;
+		for(size_t c=0; c<CHIAKI_HAPTICS_RESAMPLER_CHANNELS_IN; c++)
+		{
+			memcpy(x[c], resampler->history[c], sizeof(resampler->history[c]));
+			for(size_t i=0; i<frames; i++)
+				x[c][TAPS - 1 + i] = in[i * CHIAKI_HAPTICS_RESAMPLER_CHANNELS_IN + c];
+			memcpy(resampler->history[c], x[c] + frames, sizeof(resampler->history[c]));
+		}
+		process_block(resampler, out, x, frames);
+		in += frames * CHIAKI_HAPTICS_RESAMPLER_CHANNELS_IN;
+		out += frames * RATIO * CHIAKI_HAPTICS_RESAMPLER_CHANNELS_OUT;
+		in_frames -= frames;
+	}
+}
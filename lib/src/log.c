@@ -1,10 +1,39 @@
 // SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
 
 #include <chiaki/log.h>
+#include <chiaki/thread.h>
+#include <chiaki/time.h>
 
 #include <stdio.h>
 #include <stdarg.h>
 #include <string.h>
+#include <stdatomic.h>
+#include <time.h>
+
+#define LOG_ASYNC_POLL_MS 5
+
+typedef struct log_async_slot_t
+{
+	atomic_uint_fast64_t seq;
+	uint64_t timestamp_ms;
+	ChiakiLogLevel level;
+	char msg[CHIAKI_LOG_ASYNC_MSG_SIZE];
+} LogAsyncSlot;
+
+struct chiaki_log_async_t
+{
+	ChiakiLogCb cb;
+	void *user;
+	atomic_uint_fast64_t enqueue_pos;
+	uint64_t dequeue_pos; // only touched by the delivery thread
+	atomic_uint_fast64_t dropped;
+	uint64_t dropped_reported;
+	ChiakiBoolPredCond stop_cond;
+	ChiakiThread thread;
+	LogAsyncSlot slots[CHIAKI_LOG_ASYNC_QUEUE_SIZE];
+};
+
+static _Thread_local uint64_t delivering_timestamp_ms = 0;
 
 CHIAKI_EXPORT char chiaki_log_level_char(ChiakiLogLevel level)
 {
@@ -30,6 +59,7 @@ CHIAKI_EXPORT void chiaki_log_init(ChiakiLog *log, uint32_t level_mask, ChiakiLo
 	log->level_mask = level_mask;
 	log->cb = cb;
 	log->user = user;
+	log->async = NULL;
 }
 
 CHIAKI_EXPORT void chiaki_log_set_level(ChiakiLog *log, uint32_t level_mask)
@@ -66,12 +96,160 @@ CHIAKI_EXPORT void chiaki_log_cb_print(ChiakiLogLevel level, const char *msg, vo
 	printf("%s\n", msg);
 }
 
+static uint64_t wall_clock_ms()
+{
+	struct timespec ts;
+	if(!timespec_get(&ts, TIME_UTC))
+		return 0;
+	return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+CHIAKI_EXPORT uint64_t chiaki_log_timestamp_ms()
+{
+	return delivering_timestamp_ms ? delivering_timestamp_ms : wall_clock_ms();
+}
+
+static void log_async_push(ChiakiLogAsync *async, ChiakiLogLevel level, const char *fmt, va_list args)
+{
+	uint64_t pos = atomic_load_explicit(&async->enqueue_pos, memory_order_relaxed);
+	LogAsyncSlot *slot;
+	while(true)
+	{
+		slot = &async->slots[pos & (CHIAKI_LOG_ASYNC_QUEUE_SIZE - 1)];
+		uint64_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+		int64_t diff = (int64_t)seq - (int64_t)pos;
+		if(diff == 0)
+		{
+			if(atomic_compare_exchange_weak_explicit(&async->enqueue_pos, &pos, pos + 1, memory_order_relaxed, memory_order_relaxed))
+				break;
+		}
+		else if(diff < 0)
+		{
+			// full, never block the logging thread
+			atomic_fetch_add_explicit(&async->dropped, 1, memory_order_relaxed);
+			return;
+		}
+		else
+			pos = atomic_load_explicit(&async->enqueue_pos, memory_order_relaxed);
+	}
+
+	slot->timestamp_ms = wall_clock_ms();
+	slot->level = level;
+	if(vsnprintf(slot->msg, sizeof(slot->msg), fmt, args) < 0)
+		slot->msg[0] = '\0';
+	atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
+}
+
+static void log_async_drain(ChiakiLogAsync *async)
+{
+	while(true)
+	{
+		LogAsyncSlot *slot = &async->slots[async->dequeue_pos & (CHIAKI_LOG_ASYNC_QUEUE_SIZE - 1)];
+		if(atomic_load_explicit(&slot->seq, memory_order_acquire) != async->dequeue_pos + 1)
+			break;
+		delivering_timestamp_ms = slot->timestamp_ms;
+		async->cb(slot->level, slot->msg, async->user);
+		atomic_store_explicit(&slot->seq, async->dequeue_pos + CHIAKI_LOG_ASYNC_QUEUE_SIZE, memory_order_release);
+		async->dequeue_pos++;
+	}
+	delivering_timestamp_ms = 0;
+
+	uint64_t dropped = atomic_load_explicit(&async->dropped, memory_order_relaxed);
+	if(dropped != async->dropped_reported)
+	{
+		char msg[0x80];
+		snprintf(msg, sizeof(msg), "Log dropped %llu messages because the queue was full",
+				(unsigned long long)(dropped - async->dropped_reported));
+		async->dropped_reported = dropped;
+		async->cb(CHIAKI_LOG_WARNING, msg, async->user);
+	}
+}
+
+static void *log_async_thread_func(void *user)
+{
+	ChiakiLogAsync *async = user;
+	ChiakiErrorCode err = chiaki_bool_pred_cond_lock(&async->stop_cond);
+	if(err != CHIAKI_ERR_SUCCESS)
+		return NULL;
+	while(true)
+	{
+		log_async_drain(async);
+		if(async->stop_cond.pred)
+			break;
+		err = chiaki_bool_pred_cond_timedwait(&async->stop_cond, LOG_ASYNC_POLL_MS);
+		if(err != CHIAKI_ERR_SUCCESS && err != CHIAKI_ERR_TIMEOUT)
+			break;
+	}
+	chiaki_bool_pred_cond_unlock(&async->stop_cond);
+	log_async_drain(async);
+	return NULL;
+}
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_log_async_start(ChiakiLog *log)
+{
+	if(log->async)
+		return CHIAKI_ERR_SUCCESS;
+	ChiakiLogAsync *async = CHIAKI_NEW(ChiakiLogAsync);
+	if(!async)
+		return CHIAKI_ERR_MEMORY;
+	async->cb = log->cb ? log->cb : chiaki_log_cb_print;
+	async->user = log->user;
+	atomic_init(&async->enqueue_pos, 0);
+	async->dequeue_pos = 0;
+	atomic_init(&async->dropped, 0);
+	async->dropped_reported = 0;
+	for(size_t i=0; i<CHIAKI_LOG_ASYNC_QUEUE_SIZE; i++)
+		atomic_init(&async->slots[i].seq, i);
+
+	ChiakiErrorCode err = chiaki_bool_pred_cond_init(&async->stop_cond);
+	if(err != CHIAKI_ERR_SUCCESS)
+		goto error;
+	err = chiaki_thread_create(&async->thread, log_async_thread_func, async);
+	if(err != CHIAKI_ERR_SUCCESS)
+		goto error_stop_cond;
+	chiaki_thread_set_name(&async->thread, "Chiaki Log");
+
+	log->async = async;
+	return CHIAKI_ERR_SUCCESS;
+
+error_stop_cond:
+	chiaki_bool_pred_cond_fini(&async->stop_cond);
+error:
+	free(async);
+	return err;
+}
+
+CHIAKI_EXPORT void chiaki_log_async_stop(ChiakiLog *log)
+{
+	ChiakiLogAsync *async = log->async;
+	if(!async)
+		return;
+	chiaki_bool_pred_cond_signal(&async->stop_cond);
+	chiaki_thread_join(&async->thread, NULL);
+	chiaki_bool_pred_cond_fini(&async->stop_cond);
+	log->async = NULL;
+	free(async);
+}
+
+CHIAKI_EXPORT uint64_t chiaki_log_async_dropped(ChiakiLog *log)
+{
+	return log->async ? atomic_load_explicit(&log->async->dropped, memory_order_relaxed) : 0;
+}
+
 CHIAKI_EXPORT void chiaki_log(ChiakiLog *log, ChiakiLogLevel level, const char *fmt, ...)
 {
 	if(log && !(log->level_mask & level))
 		return;
 
 	va_list args;
+	if(log && log->async)
+	{
+		va_start(args, fmt);
+		log_async_push(log->async, level, fmt, args);
+		va_end(args);
+		return;
+	}
+
 	char buf[0x100];
 	char *msg = buf;
 
@@ -107,6 +285,63 @@ CHIAKI_EXPORT void chiaki_log(ChiakiLog *log, ChiakiLogLevel level, const char *
 		free(msg);
 }
 
+#define RATE_LIMIT_TOKENS_MASK 0xff
+
+_Static_assert(CHIAKI_LOG_RATE_LIMIT_BURST <= RATE_LIMIT_TOKENS_MASK, "Rate limit burst does not fit into the token bits");
+
+CHIAKI_EXPORT bool chiaki_log_rate_limit(ChiakiLog *log, ChiakiLogLevel level, ChiakiLogRateLimit *rl)
+{
+	if(log && !(log->level_mask & level))
+		return false;
+
+	uint64_t now = chiaki_time_now_monotonic_ms();
+	uint64_t state = atomic_load_explicit(&rl->state, memory_order_relaxed);
+	bool pass;
+	while(true)
+	{
+		uint64_t last = state >> 8;
+		uint64_t tokens = state & RATE_LIMIT_TOKENS_MASK;
+		if(!state)
+		{
+			// fresh site
+			last = now;
+			tokens = CHIAKI_LOG_RATE_LIMIT_BURST;
+		}
+		else if(now > last)
+		{
+			uint64_t refill = (now - last) / CHIAKI_LOG_RATE_LIMIT_REFILL_MS;
+			if(tokens + refill >= CHIAKI_LOG_RATE_LIMIT_BURST)
+			{
+				tokens = CHIAKI_LOG_RATE_LIMIT_BURST;
+				last = now;
+			}
+			else
+			{
+				tokens += refill;
+				last += refill * CHIAKI_LOG_RATE_LIMIT_REFILL_MS; // keep the remainder for the next refill
+			}
+		}
+
+		pass = tokens > 0;
+		if(pass)
+			tokens--;
+		uint64_t state_new = (last << 8) | tokens;
+		if(atomic_compare_exchange_weak_explicit(&rl->state, &state, state_new, memory_order_relaxed, memory_order_relaxed))
+			break;
+	}
+
+	if(!pass)
+	{
+		atomic_fetch_add_explicit(&rl->suppressed, 1, memory_order_relaxed);
+		return false;
+	}
+
+	uint64_t suppressed = atomic_exchange_explicit(&rl->suppressed, 0, memory_order_relaxed);
+	if(suppressed)
+		chiaki_log(log, level, "Suppressed %llu similar messages", (unsigned long long)suppressed);
+	return true;
+}
+
 #define HEXDUMP_WIDTH 0x10
 
 static const char hex_char[] = { '0', '1', '2', '3', '4', '5', '6', '7', '8', '9', 'a', 'b', 'c', 'd', 'e', 'f' };
@@ -0,0 +1,532 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#include <chiaki/metrics.h>
+#include <chiaki/time.h>
+
+#include <stdatomic.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#ifdef _WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#else
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#endif
+
+#define METRICS_HTTP_REQUEST_SIZE_MAX 1024
+#define METRICS_FORMAT_BUF_SIZE 0x4000
+#define METRICS_ACCEPT_TIMEOUT_MS 1000
+
+typedef struct metric_desc_t
+{
+	const char *name;
+	const char *help;
+	ChiakiMetricType type;
+	const double *bounds;
+	size_t bounds_count;
+} MetricDesc;
+
+static const double decode_time_bounds[] = { 0.5, 1.0, 2.0, 3.0, 4.0, 6.0, 8.0, 12.0, 16.0, 25.0, 50.0, 100.0 };
+static const double mic_latency_bounds[] = { 10.0, 15.0, 20.0, 25.0, 30.0, 40.0, 50.0, 75.0, 100.0, 200.0 };
+
+static const MetricDesc metric_descs[CHIAKI_METRIC_COUNT] = {
+	{ "chiaki_video_frames_total", "Video frames completed by the frame processor", CHIAKI_METRIC_TYPE_COUNTER, NULL, 0 },
+	{ "chiaki_video_bytes_total", "Bytes of completed video frames", CHIAKI_METRIC_TYPE_COUNTER, NULL, 0 },
+	{ "chiaki_video_frames_lost_total", "Video frames that could not be completed or decoded", CHIAKI_METRIC_TYPE_COUNTER, NULL, 0 },
+	{ "chiaki_video_frames_recovered_total", "Video frames decoded with a substituted reference frame", CHIAKI_METRIC_TYPE_COUNTER, NULL, 0 },
+	{ "chiaki_video_decode_failures_total", "Video frames the decoder failed on after accepting them", CHIAKI_METRIC_TYPE_COUNTER, NULL, 0 },
+	{ "chiaki_video_recovery_requests_total", "Losses recovered from by reporting corrupt frames to get a new IDR frame", CHIAKI_METRIC_TYPE_COUNTER, NULL, 0 },
+	{ "chiaki_video_recovery_idr_waits_total", "Losses recovered from by waiting for the next regular IDR frame", CHIAKI_METRIC_TYPE_COUNTER, NULL, 0 },
+	{ "chiaki_video_frames_dropped_total", "Decoded video frames replaced before they were rendered", CHIAKI_METRIC_TYPE_COUNTER, NULL, 0 },
+	{ "chiaki_fec_attempts_total", "Video frames that needed forward error correction", CHIAKI_METRIC_TYPE_COUNTER, NULL, 0 },
+	{ "chiaki_fec_successes_total", "Video frames successfully repaired by forward error correction", CHIAKI_METRIC_TYPE_COUNTER, NULL, 0 },
+	{ "chiaki_keystream_misses_total", "Key stream requests that were not in the precomputed buffer", CHIAKI_METRIC_TYPE_COUNTER, NULL, 0 },
+	{ "chiaki_audio_frames_total", "Audio frames received", CHIAKI_METRIC_TYPE_COUNTER, NULL, 0 },
+	{ "chiaki_audio_frames_concealed_total", "Missing audio frames recovered with Opus FEC or concealed", CHIAKI_METRIC_TYPE_COUNTER, NULL, 0 },
+	{ "chiaki_mic_frames_total", "Microphone frames encoded and sent", CHIAKI_METRIC_TYPE_COUNTER, NULL, 0 },
+	{ "chiaki_mic_frames_dropped_total", "Captured microphone samples dropped because encoding fell behind", CHIAKI_METRIC_TYPE_COUNTER, NULL, 0 },
+	{ "chiaki_recorder_bytes_total", "Bytes of video and audio packets written to recordings", CHIAKI_METRIC_TYPE_COUNTER, NULL, 0 },
+	{ "chiaki_recorder_packets_dropped_total", "Video and audio packets not recorded because writing fell behind", CHIAKI_METRIC_TYPE_COUNTER, NULL, 0 },
+	{ "chiaki_bitrate_mbps", "Measured video bitrate in MBit/s", CHIAKI_METRIC_TYPE_GAUGE, NULL, 0 },
+	{ "chiaki_fps", "Completed video frames per second", CHIAKI_METRIC_TYPE_GAUGE, NULL, 0 },
+	{ "chiaki_packet_loss_ratio", "Packet loss ratio of the last congestion control interval", CHIAKI_METRIC_TYPE_GAUGE, NULL, 0 },
+	{ "chiaki_rtt_ms", "Round trip time in milliseconds", CHIAKI_METRIC_TYPE_GAUGE, NULL, 0 },
+	{ "chiaki_send_buffer_packets", "Packets waiting for acknowledgement in the takion send buffer", CHIAKI_METRIC_TYPE_GAUGE, NULL, 0 },
+	{ "chiaki_audio_queue_ms", "Audio queued for playback in milliseconds", CHIAKI_METRIC_TYPE_GAUGE, NULL, 0 },
+	{ "chiaki_audio_jitter_buffer_ms", "Audio held in the jitter buffer in milliseconds", CHIAKI_METRIC_TYPE_GAUGE, NULL, 0 },
+	{ "chiaki_decode_time_ms", "Time from submitting a video frame to the decoder until it is decoded in milliseconds", CHIAKI_METRIC_TYPE_HISTOGRAM,
+		decode_time_bounds, sizeof(decode_time_bounds) / sizeof(decode_time_bounds[0]) },
+	{ "chiaki_mic_latency_ms", "Time from capturing the end of a microphone frame until it is sent in milliseconds", CHIAKI_METRIC_TYPE_HISTOGRAM,
+		mic_latency_bounds, sizeof(mic_latency_bounds) / sizeof(mic_latency_bounds[0]) }
+};
+
+typedef struct metric_histogram_t
+{
+	atomic_uint_fast64_t count;
+	atomic_uint_fast64_t sum; // bits of a double
+	atomic_uint_fast64_t buckets[CHIAKI_METRICS_HISTOGRAM_BUCKETS_MAX + 1];
+} MetricHistogram;
+
+struct chiaki_metrics_t
+{
+	atomic_uint_fast64_t values[CHIAKI_METRIC_COUNT]; // counters as integers, gauges as bits of a double
+	MetricHistogram histograms[CHIAKI_METRIC_COUNT];
+};
+
+static inline uint64_t double_to_bits(double v)
+{
+	uint64_t r;
+	memcpy(&r, &v, sizeof(r));
+	return r;
+}
+
+static inline double bits_to_double(uint64_t v)
+{
+	double r;
+	memcpy(&r, &v, sizeof(r));
+	return r;
+}
+
+static inline bool metric_valid(ChiakiMetric metric)
+{
+	return metric >= 0 && metric < CHIAKI_METRIC_COUNT;
+}
+
+CHIAKI_EXPORT const char *chiaki_metric_name(ChiakiMetric metric)
+{
+	return metric_valid(metric) ? metric_descs[metric].name : "unknown";
+}
+
+CHIAKI_EXPORT const char *chiaki_metric_help(ChiakiMetric metric)
+{
+	return metric_valid(metric) ? metric_descs[metric].help : "";
+}
+
+CHIAKI_EXPORT ChiakiMetricType chiaki_metric_type(ChiakiMetric metric)
+{
+	return metric_valid(metric) ? metric_descs[metric].type : CHIAKI_METRIC_TYPE_GAUGE;
+}
+
+CHIAKI_EXPORT const double *chiaki_metric_histogram_bounds(ChiakiMetric metric, size_t *count)
+{
+	if(!metric_valid(metric) || metric_descs[metric].type != CHIAKI_METRIC_TYPE_HISTOGRAM)
+	{
+		if(count)
+			*count = 0;
+		return NULL;
+	}
+	if(count)
+		*count = metric_descs[metric].bounds_count;
+	return metric_descs[metric].bounds;
+}
+
+CHIAKI_EXPORT ChiakiMetrics *chiaki_metrics_new()
+{
+	ChiakiMetrics *metrics = CHIAKI_NEW(ChiakiMetrics);
+	if(!metrics)
+		return NULL;
+	for(size_t i=0; i<CHIAKI_METRIC_COUNT; i++)
+	{
+		atomic_init(&metrics->values[i], 0);
+		atomic_init(&metrics->histograms[i].count, 0);
+		atomic_init(&metrics->histograms[i].sum, double_to_bits(0.0));
+		for(size_t j=0; j<CHIAKI_METRICS_HISTOGRAM_BUCKETS_MAX + 1; j++)
+			atomic_init(&metrics->histograms[i].buckets[j], 0);
+	}
+	chiaki_metrics_reset(metrics);
+	return metrics;
+}
+
+CHIAKI_EXPORT void chiaki_metrics_free(ChiakiMetrics *metrics)
+{
+	free(metrics);
+}
+
+CHIAKI_EXPORT void chiaki_metrics_reset(ChiakiMetrics *metrics)
+{
+	if(!metrics)
+		return;
+	for(size_t i=0; i<CHIAKI_METRIC_COUNT; i++)
+	{
+		atomic_store_explicit(&metrics->values[i],
+				metric_descs[i].type == CHIAKI_METRIC_TYPE_GAUGE ? double_to_bits(0.0) : 0,
+				memory_order_relaxed);
+		MetricHistogram *h = &metrics->histograms[i];
+		atomic_store_explicit(&h->count, 0, memory_order_relaxed);
+		atomic_store_explicit(&h->sum, double_to_bits(0.0), memory_order_relaxed);
+		for(size_t j=0; j<CHIAKI_METRICS_HISTOGRAM_BUCKETS_MAX + 1; j++)
+			atomic_store_explicit(&h->buckets[j], 0, memory_order_relaxed);
+	}
+}
+
+CHIAKI_EXPORT void chiaki_metrics_counter_add(ChiakiMetrics *metrics, ChiakiMetric metric, uint64_t value)
+{
+	if(!metrics || !metric_valid(metric) || metric_descs[metric].type != CHIAKI_METRIC_TYPE_COUNTER)
+		return;
+	atomic_fetch_add_explicit(&metrics->values[metric], value, memory_order_relaxed);
+}
+
+CHIAKI_EXPORT void chiaki_metrics_gauge_set(ChiakiMetrics *metrics, ChiakiMetric metric, double value)
+{
+	if(!metrics || !metric_valid(metric) || metric_descs[metric].type != CHIAKI_METRIC_TYPE_GAUGE)
+		return;
+	atomic_store_explicit(&metrics->values[metric], double_to_bits(value), memory_order_relaxed);
+}
+
+CHIAKI_EXPORT void chiaki_metrics_histogram_observe(ChiakiMetrics *metrics, ChiakiMetric metric, double value)
+{
+	if(!metrics || !metric_valid(metric) || metric_descs[metric].type != CHIAKI_METRIC_TYPE_HISTOGRAM)
+		return;
+	const MetricDesc *desc = &metric_descs[metric];
+	MetricHistogram *h = &metrics->histograms[metric];
+
+	size_t bucket = desc->bounds_count;
+	for(size_t i=0; i<desc->bounds_count; i++)
+	{
+		if(value <= desc->bounds[i])
+		{
+			bucket = i;
+			break;
+		}
+	}
+	atomic_fetch_add_explicit(&h->buckets[bucket], 1, memory_order_relaxed);
+
+	uint64_t sum = atomic_load_explicit(&h->sum, memory_order_relaxed);
+	while(!atomic_compare_exchange_weak_explicit(&h->sum, &sum, double_to_bits(bits_to_double(sum) + value),
+				memory_order_relaxed, memory_order_relaxed));
+
+	atomic_fetch_add_explicit(&h->count, 1, memory_order_release);
+}
+
+static uint64_t wall_clock_ms()
+{
+	struct timespec ts;
+	if(!timespec_get(&ts, TIME_UTC))
+		return 0;
+	return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+CHIAKI_EXPORT void chiaki_metrics_snapshot(ChiakiMetrics *metrics, ChiakiMetricsSnapshot *snapshot)
+{
+	memset(snapshot, 0, sizeof(*snapshot));
+	snapshot->timestamp_ms = wall_clock_ms();
+	if(!metrics)
+		return;
+	for(size_t i=0; i<CHIAKI_METRIC_COUNT; i++)
+	{
+		ChiakiMetricValue *v = &snapshot->values[i];
+		switch(metric_descs[i].type)
+		{
+			case CHIAKI_METRIC_TYPE_COUNTER:
+				v->value = (double)atomic_load_explicit(&metrics->values[i], memory_order_relaxed);
+				break;
+			case CHIAKI_METRIC_TYPE_GAUGE:
+				v->value = bits_to_double(atomic_load_explicit(&metrics->values[i], memory_order_relaxed));
+				break;
+			case CHIAKI_METRIC_TYPE_HISTOGRAM:
+			{
+				MetricHistogram *h = &metrics->histograms[i];
+				v->count = atomic_load_explicit(&h->count, memory_order_acquire);
+				v->sum = bits_to_double(atomic_load_explicit(&h->sum, memory_order_relaxed));
+				for(size_t j=0; j<=metric_descs[i].bounds_count; j++)
+					v->buckets[j] = atomic_load_explicit(&h->buckets[j], memory_order_relaxed);
+				break;
+			}
+		}
+	}
+}
+
+typedef struct format_buf_t
+{
+	char *buf;
+	size_t size;
+	size_t written;
+	bool overflow;
+} FormatBuf;
+
+static void format_append(FormatBuf *f, const char *fmt, ...)
+{
+	if(f->overflow)
+		return;
+	va_list args;
+	va_start(args, fmt);
+	int r = vsnprintf(f->buf + f->written, f->size - f->written, fmt, args);
+	va_end(args);
+	if(r < 0 || (size_t)r >= f->size - f->written)
+	{
+		f->overflow = true;
+		return;
+	}
+	f->written += (size_t)r;
+}
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_metrics_format_prometheus(const ChiakiMetricsSnapshot *snapshot, const char *labels, char *buf, size_t *buf_size)
+{
+	if(!*buf_size)
+		return CHIAKI_ERR_BUF_TOO_SMALL;
+	FormatBuf f = { buf, *buf_size, 0, false };
+	buf[0] = '\0';
+	bool has_labels = labels && *labels;
+
+	static const char *type_names[] = { "counter", "gauge", "histogram" };
+	for(size_t i=0; i<CHIAKI_METRIC_COUNT; i++)
+	{
+		const MetricDesc *desc = &metric_descs[i];
+		const ChiakiMetricValue *v = &snapshot->values[i];
+		format_append(&f, "# HELP %s %s\n# TYPE %s %s\n", desc->name, desc->help, desc->name, type_names[desc->type]);
+		if(desc->type != CHIAKI_METRIC_TYPE_HISTOGRAM)
+		{
+			format_append(&f, "%s%s%s%s %.17g\n", desc->name,
+					has_labels ? "{" : "", has_labels ? labels : "", has_labels ? "}" : "",
+					v->value);
+			continue;
+		}
+		uint64_t cumulative = 0;
+		for(size_t j=0; j<=desc->bounds_count; j++)
+		{
+			cumulative += v->buckets[j];
+			if(j < desc->bounds_count)
+				format_append(&f, "%s_bucket{%s%sle=\"%g\"} %llu\n", desc->name,
+						has_labels ? labels : "", has_labels ? "," : "",
+						desc->bounds[j], (unsigned long long)cumulative);
+			else
+				format_append(&f, "%s_bucket{%s%sle=\"+Inf\"} %llu\n", desc->name,
+						has_labels ? labels : "", has_labels ? "," : "",
+						(unsigned long long)cumulative);
+		}
+		format_append(&f, "%s_sum%s%s%s %.17g\n", desc->name,
+				has_labels ? "{" : "", has_labels ? labels : "", has_labels ? "}" : "", v->sum);
+		format_append(&f, "%s_count%s%s%s %llu\n", desc->name,
+				has_labels ? "{" : "", has_labels ? labels : "", has_labels ? "}" : "", (unsigned long long)v->count);
+	}
+
+	*buf_size = f.written;
+	return f.overflow ? CHIAKI_ERR_BUF_TOO_SMALL : CHIAKI_ERR_SUCCESS;
+}
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_metrics_format_json(const ChiakiMetricsSnapshot *snapshot, char *buf, size_t *buf_size)
+{
+	if(!*buf_size)
+		return CHIAKI_ERR_BUF_TOO_SMALL;
+	FormatBuf f = { buf, *buf_size, 0, false };
+	buf[0] = '\0';
+
+	format_append(&f, "{\"timestamp_ms\":%llu", (unsigned long long)snapshot->timestamp_ms);
+	for(size_t i=0; i<CHIAKI_METRIC_COUNT; i++)
+	{
+		const MetricDesc *desc = &metric_descs[i];
+		const ChiakiMetricValue *v = &snapshot->values[i];
+		if(desc->type != CHIAKI_METRIC_TYPE_HISTOGRAM)
+		{
+			format_append(&f, ",\"%s\":%.17g", desc->name, v->value);
+			continue;
+		}
+		format_append(&f, ",\"%s\":{\"count\":%llu,\"sum\":%.17g,\"buckets\":[", desc->name,
+				(unsigned long long)v->count, v->sum);
+		for(size_t j=0; j<=desc->bounds_count; j++)
+			format_append(&f, "%s%llu", j ? "," : "", (unsigned long long)v->buckets[j]);
+		format_append(&f, "]}");
+	}
+	format_append(&f, "}\n");
+
+	*buf_size = f.written;
+	return f.overflow ? CHIAKI_ERR_BUF_TOO_SMALL : CHIAKI_ERR_SUCCESS;
+}
+
+static void exporter_serve(ChiakiMetricsExporter *exporter, char *buf, size_t buf_size)
+{
+	chiaki_socket_t sock = accept(exporter->listen_sock, NULL, NULL);
+	if(CHIAKI_SOCKET_IS_INVALID(sock))
+		return;
+
+	// Drain the request, we serve the same document for any path
+	char req[METRICS_HTTP_REQUEST_SIZE_MAX];
+	ChiakiErrorCode err = chiaki_stop_pipe_select_single(&exporter->stop_pipe, sock, false, METRICS_ACCEPT_TIMEOUT_MS);
+	if(err == CHIAKI_ERR_SUCCESS)
+		recv(sock, req, sizeof(req), 0);
+
+	ChiakiMetricsSnapshot snapshot;
+	chiaki_metrics_snapshot(exporter->metrics, &snapshot);
+	char *body = buf + 0x100;
+	size_t body_size = buf_size - 0x100;
+	err = chiaki_metrics_format_prometheus(&snapshot, exporter->labels, body, &body_size);
+	if(err != CHIAKI_ERR_SUCCESS)
+		CHIAKI_LOGW(exporter->log, "Metrics exporter truncated Prometheus output");
+
+	int header_size = snprintf(buf, 0x100,
+			"HTTP/1.1 200 OK\r\n"
+			"Content-Type: text/plain; version=0.0.4\r\n"
+			"Content-Length: %llu\r\n"
+			"Connection: close\r\n\r\n", (unsigned long long)body_size);
+	memmove(buf + header_size, body, body_size);
+	size_t total = (size_t)header_size + body_size;
+	size_t sent = 0;
+	while(sent < total)
+	{
+		int r = send(sock, (CHIAKI_SOCKET_BUF_TYPE)(buf + sent), (int)(total - sent), 0);
+		if(r <= 0)
+			break;
+		sent += (size_t)r;
+	}
+	CHIAKI_SOCKET_CLOSE(sock);
+}
+
+static void exporter_write_json(ChiakiMetricsExporter *exporter, char *buf, size_t buf_size)
+{
+	ChiakiMetricsSnapshot snapshot;
+	chiaki_metrics_snapshot(exporter->metrics, &snapshot);
+	if(chiaki_metrics_format_json(&snapshot, buf, &buf_size) != CHIAKI_ERR_SUCCESS)
+	{
+		CHIAKI_LOGW(exporter->log, "Metrics exporter failed to format JSON line");
+		return;
+	}
+	fwrite(buf, 1, buf_size, exporter->json_file);
+	fflush(exporter->json_file);
+}
+
+static void *exporter_thread_func(void *user)
+{
+	ChiakiMetricsExporter *exporter = user;
+	char *buf = malloc(METRICS_FORMAT_BUF_SIZE);
+	if(!buf)
+		return NULL;
+
+	while(true)
+	{
+		uint64_t timeout_ms = METRICS_ACCEPT_TIMEOUT_MS;
+		if(exporter->json_file)
+		{
+			uint64_t now_ms = chiaki_time_now_monotonic_ms();
+			uint64_t next_ms = exporter->json_last_ms + exporter->json_interval_ms;
+			if(now_ms >= next_ms)
+			{
+				exporter_write_json(exporter, buf, METRICS_FORMAT_BUF_SIZE);
+				exporter->json_last_ms = now_ms;
+				next_ms = now_ms + exporter->json_interval_ms;
+			}
+			timeout_ms = next_ms - now_ms;
+		}
+
+		ChiakiErrorCode err = chiaki_stop_pipe_select_single(&exporter->stop_pipe, exporter->listen_sock, false, timeout_ms);
+		if(err == CHIAKI_ERR_CANCELED)
+			break;
+		if(err != CHIAKI_ERR_SUCCESS && err != CHIAKI_ERR_TIMEOUT)
+		{
+			CHIAKI_LOGE(exporter->log, "Metrics exporter failed to wait for connections: %s", chiaki_error_string(err));
+			break;
+		}
+		if(err == CHIAKI_ERR_SUCCESS && !CHIAKI_SOCKET_IS_INVALID(exporter->listen_sock))
+			exporter_serve(exporter, buf, METRICS_FORMAT_BUF_SIZE);
+	}
+
+	if(exporter->json_file)
+		exporter_write_json(exporter, buf, METRICS_FORMAT_BUF_SIZE);
+	free(buf);
+	return NULL;
+}
+
+static chiaki_socket_t exporter_listen(ChiakiLog *log, uint16_t port)
+{
+	chiaki_socket_t sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+	if(CHIAKI_SOCKET_IS_INVALID(sock))
+	{
+		CHIAKI_LOGE(log, "Metrics exporter failed to create socket");
+		return CHIAKI_INVALID_SOCKET;
+	}
+
+	const int reuse = 1;
+	setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, (const CHIAKI_SOCKET_BUF_TYPE)&reuse, sizeof(reuse));
+
+	struct sockaddr_in addr = { 0 };
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	addr.sin_port = htons(port);
+	if(bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(sock, 4) < 0)
+	{
+		CHIAKI_LOGE(log, "Metrics exporter failed to listen on 127.0.0.1:%u", (unsigned int)port);
+		CHIAKI_SOCKET_CLOSE(sock);
+		return CHIAKI_INVALID_SOCKET;
+	}
+	CHIAKI_LOGI(log, "Metrics exporter serving Prometheus metrics on http://127.0.0.1:%u/metrics", (unsigned int)port);
+	return sock;
+}
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_metrics_exporter_start(ChiakiMetricsExporter *exporter, ChiakiLog *log, ChiakiMetrics *metrics,
+		uint16_t port, const char *json_path, uint64_t json_interval_ms, const char *labels)
+{
+	memset(exporter, 0, sizeof(*exporter));
+	exporter->log = log;
+	exporter->metrics = metrics;
+	exporter->listen_sock = CHIAKI_INVALID_SOCKET;
+	exporter->json_interval_ms = json_interval_ms ? json_interval_ms : 1000;
+
+	ChiakiErrorCode err = CHIAKI_ERR_MEMORY;
+	if(labels && *labels)
+	{
+		exporter->labels = strdup(labels);
+		if(!exporter->labels)
+			goto error;
+	}
+
+	err = chiaki_stop_pipe_init(&exporter->stop_pipe);
+	if(err != CHIAKI_ERR_SUCCESS)
+		goto error_labels;
+
+	if(port)
+	{
+		exporter->listen_sock = exporter_listen(log, port);
+		if(CHIAKI_SOCKET_IS_INVALID(exporter->listen_sock))
+		{
+			err = CHIAKI_ERR_NETWORK;
+			goto error_stop_pipe;
+		}
+	}
+
+	if(json_path)
+	{
+		exporter->json_file = fopen(json_path, "a");
+		if(!exporter->json_file)
+		{
+			CHIAKI_LOGE(log, "Metrics exporter failed to open %s", json_path);
+			err = CHIAKI_ERR_UNKNOWN;
+			goto error_sock;
+		}
+		exporter->json_last_ms = chiaki_time_now_monotonic_ms();
+	}
+
+	err = chiaki_thread_create(&exporter->thread, exporter_thread_func, exporter);
+	if(err != CHIAKI_ERR_SUCCESS)
+		goto error_file;
+	chiaki_thread_set_name(&exporter->thread, "Chiaki Metrics");
+	return CHIAKI_ERR_SUCCESS;
+
+error_file:
+	if(exporter->json_file)
+		fclose(exporter->json_file);
+error_sock:
+	if(!CHIAKI_SOCKET_IS_INVALID(exporter->listen_sock))
+		CHIAKI_SOCKET_CLOSE(exporter->listen_sock);
+error_stop_pipe:
+	chiaki_stop_pipe_fini(&exporter->stop_pipe);
+error_labels:
+	free(exporter->labels);
+error:
+	return err;
+}
+
+CHIAKI_EXPORT void chiaki_metrics_exporter_stop(ChiakiMetricsExporter *exporter)
+{
+	chiaki_stop_pipe_stop(&exporter->stop_pipe);
+	chiaki_thread_join(&exporter->thread, NULL);
+	chiaki_stop_pipe_fini(&exporter->stop_pipe);
+	if(!CHIAKI_SOCKET_IS_INVALID(exporter->listen_sock))
+		CHIAKI_SOCKET_CLOSE(exporter->listen_sock);
+	if(exporter->json_file)
+		fclose(exporter->json_file);
+	free(exporter->labels);
+}
@@ -0,0 +1,216 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#include <chiaki/config.h>
+#if CHIAKI_LIB_ENABLE_OPUS
+
+#include <chiaki/micpipeline.h>
+#include <chiaki/audio.h>
+#include <chiaki/time.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+#define CAPTURE_RING_MS 500
+// smoothing of the average latency, 1/2^LATENCY_AVG_SHIFT per frame
+#define LATENCY_AVG_SHIFT 4
+
+static void *mic_pipeline_thread_func(void *user);
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_mic_pipeline_start(ChiakiMicPipeline *pipeline, ChiakiLog *log, ChiakiOpusEncoder *encoder,
+		unsigned int channels, unsigned int rate, ChiakiMicPipelineProcessCallback process_cb, void *process_cb_user, ChiakiMetrics *metrics)
+{
+	memset(pipeline, 0, sizeof(*pipeline));
+	pipeline->log = log;
+	pipeline->encoder = encoder;
+	pipeline->metrics = metrics;
+	pipeline->channels = channels;
+	pipeline->rate = rate;
+	pipeline->frame_size = encoder->audio_header.frame_size;
+	pipeline->process_cb = process_cb;
+	pipeline->process_cb_user = process_cb_user;
+
+	if(!channels || !rate || !pipeline->frame_size)
+		return CHIAKI_ERR_INVALID_DATA;
+	if(!process_cb && channels != encoder->audio_header.channels)
+	{
+		CHIAKI_LOGE(log, "Mic pipeline captures %u channels, but the encoder expects %u", channels, (unsigned int)encoder->audio_header.channels);
+		return CHIAKI_ERR_INVALID_DATA;
+	}
+
+	size_t ring_frames = (size_t)rate * CAPTURE_RING_MS / 1000;
+	if(ring_frames < pipeline->frame_size * 2)
+		ring_frames = pipeline->frame_size * 2;
+	pipeline->ring = chiaki_audio_ring_new(channels, ring_frames, 0);
+	if(!pipeline->ring)
+		return CHIAKI_ERR_MEMORY;
+
+	ChiakiErrorCode err = CHIAKI_ERR_MEMORY;
+	pipeline->frame_buf = calloc(pipeline->frame_size * channels, sizeof(int16_t));
+	if(!pipeline->frame_buf)
+		goto error_ring;
+
+	err = chiaki_mutex_init(&pipeline->mutex, false);
+	if(err != CHIAKI_ERR_SUCCESS)
+		goto error_frame_buf;
+
+	err = chiaki_cond_init(&pipeline->cond);
+	if(err != CHIAKI_ERR_SUCCESS)
+		goto error_mutex;
+
+	err = chiaki_thread_create(&pipeline->thread, mic_pipeline_thread_func, pipeline);
+	if(err != CHIAKI_ERR_SUCCESS)
+		goto error_cond;
+	chiaki_thread_set_name(&pipeline->thread, "Chiaki Mic");
+
+	return CHIAKI_ERR_SUCCESS;
+
+error_cond:
+	chiaki_cond_fini(&pipeline->cond);
+error_mutex:
+	chiaki_mutex_fini(&pipeline->mutex);
+error_frame_buf:
+	free(pipeline->frame_buf);
+error_ring:
+	chiaki_audio_ring_free(pipeline->ring);
+	pipeline->ring = NULL;
+	return err;
+}
+
+CHIAKI_EXPORT void chiaki_mic_pipeline_stop(ChiakiMicPipeline *pipeline)
+{
+	if(!pipeline->ring)
+		return;
+	chiaki_mutex_lock(&pipeline->mutex);
+	pipeline->should_stop = true;
+	chiaki_cond_signal(&pipeline->cond);
+	chiaki_mutex_unlock(&pipeline->mutex);
+	chiaki_thread_join(&pipeline->thread, NULL);
+
+	CHIAKI_LOGI(pipeline->log, "Mic pipeline: %llu frames sent, %llu captured frames dropped, latency avg %llu us, max %llu us",
+			(unsigned long long)pipeline->stats.frames_sent, (unsigned long long)pipeline->stats.frames_dropped,
+			(unsigned long long)pipeline->stats.latency_us_avg, (unsigned long long)pipeline->stats.latency_us_max);
+
+	chiaki_cond_fini(&pipeline->cond);
+	chiaki_mutex_fini(&pipeline->mutex);
+	free(pipeline->frame_buf);
+	pipeline->frame_buf = NULL;
+	chiaki_audio_ring_free(pipeline->ring);
+	pipeline->ring = NULL;
+}
+
+CHIAKI_EXPORT void chiaki_mic_pipeline_push(ChiakiMicPipeline *pipeline, const int16_t *pcm, size_t frames, uint64_t capture_end_us)
+{
+	if(!pipeline->ring || !frames)
+		return;
+	size_t written = chiaki_audio_ring_write(pipeline->ring, pcm, frames);
+	size_t dropped = frames - written;
+
+	chiaki_mutex_lock(&pipeline->mutex);
+	pipeline->captured_frames += written;
+	// the tail of pcm is what got dropped
+	pipeline->capture_end_us = capture_end_us - (uint64_t)dropped * 1000000 / pipeline->rate;
+	pipeline->stats.frames_dropped += dropped;
+	chiaki_cond_signal(&pipeline->cond);
+	chiaki_mutex_unlock(&pipeline->mutex);
+
+	if(dropped)
+		chiaki_metrics_counter_add(pipeline->metrics, CHIAKI_METRIC_MIC_FRAMES_DROPPED, dropped);
+}
+
+CHIAKI_EXPORT void chiaki_mic_pipeline_flush(ChiakiMicPipeline *pipeline)
+{
+	if(!pipeline->ring)
+		return;
+	chiaki_mutex_lock(&pipeline->mutex);
+	pipeline->flush_until = pipeline->captured_frames;
+	chiaki_cond_signal(&pipeline->cond);
+	chiaki_mutex_unlock(&pipeline->mutex);
+}
+
+CHIAKI_EXPORT void chiaki_mic_pipeline_get_stats(ChiakiMicPipeline *pipeline, ChiakiMicPipelineStats *stats)
+{
+	if(!pipeline->ring)
+	{
+		memset(stats, 0, sizeof(*stats));
+		return;
+	}
+	chiaki_mutex_lock(&pipeline->mutex);
+	*stats = pipeline->stats;
+	chiaki_mutex_unlock(&pipeline->mutex);
+}
+
+static bool mic_pipeline_check_pred(void *user)
+{
+	ChiakiMicPipeline *pipeline = user;
+	// captured_frames rather than the fill of the ring, which may already include a write that is not accounted for yet
+	return pipeline->should_stop || pipeline->flush_until > pipeline->read_frames || pipeline->captured_frames - pipeline->read_frames >= pipeline->frame_size;
+}
+
+static void mic_pipeline_drain(ChiakiMicPipeline *pipeline, uint64_t frames)
+{
+	// the ring is only ever read from this thread, so discarding means reading
+	while(frames)
+	{
+		size_t n = frames < pipeline->frame_size ? (size_t)frames : pipeline->frame_size;
+		chiaki_audio_ring_read(pipeline->ring, pipeline->frame_buf, n, CHIAKI_AUDIO_GAIN_UNITY);
+		frames -= n;
+	}
+}
+
+static void *mic_pipeline_thread_func(void *user)
+{
+	ChiakiMicPipeline *pipeline = user;
+	uint64_t frame_us = (uint64_t)pipeline->frame_size * 1000000 / pipeline->rate;
+
+	chiaki_mutex_lock(&pipeline->mutex);
+	while(true)
+	{
+		chiaki_cond_wait_pred(&pipeline->cond, &pipeline->mutex, mic_pipeline_check_pred, pipeline);
+		if(pipeline->should_stop)
+			break;
+		if(pipeline->flush_until > pipeline->read_frames)
+		{
+			uint64_t frames = pipeline->flush_until - pipeline->read_frames;
+			pipeline->read_frames = pipeline->flush_until;
+			chiaki_mutex_unlock(&pipeline->mutex);
+			mic_pipeline_drain(pipeline, frames);
+			chiaki_mutex_lock(&pipeline->mutex);
+			continue;
+		}
+
+		// everything in the ring before captured_frames is covered by capture_end_us
+		uint64_t frame_end = pipeline->read_frames + pipeline->frame_size;
+		uint64_t capture_end_us = pipeline->capture_end_us - (pipeline->captured_frames - frame_end) * 1000000 / pipeline->rate;
+		pipeline->read_frames = frame_end;
+		chiaki_mutex_unlock(&pipeline->mutex);
+
+		chiaki_audio_ring_read(pipeline->ring, pipeline->frame_buf, pipeline->frame_size, CHIAKI_AUDIO_GAIN_UNITY);
+
+		int16_t *pcm = pipeline->frame_buf;
+		if(pipeline->process_cb)
+			pcm = pipeline->process_cb(pipeline->frame_buf, pipeline->frame_size, capture_end_us - frame_us, pipeline->process_cb_user);
+		if(pcm)
+			chiaki_opus_encoder_frame(pcm, pipeline->encoder);
+		uint64_t now_us = chiaki_time_now_monotonic_us();
+		uint64_t latency_us = now_us > capture_end_us ? now_us - capture_end_us : 0;
+
+		chiaki_mutex_lock(&pipeline->mutex);
+		if(pcm)
+		{
+			ChiakiMicPipelineStats *stats = &pipeline->stats;
+			stats->latency_us_avg = stats->frames_sent
+				? stats->latency_us_avg + (latency_us >> LATENCY_AVG_SHIFT) - (stats->latency_us_avg >> LATENCY_AVG_SHIFT)
+				: latency_us;
+			stats->frames_sent++;
+			stats->latency_us_last = latency_us;
+			if(latency_us > stats->latency_us_max)
+				stats->latency_us_max = latency_us;
+			chiaki_metrics_counter_inc(pipeline->metrics, CHIAKI_METRIC_MIC_FRAMES);
+			chiaki_metrics_histogram_observe(pipeline->metrics, CHIAKI_METRIC_MIC_LATENCY_MS, (double)latency_us / 1000.0);
+		}
+	}
+	chiaki_mutex_unlock(&pipeline->mutex);
+	return NULL;
+}
+
+#endif
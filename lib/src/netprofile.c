@@ -0,0 +1,274 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#include <chiaki/netprofile.h>
+#include <chiaki/sock.h>
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#include <iphlpapi.h>
+#else
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netdb.h>
+#include <ifaddrs.h>
+#include <net/if.h>
+#if defined(__linux__)
+#include <linux/if_packet.h>
+#elif defined(AF_LINK)
+#include <net/if_dl.h>
+#endif
+#endif
+
+#include "utils.h"
+
+#define FINGERPRINT_PORT 9295 // only used to pick a route, nothing is sent
+#define FINGERPRINT_INTERNET_HOST "192.0.2.1" // documentation address, routed like any host on the internet
+
+static void append(char *out, size_t out_size, size_t *len, const char *fmt, ...)
+{
+	if(*len >= out_size)
+		return;
+	va_list args;
+	va_start(args, fmt);
+	int r = vsnprintf(out + *len, out_size - *len, fmt, args);
+	va_end(args);
+	if(r > 0)
+		*len += (size_t)r;
+}
+
+static void format_hw_addr(char *out, size_t out_size, const uint8_t *addr, size_t addr_len)
+{
+	size_t len = 0;
+	out[0] = '\0';
+	for(size_t i=0; i<addr_len; i++)
+		append(out, out_size, &len, i ? ":%02x" : "%02x", addr[i]);
+}
+
+/**
+ * Let the system pick the route to host like it would for the connection, without sending anything.
+ */
+static ChiakiErrorCode route_to_host(const char *host, struct sockaddr_storage *remote, struct sockaddr_storage *local)
+{
+	struct addrinfo hints;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_socktype = SOCK_DGRAM;
+	hints.ai_family = strchr(host, ':') ? AF_INET6 : AF_INET; // like the session
+	struct addrinfo *addrinfos;
+	if(getaddrinfo(host, NULL, &hints, &addrinfos) != 0)
+		return CHIAKI_ERR_PARSE_ADDR;
+
+	ChiakiErrorCode err = CHIAKI_ERR_NETWORK;
+	for(struct addrinfo *ai = addrinfos; ai; ai = ai->ai_next)
+	{
+		if(ai->ai_addrlen > sizeof(*remote))
+			continue;
+		memset(remote, 0, sizeof(*remote));
+		memcpy(remote, ai->ai_addr, ai->ai_addrlen);
+		if(set_port((struct sockaddr *)remote, htons(FINGERPRINT_PORT)) != CHIAKI_ERR_SUCCESS)
+			continue;
+
+		chiaki_socket_t sock = socket(ai->ai_family, SOCK_DGRAM, IPPROTO_UDP);
+		if(CHIAKI_SOCKET_IS_INVALID(sock))
+			continue;
+		socklen_t local_len = sizeof(*local);
+		bool routed = connect(sock, (struct sockaddr *)remote, ai->ai_addrlen) == 0
+			&& getsockname(sock, (struct sockaddr *)local, &local_len) == 0;
+		CHIAKI_SOCKET_CLOSE(sock);
+		if(routed)
+		{
+			err = CHIAKI_ERR_SUCCESS;
+			break;
+		}
+	}
+	freeaddrinfo(addrinfos);
+	return err;
+}
+
+#ifdef _WIN32
+
+static void describe_interface(const struct sockaddr_storage *remote, const struct sockaddr_storage *local, char *out, size_t out_size, size_t *len)
+{
+	DWORD if_index;
+	if(GetBestInterfaceEx((struct sockaddr *)remote, &if_index) != NO_ERROR)
+		goto fallback;
+
+	ULONG size = 16 * 1024;
+	IP_ADAPTER_ADDRESSES *adapters = NULL;
+	ULONG r;
+	for(int attempt=0; attempt<3; attempt++)
+	{
+		free(adapters);
+		adapters = malloc(size);
+		if(!adapters)
+			goto fallback;
+		r = GetAdaptersAddresses(remote->ss_family, GAA_FLAG_INCLUDE_GATEWAYS | GAA_FLAG_SKIP_DNS_SERVER | GAA_FLAG_SKIP_MULTICAST | GAA_FLAG_SKIP_ANYCAST, NULL, adapters, &size);
+		if(r != ERROR_BUFFER_OVERFLOW)
+			break;
+	}
+	if(r != NO_ERROR)
+	{
+		free(adapters);
+		goto fallback;
+	}
+
+	for(IP_ADAPTER_ADDRESSES *a = adapters; a; a = a->Next)
+	{
+		if(a->IfIndex != if_index && a->Ipv6IfIndex != if_index)
+			continue;
+		char hw[64];
+		format_hw_addr(hw, sizeof(hw), a->PhysicalAddress, a->PhysicalAddressLength);
+		append(out, out_size, len, " if=%s hw=%s", a->AdapterName, hw);
+		char gw[64];
+		const char *gw_str = NULL;
+		if(a->FirstGatewayAddress)
+			gw_str = sockaddr_str(a->FirstGatewayAddress->Address.lpSockaddr, gw, sizeof(gw));
+		// the gateway's own hardware address is not looked up here, its address stands in for it
+		append(out, out_size, len, " gw=%s", gw_str ? gw_str : "none");
+		free(adapters);
+		return;
+	}
+	free(adapters);
+
+fallback:;
+	char addr[64];
+	const char *addr_str = sockaddr_str((struct sockaddr *)local, addr, sizeof(addr));
+	append(out, out_size, len, " local=%s", addr_str ? addr_str : "unknown");
+}
+
+#else
+
+static bool sockaddr_same_host(const struct sockaddr *a, const struct sockaddr *b)
+{
+	if(a->sa_family != b->sa_family)
+		return false;
+	if(a->sa_family == AF_INET)
+		return ((const struct sockaddr_in *)a)->sin_addr.s_addr == ((const struct sockaddr_in *)b)->sin_addr.s_addr;
+	if(a->sa_family == AF_INET6)
+		return !memcmp(&((const struct sockaddr_in6 *)a)->sin6_addr, &((const struct sockaddr_in6 *)b)->sin6_addr, sizeof(struct in6_addr));
+	return false;
+}
+
+static bool interface_hw_addr(struct ifaddrs *ifaddrs, const char *ifname, char *out, size_t out_size)
+{
+	for(struct ifaddrs *a = ifaddrs; a; a = a->ifa_next)
+	{
+		if(!a->ifa_addr || strcmp(a->ifa_name, ifname))
+			continue;
+#if defined(__linux__)
+		if(a->ifa_addr->sa_family != AF_PACKET)
+			continue;
+		const struct sockaddr_ll *ll = (const struct sockaddr_ll *)a->ifa_addr;
+		format_hw_addr(out, out_size, ll->sll_addr, ll->sll_halen);
+		return true;
+#elif defined(AF_LINK)
+		if(a->ifa_addr->sa_family != AF_LINK)
+			continue;
+		const struct sockaddr_dl *dl = (const struct sockaddr_dl *)a->ifa_addr;
+		format_hw_addr(out, out_size, (const uint8_t *)LLADDR(dl), dl->sdl_alen);
+		return true;
+#endif
+	}
+	return false;
+}
+
+#ifdef __linux__
+/**
+ * Find the hardware address of the IPv4 default gateway on ifname in the kernel's route and neighbor tables.
+ */
+static bool gateway_hw_addr(const char *ifname, char *out, size_t out_size)
+{
+	FILE *f = fopen("/proc/net/route", "r");
+	if(!f)
+		return false;
+	char line[256];
+	char gw_str[INET_ADDRSTRLEN] = { 0 };
+	while(fgets(line, sizeof(line), f))
+	{
+		char iface[IF_NAMESIZE + 1];
+		unsigned int dest, gw, flags;
+		if(sscanf(line, "%16s %x %x %x", iface, &dest, &gw, &flags) != 4)
+			continue; // header
+		if(strcmp(iface, ifname) || dest != 0 || !(flags & 0x2 /* RTF_GATEWAY */))
+			continue;
+		struct in_addr gw_addr;
+		gw_addr.s_addr = gw; // printed in memory order
+		inet_ntop(AF_INET, &gw_addr, gw_str, sizeof(gw_str));
+		break;
+	}
+	fclose(f);
+	if(!gw_str[0])
+		return false;
+
+	f = fopen("/proc/net/arp", "r");
+	if(!f)
+		return false;
+	bool found = false;
+	while(fgets(line, sizeof(line), f))
+	{
+		char ip[64], hw[32], dev[IF_NAMESIZE + 1];
+		if(sscanf(line, "%63s %*s %*s %31s %*s %16s", ip, hw, dev) != 3)
+			continue;
+		if(strcmp(ip, gw_str) || strcmp(dev, ifname) || !strcmp(hw, "00:00:00:00:00:00"))
+			continue;
+		snprintf(out, out_size, "%s", hw);
+		found = true;
+		break;
+	}
+	fclose(f);
+	return found;
+}
+#endif
+
+static void describe_interface(const struct sockaddr_storage *remote, const struct sockaddr_storage *local, char *out, size_t out_size, size_t *len)
+{
+	(void)remote;
+	struct ifaddrs *ifaddrs;
+	if(getifaddrs(&ifaddrs) == 0)
+	{
+		for(struct ifaddrs *a = ifaddrs; a; a = a->ifa_next)
+		{
+			if(!a->ifa_addr || !sockaddr_same_host(a->ifa_addr, (const struct sockaddr *)local))
+				continue;
+			char hw[64];
+			if(!interface_hw_addr(ifaddrs, a->ifa_name, hw, sizeof(hw)))
+				snprintf(hw, sizeof(hw), "none");
+			char gw[32];
+#ifdef __linux__
+			if(!gateway_hw_addr(a->ifa_name, gw, sizeof(gw)))
+#endif
+				snprintf(gw, sizeof(gw), "unknown");
+			append(out, out_size, len, " if=%s hw=%s gw=%s", a->ifa_name, hw, gw);
+			freeifaddrs(ifaddrs);
+			return;
+		}
+		freeifaddrs(ifaddrs);
+	}
+
+	char addr[64];
+	const char *addr_str = sockaddr_str((struct sockaddr *)local, addr, sizeof(addr));
+	append(out, out_size, len, " local=%s", addr_str ? addr_str : "unknown");
+}
+
+#endif
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_network_fingerprint(const char *host, char *out, size_t out_size)
+{
+	if(!out_size)
+		return CHIAKI_ERR_BUF_TOO_SMALL;
+	out[0] = '\0';
+	size_t len = 0;
+	append(out, out_size, &len, host ? "lan" : "holepunch");
+
+	struct sockaddr_storage remote, local;
+	ChiakiErrorCode err = route_to_host(host ? host : FINGERPRINT_INTERNET_HOST, &remote, &local);
+	if(err != CHIAKI_ERR_SUCCESS)
+		return err;
+	describe_interface(&remote, &local, out, out_size, &len);
+	return len < out_size ? CHIAKI_ERR_SUCCESS : CHIAKI_ERR_BUF_TOO_SMALL;
+}
@@ -4,15 +4,21 @@
 #if CHIAKI_LIB_ENABLE_OPUS
 
 #include <chiaki/opusdecoder.h>
+#include <chiaki/trace.h>
+#include <chiaki/time.h>
 
 #include <opus/opus.h>
 
 #include <string.h>
 
+#define PLAYOUT_RESYNC_US 100000 // if the playout thread falls behind by more than this, e.g. after a suspend, it restarts its clock
+
 static void chiaki_opus_decoder_header(ChiakiAudioHeader *header, void *user);
 static void chiaki_opus_decoder_frame(uint8_t *buf, size_t buf_size, void *user);
+static void chiaki_opus_decoder_frame_index(ChiakiSeqNum16 frame_index, uint8_t *buf, size_t buf_size, void *user);
+static void *chiaki_opus_decoder_playout_thread_func(void *user);
 
-CHIAKI_EXPORT void chiaki_opus_decoder_init(ChiakiOpusDecoder *decoder, ChiakiLog *log)
+CHIAKI_EXPORT ChiakiErrorCode chiaki_opus_decoder_init(ChiakiOpusDecoder *decoder, ChiakiLog *log)
 {
 	decoder->log = log;
 	decoder->opus_decoder = NULL;
@@ -24,13 +30,35 @@ CHIAKI_EXPORT void chiaki_opus_decoder_init(ChiakiOpusDecoder *decoder, ChiakiLo
 	decoder->cb_user = NULL;
 	decoder->settings_cb = NULL;
 	decoder->frame_cb = NULL;
+
+	decoder->metrics = NULL;
+	decoder->jitter_buffer = NULL;
+	decoder->playout_thread_running = false;
+	decoder->playout_frame_us = 0;
+
+	return chiaki_mutex_init(&decoder->mutex, false);
 }
 
 CHIAKI_EXPORT void chiaki_opus_decoder_fini(ChiakiOpusDecoder *decoder)
 {
+	if(decoder->jitter_buffer)
+	{
+		if(decoder->playout_thread_running)
+		{
+			chiaki_bool_pred_cond_lock(&decoder->playout_cond);
+			decoder->playout_cond.pred = true;
+			chiaki_bool_pred_cond_unlock(&decoder->playout_cond);
+			chiaki_bool_pred_cond_signal(&decoder->playout_cond);
+			chiaki_thread_join(&decoder->playout_thread, NULL);
+		}
+		chiaki_bool_pred_cond_fini(&decoder->playout_cond);
+		chiaki_audio_jitter_buffer_fini(decoder->jitter_buffer);
+		free(decoder->jitter_buffer);
+	}
 	free(decoder->pcm_buf);
 	if(decoder->opus_decoder)
 		opus_decoder_destroy(decoder->opus_decoder);
+	chiaki_mutex_fini(&decoder->mutex);
 }
 
 CHIAKI_EXPORT void chiaki_opus_decoder_get_sink(ChiakiOpusDecoder *decoder, ChiakiAudioSink *sink)
@@ -38,11 +66,44 @@ CHIAKI_EXPORT void chiaki_opus_decoder_get_sink(ChiakiOpusDecoder *decoder, Chia
 	sink->user = decoder;
 	sink->header_cb = chiaki_opus_decoder_header;
 	sink->frame_cb = chiaki_opus_decoder_frame;
+	sink->frame_index_cb = decoder->jitter_buffer ? chiaki_opus_decoder_frame_index : NULL;
+}
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_opus_decoder_enable_jitter_buffer(ChiakiOpusDecoder *decoder)
+{
+	if(decoder->jitter_buffer)
+		return CHIAKI_ERR_SUCCESS;
+	ChiakiAudioJitterBuffer *jitter_buffer = CHIAKI_NEW(ChiakiAudioJitterBuffer);
+	if(!jitter_buffer)
+		return CHIAKI_ERR_MEMORY;
+	ChiakiErrorCode err = chiaki_audio_jitter_buffer_init(jitter_buffer, 0);
+	if(err != CHIAKI_ERR_SUCCESS)
+		goto error_alloc;
+	err = chiaki_bool_pred_cond_init(&decoder->playout_cond);
+	if(err != CHIAKI_ERR_SUCCESS)
+		goto error_jitter_buffer;
+	decoder->jitter_buffer = jitter_buffer;
+	return CHIAKI_ERR_SUCCESS;
+
+error_jitter_buffer:
+	chiaki_audio_jitter_buffer_fini(jitter_buffer);
+error_alloc:
+	free(jitter_buffer);
+	return err;
+}
+
+CHIAKI_EXPORT bool chiaki_opus_decoder_get_jitter_buffer_stats(ChiakiOpusDecoder *decoder, ChiakiAudioJitterBufferStats *stats)
+{
+	if(!decoder->jitter_buffer)
+		return false;
+	chiaki_audio_jitter_buffer_get_stats(decoder->jitter_buffer, stats);
+	return true;
 }
 
 static void chiaki_opus_decoder_header(ChiakiAudioHeader *header, void *user)
 {
 	ChiakiOpusDecoder *decoder = user;
+	chiaki_mutex_lock(&decoder->mutex);
 	memcpy(&decoder->audio_header, header, sizeof(decoder->audio_header));
 
 	opus_decoder_destroy(decoder->opus_decoder);
@@ -54,7 +115,7 @@ static void chiaki_opus_decoder_header(ChiakiAudioHeader *header, void *user)
 	{
 		CHIAKI_LOGE(decoder->log, "ChiakiOpusDecoder failed to initialize opus decoder: %s", opus_strerror(error));
 		decoder->opus_decoder = NULL;
-		return;
+		goto beach;
 	}
 
 	CHIAKI_LOGI(decoder->log, "ChiakiOpusDecoder initialized");
@@ -71,29 +132,150 @@ static void chiaki_opus_decoder_header(ChiakiAudioHeader *header, void *user)
 		opus_decoder_destroy(decoder->opus_decoder);
 		decoder->opus_decoder = NULL;
 		decoder->pcm_buf_size = 0;
-		return;
+		goto beach;
 	}
 
 	decoder->pcm_buf_size = pcm_buf_size_required;
 
 	if(decoder->settings_cb)
 		decoder->settings_cb(header->channels, header->rate, decoder->cb_user);
+
+	if(decoder->jitter_buffer && header->rate)
+	{
+		uint64_t frame_us = (uint64_t)header->frame_size * 1000000 / header->rate;
+		chiaki_audio_jitter_buffer_reset(decoder->jitter_buffer, frame_us);
+		chiaki_bool_pred_cond_lock(&decoder->playout_cond);
+		decoder->playout_frame_us = frame_us;
+		chiaki_bool_pred_cond_unlock(&decoder->playout_cond);
+		if(!decoder->playout_thread_running)
+		{
+			ChiakiErrorCode err = chiaki_thread_create(&decoder->playout_thread, chiaki_opus_decoder_playout_thread_func, decoder);
+			if(err != CHIAKI_ERR_SUCCESS)
+			{
+				CHIAKI_LOGE(decoder->log, "ChiakiOpusDecoder failed to start audio playout thread");
+				goto beach;
+			}
+			chiaki_thread_set_name(&decoder->playout_thread, "Chiaki Audio Playout");
+			decoder->playout_thread_running = true;
+		}
+		CHIAKI_LOGI(decoder->log, "ChiakiOpusDecoder playing out through jitter buffer, %llu us per frame", (unsigned long long)frame_us);
+	}
+
+beach:
+	chiaki_mutex_unlock(&decoder->mutex);
 }
 
 static void chiaki_opus_decoder_frame(uint8_t *buf, size_t buf_size, void *user)
 {
 	ChiakiOpusDecoder *decoder = user;
+	chiaki_mutex_lock(&decoder->mutex);
 	if(!decoder->opus_decoder)
 	{
 		CHIAKI_LOGE(decoder->log, "Received audio frame, but opus decoder is not initialized");
-		return;
+		goto beach;
 	}
 
+	// the audio receiver sets the frame context to the audio frame for the duration of the callback
+	int64_t frame_index = chiaki_trace_frame_context();
+	CHIAKI_TRACE_BEGIN(CHIAKI_TRACE_STAGE_AUDIO_DECODE, frame_index);
 	int r = opus_decode(decoder->opus_decoder, buf, (opus_int32)buf_size, decoder->pcm_buf, decoder->audio_header.frame_size, 0);
+	CHIAKI_TRACE_END(CHIAKI_TRACE_STAGE_AUDIO_DECODE, frame_index);
 	if(r < 1)
 		CHIAKI_LOGE(decoder->log, "Decoding audio frame with opus failed: %s", opus_strerror(r));
 	else if(decoder->frame_cb)
 		decoder->frame_cb(decoder->pcm_buf, (size_t)r, decoder->cb_user);
+
+beach:
+	chiaki_mutex_unlock(&decoder->mutex);
+}
+
+static void chiaki_opus_decoder_frame_index(ChiakiSeqNum16 frame_index, uint8_t *buf, size_t buf_size, void *user)
+{
+	ChiakiOpusDecoder *decoder = user;
+	if(!chiaki_audio_jitter_buffer_push(decoder->jitter_buffer, frame_index, buf, buf_size, chiaki_time_now_monotonic_us()))
+		CHIAKI_LOGV_RL(decoder->log, "Audio frame %#x arrived too late for playout", (unsigned int)frame_index);
+}
+
+/**
+ * Decode whatever the jitter buffer has for the current frame period.
+ */
+static void chiaki_opus_decoder_playout(ChiakiOpusDecoder *decoder)
+{
+	uint8_t buf[CHIAKI_AUDIO_JITTER_BUFFER_UNIT_SIZE_MAX];
+	size_t buf_size = 0;
+	ChiakiSeqNum16 frame_index = 0;
+	ChiakiAudioJitterBufferResult result = chiaki_audio_jitter_buffer_pop(decoder->jitter_buffer, buf, &buf_size, &frame_index);
+
+	ChiakiAudioJitterBufferStats stats;
+	chiaki_audio_jitter_buffer_get_stats(decoder->jitter_buffer, &stats);
+	chiaki_metrics_gauge_set(decoder->metrics, CHIAKI_METRIC_AUDIO_JITTER_BUFFER_MS, (double)stats.latency_us / 1000.0);
+
+	if(result == CHIAKI_AUDIO_JITTER_BUFFER_NONE)
+		return;
+
+	chiaki_mutex_lock(&decoder->mutex);
+	if(!decoder->opus_decoder)
+		goto beach;
+
+	CHIAKI_TRACE_BEGIN(CHIAKI_TRACE_STAGE_AUDIO_DECODE, frame_index);
+	int r;
+	switch(result)
+	{
+		case CHIAKI_AUDIO_JITTER_BUFFER_FEC:
+			// frame_size must be exactly the duration of the missing frame for FEC
+			r = opus_decode(decoder->opus_decoder, buf, (opus_int32)buf_size, decoder->pcm_buf, decoder->audio_header.frame_size, 1);
+			break;
+		case CHIAKI_AUDIO_JITTER_BUFFER_PLC:
+			r = opus_decode(decoder->opus_decoder, NULL, 0, decoder->pcm_buf, decoder->audio_header.frame_size, 0);
+			break;
+		default:
+			r = opus_decode(decoder->opus_decoder, buf, (opus_int32)buf_size, decoder->pcm_buf, decoder->audio_header.frame_size, 0);
+			break;
+	}
+	CHIAKI_TRACE_END(CHIAKI_TRACE_STAGE_AUDIO_DECODE, frame_index);
+
+	if(result != CHIAKI_AUDIO_JITTER_BUFFER_FRAME)
+		chiaki_metrics_counter_inc(decoder->metrics, CHIAKI_METRIC_AUDIO_FRAMES_CONCEALED);
+
+	if(r < 1)
+		CHIAKI_LOGE_RL(decoder->log, "Decoding audio frame with opus failed: %s", opus_strerror(r));
+	else if(decoder->frame_cb)
+		decoder->frame_cb(decoder->pcm_buf, (size_t)r, decoder->cb_user);
+
+beach:
+	chiaki_mutex_unlock(&decoder->mutex);
+}
+
+static void *chiaki_opus_decoder_playout_thread_func(void *user)
+{
+	ChiakiOpusDecoder *decoder = user;
+	ChiakiErrorCode err = chiaki_bool_pred_cond_lock(&decoder->playout_cond);
+	if(err != CHIAKI_ERR_SUCCESS)
+		return NULL;
+
+	// deadlines are absolute, so waking up late for one frame does not shift all following ones
+	uint64_t due_us = chiaki_time_now_monotonic_us();
+	while(!decoder->playout_cond.pred)
+	{
+		due_us += decoder->playout_frame_us;
+		uint64_t now_us = chiaki_time_now_monotonic_us();
+		if(now_us > due_us + PLAYOUT_RESYNC_US)
+			due_us = now_us;
+		while(!decoder->playout_cond.pred && now_us < due_us)
+		{
+			chiaki_bool_pred_cond_timedwait(&decoder->playout_cond, (due_us - now_us + 999) / 1000);
+			now_us = chiaki_time_now_monotonic_us();
+		}
+		if(decoder->playout_cond.pred)
+			break;
+
+		chiaki_bool_pred_cond_unlock(&decoder->playout_cond);
+		chiaki_opus_decoder_playout(decoder);
+		chiaki_bool_pred_cond_lock(&decoder->playout_cond);
+	}
+
+	chiaki_bool_pred_cond_unlock(&decoder->playout_cond);
+	return NULL;
 }
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,622 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#include <chiaki/recorder.h>
+#include <chiaki/thread.h>
+
+#include <libavformat/avformat.h>
+#include <libavutil/channel_layout.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+// timestamps of queued packets, relative to the first keyframe of the recording
+#define RECORDER_TIME_BASE ((AVRational){ 1, 1000000 })
+// audio timestamps follow the frame indices, unless they drift further than this from the arrival times
+#define AUDIO_RESYNC_US 200000
+#define OPUS_HEAD_SIZE 19
+
+typedef enum recorder_stream_t
+{
+	RECORDER_STREAM_VIDEO = 0,
+	RECORDER_STREAM_AUDIO = 1
+} RecorderStream;
+
+/**
+ * Stream parameters of a recording, taken from the latest headers when its first keyframe is queued.
+ */
+typedef struct recorder_streams_t
+{
+	ChiakiCodec codec;
+	unsigned int width;
+	unsigned int height;
+	uint8_t *param_sets;
+	size_t param_sets_size;
+	bool audio;
+	ChiakiAudioHeader audio_header;
+} RecorderStreams;
+
+struct chiaki_recorder_t
+{
+	ChiakiLog *log;
+	ChiakiMetrics *metrics;
+	ChiakiMutex mutex; // guards everything but the muxer
+	ChiakiCond cond;
+
+	// latest headers of the stream, independent of recordings
+	bool video_header_valid;
+	ChiakiCodec codec;
+	unsigned int width;
+	unsigned int height;
+	uint8_t *param_sets; // parameter set NAL units of the video header, with 4 byte start codes
+	size_t param_sets_size;
+	bool audio_header_valid;
+	ChiakiAudioHeader audio_header;
+
+	// current recording
+	bool recording;
+	bool should_stop;
+	bool failed;
+	char *path;
+	ChiakiRecorderFormat format;
+	ChiakiThread thread;
+	bool keyframe_requested;
+	bool started; // the first keyframe is queued and streams is set
+	RecorderStreams streams;
+	bool param_sets_changed; // the file header has outdated parameter sets, so keyframes need them in-band
+	bool skip_to_keyframe; // a video packet was dropped
+	uint64_t base_us; // arrival of the first keyframe
+	int64_t video_pts_prev;
+	bool audio_anchored;
+	ChiakiSeqNum16 audio_index_prev;
+	int64_t audio_pts_prev;
+	int64_t audio_frame_us;
+
+	AVPacket *queue[CHIAKI_RECORDER_QUEUE_SIZE]; // stream_index is a RecorderStream, pts in RECORDER_TIME_BASE
+	size_t queue_begin;
+	size_t queue_count;
+	size_t queue_bytes;
+
+	ChiakiRecorderStats stats;
+
+	// only touched by the writer thread
+	AVFormatContext *muxer;
+};
+
+static void *recorder_thread_func(void *user);
+
+CHIAKI_EXPORT const char *chiaki_recorder_format_name(ChiakiRecorderFormat format)
+{
+	switch(format)
+	{
+		case CHIAKI_RECORDER_FORMAT_MKV:
+			return "mkv";
+		case CHIAKI_RECORDER_FORMAT_MP4:
+			return "mp4";
+		default:
+			return "unknown";
+	}
+}
+
+CHIAKI_EXPORT ChiakiRecorderFormat chiaki_recorder_format_from_path(const char *path)
+{
+	const char *ext = strrchr(path, '.');
+	if(ext && (!strcmp(ext, ".mp4") || !strcmp(ext, ".MP4")))
+		return CHIAKI_RECORDER_FORMAT_MP4;
+	return CHIAKI_RECORDER_FORMAT_MKV;
+}
+
+CHIAKI_EXPORT ChiakiRecorder *chiaki_recorder_new(ChiakiLog *log, ChiakiMetrics *metrics)
+{
+	ChiakiRecorder *recorder = calloc(1, sizeof(ChiakiRecorder));
+	if(!recorder)
+		return NULL;
+	recorder->log = log;
+	recorder->metrics = metrics;
+	if(chiaki_mutex_init(&recorder->mutex, false) != CHIAKI_ERR_SUCCESS)
+		goto error_recorder;
+	if(chiaki_cond_init(&recorder->cond) != CHIAKI_ERR_SUCCESS)
+		goto error_mutex;
+	return recorder;
+
+error_mutex:
+	chiaki_mutex_fini(&recorder->mutex);
+error_recorder:
+	free(recorder);
+	return NULL;
+}
+
+CHIAKI_EXPORT void chiaki_recorder_free(ChiakiRecorder *recorder)
+{
+	if(!recorder)
+		return;
+	chiaki_recorder_stop(recorder);
+	chiaki_cond_fini(&recorder->cond);
+	chiaki_mutex_fini(&recorder->mutex);
+	free(recorder->param_sets);
+	free(recorder);
+}
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_recorder_start(ChiakiRecorder *recorder, const char *path, ChiakiRecorderFormat format)
+{
+	chiaki_recorder_stop(recorder);
+
+	char *path_copy = strdup(path);
+	if(!path_copy)
+		return CHIAKI_ERR_MEMORY;
+
+	chiaki_mutex_lock(&recorder->mutex);
+	recorder->path = path_copy;
+	recorder->format = format;
+	recorder->should_stop = false;
+	recorder->failed = false;
+	recorder->keyframe_requested = false;
+	recorder->started = false;
+	recorder->skip_to_keyframe = false;
+	recorder->audio_anchored = false;
+	memset(&recorder->stats, 0, sizeof(recorder->stats));
+	ChiakiErrorCode err = chiaki_thread_create(&recorder->thread, recorder_thread_func, recorder);
+	if(err != CHIAKI_ERR_SUCCESS)
+	{
+		CHIAKI_LOGE(recorder->log, "Failed to create recorder thread");
+		free(recorder->path);
+		recorder->path = NULL;
+		goto beach;
+	}
+	chiaki_thread_set_name(&recorder->thread, "Chiaki Recorder");
+	recorder->recording = true;
+	CHIAKI_LOGI(recorder->log, "Recording to %s as %s, waiting for a keyframe", path, chiaki_recorder_format_name(format));
+
+beach:
+	chiaki_mutex_unlock(&recorder->mutex);
+	return err;
+}
+
+CHIAKI_EXPORT void chiaki_recorder_stop(ChiakiRecorder *recorder)
+{
+	chiaki_mutex_lock(&recorder->mutex);
+	if(!recorder->recording)
+	{
+		chiaki_mutex_unlock(&recorder->mutex);
+		return;
+	}
+	recorder->should_stop = true;
+	chiaki_cond_signal(&recorder->cond);
+	chiaki_mutex_unlock(&recorder->mutex);
+
+	chiaki_thread_join(&recorder->thread, NULL);
+
+	chiaki_mutex_lock(&recorder->mutex);
+	recorder->recording = false;
+	CHIAKI_LOGI(recorder->log, "Recording to %s stopped: %llu video frames, %llu audio frames, %llu bytes, %llu packets dropped",
+			recorder->path, (unsigned long long)recorder->stats.video_frames, (unsigned long long)recorder->stats.audio_frames,
+			(unsigned long long)recorder->stats.bytes, (unsigned long long)recorder->stats.packets_dropped);
+	free(recorder->path);
+	recorder->path = NULL;
+	free(recorder->streams.param_sets);
+	memset(&recorder->streams, 0, sizeof(recorder->streams));
+	chiaki_mutex_unlock(&recorder->mutex);
+}
+
+CHIAKI_EXPORT void chiaki_recorder_get_stats(ChiakiRecorder *recorder, ChiakiRecorderStats *stats)
+{
+	chiaki_mutex_lock(&recorder->mutex);
+	*stats = recorder->stats;
+	stats->recording = recorder->recording;
+	stats->failed = recorder->failed;
+	chiaki_mutex_unlock(&recorder->mutex);
+}
+
+static bool nalu_is_param_set(ChiakiCodec codec, uint8_t type)
+{
+	if(codec == CHIAKI_CODEC_H264)
+		return type == 7 || type == 8; // SPS, PPS
+	return type >= 32 && type <= 34; // VPS, SPS, PPS
+}
+
+static bool index_has_param_set(ChiakiCodec codec, const ChiakiBitstreamNalIndex *index)
+{
+	for(size_t i=0; i<index->nalus_count; i++)
+	{
+		if(nalu_is_param_set(codec, index->nalus[i].type))
+			return true;
+	}
+	return false;
+}
+
+CHIAKI_EXPORT void chiaki_recorder_video_header(ChiakiRecorder *recorder, ChiakiCodec codec, unsigned int width, unsigned int height,
+		const uint8_t *buf, size_t buf_size, const ChiakiBitstreamNalIndex *index)
+{
+	size_t size = 0;
+	for(size_t i=0; i<index->nalus_count; i++)
+	{
+		if(nalu_is_param_set(codec, index->nalus[i].type))
+			size += 4 + index->nalus[i].size;
+	}
+	uint8_t *param_sets = size ? malloc(size) : NULL;
+	if(!param_sets)
+	{
+		CHIAKI_LOGE(recorder->log, "Recorder found no parameter sets in the video header");
+		return;
+	}
+
+	size = 0;
+	for(size_t i=0; i<index->nalus_count; i++)
+	{
+		const ChiakiBitstreamNalu *nalu = &index->nalus[i];
+		if(!nalu_is_param_set(codec, nalu->type))
+			continue;
+		// trailing zeros are padding, a NAL unit always ends with the rbsp stop bit
+		size_t nalu_size = nalu->size;
+		while(nalu_size && !buf[nalu->offset + nalu_size - 1])
+			nalu_size--;
+		static const uint8_t start_code[] = { 0, 0, 0, 1 };
+		memcpy(param_sets + size, start_code, sizeof(start_code));
+		memcpy(param_sets + size + sizeof(start_code), buf + nalu->offset, nalu_size);
+		size += sizeof(start_code) + nalu_size;
+	}
+
+	chiaki_mutex_lock(&recorder->mutex);
+	if(recorder->started && (size != recorder->streams.param_sets_size || memcmp(param_sets, recorder->streams.param_sets, size)))
+		recorder->param_sets_changed = true;
+	free(recorder->param_sets);
+	recorder->param_sets = param_sets;
+	recorder->param_sets_size = size;
+	recorder->codec = codec;
+	recorder->width = width;
+	recorder->height = height;
+	recorder->video_header_valid = true;
+	chiaki_mutex_unlock(&recorder->mutex);
+}
+
+CHIAKI_EXPORT void chiaki_recorder_audio_header(ChiakiRecorder *recorder, const ChiakiAudioHeader *header)
+{
+	chiaki_mutex_lock(&recorder->mutex);
+	recorder->audio_header = *header;
+	recorder->audio_header_valid = header->channels && header->rate && header->frame_size;
+	if(recorder->started)
+		CHIAKI_LOGW(recorder->log, "Recorder received a new audio header after the recording started, keeping the old one");
+	chiaki_mutex_unlock(&recorder->mutex);
+}
+
+/**
+ * Copy a packet into the queue, recorder->mutex must be locked.
+ * @param prefix optional, prepended to buf
+ * @return false if it was dropped
+ */
+static bool queue_push(ChiakiRecorder *recorder, RecorderStream stream, const uint8_t *prefix, size_t prefix_size,
+		const uint8_t *buf, size_t buf_size, int64_t pts, bool key)
+{
+	size_t size = prefix_size + buf_size;
+	if(recorder->queue_count == CHIAKI_RECORDER_QUEUE_SIZE || recorder->queue_bytes + size > CHIAKI_RECORDER_QUEUE_BYTES_MAX)
+		goto drop;
+
+	AVPacket *packet = av_packet_alloc();
+	if(!packet)
+		goto drop;
+	if(av_new_packet(packet, (int)size) < 0)
+	{
+		av_packet_free(&packet);
+		goto drop;
+	}
+	if(prefix_size)
+		memcpy(packet->data, prefix, prefix_size);
+	memcpy(packet->data + prefix_size, buf, buf_size);
+	packet->stream_index = stream;
+	packet->pts = packet->dts = pts;
+	if(key)
+		packet->flags |= AV_PKT_FLAG_KEY;
+
+	recorder->queue[(recorder->queue_begin + recorder->queue_count) % CHIAKI_RECORDER_QUEUE_SIZE] = packet;
+	recorder->queue_count++;
+	recorder->queue_bytes += size;
+	chiaki_cond_signal(&recorder->cond);
+	return true;
+
+drop:
+	recorder->stats.packets_dropped++;
+	chiaki_metrics_counter_inc(recorder->metrics, CHIAKI_METRIC_RECORDER_PACKETS_DROPPED);
+	return false;
+}
+
+static bool recording_begin(ChiakiRecorder *recorder, uint64_t arrival_us)
+{
+	RecorderStreams *streams = &recorder->streams;
+	streams->param_sets = malloc(recorder->param_sets_size);
+	if(!streams->param_sets)
+		return false;
+	memcpy(streams->param_sets, recorder->param_sets, recorder->param_sets_size);
+	streams->param_sets_size = recorder->param_sets_size;
+	streams->codec = recorder->codec;
+	streams->width = recorder->width;
+	streams->height = recorder->height;
+	streams->audio = recorder->audio_header_valid;
+	streams->audio_header = recorder->audio_header;
+	if(streams->audio)
+		recorder->audio_frame_us = (int64_t)streams->audio_header.frame_size * 1000000 / streams->audio_header.rate;
+	else
+		CHIAKI_LOGW(recorder->log, "Recorder has no audio header, recording video only");
+
+	recorder->started = true;
+	recorder->param_sets_changed = false;
+	recorder->base_us = arrival_us;
+	recorder->video_pts_prev = -1;
+	return true;
+}
+
+CHIAKI_EXPORT bool chiaki_recorder_video_frame(ChiakiRecorder *recorder, const uint8_t *buf, size_t buf_size,
+		const ChiakiBitstreamNalIndex *index, uint64_t arrival_us)
+{
+	bool request_keyframe = false;
+	chiaki_mutex_lock(&recorder->mutex);
+	if(!recorder->recording || recorder->failed || !recorder->video_header_valid)
+		goto beach;
+
+	bool key = chiaki_bitstream_index_idr(recorder->codec, index);
+	if(!recorder->started)
+	{
+		if(!key)
+		{
+			request_keyframe = !recorder->keyframe_requested;
+			recorder->keyframe_requested = true;
+			goto beach;
+		}
+		if(!recording_begin(recorder, arrival_us))
+			goto beach;
+	}
+	else if(recorder->skip_to_keyframe && !key)
+	{
+		recorder->stats.packets_dropped++;
+		chiaki_metrics_counter_inc(recorder->metrics, CHIAKI_METRIC_RECORDER_PACKETS_DROPPED);
+		goto beach;
+	}
+
+	int64_t pts = arrival_us > recorder->base_us ? (int64_t)(arrival_us - recorder->base_us) : 0;
+	if(pts <= recorder->video_pts_prev)
+		pts = recorder->video_pts_prev + 1;
+
+	// the file header only has the parameter sets the recording started with
+	bool prefix = key && recorder->param_sets_changed && !index_has_param_set(recorder->codec, index);
+	if(queue_push(recorder, RECORDER_STREAM_VIDEO, prefix ? recorder->param_sets : NULL, prefix ? recorder->param_sets_size : 0,
+			buf, buf_size, pts, key))
+	{
+		recorder->video_pts_prev = pts;
+		recorder->skip_to_keyframe = false;
+	}
+	else
+		recorder->skip_to_keyframe = true;
+
+beach:
+	chiaki_mutex_unlock(&recorder->mutex);
+	return request_keyframe;
+}
+
+CHIAKI_EXPORT void chiaki_recorder_audio_frame(ChiakiRecorder *recorder, ChiakiSeqNum16 frame_index,
+		const uint8_t *buf, size_t buf_size, uint64_t arrival_us)
+{
+	chiaki_mutex_lock(&recorder->mutex);
+	if(!recorder->recording || recorder->failed || !recorder->started || !recorder->streams.audio)
+		goto beach;
+
+	int64_t arrival_pts = arrival_us > recorder->base_us ? (int64_t)(arrival_us - recorder->base_us) : 0;
+	int64_t pts = arrival_pts;
+	if(recorder->audio_anchored)
+	{
+		// arrival times jitter, the frames themselves don't
+		int64_t next_pts = recorder->audio_pts_prev + recorder->audio_frame_us;
+		pts = recorder->audio_pts_prev + (ChiakiSeqNum16)(frame_index - recorder->audio_index_prev) * recorder->audio_frame_us;
+		if(pts > arrival_pts + AUDIO_RESYNC_US || pts + AUDIO_RESYNC_US < arrival_pts)
+			pts = arrival_pts > next_pts ? arrival_pts : next_pts;
+	}
+
+	if(queue_push(recorder, RECORDER_STREAM_AUDIO, NULL, 0, buf, buf_size, pts, true))
+	{
+		recorder->audio_anchored = true;
+		recorder->audio_index_prev = frame_index;
+		recorder->audio_pts_prev = pts;
+	}
+
+beach:
+	chiaki_mutex_unlock(&recorder->mutex);
+}
+
+static bool set_extradata(AVCodecParameters *par, const uint8_t *data, size_t size)
+{
+	par->extradata = av_mallocz(size + AV_INPUT_BUFFER_PADDING_SIZE);
+	if(!par->extradata)
+		return false;
+	memcpy(par->extradata, data, size);
+	par->extradata_size = (int)size;
+	return true;
+}
+
+static ChiakiErrorCode muxer_open(ChiakiRecorder *recorder)
+{
+	RecorderStreams *streams = &recorder->streams;
+	AVFormatContext *muxer = NULL;
+	int r = avformat_alloc_output_context2(&muxer, NULL,
+			recorder->format == CHIAKI_RECORDER_FORMAT_MP4 ? "mp4" : "matroska", recorder->path);
+	if(r < 0 || !muxer)
+	{
+		CHIAKI_LOGE(recorder->log, "Recorder failed to create muxer");
+		return CHIAKI_ERR_UNKNOWN;
+	}
+
+	AVStream *video = avformat_new_stream(muxer, NULL);
+	if(!video)
+		goto error_muxer;
+	video->time_base = RECORDER_TIME_BASE;
+	AVCodecParameters *par = video->codecpar;
+	par->codec_type = AVMEDIA_TYPE_VIDEO;
+	par->codec_id = chiaki_codec_is_h265(streams->codec) ? AV_CODEC_ID_HEVC : AV_CODEC_ID_H264;
+	par->width = streams->width;
+	par->height = streams->height;
+	if(chiaki_codec_is_hdr(streams->codec))
+	{
+		par->color_primaries = AVCOL_PRI_BT2020;
+		par->color_trc = AVCOL_TRC_SMPTE2084;
+		par->color_space = AVCOL_SPC_BT2020_NCL;
+	}
+	// Annex B, the muxers convert it to avcC/hvcC
+	if(!set_extradata(par, streams->param_sets, streams->param_sets_size))
+		goto error_muxer;
+
+	if(streams->audio)
+	{
+		AVStream *audio = avformat_new_stream(muxer, NULL);
+		if(!audio)
+			goto error_muxer;
+		audio->time_base = RECORDER_TIME_BASE;
+		par = audio->codecpar;
+		par->codec_type = AVMEDIA_TYPE_AUDIO;
+		par->codec_id = AV_CODEC_ID_OPUS;
+		par->sample_rate = streams->audio_header.rate;
+#if LIBAVUTIL_VERSION_INT >= AV_VERSION_INT(57, 28, 100)
+		av_channel_layout_default(&par->ch_layout, streams->audio_header.channels);
+#else
+		par->channels = streams->audio_header.channels;
+		par->channel_layout = av_get_default_channel_layout(par->channels);
+#endif
+		par->frame_size = streams->audio_header.frame_size;
+
+		// RFC 7845 identification header with channel mapping family 0, which covers mono and stereo.
+		// The stream has been running for a while, so there is no pre-skip.
+		if(streams->audio_header.channels > 2)
+		{
+			CHIAKI_LOGE(recorder->log, "Recorder can't describe Opus with %u channels", (unsigned int)streams->audio_header.channels);
+			goto error_muxer;
+		}
+		uint8_t opus_head[OPUS_HEAD_SIZE] = { 'O', 'p', 'u', 's', 'H', 'e', 'a', 'd', 1, streams->audio_header.channels };
+		uint32_t rate = streams->audio_header.rate;
+		opus_head[12] = rate & 0xff;
+		opus_head[13] = (rate >> 8) & 0xff;
+		opus_head[14] = (rate >> 16) & 0xff;
+		opus_head[15] = (rate >> 24) & 0xff;
+		if(!set_extradata(par, opus_head, sizeof(opus_head)))
+			goto error_muxer;
+	}
+
+	AVDictionary *options = NULL;
+	if(recorder->format == CHIAKI_RECORDER_FORMAT_MP4)
+	{
+		av_dict_set(&options, "movflags", "frag_keyframe+empty_moov+default_base_moof", 0);
+		// Opus in MP4 is still flagged as experimental by older libavformat
+		muxer->strict_std_compliance = FF_COMPLIANCE_EXPERIMENTAL;
+	}
+
+	if(!(muxer->oformat->flags & AVFMT_NOFILE))
+	{
+		r = avio_open(&muxer->pb, recorder->path, AVIO_FLAG_WRITE);
+		if(r < 0)
+		{
+			char errbuf[128];
+			av_make_error_string(errbuf, sizeof(errbuf), r);
+			CHIAKI_LOGE(recorder->log, "Recorder failed to open %s: %s", recorder->path, errbuf);
+			av_dict_free(&options);
+			goto error_muxer;
+		}
+	}
+
+	r = avformat_write_header(muxer, &options);
+	av_dict_free(&options);
+	if(r < 0)
+	{
+		char errbuf[128];
+		av_make_error_string(errbuf, sizeof(errbuf), r);
+		CHIAKI_LOGE(recorder->log, "Recorder failed to write header: %s", errbuf);
+		goto error_pb;
+	}
+
+	recorder->muxer = muxer;
+	return CHIAKI_ERR_SUCCESS;
+
+error_pb:
+	if(!(muxer->oformat->flags & AVFMT_NOFILE))
+		avio_closep(&muxer->pb);
+error_muxer:
+	avformat_free_context(muxer);
+	return CHIAKI_ERR_UNKNOWN;
+}
+
+static void muxer_close(ChiakiRecorder *recorder)
+{
+	AVFormatContext *muxer = recorder->muxer;
+	if(!muxer)
+		return;
+	int r = av_write_trailer(muxer);
+	if(r < 0)
+	{
+		char errbuf[128];
+		av_make_error_string(errbuf, sizeof(errbuf), r);
+		CHIAKI_LOGE(recorder->log, "Recorder failed to write trailer: %s", errbuf);
+	}
+	if(!(muxer->oformat->flags & AVFMT_NOFILE))
+		avio_closep(&muxer->pb);
+	avformat_free_context(muxer);
+	recorder->muxer = NULL;
+}
+
+static bool recorder_check_pred(void *user)
+{
+	ChiakiRecorder *recorder = user;
+	return recorder->should_stop || recorder->queue_count;
+}
+
+static void *recorder_thread_func(void *user)
+{
+	ChiakiRecorder *recorder = user;
+
+	chiaki_mutex_lock(&recorder->mutex);
+	while(true)
+	{
+		chiaki_cond_wait_pred(&recorder->cond, &recorder->mutex, recorder_check_pred, recorder);
+		if(!recorder->queue_count)
+			break; // stopping and everything is written
+		AVPacket *packet = recorder->queue[recorder->queue_begin];
+		recorder->queue_begin = (recorder->queue_begin + 1) % CHIAKI_RECORDER_QUEUE_SIZE;
+		recorder->queue_count--;
+		recorder->queue_bytes -= packet->size;
+		bool failed = recorder->failed;
+		chiaki_mutex_unlock(&recorder->mutex);
+
+		// everything in the queue is from the current recording, the first packet is always its first keyframe
+		if(!failed && !recorder->muxer)
+			failed = muxer_open(recorder) != CHIAKI_ERR_SUCCESS;
+
+		RecorderStream stream = packet->stream_index;
+		int size = packet->size;
+		int64_t pts = packet->pts;
+		if(!failed)
+		{
+			AVStream *st = recorder->muxer->streams[stream];
+			av_packet_rescale_ts(packet, RECORDER_TIME_BASE, st->time_base);
+			int r = av_interleaved_write_frame(recorder->muxer, packet);
+			if(r < 0)
+			{
+				char errbuf[128];
+				av_make_error_string(errbuf, sizeof(errbuf), r);
+				CHIAKI_LOGE(recorder->log, "Recorder failed to write packet, giving up: %s", errbuf);
+				failed = true;
+			}
+		}
+		av_packet_free(&packet);
+
+		chiaki_mutex_lock(&recorder->mutex);
+		if(failed)
+		{
+			recorder->failed = true;
+			continue;
+		}
+		if(stream == RECORDER_STREAM_VIDEO)
+			recorder->stats.video_frames++;
+		else
+			recorder->stats.audio_frames++;
+		recorder->stats.bytes += size;
+		if(pts > 0 && (uint64_t)pts > recorder->stats.duration_us)
+			recorder->stats.duration_us = pts;
+		chiaki_metrics_counter_add(recorder->metrics, CHIAKI_METRIC_RECORDER_BYTES, size);
+	}
+	chiaki_mutex_unlock(&recorder->mutex);
+
+	muxer_close(recorder);
+	return NULL;
+}
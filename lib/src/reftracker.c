@@ -0,0 +1,195 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#include <chiaki/reftracker.h>
+
+#include <string.h>
+
+#define FRAME_INTERVAL_DEFAULT_US 16667
+// frames it takes the console to encode and send a requested IDR frame, on top of the round trip
+#define IDR_RESPONSE_FRAMES 4
+// smoothing of the measured intervals, 1/2^INTERVAL_AVG_SHIFT per sample
+#define INTERVAL_AVG_SHIFT 3
+
+static uint64_t interval_avg(uint64_t avg, uint64_t sample)
+{
+	if(!avg)
+		return sample;
+	return avg - (avg >> INTERVAL_AVG_SHIFT) + (sample >> INTERVAL_AVG_SHIFT);
+}
+
+static void ref_tracker_reset(ChiakiRefTracker *tracker)
+{
+	tracker->empty = true;
+	tracker->newest = 0;
+	tracker->usable = 0;
+	memset(tracker->samples, -1, sizeof(tracker->samples));
+	tracker->samples_count = 0;
+	tracker->frame_us = 0;
+	tracker->frame_interval_us = 0;
+	tracker->iframe_us = 0;
+	tracker->iframe_interval_us = 0;
+	tracker->recovery = CHIAKI_REF_RECOVERY_NONE;
+	tracker->recovery_until_us = 0;
+	memset(&tracker->stats, 0, sizeof(tracker->stats));
+}
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_ref_tracker_init(ChiakiRefTracker *tracker, ChiakiMetrics *metrics)
+{
+	tracker->metrics = metrics;
+	ref_tracker_reset(tracker);
+	return chiaki_mutex_init(&tracker->mutex, false);
+}
+
+CHIAKI_EXPORT void chiaki_ref_tracker_fini(ChiakiRefTracker *tracker)
+{
+	chiaki_mutex_fini(&tracker->mutex);
+}
+
+CHIAKI_EXPORT void chiaki_ref_tracker_reset(ChiakiRefTracker *tracker)
+{
+	chiaki_mutex_lock(&tracker->mutex);
+	ref_tracker_reset(tracker);
+	chiaki_mutex_unlock(&tracker->mutex);
+}
+
+CHIAKI_EXPORT uint64_t chiaki_ref_tracker_sample(ChiakiRefTracker *tracker, int32_t frame)
+{
+	chiaki_mutex_lock(&tracker->mutex);
+	uint64_t sample = tracker->samples_count++;
+	tracker->samples[sample % CHIAKI_REF_TRACKER_WINDOW] = frame;
+	chiaki_mutex_unlock(&tracker->mutex);
+	return sample;
+}
+
+/**
+ * @return bit of frame in usable or -1 if it is outside of the window
+ */
+static int frame_bit(ChiakiRefTracker *tracker, ChiakiSeqNum16 frame)
+{
+	if(tracker->empty || chiaki_seq_num_16_gt(frame, tracker->newest))
+		return -1;
+	ChiakiSeqNum16 age = tracker->newest - frame;
+	return age < CHIAKI_REF_TRACKER_WINDOW ? (int)age : -1;
+}
+
+CHIAKI_EXPORT void chiaki_ref_tracker_submitted(ChiakiRefTracker *tracker, ChiakiSeqNum16 frame, bool idr, uint64_t now_us)
+{
+	chiaki_mutex_lock(&tracker->mutex);
+	if(tracker->empty || chiaki_seq_num_16_gt(frame, tracker->newest))
+	{
+		ChiakiSeqNum16 shift = tracker->empty ? CHIAKI_REF_TRACKER_WINDOW : frame - tracker->newest;
+		if(!tracker->empty && shift == 1 && tracker->frame_us && now_us > tracker->frame_us)
+			tracker->frame_interval_us = interval_avg(tracker->frame_interval_us, now_us - tracker->frame_us);
+		tracker->usable = shift < CHIAKI_REF_TRACKER_WINDOW ? tracker->usable << shift : 0;
+		tracker->newest = frame;
+		tracker->frame_us = now_us;
+		tracker->empty = false;
+	}
+	int bit = frame_bit(tracker, frame);
+	if(bit >= 0)
+	{
+		// nothing before an IDR frame can be referenced anymore
+		if(idr)
+			tracker->usable &= ((uint64_t)1 << bit) - 1;
+		tracker->usable |= (uint64_t)1 << bit;
+	}
+
+	if(idr)
+	{
+		// IDR frames answering a request don't tell anything about the regular interval
+		if(tracker->iframe_us && tracker->recovery != CHIAKI_REF_RECOVERY_REQUEST && now_us > tracker->iframe_us)
+			tracker->iframe_interval_us = interval_avg(tracker->iframe_interval_us, now_us - tracker->iframe_us);
+		tracker->iframe_us = now_us;
+		tracker->recovery = CHIAKI_REF_RECOVERY_NONE;
+	}
+	chiaki_mutex_unlock(&tracker->mutex);
+}
+
+CHIAKI_EXPORT void chiaki_ref_tracker_sample_decoded(ChiakiRefTracker *tracker, uint64_t sample, bool success)
+{
+	if(success)
+		return;
+	chiaki_mutex_lock(&tracker->mutex);
+	if(sample < tracker->samples_count && tracker->samples_count - sample <= CHIAKI_REF_TRACKER_WINDOW)
+	{
+		int32_t frame = tracker->samples[sample % CHIAKI_REF_TRACKER_WINDOW];
+		if(frame >= 0)
+		{
+			tracker->stats.decode_failures++;
+			chiaki_metrics_counter_inc(tracker->metrics, CHIAKI_METRIC_VIDEO_DECODE_FAILURES);
+			// every frame after it may depend on it
+			int bit = frame_bit(tracker, (ChiakiSeqNum16)frame);
+			if(bit >= 0)
+				tracker->usable &= ~((((uint64_t)1 << bit) << 1) - 1);
+		}
+	}
+	chiaki_mutex_unlock(&tracker->mutex);
+}
+
+CHIAKI_EXPORT int32_t chiaki_ref_tracker_sample_frame(ChiakiRefTracker *tracker, uint64_t sample)
+{
+	chiaki_mutex_lock(&tracker->mutex);
+	int32_t frame = -1;
+	if(sample < tracker->samples_count && tracker->samples_count - sample <= CHIAKI_REF_TRACKER_WINDOW)
+		frame = tracker->samples[sample % CHIAKI_REF_TRACKER_WINDOW];
+	chiaki_mutex_unlock(&tracker->mutex);
+	return frame;
+}
+
+CHIAKI_EXPORT bool chiaki_ref_tracker_have(ChiakiRefTracker *tracker, ChiakiSeqNum16 frame)
+{
+	chiaki_mutex_lock(&tracker->mutex);
+	int bit = frame_bit(tracker, frame);
+	bool r = bit >= 0 && (tracker->usable & ((uint64_t)1 << bit));
+	chiaki_mutex_unlock(&tracker->mutex);
+	return r;
+}
+
+CHIAKI_EXPORT void chiaki_ref_tracker_rewritten(ChiakiRefTracker *tracker)
+{
+	chiaki_mutex_lock(&tracker->mutex);
+	tracker->stats.rewrites++;
+	chiaki_mutex_unlock(&tracker->mutex);
+	chiaki_metrics_counter_inc(tracker->metrics, CHIAKI_METRIC_VIDEO_FRAMES_RECOVERED);
+}
+
+CHIAKI_EXPORT ChiakiRefRecovery chiaki_ref_tracker_recovery(ChiakiRefTracker *tracker, uint64_t rtt_us, uint64_t now_us)
+{
+	chiaki_mutex_lock(&tracker->mutex);
+	if(tracker->recovery != CHIAKI_REF_RECOVERY_NONE && now_us < tracker->recovery_until_us)
+	{
+		chiaki_mutex_unlock(&tracker->mutex);
+		return CHIAKI_REF_RECOVERY_NONE;
+	}
+
+	uint64_t frame_interval_us = tracker->frame_interval_us ? tracker->frame_interval_us : FRAME_INTERVAL_DEFAULT_US;
+	uint64_t request_us = rtt_us + IDR_RESPONSE_FRAMES * frame_interval_us;
+
+	// a regular IDR frame that is overdue by more than the response time is not coming
+	uint64_t idr_due_us = tracker->iframe_us + tracker->iframe_interval_us;
+	if(tracker->iframe_interval_us && idr_due_us + request_us > now_us && idr_due_us < now_us + request_us)
+	{
+		tracker->recovery = CHIAKI_REF_RECOVERY_WAIT_IDR;
+		tracker->recovery_until_us = (idr_due_us > now_us ? idr_due_us : now_us) + request_us;
+		tracker->stats.idr_waits++;
+		chiaki_metrics_counter_inc(tracker->metrics, CHIAKI_METRIC_VIDEO_RECOVERY_IDR_WAITS);
+	}
+	else
+	{
+		tracker->recovery = CHIAKI_REF_RECOVERY_REQUEST;
+		tracker->recovery_until_us = now_us + request_us;
+		tracker->stats.requests++;
+		chiaki_metrics_counter_inc(tracker->metrics, CHIAKI_METRIC_VIDEO_RECOVERY_REQUESTS);
+	}
+	ChiakiRefRecovery r = tracker->recovery;
+	chiaki_mutex_unlock(&tracker->mutex);
+	return r;
+}
+
+CHIAKI_EXPORT void chiaki_ref_tracker_get_stats(ChiakiRefTracker *tracker, ChiakiRefTrackerStats *stats)
+{
+	chiaki_mutex_lock(&tracker->mutex);
+	*stats = tracker->stats;
+	stats->iframe_interval_us = tracker->iframe_interval_us;
+	chiaki_mutex_unlock(&tracker->mutex);
+}
@@ -0,0 +1,353 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#include <chiaki/remote/candidaterace.h>
+#include <chiaki/time.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "../utils.h"
+
+#define STAGGER_MS_DEFAULT 25
+#define RESEND_MS_DEFAULT 100
+#define RESEND_MAX_MS_DEFAULT 500
+#define TIMEOUT_MS_DEFAULT 10000
+#define REPLY_TIMEOUT_MS_DEFAULT 5000
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_candidate_race_init(ChiakiCandidateRace *race, ChiakiLog *log,
+		ChiakiCandidateRaceProbeCb probe_cb, ChiakiCandidateRaceReadCb read_cb, void *cb_user)
+{
+	memset(race, 0, sizeof(*race));
+	race->log = log;
+	race->probe_cb = probe_cb;
+	race->read_cb = read_cb;
+	race->cb_user = cb_user;
+	race->stagger_ms = STAGGER_MS_DEFAULT;
+	race->resend_ms = RESEND_MS_DEFAULT;
+	race->resend_max_ms = RESEND_MAX_MS_DEFAULT;
+	race->timeout_ms = TIMEOUT_MS_DEFAULT;
+	race->reply_timeout_ms = REPLY_TIMEOUT_MS_DEFAULT;
+	race->first_reply_us = CHIAKI_CANDIDATE_RACE_NEVER;
+	race->validated = CHIAKI_CANDIDATE_RACE_NONE;
+	race->validated_sock = CHIAKI_INVALID_SOCKET;
+	race->abort_err = CHIAKI_ERR_SUCCESS;
+	return CHIAKI_ERR_SUCCESS;
+}
+
+CHIAKI_EXPORT void chiaki_candidate_race_fini(ChiakiCandidateRace *race)
+{
+	free(race->pairs);
+	free(race->socks);
+}
+
+static uint64_t race_now_us(ChiakiCandidateRace *race)
+{
+	return chiaki_time_now_monotonic_us() - race->start_us;
+}
+
+static bool socket_registered(ChiakiCandidateRace *race, chiaki_socket_t sock)
+{
+	for(size_t i=0; i<race->socks_count; i++)
+		if(race->socks[i] == sock)
+			return true;
+	return false;
+}
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_candidate_race_add_socket(ChiakiCandidateRace *race, chiaki_socket_t sock)
+{
+	if(CHIAKI_SOCKET_IS_INVALID(sock))
+		return CHIAKI_ERR_INVALID_DATA;
+	if(socket_registered(race, sock))
+		return CHIAKI_ERR_SUCCESS;
+	if(race->socks_count == race->socks_size)
+	{
+		size_t size = race->socks_size ? race->socks_size * 2 : 8;
+		chiaki_socket_t *socks = realloc(race->socks, size * sizeof(chiaki_socket_t));
+		if(!socks)
+			return CHIAKI_ERR_MEMORY;
+		race->socks = socks;
+		race->socks_size = size;
+	}
+	race->socks[race->socks_count++] = sock;
+	return CHIAKI_ERR_SUCCESS;
+}
+
+CHIAKI_EXPORT void chiaki_candidate_race_remove_socket(ChiakiCandidateRace *race, chiaki_socket_t sock)
+{
+	for(size_t i=0; i<race->socks_count; i++)
+	{
+		if(race->socks[i] != sock)
+			continue;
+		race->socks[i] = race->socks[--race->socks_count];
+		return;
+	}
+}
+
+/**
+ * Offset from the start of the race at which pairs of the given priority are first probed.
+ */
+static uint64_t priority_start_us(ChiakiCandidateRace *race, unsigned int priority)
+{
+	size_t rank = 0;
+	for(size_t i=0; i<race->pairs_count; i++)
+	{
+		unsigned int p = race->pairs[i].priority;
+		if(p >= priority)
+			continue;
+		bool counted = false;
+		for(size_t j=0; j<i; j++)
+		{
+			if(race->pairs[j].priority == p)
+			{
+				counted = true;
+				break;
+			}
+		}
+		if(!counted)
+			rank++;
+	}
+	return rank * race->stagger_ms * 1000;
+}
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_candidate_race_add_pair(ChiakiCandidateRace *race, chiaki_socket_t sock,
+		const struct sockaddr *addr, socklen_t addr_len, unsigned int priority, void *user, size_t *index)
+{
+	if(addr_len > sizeof(struct sockaddr_storage))
+		return CHIAKI_ERR_INVALID_DATA;
+	ChiakiErrorCode err = chiaki_candidate_race_add_socket(race, sock);
+	if(err != CHIAKI_ERR_SUCCESS)
+		return err;
+	if(race->pairs_count == race->pairs_size)
+	{
+		size_t size = race->pairs_size ? race->pairs_size * 2 : 8;
+		ChiakiCandidateRacePair *pairs = realloc(race->pairs, size * sizeof(ChiakiCandidateRacePair));
+		if(!pairs)
+			return CHIAKI_ERR_MEMORY;
+		race->pairs = pairs;
+		race->pairs_size = size;
+	}
+
+	ChiakiCandidateRacePair *pair = &race->pairs[race->pairs_count];
+	memset(pair, 0, sizeof(*pair));
+	pair->sock = sock;
+	memcpy(&pair->addr, addr, addr_len);
+	pair->addr_len = addr_len;
+	pair->priority = priority;
+	pair->user = user;
+	pair->probes = 0;
+	pair->first_probe_us = CHIAKI_CANDIDATE_RACE_NEVER;
+	pair->last_probe_us = CHIAKI_CANDIDATE_RACE_NEVER;
+	pair->first_reply_us = CHIAKI_CANDIDATE_RACE_NEVER;
+	pair->validated_us = CHIAKI_CANDIDATE_RACE_NEVER;
+	pair->next_probe_us = 0; // set when the race starts
+	if(race->running)
+	{
+		uint64_t start_us = priority_start_us(race, priority);
+		uint64_t now_us = race_now_us(race);
+		pair->next_probe_us = start_us > now_us ? start_us : now_us;
+	}
+	if(index)
+		*index = race->pairs_count;
+	race->pairs_count++;
+	return CHIAKI_ERR_SUCCESS;
+}
+
+CHIAKI_EXPORT void chiaki_candidate_race_replied(ChiakiCandidateRace *race, size_t pair)
+{
+	if(pair >= race->pairs_count)
+		return;
+	uint64_t now_us = race_now_us(race);
+	if(race->pairs[pair].first_reply_us == CHIAKI_CANDIDATE_RACE_NEVER)
+		race->pairs[pair].first_reply_us = now_us;
+	if(race->first_reply_us == CHIAKI_CANDIDATE_RACE_NEVER)
+		race->first_reply_us = now_us;
+}
+
+CHIAKI_EXPORT void chiaki_candidate_race_validated(ChiakiCandidateRace *race, size_t pair, chiaki_socket_t sock)
+{
+	if(pair >= race->pairs_count || race->validated != CHIAKI_CANDIDATE_RACE_NONE)
+		return;
+	uint64_t now_us = race_now_us(race);
+	if(race->pairs[pair].first_reply_us == CHIAKI_CANDIDATE_RACE_NEVER)
+		race->pairs[pair].first_reply_us = now_us;
+	if(race->first_reply_us == CHIAKI_CANDIDATE_RACE_NEVER)
+		race->first_reply_us = now_us;
+	race->pairs[pair].validated_us = now_us;
+	race->validated = pair;
+	race->validated_sock = sock;
+}
+
+CHIAKI_EXPORT void chiaki_candidate_race_abort(ChiakiCandidateRace *race, ChiakiErrorCode err)
+{
+	if(race->abort_err == CHIAKI_ERR_SUCCESS)
+		race->abort_err = err;
+}
+
+static bool race_finished(ChiakiCandidateRace *race)
+{
+	return race->validated != CHIAKI_CANDIDATE_RACE_NONE || race->abort_err != CHIAKI_ERR_SUCCESS;
+}
+
+/**
+ * Send the probes that are due.
+ * @return when the next one is due
+ */
+static uint64_t send_probes(ChiakiCandidateRace *race, uint64_t now_us, uint64_t wake_us)
+{
+	for(size_t i=0; i<race->pairs_count && !race_finished(race); i++)
+	{
+		if(now_us >= race->pairs[i].next_probe_us)
+		{
+			race->probe_cb(race, i, race->cb_user);
+			// the callback may have added pairs, moving them
+			ChiakiCandidateRacePair *pair = &race->pairs[i];
+			if(pair->first_probe_us == CHIAKI_CANDIDATE_RACE_NEVER)
+				pair->first_probe_us = now_us;
+			pair->last_probe_us = now_us;
+			uint64_t interval_ms = race->resend_ms;
+			for(unsigned int p=0; p<pair->probes && interval_ms < race->resend_max_ms; p++)
+				interval_ms *= 2;
+			if(interval_ms > race->resend_max_ms)
+				interval_ms = race->resend_max_ms;
+			pair->probes++;
+			pair->next_probe_us = now_us + interval_ms * 1000;
+		}
+		if(race->pairs[i].next_probe_us < wake_us)
+			wake_us = race->pairs[i].next_probe_us;
+	}
+	return wake_us;
+}
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_candidate_race_run(ChiakiCandidateRace *race)
+{
+	race->start_us = chiaki_time_now_monotonic_us();
+	race->first_reply_us = CHIAKI_CANDIDATE_RACE_NEVER;
+	race->validated = CHIAKI_CANDIDATE_RACE_NONE;
+	race->validated_sock = CHIAKI_INVALID_SOCKET;
+	race->abort_err = CHIAKI_ERR_SUCCESS;
+	for(size_t i=0; i<race->pairs_count; i++)
+		race->pairs[i].next_probe_us = priority_start_us(race, race->pairs[i].priority);
+	race->running = true;
+
+	struct pollfd *fds = NULL;
+	size_t fds_size = 0;
+	ChiakiErrorCode err;
+	while(true)
+	{
+		if(race->abort_err != CHIAKI_ERR_SUCCESS)
+		{
+			err = race->abort_err;
+			break;
+		}
+		if(race->validated != CHIAKI_CANDIDATE_RACE_NONE)
+		{
+			err = CHIAKI_ERR_SUCCESS;
+			break;
+		}
+
+		uint64_t now_us = race_now_us(race);
+		uint64_t deadline_us = race->timeout_ms * 1000;
+		if(race->first_reply_us != CHIAKI_CANDIDATE_RACE_NEVER
+				&& race->first_reply_us + race->reply_timeout_ms * 1000 > deadline_us)
+			deadline_us = race->first_reply_us + race->reply_timeout_ms * 1000;
+		if(now_us >= deadline_us)
+		{
+			err = CHIAKI_ERR_HOST_UNREACH;
+			break;
+		}
+
+		uint64_t wake_us = send_probes(race, now_us, deadline_us);
+		if(race_finished(race))
+			continue;
+		if(!race->socks_count)
+		{
+			CHIAKI_LOGE(race->log, "Candidate race has no sockets to wait on");
+			err = CHIAKI_ERR_HOST_UNREACH;
+			break;
+		}
+
+		if(fds_size < race->socks_count)
+		{
+			struct pollfd *new_fds = realloc(fds, race->socks_size * sizeof(struct pollfd));
+			if(!new_fds)
+			{
+				err = CHIAKI_ERR_MEMORY;
+				break;
+			}
+			fds = new_fds;
+			fds_size = race->socks_size;
+		}
+		// callbacks may add or remove sockets, the wait works on a copy
+		size_t fds_count = race->socks_count;
+		for(size_t i=0; i<fds_count; i++)
+		{
+			fds[i].fd = race->socks[i];
+			fds[i].events = POLLIN;
+			fds[i].revents = 0;
+		}
+
+		now_us = race_now_us(race);
+		int timeout_ms = wake_us > now_us ? (int)((wake_us - now_us + 999) / 1000) : 0;
+		int r = poll(fds, fds_count, timeout_ms);
+		if(r < 0)
+		{
+			if(POLL_INTERRUPTED)
+				continue;
+			CHIAKI_LOGE(race->log, "Candidate race poll failed with error " CHIAKI_SOCKET_ERROR_FMT, CHIAKI_SOCKET_ERROR_VALUE);
+			err = CHIAKI_ERR_NETWORK;
+			break;
+		}
+
+		for(size_t i=0; i<fds_count && r > 0 && !race_finished(race); i++)
+		{
+			if(!fds[i].revents)
+				continue;
+			if(!socket_registered(race, fds[i].fd))
+				continue;
+			if(fds[i].revents & POLLNVAL)
+			{
+				CHIAKI_LOGW(race->log, "Candidate race dropping invalid socket");
+				chiaki_candidate_race_remove_socket(race, fds[i].fd);
+				continue;
+			}
+			race->read_cb(race, fds[i].fd, race->cb_user);
+		}
+	}
+
+	free(fds);
+	race->running = false;
+	return err;
+}
+
+static void format_race_time(char *buf, size_t buf_size, uint64_t us)
+{
+	if(us == CHIAKI_CANDIDATE_RACE_NEVER)
+		snprintf(buf, buf_size, "-");
+	else
+		snprintf(buf, buf_size, "%.1f ms", (double)us / 1000.0);
+}
+
+CHIAKI_EXPORT void chiaki_candidate_race_log_timeline(ChiakiCandidateRace *race, ChiakiLogLevel level)
+{
+	for(size_t i=0; i<race->pairs_count; i++)
+	{
+		ChiakiCandidateRacePair *pair = &race->pairs[i];
+		char addr[INET6_ADDRSTRLEN];
+		const char *addr_str = sockaddr_str((struct sockaddr *)&pair->addr, addr, sizeof(addr));
+		uint16_t port = 0;
+		if(pair->addr.ss_family == AF_INET)
+			port = ntohs(((struct sockaddr_in *)&pair->addr)->sin_port);
+		else if(pair->addr.ss_family == AF_INET6)
+			port = ntohs(((struct sockaddr_in6 *)&pair->addr)->sin6_port);
+		char first_probe[32], last_probe[32], first_reply[32], validated[32];
+		format_race_time(first_probe, sizeof(first_probe), pair->first_probe_us);
+		format_race_time(last_probe, sizeof(last_probe), pair->last_probe_us);
+		format_race_time(first_reply, sizeof(first_reply), pair->first_reply_us);
+		format_race_time(validated, sizeof(validated), pair->validated_us);
+		chiaki_log(race->log, level, "Candidate pair %zu %s:%u priority %u: %u probes, first %s, last %s, reply %s, validated %s",
+				i, addr_str ? addr_str : "?", (unsigned int)port, pair->priority, pair->probes,
+				first_probe, last_probe, first_reply, validated);
+	}
+}
@@ -58,6 +58,7 @@
 #include <miniupnpc/upnperrors.h>
 
 #include <chiaki/remote/holepunch.h>
+#include <chiaki/remote/candidaterace.h>
 #include <chiaki/stoppipe.h>
 #include <chiaki/thread.h>
 #include <chiaki/base64.h>
@@ -77,17 +78,19 @@
 #define SESSION_CREATION_TIMEOUT_SEC 30
 #define SESSION_START_TIMEOUT_SEC 30
 #define SESSION_DELETION_TIMEOUT_SEC 3
-#define SELECT_CANDIDATE_TIMEOUT_SEC 0.5F
-#define SELECT_CANDIDATE_TRIES 20
-#define SELECT_CANDIDATE_CONNECTION_SEC 5
+#define CHECK_CANDIDATES_TIMEOUT_MS 10000
+#define CHECK_CANDIDATES_REPLY_TIMEOUT_MS 5000
 #define RANDOM_ALLOCATION_GUESSES_NUMBER 75
 #define RANDOM_ALLOCATION_SOCKS_NUMBER 250
 #define CHECK_CANDIDATES_REQUEST_NUMBER 1
-#define WAIT_RESPONSE_TIMEOUT_SEC 1
+#define WAIT_RESPONSE_TIMEOUT_MS 1000
+#define FOLLOWUP_REQUEST_TIMEOUT_MIN_MS 100
 #define MSG_TYPE_REQ 0x06000000
 #define MSG_TYPE_RESP 0x07000000
 #define EXTRA_CANDIDATE_ADDRESSES 3
 #define ENABLE_IPV6 false
+#define STUN_SERVERS_CACHE_TTL_MS (24 * 60 * 60 * 1000)
+#define STUN_NAT_CACHE_TTL_MS (10 * 60 * 1000)
 
 static const char oauth_header_fmt[] = "Authorization: Bearer %s";
 static const char session_id_header_fmt[] = "X-PSN-SESSION-MANAGER-SESSION-IDS: %s";
@@ -388,8 +391,11 @@ static ChiakiErrorCode upnp_get_gateway_info(ChiakiLog *log, UPNPGatewayInfo *in
 static bool get_client_addr_remote_upnp(ChiakiLog *log, UPNPGatewayInfo *gw_info, char *out);
 static bool upnp_add_udp_port_mapping(ChiakiLog *log, UPNPGatewayInfo *gw_info, uint16_t port_internal, uint16_t port_external);
 static bool upnp_delete_udp_port_mapping(ChiakiLog *log, UPNPGatewayInfo *gw_info, uint16_t port_external);
-static bool get_client_addr_remote_stun(Session *session, char *address, uint16_t *port, chiaki_socket_t *sock, bool ipv4);
+static bool get_client_addr_remote_stun(Session *session, char *address, uint16_t *port, chiaki_socket_t *sock,
+    char *address_ipv6, uint16_t *port_ipv6, chiaki_socket_t *sock_ipv6, bool *have_addr_ipv6);
 static ChiakiErrorCode get_stun_servers(Session *session);
+static bool stun_cache_get_nat(char *address, int32_t *allocation_increment, bool *random_allocation);
+static void stun_cache_put_nat(const char *address, int32_t allocation_increment, bool random_allocation);
 // static bool get_mac_addr(ChiakiLog *log, uint8_t *mac_addr);
 static void log_session_state(Session *session);
 static ChiakiErrorCode decode_customdata1(const char *customdata1, uint8_t *out, size_t out_len);
@@ -427,7 +433,7 @@ static ChiakiErrorCode deleteSession(Session *session);
 static void print_session_request(ChiakiLog *log, ConnectionRequest *req);
 static void print_candidate(ChiakiLog *log, Candidate *candidate);
 static ChiakiErrorCode receive_request_send_response_ps(Session *session, chiaki_socket_t *sock,
-    Candidate *candidate, size_t timeout);
+    Candidate *candidate, uint64_t timeout_ms);
 static ChiakiErrorCode send_response_ps(Session *session, uint8_t *req, chiaki_socket_t *sock,
     Candidate *candidate);
 static ChiakiErrorCode send_responseto_ps(Session *session, uint8_t *req, chiaki_socket_t *sock,
@@ -1592,7 +1598,7 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_holepunch_session_punch_hole(Session* sessi
         goto cleanup_msg;
     }
     chiaki_mutex_unlock(&session->stop_mutex);
-    ChiakiErrorCode pserr = receive_request_send_response_ps(session, &sock, &selected_candidate, WAIT_RESPONSE_TIMEOUT_SEC);
+    ChiakiErrorCode pserr = receive_request_send_response_ps(session, &sock, &selected_candidate, WAIT_RESPONSE_TIMEOUT_MS);
     if(!(pserr == CHIAKI_ERR_SUCCESS || pserr == CHIAKI_ERR_TIMEOUT))
     {
         CHIAKI_LOGE(session->log, "Sending extra request to ps failed");
@@ -2446,7 +2452,13 @@ CHIAKI_EXPORT ChiakiErrorCode holepunch_session_create_offer(Session *session)
         candidate_stun->type = CANDIDATE_TYPE_STUN;
         memcpy(candidate_stun->addr_mapped, "0.0.0.0", 8);
         candidate_stun->port_mapped = 0;
-        have_addr = get_client_addr_remote_stun(session, candidate_stun->addr, &candidate_stun->port, &session->ipv4_sock, true);
+        // Only PS5 supports ipv6, its address is queried alongside the ipv4 one
+        bool query_ipv6 = session->console_type == CHIAKI_HOLEPUNCH_CONSOLE_TYPE_PS5 && ENABLE_IPV6;
+        char addr_ipv6[INET6_ADDRSTRLEN];
+        uint16_t port_ipv6 = 0;
+        bool have_addr_ipv6 = false;
+        have_addr = get_client_addr_remote_stun(session, candidate_stun->addr, &candidate_stun->port, &session->ipv4_sock,
+            query_ipv6 ? addr_ipv6 : NULL, &port_ipv6, &session->ipv6_sock, &have_addr_ipv6);
         if(have_addr)
         {
             memcpy(candidate_remote->addr, candidate_stun->addr, sizeof(candidate_stun->addr));
@@ -2565,15 +2577,16 @@ CHIAKI_EXPORT ChiakiErrorCode holepunch_session_create_offer(Session *session)
             err = CHIAKI_ERR_UNKNOWN;
             goto cleanup;
         }
-        // Only PS5 supports ipv6
-        if(session->console_type == CHIAKI_HOLEPUNCH_CONSOLE_TYPE_PS5 && ENABLE_IPV6)
+        if(query_ipv6)
         {
             Candidate *candidate_stun_ipv6 = &msg.conn_request->candidates[msg.conn_request->num_candidates];
             candidate_stun_ipv6->type = CANDIDATE_TYPE_STUN;
             memcpy(candidate_stun_ipv6->addr_mapped, "0.0.0.0", 8);
             candidate_stun_ipv6->port_mapped = 0;
-            if(get_client_addr_remote_stun(session, candidate_stun_ipv6->addr, &candidate_stun_ipv6->port, &session->ipv6_sock, false))
+            if(have_addr_ipv6)
             {
+                memcpy(candidate_stun_ipv6->addr, addr_ipv6, sizeof(addr_ipv6));
+                candidate_stun_ipv6->port = port_ipv6;
                 if (setsockopt(session->ipv6_sock, SOL_SOCKET, SO_RCVTIMEO, (const CHIAKI_SOCKET_BUF_TYPE)&timeout, sizeof(timeout)) < 0)
                 {
                     CHIAKI_LOGE(session->log, "holepunch_session_create_offer: Failed to unset socket timeout, error was " CHIAKI_SOCKET_ERROR_FMT, CHIAKI_SOCKET_ERROR_VALUE);
@@ -3488,42 +3501,121 @@ static bool upnp_delete_udp_port_mapping(ChiakiLog *log, UPNPGatewayInfo *gw_inf
 /**
  * Retrieves the external IP address (i.e. internet-visible) of the client using STUN.
  *
- * @param log The ChiakiLog instance for logging.
- * @return The external IP address of the client, or NULL if the IP address could not be retrieved. Needs to be freed by the caller.
+ * The IPv4 and IPv6 addresses are queried at the same time. The first time in a session the port allocation of the NAT
+ * is measured too, unless it was measured before within STUN_NAT_CACHE_TTL_MS and the external address is still the same.
+ *
+ * @param session The holepunch session
+ * @param[out] address Buffer for the IPv4 address
+ * @param[out] port Buffer for the IPv4 port
+ * @param sock Socket to query the IPv4 address for, closed and set to invalid if it can't be sent on
+ * @param[out] address_ipv6 Buffer for the IPv6 address or NULL to skip IPv6
+ * @param[out] port_ipv6 Buffer for the IPv6 port
+ * @param sock_ipv6 Socket to query the IPv6 address for, closed and set to invalid if it can't be sent on
+ * @param[out] have_addr_ipv6 Whether the IPv6 address could be retrieved
+ * @return Whether the IPv4 address could be retrieved
 */
-static bool get_client_addr_remote_stun(Session *session, char *address, uint16_t *port, chiaki_socket_t *sock, bool ipv4)
+static bool get_client_addr_remote_stun(Session *session, char *address, uint16_t *port, chiaki_socket_t *sock,
+    char *address_ipv6, uint16_t *port_ipv6, chiaki_socket_t *sock_ipv6, bool *have_addr_ipv6)
 {
+    *have_addr_ipv6 = false;
+    bool nat_cached = false;
+    char nat_cached_addr[INET6_ADDRSTRLEN];
+    int32_t nat_cached_increment = 0;
+    bool nat_cached_random = false;
     // run STUN test if it hasn't been run yet
-    if(session->stun_allocation_increment == -1)
+    bool allocation_test = session->stun_allocation_increment == -1;
+    if(allocation_test)
     {
         ChiakiErrorCode err = get_stun_servers(session);
         if(err != CHIAKI_ERR_SUCCESS)
         {
             CHIAKI_LOGW(session->log, "Getting stun servers returned error %s", chiaki_error_string(err));
         }
-        if (!stun_port_allocation_test(session->log, address, port, &session->stun_allocation_increment, &session->stun_random_allocation, session->stun_server_list, session->num_stun_servers, sock))
-        {
-            CHIAKI_LOGE(session->log, "get_client_addr_remote_stun: Failed to get external address");
-            return false;
-        }
-        return true;
+        nat_cached = stun_cache_get_nat(nat_cached_addr, &nat_cached_increment, &nat_cached_random);
     }
-    if(ipv4)
+
+    StunServer servers[sizeof(session->stun_server_list) / sizeof(StunServer) + STUN_SERVERS_COUNT];
+    StunServer servers_ipv6[sizeof(session->stun_server_list_ipv6) / sizeof(StunServer) + STUN_SERVERS_COUNT];
+    ChiakiStunQuery queries[2];
+    size_t num_queries = 0;
+    ChiakiStunQuery *query = &queries[num_queries++];
+    stun_query_prepare(query, servers, session->stun_server_list, session->num_stun_servers, *sock, true,
+        allocation_test && !nat_cached ? STUN_ALLOCATION_TEST_MAPPINGS : 1);
+    // The port is the base for guessing the next allocations, every server asked at once would get a mapping
+    // of its own and leave the first answer behind the latest one
+    if(query->mappings_wanted == 1 && (nat_cached ? nat_cached_increment : session->stun_allocation_increment) != 0)
+        query->batch = 1;
+    ChiakiStunQuery *query_ipv6 = NULL;
+    if(address_ipv6 && !CHIAKI_SOCKET_IS_INVALID(*sock_ipv6))
     {
-        if (!stun_get_external_address(session->log, address, port, session->stun_server_list, session->num_stun_servers, sock, ipv4))
+        query_ipv6 = &queries[num_queries++];
+        stun_query_prepare(query_ipv6, servers_ipv6, session->stun_server_list_ipv6, session->num_stun_servers_ipv6, *sock_ipv6, false, 1);
+    }
+    chiaki_stun_query_run(session->log, queries, num_queries, STUN_QUERY_TIMEOUT_MS);
+
+    if(query_ipv6)
+    {
+        if(query_ipv6->sock_failed)
         {
-            CHIAKI_LOGE(session->log, "get_client_addr_remote_stun: Failed to get external address");
-            return false;
+            CHIAKI_SOCKET_CLOSE(*sock_ipv6);
+            *sock_ipv6 = CHIAKI_INVALID_SOCKET;
         }
+        else if(query_ipv6->mappings_count > 0)
+        {
+            memcpy(address_ipv6, query_ipv6->mappings[0].addr, sizeof(query_ipv6->mappings[0].addr));
+            *port_ipv6 = query_ipv6->mappings[0].port;
+            *have_addr_ipv6 = true;
+        }
+        else
+            CHIAKI_LOGW(session->log, "get_client_addr_remote_stun: Failed to get external IPV6 address");
     }
-    else
+
+    if(query->sock_failed)
+    {
+        CHIAKI_SOCKET_CLOSE(*sock);
+        *sock = CHIAKI_INVALID_SOCKET;
+    }
+    if(query->mappings_count == 0)
+    {
+        CHIAKI_LOGE(session->log, "get_client_addr_remote_stun: Failed to get external address");
+        return false;
+    }
+    if(query->mappings_wanted == 1)
     {
-        if (!stun_get_external_address(session->log, address, port, session->stun_server_list_ipv6, session->num_stun_servers_ipv6, sock, ipv4))
+        memcpy(address, query->mappings[0].addr, sizeof(query->mappings[0].addr));
+        *port = query->mappings[0].port;
+        if(!allocation_test)
+            return true;
+        if(strcmp(address, nat_cached_addr) == 0)
+        {
+            CHIAKI_LOGI(session->log, "get_client_addr_remote_stun: Reusing port allocation measured before for %s, increment %d%s",
+                address, nat_cached_increment, nat_cached_random ? ", random" : "");
+            session->stun_allocation_increment = nat_cached_increment;
+            session->stun_random_allocation = nat_cached_random;
+            return true;
+        }
+        // Different network than the one measured before
+        CHIAKI_LOGI(session->log, "get_client_addr_remote_stun: External address changed from %s to %s, measuring port allocation", nat_cached_addr, address);
+        stun_query_prepare(query, servers, session->stun_server_list, session->num_stun_servers, *sock, true, STUN_ALLOCATION_TEST_MAPPINGS);
+        chiaki_stun_query_run(session->log, query, 1, STUN_QUERY_TIMEOUT_MS);
+        if(query->sock_failed)
         {
-            CHIAKI_LOGE(session->log, "get_client_addr_remote_stun: Failed to get external address");
-            return false;
+            CHIAKI_SOCKET_CLOSE(*sock);
+            *sock = CHIAKI_INVALID_SOCKET;
         }
     }
+    int32_t allocation_increment = 0;
+    bool random_allocation = false;
+    if (!stun_port_allocation_evaluate(session->log, query, address, port, &allocation_increment, &random_allocation))
+    {
+        CHIAKI_LOGE(session->log, "get_client_addr_remote_stun: Failed to get external address");
+        return false;
+    }
+    session->stun_allocation_increment = allocation_increment;
+    session->stun_random_allocation = random_allocation;
+    // A single answer says nothing about the allocation
+    if(query->mappings_count >= 2)
+        stun_cache_put_nat(address, allocation_increment, random_allocation);
     return true;
 }
 
@@ -3577,6 +3669,255 @@ static bool get_client_addr_remote_stun(Session *session, char *address, uint16_
 //     return true;
 // }
 
+typedef struct candidate_check_t
+{
+    Candidate candidate;
+    int responses_received;
+    size_t pair; // in the candidate race, CHIAKI_CANDIDATE_RACE_NONE if not probed
+} CandidateCheck;
+
+typedef struct check_candidates_ctx_t
+{
+    Session *session;
+    uint8_t (*request_buf)[88];
+    uint8_t (*request_id)[5];
+    CandidateCheck *checks;
+    size_t checks_count;
+    size_t extra_addresses_used;
+    chiaki_socket_t *socks; // random allocation sockets or NULL
+    bool responded;
+} CheckCandidatesCtx;
+
+/**
+ * Order in which the candidate types are probed, local candidates first since they need no NAT traversal,
+ * then the port mapped via UPnP, STUN and finally peer-reflexive ones learned during the check.
+ */
+static unsigned int candidate_priority(CandidateType type)
+{
+    switch(type)
+    {
+        case CANDIDATE_TYPE_LOCAL:
+            return 0;
+        case CANDIDATE_TYPE_STATIC:
+            return 1;
+        case CANDIDATE_TYPE_STUN:
+            return 2;
+        default:
+            return 3;
+    }
+}
+
+static void check_candidates_probe(ChiakiCandidateRace *race, size_t pair_index, void *user)
+{
+    CheckCandidatesCtx *ctx = user;
+    Session *session = ctx->session;
+    ChiakiCandidateRacePair *pair = &race->pairs[pair_index];
+    CandidateCheck *check = pair->user;
+    Candidate *candidate = &check->candidate;
+    uint8_t *request = ctx->request_buf[check->responses_received];
+
+    if(pair->probes > 0)
+        CHIAKI_LOGV(session->log, "check_candidates: Resending request to %s:%d TRY %u", candidate->addr, candidate->port, pair->probes);
+    if (sendto(pair->sock, (CHIAKI_SOCKET_BUF_TYPE) request, 88, 0, (struct sockaddr *)&pair->addr, pair->addr_len) < 0)
+    {
+        CHIAKI_LOGW(session->log, "check_candidates: Sending request failed for %s:%d with error: " CHIAKI_SOCKET_ERROR_FMT, candidate->addr, candidate->port, CHIAKI_SOCKET_ERROR_VALUE);
+        return;
+    }
+
+    // Punch holes from the random allocation sockets once, the replies are waited for on all of them
+    if(!ctx->socks || pair->probes > 0 || pair->addr.ss_family != AF_INET)
+        return;
+    if(candidate->type != CANDIDATE_TYPE_STATIC && candidate->type != CANDIDATE_TYPE_STUN)
+        return;
+    for (int j=0; j<RANDOM_ALLOCATION_SOCKS_NUMBER; j++)
+    {
+        if(CHIAKI_SOCKET_IS_INVALID(ctx->socks[j]))
+            continue;
+        if (sendto(ctx->socks[j], (CHIAKI_SOCKET_BUF_TYPE) request, 88, 0, (struct sockaddr *)&pair->addr, pair->addr_len) < 0)
+        {
+            CHIAKI_LOGW(session->log, "check_candidates: Sending request for socket %d failed for %s:%d with error, closing socket: " CHIAKI_SOCKET_ERROR_FMT, j, candidate->addr, candidate->port, CHIAKI_SOCKET_ERROR_VALUE);
+            chiaki_candidate_race_remove_socket(race, ctx->socks[j]);
+            CHIAKI_SOCKET_CLOSE(ctx->socks[j]);
+            ctx->socks[j] = CHIAKI_INVALID_SOCKET;
+        }
+    }
+}
+
+static void check_candidates_read(ChiakiCandidateRace *race, chiaki_socket_t candidate_sock, void *user)
+{
+    CheckCandidatesCtx *ctx = user;
+    Session *session = ctx->session;
+    uint8_t response_buf[88];
+    ChiakiErrorCode err;
+
+    socklen_t recv_len = candidate_sock == session->ipv6_sock ? sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in);
+    if(candidate_sock != session->ipv4_sock && candidate_sock != session->ipv6_sock)
+    {
+        // random allocation socket, the hole is punched now
+#ifdef _WIN32
+        DWORD ttl = 64;
+#else
+        int ttl = 64;
+#endif
+        if (setsockopt(candidate_sock, IPPROTO_IP, IP_TTL, (const CHIAKI_SOCKET_BUF_TYPE)&ttl, sizeof(ttl)) < 0)
+        {
+            CHIAKI_LOGE(session->log, "setsockopt(IP_TTL) failed with error" CHIAKI_SOCKET_ERROR_FMT, CHIAKI_SOCKET_ERROR_VALUE);
+            chiaki_candidate_race_abort(race, CHIAKI_ERR_UNKNOWN);
+            return;
+        }
+    }
+
+    struct sockaddr_storage recv_storage;
+    struct sockaddr *recv_address = (struct sockaddr *)&recv_storage;
+    char recv_address_string[INET6_ADDRSTRLEN];
+    uint16_t recv_address_port = 0;
+    CHIAKI_SSIZET_TYPE response_len = recvfrom(candidate_sock, (CHIAKI_SOCKET_BUF_TYPE) response_buf, sizeof(response_buf), 0, recv_address, &recv_len);
+    if (response_len < 0)
+    {
+        CHIAKI_LOGE(session->log, "check_candidates: Receiving response failed with error: " CHIAKI_SOCKET_ERROR_FMT, CHIAKI_SOCKET_ERROR_VALUE);
+        return;
+    }
+    if(recv_address->sa_family == AF_INET)
+    {
+        if (!inet_ntop(AF_INET, &(((struct sockaddr_in *)recv_address)->sin_addr), recv_address_string, sizeof(recv_address_string)))
+        {
+            CHIAKI_LOGE(session->log, "check_candidates: Couldn't retrieve address from recv address!");
+            return;
+        }
+        recv_address_port = ntohs(((struct sockaddr_in *)recv_address)->sin_port);
+    }
+    else if (recv_address->sa_family == AF_INET6)
+    {
+        if (!inet_ntop(AF_INET6, &(((struct sockaddr_in6 *)recv_address)->sin6_addr), recv_address_string, sizeof(recv_address_string)))
+        {
+            CHIAKI_LOGE(session->log, "check_candidates: Couldn't retrieve address from recv address!");
+            return;
+        }
+        recv_address_port = ntohs(((struct sockaddr_in6 *)recv_address)->sin6_port);
+    }
+    else
+    {
+        CHIAKI_LOGE(session->log, "check_candidates: Got an address with an unsupported address family %d, skipping ...", recv_address->sa_family);
+        return;
+    }
+
+    CandidateCheck *check = NULL;
+    for (size_t i=0; i < ctx->checks_count; i++)
+    {
+        Candidate *c = &ctx->checks[i].candidate;
+        if((strcmp(c->addr, recv_address_string) == 0) && (c->port == recv_address_port))
+        {
+            check = &ctx->checks[i];
+            break;
+        }
+    }
+    if(!check)
+    {
+        // e.g. a late STUN response, which must not take the place of a candidate
+        if (response_len != sizeof(response_buf))
+        {
+            CHIAKI_LOGV(session->log, "check_candidates: Ignoring %zd bytes from unknown address %s:%d", response_len, recv_address_string, recv_address_port);
+            return;
+        }
+        if(ctx->extra_addresses_used >= EXTRA_CANDIDATE_ADDRESSES)
+        {
+            CHIAKI_LOGI(session->log, "check_candidates: Received more than %d extra candidates skipping this one", EXTRA_CANDIDATE_ADDRESSES);
+            return;
+        }
+        check = &ctx->checks[ctx->checks_count];
+        memset(check, 0, sizeof(*check));
+        check->pair = CHIAKI_CANDIDATE_RACE_NONE;
+        Candidate *candidate = &check->candidate;
+        memcpy(candidate->addr, recv_address_string, sizeof(recv_address_string));
+        candidate->port = recv_address_port;
+        candidate->port_mapped = 0;
+        candidate->type = CANDIDATE_TYPE_DERIVED;
+        if(recv_address->sa_family == AF_INET)
+            memcpy(candidate->addr_mapped, "0.0.0.0", 8);
+        else
+            memcpy(candidate->addr_mapped, "0:0:0:0:0:0:0:0", 16);
+        ctx->checks_count++;
+        ctx->extra_addresses_used++;
+        CHIAKI_LOGI(session->log, "check_candidates: Received new candidate at %s:%d", candidate->addr, candidate->port);
+    }
+    Candidate *candidate = &check->candidate;
+    if(check->pair == CHIAKI_CANDIDATE_RACE_NONE)
+    {
+        err = chiaki_candidate_race_add_pair(race, candidate_sock, recv_address, recv_len,
+                candidate_priority(candidate->type), check, &check->pair);
+        if(err != CHIAKI_ERR_SUCCESS)
+        {
+            chiaki_candidate_race_abort(race, err);
+            return;
+        }
+    }
+    ChiakiCandidateRacePair *pair = &race->pairs[check->pair];
+
+    CHIAKI_LOGV(session->log, "check_candidates: Received data from %s:%d", candidate->addr, candidate->port);
+    if (response_len != sizeof(response_buf))
+    {
+        if(candidate->type == CANDIDATE_TYPE_DERIVED)
+            return;
+        CHIAKI_LOGE(session->log, "check_candidates: Received response of unexpected size %zd from %s:%d", response_len, candidate->addr, candidate->port);
+        chiaki_candidate_race_abort(race, CHIAKI_ERR_NETWORK);
+        return;
+    }
+    uint32_t msg_type = ntohl(*((uint32_t*)(response_buf)));
+    if (msg_type == MSG_TYPE_REQ)
+    {
+        CHIAKI_LOGI(session->log, "Responding to request");
+        ctx->responded = true;
+        chiaki_candidate_race_replied(race, check->pair);
+        err = send_responseto_ps(session, response_buf, &candidate_sock, candidate, (struct sockaddr *)&pair->addr, pair->addr_len);
+        if(err != CHIAKI_ERR_SUCCESS && candidate->type != CANDIDATE_TYPE_DERIVED)
+        {
+            chiaki_candidate_race_abort(race, err);
+            return;
+        }
+        if((ctx->socks || candidate->type == CANDIDATE_TYPE_DERIVED) && check->responses_received == 0)
+        {
+            if (sendto(candidate_sock, (CHIAKI_SOCKET_BUF_TYPE) ctx->request_buf[0], sizeof(ctx->request_buf[0]), 0, (struct sockaddr *)&pair->addr, pair->addr_len) < 0)
+            {
+                CHIAKI_LOGE(session->log, "check_candidates: Sending request failed for %s:%d with error: " CHIAKI_SOCKET_ERROR_FMT, candidate->addr, candidate->port, CHIAKI_SOCKET_ERROR_VALUE);
+                chiaki_candidate_race_abort(race, CHIAKI_ERR_NETWORK);
+            }
+        }
+        return;
+    }
+    if (msg_type != MSG_TYPE_RESP)
+    {
+        CHIAKI_LOGE(session->log, "check_candidates: Received response of unexpected type %"PRIu32" from %s:%d", msg_type, candidate->addr, candidate->port);
+        chiaki_log_hexdump(session->log, CHIAKI_LOG_ERROR, response_buf, 88);
+        if(candidate->type != CANDIDATE_TYPE_DERIVED)
+            chiaki_candidate_race_abort(race, CHIAKI_ERR_UNKNOWN);
+        return;
+    }
+    // TODO: More validation of localHashedIds, sids and the weird data at 0x4b?
+    int responses = check->responses_received;
+    if(memcmp(response_buf + 0x4b, ctx->request_id[responses], sizeof(ctx->request_id[responses])) != 0)
+    {
+        CHIAKI_LOGE(session->log, "check_candidates: Received response with unexpected request ID from %s:%d", candidate->addr, candidate->port);
+        CHIAKI_LOGE(session->log, "check_candidates: Request ID expected:");
+        chiaki_log_hexdump(session->log, CHIAKI_LOG_ERROR, ctx->request_id[responses], 5);
+        CHIAKI_LOGE(session->log, "check_candidates: Request ID received:");
+        chiaki_log_hexdump(session->log, CHIAKI_LOG_ERROR, response_buf + 0x4b, 5);
+        CHIAKI_LOGE(session->log, "check_candidates: Full response received:");
+        chiaki_log_hexdump(session->log, CHIAKI_LOG_ERROR, response_buf, 88);
+        return;
+    }
+    chiaki_candidate_race_replied(race, check->pair);
+    check->responses_received++;
+    responses = check->responses_received;
+    CHIAKI_LOGV(session->log, "Received response %d", responses);
+    if(responses > (CHECK_CANDIDATES_REQUEST_NUMBER - 1))
+    {
+        chiaki_candidate_race_validated(race, check->pair, candidate_sock);
+        return;
+    }
+    if (sendto(candidate_sock, (CHIAKI_SOCKET_BUF_TYPE) ctx->request_buf[responses], sizeof(ctx->request_buf[responses]), 0, (struct sockaddr *)&pair->addr, pair->addr_len) < 0)
+        CHIAKI_LOGE(session->log, "check_candidates: Sending request failed for %s:%d with error: " CHIAKI_SOCKET_ERROR_FMT, candidate->addr, candidate->port, CHIAKI_SOCKET_ERROR_VALUE);
+}
+
 /**
  * Linking to a responsive PlayStation candidate from the available console candidates
  *
@@ -3611,20 +3952,10 @@ static ChiakiErrorCode check_candidates(
     Candidate *local_candidate = &local_candidates[0];
     Candidate *remote_candidate = &local_candidates[1];
 
-    size_t extra_addresses_used = 0;
-    // Set up addresses for each candidate + extras (use sockaddr_storage and cast bc needs to be at least that big if we get ipv6)
-    struct sockaddr_storage addrs[num_candidates + EXTRA_CANDIDATE_ADDRESSES];
-    socklen_t lens[num_candidates + EXTRA_CANDIDATE_ADDRESSES];
-    Candidate candidates[num_candidates + EXTRA_CANDIDATE_ADDRESSES];
-    memcpy(candidates, candidates_received, num_candidates * sizeof(Candidate));
-    int responses_received[num_candidates + EXTRA_CANDIDATE_ADDRESSES];
-    fd_set fds;
-    FD_ZERO(&fds);
-    if(!CHIAKI_SOCKET_IS_INVALID(session->ipv4_sock))
-        FD_SET(session->ipv4_sock, &fds);
-    if(!CHIAKI_SOCKET_IS_INVALID(session->ipv6_sock))
-        FD_SET(session->ipv6_sock, &fds);
-    bool failed = true;
+    // Each candidate + extras learned from the addresses responses come from
+    CandidateCheck checks[num_candidates + EXTRA_CANDIDATE_ADDRESSES];
+    for (size_t i=0; i < num_candidates; i++)
+        checks[i].candidate = candidates_received[i];
     char service_remote[6];
     struct addrinfo hints;
     memset(&hints, 0, sizeof(hints));
@@ -3712,10 +4043,27 @@ static ChiakiErrorCode check_candidates(
             }
         }
     }
+    CheckCandidatesCtx ctx;
+    ctx.session = session;
+    ctx.request_buf = request_buf;
+    ctx.request_id = request_id;
+    ctx.checks = checks;
+    ctx.checks_count = num_candidates;
+    ctx.extra_addresses_used = 0;
+    ctx.socks = session->stun_random_allocation ? socks : NULL;
+    ctx.responded = false;
+
+    ChiakiCandidateRace race;
+    chiaki_candidate_race_init(&race, session->log, check_candidates_probe, check_candidates_read, &ctx);
+    race.timeout_ms = CHECK_CANDIDATES_TIMEOUT_MS;
+    race.reply_timeout_ms = CHECK_CANDIDATES_REPLY_TIMEOUT_MS;
+
     for (int i=0; i < num_candidates; i++)
     {
-        Candidate *candidate = &candidates[i];
-        responses_received[i] = 0;
+        CandidateCheck *check = &checks[i];
+        Candidate *candidate = &check->candidate;
+        check->responses_received = 0;
+        check->pair = CHIAKI_CANDIDATE_RACE_NONE;
 
         sprintf(service_remote, "%d", candidate->port);
 
@@ -3725,388 +4073,79 @@ static ChiakiErrorCode check_candidates(
             err = CHIAKI_ERR_UNKNOWN;
             continue;
         }
-        memcpy((struct sockaddr *)&addrs[i], addr_remote->ai_addr, addr_remote->ai_addrlen);
-        lens[i] = addr_remote->ai_addrlen;
-        bool sent = false;
-        switch(((struct sockaddr *)&addrs[i])->sa_family)
+        chiaki_socket_t sock = CHIAKI_INVALID_SOCKET;
+        switch(addr_remote->ai_family)
         {
             case AF_INET:
-                if(!CHIAKI_SOCKET_IS_INVALID(session->ipv4_sock))
-                {
-                    if (sendto(session->ipv4_sock, (CHIAKI_SOCKET_BUF_TYPE) request_buf[0], sizeof(request_buf[0]), 0, (struct sockaddr *)&addrs[i], lens[i]) < 0)
-                    {
-                        CHIAKI_LOGW(session->log, "check_candidates: Sending request failed for %s:%d with error: " CHIAKI_SOCKET_ERROR_FMT, candidate->addr, candidate->port, CHIAKI_SOCKET_ERROR_VALUE);
-                        err = CHIAKI_ERR_NETWORK;
-                        freeaddrinfo(addr_remote);
-                        continue;
-                    }
-                }
-                if(session->stun_random_allocation && ((candidate->type == CANDIDATE_TYPE_STATIC && !sent) || candidate->type == CANDIDATE_TYPE_STUN))
-                {
-                    for (int j=0; j<RANDOM_ALLOCATION_SOCKS_NUMBER; j++)
-                    {
-                        if(CHIAKI_SOCKET_IS_INVALID(socks[j]))
-                            continue;
-                        if (sendto(socks[j], (CHIAKI_SOCKET_BUF_TYPE) request_buf[0], sizeof(request_buf[0]), 0, (struct sockaddr *)&addrs[i], lens[i]) < 0)
-                        {
-                            CHIAKI_LOGW(session->log, "check_candidates: Sending request for socket %d failed for %s:%d with error, closing socket: " CHIAKI_SOCKET_ERROR_FMT, j, candidate->addr, candidate->port, CHIAKI_SOCKET_ERROR_VALUE);
-                            if (!CHIAKI_SOCKET_IS_INVALID(socks[j]))
-                            {
-                                CHIAKI_SOCKET_CLOSE(socks[j]);
-                                socks[j] = CHIAKI_INVALID_SOCKET;
-                            }
-                            continue;
-                        }
-                        sent = true;
-                    }
-                }
+                sock = session->ipv4_sock;
                 break;
             case AF_INET6:
-                if(!CHIAKI_SOCKET_IS_INVALID(session->ipv6_sock))
-                {
-                    if (sendto(session->ipv6_sock, (CHIAKI_SOCKET_BUF_TYPE) request_buf[0], sizeof(request_buf[0]), 0, (struct sockaddr *)&addrs[i], lens[i]) < 0)
-                    {
-                        CHIAKI_LOGW(session->log, "check_candidates: Sending request failed for %s:%d with error: " CHIAKI_SOCKET_ERROR_FMT, candidate->addr, candidate->port, CHIAKI_SOCKET_ERROR_VALUE);
-                        err = CHIAKI_ERR_NETWORK;
-                        freeaddrinfo(addr_remote);
-                        continue;
-                    }
-                }
+                sock = session->ipv6_sock;
                 break;
             default:
                 CHIAKI_LOGW(session->log, "Unsupported address family, skipping...");
+                break;
         }
-        failed = false;
+        if(CHIAKI_SOCKET_IS_INVALID(sock))
+        {
+            freeaddrinfo(addr_remote);
+            continue;
+        }
+        err = chiaki_candidate_race_add_pair(&race, sock, addr_remote->ai_addr, addr_remote->ai_addrlen,
+                candidate_priority(candidate->type), check, &check->pair);
         freeaddrinfo(addr_remote);
+        if(err != CHIAKI_ERR_SUCCESS)
+            goto cleanup_race;
     }
-    if(failed)
+    if(race.pairs_count == 0)
     {
         err = CHIAKI_ERR_NETWORK;
-        goto cleanup_sockets;
+        goto cleanup_race;
     }
-
-    // Wait for responses
-    uint8_t response_buf[88];
-
-    chiaki_socket_t maxfd = -1;
-    if(!CHIAKI_SOCKET_IS_INVALID(session->ipv4_sock))
-        maxfd = session->ipv4_sock;
-    if(session->ipv6_sock > maxfd)
-        maxfd = session->ipv6_sock;
-    if(session->stun_random_allocation)
+    if(ctx.socks)
     {
         for(int i=0; i<RANDOM_ALLOCATION_SOCKS_NUMBER; i++)
         {
-            if(socks[i] > maxfd)
-                maxfd = socks[i];
-            FD_SET(socks[i], &fds);
+            if(CHIAKI_SOCKET_IS_INVALID(socks[i]))
+                continue;
+            err = chiaki_candidate_race_add_socket(&race, socks[i]);
+            if(err != CHIAKI_ERR_SUCCESS)
+                goto cleanup_race;
         }
     }
-    maxfd = maxfd + 1;
-
-    struct timeval tv;
-    tv.tv_sec = 0;
-    tv.tv_usec = SELECT_CANDIDATE_TIMEOUT_SEC * SECOND_US;
-
-    chiaki_socket_t selected_sock = CHIAKI_INVALID_SOCKET;
-    Candidate *selected_candidate = NULL;
-    bool received_response = false;
-    bool responded = false;
-    bool connecting = false;
-    int retry_counter = 0;
 
-    while (!selected_candidate)
+    // Probe the candidates best first, staggered by priority, until one of them answers
+    err = chiaki_candidate_race_run(&race);
+    chiaki_candidate_race_log_timeline(&race, err == CHIAKI_ERR_SUCCESS ? CHIAKI_LOG_VERBOSE : CHIAKI_LOG_INFO);
+    if(err != CHIAKI_ERR_SUCCESS)
     {
-        int ret = select(maxfd, &fds, NULL, NULL, &tv);
-#ifdef _WIN32
-	    if (ret < 0 && WSAGetLastError() != WSAEINTR)
-#else
-	    if (ret < 0 && errno != EINTR)
-#endif
-        {
-            CHIAKI_LOGE(session->log, "check_candidates: Select failed with error: " CHIAKI_SOCKET_ERROR_FMT, CHIAKI_SOCKET_ERROR_VALUE);
-            err = CHIAKI_ERR_NETWORK;
-            goto cleanup_sockets;
-        } else if (ret == 0)
-        {
-            if (CHIAKI_SOCKET_IS_INVALID(selected_sock))
-            {
-                if(retry_counter < SELECT_CANDIDATE_TRIES && !received_response)
-                {
-                    retry_counter++;
-                    tv.tv_sec = 0;
-                    tv.tv_usec = SELECT_CANDIDATE_TIMEOUT_SEC * SECOND_US;
-                    FD_ZERO(&fds);
-                    if(!CHIAKI_SOCKET_IS_INVALID(session->ipv4_sock))
-                        FD_SET(session->ipv4_sock, &fds);
-                    if(!CHIAKI_SOCKET_IS_INVALID(session->ipv6_sock))
-                        FD_SET(session->ipv6_sock, &fds);
-                    Candidate *candidate = NULL;
-                    chiaki_socket_t sock = CHIAKI_INVALID_SOCKET;
-                    CHIAKI_LOGI(session->log, "check_candidates: Resending requests to all candidates TRY %d... waiting for 1st response", retry_counter);
-                    for (int i=0; i < num_candidates + extra_addresses_used; i++)
-                    {
-                        if(((struct sockaddr *)&addrs[i])->sa_family == AF_INET)
-                            sock = session->ipv4_sock;
-                        else if(((struct sockaddr *)&addrs[i])->sa_family == AF_INET6)
-                            sock = session->ipv6_sock;
-                        else
-                        {
-                            CHIAKI_LOGE(session->log, "check_candidates: Got an address with an unsupported address family %d, skipping ...", ((struct sockaddr *)&addrs[i])->sa_family);
-                            continue;
-                        }
-                        if(CHIAKI_SOCKET_IS_INVALID(sock))
-                            continue;
-                        candidate = &candidates[i];
-                        if (sendto(sock, (CHIAKI_SOCKET_BUF_TYPE) request_buf[0], sizeof(request_buf[0]), 0, (struct sockaddr *)&addrs[i], lens[i]) < 0)
-                        {
-                            CHIAKI_LOGE(session->log, "check_candidates: Sending request failed for %s:%d with error: " CHIAKI_SOCKET_ERROR_FMT, candidate->addr, candidate->port, CHIAKI_SOCKET_ERROR_VALUE);
-                            continue;
-                        }
-                        if(session->stun_random_allocation && (candidate->type == CANDIDATE_TYPE_STATIC || candidate->type == CANDIDATE_TYPE_STUN))
-                        {
-                            for(int j=0; j<RANDOM_ALLOCATION_SOCKS_NUMBER; j++)
-                            {
-                                if(!CHIAKI_SOCKET_IS_INVALID(socks[j]))
-                                    FD_SET(socks[j], &fds);
-                            }
-                        }
-                    }
-                    continue;                    
-                }
-                else if(received_response && !connecting)
-                {
-                    connecting = true;
-                    tv.tv_sec = SELECT_CANDIDATE_CONNECTION_SEC;
-                    tv.tv_usec = 0;
-                    continue;
-                }
-                // No responsive candidate within timeout, terminate with error
-                CHIAKI_LOGE(session->log, "check_candidates: Select timed out");
-                err = CHIAKI_ERR_HOST_UNREACH;
-                goto cleanup_sockets;
-            }
-            // Otherwise, we have a responsive candidate, break out of loop
-            break;
-        }
-
-        Candidate *candidate = NULL;
-        chiaki_socket_t candidate_sock = CHIAKI_INVALID_SOCKET;
-        socklen_t recv_len;
-        if (!(CHIAKI_SOCKET_IS_INVALID(session->ipv4_sock)) && FD_ISSET(session->ipv4_sock, &fds))
-        {
-            candidate_sock = session->ipv4_sock;
-            recv_len = sizeof(struct sockaddr_in);
-        }
-        else if (!(CHIAKI_SOCKET_IS_INVALID(session->ipv6_sock)) && FD_ISSET(session->ipv6_sock, &fds))
-        {
-            candidate_sock = session->ipv6_sock;
-            recv_len = sizeof(struct sockaddr_in6);
-        }
-        else
-        {
-            for(int j=0; j<RANDOM_ALLOCATION_SOCKS_NUMBER; j++)
-            {
-                if(!(CHIAKI_SOCKET_IS_INVALID(socks[j])) && FD_ISSET(socks[j], &fds))
-                {
-                    candidate_sock = socks[j];
-                    recv_len = sizeof(struct sockaddr_in);
-#ifdef _WIN32
-                    DWORD ttl = 64;
-#else
-                    int ttl = 64;
-#endif
-                    if (setsockopt(socks[j], IPPROTO_IP, IP_TTL, (const CHIAKI_SOCKET_BUF_TYPE)&ttl, sizeof(ttl)) < 0)
-                    {
-                        CHIAKI_LOGE(session->log, "setsockopt(IP_TTL) failed with error" CHIAKI_SOCKET_ERROR_FMT, CHIAKI_SOCKET_ERROR_VALUE);
-                        if (!CHIAKI_SOCKET_IS_INVALID(socks[j]))
-                        {
-                            CHIAKI_SOCKET_CLOSE(socks[j]);
-                            socks[j] = CHIAKI_INVALID_SOCKET;
-                        }
-                        err = CHIAKI_ERR_UNKNOWN;
-                        goto cleanup_sockets;
-                    }
-                    break;
-                }
-            }
-        }
-        if(CHIAKI_SOCKET_IS_INVALID(candidate_sock))
-        {
-            CHIAKI_LOGE(session->log, "check_candidates: Select returned an invalid socket!");
-            err = CHIAKI_ERR_UNKNOWN;
-            goto cleanup_sockets;
-        }
-
-        struct sockaddr* recv_address;
-        // allocate up to sockaddr in6 since that's what may be needed
-        recv_address = malloc(sizeof(struct sockaddr_in6));
-        if(!recv_address)
-        {
-            err = CHIAKI_ERR_MEMORY;
-            goto cleanup_sockets;
-        }
-        char recv_address_string[INET6_ADDRSTRLEN];
-        uint16_t recv_address_port = 0;
-        int i = 0;
-        CHIAKI_SSIZET_TYPE response_len = recvfrom(candidate_sock, (CHIAKI_SOCKET_BUF_TYPE) response_buf, sizeof(response_buf), 0, recv_address, &recv_len);
-        if (response_len < 0)
-        {
-            CHIAKI_LOGE(session->log, "check_candidates: Receiving response failed with error: " CHIAKI_SOCKET_ERROR_FMT, CHIAKI_SOCKET_ERROR_VALUE);
-            free(recv_address);
-            continue;
-        }
-        if(recv_address->sa_family == AF_INET)
-        {
-            if (!inet_ntop(AF_INET, &(((struct sockaddr_in *)recv_address)->sin_addr), recv_address_string, sizeof(recv_address_string)))
-            {
-                CHIAKI_LOGE(session->log, "check_candidates: Couldn't retrieve address from recv address!");
-                free(recv_address);
-                continue;
-            }
-            recv_address_port = ntohs(((struct sockaddr_in *)recv_address)->sin_port);
-        }
-        else if (recv_address->sa_family == AF_INET6)
-        {
-            if (!inet_ntop(AF_INET6, &(((struct sockaddr_in6 *)recv_address)->sin6_addr), recv_address_string, sizeof(recv_address_string)))
-            {
-                CHIAKI_LOGE(session->log, "check_candidates: Couldn't retrieve address from recv address!");
-                free(recv_address);
-                continue;
-            }
-            recv_address_port = ntohs(((struct sockaddr_in6 *)recv_address)->sin6_port);
-        }
-        else
-        {
-            CHIAKI_LOGE(session->log, "check_candidates: Got an address with an unsupported address family %d, skipping ...", recv_address->sa_family);
-            free(recv_address);
-            continue;
-        }
-        bool existing_candidate = false;
-        for (; i < num_candidates + extra_addresses_used; i++)
-        {
-            candidate = &candidates[i];
-            if((strcmp(candidate->addr, recv_address_string) == 0) && (candidate->port == recv_address_port))
-            {
-                existing_candidate = true;
-                break;
-            }
-        }
-        if(!existing_candidate)
-        {
-            if(extra_addresses_used >= EXTRA_CANDIDATE_ADDRESSES)
-            {
-                CHIAKI_LOGI(session->log, "check_candidates: Received more than %d extra candidates skipping this one", EXTRA_CANDIDATE_ADDRESSES);
-                free(recv_address);
-                continue;
-            }
-            else
-            {
-                candidate = &candidates[i];
-                responses_received[i] = 0;
-                memcpy(candidate->addr, recv_address_string, sizeof(recv_address_string));
-                candidate->port_mapped = 0;
-                candidate->type = CANDIDATE_TYPE_DERIVED;
-                if(recv_address->sa_family == AF_INET)
-                {
-                    candidate->port = recv_address_port;
-                    memcpy(candidate->addr_mapped, "0.0.0.0", 8);
-                }
-                else if(recv_address->sa_family == AF_INET6)
-                {
-                    candidate->port = recv_address_port;
-                    memcpy(candidate->addr_mapped, "0:0:0:0:0:0:0:0", 16);
-                }
-                else
-                {
-                    CHIAKI_LOGE(session->log, "check_candidates: Got an address with an unsupported address family %d, skipping ...", recv_address->sa_family);
-                    free(recv_address);
-                    continue;
-                }
-                memcpy((struct sockaddr *)&addrs[i], recv_address, recv_len);
-                lens[i] = recv_len;
-                extra_addresses_used++;
-                CHIAKI_LOGI(session->log, "check_candidates: Received new candidate at %s:%d", candidate->addr, candidate->port);
-            }
-            free(recv_address);
-        }
-        CHIAKI_LOGV(session->log, "check_candidates: Received data from %s:%d", candidate->addr, candidate->port);
-        if (response_len != sizeof(response_buf))
-        {
-            if(candidate->type == CANDIDATE_TYPE_DERIVED)
-                continue;
-            CHIAKI_LOGE(session->log, "check_candidates: Received response of unexpected size %zd from %s:%d", response_len, candidate->addr, candidate->port);
-            err = CHIAKI_ERR_NETWORK;
-            goto cleanup_sockets;
-        }
-        uint32_t msg_type = ntohl(*((uint32_t*)(response_buf)));
-        if (msg_type == MSG_TYPE_REQ)
-        {
-            CHIAKI_LOGI(session->log, "Responding to request");
-            responded = true;
-            err = send_responseto_ps(session, response_buf, &candidate_sock, candidate, (struct sockaddr *)&addrs[i], lens[i]);
-            if(err != CHIAKI_ERR_SUCCESS && candidate->type != CANDIDATE_TYPE_DERIVED)
-                goto cleanup_sockets;
-            if((session->stun_random_allocation || candidate->type == CANDIDATE_TYPE_DERIVED) && responses_received[i] == 0)
-            {
-                if (sendto(candidate_sock, (CHIAKI_SOCKET_BUF_TYPE) request_buf[0], sizeof(request_buf[0]), 0, (struct sockaddr *)&addrs[i], lens[i]) < 0)
-                {
-                    CHIAKI_LOGE(session->log, "check_candidates: Sending request failed for %s:%d with error: " CHIAKI_SOCKET_ERROR_FMT, candidate->addr, candidate->port, CHIAKI_SOCKET_ERROR_VALUE);
-                    goto cleanup_sockets;
-                }
-            }
-            continue;
-        }
-        if (msg_type != MSG_TYPE_RESP)
-        {
-            CHIAKI_LOGE(session->log, "check_candidates: Received response of unexpected type %"PRIu32" from %s:%d", msg_type, candidate->addr, candidate->port);
-            chiaki_log_hexdump(session->log, CHIAKI_LOG_ERROR, response_buf, 88);
-            err = CHIAKI_ERR_UNKNOWN;
-            if(candidate->type == CANDIDATE_TYPE_DERIVED)
-                continue;
-            goto cleanup_sockets;
-        }
-        // TODO: More validation of localHashedIds, sids and the weird data at 0x4b?
-        int responses = responses_received[i];
-        if(memcmp(response_buf + 0x4b, request_id[responses], sizeof(request_id[responses])) != 0)
-        {
-            CHIAKI_LOGE(session->log, "check_candidates: Received response with unexpected request ID from %s:%d", candidate->addr, candidate->port);
-            CHIAKI_LOGE(session->log, "check_candidates: Request ID expected:");
-            chiaki_log_hexdump(session->log, CHIAKI_LOG_ERROR, request_id[responses], 5);
-            CHIAKI_LOGE(session->log, "check_candidates: Request ID received:");
-            chiaki_log_hexdump(session->log, CHIAKI_LOG_ERROR, response_buf + 0x4b, 5);
-            CHIAKI_LOGE(session->log, "check_candidates: Full response received:");
-            chiaki_log_hexdump(session->log, CHIAKI_LOG_ERROR, response_buf, 88);
-            continue;
-        }
-        received_response = true;
-        responses_received[i]++;
-        responses = responses_received[i];
-        CHIAKI_LOGV(session->log, "Received response %d", responses);
-        if(responses > (CHECK_CANDIDATES_REQUEST_NUMBER - 1))
-        {
-            selected_sock = candidate_sock;
-            selected_candidate = candidate;
-            if (connect(selected_sock, (struct sockaddr *)&addrs[i], lens[i]) < 0)
-            {
-                CHIAKI_LOGE(session->log, "check_candidates: Connecting socket failed for %s:%d with error " CHIAKI_SOCKET_ERROR_FMT, selected_candidate->addr, selected_candidate->port, CHIAKI_SOCKET_ERROR_VALUE);
-                err = CHIAKI_ERR_NETWORK;
-                goto cleanup_sockets;
-            }
-            CHIAKI_LOGV(session->log, "Selected Candidate");
-            print_candidate(session->log, selected_candidate);
-            break;
-        }
-        else
-        {
-            if (sendto(candidate_sock, (CHIAKI_SOCKET_BUF_TYPE) request_buf[responses], sizeof(request_buf[responses]), 0, (struct sockaddr *)&addrs[i], lens[i]) < 0)
-            {
-                CHIAKI_LOGE(session->log, "check_candidates: Sending request failed for %s:%d with error: " CHIAKI_SOCKET_ERROR_FMT, candidate->addr, candidate->port, CHIAKI_SOCKET_ERROR_VALUE);
-                err = CHIAKI_ERR_NETWORK;
-                    continue;
-            }
-        }
+        if(err == CHIAKI_ERR_HOST_UNREACH)
+            CHIAKI_LOGE(session->log, "check_candidates: No candidate responded in time");
+        goto cleanup_race;
+    }
+
+    ChiakiCandidateRacePair *selected_pair = &race.pairs[race.validated];
+    chiaki_socket_t selected_sock = race.validated_sock;
+    Candidate *selected_candidate = &((CandidateCheck *)selected_pair->user)->candidate;
+    // The console follows up with its own request right after its response, so waiting for a few round trips is enough
+    // A pair derived from a request of the console can be validated before it was ever probed, without a round trip to go by
+    uint64_t followup_timeout_ms = WAIT_RESPONSE_TIMEOUT_MS;
+    if(selected_pair->last_probe_us != CHIAKI_CANDIDATE_RACE_NEVER)
+        followup_timeout_ms = 3 * (selected_pair->validated_us - selected_pair->last_probe_us) / MILLISECONDS_US;
+    if(followup_timeout_ms < FOLLOWUP_REQUEST_TIMEOUT_MIN_MS)
+        followup_timeout_ms = FOLLOWUP_REQUEST_TIMEOUT_MIN_MS;
+    if(followup_timeout_ms > WAIT_RESPONSE_TIMEOUT_MS)
+        followup_timeout_ms = WAIT_RESPONSE_TIMEOUT_MS;
+    if (connect(selected_sock, (struct sockaddr *)&selected_pair->addr, selected_pair->addr_len) < 0)
+    {
+        CHIAKI_LOGE(session->log, "check_candidates: Connecting socket failed for %s:%d with error " CHIAKI_SOCKET_ERROR_FMT, selected_candidate->addr, selected_candidate->port, CHIAKI_SOCKET_ERROR_VALUE);
+        err = CHIAKI_ERR_NETWORK;
+        goto cleanup_race;
     }
+    CHIAKI_LOGV(session->log, "Selected Candidate");
+    print_candidate(session->log, selected_candidate);
+    chiaki_candidate_race_fini(&race);
+
     *out = selected_sock;
     // Close non-chosen sockets
     if (session->ipv4_sock != *out && (!CHIAKI_SOCKET_IS_INVALID(session->ipv4_sock)))
@@ -4131,10 +4170,11 @@ static ChiakiErrorCode check_candidates(
         }
     }
 
-    err = receive_request_send_response_ps(session, out, selected_candidate, WAIT_RESPONSE_TIMEOUT_SEC);
+    // Without having answered a request of the console yet, its next one must arrive
+    err = receive_request_send_response_ps(session, out, selected_candidate, ctx.responded ? followup_timeout_ms : WAIT_RESPONSE_TIMEOUT_MS);
     if(err == CHIAKI_ERR_TIMEOUT)
     {
-        if(!responded)
+        if(!ctx.responded)
             goto cleanup_sockets;
     }
     else if(err != CHIAKI_ERR_SUCCESS)
@@ -4193,6 +4233,8 @@ static ChiakiErrorCode check_candidates(
     session->ipv6_sock = CHIAKI_INVALID_SOCKET;
     return CHIAKI_ERR_SUCCESS;
 
+cleanup_race:
+    chiaki_candidate_race_fini(&race);
 cleanup_sockets:
     if(!CHIAKI_SOCKET_IS_INVALID(session->ipv4_sock))
     {
@@ -4330,10 +4372,10 @@ static ChiakiErrorCode send_responseto_ps(Session *session, uint8_t *req, chiaki
  * @param session Pointer to session instance
  * @param[in] sock Pointer to a socket to use to send the response
  * @param[in] candidate Pointer to the candidate to send the response to
- * @param[in] timeout Amount of time to wait for next request
+ * @param[in] timeout_ms Amount of time to wait for next request in milliseconds
  * @return CHIAKI_ERR_SUCCESS on success or an error code on failure
  */
-static ChiakiErrorCode receive_request_send_response_ps(Session *session, chiaki_socket_t *sock, Candidate *candidate, size_t timeout)
+static ChiakiErrorCode receive_request_send_response_ps(Session *session, chiaki_socket_t *sock, Candidate *candidate, uint64_t timeout_ms)
 {
     CHIAKI_SSIZET_TYPE len = 0;
     uint8_t req[88] = {0};
@@ -4342,7 +4384,7 @@ static ChiakiErrorCode receive_request_send_response_ps(Session *session, chiaki
     // Wait for followup request from responsive candidate
     while (true)
     {
-        err = chiaki_stop_pipe_select_single(&session->select_pipe, *sock, false, timeout * 1000);
+        err = chiaki_stop_pipe_select_single(&session->select_pipe, *sock, false, timeout_ms);
         if(err == CHIAKI_ERR_TIMEOUT && received)
             return CHIAKI_ERR_SUCCESS;
         if(err != CHIAKI_ERR_SUCCESS)
@@ -5239,7 +5281,148 @@ static ChiakiErrorCode session_message_free(SessionMessage *message)
 }
 
 /**
- * Gets stun servers from updated list of online STUN servers
+ * What STUN found out, shared by the sessions of the process
+ */
+typedef struct stun_cache_t
+{
+    ChiakiMutex mutex;
+    StunServer servers[10];
+    size_t num_servers;
+    StunServer servers_ipv6[10];
+    size_t num_servers_ipv6;
+    bool servers_valid;
+    uint64_t servers_fetched_ms;
+    char nat_addr[INET6_ADDRSTRLEN];
+    int32_t nat_allocation_increment;
+    bool nat_random_allocation;
+    bool nat_valid;
+    uint64_t nat_measured_ms;
+} StunCache;
+
+static StunCache *stun_cache = NULL;
+#ifdef _WIN32
+static INIT_ONCE stun_cache_once = INIT_ONCE_STATIC_INIT;
+#else
+static pthread_once_t stun_cache_once = PTHREAD_ONCE_INIT;
+#endif
+
+#ifdef _WIN32
+static BOOL CALLBACK stun_cache_init_once(PINIT_ONCE once, PVOID param, PVOID *ctx)
+#else
+static void stun_cache_init_once()
+#endif
+{
+    StunCache *cache = calloc(1, sizeof(StunCache));
+    if(cache && chiaki_mutex_init(&cache->mutex, false) != CHIAKI_ERR_SUCCESS)
+    {
+        free(cache);
+        cache = NULL;
+    }
+    stun_cache = cache;
+#ifdef _WIN32
+    return TRUE;
+#endif
+}
+
+static StunCache *stun_cache_lock()
+{
+#ifdef _WIN32
+    InitOnceExecuteOnce(&stun_cache_once, stun_cache_init_once, NULL, NULL);
+#else
+    pthread_once(&stun_cache_once, stun_cache_init_once);
+#endif
+    if(stun_cache)
+        chiaki_mutex_lock(&stun_cache->mutex);
+    return stun_cache;
+}
+
+/**
+ * Copies a STUN server list with its hosts
+ *
+ * @return Number of servers copied, less than num_servers if memory ran out
+ */
+static size_t stun_servers_copy(StunServer *dst, const StunServer *src, size_t num_servers)
+{
+    for(size_t i=0; i < num_servers; i++)
+    {
+        dst[i].host = malloc((strlen(src[i].host) + 1) * sizeof(char));
+        if(!dst[i].host)
+            return i;
+        strcpy(dst[i].host, src[i].host);
+        dst[i].port = src[i].port;
+    }
+    return num_servers;
+}
+
+/**
+ * Fills the session's STUN server lists from the cache if they were fetched within STUN_SERVERS_CACHE_TTL_MS
+ */
+static bool stun_cache_get_servers(Session *session)
+{
+    StunCache *cache = stun_cache_lock();
+    if(!cache)
+        return false;
+    bool valid = cache->servers_valid && chiaki_time_now_monotonic_ms() - cache->servers_fetched_ms < STUN_SERVERS_CACHE_TTL_MS;
+    if(valid)
+    {
+        session->num_stun_servers = stun_servers_copy(session->stun_server_list, cache->servers, cache->num_servers);
+        session->num_stun_servers_ipv6 = stun_servers_copy(session->stun_server_list_ipv6, cache->servers_ipv6, cache->num_servers_ipv6);
+    }
+    chiaki_mutex_unlock(&cache->mutex);
+    return valid;
+}
+
+static void stun_cache_put_servers(Session *session)
+{
+    StunCache *cache = stun_cache_lock();
+    if(!cache)
+        return;
+    for(size_t i=0; i < cache->num_servers; i++)
+        free(cache->servers[i].host);
+    for(size_t i=0; i < cache->num_servers_ipv6; i++)
+        free(cache->servers_ipv6[i].host);
+    cache->num_servers = stun_servers_copy(cache->servers, session->stun_server_list, session->num_stun_servers);
+    cache->num_servers_ipv6 = stun_servers_copy(cache->servers_ipv6, session->stun_server_list_ipv6, session->num_stun_servers_ipv6);
+    cache->servers_valid = true;
+    cache->servers_fetched_ms = chiaki_time_now_monotonic_ms();
+    chiaki_mutex_unlock(&cache->mutex);
+}
+
+/**
+ * Gets the port allocation of the NAT if it was measured within STUN_NAT_CACHE_TTL_MS, with the external address it was measured for
+ */
+static bool stun_cache_get_nat(char *address, int32_t *allocation_increment, bool *random_allocation)
+{
+    StunCache *cache = stun_cache_lock();
+    if(!cache)
+        return false;
+    bool valid = cache->nat_valid && chiaki_time_now_monotonic_ms() - cache->nat_measured_ms < STUN_NAT_CACHE_TTL_MS;
+    if(valid)
+    {
+        memcpy(address, cache->nat_addr, sizeof(cache->nat_addr));
+        *allocation_increment = cache->nat_allocation_increment;
+        *random_allocation = cache->nat_random_allocation;
+    }
+    chiaki_mutex_unlock(&cache->mutex);
+    return valid;
+}
+
+static void stun_cache_put_nat(const char *address, int32_t allocation_increment, bool random_allocation)
+{
+    StunCache *cache = stun_cache_lock();
+    if(!cache)
+        return;
+    strncpy(cache->nat_addr, address, sizeof(cache->nat_addr) - 1);
+    cache->nat_addr[sizeof(cache->nat_addr) - 1] = '\0';
+    cache->nat_allocation_increment = allocation_increment;
+    cache->nat_random_allocation = random_allocation;
+    cache->nat_valid = true;
+    cache->nat_measured_ms = chiaki_time_now_monotonic_ms();
+    chiaki_mutex_unlock(&cache->mutex);
+}
+
+/**
+ * Gets stun servers from updated list of online STUN servers, unless another session did within STUN_SERVERS_CACHE_TTL_MS
  *
  * @param session Pointer to the holepunch session
  * @return ChiakiErrSuccess on success or error code on failure
@@ -5247,6 +5430,11 @@ static ChiakiErrorCode session_message_free(SessionMessage *message)
 static ChiakiErrorCode get_stun_servers(Session *session)
 {
     ChiakiErrorCode err = CHIAKI_ERR_SUCCESS;
+    if(stun_cache_get_servers(session))
+    {
+        CHIAKI_LOGV(session->log, "Using cached stun server list with %zu ipv4 and %zu ipv6 servers", session->num_stun_servers, session->num_stun_servers_ipv6);
+        return CHIAKI_ERR_SUCCESS;
+    }
     const char STUN_HOSTS_URL[] = "https://raw.githubusercontent.com/pradt2/always-online-stun/master/valid_hosts.txt";
     CURL *curl = curl_easy_init();
     if(!curl)
@@ -5414,6 +5602,7 @@ static ChiakiErrorCode get_stun_servers(Session *session)
         session->stun_server_list_ipv6[i].port = strtol(ptr + 1, NULL, 10);
         ptr = NULL;
     }
+    stun_cache_put_servers(session);
 
 cleanup:
     free(response_data.data);
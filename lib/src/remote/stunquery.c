@@ -0,0 +1,489 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#include <chiaki/remote/stunquery.h>
+#include <chiaki/random.h>
+#include <chiaki/time.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#ifndef _WIN32
+#include <netdb.h>
+#endif
+
+#include "../utils.h"
+
+#define STUN_MSG_TYPE_BINDING_REQUEST 0x0001
+#define STUN_MSG_TYPE_BINDING_RESPONSE 0x0101
+#define STUN_MAGIC_COOKIE 0x2112A442UL
+#define STUN_ATTRIB_MAPPED_ADDRESS 0x0001
+#define STUN_ATTRIB_XOR_MAPPED_ADDRESS 0x0020
+#define STUN_MAPPED_ADDR_FAMILY_IPV4 0x01
+#define STUN_MAPPED_ADDR_FAMILY_IPV6 0x02
+
+#define STUN_RESEND_MS 500 // initial RTO of RFC 5389
+#define STUN_ROUND_TIMEOUT_MS 1500 // before the next servers are asked
+
+typedef enum stun_transaction_state_t
+{
+	STUN_TRANSACTION_IDLE,
+	STUN_TRANSACTION_PENDING,
+	STUN_TRANSACTION_ANSWERED,
+	STUN_TRANSACTION_FAILED
+} StunTransactionState;
+
+struct chiaki_stun_transaction_t
+{
+	StunTransactionState state;
+	unsigned int round;
+	uint8_t request[CHIAKI_STUN_HEADER_SIZE];
+	struct sockaddr_storage addr;
+	socklen_t addr_len;
+	unsigned int sends;
+	uint64_t next_send_ms;
+	ChiakiStunMapping mapping;
+};
+
+CHIAKI_EXPORT void chiaki_stun_binding_request(uint8_t *buf)
+{
+	memset(buf, 0, CHIAKI_STUN_HEADER_SIZE);
+	*(uint16_t *)(&buf[0]) = htons(STUN_MSG_TYPE_BINDING_REQUEST);
+	*(uint16_t *)(&buf[2]) = htons(0); // Length
+	*(uint32_t *)(&buf[4]) = htonl(STUN_MAGIC_COOKIE);
+	chiaki_random_bytes_crypt(&buf[8], CHIAKI_STUN_TRANSACTION_ID_SIZE);
+}
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_stun_parse_binding_response(ChiakiLog *log, const uint8_t *request,
+		const uint8_t *buf, size_t buf_size, char *addr, size_t addr_size, uint16_t *port)
+{
+	if(buf_size < CHIAKI_STUN_HEADER_SIZE)
+	{
+		CHIAKI_LOGW(log, "STUN response is too small");
+		return CHIAKI_ERR_INVALID_RESPONSE;
+	}
+	if(ntohs(*(uint16_t *)(&buf[0])) != STUN_MSG_TYPE_BINDING_RESPONSE)
+	{
+		CHIAKI_LOGW(log, "STUN response has invalid message type");
+		return CHIAKI_ERR_INVALID_RESPONSE;
+	}
+	// Verify length stored in buf[2] is correct
+	size_t expected_size = ntohs(*(uint16_t *)(&buf[2])) + CHIAKI_STUN_HEADER_SIZE;
+	if(buf_size != expected_size)
+	{
+		CHIAKI_LOGW(log, "STUN response has invalid length: %zu received, %zu expected", buf_size, expected_size);
+		return CHIAKI_ERR_INVALID_RESPONSE;
+	}
+	if(ntohl(*(uint32_t *)(&buf[4])) != STUN_MAGIC_COOKIE)
+	{
+		CHIAKI_LOGW(log, "STUN response has invalid magic cookie");
+		return CHIAKI_ERR_INVALID_RESPONSE;
+	}
+	if(memcmp(&buf[8], &request[8], CHIAKI_STUN_TRANSACTION_ID_SIZE) != 0)
+	{
+		CHIAKI_LOGW(log, "STUN response has invalid transaction ID");
+		return CHIAKI_ERR_INVALID_RESPONSE;
+	}
+
+	size_t pos = CHIAKI_STUN_HEADER_SIZE;
+	// Check we can read 4 bytes of attribute data
+	while(pos + 4 <= buf_size)
+	{
+		uint16_t attr_type = ntohs(*(uint16_t *)(&buf[pos]));
+		uint16_t attr_length = ntohs(*(uint16_t *)(&buf[pos + 2]));
+		// check that the whole advertised attribute has been received
+		if(pos + 4 + attr_length > buf_size)
+		{
+			CHIAKI_LOGW(log, "STUN response has invalid data");
+			return CHIAKI_ERR_INVALID_RESPONSE;
+		}
+		if(attr_type != STUN_ATTRIB_MAPPED_ADDRESS && attr_type != STUN_ATTRIB_XOR_MAPPED_ADDRESS)
+		{
+			pos += 4 + attr_length;
+			continue;
+		}
+
+		if(attr_length < 8)
+		{
+			CHIAKI_LOGW(log, "STUN response has address attribute of invalid length %u", (unsigned int)attr_length);
+			return CHIAKI_ERR_INVALID_RESPONSE;
+		}
+		bool xored = attr_type == STUN_ATTRIB_XOR_MAPPED_ADDRESS;
+		uint8_t family = buf[pos + 5];
+		uint16_t mapped_port = *(uint16_t *)(&buf[pos + 6]);
+		if(xored)
+			mapped_port ^= (uint16_t)htonl(STUN_MAGIC_COOKIE);
+		if(family == STUN_MAPPED_ADDR_FAMILY_IPV4)
+		{
+			if(attr_length != 8)
+			{
+				CHIAKI_LOGW(log, "STUN response has IPv4 address attribute of invalid length %u", (unsigned int)attr_length);
+				return CHIAKI_ERR_INVALID_RESPONSE;
+			}
+			uint32_t mapped_addr = *(uint32_t *)(&buf[pos + 8]);
+			if(xored)
+				mapped_addr ^= htonl(STUN_MAGIC_COOKIE);
+			if(!inet_ntop(AF_INET, &mapped_addr, addr, addr_size))
+				return CHIAKI_ERR_BUF_TOO_SMALL;
+		}
+		else if(family == STUN_MAPPED_ADDR_FAMILY_IPV6)
+		{
+			if(attr_length != 20)
+			{
+				CHIAKI_LOGW(log, "STUN response has IPv6 address attribute of invalid length %u", (unsigned int)attr_length);
+				return CHIAKI_ERR_INVALID_RESPONSE;
+			}
+			uint8_t mapped_addr[16];
+			// XOR address with concat(STUN_MAGIC_COOKIE, transaction_id)
+			// NOTE: RFC5389 says we need to convert from network to host
+			// endianness here, but this seems to be misleading, see
+			// https://stackoverflow.com/a/40325004
+			for(size_t i=0; i<16; i++)
+				mapped_addr[i] = buf[pos + 8 + i] ^ (xored ? request[4 + i] : 0);
+			if(!inet_ntop(AF_INET6, mapped_addr, addr, addr_size))
+				return CHIAKI_ERR_BUF_TOO_SMALL;
+		}
+		else
+		{
+			CHIAKI_LOGW(log, "STUN response has invalid address family: %d", family);
+			return CHIAKI_ERR_INVALID_RESPONSE;
+		}
+		*port = ntohs(mapped_port);
+		return CHIAKI_ERR_SUCCESS;
+	}
+
+	CHIAKI_LOGW(log, "STUN response has no mapped address");
+	return CHIAKI_ERR_INVALID_RESPONSE;
+}
+
+CHIAKI_EXPORT size_t chiaki_stun_binding_response(const uint8_t *request, size_t request_size,
+		const struct sockaddr *mapped, uint8_t *out, size_t out_size)
+{
+	if(request_size < CHIAKI_STUN_HEADER_SIZE
+			|| ntohs(*(uint16_t *)(&request[0])) != STUN_MSG_TYPE_BINDING_REQUEST
+			|| ntohl(*(uint32_t *)(&request[4])) != STUN_MAGIC_COOKIE)
+		return 0;
+	uint16_t attr_length;
+	if(mapped->sa_family == AF_INET)
+		attr_length = 8;
+	else if(mapped->sa_family == AF_INET6)
+		attr_length = 20;
+	else
+		return 0;
+	size_t size = CHIAKI_STUN_HEADER_SIZE + 4 + attr_length;
+	if(out_size < size)
+		return 0;
+
+	memcpy(out, request, CHIAKI_STUN_HEADER_SIZE);
+	*(uint16_t *)(&out[0]) = htons(STUN_MSG_TYPE_BINDING_RESPONSE);
+	*(uint16_t *)(&out[2]) = htons(4 + attr_length);
+	uint8_t *attr = out + CHIAKI_STUN_HEADER_SIZE;
+	*(uint16_t *)(&attr[0]) = htons(STUN_ATTRIB_XOR_MAPPED_ADDRESS);
+	*(uint16_t *)(&attr[2]) = htons(attr_length);
+	attr[4] = 0;
+	if(mapped->sa_family == AF_INET)
+	{
+		const struct sockaddr_in *in = (const struct sockaddr_in *)mapped;
+		attr[5] = STUN_MAPPED_ADDR_FAMILY_IPV4;
+		*(uint16_t *)(&attr[6]) = in->sin_port ^ (uint16_t)htonl(STUN_MAGIC_COOKIE);
+		*(uint32_t *)(&attr[8]) = in->sin_addr.s_addr ^ htonl(STUN_MAGIC_COOKIE);
+	}
+	else
+	{
+		const struct sockaddr_in6 *in6 = (const struct sockaddr_in6 *)mapped;
+		attr[5] = STUN_MAPPED_ADDR_FAMILY_IPV6;
+		*(uint16_t *)(&attr[6]) = in6->sin6_port ^ (uint16_t)htonl(STUN_MAGIC_COOKIE);
+		const uint8_t *a = (const uint8_t *)&in6->sin6_addr;
+		for(size_t i=0; i<16; i++)
+			attr[8 + i] = a[i] ^ request[4 + i];
+	}
+	return size;
+}
+
+CHIAKI_EXPORT void chiaki_stun_query_init(ChiakiStunQuery *query, chiaki_socket_t sock, int family,
+		const ChiakiStunServer *servers, size_t servers_count, size_t mappings_wanted)
+{
+	memset(query, 0, sizeof(*query));
+	query->sock = sock;
+	query->family = family;
+	query->servers = servers;
+	query->servers_count = servers_count;
+	if(mappings_wanted < 1)
+		mappings_wanted = 1;
+	if(mappings_wanted > CHIAKI_STUN_QUERY_MAPPINGS_MAX)
+		mappings_wanted = CHIAKI_STUN_QUERY_MAPPINGS_MAX;
+	query->mappings_wanted = mappings_wanted;
+	query->batch = CHIAKI_STUN_QUERY_BATCH;
+}
+
+static bool transaction_resolve(ChiakiLog *log, ChiakiStunQuery *query, ChiakiStunTransaction *transaction, const ChiakiStunServer *server)
+{
+	struct addrinfo hints;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = query->family;
+	hints.ai_socktype = SOCK_DGRAM;
+	char service[6];
+	snprintf(service, sizeof(service), "%u", (unsigned int)server->port);
+	struct addrinfo *resolved;
+	if(getaddrinfo(server->host, service, &hints, &resolved) != 0)
+	{
+		CHIAKI_LOGW(log, "Failed to resolve STUN server %s:%u", server->host, (unsigned int)server->port);
+		return false;
+	}
+	bool ok = resolved->ai_addrlen <= sizeof(transaction->addr);
+	if(ok)
+	{
+		memcpy(&transaction->addr, resolved->ai_addr, resolved->ai_addrlen);
+		transaction->addr_len = resolved->ai_addrlen;
+	}
+	freeaddrinfo(resolved);
+	return ok;
+}
+
+/**
+ * Ask the next servers, as many as mappings are still missing or a batch if any answer will do.
+ * @return whether any server could be asked
+ */
+static bool query_start_round(ChiakiLog *log, ChiakiStunQuery *query, uint64_t now_ms)
+{
+	size_t want = query->mappings_wanted == 1 ? query->batch : query->mappings_wanted - query->mappings_count;
+	size_t started = 0;
+	query->round++;
+	query->round_start_ms = now_ms;
+	while(started < want && query->next_server < query->servers_count)
+	{
+		size_t i = query->next_server++;
+		ChiakiStunTransaction *transaction = &query->transactions[i];
+		if(!transaction_resolve(log, query, transaction, &query->servers[i]))
+		{
+			transaction->state = STUN_TRANSACTION_FAILED;
+			continue;
+		}
+		chiaki_stun_binding_request(transaction->request);
+		transaction->state = STUN_TRANSACTION_PENDING;
+		transaction->round = query->round;
+		transaction->sends = 0;
+		transaction->next_send_ms = now_ms;
+		started++;
+	}
+	return started > 0;
+}
+
+/**
+ * Take the mappings of the current round in the order the requests were sent.
+ */
+static void query_collect_round(ChiakiLog *log, ChiakiStunQuery *query)
+{
+	for(size_t i=0; i<query->next_server; i++)
+	{
+		ChiakiStunTransaction *transaction = &query->transactions[i];
+		if(transaction->round != query->round)
+			continue;
+		if(transaction->state == STUN_TRANSACTION_PENDING)
+		{
+			CHIAKI_LOGW(log, "STUN server %s:%u did not answer in time", query->servers[i].host, (unsigned int)query->servers[i].port);
+			transaction->state = STUN_TRANSACTION_FAILED;
+		}
+		else if(transaction->state == STUN_TRANSACTION_ANSWERED && query->mappings_count < query->mappings_wanted)
+			query->mappings[query->mappings_count++] = transaction->mapping;
+	}
+}
+
+static void query_finish_round(ChiakiLog *log, ChiakiStunQuery *query, uint64_t now_ms)
+{
+	query_collect_round(log, query);
+	if(query->mappings_count >= query->mappings_wanted || !query_start_round(log, query, now_ms))
+		query->done = true;
+}
+
+static bool round_pending(ChiakiStunQuery *query)
+{
+	for(size_t i=0; i<query->next_server; i++)
+		if(query->transactions[i].round == query->round && query->transactions[i].state == STUN_TRANSACTION_PENDING)
+			return true;
+	return false;
+}
+
+/**
+ * Send the requests that are due.
+ * @return when the next one is due
+ */
+static uint64_t query_send(ChiakiLog *log, ChiakiStunQuery *query, uint64_t now_ms, uint64_t wake_ms)
+{
+	for(size_t i=0; i<query->next_server && !query->done; i++)
+	{
+		ChiakiStunTransaction *transaction = &query->transactions[i];
+		// older rounds may still answer when any answer will do, but are not asked again
+		if(transaction->state != STUN_TRANSACTION_PENDING || transaction->round != query->round)
+			continue;
+		if(now_ms >= transaction->next_send_ms)
+		{
+			CHIAKI_SSIZET_TYPE sent = sendto(query->sock, (CHIAKI_SOCKET_BUF_TYPE)transaction->request, CHIAKI_STUN_HEADER_SIZE, 0,
+					(struct sockaddr *)&transaction->addr, transaction->addr_len);
+			if(sent != CHIAKI_STUN_HEADER_SIZE)
+			{
+				CHIAKI_LOGE(log, "Failed to send STUN request, error was " CHIAKI_SOCKET_ERROR_FMT, CHIAKI_SOCKET_ERROR_VALUE);
+				query->sock_failed = true;
+				query->done = true;
+				break;
+			}
+			transaction->next_send_ms = now_ms + (STUN_RESEND_MS << transaction->sends);
+			transaction->sends++;
+		}
+		if(transaction->next_send_ms < wake_ms)
+			wake_ms = transaction->next_send_ms;
+	}
+	return wake_ms;
+}
+
+static void query_read(ChiakiLog *log, ChiakiStunQuery *query)
+{
+	uint8_t buf[256];
+	CHIAKI_SSIZET_TYPE received = recvfrom(query->sock, (CHIAKI_SOCKET_BUF_TYPE)buf, sizeof(buf), 0, NULL, NULL);
+	if(received < 0)
+	{
+		CHIAKI_LOGW(log, "Failed to receive STUN response, error was " CHIAKI_SOCKET_ERROR_FMT, CHIAKI_SOCKET_ERROR_VALUE);
+		return;
+	}
+	if(received < CHIAKI_STUN_HEADER_SIZE)
+		return;
+	for(size_t i=0; i<query->next_server; i++)
+	{
+		ChiakiStunTransaction *transaction = &query->transactions[i];
+		if(transaction->state != STUN_TRANSACTION_PENDING
+				|| memcmp(&buf[8], &transaction->request[8], CHIAKI_STUN_TRANSACTION_ID_SIZE) != 0)
+			continue;
+		ChiakiStunMapping *mapping = &transaction->mapping;
+		if(chiaki_stun_parse_binding_response(log, transaction->request, buf, (size_t)received,
+					mapping->addr, sizeof(mapping->addr), &mapping->port) != CHIAKI_ERR_SUCCESS)
+		{
+			CHIAKI_LOGW(log, "Invalid STUN response from %s:%u", query->servers[i].host, (unsigned int)query->servers[i].port);
+			transaction->state = STUN_TRANSACTION_FAILED;
+			return;
+		}
+		mapping->server = i;
+		transaction->state = STUN_TRANSACTION_ANSWERED;
+		CHIAKI_LOGV(log, "Got response from STUN server %s:%u", query->servers[i].host, (unsigned int)query->servers[i].port);
+		if(query->mappings_wanted == 1)
+		{
+			query->mappings[0] = *mapping;
+			query->mappings_count = 1;
+			query->done = true;
+		}
+		return;
+	}
+}
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_stun_query_run(ChiakiLog *log, ChiakiStunQuery *queries, size_t queries_count, uint64_t timeout_ms)
+{
+	ChiakiErrorCode err = CHIAKI_ERR_SUCCESS;
+	struct pollfd *fds = calloc(queries_count, sizeof(struct pollfd));
+	size_t *fd_queries = calloc(queries_count, sizeof(size_t));
+	if(!fds || !fd_queries)
+	{
+		err = CHIAKI_ERR_MEMORY;
+		goto cleanup;
+	}
+
+	uint64_t now_ms = chiaki_time_now_monotonic_ms();
+	uint64_t deadline_ms = now_ms + timeout_ms;
+	for(size_t i=0; i<queries_count; i++)
+	{
+		ChiakiStunQuery *query = &queries[i];
+		query->mappings_count = 0;
+		query->next_server = 0;
+		query->round = 0;
+		query->done = false;
+		query->sock_failed = false;
+		query->transactions = NULL;
+		if(CHIAKI_SOCKET_IS_INVALID(query->sock) || !query->servers_count)
+		{
+			query->done = true;
+			continue;
+		}
+		query->transactions = calloc(query->servers_count, sizeof(ChiakiStunTransaction));
+		if(!query->transactions)
+		{
+			err = CHIAKI_ERR_MEMORY;
+			goto cleanup;
+		}
+		if(!query_start_round(log, query, now_ms))
+			query->done = true;
+	}
+
+	while(true)
+	{
+		now_ms = chiaki_time_now_monotonic_ms();
+		if(now_ms >= deadline_ms)
+			break;
+		uint64_t wake_ms = deadline_ms;
+		size_t fds_count = 0;
+		for(size_t i=0; i<queries_count; i++)
+		{
+			ChiakiStunQuery *query = &queries[i];
+			if(query->done)
+				continue;
+			bool round_over = now_ms >= query->round_start_ms + STUN_ROUND_TIMEOUT_MS;
+			if(query->mappings_wanted > 1 && !round_pending(query))
+				round_over = true;
+			if(round_over)
+			{
+				if(query->mappings_wanted > 1)
+					query_finish_round(log, query, now_ms);
+				else if(!query_start_round(log, query, now_ms))
+					query->done = true;
+				if(query->done)
+					continue;
+			}
+			wake_ms = query_send(log, query, now_ms, wake_ms);
+			if(query->done)
+				continue;
+			if(query->round_start_ms + STUN_ROUND_TIMEOUT_MS < wake_ms)
+				wake_ms = query->round_start_ms + STUN_ROUND_TIMEOUT_MS;
+			fds[fds_count].fd = query->sock;
+			fds[fds_count].events = POLLIN;
+			fds[fds_count].revents = 0;
+			fd_queries[fds_count] = i;
+			fds_count++;
+		}
+		if(!fds_count)
+			break;
+
+		int r = poll(fds, fds_count, wake_ms > now_ms ? (int)(wake_ms - now_ms) : 0);
+		if(r < 0)
+		{
+			if(POLL_INTERRUPTED)
+				continue;
+			CHIAKI_LOGE(log, "STUN poll failed with error " CHIAKI_SOCKET_ERROR_FMT, CHIAKI_SOCKET_ERROR_VALUE);
+			err = CHIAKI_ERR_NETWORK;
+			goto cleanup;
+		}
+		for(size_t i=0; i<fds_count && r > 0; i++)
+		{
+			if(fds[i].revents & (POLLIN | POLLERR))
+				query_read(log, &queries[fd_queries[i]]);
+		}
+	}
+
+	// a round that ran into the deadline still counts
+	for(size_t i=0; i<queries_count; i++)
+	{
+		ChiakiStunQuery *query = &queries[i];
+		if(!query->done && query->transactions && query->mappings_wanted > 1)
+			query_collect_round(log, query);
+		if(query->mappings_count < query->mappings_wanted && err == CHIAKI_ERR_SUCCESS)
+			err = CHIAKI_ERR_TIMEOUT;
+	}
+
+cleanup:
+	for(size_t i=0; i<queries_count; i++)
+	{
+		free(queries[i].transactions);
+		queries[i].transactions = NULL;
+		queries[i].done = true;
+	}
+	free(fds);
+	free(fd_queries);
+	return err;
+}
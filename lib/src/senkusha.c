@@ -31,8 +31,12 @@
 #define EXPECT_TIMEOUT_MS 5000
 
 #define SENKUSHA_PING_COUNT_DEFAULT 10
+#define SENKUSHA_PING_COUNT_CACHED 3
 #define EXPECT_PONG_TIMEOUT_MS 1000
 
+#define SENKUSHA_MTU_MIN 576
+#define SENKUSHA_MTU_MAX 1454
+
 // Assuming IPv4, sizeof(ip header) + sizeof(udp header)
 #define MTU_UDP_PACKET_ADD 0x1c
 
@@ -111,7 +115,7 @@ static bool state_finished_cond_check(void *user)
 	return senkusha->state_finished || senkusha->should_stop;
 }
 
-CHIAKI_EXPORT ChiakiErrorCode chiaki_senkusha_run(ChiakiSenkusha *senkusha, uint32_t *mtu_in, uint32_t *mtu_out, uint64_t *rtt_us, chiaki_socket_t *socket)
+CHIAKI_EXPORT ChiakiErrorCode chiaki_senkusha_run(ChiakiSenkusha *senkusha, const ChiakiNetworkProfile *cached, uint32_t *mtu_in, uint32_t *mtu_out, uint64_t *rtt_us, chiaki_socket_t *socket)
 {
 	ChiakiSession *session = senkusha->session;
 	ChiakiErrorCode err;
@@ -248,7 +252,18 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_senkusha_run(ChiakiSenkusha *senkusha, uint
 
 	CHIAKI_LOGI(session->log, "Senkusha successfully received bang");
 
-	err = senkusha_run_rtt_test(senkusha, 0, SENKUSHA_PING_COUNT_DEFAULT, rtt_us);
+	uint32_t mtu_in_max, mtu_out_max;
+	if(!chiaki_senkusha_mtu_max(cached, &mtu_in_max, &mtu_out_max) && cached)
+	{
+		CHIAKI_LOGW(session->log, "Senkusha ignoring cached network profile with MTU in %u, out %u",
+				(unsigned int)cached->mtu_in, (unsigned int)cached->mtu_out);
+		cached = NULL;
+	}
+	if(cached)
+		CHIAKI_LOGI(session->log, "Senkusha checking cached network profile with MTU in %u, out %u, RTT %llu us",
+				(unsigned int)cached->mtu_in, (unsigned int)cached->mtu_out, (unsigned long long)cached->rtt_us);
+
+	err = senkusha_run_rtt_test(senkusha, 0, cached ? SENKUSHA_PING_COUNT_CACHED : SENKUSHA_PING_COUNT_DEFAULT, rtt_us);
 	if(err != CHIAKI_ERR_SUCCESS)
 	{
 		CHIAKI_LOGE(senkusha->log, "Senkusha Ping Test failed");
@@ -261,14 +276,14 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_senkusha_run(ChiakiSenkusha *senkusha, uint
 	if(mtu_timeout_ms > 500)
 		mtu_timeout_ms = 500;
 
-	err = senkusha_run_mtu_in_test(senkusha, 576, 1454, 3, mtu_timeout_ms, mtu_in);
+	err = senkusha_run_mtu_in_test(senkusha, SENKUSHA_MTU_MIN, mtu_in_max, 3, mtu_timeout_ms, mtu_in);
 	if(err != CHIAKI_ERR_SUCCESS)
 	{
 		CHIAKI_LOGE(senkusha->log, "Senkusha MTU in test failed");
 		goto disconnect;
 	}
 
-	err = senkusha_run_mtu_out_test(senkusha, *mtu_in, 576, 1454, 3, mtu_timeout_ms, mtu_out);
+	err = senkusha_run_mtu_out_test(senkusha, *mtu_in, SENKUSHA_MTU_MIN, mtu_out_max, 3, mtu_timeout_ms, mtu_out);
 	if(err != CHIAKI_ERR_SUCCESS)
 	{
 		CHIAKI_LOGE(senkusha->log, "Senkusha MTU out test failed");
@@ -387,6 +402,19 @@ static ChiakiErrorCode senkusha_run_rtt_test(ChiakiSenkusha *senkusha, uint16_t
 	return CHIAKI_ERR_SUCCESS;
 }
 
+CHIAKI_EXPORT bool chiaki_senkusha_mtu_max(const ChiakiNetworkProfile *cached, uint32_t *mtu_in_max, uint32_t *mtu_out_max)
+{
+	*mtu_in_max = SENKUSHA_MTU_MAX;
+	*mtu_out_max = SENKUSHA_MTU_MAX;
+	if(!cached
+			|| cached->mtu_in <= SENKUSHA_MTU_MIN || cached->mtu_in > SENKUSHA_MTU_MAX
+			|| cached->mtu_out <= SENKUSHA_MTU_MIN || cached->mtu_out > SENKUSHA_MTU_MAX)
+		return false;
+	*mtu_in_max = cached->mtu_in;
+	*mtu_out_max = cached->mtu_out;
+	return true;
+}
+
 static ChiakiErrorCode senkusha_run_mtu_in_test(ChiakiSenkusha *senkusha, uint32_t min, uint32_t max, uint32_t retries, uint64_t timeout_ms, uint32_t *mtu)
 {
 	CHIAKI_LOGI(senkusha->log, "Senkusha starting MTU in test with min %u, max %u, retries %u, timeout %llu ms",
@@ -455,7 +483,8 @@ static ChiakiErrorCode senkusha_run_mtu_in_test(ChiakiSenkusha *senkusha, uint32
 
 static ChiakiErrorCode senkusha_run_mtu_out_test(ChiakiSenkusha *senkusha, uint32_t mtu_in, uint32_t min, uint32_t max, uint32_t retries, uint64_t timeout_ms, uint32_t *mtu)
 {
-	if(min < 8 + MTU_PING_DATA_ADD || max < min || mtu_in < min || mtu_in > max)
+	// mtu_in may exceed max if a cached outbound MTU is lower
+	if(min < 8 + MTU_PING_DATA_ADD || max < min || mtu_in < min)
 		return CHIAKI_ERR_INVALID_DATA;
 
 	CHIAKI_LOGI(senkusha->log, "Senkusha starting MTU out test with min %u, max %u, retries %u, timeout %llu ms",
@@ -511,7 +540,7 @@ static ChiakiErrorCode senkusha_run_mtu_out_test(ChiakiSenkusha *senkusha, uint3
 
 	err = CHIAKI_ERR_SUCCESS;
 
-	uint32_t cur = mtu_in;
+	uint32_t cur = mtu_in < max ? mtu_in : max;
 	while((max - min) > 1)
 	{
 		bool success = false;
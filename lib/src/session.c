@@ -6,6 +6,7 @@
 #include <chiaki/http.h>
 #include <chiaki/base64.h>
 #include <chiaki/random.h>
+#include <chiaki/time.h>
 
 #include <stdlib.h>
 #include <string.h>
@@ -171,6 +172,33 @@ CHIAKI_EXPORT const char *chiaki_quit_reason_string(ChiakiQuitReason reason)
 	}
 }
 
+CHIAKI_EXPORT const char *chiaki_startup_phase_string(ChiakiStartupPhase phase)
+{
+	switch(phase)
+	{
+		case CHIAKI_STARTUP_PHASE_SESSION_REQUEST:
+			return "session_request";
+		case CHIAKI_STARTUP_PHASE_CTRL:
+			return "ctrl";
+		case CHIAKI_STARTUP_PHASE_LOGIN_PIN:
+			return "login_pin";
+		case CHIAKI_STARTUP_PHASE_HOLEPUNCH:
+			return "holepunch";
+		case CHIAKI_STARTUP_PHASE_SENKUSHA:
+			return "senkusha";
+		case CHIAKI_STARTUP_PHASE_TAKION_CONNECT:
+			return "takion_connect";
+		case CHIAKI_STARTUP_PHASE_BIG_BANG:
+			return "big_bang";
+		case CHIAKI_STARTUP_PHASE_STREAMINFO:
+			return "streaminfo";
+		case CHIAKI_STARTUP_PHASE_FIRST_FRAME:
+			return "first_frame";
+		default:
+			return "unknown";
+	}
+}
+
 CHIAKI_EXPORT ChiakiErrorCode chiaki_session_init(ChiakiSession *session, ChiakiConnectInfo *connect_info,
 	ChiakiLog *log)
 {
@@ -182,8 +210,17 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_session_init(ChiakiSession *session, Chiaki
 	session->auto_regist = connect_info->auto_regist;
 	session->holepunch_session = connect_info->holepunch_session;
 	session->rudp = NULL;
+	session->worker_pool = connect_info->worker_pool;
+
+	ChiakiErrorCode err;
+	session->metrics = chiaki_metrics_new();
+	if(!session->metrics)
+	{
+		err = CHIAKI_ERR_MEMORY;
+		goto error;
+	}
 
-	ChiakiErrorCode err = chiaki_cond_init(&session->state_cond);
+	err = chiaki_cond_init(&session->state_cond);
 	if(err != CHIAKI_ERR_SUCCESS)
 		goto error;
 		
@@ -195,6 +232,10 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_session_init(ChiakiSession *session, Chiaki
 	if(err != CHIAKI_ERR_SUCCESS)
 		goto error_state_mutex;
 
+	err = chiaki_mutex_init(&session->startup_mutex, false);
+	if(err != CHIAKI_ERR_SUCCESS)
+		goto error_stop_pipe;
+
 	chiaki_mutex_lock(&session->state_mutex);
 	session->should_stop = false;
 	session->ctrl_session_id_received = false;
@@ -210,7 +251,7 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_session_init(ChiakiSession *session, Chiaki
 	if(err != CHIAKI_ERR_SUCCESS)
 	{
 		CHIAKI_LOGE(session->log, "Ctrl init failed");
-		goto error_stop_pipe;
+		goto error_startup_mutex;
 	}
 
 	err = chiaki_stream_connection_init(&session->stream_connection, session, connect_info->packet_loss_max);
@@ -262,11 +303,16 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_session_init(ChiakiSession *session, Chiaki
 	session->connect_info.video_profile_auto_downgrade = connect_info->video_profile_auto_downgrade;
 	session->connect_info.enable_keyboard = connect_info->enable_keyboard;
 	session->connect_info.enable_dualsense = connect_info->enable_dualsense;
+	session->connect_info.network_profile_set = connect_info->network_profile != NULL;
+	if(connect_info->network_profile)
+		session->connect_info.network_profile = *connect_info->network_profile;
 
 	return CHIAKI_ERR_SUCCESS;
 
 error_ctrl:
 	chiaki_ctrl_fini(&session->ctrl);
+error_startup_mutex:
+	chiaki_mutex_fini(&session->startup_mutex);
 error_stop_pipe:
 	chiaki_stop_pipe_fini(&session->stop_pipe);
 error_state_mutex:
@@ -276,6 +322,8 @@ error_state_cond:
 error:
 	if(session->holepunch_session)
 		chiaki_holepunch_session_fini(session->holepunch_session);
+	chiaki_metrics_free(session->metrics);
+	session->metrics = NULL;
 	return err;
 }
 
@@ -295,9 +343,12 @@ CHIAKI_EXPORT void chiaki_session_fini(ChiakiSession *session)
 	if(session->holepunch_session)
 		chiaki_holepunch_session_fini(session->holepunch_session);
 	chiaki_stop_pipe_fini(&session->stop_pipe);
+	chiaki_mutex_fini(&session->startup_mutex);
 	chiaki_cond_fini(&session->state_cond);
 	chiaki_mutex_fini(&session->state_mutex);
 	freeaddrinfo(session->connect_info.host_addrinfos);
+	chiaki_metrics_free(session->metrics);
+	session->metrics = NULL;
 }
 
 CHIAKI_EXPORT ChiakiErrorCode chiaki_session_start(ChiakiSession *session)
@@ -377,6 +428,96 @@ void chiaki_session_send_event(ChiakiSession *session, ChiakiEvent *event)
 	session->event_cb(event, session->event_cb_user);
 }
 
+static void startup_timeline_reset(ChiakiSession *session)
+{
+	chiaki_mutex_lock(&session->startup_mutex);
+	memset(&session->startup_timeline, 0, sizeof(session->startup_timeline));
+	session->startup_phase = CHIAKI_STARTUP_PHASE_SESSION_REQUEST;
+	session->startup_start_us = chiaki_time_now_monotonic_us();
+	session->startup_phase_start_us = session->startup_start_us;
+	session->startup_finished = false;
+	chiaki_mutex_unlock(&session->startup_mutex);
+}
+
+static void startup_timeline_end_phase(ChiakiSession *session, uint64_t now_us)
+{
+	// phases can be entered several times, e.g. ctrl before and after the PIN
+	session->startup_timeline.phase_us[session->startup_phase] += now_us - session->startup_phase_start_us;
+	session->startup_phase_start_us = now_us;
+}
+
+/**
+ * End the current phase of the startup timeline and start the given one.
+ */
+void chiaki_session_startup_phase(ChiakiSession *session, ChiakiStartupPhase phase)
+{
+	chiaki_mutex_lock(&session->startup_mutex);
+	if(!session->startup_finished)
+	{
+		startup_timeline_end_phase(session, chiaki_time_now_monotonic_us());
+		session->startup_phase = phase;
+	}
+	chiaki_mutex_unlock(&session->startup_mutex);
+}
+
+/**
+ * End the startup timeline and send it as an event, only the first call after the session started does anything.
+ * @param complete true if the first frame was received, false if the session is quitting before
+ */
+void chiaki_session_startup_finish(ChiakiSession *session, bool complete)
+{
+	chiaki_mutex_lock(&session->startup_mutex);
+	if(session->startup_finished)
+	{
+		chiaki_mutex_unlock(&session->startup_mutex);
+		return;
+	}
+	uint64_t now_us = chiaki_time_now_monotonic_us();
+	startup_timeline_end_phase(session, now_us);
+	session->startup_finished = true;
+	session->startup_timeline.total_us = now_us - session->startup_start_us;
+	session->startup_timeline.complete = complete;
+	ChiakiEvent event = { 0 };
+	event.type = CHIAKI_EVENT_STARTUP_TIMELINE;
+	event.startup_timeline = session->startup_timeline;
+	chiaki_mutex_unlock(&session->startup_mutex);
+
+	char phases[512];
+	size_t len = 0;
+	phases[0] = '\0';
+	for(size_t i=0; i<CHIAKI_STARTUP_PHASE_COUNT && len < sizeof(phases); i++)
+	{
+		if(!event.startup_timeline.phase_us[i])
+			continue;
+		int r = snprintf(phases + len, sizeof(phases) - len, "%s%s %.1f",
+				len ? ", " : "", chiaki_startup_phase_string((ChiakiStartupPhase)i),
+				(double)event.startup_timeline.phase_us[i] / 1000.0);
+		if(r < 0)
+			break;
+		len += (size_t)r;
+	}
+	CHIAKI_LOGI(session->log, "Startup %s after %.1f ms (%s)",
+			complete ? "completed with the first frame" : "aborted",
+			(double)event.startup_timeline.total_us / 1000.0, phases);
+	chiaki_session_send_event(session, &event);
+}
+
+/**
+ * Report a measured network profile, or that a cached one didn't hold, so the application can update its cache.
+ */
+void chiaki_session_network_profile(ChiakiSession *session, const ChiakiNetworkProfile *profile, bool valid)
+{
+	if(!valid)
+		CHIAKI_LOGW(session->log, "Cached network profile with MTU in %u, out %u doesn't fit the network anymore",
+				(unsigned int)profile->mtu_in, (unsigned int)profile->mtu_out);
+	ChiakiEvent event = { 0 };
+	event.type = CHIAKI_EVENT_NETWORK_PROFILE;
+	event.network_profile.profile = *profile;
+	event.network_profile.valid = valid;
+	event.network_profile.cached = session->network_profile_cached;
+	chiaki_session_send_event(session, &event);
+}
+
 
 static bool session_check_state_pred(void *user)
 {
@@ -420,10 +561,33 @@ static bool session_check_state_pred_regist(void *user)
 
 #define ENABLE_SENKUSHA
 
+/**
+ * Generate the keys for the stream connection handshake, which don't depend on anything from the console,
+ * so this can run while ctrl is still connecting.
+ */
+static ChiakiErrorCode session_thread_prepare_stream_keys(ChiakiSession *session)
+{
+	ChiakiErrorCode err = chiaki_random_bytes_crypt(session->handshake_key, sizeof(session->handshake_key));
+	if(err != CHIAKI_ERR_SUCCESS)
+	{
+		CHIAKI_LOGE(session->log, "Session failed to generate handshake key");
+		return err;
+	}
+
+	err = chiaki_ecdh_init(&session->ecdh);
+	if(err != CHIAKI_ERR_SUCCESS)
+	{
+		CHIAKI_LOGE(session->log, "Session failed to initialize ECDH");
+		return err;
+	}
+	return CHIAKI_ERR_SUCCESS;
+}
+
 static void *session_thread_func(void *arg)
 {
 	ChiakiSession *session = (ChiakiSession *)arg;
 
+	startup_timeline_reset(session);
 	chiaki_mutex_lock(&session->state_mutex);
 
 #define QUIT(quit_label) do { \
@@ -503,6 +667,7 @@ static void *session_thread_func(void *arg)
 		QUIT(quit);
 
 	CHIAKI_LOGI(session->log, "Session request successful");
+	chiaki_session_startup_phase(session, CHIAKI_STARTUP_PHASE_CTRL);
 
 	chiaki_rpcrypt_init_auth(&session->rpcrypt, session->target, session->nonce, session->connect_info.morning);
 
@@ -515,6 +680,15 @@ static void *session_thread_func(void *arg)
 	if(err != CHIAKI_ERR_SUCCESS)
 		QUIT(quit);
 
+	// ctrl connects on its own thread meanwhile
+	bool ecdh_initialized = false;
+	chiaki_mutex_unlock(&session->state_mutex);
+	err = session_thread_prepare_stream_keys(session);
+	chiaki_mutex_lock(&session->state_mutex);
+	if(err != CHIAKI_ERR_SUCCESS)
+		QUIT(quit_ctrl);
+	ecdh_initialized = true;
+
 	err = chiaki_cond_timedwait_pred(&session->state_cond, &session->state_mutex, SESSION_EXPECT_CTRL_START_MS, session_check_state_pred_ctrl_start, session);
 	CHECK_STOP(quit_ctrl);
 
@@ -532,6 +706,7 @@ static void *session_thread_func(void *arg)
 			CHIAKI_LOGI(session->log, "Login PIN was incorrect, requested again by Ctrl");
 		else
 			CHIAKI_LOGI(session->log, "Ctrl requested Login PIN");
+		chiaki_session_startup_phase(session, CHIAKI_STARTUP_PHASE_LOGIN_PIN);
 		ChiakiEvent event = { 0 };
 		event.type = CHIAKI_EVENT_LOGIN_PIN_REQUEST;
 		event.login_pin_request.pin_incorrect = pin_incorrect;
@@ -547,6 +722,7 @@ static void *session_thread_func(void *arg)
 
 		assert(session->login_pin_entered && session->login_pin);
 		CHIAKI_LOGI(session->log, "Session received entered Login PIN, forwarding to Ctrl");
+		chiaki_session_startup_phase(session, CHIAKI_STARTUP_PHASE_CTRL);
 		chiaki_ctrl_set_login_pin(&session->ctrl, session->login_pin, session->login_pin_size);
 		session->login_pin_entered = false;
 		free(session->login_pin);
@@ -567,6 +743,7 @@ static void *session_thread_func(void *arg)
 			CHECK_STOP(quit_ctrl);
 		}
 		CHIAKI_LOGI(session->log, "Punching hole for data connection");
+		chiaki_session_startup_phase(session, CHIAKI_STARTUP_PHASE_HOLEPUNCH);
 		ChiakiEvent event_start = { 0 };
 		event_start.type = CHIAKI_EVENT_HOLEPUNCH;
 		event_start.data_holepunch.finished = false;
@@ -583,6 +760,7 @@ static void *session_thread_func(void *arg)
 		event_finish.type = CHIAKI_EVENT_HOLEPUNCH;
 		event_finish.data_holepunch.finished = true;
 		chiaki_session_send_event(session, &event_finish);
+		chiaki_session_startup_phase(session, CHIAKI_STARTUP_PHASE_CTRL);
 		err = chiaki_cond_timedwait_pred(&session->state_cond, &session->state_mutex, SESSION_EXPECT_TIMEOUT_MS, session_check_state_pred_ctrl_start, session);
 		CHECK_STOP(quit_ctrl);
 	}
@@ -609,27 +787,41 @@ ctrl_failed:
 
 #ifdef ENABLE_SENKUSHA
 	CHIAKI_LOGI(session->log, "Starting Senkusha");
+	chiaki_session_startup_phase(session, CHIAKI_STARTUP_PHASE_SENKUSHA);
 
 	ChiakiSenkusha senkusha;
 	err = chiaki_senkusha_init(&senkusha, session);
 	if(err != CHIAKI_ERR_SUCCESS)
 		QUIT(quit_ctrl);
 
-	err = chiaki_senkusha_run(&senkusha, &session->mtu_in, &session->mtu_out, &session->rtt_us, data_sock);
+	session->network_profile_cached = session->connect_info.network_profile_set;
+	err = chiaki_senkusha_run(&senkusha,
+			session->network_profile_cached ? &session->connect_info.network_profile : NULL,
+			&session->mtu_in, &session->mtu_out, &session->rtt_us, data_sock);
 	chiaki_senkusha_fini(&senkusha);
 
 	if(err == CHIAKI_ERR_SUCCESS)
+	{
 		CHIAKI_LOGI(session->log, "Senkusha completed successfully");
+		ChiakiNetworkProfile profile = { session->mtu_in, session->mtu_out, session->rtt_us };
+		chiaki_session_network_profile(session, &profile, true);
+	}
 	else if(err == CHIAKI_ERR_CANCELED)
 		QUIT(quit_ctrl);
 	else
 	{
 		CHIAKI_LOGE(session->log, "Senkusha failed, but we still try to connect with fallback values");
+		if(session->network_profile_cached)
+			chiaki_session_network_profile(session, &session->connect_info.network_profile, false);
+		session->network_profile_cached = false;
 		session->mtu_in = 1454;
 		session->mtu_out = 1454;
 		session->rtt_us = 1000;
 	}
 #endif
+	if(session->rtt_us)
+		chiaki_metrics_gauge_set(session->metrics, CHIAKI_METRIC_RTT_MS, (double)session->rtt_us / 1000.0);
+	chiaki_session_startup_phase(session, CHIAKI_STARTUP_PHASE_TAKION_CONNECT);
 	if(session->rudp)
 	{
 		ChiakiErrorCode err;
@@ -649,20 +841,6 @@ ctrl_failed:
 		CHIAKI_LOGI(session->log, "Received Switch to Stream Connection Ack... Switching to Stream Connection now");
 	}
 
-	err = chiaki_random_bytes_crypt(session->handshake_key, sizeof(session->handshake_key));
-	if(err != CHIAKI_ERR_SUCCESS)
-	{
-		CHIAKI_LOGE(session->log, "Session failed to generate handshake key");
-		QUIT(quit_ctrl);
-	}
-
-	err = chiaki_ecdh_init(&session->ecdh);
-	if(err != CHIAKI_ERR_SUCCESS)
-	{
-		CHIAKI_LOGE(session->log, "Session failed to initialize ECDH");
-		QUIT(quit_ctrl);
-	}
-
 	chiaki_mutex_unlock(&session->state_mutex);
 	err = chiaki_stream_connection_run(&session->stream_connection, data_sock);
 	chiaki_mutex_lock(&session->state_mutex);
@@ -687,17 +865,19 @@ ctrl_failed:
 	}
 
 	chiaki_mutex_unlock(&session->state_mutex);
-	chiaki_ecdh_fini(&session->ecdh);
 
 quit_ctrl:
 	chiaki_ctrl_stop(&session->ctrl);
 	chiaki_ctrl_join(&session->ctrl);
 	CHIAKI_LOGI(session->log, "Ctrl stopped");
+	if(ecdh_initialized)
+		chiaki_ecdh_fini(&session->ecdh);
 
 	ChiakiEvent quit_event;
 quit:
 
 	CHIAKI_LOGI(session->log, "Session has quit");
+	chiaki_session_startup_finish(session, false);
 	chiaki_mutex_lock(&session->state_mutex);
 	quit_event.type = CHIAKI_EVENT_QUIT;
 	quit_event.quit.reason = session->quit_reason;
@@ -1160,4 +1340,20 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_session_go_home(ChiakiSession *session)
 	ChiakiErrorCode err;
 	err = ctrl_message_go_home(&session->ctrl);
 	return err;
-}
\ No newline at end of file
+}
+
+CHIAKI_EXPORT const ChiakiBitstreamNalIndex *chiaki_session_video_sample_nal_index(ChiakiSession *session)
+{
+	ChiakiVideoReceiver *video_receiver = session->stream_connection.video_receiver;
+	return video_receiver ? &video_receiver->nal_index : NULL;
+}
+
+CHIAKI_EXPORT void chiaki_session_video_sample_decoded(ChiakiSession *session, uint64_t sample, bool success)
+{
+	chiaki_ref_tracker_sample_decoded(&session->stream_connection.ref_tracker, sample, success);
+}
+
+CHIAKI_EXPORT int32_t chiaki_session_video_sample_frame_index(ChiakiSession *session, uint64_t sample)
+{
+	return chiaki_ref_tracker_sample_frame(&session->stream_connection.ref_tracker, sample);
+}
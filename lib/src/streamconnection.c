@@ -43,6 +43,7 @@ typedef enum {
 } StreamConnectionState;
 
 void chiaki_session_send_event(ChiakiSession *session, ChiakiEvent *event);
+void chiaki_session_startup_phase(ChiakiSession *session, ChiakiStartupPhase phase);
 
 static void stream_connection_takion_cb(ChiakiTakionEvent *event, void *user);
 static void stream_connection_takion_data(ChiakiStreamConnection *stream_connection, ChiakiTakionMessageDataType data_type, uint8_t *buf, size_t buf_size);
@@ -54,6 +55,20 @@ static ChiakiErrorCode stream_connection_send_big(ChiakiStreamConnection *stream
 static ChiakiErrorCode stream_connection_send_controller_connection(ChiakiStreamConnection *stream_connection);
 static ChiakiErrorCode stream_connection_enable_microphone(ChiakiStreamConnection *stream_connection);
 static ChiakiErrorCode stream_connection_send_disconnect(ChiakiStreamConnection *stream_connection);
+static void stream_connection_update_metrics(ChiakiStreamConnection *stream_connection, ChiakiStreamStatsWindow *window)
+{
+	ChiakiMetrics *metrics = stream_connection->session->metrics;
+	chiaki_metrics_gauge_set(metrics, CHIAKI_METRIC_BITRATE_MBPS, stream_connection->measured_bitrate);
+	chiaki_metrics_gauge_set(metrics, CHIAKI_METRIC_FPS, window->fps);
+	chiaki_metrics_gauge_set(metrics, CHIAKI_METRIC_PACKET_LOSS, stream_connection->congestion_control.packet_loss);
+
+	ChiakiTakionSendBuffer *send_buffer = &stream_connection->takion.send_buffer;
+	chiaki_mutex_lock(&send_buffer->mutex);
+	size_t send_buffer_packets = send_buffer->packets_count;
+	chiaki_mutex_unlock(&send_buffer->mutex);
+	chiaki_metrics_gauge_set(metrics, CHIAKI_METRIC_SEND_BUFFER_PACKETS, (double)send_buffer_packets);
+}
+
 static void stream_connection_takion_data_idle(ChiakiStreamConnection *stream_connection, uint8_t *buf, size_t buf_size);
 static void stream_connection_takion_data_expect_bang(ChiakiStreamConnection *stream_connection, uint8_t *buf, size_t buf_size);
 static void stream_connection_takion_data_expect_streaminfo(ChiakiStreamConnection *stream_connection, uint8_t *buf, size_t buf_size);
@@ -70,6 +85,7 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_stream_connection_init(ChiakiStreamConnecti
 	stream_connection->ecdh_secret = NULL;
 	stream_connection->gkcrypt_remote = NULL;
 	stream_connection->gkcrypt_local = NULL;
+	stream_connection->congestion_control.lane = NULL;
 	stream_connection->streaminfo_early_buf = NULL;
 	stream_connection->streaminfo_early_buf_size = 0;
 	memset(stream_connection->motion_counter, 0, sizeof(stream_connection->motion_counter));
@@ -98,6 +114,10 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_stream_connection_init(ChiakiStreamConnecti
 	if(err != CHIAKI_ERR_SUCCESS)
 		goto error_packet_stats;
 
+	err = chiaki_ref_tracker_init(&stream_connection->ref_tracker, session->metrics);
+	if(err != CHIAKI_ERR_SUCCESS)
+		goto error_feedback_sender_mutex;
+
 	stream_connection->state = STATE_IDLE;
 	stream_connection->state_finished = false;
 	stream_connection->state_failed = false;
@@ -107,6 +127,8 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_stream_connection_init(ChiakiStreamConnecti
 
 	return CHIAKI_ERR_SUCCESS;
 
+error_feedback_sender_mutex:
+	chiaki_mutex_fini(&stream_connection->feedback_sender_mutex);
 error_packet_stats:
 	chiaki_packet_stats_fini(&stream_connection->packet_stats);
 error_state_cond:
@@ -125,12 +147,13 @@ CHIAKI_EXPORT void chiaki_stream_connection_fini(ChiakiStreamConnection *stream_
 	chiaki_gkcrypt_free(stream_connection->gkcrypt_local);
 
 	free(stream_connection->ecdh_secret);
-	if (stream_connection->congestion_control.thread.thread)
+	if (stream_connection->congestion_control.thread.thread || stream_connection->congestion_control.lane)
 		chiaki_congestion_control_stop(&stream_connection->congestion_control);
 
 	chiaki_packet_stats_fini(&stream_connection->packet_stats);
 
 	chiaki_mutex_fini(&stream_connection->feedback_sender_mutex);
+	chiaki_ref_tracker_fini(&stream_connection->ref_tracker);
 
 	chiaki_cond_fini(&stream_connection->state_cond);
 	chiaki_mutex_fini(&stream_connection->state_mutex);
@@ -219,7 +242,7 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_stream_connection_run(ChiakiStreamConnectio
 		goto err_video_receiver;
 	}
 
-	err = chiaki_congestion_control_start(&stream_connection->congestion_control, &stream_connection->takion, &stream_connection->packet_stats, stream_connection->packet_loss_max);
+	err = chiaki_congestion_control_start(&stream_connection->congestion_control, &stream_connection->takion, &stream_connection->packet_stats, stream_connection->packet_loss_max, session->worker_pool);
 	if(err != CHIAKI_ERR_SUCCESS)
 	{
 		CHIAKI_LOGE(session->log, "StreamConnection failed to start Congestion Control");
@@ -236,6 +259,7 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_stream_connection_run(ChiakiStreamConnectio
 	}
 
 	CHIAKI_LOGI(session->log, "StreamConnection sending big");
+	chiaki_session_startup_phase(session, CHIAKI_STARTUP_PHASE_BIG_BANG);
 
 	stream_connection->state = STATE_EXPECT_BANG;
 	stream_connection->state_finished = false;
@@ -261,6 +285,7 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_stream_connection_run(ChiakiStreamConnectio
 		goto disconnect;
 	}
 	CHIAKI_LOGI(session->log, "StreamConnection successfully received bang");
+	chiaki_session_startup_phase(session, CHIAKI_STARTUP_PHASE_STREAMINFO);
 	stream_connection->state = STATE_EXPECT_STREAMINFO;
 	stream_connection->state_finished = false;
 	stream_connection->state_failed = false;
@@ -682,9 +707,14 @@ static void stream_connection_takion_data_idle(ChiakiStreamConnection *stream_co
 			 q.target_bitrate, q.upstream_bitrate,
 			 q.upstream_loss,
 			 q.disable_upstream_audio, q.rtt, q.loss);
-		stream_connection->measured_bitrate = chiaki_stream_stats_bitrate(&stream_connection->video_receiver->frame_processor.stream_stats, stream_connection->session->connect_info.video_profile.max_fps) / 1000000.0;
-		CHIAKI_LOGV(stream_connection->log, "StreamConnection measured bitrate: %.4f MBit/s", stream_connection->measured_bitrate);
-		chiaki_stream_stats_reset(&stream_connection->video_receiver->frame_processor.stream_stats);
+		chiaki_stream_stats_window(&stream_connection->video_receiver->frame_processor.stream_stats, &stream_connection->stream_stats_window);
+		ChiakiStreamStatsWindow *window = &stream_connection->stream_stats_window;
+		stream_connection->measured_bitrate = window->bitrate / 1000000.0;
+		CHIAKI_LOGV(stream_connection->log, "StreamConnection measured bitrate: %.4f MBit/s, %.2f fps, frame size p50/p95/max: %llu/%llu/%llu, I-frame size: %llu, interval: %.1f ms",
+			stream_connection->measured_bitrate, window->fps,
+			(unsigned long long)window->frame_size_p50, (unsigned long long)window->frame_size_p95, (unsigned long long)window->frame_size_max,
+			(unsigned long long)window->iframe_size, (double)window->iframe_interval_us / 1000.0);
+		stream_connection_update_metrics(stream_connection, window);
 		break;
 	}
 	case tkproto_TakionMessage_PayloadType_CORRUPTFRAME:
@@ -703,13 +733,13 @@ static ChiakiErrorCode stream_connection_init_crypt(ChiakiStreamConnection *stre
 {
 	ChiakiSession *session = stream_connection->session;
 
-	stream_connection->gkcrypt_local = chiaki_gkcrypt_new(stream_connection->log, CHIAKI_GKCRYPT_KEY_BUF_BLOCKS_DEFAULT, 2, session->handshake_key, stream_connection->ecdh_secret);
+	stream_connection->gkcrypt_local = chiaki_gkcrypt_new(stream_connection->log, CHIAKI_GKCRYPT_KEY_BUF_BLOCKS_DEFAULT, session->worker_pool, 2, session->handshake_key, stream_connection->ecdh_secret);
 	if(!stream_connection->gkcrypt_local)
 	{
 		CHIAKI_LOGE(stream_connection->log, "StreamConnection failed to initialize local GKCrypt with index 2");
 		return CHIAKI_ERR_UNKNOWN;
 	}
-	stream_connection->gkcrypt_remote = chiaki_gkcrypt_new(stream_connection->log, CHIAKI_GKCRYPT_KEY_BUF_BLOCKS_DEFAULT, 3, session->handshake_key, stream_connection->ecdh_secret);
+	stream_connection->gkcrypt_remote = chiaki_gkcrypt_new(stream_connection->log, CHIAKI_GKCRYPT_KEY_BUF_BLOCKS_DEFAULT, session->worker_pool, 3, session->handshake_key, stream_connection->ecdh_secret);
 	if(!stream_connection->gkcrypt_remote)
 	{
 		CHIAKI_LOGE(stream_connection->log, "StreamConnection failed to initialize remote GKCrypt with index 3");
@@ -718,6 +748,9 @@ static ChiakiErrorCode stream_connection_init_crypt(ChiakiStreamConnection *stre
 		return CHIAKI_ERR_UNKNOWN;
 	}
 
+	stream_connection->gkcrypt_local->metrics = session->metrics;
+	stream_connection->gkcrypt_remote->metrics = session->metrics;
+
 	chiaki_takion_set_crypt(&stream_connection->takion, stream_connection->gkcrypt_local, stream_connection->gkcrypt_remote);
 
 	return CHIAKI_ERR_SUCCESS;
@@ -938,6 +971,8 @@ static void stream_connection_takion_data_expect_streaminfo(ChiakiStreamConnecti
 
 	// TODO: do some checks?
 
+	// before the ack, which makes the console start sending video
+	chiaki_session_startup_phase(stream_connection->session, CHIAKI_STARTUP_PHASE_FIRST_FRAME);
 	stream_connection_send_streaminfo_ack(stream_connection);
 	
 	ChiakiErrorCode err = stream_connection_send_controller_connection(stream_connection);
@@ -1024,12 +1024,19 @@ static ChiakiErrorCode takion_handle_packet_mac(ChiakiTakion *takion, uint8_t ba
 
 	if(memcmp(mac_expected, mac, sizeof(mac)) != 0)
 	{
-		CHIAKI_LOGE(takion->log, "Takion packet MAC mismatch for packet type %#x with key_pos %#llx", base_type, key_pos);
-		chiaki_log_hexdump(takion->log, CHIAKI_LOG_ERROR, buf, buf_size);
-		CHIAKI_LOGD(takion->log, "GMAC:");
-		chiaki_log_hexdump(takion->log, CHIAKI_LOG_DEBUG, mac, sizeof(mac));
-		CHIAKI_LOGD(takion->log, "GMAC expected:");
-		chiaki_log_hexdump(takion->log, CHIAKI_LOG_DEBUG, mac_expected, sizeof(mac_expected));
+		// may happen for every packet under attack or corruption, so don't let the log make it worse
+		static ChiakiLogRateLimit mac_mismatch_rl;
+		if(chiaki_log_rate_limit(takion->log, CHIAKI_LOG_ERROR, &mac_mismatch_rl))
+		{
+			CHIAKI_LOGE(takion->log, "Takion packet MAC mismatch for packet type %#x with key_pos %#llx", base_type, key_pos);
+#if CHIAKI_LIB_ENABLE_HOT_PATH_VERBOSE_LOGS
+			chiaki_log_hexdump(takion->log, CHIAKI_LOG_VERBOSE, buf, buf_size);
+			CHIAKI_LOGD(takion->log, "GMAC:");
+			chiaki_log_hexdump(takion->log, CHIAKI_LOG_DEBUG, mac, sizeof(mac));
+			CHIAKI_LOGD(takion->log, "GMAC expected:");
+			chiaki_log_hexdump(takion->log, CHIAKI_LOG_DEBUG, mac_expected, sizeof(mac_expected));
+#endif
+		}
 		return CHIAKI_ERR_INVALID_MAC;
 	}
 
@@ -0,0 +1,302 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#define _GNU_SOURCE
+
+#include <chiaki/trace.h>
+#include <chiaki/thread.h>
+#include <chiaki/time.h>
+
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#endif
+
+#define TRACE_RING_SIZE 8192 // must be a power of 2
+#define TRACE_THREAD_NAME_SIZE 32
+#define TRACE_RING_OWNERS 8 // threads a reused ring keeps the names of, for their events still in it
+
+typedef struct trace_event_t
+{
+	uint64_t ts_us;
+	int64_t frame_index;
+	uint32_t tid;
+	uint16_t stage;
+	char phase;
+} TraceEvent;
+
+typedef struct trace_owner_t
+{
+	uint32_t tid;
+	char thread_name[TRACE_THREAD_NAME_SIZE];
+} TraceOwner;
+
+typedef struct trace_ring_t
+{
+	struct trace_ring_t *next;
+	atomic_bool owned; // false once the owning thread has exited, so the ring can be taken over
+	uint32_t tid;
+	// the current and previous owners, protected by rings_mutex
+	TraceOwner owners[TRACE_RING_OWNERS];
+	size_t owners_count;
+	atomic_uint_fast64_t head;
+	atomic_uint_fast64_t cleared; // events before this were dropped by chiaki_trace_clear()
+	TraceEvent events[TRACE_RING_SIZE];
+} TraceRing;
+
+CHIAKI_EXPORT volatile int chiaki_trace_active = 0;
+
+static _Thread_local TraceRing *thread_ring = NULL;
+static _Thread_local int64_t thread_frame_context = CHIAKI_TRACE_FRAME_NONE;
+
+static ChiakiMutex *rings_mutex = NULL;
+static TraceRing *rings = NULL;
+static uint32_t next_tid = 1;
+static uint64_t trace_start_us = 0;
+
+#ifdef _WIN32
+static DWORD ring_release_key = FLS_OUT_OF_INDEXES;
+static INIT_ONCE init_once = INIT_ONCE_STATIC_INIT;
+#else
+static pthread_key_t ring_release_key;
+static pthread_once_t init_once = PTHREAD_ONCE_INIT;
+#endif
+
+static const char *stage_names[CHIAKI_TRACE_STAGE_COUNT] = {
+	"video_unit_first",
+	"video_unit_last",
+	"fec",
+	"bitstream_parse",
+	"decoder_queue",
+	"decoder_send_packet",
+	"decoder_frame",
+	"decoder_pull_frame",
+	"present_frame",
+	"render",
+	"audio_frame",
+	"audio_decode",
+	"feedback_state",
+	"feedback_history"
+};
+
+static const char *stage_categories[CHIAKI_TRACE_STAGE_COUNT] = {
+	"video", "video", "video", "video", "decode", "decode", "decode", "decode", "render", "render", "audio", "audio", "input", "input"
+};
+
+CHIAKI_EXPORT const char *chiaki_trace_stage_name(ChiakiTraceStage stage)
+{
+	if(stage < 0 || stage >= CHIAKI_TRACE_STAGE_COUNT)
+		return "unknown";
+	return stage_names[stage];
+}
+
+#ifdef _WIN32
+static void WINAPI ring_release(void *ring)
+#else
+static void ring_release(void *ring)
+#endif
+{
+	if(ring)
+		atomic_store_explicit(&((TraceRing *)ring)->owned, false, memory_order_release);
+}
+
+#ifdef _WIN32
+static BOOL CALLBACK trace_init_once(PINIT_ONCE once, PVOID param, PVOID *ctx)
+#else
+static void trace_init_once()
+#endif
+{
+	rings_mutex = CHIAKI_NEW(ChiakiMutex);
+	if(rings_mutex && chiaki_mutex_init(rings_mutex, false) != CHIAKI_ERR_SUCCESS)
+	{
+		free(rings_mutex);
+		rings_mutex = NULL;
+	}
+#ifdef _WIN32
+	ring_release_key = FlsAlloc(ring_release);
+	return TRUE;
+#else
+	pthread_key_create(&ring_release_key, ring_release);
+#endif
+}
+
+static bool trace_init()
+{
+#ifdef _WIN32
+	InitOnceExecuteOnce(&init_once, trace_init_once, NULL, NULL);
+#else
+	pthread_once(&init_once, trace_init_once);
+#endif
+	return rings_mutex != NULL;
+}
+
+static void thread_name_get(char *buf, size_t buf_size)
+{
+	buf[0] = '\0';
+#if defined(__GLIBC__)
+	pthread_getname_np(pthread_self(), buf, buf_size);
+#endif
+}
+
+static TraceRing *thread_ring_acquire()
+{
+	if(thread_ring)
+		return thread_ring;
+	if(!trace_init())
+		return NULL;
+
+	chiaki_mutex_lock(rings_mutex);
+	TraceRing *ring = NULL;
+	for(TraceRing *r = rings; r; r = r->next)
+	{
+		if(!atomic_load_explicit(&r->owned, memory_order_acquire))
+		{
+			ring = r;
+			break;
+		}
+	}
+	if(!ring)
+	{
+		ring = calloc(1, sizeof(TraceRing));
+		if(!ring)
+		{
+			chiaki_mutex_unlock(rings_mutex);
+			return NULL;
+		}
+		atomic_init(&ring->head, 0);
+		atomic_init(&ring->cleared, 0);
+		ring->next = rings;
+		rings = ring;
+	}
+	ring->tid = next_tid++;
+	TraceOwner *owner = &ring->owners[ring->owners_count++ % TRACE_RING_OWNERS];
+	owner->tid = ring->tid;
+	thread_name_get(owner->thread_name, sizeof(owner->thread_name));
+	atomic_store_explicit(&ring->owned, true, memory_order_release);
+	chiaki_mutex_unlock(rings_mutex);
+
+#ifdef _WIN32
+	if(ring_release_key != FLS_OUT_OF_INDEXES)
+		FlsSetValue(ring_release_key, ring);
+#else
+	pthread_setspecific(ring_release_key, ring);
+#endif
+	thread_ring = ring;
+	return ring;
+}
+
+CHIAKI_EXPORT void chiaki_trace_set_enabled(bool enabled)
+{
+	if(enabled && !trace_start_us)
+		trace_start_us = chiaki_time_now_monotonic_us();
+	chiaki_trace_active = enabled ? 1 : 0;
+}
+
+CHIAKI_EXPORT void chiaki_trace_event(ChiakiTraceStage stage, ChiakiTracePhase phase, int64_t frame_index)
+{
+	TraceRing *ring = thread_ring_acquire();
+	if(!ring)
+		return;
+	uint64_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+	TraceEvent *event = &ring->events[head & (TRACE_RING_SIZE - 1)];
+	event->ts_us = chiaki_time_now_monotonic_us();
+	event->frame_index = frame_index;
+	event->tid = ring->tid;
+	event->stage = (uint16_t)stage;
+	event->phase = (char)phase;
+	atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+CHIAKI_EXPORT void chiaki_trace_set_frame_context(int64_t frame_index)
+{
+	thread_frame_context = frame_index;
+}
+
+CHIAKI_EXPORT int64_t chiaki_trace_frame_context()
+{
+	return thread_frame_context;
+}
+
+static void write_ring(FILE *f, TraceRing *ring, TraceEvent *copy, bool *first)
+{
+	uint64_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+	uint64_t tail = head > TRACE_RING_SIZE ? head - TRACE_RING_SIZE : 0;
+	for(uint64_t i = tail; i < head; i++)
+		copy[i - tail] = ring->events[i & (TRACE_RING_SIZE - 1)];
+
+	// anything the writer may have touched while we were copying is not trustworthy anymore
+	uint64_t head_after = atomic_load_explicit(&ring->head, memory_order_acquire);
+	uint64_t valid_from = head_after > TRACE_RING_SIZE ? head_after - TRACE_RING_SIZE + 1 : 0;
+	if(valid_from < tail)
+		valid_from = tail;
+	uint64_t cleared = atomic_load_explicit(&ring->cleared, memory_order_acquire);
+	if(valid_from < cleared)
+		valid_from = cleared;
+
+	size_t owners = ring->owners_count < TRACE_RING_OWNERS ? ring->owners_count : TRACE_RING_OWNERS;
+	for(size_t i = 0; i < owners; i++)
+	{
+		TraceOwner *owner = &ring->owners[i];
+		fprintf(f, "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,\"args\":{\"name\":\"%s\"}}",
+				*first ? "" : ",", (unsigned int)owner->tid, owner->thread_name[0] ? owner->thread_name : "chiaki");
+		*first = false;
+	}
+
+	for(uint64_t i = valid_from; i < head; i++)
+	{
+		TraceEvent *event = &copy[i - tail];
+		if(event->stage >= CHIAKI_TRACE_STAGE_COUNT)
+			continue;
+		uint64_t ts = event->ts_us > trace_start_us ? event->ts_us - trace_start_us : 0;
+		fprintf(f, ",\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"%c\",\"ts\":%llu,\"pid\":1,\"tid\":%u%s,\"args\":{\"frame\":%lld}}",
+				stage_names[event->stage], stage_categories[event->stage], event->phase,
+				(unsigned long long)ts, (unsigned int)event->tid,
+				event->phase == CHIAKI_TRACE_PHASE_INSTANT ? ",\"s\":\"t\"" : "",
+				(long long)event->frame_index);
+	}
+}
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_trace_write_chrome_json(const char *path)
+{
+	if(!trace_init())
+		return CHIAKI_ERR_UNINITIALIZED;
+
+	TraceEvent *copy = malloc(sizeof(TraceEvent) * TRACE_RING_SIZE);
+	if(!copy)
+		return CHIAKI_ERR_MEMORY;
+
+	FILE *f = fopen(path, "w");
+	if(!f)
+	{
+		free(copy);
+		return CHIAKI_ERR_UNKNOWN;
+	}
+
+	fprintf(f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+	bool first = true;
+	chiaki_mutex_lock(rings_mutex);
+	for(TraceRing *ring = rings; ring; ring = ring->next)
+		write_ring(f, ring, copy, &first);
+	chiaki_mutex_unlock(rings_mutex);
+	fprintf(f, "\n]}\n");
+
+	free(copy);
+	return fclose(f) == 0 ? CHIAKI_ERR_SUCCESS : CHIAKI_ERR_UNKNOWN;
+}
+
+CHIAKI_EXPORT void chiaki_trace_clear()
+{
+	if(!trace_init())
+		return;
+	chiaki_mutex_lock(rings_mutex);
+	// the owning threads may still be recording, so their events are only cut off instead of touched
+	for(TraceRing *ring = rings; ring; ring = ring->next)
+		atomic_store_explicit(&ring->cleared, atomic_load_explicit(&ring->head, memory_order_acquire), memory_order_release);
+	trace_start_us = chiaki_time_now_monotonic_us();
+	chiaki_mutex_unlock(rings_mutex);
+}
@@ -22,6 +22,15 @@
 
 #include <stdint.h>
 
+#ifdef _WIN32
+#define poll WSAPoll
+#define POLL_INTERRUPTED false
+#else
+#include <poll.h>
+#include <errno.h>
+#define POLL_INTERRUPTED (errno == EINTR)
+#endif
+
 static inline ChiakiErrorCode set_port(struct sockaddr *sa, uint16_t port)
 {
 	if(sa->sa_family == AF_INET)
@@ -1,36 +1,61 @@
 // SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
 
+#include <chiaki/config.h>
+
 #include <chiaki/videoreceiver.h>
 #include <chiaki/session.h>
+#include <chiaki/trace.h>
+#include <chiaki/time.h>
 
 #include <string.h>
 
 static ChiakiErrorCode chiaki_video_receiver_flush_frame(ChiakiVideoReceiver *video_receiver);
 
-static void add_ref_frame(ChiakiVideoReceiver *video_receiver, int32_t frame)
+void chiaki_session_startup_finish(ChiakiSession *session, bool complete);
+void chiaki_session_network_profile(ChiakiSession *session, const ChiakiNetworkProfile *profile, bool valid);
+
+#define NETWORK_PROFILE_CHECK_FRAMES 120
+
+static ChiakiRefTracker *ref_tracker(ChiakiVideoReceiver *video_receiver)
 {
-	if(video_receiver->reference_frames[0] != -1)
-	{
-		memmove(&video_receiver->reference_frames[1], &video_receiver->reference_frames[0], sizeof(int32_t) * 15);
-		video_receiver->reference_frames[0] = frame;
+	return &video_receiver->session->stream_connection.ref_tracker;
+}
+
+/**
+ * With a cached network profile, senkusha only probes whether its MTUs still get through,
+ * so a frame lost beyond what FEC recovers in the first ones is taken as a sign that the profile doesn't fit anymore,
+ * e.g. because full-size packets are dropped.
+ */
+static void network_profile_check(ChiakiVideoReceiver *video_receiver, bool frame_complete)
+{
+	ChiakiSession *session = video_receiver->session;
+	if(!session->network_profile_cached || video_receiver->network_profile_checked)
 		return;
-	}
-	for(int i=15; i>=0; i--)
-	{
-		if(video_receiver->reference_frames[i] == -1)
-		{
-			video_receiver->reference_frames[i] = frame;
-			return;
-		}
-	}
+	if(frame_complete && ++video_receiver->network_profile_frames < NETWORK_PROFILE_CHECK_FRAMES)
+		return;
+	video_receiver->network_profile_checked = true;
+	if(frame_complete)
+		CHIAKI_LOGI(video_receiver->log, "Cached network profile confirmed by the first %u frames", (unsigned int)NETWORK_PROFILE_CHECK_FRAMES);
+	else
+		chiaki_session_network_profile(session, &session->connect_info.network_profile, false);
 }
 
-static bool have_ref_frame(ChiakiVideoReceiver *video_receiver, int32_t frame)
+static void request_recovery(ChiakiVideoReceiver *video_receiver, ChiakiSeqNum16 start, ChiakiSeqNum16 end)
 {
-	for(int i=0; i<16; i++)
-		if(video_receiver->reference_frames[i] == frame)
-			return true;
-	return false;
+	ChiakiSession *session = video_receiver->session;
+	ChiakiRefRecovery recovery = chiaki_ref_tracker_recovery(ref_tracker(video_receiver), session->rtt_us, chiaki_time_now_monotonic_us());
+	switch(recovery)
+	{
+		case CHIAKI_REF_RECOVERY_REQUEST:
+			if(stream_connection_send_corrupt_frame(&session->stream_connection, start, end) != CHIAKI_ERR_SUCCESS)
+				CHIAKI_LOGW(video_receiver->log, "Error sending corrupt frame.");
+			break;
+		case CHIAKI_REF_RECOVERY_WAIT_IDR:
+			CHIAKI_LOGI(video_receiver->log, "Regular IDR frame is due, waiting for it instead of reporting frames %d to %d as corrupt", (int)start, (int)end);
+			break;
+		default:
+			break;
+	}
 }
 
 CHIAKI_EXPORT void chiaki_video_receiver_init(ChiakiVideoReceiver *video_receiver, struct chiaki_session_t *session, ChiakiPacketStats *packet_stats)
@@ -49,8 +74,13 @@ CHIAKI_EXPORT void chiaki_video_receiver_init(ChiakiVideoReceiver *video_receive
 	video_receiver->packet_stats = packet_stats;
 
 	video_receiver->frames_lost = 0;
-	memset(video_receiver->reference_frames, -1, sizeof(video_receiver->reference_frames));
+	video_receiver->first_frame_passed = false;
+	video_receiver->network_profile_frames = 0;
+	video_receiver->network_profile_checked = false;
+	chiaki_ref_tracker_reset(ref_tracker(video_receiver));
 	chiaki_bitstream_init(&video_receiver->bitstream, video_receiver->log, video_receiver->session->connect_info.video_profile.codec);
+	memset(&video_receiver->nal_index, 0, sizeof(video_receiver->nal_index));
+	video_receiver->nal_index.slice = -1;
 }
 
 CHIAKI_EXPORT void chiaki_video_receiver_fini(ChiakiVideoReceiver *video_receiver)
@@ -88,7 +118,7 @@ CHIAKI_EXPORT void chiaki_video_receiver_av_packet(ChiakiVideoReceiver *video_re
 	if(video_receiver->frame_index_cur >= 0
 		&& chiaki_seq_num_16_lt(frame_index, (ChiakiSeqNum16)video_receiver->frame_index_cur))
 	{
-		CHIAKI_LOGW(video_receiver->log, "Video Receiver received old frame packet");
+		CHIAKI_LOGW_RL(video_receiver->log, "Video Receiver received old frame packet");
 		return;
 	}
 
@@ -106,8 +136,17 @@ CHIAKI_EXPORT void chiaki_video_receiver_av_packet(ChiakiVideoReceiver *video_re
 
 		ChiakiVideoProfile *profile = video_receiver->profiles + video_receiver->profile_cur;
 		CHIAKI_LOGI(video_receiver->log, "Switched to profile %d, resolution: %ux%u", video_receiver->profile_cur, profile->width, profile->height);
+		chiaki_bitstream_index(&video_receiver->bitstream, profile->header, profile->header_sz, &video_receiver->nal_index);
 		if(video_receiver->session->video_sample_cb)
+		{
+			chiaki_ref_tracker_sample(ref_tracker(video_receiver), -1);
 			video_receiver->session->video_sample_cb(profile->header, profile->header_sz, 0, false, video_receiver->session->video_sample_cb_user);
+		}
+#if CHIAKI_LIB_ENABLE_FFMPEG_DECODER
+		if(video_receiver->session->recorder)
+			chiaki_recorder_video_header(video_receiver->session->recorder, video_receiver->bitstream.codec,
+					profile->width, profile->height, profile->header, profile->header_sz, &video_receiver->nal_index);
+#endif
 		if(!chiaki_bitstream_header(&video_receiver->bitstream, profile->header, profile->header_sz))
 			CHIAKI_LOGW(video_receiver->log, "Failed to parse video header");
 	}
@@ -131,12 +170,12 @@ CHIAKI_EXPORT void chiaki_video_receiver_av_packet(ChiakiVideoReceiver *video_re
 			&& !(frame_index == 1 && video_receiver->frame_index_cur < 0)) // ok for frame 1
 		{
 			CHIAKI_LOGW(video_receiver->log, "Detected missing or corrupt frame(s) from %d to %d", next_frame_expected, (int)frame_index);
-			err = stream_connection_send_corrupt_frame(&video_receiver->session->stream_connection, next_frame_expected, frame_index - 1);
-			if(err != CHIAKI_ERR_SUCCESS)
-				CHIAKI_LOGW(video_receiver->log, "Error sending corrupt frame.");
+			request_recovery(video_receiver, next_frame_expected, frame_index - 1);
 		}
 
 		video_receiver->frame_index_cur = frame_index;
+		CHIAKI_TRACE_SET_FRAME(frame_index);
+		CHIAKI_TRACE_INSTANT(CHIAKI_TRACE_STAGE_VIDEO_UNIT_FIRST, frame_index);
 		err = chiaki_frame_processor_alloc_frame(&video_receiver->frame_processor, packet);
 		if(err != CHIAKI_ERR_SUCCESS)
 			CHIAKI_LOGW(video_receiver->log, "Video receiver could not allocate frame for packet.");
@@ -151,7 +190,11 @@ CHIAKI_EXPORT void chiaki_video_receiver_av_packet(ChiakiVideoReceiver *video_re
 	{
 		// if we already have enough for the whole frame, flush it already
 		if(chiaki_frame_processor_flush_possible(&video_receiver->frame_processor) || packet->unit_index == packet->units_in_frame_total - 1)
+		{
+			// the unit completing the frame just arrived, a frame cut short by the next one never gets this
+			CHIAKI_TRACE_INSTANT(CHIAKI_TRACE_STAGE_VIDEO_UNIT_LAST, video_receiver->frame_index_cur);
 			err = chiaki_video_receiver_flush_frame(video_receiver);
+		}
 		if(err != CHIAKI_ERR_SUCCESS)
 			CHIAKI_LOGW(video_receiver->log, "Video receiver could not flush frame.");
 	}
@@ -162,6 +205,11 @@ static ChiakiErrorCode chiaki_video_receiver_flush_frame(ChiakiVideoReceiver *vi
 	uint8_t *frame;
 	size_t frame_size;
 	ChiakiFrameProcessorFlushResult flush_result = chiaki_frame_processor_flush(&video_receiver->frame_processor, &frame, &frame_size);
+	ChiakiMetrics *metrics = video_receiver->session->metrics;
+	if(flush_result == CHIAKI_FRAME_PROCESSOR_FLUSH_RESULT_FEC_SUCCESS || flush_result == CHIAKI_FRAME_PROCESSOR_FLUSH_RESULT_FEC_FAILED)
+		chiaki_metrics_counter_inc(metrics, CHIAKI_METRIC_FEC_ATTEMPTS);
+	if(flush_result == CHIAKI_FRAME_PROCESSOR_FLUSH_RESULT_FEC_SUCCESS)
+		chiaki_metrics_counter_inc(metrics, CHIAKI_METRIC_FEC_SUCCESSES);
 
 	if(flush_result == CHIAKI_FRAME_PROCESSOR_FLUSH_RESULT_FAILED
 		|| flush_result == CHIAKI_FRAME_PROCESSOR_FLUSH_RESULT_FEC_FAILED)
@@ -169,31 +217,42 @@ static ChiakiErrorCode chiaki_video_receiver_flush_frame(ChiakiVideoReceiver *vi
 		if (flush_result == CHIAKI_FRAME_PROCESSOR_FLUSH_RESULT_FEC_FAILED)
 		{
 			ChiakiSeqNum16 next_frame_expected = (ChiakiSeqNum16)(video_receiver->frame_index_prev_complete + 1);
-			stream_connection_send_corrupt_frame(&video_receiver->session->stream_connection, next_frame_expected, video_receiver->frame_index_cur);
+			request_recovery(video_receiver, next_frame_expected, video_receiver->frame_index_cur);
 			video_receiver->frames_lost += video_receiver->frame_index_cur - next_frame_expected + 1;
+			chiaki_metrics_counter_add(metrics, CHIAKI_METRIC_VIDEO_FRAMES_LOST, (uint64_t)(ChiakiSeqNum16)(video_receiver->frame_index_cur - next_frame_expected + 1));
 			video_receiver->frame_index_prev = video_receiver->frame_index_cur;
 		}
 		CHIAKI_LOGW(video_receiver->log, "Failed to complete frame %d", (int)video_receiver->frame_index_cur);
+		network_profile_check(video_receiver, false);
 		return CHIAKI_ERR_UNKNOWN;
 	}
 
+	chiaki_metrics_counter_inc(metrics, CHIAKI_METRIC_VIDEO_FRAMES);
+	chiaki_metrics_counter_add(metrics, CHIAKI_METRIC_VIDEO_BYTES, frame_size);
+
 	bool succ = flush_result != CHIAKI_FRAME_PROCESSOR_FLUSH_RESULT_FEC_FAILED;
 	bool recovered = false;
 
 	ChiakiBitstreamSlice slice;
-	if(chiaki_bitstream_slice(&video_receiver->bitstream, frame, frame_size, &slice))
+	CHIAKI_TRACE_BEGIN(CHIAKI_TRACE_STAGE_BITSTREAM_PARSE, video_receiver->frame_index_cur);
+	chiaki_bitstream_index(&video_receiver->bitstream, frame, frame_size, &video_receiver->nal_index);
+	bool slice_parsed = chiaki_bitstream_slice(&video_receiver->bitstream, frame, &video_receiver->nal_index, &slice);
+	CHIAKI_TRACE_END(CHIAKI_TRACE_STAGE_BITSTREAM_PARSE, video_receiver->frame_index_cur);
+	if(slice_parsed)
 	{
-		if(slice.slice_type == CHIAKI_BITSTREAM_SLICE_P)
+		if(slice.slice_type == CHIAKI_BITSTREAM_SLICE_I)
+			chiaki_stream_stats_iframe(&video_receiver->frame_processor.stream_stats);
+		else if(slice.slice_type == CHIAKI_BITSTREAM_SLICE_P)
 		{
 			ChiakiSeqNum16 ref_frame_index = video_receiver->frame_index_cur - slice.reference_frame - 1;
-			if(slice.reference_frame != 0xff && !have_ref_frame(video_receiver, ref_frame_index))
+			if(slice.reference_frame != 0xff && !chiaki_ref_tracker_have(ref_tracker(video_receiver), ref_frame_index))
 			{
 				for(unsigned i=slice.reference_frame+1; i<16; i++)
 				{
 					ChiakiSeqNum16 ref_frame_index_new = video_receiver->frame_index_cur - i - 1;
-					if(have_ref_frame(video_receiver, ref_frame_index_new))
+					if(chiaki_ref_tracker_have(ref_tracker(video_receiver), ref_frame_index_new))
 					{
-						if(chiaki_bitstream_slice_set_reference_frame(&video_receiver->bitstream, frame, frame_size, i))
+						if(chiaki_bitstream_slice_set_reference_frame(&video_receiver->bitstream, frame, &video_receiver->nal_index, i))
 						{
 							recovered = true;
 							CHIAKI_LOGW(video_receiver->log, "Missing reference frame %d for decoding frame %d -> changed to %d", (int)ref_frame_index, (int)video_receiver->frame_index_cur, (int)ref_frame_index_new);
@@ -205,14 +264,24 @@ static ChiakiErrorCode chiaki_video_receiver_flush_frame(ChiakiVideoReceiver *vi
 				{
 					succ = false;
 					video_receiver->frames_lost++;
+					chiaki_metrics_counter_inc(metrics, CHIAKI_METRIC_VIDEO_FRAMES_LOST);
 					CHIAKI_LOGW(video_receiver->log, "Missing reference frame %d for decoding frame %d", (int)ref_frame_index, (int)video_receiver->frame_index_cur);
+					request_recovery(video_receiver, (ChiakiSeqNum16)(video_receiver->frame_index_prev_complete + 1), video_receiver->frame_index_cur);
 				}
 			}
 		}
 	}
 
+	if(recovered)
+		chiaki_ref_tracker_rewritten(ref_tracker(video_receiver));
+
+#if CHIAKI_LIB_ENABLE_FFMPEG_DECODER
+	bool intact = succ;
+#endif
+	uint64_t now_us = chiaki_time_now_monotonic_us();
 	if(succ && video_receiver->session->video_sample_cb)
 	{
+		chiaki_ref_tracker_sample(ref_tracker(video_receiver), video_receiver->frame_index_cur);
 		bool cb_succ = video_receiver->session->video_sample_cb(frame, frame_size, video_receiver->frames_lost, recovered, video_receiver->session->video_sample_cb_user);
 		video_receiver->frames_lost = 0;
 		if(!cb_succ)
@@ -222,11 +291,30 @@ static ChiakiErrorCode chiaki_video_receiver_flush_frame(ChiakiVideoReceiver *vi
 		}
 		else
 		{
-			add_ref_frame(video_receiver, video_receiver->frame_index_cur);
-			CHIAKI_LOGV(video_receiver->log, "Added reference %c frame %d", slice.slice_type == CHIAKI_BITSTREAM_SLICE_I ? 'I' : 'P', (int)video_receiver->frame_index_cur);
+			// an I slice alone may still be followed by frames referencing what came before it
+			chiaki_ref_tracker_submitted(ref_tracker(video_receiver), video_receiver->frame_index_cur,
+					chiaki_bitstream_index_idr(video_receiver->bitstream.codec, &video_receiver->nal_index), now_us);
+			CHIAKI_LOGV_RL(video_receiver->log, "Added reference %c frame %d", slice.slice_type == CHIAKI_BITSTREAM_SLICE_I ? 'I' : 'P', (int)video_receiver->frame_index_cur);
+			if(!video_receiver->first_frame_passed)
+			{
+				video_receiver->first_frame_passed = true;
+				chiaki_session_startup_finish(video_receiver->session, true);
+			}
+			network_profile_check(video_receiver, true);
 		}
 	}
 
+#if CHIAKI_LIB_ENABLE_FFMPEG_DECODER
+	// recorded even if the decoder didn't take it, a file is decoded from its start
+	if(intact && video_receiver->session->recorder
+		&& chiaki_recorder_video_frame(video_receiver->session->recorder, frame, frame_size, &video_receiver->nal_index, now_us))
+	{
+		CHIAKI_LOGI(video_receiver->log, "Requesting a keyframe to start recording");
+		if(stream_connection_send_corrupt_frame(&video_receiver->session->stream_connection, video_receiver->frame_index_cur, video_receiver->frame_index_cur) != CHIAKI_ERR_SUCCESS)
+			CHIAKI_LOGW(video_receiver->log, "Error sending corrupt frame.");
+	}
+#endif
+
 	video_receiver->frame_index_prev = video_receiver->frame_index_cur;
 
 	if(succ)
@@ -0,0 +1,365 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#include <chiaki/workerpool.h>
+#include <chiaki/time.h>
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
+
+struct chiaki_worker_lane_t
+{
+	ChiakiWorkerPool *pool;
+
+	// everything below is guarded by the pool's mutex
+	ChiakiWorkerTask *tasks_head;
+	ChiakiWorkerTask *tasks_tail;
+	bool ready; // in the ready list of the pool
+	bool running; // a task of the lane is running on some worker
+	bool closing;
+
+	uint64_t timer_interval_ms; // 0 if there is no timer
+	uint64_t timer_next_ms;
+	ChiakiWorkerTask timer_task;
+
+	struct chiaki_worker_lane_t *ready_next;
+	struct chiaki_worker_lane_t *prev;
+	struct chiaki_worker_lane_t *next;
+};
+
+struct chiaki_worker_pool_t
+{
+	ChiakiLog *log;
+	ChiakiMutex mutex;
+	ChiakiCond cond; // work or a timer change for the workers
+	ChiakiCond idle_cond; // a task of a closing lane finished
+	bool stop;
+
+	// lanes with tasks that are not running, in the order they take turns
+	ChiakiWorkerLane *ready_head;
+	ChiakiWorkerLane *ready_tail;
+
+	ChiakiWorkerLane *lanes;
+
+	ChiakiThread *threads;
+	unsigned int threads_count;
+};
+
+CHIAKI_EXPORT unsigned int chiaki_worker_pool_cpu_count()
+{
+#ifdef _WIN32
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	long count = (long)info.dwNumberOfProcessors;
+#else
+	long count = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+	return count > 0 ? (unsigned int)count : 1;
+}
+
+static void ready_push(ChiakiWorkerPool *pool, ChiakiWorkerLane *lane)
+{
+	assert(!lane->ready);
+	lane->ready = true;
+	lane->ready_next = NULL;
+	if(pool->ready_tail)
+		pool->ready_tail->ready_next = lane;
+	else
+		pool->ready_head = lane;
+	pool->ready_tail = lane;
+}
+
+static ChiakiWorkerLane *ready_pop(ChiakiWorkerPool *pool)
+{
+	ChiakiWorkerLane *lane = pool->ready_head;
+	if(!lane)
+		return NULL;
+	pool->ready_head = lane->ready_next;
+	if(!pool->ready_head)
+		pool->ready_tail = NULL;
+	lane->ready = false;
+	lane->ready_next = NULL;
+	return lane;
+}
+
+static void ready_remove(ChiakiWorkerPool *pool, ChiakiWorkerLane *lane)
+{
+	if(!lane->ready)
+		return;
+	ChiakiWorkerLane *prev = NULL;
+	for(ChiakiWorkerLane *l = pool->ready_head; l; prev = l, l = l->ready_next)
+	{
+		if(l != lane)
+			continue;
+		if(prev)
+			prev->ready_next = l->ready_next;
+		else
+			pool->ready_head = l->ready_next;
+		if(pool->ready_tail == l)
+			pool->ready_tail = prev;
+		break;
+	}
+	lane->ready = false;
+	lane->ready_next = NULL;
+}
+
+static void lane_post_locked(ChiakiWorkerLane *lane, ChiakiWorkerTask *task)
+{
+	if(task->queued || lane->closing)
+		return;
+	task->queued = true;
+	task->next = NULL;
+	if(lane->tasks_tail)
+		lane->tasks_tail->next = task;
+	else
+		lane->tasks_head = task;
+	lane->tasks_tail = task;
+
+	// a running lane is put back by its worker once the task finished
+	if(!lane->running && !lane->ready)
+	{
+		ready_push(lane->pool, lane);
+		chiaki_cond_signal(&lane->pool->cond);
+	}
+}
+
+/**
+ * Post the timers that are due.
+ * @return ms until the next timer is due, UINT64_MAX if there is none
+ */
+static uint64_t fire_timers(ChiakiWorkerPool *pool, uint64_t now)
+{
+	uint64_t wait_ms = UINT64_MAX;
+	for(ChiakiWorkerLane *lane = pool->lanes; lane; lane = lane->next)
+	{
+		if(!lane->timer_interval_ms)
+			continue;
+		if(now >= lane->timer_next_ms)
+		{
+			lane_post_locked(lane, &lane->timer_task);
+			lane->timer_next_ms += lane->timer_interval_ms;
+			if(lane->timer_next_ms <= now)
+				lane->timer_next_ms = now + lane->timer_interval_ms;
+		}
+		uint64_t remaining = lane->timer_next_ms - now;
+		if(remaining < wait_ms)
+			wait_ms = remaining;
+	}
+	return wait_ms;
+}
+
+static void *worker_thread_func(void *user)
+{
+	ChiakiWorkerPool *pool = user;
+
+	chiaki_mutex_lock(&pool->mutex);
+	while(!pool->stop)
+	{
+		uint64_t wait_ms = fire_timers(pool, chiaki_time_now_monotonic_ms());
+
+		ChiakiWorkerLane *lane = ready_pop(pool);
+		if(!lane)
+		{
+			if(wait_ms == UINT64_MAX)
+				chiaki_cond_wait(&pool->cond, &pool->mutex);
+			else
+				chiaki_cond_timedwait(&pool->cond, &pool->mutex, wait_ms);
+			continue;
+		}
+
+		ChiakiWorkerTask *task = lane->tasks_head;
+		lane->tasks_head = task->next;
+		if(!lane->tasks_head)
+			lane->tasks_tail = NULL;
+		task->queued = false;
+		task->next = NULL;
+		ChiakiWorkerTaskFunc func = task->func;
+		void *task_user = task->user;
+		lane->running = true;
+		chiaki_mutex_unlock(&pool->mutex);
+
+		func(task_user);
+
+		chiaki_mutex_lock(&pool->mutex);
+		lane->running = false;
+		if(lane->closing)
+			chiaki_cond_broadcast(&pool->idle_cond);
+		else if(lane->tasks_head)
+			ready_push(pool, lane); // back of the line, after the other lanes had their turn
+	}
+	chiaki_mutex_unlock(&pool->mutex);
+
+	return NULL;
+}
+
+CHIAKI_EXPORT ChiakiWorkerPool *chiaki_worker_pool_new(ChiakiLog *log, unsigned int threads)
+{
+	ChiakiWorkerPool *pool = CHIAKI_NEW(ChiakiWorkerPool);
+	if(!pool)
+		return NULL;
+	pool->log = log;
+	pool->stop = false;
+	pool->ready_head = NULL;
+	pool->ready_tail = NULL;
+	pool->lanes = NULL;
+	pool->threads_count = 0;
+
+	if(!threads)
+		threads = chiaki_worker_pool_cpu_count();
+	pool->threads = calloc(threads, sizeof(ChiakiThread));
+	if(!pool->threads)
+		goto error_pool;
+
+	if(chiaki_mutex_init(&pool->mutex, false) != CHIAKI_ERR_SUCCESS)
+		goto error_threads;
+	if(chiaki_cond_init(&pool->cond) != CHIAKI_ERR_SUCCESS)
+		goto error_mutex;
+	if(chiaki_cond_init(&pool->idle_cond) != CHIAKI_ERR_SUCCESS)
+		goto error_cond;
+
+	for(; pool->threads_count < threads; pool->threads_count++)
+	{
+		ChiakiThread *thread = &pool->threads[pool->threads_count];
+		if(chiaki_thread_create(thread, worker_thread_func, pool) != CHIAKI_ERR_SUCCESS)
+		{
+			CHIAKI_LOGE(log, "Worker pool failed to create thread");
+			goto error_workers;
+		}
+		char name[16]; // what fits into pthread names
+		snprintf(name, sizeof(name), "Chiaki Wrk %u", pool->threads_count);
+		chiaki_thread_set_name(thread, name);
+	}
+
+	CHIAKI_LOGI(log, "Worker pool started with %u threads", pool->threads_count);
+	return pool;
+
+error_workers:
+	chiaki_mutex_lock(&pool->mutex);
+	pool->stop = true;
+	chiaki_mutex_unlock(&pool->mutex);
+	chiaki_cond_broadcast(&pool->cond);
+	for(unsigned int i = 0; i < pool->threads_count; i++)
+		chiaki_thread_join(&pool->threads[i], NULL);
+	chiaki_cond_fini(&pool->idle_cond);
+error_cond:
+	chiaki_cond_fini(&pool->cond);
+error_mutex:
+	chiaki_mutex_fini(&pool->mutex);
+error_threads:
+	free(pool->threads);
+error_pool:
+	free(pool);
+	return NULL;
+}
+
+CHIAKI_EXPORT void chiaki_worker_pool_free(ChiakiWorkerPool *pool)
+{
+	if(!pool)
+		return;
+	chiaki_mutex_lock(&pool->mutex);
+	assert(!pool->lanes);
+	pool->stop = true;
+	chiaki_mutex_unlock(&pool->mutex);
+	chiaki_cond_broadcast(&pool->cond);
+	for(unsigned int i = 0; i < pool->threads_count; i++)
+		chiaki_thread_join(&pool->threads[i], NULL);
+	chiaki_cond_fini(&pool->idle_cond);
+	chiaki_cond_fini(&pool->cond);
+	chiaki_mutex_fini(&pool->mutex);
+	free(pool->threads);
+	free(pool);
+}
+
+CHIAKI_EXPORT unsigned int chiaki_worker_pool_thread_count(ChiakiWorkerPool *pool)
+{
+	return pool->threads_count;
+}
+
+CHIAKI_EXPORT ChiakiWorkerLane *chiaki_worker_lane_new(ChiakiWorkerPool *pool)
+{
+	ChiakiWorkerLane *lane = CHIAKI_NEW(ChiakiWorkerLane);
+	if(!lane)
+		return NULL;
+	lane->pool = pool;
+	lane->tasks_head = NULL;
+	lane->tasks_tail = NULL;
+	lane->ready = false;
+	lane->running = false;
+	lane->closing = false;
+	lane->timer_interval_ms = 0;
+	lane->timer_next_ms = 0;
+	chiaki_worker_task_init(&lane->timer_task, NULL, NULL);
+	lane->ready_next = NULL;
+	lane->prev = NULL;
+
+	chiaki_mutex_lock(&pool->mutex);
+	lane->next = pool->lanes;
+	if(pool->lanes)
+		pool->lanes->prev = lane;
+	pool->lanes = lane;
+	chiaki_mutex_unlock(&pool->mutex);
+	return lane;
+}
+
+CHIAKI_EXPORT void chiaki_worker_lane_free(ChiakiWorkerLane *lane)
+{
+	if(!lane)
+		return;
+	ChiakiWorkerPool *pool = lane->pool;
+	chiaki_mutex_lock(&pool->mutex);
+	lane->closing = true;
+	lane->timer_interval_ms = 0;
+	for(ChiakiWorkerTask *task = lane->tasks_head; task;)
+	{
+		ChiakiWorkerTask *next = task->next;
+		task->queued = false;
+		task->next = NULL;
+		task = next;
+	}
+	lane->tasks_head = NULL;
+	lane->tasks_tail = NULL;
+	ready_remove(pool, lane);
+	while(lane->running)
+		chiaki_cond_wait(&pool->idle_cond, &pool->mutex);
+
+	if(lane->prev)
+		lane->prev->next = lane->next;
+	else
+		pool->lanes = lane->next;
+	if(lane->next)
+		lane->next->prev = lane->prev;
+	chiaki_mutex_unlock(&pool->mutex);
+	free(lane);
+}
+
+CHIAKI_EXPORT void chiaki_worker_lane_post(ChiakiWorkerLane *lane, ChiakiWorkerTask *task)
+{
+	chiaki_mutex_lock(&lane->pool->mutex);
+	lane_post_locked(lane, task);
+	chiaki_mutex_unlock(&lane->pool->mutex);
+}
+
+CHIAKI_EXPORT void chiaki_worker_lane_set_timer(ChiakiWorkerLane *lane, uint64_t interval_ms, ChiakiWorkerTaskFunc func, void *user)
+{
+	ChiakiWorkerPool *pool = lane->pool;
+	chiaki_mutex_lock(&pool->mutex);
+	if(lane->closing)
+	{
+		chiaki_mutex_unlock(&pool->mutex);
+		return;
+	}
+	lane->timer_interval_ms = interval_ms;
+	lane->timer_next_ms = chiaki_time_now_monotonic_ms() + interval_ms;
+	// a run that is already queued keeps its old function
+	if(!lane->timer_task.queued)
+		chiaki_worker_task_init(&lane->timer_task, func, user);
+	chiaki_mutex_unlock(&pool->mutex);
+	// waiting workers need to pick up the new deadline
+	chiaki_cond_broadcast(&pool->cond);
+}
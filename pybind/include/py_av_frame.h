@@ -14,30 +14,90 @@ extern "C"
 
 namespace py = pybind11;
 
+/**
+ * Where a frame handed to Python came from, all times are monotonic as by chiaki_time_now_monotonic_us()
+ */
+struct PyAVFrameInfo
+{
+    int64_t frame_index = -1; // in the stream, -1 if unknown
+    int32_t frames_lost = 0; // never received or dropped before decoding since the previous frame
+    uint64_t frames_dropped = 0; // decoded since the previous frame, but replaced by newer ones before being handed out
+    uint64_t arrival_us = 0; // received completely and passed to the decoder, 0 if unknown
+    uint64_t decoded_us = 0; // came out of the decoder, 0 if unknown
+    uint64_t pulled_us = 0; // taken from the decoder, after downloading it from the hardware if necessary
+};
+
+/**
+ * A decoded frame handed to Python.
+ *
+ * plane() returns numpy views straight into the buffers of the frame, without copying anything.
+ * Every view holds its own reference to the buffer of its plane, so it stays valid after the frame
+ * is released or garbage collected, and the buffer only goes back to the decoder's pool once the
+ * last view is gone. The views are read-only, the decoder may still reference the same buffers
+ * for predicting the following frames.
+ */
 class PyAVFrame
 {
 public:
     AVFrame *frame;
+    PyAVFrameInfo info;
 
     PyAVFrame();
 
+    /**
+     * Take over frame, which is released with chiaki_ffmpeg_frame_free()
+     */
+    explicit PyAVFrame(AVFrame *frame);
+
     ~PyAVFrame();
 
-    int width() const { return frame->width; }
-    void set_width(int w) { frame->width = w; }
+    PyAVFrame(const PyAVFrame &) = delete;
+    PyAVFrame &operator=(const PyAVFrame &) = delete;
+
+    int width() const { return Frame()->width; }
+    void set_width(int w) { Frame()->width = w; }
 
-    int height() const { return frame->height; }
-    void set_height(int h) { frame->height = h; }
+    int height() const { return Frame()->height; }
+    void set_height(int h) { Frame()->height = h; }
 
-    int format() const { return frame->format; }
-    void set_format(int fmt) { frame->format = fmt; }
+    int format() const { return Frame()->format; }
+    void set_format(int fmt) { Frame()->format = fmt; }
 
-    int64_t pts() const { return frame->pts; }
-    void set_pts(int64_t pts) { frame->pts = pts; }
+    int64_t pts() const { return Frame()->pts; }
+    void set_pts(int64_t pts) { Frame()->pts = pts; }
+
+    int linesize(int index) const;
+    int plane_count() const;
 
     py::bytes data(int index);
 
+    /**
+     * Copy of the rows of a plane, as bytes without the format applied
+     */
     py::array_t<uint8_t> to_numpy(int index);
+
+    /**
+     * Read-only view of a plane: (height, width) for planes of a single component,
+     * (height, width, components) for interleaved ones such as the chroma plane of NV12 or packed RGB,
+     * uint16 for more than 8 bits per component.
+     */
+    py::array plane(int index);
+    py::list planes();
+
+    /**
+     * Drop the reference to the frame now instead of when the object is collected.
+     * Views that were already taken stay valid.
+     */
+    void release();
+    bool released() const { return !frame; }
+
+private:
+    AVFrame *Frame() const
+    {
+        if (!frame)
+            throw std::runtime_error("Frame was released");
+        return frame;
+    }
 };
 
-#endif // CHIAKI_PY_AV_FRAME_H
\ No newline at end of file
+#endif // CHIAKI_PY_AV_FRAME_H
@@ -0,0 +1,62 @@
+#ifndef CHIAKI_PY_FRAME_CONVERTER_H
+#define CHIAKI_PY_FRAME_CONVERTER_H
+
+#include <mutex>
+#include <stddef.h>
+#include <stdint.h>
+
+extern "C"
+{
+#include <libavutil/frame.h>
+#include <libavutil/pixfmt.h>
+#include <libswscale/swscale.h>
+}
+
+/**
+ * Converts decoded frames into packed RGB/BGR images in memory owned by the caller.
+ *
+ * Everything that only depends on the frame size and formats, the SwsContext and the buffers
+ * hardware frames are downloaded into, is kept and reused until the stream changes,
+ * so converting the same stream over and over doesn't allocate any image memory.
+ */
+class FrameConverter
+{
+    public:
+        enum class Format
+        {
+            RGB24,
+            BGR24 // what OpenCV expects
+        };
+
+        /**
+         * @param threads for slicing the conversion, 0 for as many as there are cores
+         */
+        explicit FrameConverter(int threads = 0);
+        ~FrameConverter();
+
+        FrameConverter(const FrameConverter &) = delete;
+        FrameConverter &operator=(const FrameConverter &) = delete;
+
+        /**
+         * Convert frame into dst, downloading it first if it is a hardware frame.
+         * @param dst_linesize bytes from one row of dst to the next, at least 3 * frame->width
+         * @return nullptr on success, otherwise what went wrong
+         */
+        const char *Convert(const AVFrame *frame, Format format, uint8_t *dst, size_t dst_size, int dst_linesize);
+
+    private:
+        std::mutex mutex;
+        int threads;
+        SwsContext *sws = nullptr;
+        int sws_width = 0;
+        int sws_height = 0;
+        AVPixelFormat sws_src_format = AV_PIX_FMT_NONE;
+        AVPixelFormat sws_dst_format = AV_PIX_FMT_NONE;
+        AVFrame *download_frame = nullptr;
+        AVFrame *dst_frame = nullptr;
+
+        const AVFrame *Download(const AVFrame *frame);
+        bool UpdateContext(int width, int height, AVPixelFormat src_format, AVPixelFormat dst_format);
+};
+
+#endif // CHIAKI_PY_FRAME_CONVERTER_H
@@ -0,0 +1,92 @@
+#ifndef CHIAKI_PY_FRAME_STREAM_H
+#define CHIAKI_PY_FRAME_STREAM_H
+
+#include "py_av_frame.h"
+
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+class StreamSession;
+
+/**
+ * Pull the newest frame from the decoder of session, downloaded to system memory if it is a hardware frame,
+ * with its info filled in.
+ * @return nullptr if no new frame was decoded since the last call
+ * @throws ChiakiException if the session has no decoder or downloading failed
+ */
+std::unique_ptr<PyAVFrame> PullFrame(StreamSession *session);
+
+/**
+ * Hands the decoded frames of a session to Python through a bounded queue.
+ *
+ * The decoder thread only signals new frames, a thread of the stream pulls and downloads them,
+ * so neither decoding nor the network wait for Python. Next() blocks without needing the GIL.
+ * Only one stream can be attached to a session at a time, while it is,
+ * StreamSession::FfmpegFrameAvailable is not called anymore.
+ */
+class FrameStream
+{
+    public:
+        enum class Policy
+        {
+            Latest, // only keep the newest frame, for consumers that want to be as close to live as possible
+            Fifo // keep up to capacity frames in order, dropping the oldest when full
+        };
+
+        /**
+         * @throws ChiakiException if another stream is already attached to session
+         */
+        FrameStream(StreamSession *session, Policy policy, size_t capacity);
+        ~FrameStream();
+
+        FrameStream(const FrameStream &) = delete;
+        FrameStream &operator=(const FrameStream &) = delete;
+
+        /**
+         * Wait for the next frame.
+         * @param timeout_s negative to wait until there is one or the stream is closed
+         * @return nullptr on timeout or if the stream is closed
+         */
+        std::unique_ptr<PyAVFrame> Next(double timeout_s);
+
+        /**
+         * Detach from the session and stop the thread, frames still queued are dropped
+         * and pending calls of Next() return.
+         */
+        void Close();
+
+        bool IsClosed();
+        size_t GetPending();
+        uint64_t GetFramesDropped();
+
+        /**
+         * Called by the session from the decoder thread.
+         */
+        void FrameAvailable();
+
+    private:
+        StreamSession *session;
+        Policy policy;
+        size_t capacity;
+
+        std::mutex mutex;
+        std::condition_variable frame_cond;
+        std::condition_variable pull_cond;
+        bool pull_pending = false;
+        bool closed = false;
+        std::deque<std::unique_ptr<PyAVFrame>> frames;
+        uint64_t frames_dropped = 0;
+        // of frames dropped from the queue, added to the next one handed out
+        uint64_t carry_dropped = 0;
+        int32_t carry_lost = 0;
+        std::thread thread;
+
+        void Run();
+        void Push(std::unique_ptr<PyAVFrame> frame);
+        void Drop();
+};
+
+#endif // CHIAKI_PY_FRAME_STREAM_H
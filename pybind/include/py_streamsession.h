@@ -7,6 +7,7 @@
 #include <chiaki/opusdecoder.h>
 #include <chiaki/opusencoder.h>
 #include <chiaki/ffmpegdecoder.h>
+#include <chiaki/recorder.h>
 #include <string>
 #include <map>
 #include <vector>
@@ -23,6 +24,11 @@
 #include "py_settings.h"
 #include "py_timer.h"
 #include "py_elapsed_timer.h"
+#include "py_frame_converter.h"
+
+#include <mutex>
+
+class FrameStream;
 
 class KeyEvent {
     public:
@@ -45,6 +51,7 @@ struct StreamSessionConnectInfo
 	Decoder decoder;
 	std::string hw_decoder;
 	AVBufferRef *hw_device_ctx;
+	ChiakiFfmpegDecoderOptions decoder_options;
 	std::string audio_out_device;
 	std::string audio_in_device;
 	uint32_t log_level_mask;
@@ -153,6 +160,10 @@ class StreamSession
 		bool session_started;
 
 		ChiakiFfmpegDecoder *ffmpeg_decoder;
+		ChiakiRecorder *recorder;
+		FrameConverter frame_converter;
+		std::mutex frame_stream_mutex;
+		FrameStream *frame_stream = nullptr;
 		void TriggerFfmpegFrameAvailable();
 		std::string audio_out_device_name;
 		std::string audio_in_device_name;
@@ -189,6 +200,12 @@ class StreamSession
 		void GoToBed();
 		void SetLoginPIN(const std::string &pin);
 		void GoHome();
+		/**
+		 * Record the stream as it is received, the format follows the extension, .mkv or .mp4
+		 */
+		void StartRecording(const std::string &path);
+		void StopRecording();
+		ChiakiRecorderStats GetRecordingStats();
 		std::string GetHost() { return host; }
 		bool GetConnected() { return connected; }
 		double GetMeasuredBitrate()	{ return measured_bitrate; }
@@ -210,6 +227,20 @@ class StreamSession
             return controller_list;
         }
         ChiakiFfmpegDecoder *GetFfmpegDecoder()	{ return ffmpeg_decoder; }
+        FrameConverter *GetFrameConverter()	{ return &frame_converter; }
+        /**
+         * Hand new frames to stream instead of calling FfmpegFrameAvailable.
+         * @return false if another stream is attached
+         */
+        bool AttachFrameStream(FrameStream *stream);
+        /**
+         * Once this returns, stream is not called anymore.
+         */
+        void DetachFrameStream(FrameStream *stream);
+        /**
+         * @return index of the frame in the stream, see chiaki_session_video_sample_frame_index()
+         */
+        int32_t GetVideoSampleFrameIndex(uint64_t sample) { return chiaki_session_video_sample_frame_index(&session, sample); }
 
 		std::function<void()> FfmpegFrameAvailable;
         std::function<void(ChiakiQuitReason, const std::string &)> SessionQuit;
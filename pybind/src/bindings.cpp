@@ -3,6 +3,7 @@
 #include "py_streamsession.h"
 #include "py_settings.h"
 #include "py_av_frame.h"
+#include "py_frame_stream.h"
 
 #include <chiaki-pybind.h>
 #include <stdlib.h>
@@ -75,45 +76,22 @@ ChiakiErrorCode chiaki_pybind_wakeup_wrapper(PyChiakiLog &log, const std::string
     return chiaki_pybind_wakeup(log.get_raw_log(), host.c_str(), registkey.c_str(), ps5);
 }
 
-/*PyAVFrame get_frame(StreamSession &session, bool disable_zero_copy)
+// Hand the next frame to Python as it is, for reading its planes without converting or copying them.
+py::object pull_frame(StreamSession &session)
 {
-    PyAVFrame pyAvFrame;
-
-    ChiakiFfmpegDecoder *decoder = session.GetFfmpegDecoder();
-    if (!decoder)
+    std::unique_ptr<PyAVFrame> frame;
     {
-        // qCCritical(chiakiGui) << "Session has no FFmpeg decoder";
-        return pyAvFrame;
+        py::gil_scoped_release release;
+        frame = PullFrame(&session);
     }
-    int32_t frames_lost;
-    AVFrame *frame = chiaki_ffmpeg_decoder_pull_frame(decoder, &frames_lost);
     if (!frame)
-        // qCCritical(chiakiGui) << "Session has no FFmpeg decoder";
-        return pyAvFrame;
-
-    static const std::set<int> zero_copy_formats = { AV_PIX_FMT_VULKAN };
-
-    if (frame->hw_frames_ctx && (zero_copy_formats.find(frame->format) != zero_copy_formats.end() || disable_zero_copy))
-    {
-        AVFrame *sw_frame = av_frame_alloc();
-        if (av_hwframe_transfer_data(sw_frame, frame, 0) < 0)
-        {
-            // qCWarning(chiakiGui) << "Failed to transfer frame from hardware";
-            av_frame_unref(frame);
-            av_frame_free(&sw_frame);
-            return pyAvFrame;
-        }
-        av_frame_copy_props(sw_frame, frame);
-        av_frame_unref(frame);
-        frame = sw_frame;
-    }
-
-    pyAvFrame.frame = frame;
-    return pyAvFrame;
-}*/
+        return py::none();
+    return py::cast(std::move(frame));
+}
 
-// Function to return a NumPy array
-py::object get_frame(StreamSession &session, bool disable_zero_copy, py::array_t<uint8_t> target)
+// Convert the next frame into target, either of shape (height, width, 3) or at least that, or flat with room for height * width * 3 bytes.
+// Hardware frames are always downloaded, numpy can't look into them, disable_zero_copy only remains for compatibility.
+py::object get_frame(StreamSession &session, bool disable_zero_copy, py::array_t<uint8_t> target, FrameConverter::Format format)
 {
     // Retrieve the FFmpeg decoder
     ChiakiFfmpegDecoder *decoder = session.GetFfmpegDecoder();
@@ -123,125 +101,57 @@ py::object get_frame(StreamSession &session, bool disable_zero_copy, py::array_t
         return py::str("Session has no FFmpeg decoder");
     }
 
-    int32_t frames_lost;
-    AVFrame *frame = chiaki_ffmpeg_decoder_pull_frame(decoder, &frames_lost);
-    if (!frame)
+    py::buffer_info target_buf = target.request(true);
+    bool target_image = target_buf.ndim == 3;
+    if (target_image ? (target_buf.shape[2] != 3 || target_buf.strides[2] != 1 || target_buf.strides[1] != 3 || target_buf.strides[0] <= 0)
+                     : !(target.flags() & py::array::c_style))
     {
-        return py::str("Failed to pull frame from FFmpeg decoder");
+        return py::str("Target must be contiguous or of shape (height, width, 3) with packed rows");
     }
+    // rows of an image may be further apart than their width, e.g. in a view into a larger one
+    size_t target_size = target_image && target_buf.shape[0] > 0
+        ? static_cast<size_t>(target_buf.strides[0] * (target_buf.shape[0] - 1) + 3 * target_buf.shape[1])
+        : static_cast<size_t>(target_buf.size);
 
-    // Ensure proper cleanup if an error occurs
-    struct AVFrameGuard
+    const char *error = nullptr;
     {
-        AVFrame *frame;
-        ~AVFrameGuard() { av_frame_unref(frame); }
-    } frame_guard{frame};
-
-    // Handle hardware decoding cases
-    static const std::set<int> zero_copy_formats = {AV_PIX_FMT_VULKAN,
-                                                    AV_PIX_FMT_D3D11
-#ifdef __linux__
-                                                    ,
-                                                    AV_PIX_FMT_VAAPI
-#endif
-    };
-
-    if ((zero_copy_formats.find(frame->format) != zero_copy_formats.end() || disable_zero_copy))
-    {
-        AVFrame *sw_frame = av_frame_alloc();
-        if (!sw_frame)
-        {
-            return py::str("Failed to allocate software frame");
-        }
-
-        if (av_hwframe_transfer_data(sw_frame, frame, 0) < 0)
-        {
-            av_frame_free(&sw_frame);
-            return py::str("Failed to transfer frame from hardware (D3D11)");
-        }
-
-        av_frame_copy_props(sw_frame, frame);
-        av_frame_unref(frame);
-        frame = sw_frame;
-        frame_guard.frame = frame; // Ensure cleanup
-    }
-
-    if (frame->format == AV_PIX_FMT_NV12) {
-        // Step 1: Initialize SwsContext
-        struct SwsContext *sws_ctx = sws_getContext(
-            frame->width, frame->height, (AVPixelFormat)frame->format,
-            frame->width, frame->height, AV_PIX_FMT_RGB24,
-            SWS_BILINEAR, nullptr, nullptr, nullptr);
-
-        if (!sws_ctx)
-        {
-            av_frame_free(&frame);
-            return py::str("Failed to create SwsContext");
-        }
+        // pulling may wait for the decoder and converting takes a while, let other Python threads run meanwhile
+        py::gil_scoped_release release;
 
-        // Step 2: Allocate Target Frame
-        AVFrame *rgb_frame = av_frame_alloc();
-        if (!rgb_frame)
+        int32_t frames_lost;
+        AVFrame *frame = chiaki_ffmpeg_decoder_pull_frame(decoder, &frames_lost);
+        if (!frame)
         {
-            sws_freeContext(sws_ctx);
-            return py::str("Failed to allocate RGB frame");
+            error = "Failed to pull frame from FFmpeg decoder";
         }
-
-        rgb_frame->format = AV_PIX_FMT_RGB24;
-        rgb_frame->width = frame->width;
-        rgb_frame->height = frame->height;
-
-        if (av_image_alloc(rgb_frame->data, rgb_frame->linesize, rgb_frame->width,
-                        rgb_frame->height, AV_PIX_FMT_RGB24, 1) < 0)
+        else
         {
-            av_frame_free(&rgb_frame);
-            sws_freeContext(sws_ctx);
-            return py::str("Failed to allocate RGB image buffer");
+            // a larger image gets the frame in its top left corner
+            if (target_image && (target_buf.shape[0] < frame->height || target_buf.shape[1] < frame->width))
+                error = "Target is smaller than the frame";
+            else
+                error = session.GetFrameConverter()->Convert(frame, format,
+                        static_cast<uint8_t *>(target_buf.ptr), target_size,
+                        target_image ? static_cast<int>(target_buf.strides[0]) : 3 * frame->width);
+            chiaki_ffmpeg_frame_free(&frame);
         }
-
-        // Step 3: Perform the Conversion
-        sws_scale(
-            sws_ctx,
-            frame->data, frame->linesize, 0, frame->height,
-            rgb_frame->data, rgb_frame->linesize);
-
-        // Clean up the old frame and replace it with the new one
-        av_frame_free(&frame);
-        sws_freeContext(sws_ctx);
-        frame = rgb_frame;
-    }
-
-    // Ensure the frame is in a readable format
-    if (frame->format != AV_PIX_FMT_RGB24 && frame->format != AV_PIX_FMT_GRAY8 && frame->format != AV_PIX_FMT_YUV420P) // AV_PIX_FMT_D3D11
-    {
-        return py::str("Unsupported pixel format for NumPy conversion");
-    }
-
-    int height = frame->height;
-    int width = frame->width;
-    int channels = (frame->format == AV_PIX_FMT_RGB24 || frame->format == AV_PIX_FMT_YUV420P) ? 3 : 1;
-    int data_size = av_image_get_buffer_size((AVPixelFormat)frame->format, width, height, 1);
-
-    if (data_size <= 0)
-    {
-        return py::str("Failed to get image buffer size");
     }
 
-    // Copy data into a buffer
-    std::vector<uint8_t> buffer(data_size);
-    
-    // Request buffer info from the NumPy array
-    py::buffer_info array_buf = target.request();
-
-    av_image_copy_to_buffer(static_cast<uint8_t *>(array_buf.ptr), data_size, frame->data, frame->linesize, (AVPixelFormat)frame->format, width, height, 1);
-
-    return py::str("Success");
+    return py::str(error ? error : "Success");
 }
 
 PYBIND11_MODULE(chiaki_py, m)
 {
     m.doc() = "Python bindings for Chiaki CLI commands";
 
+    py::class_<PyAVFrameInfo>(m, "FrameInfo")
+        .def_readonly("frame_index", &PyAVFrameInfo::frame_index, "Index of the frame in the stream, -1 if unknown.")
+        .def_readonly("frames_lost", &PyAVFrameInfo::frames_lost, "Frames never received or dropped before decoding since the previous one.")
+        .def_readonly("frames_dropped", &PyAVFrameInfo::frames_dropped, "Frames decoded since the previous one, but replaced before being handed out.")
+        .def_readonly("arrival_us", &PyAVFrameInfo::arrival_us, "Monotonic time the frame was received, 0 if unknown.")
+        .def_readonly("decoded_us", &PyAVFrameInfo::decoded_us, "Monotonic time the frame was decoded, 0 if unknown.")
+        .def_readonly("pulled_us", &PyAVFrameInfo::pulled_us, "Monotonic time the frame was taken from the decoder.");
+
     py::class_<PyAVFrame>(m, "AVFrame")
         .def(py::init<>())
         .def("width", &PyAVFrame::width)
@@ -252,8 +162,27 @@ PYBIND11_MODULE(chiaki_py, m)
         .def("set_format", &PyAVFrame::set_format)
         .def("pts", &PyAVFrame::pts)
         .def("set_pts", &PyAVFrame::set_pts)
+        .def_readonly("info", &PyAVFrame::info)
+        .def("linesize", &PyAVFrame::linesize)
         .def("data", &PyAVFrame::data)
-        .def("to_numpy", &PyAVFrame::to_numpy, "Convert frame data to numpy array");
+        .def("to_numpy", &PyAVFrame::to_numpy, "Copy the rows of a plane into a numpy array of bytes.")
+        .def("plane_count", &PyAVFrame::plane_count)
+        .def("plane", &PyAVFrame::plane, py::arg("index"),
+             "Read-only numpy view of a plane, without copying. Stays valid after the frame is released.")
+        .def("planes", &PyAVFrame::planes, "Views of all planes, as by plane().")
+        .def("release", &PyAVFrame::release, "Drop the frame now, views that were already taken stay valid.")
+        .def("released", &PyAVFrame::released)
+        .def("__array__", [](PyAVFrame &f, py::object dtype, py::object copy)
+            {
+                py::object r = f.plane(0);
+                if (!dtype.is_none())
+                    r = r.attr("astype")(dtype);
+                else if (!copy.is_none() && copy.cast<bool>())
+                    r = r.attr("copy")();
+                return r;
+            }, py::arg("dtype") = py::none(), py::arg("copy") = py::none())
+        .def("__enter__", [](PyAVFrame &f) -> PyAVFrame & { return f; }, py::return_value_policy::reference)
+        .def("__exit__", [](PyAVFrame &f, py::args) { f.release(); });
 
     py::enum_<ChiakiErrorCode>(m, "ErrorCode")
         .value("SUCCESS", CHIAKI_ERR_SUCCESS)
@@ -353,11 +282,70 @@ PYBIND11_MODULE(chiaki_py, m)
           py::arg("ps5"),
           "Wakeup Chiaki device.");
 
+    py::enum_<FrameConverter::Format>(m, "FrameFormat")
+        .value("RGB24", FrameConverter::Format::RGB24)
+        .value("BGR24", FrameConverter::Format::BGR24)
+        .export_values();
+
+    m.def("pull_frame", &pull_frame,
+          py::arg("session"),
+          "Get the next frame from the session as an AVFrame whose planes can be viewed without copying, "
+          "or None if there is none. Use it as a context manager to give the frame back right after.");
+
+    py::enum_<FrameStream::Policy>(m, "FrameStreamPolicy")
+        .value("LATEST", FrameStream::Policy::Latest)
+        .value("FIFO", FrameStream::Policy::Fifo)
+        .export_values();
+
+    py::class_<FrameStream>(m, "FrameStream")
+        .def(py::init<StreamSession *, FrameStream::Policy, size_t>(),
+             py::arg("session"),
+             py::arg("policy") = FrameStream::Policy::Latest,
+             py::arg("capacity") = 8,
+             py::keep_alive<1, 2>(),
+             "Receive the frames of session on a native thread into a queue of up to capacity frames. "
+             "Only one stream can be open per session.")
+        .def("next_frame", [](FrameStream &stream, std::optional<double> timeout) -> py::object
+            {
+                std::unique_ptr<PyAVFrame> frame;
+                {
+                    py::gil_scoped_release release;
+                    frame = stream.Next(timeout ? *timeout : -1.0);
+                }
+                if (!frame)
+                    return py::none();
+                return py::cast(std::move(frame));
+            },
+             py::arg("timeout") = py::none(),
+             "Wait up to timeout seconds, forever if None, for the next frame without holding the GIL. "
+             "Returns None on timeout or when the stream is closed.")
+        .def("close", &FrameStream::Close, py::call_guard<py::gil_scoped_release>())
+        .def_property_readonly("closed", &FrameStream::IsClosed)
+        .def_property_readonly("pending", &FrameStream::GetPending, "Frames waiting in the queue.")
+        .def_property_readonly("frames_dropped", &FrameStream::GetFramesDropped,
+                               "Decoded frames that were never handed out, replaced in the decoder or dropped from the queue.")
+        .def("__iter__", [](FrameStream &stream) -> FrameStream & { return stream; }, py::return_value_policy::reference_internal)
+        .def("__next__", [](FrameStream &stream)
+            {
+                std::unique_ptr<PyAVFrame> frame;
+                {
+                    py::gil_scoped_release release;
+                    frame = stream.Next(-1.0);
+                }
+                if (!frame)
+                    throw py::stop_iteration();
+                return frame;
+            })
+        .def("__enter__", [](FrameStream &stream) -> FrameStream & { return stream; }, py::return_value_policy::reference_internal)
+        .def("__exit__", [](FrameStream &stream, py::args) { py::gil_scoped_release release; stream.Close(); });
+
     m.def("get_frame", &get_frame,
           py::arg("session"),
           py::arg("disable_zero_copy"),
           py::arg("target"),
-          "Get the next frame from the session.");
+          py::arg("format") = FrameConverter::Format::RGB24,
+          "Convert the next frame from the session into target, a uint8 array of shape (height, width, 3). "
+          "Use FrameFormat.BGR24 for OpenCV.");
 
     py::class_<ChiakiConnectVideoProfile>(m, "ChiakiConnectVideoProfile")
         .def(py::init<>())
@@ -510,6 +498,15 @@ PYBIND11_MODULE(chiaki_py, m)
              py::arg("zoom"),
              py::arg("stretch"));
 
+    py::class_<ChiakiRecorderStats>(m, "RecorderStats")
+        .def_readonly("recording", &ChiakiRecorderStats::recording)
+        .def_readonly("failed", &ChiakiRecorderStats::failed)
+        .def_readonly("video_frames", &ChiakiRecorderStats::video_frames)
+        .def_readonly("audio_frames", &ChiakiRecorderStats::audio_frames)
+        .def_readonly("bytes", &ChiakiRecorderStats::bytes)
+        .def_readonly("packets_dropped", &ChiakiRecorderStats::packets_dropped)
+        .def_readonly("duration_us", &ChiakiRecorderStats::duration_us);
+
     py::class_<StreamSession>(m, "StreamSession")
         .def(py::init<const StreamSessionConnectInfo &>(), py::arg("connect_info"))
         .def("start", &StreamSession::Start)
@@ -517,6 +514,9 @@ PYBIND11_MODULE(chiaki_py, m)
         .def("go_to_bed", &StreamSession::GoToBed)
         .def("set_login_pin", &StreamSession::SetLoginPIN)
         .def("go_home", &StreamSession::GoHome)
+        .def("start_recording", &StreamSession::StartRecording, py::arg("path"), "Record the stream as received, without re-encoding, to an .mkv or .mp4 file.")
+        .def("stop_recording", &StreamSession::StopRecording, py::call_guard<py::gil_scoped_release>())
+        .def("get_recording_stats", &StreamSession::GetRecordingStats)
         .def("get_host", &StreamSession::GetHost)
         .def("is_connected", &StreamSession::IsConnected)
         .def("is_connecting", &StreamSession::IsConnecting)
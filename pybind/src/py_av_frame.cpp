@@ -1,27 +1,58 @@
 #include "py_av_frame.h"
 
+#include <chiaki/ffmpegdecoder.h>
+
+#include <algorithm>
+#include <vector>
+
+extern "C"
+{
+#include <libavutil/buffer.h>
+#include <libavutil/pixdesc.h>
+}
+
 PyAVFrame::PyAVFrame()
 {
-    frame = av_frame_alloc();
+    frame = chiaki_ffmpeg_frame_alloc();
     if (!frame)
     {
         throw std::runtime_error("Failed to allocate AVFrame");
     }
 }
 
+PyAVFrame::PyAVFrame(AVFrame *frame)
+    : frame(frame)
+{
+}
+
 PyAVFrame::~PyAVFrame()
 {
-    if (frame)
-    {
-        av_frame_free(&frame);
-    }
+    release();
+}
+
+void PyAVFrame::release()
+{
+    chiaki_ffmpeg_frame_free(&frame);
+}
+
+int PyAVFrame::linesize(int index) const
+{
+    if (index < 0 || index >= AV_NUM_DATA_POINTERS)
+        throw std::out_of_range("Invalid data index");
+    return Frame()->linesize[index];
+}
+
+int PyAVFrame::plane_count() const
+{
+    int count = av_pix_fmt_count_planes((AVPixelFormat)Frame()->format);
+    return count > 0 ? count : 0;
 }
 
 py::bytes PyAVFrame::data(int index)
 {
     if (index < 0 || index >= AV_NUM_DATA_POINTERS)
         throw std::out_of_range("Invalid data index");
-    return py::bytes(reinterpret_cast<const char *>(frame->data[index]), frame->linesize[index]);
+    return py::bytes(reinterpret_cast<const char *>(Frame()->data[index]), frame->linesize[index]);
 }
 
 py::array_t<uint8_t> PyAVFrame::to_numpy(int index)
@@ -29,7 +60,7 @@ py::array_t<uint8_t> PyAVFrame::to_numpy(int index)
     if (index < 0 || index >= AV_NUM_DATA_POINTERS)
         throw std::out_of_range("Invalid data index");
 
-    int height = frame->height;
+    int height = Frame()->height;
     int width = frame->linesize[index]; // Usually bytes per line, but depends on format
     if (height == 0 || width == 0)
     {
@@ -40,4 +71,81 @@ py::array_t<uint8_t> PyAVFrame::to_numpy(int index)
         {height, width},
         {static_cast<size_t>(frame->linesize[index]), sizeof(uint8_t)},
         frame->data[index]);
-}
\ No newline at end of file
+}
+
+py::array PyAVFrame::plane(int index)
+{
+    Frame(); // throws if released
+    const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get((AVPixelFormat)frame->format);
+    if (!desc || (desc->flags & (AV_PIX_FMT_FLAG_HWACCEL | AV_PIX_FMT_FLAG_BITSTREAM | AV_PIX_FMT_FLAG_PAL)))
+        throw std::runtime_error("Frame has no planes that can be viewed");
+    if (index < 0 || index >= av_pix_fmt_count_planes((AVPixelFormat)frame->format))
+        throw std::out_of_range("Invalid plane index");
+
+    AVBufferRef *buf = av_frame_get_plane_buffer(frame, index);
+    if (!buf)
+        throw std::runtime_error("Plane is not backed by a buffer");
+
+    int components = 0;
+    int step = 0;
+    int depth = 0;
+    bool uniform = true;
+    for (int i = 0; i < desc->nb_components; i++)
+    {
+        const AVComponentDescriptor &comp = desc->comp[i];
+        if (comp.plane != index)
+            continue;
+        uniform = uniform && (!components || comp.step == step);
+        components++;
+        step = comp.step;
+        depth = std::max(depth, comp.depth + comp.shift);
+    }
+    py::ssize_t itemsize = depth > 8 ? 2 : 1;
+
+    bool chroma = (index == 1 || index == 2) && !(desc->flags & AV_PIX_FMT_FLAG_RGB);
+    py::ssize_t height = chroma ? AV_CEIL_RSHIFT(frame->height, desc->log2_chroma_h) : frame->height;
+    py::ssize_t width = chroma ? AV_CEIL_RSHIFT(frame->width, desc->log2_chroma_w) : frame->width;
+
+    std::vector<py::ssize_t> shape;
+    std::vector<py::ssize_t> strides;
+    if (uniform && step == components * itemsize && !(desc->flags & AV_PIX_FMT_FLAG_FLOAT) && depth <= 16)
+    {
+        shape = {height, width};
+        strides = {frame->linesize[index], step};
+        if (components > 1)
+        {
+            shape.push_back(components);
+            strides.push_back(itemsize);
+        }
+    }
+    else
+    {
+        // components not lined up in whole items, e.g. RGB565 or YUYV, so just the bytes of each row
+        itemsize = 1;
+        shape = {height, av_image_get_linesize((AVPixelFormat)frame->format, frame->width, index)};
+        strides = {frame->linesize[index], 1};
+    }
+    py::dtype dtype = itemsize == 2 ? py::dtype::of<uint16_t>() : py::dtype::of<uint8_t>();
+
+    // the view holds its own reference, independent of this object
+    AVBufferRef *ref = av_buffer_ref(buf);
+    if (!ref)
+        throw std::runtime_error("Failed to reference plane buffer");
+    py::capsule base(ref, [](void *p) {
+        AVBufferRef *ref = static_cast<AVBufferRef *>(p);
+        av_buffer_unref(&ref);
+    });
+
+    py::array view(dtype, shape, strides, frame->data[index], base);
+    view.attr("setflags")(py::arg("write") = false);
+    return view;
+}
+
+py::list PyAVFrame::planes()
+{
+    py::list r;
+    int count = plane_count();
+    for (int i = 0; i < count; i++)
+        r.append(plane(i));
+    return r;
+}
@@ -0,0 +1,147 @@
+#include "py_frame_converter.h"
+
+extern "C"
+{
+#include <libavutil/buffer.h>
+#include <libavutil/hwcontext.h>
+#include <libavutil/opt.h>
+}
+
+// sws_scale() only ever uses a single thread, slice threading needs the threads option and sws_scale_frame()
+#define SWS_SLICE_THREADS (LIBSWSCALE_VERSION_INT >= AV_VERSION_INT(6, 1, 100))
+
+#if SWS_SLICE_THREADS
+static void dst_buffer_free(void *opaque, uint8_t *data)
+{
+    // owned by the caller of Convert()
+}
+#endif
+
+FrameConverter::FrameConverter(int threads)
+    : threads(threads)
+{
+}
+
+FrameConverter::~FrameConverter()
+{
+    sws_freeContext(sws);
+    av_frame_free(&download_frame);
+    av_frame_free(&dst_frame);
+}
+
+const AVFrame *FrameConverter::Download(const AVFrame *frame)
+{
+    if (!frame->hw_frames_ctx)
+        return frame;
+
+    auto hw_frames = reinterpret_cast<AVHWFramesContext *>(frame->hw_frames_ctx->data);
+    if (download_frame && (download_frame->width != frame->width
+            || download_frame->height != frame->height
+            || download_frame->format != hw_frames->sw_format))
+        av_frame_free(&download_frame);
+
+    if (!download_frame)
+    {
+        download_frame = av_frame_alloc();
+        if (!download_frame)
+            return nullptr;
+        download_frame->width = frame->width;
+        download_frame->height = frame->height;
+        download_frame->format = hw_frames->sw_format;
+        if (av_frame_get_buffer(download_frame, 0) < 0)
+        {
+            av_frame_free(&download_frame);
+            return nullptr;
+        }
+    }
+
+    // transfers into the existing buffers of download_frame
+    if (av_hwframe_transfer_data(download_frame, frame, 0) < 0)
+    {
+        av_frame_free(&download_frame);
+        return nullptr;
+    }
+    return download_frame;
+}
+
+bool FrameConverter::UpdateContext(int width, int height, AVPixelFormat src_format, AVPixelFormat dst_format)
+{
+    if (sws && width == sws_width && height == sws_height && src_format == sws_src_format && dst_format == sws_dst_format)
+        return true;
+
+    sws_freeContext(sws);
+#if SWS_SLICE_THREADS
+    sws = sws_alloc_context();
+    if (sws)
+    {
+        av_opt_set_int(sws, "srcw", width, 0);
+        av_opt_set_int(sws, "srch", height, 0);
+        av_opt_set_int(sws, "src_format", src_format, 0);
+        av_opt_set_int(sws, "dstw", width, 0);
+        av_opt_set_int(sws, "dsth", height, 0);
+        av_opt_set_int(sws, "dst_format", dst_format, 0);
+        av_opt_set_int(sws, "sws_flags", SWS_BILINEAR, 0);
+        av_opt_set_int(sws, "threads", threads, 0);
+        if (sws_init_context(sws, nullptr, nullptr) < 0)
+        {
+            sws_freeContext(sws);
+            sws = nullptr;
+        }
+    }
+#else
+    sws = sws_getContext(width, height, src_format, width, height, dst_format, SWS_BILINEAR, nullptr, nullptr, nullptr);
+#endif
+    if (!sws)
+    {
+        sws_src_format = sws_dst_format = AV_PIX_FMT_NONE;
+        return false;
+    }
+
+    sws_width = width;
+    sws_height = height;
+    sws_src_format = src_format;
+    sws_dst_format = dst_format;
+    return true;
+}
+
+const char *FrameConverter::Convert(const AVFrame *frame, Format format, uint8_t *dst, size_t dst_size, int dst_linesize)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+
+    if (frame->width <= 0 || frame->height <= 0)
+        return "Frame has no size";
+    if (dst_linesize < 3 * frame->width || dst_size < (size_t)dst_linesize * (frame->height - 1) + 3 * frame->width)
+        return "Target is too small for the frame";
+
+    const AVFrame *src = Download(frame);
+    if (!src)
+        return "Failed to transfer frame from hardware";
+
+    AVPixelFormat dst_format = format == Format::BGR24 ? AV_PIX_FMT_BGR24 : AV_PIX_FMT_RGB24;
+    if (!UpdateContext(src->width, src->height, (AVPixelFormat)src->format, dst_format))
+        return "Unsupported pixel format for conversion";
+
+#if SWS_SLICE_THREADS
+    if (!dst_frame && !(dst_frame = av_frame_alloc()))
+        return "Failed to allocate target frame";
+    // sws_scale_frame() only writes into frames it can reference, so wrap dst without taking it over
+    dst_frame->buf[0] = av_buffer_create(dst, dst_size, dst_buffer_free, nullptr, 0);
+    if (!dst_frame->buf[0])
+        return "Failed to allocate target frame";
+    dst_frame->data[0] = dst;
+    dst_frame->linesize[0] = dst_linesize;
+    dst_frame->width = src->width;
+    dst_frame->height = src->height;
+    dst_frame->format = dst_format;
+    int r = sws_scale_frame(sws, dst_frame, src);
+    av_frame_unref(dst_frame);
+    if (r < 0)
+        return "Failed to convert frame";
+#else
+    uint8_t *dst_data[4] = { dst, nullptr, nullptr, nullptr };
+    int dst_linesizes[4] = { dst_linesize, 0, 0, 0 };
+    if (sws_scale(sws, src->data, src->linesize, 0, src->height, dst_data, dst_linesizes) <= 0)
+        return "Failed to convert frame";
+#endif
+    return nullptr;
+}
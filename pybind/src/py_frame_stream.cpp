@@ -0,0 +1,180 @@
+#include "py_frame_stream.h"
+#include "py_streamsession.h"
+
+#include <chiaki/ffmpegdecoder.h>
+#include <chiaki/log.h>
+#include <chiaki/time.h>
+
+#include <chrono>
+
+extern "C"
+{
+#include <libavutil/hwcontext.h>
+}
+
+std::unique_ptr<PyAVFrame> PullFrame(StreamSession *session)
+{
+    ChiakiFfmpegDecoder *decoder = session->GetFfmpegDecoder();
+    if (!decoder)
+        throw ChiakiException("Session has no FFmpeg decoder");
+
+    int32_t frames_lost;
+    ChiakiFfmpegDecoderFrameStats stats;
+    AVFrame *frame = chiaki_ffmpeg_decoder_pull_frame_stats(decoder, &frames_lost, &stats);
+    if (!frame)
+        return nullptr;
+
+    if (frame->hw_frames_ctx)
+    {
+        AVFrame *sw_frame = chiaki_ffmpeg_frame_alloc();
+        if (!sw_frame || av_hwframe_transfer_data(sw_frame, frame, 0) < 0)
+        {
+            chiaki_ffmpeg_frame_free(&sw_frame);
+            chiaki_ffmpeg_frame_free(&frame);
+            throw ChiakiException("Failed to transfer frame from hardware");
+        }
+        av_frame_copy_props(sw_frame, frame);
+        chiaki_ffmpeg_frame_free(&frame);
+        frame = sw_frame;
+    }
+
+    std::unique_ptr<PyAVFrame> r(new PyAVFrame(frame));
+    r->info.frames_lost = frames_lost;
+    r->info.frames_dropped = stats.frames_replaced;
+    r->info.arrival_us = stats.enqueue_us;
+    r->info.decoded_us = stats.decoded_us;
+    r->info.pulled_us = chiaki_time_now_monotonic_us();
+    if (stats.enqueue_us)
+        r->info.frame_index = session->GetVideoSampleFrameIndex(stats.sample);
+    return r;
+}
+
+FrameStream::FrameStream(StreamSession *session, Policy policy, size_t capacity)
+    : session(session),
+      policy(policy),
+      capacity(capacity ? capacity : 1)
+{
+    if (!session->AttachFrameStream(this))
+        throw ChiakiException("Another frame stream is already attached to the session");
+    thread = std::thread(&FrameStream::Run, this);
+}
+
+FrameStream::~FrameStream()
+{
+    Close();
+}
+
+void FrameStream::Close()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (closed)
+            return;
+        closed = true;
+        frames.clear();
+    }
+    // once this returns, FrameAvailable() is not called anymore
+    session->DetachFrameStream(this);
+    pull_cond.notify_all();
+    frame_cond.notify_all();
+    if (thread.joinable())
+        thread.join();
+}
+
+bool FrameStream::IsClosed()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return closed;
+}
+
+size_t FrameStream::GetPending()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return frames.size();
+}
+
+uint64_t FrameStream::GetFramesDropped()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return frames_dropped;
+}
+
+void FrameStream::FrameAvailable()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        pull_pending = true;
+    }
+    pull_cond.notify_one();
+}
+
+void FrameStream::Run()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true)
+    {
+        pull_cond.wait(lock, [this] { return pull_pending || closed; });
+        if (closed)
+            break;
+        pull_pending = false;
+        lock.unlock();
+
+        // the decoder only keeps the newest frame, frames decoded while this one is downloaded set pull_pending again
+        std::unique_ptr<PyAVFrame> frame;
+        try
+        {
+            frame = PullFrame(session);
+        }
+        catch (const Exception &e)
+        {
+            CHIAKI_LOGE(session->GetChiakiLog(), "Frame stream failed to pull frame: %s", e.what());
+        }
+
+        lock.lock();
+        if (frame && !closed)
+            Push(std::move(frame));
+    }
+}
+
+void FrameStream::Drop()
+{
+    const PyAVFrameInfo &info = frames.front()->info;
+    carry_dropped += info.frames_dropped + 1;
+    carry_lost += info.frames_lost;
+    frames_dropped++;
+    frames.pop_front();
+}
+
+void FrameStream::Push(std::unique_ptr<PyAVFrame> frame)
+{
+    frames_dropped += frame->info.frames_dropped;
+    if (policy == Policy::Latest)
+    {
+        while (!frames.empty())
+            Drop();
+    }
+    else if (frames.size() >= capacity)
+        Drop();
+    frames.push_back(std::move(frame));
+    frame_cond.notify_one();
+}
+
+std::unique_ptr<PyAVFrame> FrameStream::Next(double timeout_s)
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    auto ready = [this] { return !frames.empty() || closed; };
+    if (timeout_s < 0)
+        frame_cond.wait(lock, ready);
+    else if (!frame_cond.wait_for(lock, std::chrono::duration<double>(timeout_s), ready))
+        return nullptr;
+    if (closed)
+        return nullptr;
+
+    std::unique_ptr<PyAVFrame> frame = std::move(frames.front());
+    frames.pop_front();
+    frame->info.frames_dropped += carry_dropped;
+    frame->info.frames_lost += carry_lost;
+    carry_dropped = 0;
+    carry_lost = 0;
+    return frame;
+}
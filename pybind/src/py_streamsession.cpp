@@ -3,6 +3,7 @@
 #include "py_streamsession.h"
 #include "py_settings.h"
 #include "py_controllermanager.h"
+#include "py_frame_stream.h"
 
 #include <chiaki/base64.h>
 #include <chiaki/streamconnection.h>
@@ -91,6 +92,7 @@ StreamSessionConnectInfo::StreamSessionConnectInfo(
     decoder = settings->GetDecoder();
     hw_decoder = settings->GetHardwareDecoder();
     hw_device_ctx = nullptr;
+    chiaki_ffmpeg_decoder_options_default(&decoder_options);
     audio_out_device = settings->GetAudioOutDevice();
     audio_in_device = settings->GetAudioInDevice();
     log_level_mask = settings->GetLogLevelMask();
@@ -190,6 +192,7 @@ std::vector<uint8_t> fromBase64(const std::string &base64Str)
 StreamSession::StreamSession(const StreamSessionConnectInfo &connect_info)
     : log(this, connect_info.log_level_mask, connect_info.log_file),
       ffmpeg_decoder(nullptr),
+      recorder(nullptr),
       haptics_handheld(0),
       session_started(false),
       haptics_resampler_buf(nullptr),
@@ -222,7 +225,7 @@ StreamSession::StreamSession(const StreamSessionConnectInfo &connect_info)
                                         chiaki_log_sniffer_get_log(&sniffer),
                                         chiaki_target_is_ps5(connect_info.target) ? connect_info.video_profile.codec : CHIAKI_CODEC_H264,
                                         connect_info.hw_decoder.empty() ? NULL : connect_info.hw_decoder.c_str(),
-                                        connect_info.hw_device_ctx, FfmpegFrameCb, this);
+                                        connect_info.hw_device_ctx, FfmpegFrameCb, this, &connect_info.decoder_options);
     if (err != CHIAKI_ERR_SUCCESS)
     {
         std::string log = std::string(chiaki_log_sniffer_get_buffer(&sniffer));
@@ -236,7 +239,9 @@ StreamSession::StreamSession(const StreamSessionConnectInfo &connect_info)
     audio_out_device_name = connect_info.audio_out_device;
     audio_in_device_name = connect_info.audio_in_device;
 
-    chiaki_opus_decoder_init(&opus_decoder, log.GetChiakiLog());
+    err = chiaki_opus_decoder_init(&opus_decoder, log.GetChiakiLog());
+    if (err != CHIAKI_ERR_SUCCESS)
+        throw ChiakiException("Failed to initialize Opus Decoder: " + fromLocal8Bit(chiaki_error_string(err)));
     chiaki_opus_encoder_init(&opus_encoder, log.GetChiakiLog());
     audio_buffer_size = connect_info.audio_buffer_size;
 
@@ -341,6 +346,11 @@ StreamSession::StreamSession(const StreamSessionConnectInfo &connect_info)
     }
     chiaki_session_set_video_sample_cb(&session, chiaki_ffmpeg_decoder_video_sample_cb, ffmpeg_decoder);
 
+    recorder = chiaki_recorder_new(GetChiakiLog(), session.metrics);
+    if (!recorder)
+        throw ChiakiException("Failed to create recorder");
+    chiaki_session_set_recorder(&session, recorder);
+
     chiaki_session_set_event_cb(&session, EventCb, this);
     key_map = connect_info.key_map;
     if (connect_info.enable_dualsense)
@@ -379,6 +389,7 @@ StreamSession::~StreamSession()
     if (session_started)
         chiaki_session_join(&session);
     chiaki_session_fini(&session);
+    chiaki_recorder_free(recorder);
     chiaki_opus_decoder_fini(&opus_decoder);
     chiaki_opus_encoder_fini(&opus_encoder);
     if (ffmpeg_decoder)
@@ -441,6 +452,25 @@ void StreamSession::GoHome()
     chiaki_session_go_home(&session);
 }
 
+void StreamSession::StartRecording(const std::string &path)
+{
+    ChiakiErrorCode err = chiaki_recorder_start(recorder, path.c_str(), chiaki_recorder_format_from_path(path.c_str()));
+    if (err != CHIAKI_ERR_SUCCESS)
+        throw ChiakiException("Failed to start recording: " + std::string(chiaki_error_string(err)));
+}
+
+void StreamSession::StopRecording()
+{
+    chiaki_recorder_stop(recorder);
+}
+
+ChiakiRecorderStats StreamSession::GetRecordingStats()
+{
+    ChiakiRecorderStats stats;
+    chiaki_recorder_get_stats(recorder, &stats);
+    return stats;
+}
+
 void StreamSession::Event(ChiakiEvent *event)
 {
     switch (event->type)
@@ -585,9 +615,33 @@ void StreamSession::CancelPsnConnection(bool stop_thread)
     chiaki_holepunch_main_thread_cancel(holepunch_session, stop_thread);
 }
 
+bool StreamSession::AttachFrameStream(FrameStream *stream)
+{
+    std::lock_guard<std::mutex> lock(frame_stream_mutex);
+    if (frame_stream)
+        return false;
+    frame_stream = stream;
+    return true;
+}
+
+void StreamSession::DetachFrameStream(FrameStream *stream)
+{
+    std::lock_guard<std::mutex> lock(frame_stream_mutex);
+    if (frame_stream == stream)
+        frame_stream = nullptr;
+}
+
 void StreamSession::TriggerFfmpegFrameAvailable()
 {
-    FfmpegFrameAvailable();
+    bool streamed;
+    {
+        std::lock_guard<std::mutex> lock(frame_stream_mutex);
+        streamed = frame_stream != nullptr;
+        if (streamed)
+            frame_stream->FrameAvailable();
+    }
+    if (!streamed && FfmpegFrameAvailable)
+        FfmpegFrameAvailable();
     if (measured_bitrate != session.stream_connection.measured_bitrate)
     {
         measured_bitrate = session.stream_connection.measured_bitrate;
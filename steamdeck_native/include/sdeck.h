@@ -104,6 +104,15 @@ typedef struct sdeck_event_t
 
 typedef void (*SDeckEventCb)(SDeckEvent *event, void *user);
 
+// CPU cost of the haptics analysis done by play_pcm_haptic()
+typedef struct sdeck_haptic_stats_t
+{
+    uint64_t blocks;
+    uint64_t total_ns;
+    uint32_t last_ns;
+    uint32_t max_ns;
+} SDeckHapticStats;
+
 SDeck *sdeck_new();
 void sdeck_free(SDeck *sdeck);
 void sdeck_read(SDeck *sdeck, SDeckEventCb cb, void *user);
@@ -112,6 +121,7 @@ int sdeck_haptic_ratio(SDeck *sdeck, uint8_t position, double frequency, uint32_
 int send_haptic(SDeck* sdeck, uint8_t position, uint16_t period_high, uint16_t period_low, uint16_t repeat_count);
 int sdeck_haptic_init(SDeck * sdeck, int samples);
 int play_pcm_haptic(SDeck *sdeck, uint8_t position, int16_t *buf, const int32_t num_elements, const int sampling_rate);
+int sdeck_haptic_get_stats(SDeck *sdeck, SDeckHapticStats *stats);
 
 #ifdef __cplusplus
 }
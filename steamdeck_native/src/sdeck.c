@@ -6,7 +6,13 @@
 #include <hidapi.h>
 #include <math.h>
 #include <unistd.h>
+#include <time.h>
 #include <fftw3.h>
+
+#if defined(__SSE__) || defined(_M_X64)
+#include <xmmintrin.h>
+#define SDECK_GOERTZEL_SSE 1
+#endif
 #define ENABLE_LOG
 
 #ifdef ENABLE_LOG
@@ -34,13 +40,28 @@
 #define STEAM_DECK_HAPTIC_INTENSITY 0.38f
 #define STEAM_DECK_CUTOFF_FREQ 250.0f
 #define STEAM_DECK_HAPTIC_SAMPLING_FREQ 3000.0f
-
+// upper end of the analysed band, content above is already attenuated by the low pass
+#define STEAM_DECK_ANALYSIS_MAX_FREQ (2.0f * STEAM_DECK_CUTOFF_FREQ)
+#define STEAM_DECK_TRACKPADS 2
+
+/*
+ * Finds the dominant frequency of a block of haptics with a bank of Goertzel filters,
+ * one per bin of a 2N point DFT (the resolution of the zero padded FFT this replaces)
+ * between 0 and STEAM_DECK_ANALYSIS_MAX_FREQ.
+ * Everything is allocated up front and the work per block only depends on N and the
+ * number of bins, so analysis runs in a fixed time.
+ */
 typedef struct freq_t
 {
 	int N;
-	fftw_plan fft;
-	double *hann, *butterworth, *pcm_data;
-	fftw_complex *freq_data;
+	int bins; // bins 1..bins, multiple of 4 for the SIMD path
+	float *hann;
+	float *coef; // 2cos(2 pi k / 2N) for bin k + 1
+	float *data;
+	float *power;
+	float butterworth[5];
+	float lpf_state[STEAM_DECK_TRACKPADS][4]; // x[n-1], x[n-2], y[n-1], y[n-2], carried across blocks
+	SDeckHapticStats stats;
 } FreqFinder;
 
 struct sdeck_t
@@ -59,8 +80,8 @@ void calc_powers(fftw_complex *data, int N);
 void max_power_freq(const int N, const double sampling_rate, double *frequency, double *freq_power, fftw_complex *power);
 void generate_event(SDeck *sdeck, SDeckEventType type, SDeckEventCb cb, void *user);
 double * butterworth_init();
-void lpf_apply(double * pcm_data, double * butterworth, int N);
 FreqFinder *freqfinder_new(int samples);
+void freqfinder_free(FreqFinder *freqfinder);
 
 SDeck *sdeck_new()
 {
@@ -91,6 +112,10 @@ SDeck *sdeck_new()
 
 int sdeck_haptic_init(SDeck *sdeck, int samples)
 {
+	// reconnecting with the same block size keeps everything that was set up before
+	if (sdeck->freqfinder && sdeck->freqfinder->N == samples)
+		return 0;
+	freqfinder_free(sdeck->freqfinder);
 	sdeck->freqfinder = freqfinder_new(samples);
 	if (!sdeck->freqfinder)
 		return -1;
@@ -99,27 +124,58 @@ int sdeck_haptic_init(SDeck *sdeck, int samples)
 
 FreqFinder *freqfinder_new(int samples)
 {
-	FreqFinder *freqfinder = fftw_malloc(sizeof(FreqFinder));
+	if (samples < 2)
+		return NULL;
+	FreqFinder *freqfinder = calloc(1, sizeof(FreqFinder));
+	if (!freqfinder)
+		return NULL;
 	freqfinder->N = samples;
-	freqfinder->hann = hann_init(samples);
-	freqfinder->butterworth = butterworth_init();
-	freqfinder->pcm_data = fftw_malloc(2 * samples * sizeof(double));
-	freqfinder->freq_data = fftw_malloc((samples + 1) * sizeof(fftw_complex));
-	freqfinder->fft = fftw_plan_dft_r2c_1d(2 * samples, freqfinder->pcm_data, freqfinder->freq_data, FFTW_MEASURE);
+	int bins = (int)(STEAM_DECK_ANALYSIS_MAX_FREQ * 2 * samples / STEAM_DECK_HAPTIC_SAMPLING_FREQ);
+	if (bins > samples)
+		bins = samples;
+	freqfinder->bins = (bins + 3) & ~3;
+	freqfinder->hann = fftw_malloc(samples * sizeof(float));
+	freqfinder->data = fftw_malloc(samples * sizeof(float));
+	freqfinder->coef = fftw_malloc(freqfinder->bins * sizeof(float));
+	freqfinder->power = fftw_malloc(freqfinder->bins * sizeof(float));
+	if (!freqfinder->hann || !freqfinder->data || !freqfinder->coef || !freqfinder->power)
+	{
+		freqfinder_free(freqfinder);
+		return NULL;
+	}
+	for (int i = 0; i < samples; i++)
+		freqfinder->hann[i] = (float)(0.5 * (1 - cos(2 * M_PI * i / (samples - 1))));
+	for (int k = 0; k < freqfinder->bins; k++)
+		freqfinder->coef[k] = (float)(2.0 * cos(M_PI * (k + 1) / samples));
+	double *butterworth = butterworth_init();
+	if (!butterworth)
+	{
+		freqfinder_free(freqfinder);
+		return NULL;
+	}
+	for (int i = 0; i < 5; i++)
+		freqfinder->butterworth[i] = (float)butterworth[i];
+	fftw_free(butterworth);
 	return freqfinder;
 }
 
-void haptic_free(FreqFinder *freqfinder)
+void freqfinder_free(FreqFinder *freqfinder)
 {
-	fftw_destroy_plan(freqfinder->fft);
-
+	if (!freqfinder)
+		return;
 	fftw_free(freqfinder->hann);
-	fftw_free(freqfinder->butterworth);
-	fftw_free(freqfinder->pcm_data);
-	fftw_free(freqfinder->freq_data);
-	fftw_free(freqfinder);
+	fftw_free(freqfinder->data);
+	fftw_free(freqfinder->coef);
+	fftw_free(freqfinder->power);
+	free(freqfinder);
+}
 
-	fftw_cleanup();
+int sdeck_haptic_get_stats(SDeck *sdeck, SDeckHapticStats *stats)
+{
+	if (!sdeck->freqfinder)
+		return -1;
+	*stats = sdeck->freqfinder->stats;
+	return 0;
 }
 
 void sdeck_free(SDeck *sdeck)
@@ -128,8 +184,7 @@ void sdeck_free(SDeck *sdeck)
 		return;
 	hid_close(sdeck->hiddev);
 	hid_exit();
-	if (sdeck->freqfinder)
-		haptic_free(sdeck->freqfinder);
+	freqfinder_free(sdeck->freqfinder);
 	free(sdeck);
 }
 
@@ -239,17 +294,24 @@ double *butterworth_init()
 	return butterworth;
 }
 
-void lpf_apply(double *buf, double * butterworth, int buf_count)
+static void lpf_window_apply(FreqFinder *freqfinder, const int16_t *buf, float *state)
 {
-	double holder_buffer[buf_count];
-	holder_buffer[0] = buf[0];
-	holder_buffer[1] = buf[1];
-	for (int i = 2; i < buf_count; i++)
-		holder_buffer[i] = butterworth[0] * buf[i] + butterworth[1] * buf[i - 1] + butterworth[2] * buf[i - 2] + butterworth[3] * holder_buffer[i - 1] + butterworth[4] * holder_buffer[i - 2];
-	for (int i = 2; i < buf_count; i++)
+	const float *b = freqfinder->butterworth;
+	float x1 = state[0], x2 = state[1], y1 = state[2], y2 = state[3];
+	for (int i = 0; i < freqfinder->N; i++)
 	{
-		buf[i] = holder_buffer[i];
+		float x = buf[i];
+		float y = b[0] * x + b[1] * x1 + b[2] * x2 + b[3] * y1 + b[4] * y2;
+		x2 = x1;
+		x1 = x;
+		y2 = y1;
+		y1 = y;
+		freqfinder->data[i] = y * freqfinder->hann[i];
 	}
+	state[0] = x1;
+	state[1] = x2;
+	state[2] = y1;
+	state[3] = y2;
 }
 
 void hann_apply(double *data, double *han, int N) // apply hann window to data
@@ -309,30 +371,103 @@ void max_power_freq(const int N, const double sampling_rate, double *frequency,
 	*freq_power = ((2 * sqrt(power[max_pos][0])) / originalN);
 }
 
-void calc_freqs(FreqFinder *freqfinder, const int sampling_rate, double *freq, double *freq_power)
+/*
+ * |X[k]|^2 of the windowed block for every bin of the bank.
+ * The bins are independent, so 4 of them run side by side in one vector
+ * and 4 vectors are interleaved to hide the latency of the recurrence.
+ */
+static void goertzel_bank(FreqFinder *freqfinder)
+{
+	const int N = freqfinder->N;
+	const float *data = freqfinder->data;
+#if SDECK_GOERTZEL_SSE
+	for (int g = 0; g < freqfinder->bins; g += 16)
+	{
+		int lanes = (freqfinder->bins - g) / 4;
+		if (lanes > 4)
+			lanes = 4;
+		__m128 c[4], s1[4], s2[4];
+		for (int l = 0; l < lanes; l++)
+		{
+			c[l] = _mm_loadu_ps(freqfinder->coef + g + 4 * l);
+			s1[l] = s2[l] = _mm_setzero_ps();
+		}
+		for (int i = 0; i < N; i++)
+		{
+			__m128 x = _mm_set1_ps(data[i]);
+			for (int l = 0; l < lanes; l++)
+			{
+				__m128 s0 = _mm_sub_ps(_mm_add_ps(x, _mm_mul_ps(c[l], s1[l])), s2[l]);
+				s2[l] = s1[l];
+				s1[l] = s0;
+			}
+		}
+		for (int l = 0; l < lanes; l++)
+		{
+			__m128 p = _mm_add_ps(_mm_mul_ps(s1[l], s1[l]), _mm_mul_ps(s2[l], s2[l]));
+			p = _mm_sub_ps(p, _mm_mul_ps(c[l], _mm_mul_ps(s1[l], s2[l])));
+			_mm_storeu_ps(freqfinder->power + g + 4 * l, p);
+		}
+	}
+#else
+	for (int k = 0; k < freqfinder->bins; k++)
+	{
+		const float c = freqfinder->coef[k];
+		float s1 = 0, s2 = 0;
+		for (int i = 0; i < N; i++)
+		{
+			float s0 = data[i] + c * s1 - s2;
+			s2 = s1;
+			s1 = s0;
+		}
+		freqfinder->power[k] = s1 * s1 + s2 * s2 - c * s1 * s2;
+	}
+#endif
+}
+
+static uint64_t now_ns()
 {
-	int N = freqfinder->N;
-	int complexN = freqfinder->N + 1;
-	lpf_apply(freqfinder->pcm_data, freqfinder->butterworth, N);
-	hann_apply(freqfinder->pcm_data, freqfinder->hann, N);
-	zero_pad(freqfinder->pcm_data, N);
-	fftw_execute(freqfinder->fft);
-	calc_powers(freqfinder->freq_data, complexN);
-	max_power_freq(complexN, sampling_rate, freq, freq_power, freqfinder->freq_data);
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
 }
 
-int get_data(FreqFinder *freqfinder, int16_t *buf, const int num_elements)
+/*
+ * Dominant frequency of the low passed block and its amplitude,
+ * frequency is left untouched if nothing beats the DC component.
+ */
+static void calc_freqs(FreqFinder *freqfinder, uint8_t position, const int16_t *buf, const int sampling_rate, double *freq, double *freq_power)
 {
-	if (freqfinder->N != num_elements)
+	uint64_t start = now_ns();
+	const int N = freqfinder->N;
+	lpf_window_apply(freqfinder, buf, freqfinder->lpf_state[position % STEAM_DECK_TRACKPADS]);
+	goertzel_bank(freqfinder);
+
+	float dc = 0;
+	for (int i = 0; i < N; i++)
+		dc += freqfinder->data[i];
+	float max_power = dc * dc;
+	int max_bin = 0;
+	for (int k = 0; k < freqfinder->bins; k++)
 	{
-		SDECK_LOG("\nBuffer size mismatch...initialized buffer is not right size!\n");
-		return -1;
+		if (freqfinder->power[k] > max_power)
+		{
+			max_power = freqfinder->power[k];
+			max_bin = k + 1;
+		}
 	}
-	for (int i = 0; i < num_elements; i++)
+	if (max_bin)
 	{
-		freqfinder->pcm_data[i] = buf[i];
+		*freq = ((double)max_bin * sampling_rate) / (2 * N);
+		*freq_power = (2 * sqrt(max_power)) / (2 * N);
 	}
-	return 0;
+
+	uint32_t cost = (uint32_t)(now_ns() - start);
+	freqfinder->stats.blocks++;
+	freqfinder->stats.total_ns += cost;
+	freqfinder->stats.last_ns = cost;
+	if (cost > freqfinder->stats.max_ns)
+		freqfinder->stats.max_ns = cost;
 }
 
 void find_repeat(double * data, const int num_samples, const double frequency, const int sampling_rate, const double avg_min, double * total_avg, int * repeat_count)
@@ -379,11 +514,14 @@ int play_pcm_haptic(SDeck *sdeck, uint8_t position, int16_t *buf, const int num_
 	int repeat = 0;
 	int32_t playtime = 0;
 	double freq = 0, avg = 0, ratio = 0, freq_power = 0;
-	if (get_data(sdeck->freqfinder, buf, num_elements))
+	if (!sdeck->freqfinder || sdeck->freqfinder->N != num_elements)
+	{
+		SDECK_LOG("\nBuffer size mismatch...initialized buffer is not right size!\n");
 		return -1;
+	}
 	// interval in microseconds
 	interval = 1000000 * ((double)num_elements / (double)sampling_rate);
-	calc_freqs(sdeck->freqfinder, sampling_rate, &freq, &freq_power);
+	calc_freqs(sdeck->freqfinder, position, buf, sampling_rate, &freq, &freq_power);
 	if (!freq)
 		return 0;
 	avg = 5 * freq_power;
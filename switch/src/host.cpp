@@ -145,7 +145,9 @@ int Host::InitSession(IO *user)
 	chiaki_connect_video_profile_preset(&(this->video_profile),
 		this->video_resolution, this->video_fps);
 	// Build chiaki ps4 stream session
-	chiaki_opus_decoder_init(&(this->opus_decoder), this->log);
+	ChiakiErrorCode err = chiaki_opus_decoder_init(&(this->opus_decoder), this->log);
+	if(err != CHIAKI_ERR_SUCCESS)
+		throw Exception(chiaki_error_string(err));
 	ChiakiAudioSink audio_sink;
 	ChiakiAudioSink haptics_sink;
 	haptics_sink.user = user;
@@ -181,7 +183,7 @@ int Host::InitSession(IO *user)
 	memcpy(chiaki_connect_info.regist_key, this->rp_regist_key, sizeof(chiaki_connect_info.regist_key));
 	memcpy(chiaki_connect_info.morning, this->rp_key, sizeof(chiaki_connect_info.morning));
 
-	ChiakiErrorCode err = chiaki_session_init(&(this->session), &chiaki_connect_info, this->log);
+	err = chiaki_session_init(&(this->session), &chiaki_connect_info, this->log);
 	if(err != CHIAKI_ERR_SUCCESS)
 		throw Exception(chiaki_error_string(err));
 	this->session_init = true;
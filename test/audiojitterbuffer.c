@@ -0,0 +1,181 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#include <munit.h>
+
+#include <chiaki/audiojitterbuffer.h>
+
+#define FRAME_US 10000
+
+static void push_frame(ChiakiAudioJitterBuffer *jb, ChiakiSeqNum16 index, uint64_t now_us)
+{
+	uint8_t buf[4] = { (uint8_t)index, (uint8_t)(index >> 8), 0x42, 0x42 };
+	chiaki_audio_jitter_buffer_push(jb, index, buf, sizeof(buf), now_us);
+}
+
+static ChiakiAudioJitterBufferResult pop_frame(ChiakiAudioJitterBuffer *jb, ChiakiSeqNum16 *index)
+{
+	uint8_t buf[CHIAKI_AUDIO_JITTER_BUFFER_UNIT_SIZE_MAX];
+	size_t buf_size = 0;
+	ChiakiAudioJitterBufferResult r = chiaki_audio_jitter_buffer_pop(jb, buf, &buf_size, NULL);
+	if(r == CHIAKI_AUDIO_JITTER_BUFFER_FRAME || r == CHIAKI_AUDIO_JITTER_BUFFER_FEC)
+	{
+		munit_assert_size(buf_size, ==, 4);
+		*index = (ChiakiSeqNum16)(buf[0] | (buf[1] << 8));
+	}
+	return r;
+}
+
+static MunitResult test_steady(const MunitParameter params[], void *user)
+{
+	ChiakiAudioJitterBuffer jb;
+	ChiakiErrorCode err = chiaki_audio_jitter_buffer_init(&jb, FRAME_US);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+
+	// buffers up to the target, then plays every frame in order, across the wraparound
+	ChiakiSeqNum16 first = 0xfff0;
+	ChiakiSeqNum16 index;
+	uint64_t now_us = 1000000;
+	push_frame(&jb, first, now_us);
+	munit_assert_int(pop_frame(&jb, &index), ==, CHIAKI_AUDIO_JITTER_BUFFER_NONE);
+	for(int i=1; i<100; i++)
+	{
+		now_us += FRAME_US;
+		push_frame(&jb, first + i, now_us);
+		munit_assert_int(pop_frame(&jb, &index), ==, CHIAKI_AUDIO_JITTER_BUFFER_FRAME);
+		munit_assert_uint16(index, ==, (ChiakiSeqNum16)(first + i - 1));
+	}
+
+	ChiakiAudioJitterBufferStats stats;
+	chiaki_audio_jitter_buffer_get_stats(&jb, &stats);
+	munit_assert_uint64(stats.frames_played, ==, 99);
+	munit_assert_uint64(stats.frames_fec + stats.frames_concealed + stats.frames_dropped + stats.underruns, ==, 0);
+	munit_assert_uint64(stats.jitter_us, ==, 0);
+	munit_assert_uint64(stats.target_us, ==, CHIAKI_AUDIO_JITTER_BUFFER_TARGET_MIN * FRAME_US);
+	munit_assert_uint64(stats.latency_us, ==, FRAME_US);
+
+	chiaki_audio_jitter_buffer_fini(&jb);
+	return MUNIT_OK;
+}
+
+static MunitResult test_loss(const MunitParameter params[], void *user)
+{
+	ChiakiAudioJitterBuffer jb;
+	ChiakiErrorCode err = chiaki_audio_jitter_buffer_init(&jb, FRAME_US);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+
+	// 2 and 3 are lost, 4 arrives out of order before 1, the redundant copy of 5 arrives before 5 is due
+	push_frame(&jb, 0, 0);
+	push_frame(&jb, 4, 0);
+	push_frame(&jb, 1, 0);
+	push_frame(&jb, 6, 0);
+	push_frame(&jb, 5, 0);
+	push_frame(&jb, 5, 0);
+
+	ChiakiSeqNum16 index;
+	munit_assert_int(pop_frame(&jb, &index), ==, CHIAKI_AUDIO_JITTER_BUFFER_FRAME);
+	munit_assert_uint16(index, ==, 0);
+	munit_assert_int(pop_frame(&jb, &index), ==, CHIAKI_AUDIO_JITTER_BUFFER_FRAME);
+	munit_assert_uint16(index, ==, 1);
+	// nothing to recover 2 from
+	munit_assert_int(pop_frame(&jb, &index), ==, CHIAKI_AUDIO_JITTER_BUFFER_PLC);
+	// 3 is recovered from the FEC data in 4
+	munit_assert_int(pop_frame(&jb, &index), ==, CHIAKI_AUDIO_JITTER_BUFFER_FEC);
+	munit_assert_uint16(index, ==, 4);
+	for(ChiakiSeqNum16 i=4; i<=6; i++)
+	{
+		munit_assert_int(pop_frame(&jb, &index), ==, CHIAKI_AUDIO_JITTER_BUFFER_FRAME);
+		munit_assert_uint16(index, ==, i);
+	}
+
+	// too late
+	munit_assert_false(chiaki_audio_jitter_buffer_push(&jb, 3, (const uint8_t *)"late", 4, 0));
+
+	// run dry, conceal for a while, then rebuffer
+	for(int i=0; i<CHIAKI_AUDIO_JITTER_BUFFER_CONCEAL_MAX; i++)
+		munit_assert_int(pop_frame(&jb, &index), ==, CHIAKI_AUDIO_JITTER_BUFFER_PLC);
+	munit_assert_int(pop_frame(&jb, &index), ==, CHIAKI_AUDIO_JITTER_BUFFER_NONE);
+
+	ChiakiAudioJitterBufferStats stats;
+	chiaki_audio_jitter_buffer_get_stats(&jb, &stats);
+	munit_assert_uint64(stats.frames_played, ==, 5);
+	munit_assert_uint64(stats.frames_fec, ==, 1);
+	munit_assert_uint64(stats.frames_concealed, ==, 1 + CHIAKI_AUDIO_JITTER_BUFFER_CONCEAL_MAX);
+	munit_assert_uint64(stats.frames_late, ==, 1);
+	munit_assert_uint64(stats.underruns, ==, 1);
+
+	chiaki_audio_jitter_buffer_fini(&jb);
+	return MUNIT_OK;
+}
+
+static MunitResult test_adapt(const MunitParameter params[], void *user)
+{
+	ChiakiAudioJitterBuffer jb;
+	ChiakiErrorCode err = chiaki_audio_jitter_buffer_init(&jb, FRAME_US);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+
+	// frames arrive in bursts of 4 every 40ms, the target grows to absorb that
+	uint64_t now_us = 1000000;
+	ChiakiSeqNum16 index;
+	for(int i=0; i<400; i++)
+	{
+		if(i % 4 == 0)
+		{
+			for(int j=0; j<4; j++)
+				push_frame(&jb, (ChiakiSeqNum16)(i + j), now_us);
+		}
+		pop_frame(&jb, &index);
+		now_us += FRAME_US;
+	}
+
+	ChiakiAudioJitterBufferStats stats;
+	chiaki_audio_jitter_buffer_get_stats(&jb, &stats);
+	munit_assert_uint64(stats.jitter_us, >, FRAME_US);
+	munit_assert_uint64(stats.target_us, >, CHIAKI_AUDIO_JITTER_BUFFER_TARGET_MIN * FRAME_US);
+	munit_assert_uint64(stats.target_us, <=, CHIAKI_AUDIO_JITTER_BUFFER_TARGET_MAX * FRAME_US);
+	munit_assert_uint64(stats.frames_concealed, ==, 0);
+
+	// a large backlog is trimmed down to the target over time
+	for(int i=0; i<16; i++)
+		push_frame(&jb, (ChiakiSeqNum16)(400 + i), now_us);
+	for(int i=416; i<2000; i++)
+	{
+		now_us += FRAME_US;
+		push_frame(&jb, (ChiakiSeqNum16)i, now_us);
+		pop_frame(&jb, &index);
+	}
+	chiaki_audio_jitter_buffer_get_stats(&jb, &stats);
+	munit_assert_uint64(stats.frames_dropped, >, 0);
+	munit_assert_uint64(stats.latency_us, <=, stats.target_us + 2 * FRAME_US);
+
+	chiaki_audio_jitter_buffer_fini(&jb);
+	return MUNIT_OK;
+}
+
+
+MunitTest tests_audio_jitter_buffer[] = {
+	{
+		"/steady",
+		test_steady,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{
+		"/loss",
+		test_loss,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{
+		"/adapt",
+		test_adapt,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{ NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL }
+};
@@ -0,0 +1,158 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#include <munit.h>
+
+#include <chiaki/audioring.h>
+#include <chiaki/audio.h>
+
+#include <string.h>
+
+static MunitResult test_gain(const MunitParameter params[], void *user)
+{
+	int16_t src[67];
+	int16_t dst[67];
+	for(size_t i=0; i<sizeof(src) / sizeof(src[0]); i++)
+		src[i] = (int16_t)munit_rand_int_range(INT16_MIN, INT16_MAX);
+	src[0] = INT16_MIN;
+	src[1] = INT16_MAX;
+
+	static const uint16_t gains[] = { 0, 1, 0x1234, 0x4000, 0x7fff };
+	for(size_t g=0; g<sizeof(gains) / sizeof(gains[0]); g++)
+	{
+		// odd length to cover both the vector and the scalar part
+		chiaki_audio_s16_gain(dst, src, sizeof(src) / sizeof(src[0]), gains[g]);
+		for(size_t i=0; i<sizeof(src) / sizeof(src[0]); i++)
+			munit_assert_int16(dst[i], ==, (int16_t)(((int32_t)src[i] * gains[g]) >> 15));
+	}
+
+	chiaki_audio_s16_gain(dst, src, sizeof(src) / sizeof(src[0]), CHIAKI_AUDIO_GAIN_UNITY);
+	munit_assert_memory_equal(sizeof(src), dst, src);
+
+	// in place
+	memcpy(dst, src, sizeof(src));
+	chiaki_audio_s16_gain(dst, dst, sizeof(src) / sizeof(src[0]), 0x4000);
+	for(size_t i=0; i<sizeof(src) / sizeof(src[0]); i++)
+		munit_assert_int16(dst[i], ==, (int16_t)(src[i] >> 1));
+
+	return MUNIT_OK;
+}
+
+static MunitResult test_ring(const MunitParameter params[], void *user)
+{
+	ChiakiAudioRing *ring = chiaki_audio_ring_new(2, 100, 50);
+	munit_assert_not_null(ring);
+
+	ChiakiAudioRingStats stats;
+	chiaki_audio_ring_get_stats(ring, &stats);
+	munit_assert_size(stats.capacity_frames, ==, 128);
+
+	int16_t in[2 * 100];
+	int16_t out[2 * 100];
+	int16_t next_in = 0;
+	int16_t next_out = 0;
+	for(int round=0; round<10; round++)
+	{
+		// wraps around several times
+		for(size_t i=0; i<sizeof(in) / sizeof(in[0]); i++)
+			in[i] = next_in++;
+		munit_assert_size(chiaki_audio_ring_write(ring, in, 100), ==, 100);
+		munit_assert_size(chiaki_audio_ring_fill(ring), ==, 100);
+		chiaki_audio_ring_read(ring, out, 100, CHIAKI_AUDIO_GAIN_UNITY);
+		for(size_t i=0; i<sizeof(out) / sizeof(out[0]); i++)
+			munit_assert_int16(out[i], ==, next_out++);
+	}
+
+	// overrun
+	munit_assert_size(chiaki_audio_ring_write(ring, in, 100), ==, 100);
+	munit_assert_size(chiaki_audio_ring_write(ring, in, 100), ==, 28);
+
+	// underrun is padded with silence
+	chiaki_audio_ring_read(ring, out, 100, CHIAKI_AUDIO_GAIN_UNITY);
+	chiaki_audio_ring_read(ring, out, 100, CHIAKI_AUDIO_GAIN_UNITY);
+	for(size_t i=28 * 2; i<sizeof(out) / sizeof(out[0]); i++)
+		munit_assert_int16(out[i], ==, 0);
+
+	chiaki_audio_ring_get_stats(ring, &stats);
+	munit_assert_uint64(stats.overrun_frames, ==, 72);
+	munit_assert_uint64(stats.underrun_frames, ==, 72);
+	munit_assert_size(stats.fill_min, ==, 28);
+	munit_assert_size(stats.fill_max, ==, 128);
+	munit_assert_size(stats.fill_frames, ==, 0);
+
+	chiaki_audio_ring_free(ring);
+	return MUNIT_OK;
+}
+
+static MunitResult test_drift(const MunitParameter params[], void *user)
+{
+	// 10ms frames at 48kHz, the device consumes 1000 ppm faster than the stream delivers
+	const size_t frame = 480;
+	const size_t target = 2 * frame;
+	ChiakiAudioRing *ring = chiaki_audio_ring_new(2, 8 * frame, target);
+	munit_assert_not_null(ring);
+
+	int16_t in[2 * 480];
+	int16_t out[2 * 600];
+	for(size_t i=0; i<frame; i++)
+		in[2 * i] = in[2 * i + 1] = (int16_t)(i * 10);
+
+	for(int i=0; i<2; i++)
+		chiaki_audio_ring_write_compensated(ring, in, frame);
+
+	double consumed = 0.0;
+	size_t read = 0;
+	uint64_t underruns_settled = 0;
+	ChiakiAudioRingStats stats;
+	for(int tick=0; tick<6000; tick++)
+	{
+		chiaki_audio_ring_write_compensated(ring, in, frame);
+		consumed += (double)frame * 1.001;
+		size_t n = (size_t)consumed - read;
+		chiaki_audio_ring_read(ring, out, n, CHIAKI_AUDIO_GAIN_UNITY);
+		read += n;
+		if(tick == 3000)
+		{
+			chiaki_audio_ring_get_stats(ring, &stats);
+			underruns_settled = stats.underrun_frames;
+		}
+	}
+
+	chiaki_audio_ring_get_stats(ring, &stats);
+	munit_assert_uint64(stats.underrun_frames, ==, underruns_settled);
+	munit_assert_uint64(stats.overrun_frames, ==, 0);
+	munit_assert_int32(stats.drift_ppm, <=, -900);
+	munit_assert_int32(stats.drift_ppm, >=, -1100);
+	munit_assert_size(stats.fill_min, >, 0);
+
+	chiaki_audio_ring_free(ring);
+	return MUNIT_OK;
+}
+
+
+MunitTest tests_audio_ring[] = {
+	{
+		"/gain",
+		test_gain,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{
+		"/ring",
+		test_ring,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{
+		"/drift",
+		test_drift,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{ NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL }
+};
@@ -7,6 +7,20 @@
 
 #define ARRAY_SIZE(a) sizeof(a) / sizeof(a[0])
 
+static bool slice_indexed(ChiakiBitstream *bs, uint8_t *data, size_t size, ChiakiBitstreamSlice *slice)
+{
+	ChiakiBitstreamNalIndex index;
+	chiaki_bitstream_index(bs, data, size, &index);
+	return chiaki_bitstream_slice(bs, data, &index, slice);
+}
+
+static bool set_reference_frame_indexed(ChiakiBitstream *bs, uint8_t *data, size_t size, unsigned reference_frame)
+{
+	ChiakiBitstreamNalIndex index;
+	chiaki_bitstream_index(bs, data, size, &index);
+	return chiaki_bitstream_slice_set_reference_frame(bs, data, &index, reference_frame);
+}
+
 static MunitResult test_bitstream_parse_h264(const MunitParameter params[], void *fixture)
 {
 	ChiakiBitstream bs;
@@ -28,7 +42,7 @@ static MunitResult test_bitstream_parse_h264(const MunitParameter params[], void
 		0x7f, 0x88, 0x46, 0x44, 0x77, 0x17, 0xe7, 0x6d, 0xb3, 0xad, 0x38, 0x19, 0x74, 0x5a, 0xf1, 0x51,
 	};
 	memset(&slice, -1, sizeof(slice));
-	munit_assert(chiaki_bitstream_slice(&bs, slice_i, ARRAY_SIZE(slice_i), &slice));
+	munit_assert(slice_indexed(&bs, slice_i, ARRAY_SIZE(slice_i), &slice));
 	munit_assert(slice.slice_type == CHIAKI_BITSTREAM_SLICE_I);
 
 	uint8_t slice_p[] = {
@@ -36,7 +50,7 @@ static MunitResult test_bitstream_parse_h264(const MunitParameter params[], void
 		0xd3, 0xa0, 0x28, 0x1f, 0x83, 0x63, 0x0e, 0xc2, 0xfc, 0x9d, 0x7a, 0xc7, 0xc4, 0x7d, 0xf9, 0x18,
 	};
 	memset(&slice, -1, sizeof(slice));
-	munit_assert(chiaki_bitstream_slice(&bs, slice_p, ARRAY_SIZE(slice_p), &slice));
+	munit_assert(slice_indexed(&bs, slice_p, ARRAY_SIZE(slice_p), &slice));
 	munit_assert(slice.slice_type == CHIAKI_BITSTREAM_SLICE_P);
 	munit_assert(slice.reference_frame == 0);
 
@@ -45,7 +59,7 @@ static MunitResult test_bitstream_parse_h264(const MunitParameter params[], void
 		0x90, 0x10, 0xb3, 0x2c, 0x4e, 0x45, 0xfc, 0xff, 0x45, 0x24, 0x8c, 0x79, 0xec, 0x12, 0xe5, 0x9b,
 	};
 	memset(&slice, -1, sizeof(slice));
-	munit_assert(chiaki_bitstream_slice(&bs, slice_p_ref_5, ARRAY_SIZE(slice_p_ref_5), &slice));
+	munit_assert(slice_indexed(&bs, slice_p_ref_5, ARRAY_SIZE(slice_p_ref_5), &slice));
 	munit_assert(slice.slice_type == CHIAKI_BITSTREAM_SLICE_P);
 	munit_assert(slice.reference_frame == 5);
 
@@ -76,7 +90,7 @@ static MunitResult test_bitstream_parse_h265(const MunitParameter params[], void
 		0x7a, 0x06, 0x7c, 0x3f, 0x31, 0x9b, 0xe6, 0x10, 0x57, 0xe8, 0x0e, 0xcf, 0xdd, 0xda, 0xdb, 0x3f,
 	};
 	memset(&slice, -1, sizeof(slice));
-	munit_assert(chiaki_bitstream_slice(&bs, slice_i, ARRAY_SIZE(slice_i), &slice));
+	munit_assert(slice_indexed(&bs, slice_i, ARRAY_SIZE(slice_i), &slice));
 	munit_assert(slice.slice_type == CHIAKI_BITSTREAM_SLICE_I);
 
 	uint8_t slice_p[] = {
@@ -84,7 +98,7 @@ static MunitResult test_bitstream_parse_h265(const MunitParameter params[], void
 		0x2f, 0x2b, 0x11, 0xd4, 0x55, 0x04, 0x90, 0x18, 0x49, 0xe5, 0xbc, 0xc4, 0x97, 0xbc, 0x3d, 0xeb,
 	};
 	memset(&slice, -1, sizeof(slice));
-	munit_assert(chiaki_bitstream_slice(&bs, slice_p, ARRAY_SIZE(slice_p), &slice));
+	munit_assert(slice_indexed(&bs, slice_p, ARRAY_SIZE(slice_p), &slice));
 	munit_assert(slice.slice_type == CHIAKI_BITSTREAM_SLICE_P);
 	munit_assert(slice.reference_frame == 0);
 
@@ -93,7 +107,7 @@ static MunitResult test_bitstream_parse_h265(const MunitParameter params[], void
 		0xec, 0x5e, 0xdf, 0x39, 0x86, 0xe6, 0xd9, 0x07, 0x49, 0x17, 0xe2, 0x62, 0x57, 0x14, 0xd7, 0x08,
 	};
 	memset(&slice, -1, sizeof(slice));
-	munit_assert(chiaki_bitstream_slice(&bs, slice_p_ref_5, ARRAY_SIZE(slice_p_ref_5), &slice));
+	munit_assert(slice_indexed(&bs, slice_p_ref_5, ARRAY_SIZE(slice_p_ref_5), &slice));
 	munit_assert(slice.slice_type == CHIAKI_BITSTREAM_SLICE_P);
 	munit_assert(slice.reference_frame == 5);
 
@@ -121,7 +135,7 @@ static MunitResult test_bitstream_issue_213(const MunitParameter params[], void
 		0x00, 0x00, 0x00, 0x01, 0x02, 0x01, 0xd2, 0x0b, 0xea, 0x60, 0x86, 0x82, 0x3d, 0x00, 0x00, 0x03,
 	};
 	memset(&slice, -1, sizeof(slice));
-	munit_assert(chiaki_bitstream_slice(&bs, slice_p, ARRAY_SIZE(slice_p), &slice));
+	munit_assert(slice_indexed(&bs, slice_p, ARRAY_SIZE(slice_p), &slice));
 	munit_assert(slice.slice_type == CHIAKI_BITSTREAM_SLICE_P);
 	munit_assert(slice.reference_frame == 0);
 
@@ -152,20 +166,135 @@ static MunitResult test_bitstream_set_ref_h265(const MunitParameter params[], vo
 		0x6b, 0x71, 0x72, 0xf9, 0x6e, 0xd4, 0xf2, 0x66, 0x78, 0x0c, 0x12, 0xe7, 0x79, 0xf0, 0xbc, 0xc9,
 	};
 	memset(&slice, -1, sizeof(slice));
-	munit_assert(chiaki_bitstream_slice(&bs, slice_p, ARRAY_SIZE(slice_p), &slice));
+	munit_assert(slice_indexed(&bs, slice_p, ARRAY_SIZE(slice_p), &slice));
 	munit_assert(slice.slice_type == CHIAKI_BITSTREAM_SLICE_P);
 	munit_assert(slice.reference_frame == 0);
 
 	for(unsigned i=0; i<9; i++)
 	{
-		munit_assert(chiaki_bitstream_slice_set_reference_frame(&bs, slice_p, ARRAY_SIZE(slice_p), i));
+		munit_assert(set_reference_frame_indexed(&bs, slice_p, ARRAY_SIZE(slice_p), i));
 		memset(&slice, -1, sizeof(slice));
-		munit_assert(chiaki_bitstream_slice(&bs, slice_p, ARRAY_SIZE(slice_p), &slice));
+		munit_assert(slice_indexed(&bs, slice_p, ARRAY_SIZE(slice_p), &slice));
 		munit_assert(slice.slice_type == CHIAKI_BITSTREAM_SLICE_P);
 		munit_assert(slice.reference_frame == i);
 	}
 	// Slice have 9 reference frames
-	munit_assert(!chiaki_bitstream_slice_set_reference_frame(&bs, slice_p, ARRAY_SIZE(slice_p), 10));
+	munit_assert(!set_reference_frame_indexed(&bs, slice_p, ARRAY_SIZE(slice_p), 10));
+
+	return MUNIT_OK;
+}
+
+static size_t find_start_code_ref(const uint8_t *data, size_t size)
+{
+	for(size_t i=0; i+3<=size; i++)
+		if(!data[i] && !data[i+1] && data[i+2] == 1)
+			return i;
+	return size;
+}
+
+static MunitResult test_bitstream_find_start_code(const MunitParameter params[], void *fixture)
+{
+	uint8_t buf[200];
+	for(unsigned r=0; r<2000; r++)
+	{
+		// mostly zeros and ones, so there are many near misses
+		size_t size = (size_t)munit_rand_int_range(0, sizeof(buf));
+		for(size_t i=0; i<size; i++)
+		{
+			int v = munit_rand_int_range(0, 16);
+			buf[i] = v < 10 ? 0 : v < 12 ? 1 : (uint8_t)munit_rand_int_range(2, 255);
+		}
+		for(size_t off=0; off<size && off<20; off++)
+			munit_assert_size(chiaki_bitstream_find_start_code(buf + off, size - off), ==, find_start_code_ref(buf + off, size - off));
+	}
+
+	memset(buf, 0xff, sizeof(buf));
+	munit_assert_size(chiaki_bitstream_find_start_code(buf, sizeof(buf)), ==, sizeof(buf));
+	for(size_t pos=0; pos+3<=sizeof(buf); pos++)
+	{
+		buf[pos] = 0; buf[pos+1] = 0; buf[pos+2] = 1;
+		munit_assert_size(chiaki_bitstream_find_start_code(buf, sizeof(buf)), ==, pos);
+		// cut right through it
+		munit_assert_size(chiaki_bitstream_find_start_code(buf, pos+2), ==, pos+2);
+		buf[pos] = 0xff; buf[pos+1] = 0xff; buf[pos+2] = 0xff;
+	}
+
+	return MUNIT_OK;
+}
+
+static MunitResult test_bitstream_index(const MunitParameter params[], void *fixture)
+{
+	ChiakiBitstream bs;
+	ChiakiBitstreamNalIndex index;
+
+	chiaki_bitstream_init(&bs, NULL, CHIAKI_CODEC_H264);
+
+	// AUD, SEI with a 3 byte start code, P slice
+	uint8_t frame[] = {
+		0x00, 0x00, 0x00, 0x01, 0x09, 0xf0, 0x00, 0x00, 0x01, 0x06, 0x05, 0x01, 0x00, 0x80,
+		0x00, 0x00, 0x00, 0x01, 0x41, 0x9a, 0x04, 0x44, 0x3f, 0x41, 0x5b, 0xf4, 0x65, 0xb4, 0x3e, 0x1a,
+		0xd3, 0xa0, 0x28, 0x1f, 0x83, 0x63, 0x0e, 0xc2, 0xfc, 0x9d, 0x7a, 0xc7, 0xc4, 0x7d, 0xf9, 0x18,
+	};
+	chiaki_bitstream_index(&bs, frame, ARRAY_SIZE(frame), &index);
+	munit_assert_size(index.nalus_count, ==, 3);
+	munit_assert_false(index.truncated);
+	munit_assert_int(index.slice, ==, 2);
+
+	munit_assert_uint32(index.nalus[0].offset, ==, 4);
+	munit_assert_uint32(index.nalus[0].size, ==, 2);
+	munit_assert_uint8(index.nalus[0].start_code_size, ==, 4);
+	munit_assert_uint8(index.nalus[0].type, ==, 9);
+
+	munit_assert_uint32(index.nalus[1].offset, ==, 9);
+	munit_assert_uint32(index.nalus[1].size, ==, 5);
+	munit_assert_uint8(index.nalus[1].start_code_size, ==, 3);
+	munit_assert_uint8(index.nalus[1].type, ==, 6);
+
+	munit_assert_uint32(index.nalus[2].offset, ==, 18);
+	munit_assert_uint32(index.nalus[2].size, ==, ARRAY_SIZE(frame) - 18);
+	munit_assert_uint8(index.nalus[2].start_code_size, ==, 4);
+	munit_assert_uint8(index.nalus[2].type, ==, 1);
+
+	// the slice is found behind the other NAL units
+	ChiakiBitstreamSlice slice;
+	bs.h264.sps.log2_max_frame_num_minus4 = 3;
+	munit_assert(chiaki_bitstream_slice(&bs, frame, &index, &slice));
+	munit_assert(slice.slice_type == CHIAKI_BITSTREAM_SLICE_P);
+	munit_assert(slice.reference_frame == 0);
+	munit_assert_false(chiaki_bitstream_index_idr(CHIAKI_CODEC_H264, &index));
+
+	// IDR slice after SPS
+	uint8_t idr[] = { 0x00, 0x00, 0x00, 0x01, 0x67, 0x42, 0x00, 0x00, 0x01, 0x65, 0x88, 0x84 };
+	chiaki_bitstream_index(&bs, idr, ARRAY_SIZE(idr), &index);
+	munit_assert_true(chiaki_bitstream_index_idr(CHIAKI_CODEC_H264, &index));
+
+	// H.265 CRA and a trailing picture
+	ChiakiBitstream bs_h265;
+	chiaki_bitstream_init(&bs_h265, NULL, CHIAKI_CODEC_H265);
+	uint8_t cra[] = { 0x00, 0x00, 0x00, 0x01, 0x2a, 0x01, 0xaf, 0x00, 0x00, 0x01, 0x02, 0x01, 0xd0 };
+	chiaki_bitstream_index(&bs_h265, cra, 7, &index);
+	munit_assert_true(chiaki_bitstream_index_idr(CHIAKI_CODEC_H265, &index));
+	chiaki_bitstream_index(&bs_h265, cra + 7, ARRAY_SIZE(cra) - 7, &index);
+	munit_assert_false(chiaki_bitstream_index_idr(CHIAKI_CODEC_H265, &index));
+
+	// no start code at all
+	uint8_t garbage[] = { 0x12, 0x00, 0x00, 0x02, 0x00, 0x00 };
+	chiaki_bitstream_index(&bs, garbage, ARRAY_SIZE(garbage), &index);
+	munit_assert_size(index.nalus_count, ==, 0);
+	munit_assert_int(index.slice, ==, -1);
+	munit_assert_false(chiaki_bitstream_slice(&bs, garbage, &index, &slice));
+
+	// more NAL units than fit into the index
+	uint8_t many[(CHIAKI_BITSTREAM_NALUS_MAX + 4) * 4];
+	for(size_t i=0; i<CHIAKI_BITSTREAM_NALUS_MAX + 4; i++)
+	{
+		many[i*4] = 0x00; many[i*4+1] = 0x00; many[i*4+2] = 0x01; many[i*4+3] = 0x06;
+	}
+	chiaki_bitstream_index(&bs, many, ARRAY_SIZE(many), &index);
+	munit_assert_size(index.nalus_count, ==, CHIAKI_BITSTREAM_NALUS_MAX);
+	munit_assert_true(index.truncated);
+	munit_assert_int(index.slice, ==, -1);
+	munit_assert_uint32(index.nalus[CHIAKI_BITSTREAM_NALUS_MAX - 1].offset + index.nalus[CHIAKI_BITSTREAM_NALUS_MAX - 1].size, ==, ARRAY_SIZE(many));
 
 	return MUNIT_OK;
 }
@@ -203,5 +332,21 @@ MunitTest tests_bitstream[] = {
 		MUNIT_TEST_OPTION_NONE,
 		NULL
 	},
+	{
+		"/bitstream_find_start_code",
+		test_bitstream_find_start_code,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{
+		"/bitstream_index",
+		test_bitstream_index,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
 	{ NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL }
 };
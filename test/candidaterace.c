@@ -0,0 +1,199 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#include <munit.h>
+
+#include <chiaki/remote/candidaterace.h>
+
+#include <string.h>
+
+#ifdef _WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#else
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#endif
+
+#include "test_log.h"
+#include "test_sock.h"
+
+#define PROBE_MAGIC 0x42
+
+/**
+ * A console stand-in on loopback that echoes every probe back to where it came from.
+ * It is waited on by the race itself, so everything runs on the test thread.
+ */
+typedef struct race_test_t
+{
+	chiaki_socket_t client;
+	chiaki_socket_t console;
+	struct sockaddr_in console_addr;
+	struct sockaddr_in dead_addr[2];
+} RaceTest;
+
+static chiaki_socket_t bind_loopback_addr(struct sockaddr_in *addr)
+{
+	uint16_t port = 0;
+	chiaki_socket_t sock = bind_loopback(AF_INET, &port);
+	memset(addr, 0, sizeof(*addr));
+	addr->sin_family = AF_INET;
+	addr->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	addr->sin_port = htons(port);
+	return sock;
+}
+
+static bool race_test_init(RaceTest *test)
+{
+	struct sockaddr_in client_addr;
+	test->client = bind_loopback_addr(&client_addr);
+	test->console = bind_loopback_addr(&test->console_addr);
+	if(CHIAKI_SOCKET_IS_INVALID(test->client) || CHIAKI_SOCKET_IS_INVALID(test->console))
+		return false;
+	// ports nobody listens on anymore stand in for candidates that never answer
+	for(size_t i=0; i<2; i++)
+	{
+		chiaki_socket_t dead = bind_loopback_addr(&test->dead_addr[i]);
+		if(CHIAKI_SOCKET_IS_INVALID(dead))
+			return false;
+		CHIAKI_SOCKET_CLOSE(dead);
+	}
+	return true;
+}
+
+static void race_test_fini(RaceTest *test)
+{
+	CHIAKI_SOCKET_CLOSE(test->client);
+	CHIAKI_SOCKET_CLOSE(test->console);
+}
+
+static void probe_cb(ChiakiCandidateRace *race, size_t pair, void *user)
+{
+	ChiakiCandidateRacePair *p = &race->pairs[pair];
+	uint8_t buf[2] = { PROBE_MAGIC, (uint8_t)pair };
+	sendto(p->sock, (CHIAKI_SOCKET_BUF_TYPE)buf, sizeof(buf), 0, (struct sockaddr *)&p->addr, p->addr_len);
+}
+
+static void read_cb(ChiakiCandidateRace *race, chiaki_socket_t sock, void *user)
+{
+	RaceTest *test = user;
+	uint8_t buf[2];
+	struct sockaddr_in from;
+	socklen_t from_len = sizeof(from);
+	CHIAKI_SSIZET_TYPE len = recvfrom(sock, (CHIAKI_SOCKET_BUF_TYPE)buf, sizeof(buf), 0, (struct sockaddr *)&from, &from_len);
+	if(len != sizeof(buf) || buf[0] != PROBE_MAGIC)
+		return;
+	if(sock == test->console)
+	{
+		sendto(test->console, (CHIAKI_SOCKET_BUF_TYPE)buf, sizeof(buf), 0, (struct sockaddr *)&from, from_len);
+		return;
+	}
+	chiaki_candidate_race_validated(race, buf[1], sock);
+}
+
+static MunitResult test_lower_priority_wins(const MunitParameter params[], void *user)
+{
+	RaceTest test;
+	munit_assert(race_test_init(&test));
+
+	ChiakiCandidateRace race;
+	chiaki_candidate_race_init(&race, get_test_log(), probe_cb, read_cb, &test);
+	race.stagger_ms = 20;
+	munit_assert_int(chiaki_candidate_race_add_socket(&race, test.console), ==, CHIAKI_ERR_SUCCESS);
+	size_t live;
+	munit_assert_int(chiaki_candidate_race_add_pair(&race, test.client, (struct sockaddr *)&test.dead_addr[0], sizeof(test.dead_addr[0]), 0, NULL, NULL), ==, CHIAKI_ERR_SUCCESS);
+	munit_assert_int(chiaki_candidate_race_add_pair(&race, test.client, (struct sockaddr *)&test.console_addr, sizeof(test.console_addr), 5, NULL, &live), ==, CHIAKI_ERR_SUCCESS);
+	munit_assert_int(chiaki_candidate_race_add_pair(&race, test.client, (struct sockaddr *)&test.dead_addr[1], sizeof(test.dead_addr[1]), 1, NULL, NULL), ==, CHIAKI_ERR_SUCCESS);
+
+	munit_assert_int(chiaki_candidate_race_run(&race), ==, CHIAKI_ERR_SUCCESS);
+	munit_assert_size(race.validated, ==, live);
+	munit_assert(race.validated_sock == test.client);
+
+	// the third distinct priority starts two staggers in, after both dead pairs were probed
+	ChiakiCandidateRacePair *pair = &race.pairs[live];
+	munit_assert_uint64(pair->first_probe_us, >=, 2 * race.stagger_ms * 1000);
+	munit_assert_uint64(pair->validated_us, >=, pair->first_probe_us);
+	munit_assert_uint64(pair->first_reply_us, ==, pair->validated_us);
+	munit_assert_uint64(race.pairs[0].first_probe_us, <, race.pairs[2].first_probe_us);
+	munit_assert_uint64(race.pairs[2].first_probe_us, <=, pair->first_probe_us);
+	munit_assert_uint64(race.pairs[0].first_reply_us, ==, CHIAKI_CANDIDATE_RACE_NEVER);
+
+	chiaki_candidate_race_log_timeline(&race, CHIAKI_LOG_DEBUG);
+	chiaki_candidate_race_fini(&race);
+	race_test_fini(&test);
+	return MUNIT_OK;
+}
+
+static MunitResult test_first_priority_skips_others(const MunitParameter params[], void *user)
+{
+	RaceTest test;
+	munit_assert(race_test_init(&test));
+
+	ChiakiCandidateRace race;
+	chiaki_candidate_race_init(&race, get_test_log(), probe_cb, read_cb, &test);
+	race.stagger_ms = 500;
+	munit_assert_int(chiaki_candidate_race_add_socket(&race, test.console), ==, CHIAKI_ERR_SUCCESS);
+	munit_assert_int(chiaki_candidate_race_add_pair(&race, test.client, (struct sockaddr *)&test.console_addr, sizeof(test.console_addr), 0, NULL, NULL), ==, CHIAKI_ERR_SUCCESS);
+	munit_assert_int(chiaki_candidate_race_add_pair(&race, test.client, (struct sockaddr *)&test.dead_addr[0], sizeof(test.dead_addr[0]), 1, NULL, NULL), ==, CHIAKI_ERR_SUCCESS);
+
+	munit_assert_int(chiaki_candidate_race_run(&race), ==, CHIAKI_ERR_SUCCESS);
+	munit_assert_size(race.validated, ==, 0);
+	munit_assert_uint64(race.pairs[0].validated_us, <, race.stagger_ms * 1000);
+	munit_assert_uint(race.pairs[1].probes, ==, 0);
+	munit_assert_uint64(race.pairs[1].first_probe_us, ==, CHIAKI_CANDIDATE_RACE_NEVER);
+
+	chiaki_candidate_race_fini(&race);
+	race_test_fini(&test);
+	return MUNIT_OK;
+}
+
+static MunitResult test_timeout(const MunitParameter params[], void *user)
+{
+	RaceTest test;
+	munit_assert(race_test_init(&test));
+
+	ChiakiCandidateRace race;
+	chiaki_candidate_race_init(&race, get_test_log(), probe_cb, read_cb, &test);
+	race.resend_ms = 20;
+	race.resend_max_ms = 40;
+	race.timeout_ms = 200;
+	munit_assert_int(chiaki_candidate_race_add_pair(&race, test.client, (struct sockaddr *)&test.dead_addr[0], sizeof(test.dead_addr[0]), 0, NULL, NULL), ==, CHIAKI_ERR_SUCCESS);
+
+	munit_assert_int(chiaki_candidate_race_run(&race), ==, CHIAKI_ERR_HOST_UNREACH);
+	munit_assert_size(race.validated, ==, CHIAKI_CANDIDATE_RACE_NONE);
+	// probes at 0, 20, 60, 100, 140, 180 ms with the backoff capped
+	munit_assert_uint(race.pairs[0].probes, >=, 4);
+	munit_assert_uint(race.pairs[0].probes, <=, 6);
+	munit_assert_uint64(race.pairs[0].last_probe_us, <, race.timeout_ms * 1000);
+
+	chiaki_candidate_race_fini(&race);
+	race_test_fini(&test);
+	return MUNIT_OK;
+}
+
+MunitTest tests_candidate_race[] = {
+	{
+		"/lower_priority_wins",
+		test_lower_priority_wins,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{
+		"/first_priority_skips_others",
+		test_first_priority_skips_others,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{
+		"/timeout",
+		test_timeout,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{ NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL }
+};
@@ -0,0 +1,186 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#include <munit.h>
+
+#include <chiaki/echoring.h>
+#include <chiaki/audio.h>
+
+#include <string.h>
+
+static MunitResult test_downmix(const MunitParameter params[], void *user)
+{
+	int16_t src[2 * 37];
+	int16_t dst[37];
+	for(size_t i=0; i<sizeof(src) / sizeof(src[0]); i++)
+		src[i] = (int16_t)munit_rand_int_range(INT16_MIN, INT16_MAX);
+	src[0] = src[1] = INT16_MIN;
+	src[2] = src[3] = INT16_MAX;
+
+	static const uint16_t gains[] = { 0, 1, 0x1234, 0x4000, 0x7fff, CHIAKI_AUDIO_GAIN_UNITY, 0xffff };
+	for(size_t g=0; g<sizeof(gains) / sizeof(gains[0]); g++)
+	{
+		int32_t h = (gains[g] > CHIAKI_AUDIO_GAIN_UNITY ? CHIAKI_AUDIO_GAIN_UNITY : gains[g]) >> 1;
+		chiaki_audio_s16_downmix_gain(dst, src, 37, gains[g]);
+		for(size_t i=0; i<37; i++)
+			munit_assert_int16(dst[i], ==, (int16_t)((((int32_t)src[2 * i] + src[2 * i + 1]) * h) >> 15));
+	}
+
+	chiaki_audio_s16_downmix_gain(dst, src, 37, CHIAKI_AUDIO_GAIN_UNITY);
+	munit_assert_int16(dst[0], ==, INT16_MIN);
+	munit_assert_int16(dst[1], ==, INT16_MAX);
+	return MUNIT_OK;
+}
+
+static MunitResult test_upmix(const MunitParameter params[], void *user)
+{
+	int16_t src[37];
+	int16_t dst[2 * 37];
+	for(size_t i=0; i<sizeof(src) / sizeof(src[0]); i++)
+		src[i] = (int16_t)munit_rand_int_range(INT16_MIN, INT16_MAX);
+	chiaki_audio_s16_upmix(dst, src, 37);
+	for(size_t i=0; i<37; i++)
+	{
+		munit_assert_int16(dst[2 * i], ==, src[i]);
+		munit_assert_int16(dst[2 * i + 1], ==, src[i]);
+	}
+	return MUNIT_OK;
+}
+
+#define RATE 48000
+#define SAMPLE_US(n) (((uint64_t)(n) * 1000000 + RATE - 1) / RATE) // rounded up, so it maps back to sample n
+
+static void fill_frames(int16_t *frames, size_t count, size_t first)
+{
+	// identical channels, so the downmix at unity gain returns the sample index
+	for(size_t i=0; i<count; i++)
+		frames[2 * i] = frames[2 * i + 1] = (int16_t)(first + i);
+}
+
+static MunitResult test_ring(const MunitParameter params[], void *user)
+{
+	ChiakiEchoRing *ring = chiaki_echo_ring_new(RATE, 1000);
+	munit_assert_not_null(ring);
+
+	int16_t buf[480];
+	memset(buf, 0x55, sizeof(buf));
+	munit_assert_size(chiaki_echo_ring_read(ring, buf, 480, 1000000), ==, 0);
+	for(size_t i=0; i<480; i++)
+		munit_assert_int16(buf[i], ==, 0);
+
+	// 10 ms packets, played back to back from t = 1 s, wrapping around the 1024 sample ring
+	const uint64_t t0 = 1000000;
+	int16_t frames[2 * 480];
+	for(size_t p=0; p<5; p++)
+	{
+		fill_frames(frames, 480, p * 480);
+		chiaki_echo_ring_write_stereo(ring, frames, 480, CHIAKI_AUDIO_GAIN_UNITY, t0 + SAMPLE_US(p * 480));
+	}
+
+	// the last 1024 of 2400 samples are kept
+	munit_assert_size(chiaki_echo_ring_read(ring, buf, 480, t0 + SAMPLE_US(1900)), ==, 480);
+	for(size_t i=0; i<480; i++)
+		munit_assert_int16(buf[i], ==, (int16_t)(1900 + i));
+
+	// straddling the oldest kept sample
+	munit_assert_size(chiaki_echo_ring_read(ring, buf, 480, t0 + SAMPLE_US(1276)), ==, 380);
+	for(size_t i=0; i<100; i++)
+		munit_assert_int16(buf[i], ==, 0);
+	for(size_t i=100; i<480; i++)
+		munit_assert_int16(buf[i], ==, (int16_t)(1276 + i));
+
+	// straddling the newest sample
+	munit_assert_size(chiaki_echo_ring_read(ring, buf, 480, t0 + SAMPLE_US(2200)), ==, 200);
+	for(size_t i=0; i<200; i++)
+		munit_assert_int16(buf[i], ==, (int16_t)(2200 + i));
+	for(size_t i=200; i<480; i++)
+		munit_assert_int16(buf[i], ==, 0);
+
+	// not played yet
+	munit_assert_size(chiaki_echo_ring_read(ring, buf, 480, t0 + SAMPLE_US(3000)), ==, 0);
+
+	ChiakiEchoRingStats stats;
+	chiaki_echo_ring_get_stats(ring, &stats);
+	munit_assert_uint64(stats.samples_read, ==, 5 * 480);
+	munit_assert_uint64(stats.samples_missing, ==, 480 + 100 + 280 + 480);
+	munit_assert_int64(stats.offset_us, ==, (int64_t)SAMPLE_US(600));
+
+	chiaki_echo_ring_free(ring);
+	return MUNIT_OK;
+}
+
+static MunitResult test_timing(const MunitParameter params[], void *user)
+{
+	ChiakiEchoRing *ring = chiaki_echo_ring_new(RATE, 48000);
+	munit_assert_not_null(ring);
+
+	int16_t frames[2 * 480];
+	int16_t buf[16];
+	const uint64_t t0 = 5000000;
+
+	// jitter of the reported play time within a few hundred us is smoothed out
+	static const int jitter_us[] = { 0, 300, -200, 150, -300, 0, 250, -100 };
+	for(size_t p=0; p<8; p++)
+	{
+		fill_frames(frames, 480, p * 480);
+		chiaki_echo_ring_write_stereo(ring, frames, 480, CHIAKI_AUDIO_GAIN_UNITY, t0 + SAMPLE_US(p * 480) + jitter_us[p]);
+	}
+	munit_assert_size(chiaki_echo_ring_read(ring, buf, 16, t0 + SAMPLE_US(2000)), ==, 16);
+	munit_assert_int(buf[0], >=, 2000 - 48 / 4);
+	munit_assert_int(buf[0], <=, 2000 + 48 / 4);
+
+	// a gap in playback moves the mapping right away
+	const uint64_t t1 = t0 + 3000000;
+	fill_frames(frames, 480, 10000);
+	chiaki_echo_ring_write_stereo(ring, frames, 480, CHIAKI_AUDIO_GAIN_UNITY, t1);
+	munit_assert_size(chiaki_echo_ring_read(ring, buf, 16, t1 + SAMPLE_US(100)), ==, 16);
+	for(size_t i=0; i<16; i++)
+		munit_assert_int16(buf[i], ==, (int16_t)(10100 + i));
+
+	// with gain
+	fill_frames(frames, 480, 0);
+	for(size_t i=0; i<480; i++)
+		frames[2 * i + 1] = 1000;
+	chiaki_echo_ring_write_stereo(ring, frames, 480, 0x4000, t1 + SAMPLE_US(480));
+	munit_assert_size(chiaki_echo_ring_read(ring, buf, 16, t1 + SAMPLE_US(480)), ==, 16);
+	for(size_t i=0; i<16; i++)
+		munit_assert_int16(buf[i], ==, (int16_t)(((int32_t)i + 1000) * 0x2000 >> 15));
+
+	chiaki_echo_ring_free(ring);
+	return MUNIT_OK;
+}
+
+MunitTest tests_echo_ring[] = {
+	{
+		"/downmix",
+		test_downmix,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{
+		"/upmix",
+		test_upmix,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{
+		"/ring",
+		test_ring,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{
+		"/timing",
+		test_timing,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{ NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL }
+};
@@ -0,0 +1,105 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#include <munit.h>
+
+#include <chiaki/frameprocessor.h>
+
+
+static MunitResult test_stream_stats_window(const MunitParameter params[], void *user)
+{
+	ChiakiStreamStats stats;
+	chiaki_stream_stats_reset(&stats);
+
+	ChiakiStreamStatsWindow window;
+	chiaki_stream_stats_window_at(&stats, 1000000, &window);
+	munit_assert_uint64(window.frames, ==, 0);
+	munit_assert_uint64(window.bitrate, ==, 0);
+
+	// 1 second of 50 fps, 1000 bytes per frame, except every 10th frame which is 5000 bytes
+	uint64_t ts = 1000000;
+	for(int i=0; i<=50; i++)
+	{
+		chiaki_stream_stats_frame_at(&stats, i % 10 == 0 ? 5000 : 1000, ts);
+		if(i % 10 == 0)
+			chiaki_stream_stats_iframe(&stats);
+		ts += 20000;
+	}
+	ts -= 20000;
+
+	chiaki_stream_stats_window_at(&stats, ts, &window);
+	munit_assert_uint64(window.frames, ==, 51);
+	munit_assert_uint64(window.span_us, ==, 1000000);
+	munit_assert_double_equal(window.fps, 50.0, 6);
+	// 5 I-frames and 45 P-frames after the first one
+	munit_assert_uint64(window.bitrate, ==, (5 * 5000 + 45 * 1000) * 8);
+	munit_assert_uint64(window.frame_size_p50, ==, 1000);
+	munit_assert_uint64(window.frame_size_p95, ==, 5000);
+	munit_assert_uint64(window.frame_size_max, ==, 5000);
+	munit_assert_uint64(window.iframe_size, ==, 5000);
+	munit_assert_uint64(window.iframe_interval_us, ==, 200000);
+
+	// frame rate halves, the window follows it instead of assuming the nominal rate
+	for(int i=0; i<100; i++)
+	{
+		ts += 40000;
+		chiaki_stream_stats_frame_at(&stats, 1000, ts);
+	}
+	chiaki_stream_stats_window_at(&stats, ts, &window);
+	munit_assert_uint64(window.span_us, <=, CHIAKI_STREAM_STATS_WINDOW_US);
+	munit_assert_double_equal(window.fps, 25.0, 6);
+	munit_assert_uint64(window.bitrate, ==, 25 * 1000 * 8);
+	munit_assert_uint64(window.frame_size_max, ==, 1000);
+
+	// nothing arrived for longer than the window
+	chiaki_stream_stats_window_at(&stats, ts + CHIAKI_STREAM_STATS_WINDOW_US + 1, &window);
+	munit_assert_uint64(window.frames, ==, 0);
+	munit_assert_double(window.fps, ==, 0.0);
+	munit_assert_uint64(window.iframe_size, ==, 5000);
+
+	munit_assert_uint64(stats.frames, ==, 151);
+	return MUNIT_OK;
+}
+
+static MunitResult test_stream_stats_overflow(const MunitParameter params[], void *user)
+{
+	ChiakiStreamStats stats;
+	chiaki_stream_stats_reset(&stats);
+
+	// more frames within the window than the ring holds
+	uint64_t ts = 1000000;
+	for(int i=0; i<CHIAKI_STREAM_STATS_WINDOW_FRAMES_MAX * 2; i++)
+	{
+		chiaki_stream_stats_frame_at(&stats, (uint64_t)i, ts);
+		ts += 1000;
+	}
+	ts -= 1000;
+
+	ChiakiStreamStatsWindow window;
+	chiaki_stream_stats_window_at(&stats, ts, &window);
+	munit_assert_uint64(window.frames, ==, CHIAKI_STREAM_STATS_WINDOW_FRAMES_MAX);
+	munit_assert_double_equal(window.fps, 1000.0, 6);
+	munit_assert_uint64(window.frame_size_max, ==, CHIAKI_STREAM_STATS_WINDOW_FRAMES_MAX * 2 - 1);
+
+	return MUNIT_OK;
+}
+
+
+MunitTest tests_frame_processor[] = {
+	{
+		"/stream_stats_window",
+		test_stream_stats_window,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{
+		"/stream_stats_overflow",
+		test_stream_stats_overflow,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{ NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL }
+};
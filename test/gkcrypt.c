@@ -63,7 +63,7 @@ static MunitResult test_key_stream(const MunitParameter params[], void *user)
 	ChiakiLog log;
 
 	ChiakiGKCrypt gkcrypt;
-	ChiakiErrorCode err = chiaki_gkcrypt_init(&gkcrypt, &log, 0, 42, handshake_key, ecdh_secret);
+	ChiakiErrorCode err = chiaki_gkcrypt_init(&gkcrypt, &log, 0, NULL, 42, handshake_key, ecdh_secret);
 	if(err != CHIAKI_ERR_SUCCESS)
 		return MUNIT_ERROR;
 
@@ -109,7 +109,7 @@ static MunitResult test_endecrypt(const MunitParameter params[], void *user)
 	ChiakiLog log;
 
 	ChiakiGKCrypt gkcrypt;
-	ChiakiErrorCode err = chiaki_gkcrypt_init(&gkcrypt, &log, 0, 42, handshake_key, ecdh_secret);
+	ChiakiErrorCode err = chiaki_gkcrypt_init(&gkcrypt, &log, 0, NULL, 42, handshake_key, ecdh_secret);
 	if(err != CHIAKI_ERR_SUCCESS)
 		return MUNIT_ERROR;
 
@@ -365,7 +365,7 @@ static MunitResult test_gmac_multiple_of_key_refresh(const MunitParameter params
 
 	ChiakiLog log;
 	ChiakiGKCrypt gkcrypt;
-	chiaki_gkcrypt_init(&gkcrypt, &log, 0, crypt_index, handshake_key, ecdh_secret);
+	chiaki_gkcrypt_init(&gkcrypt, &log, 0, NULL, crypt_index, handshake_key, ecdh_secret);
 
 	uint8_t gmac[CHIAKI_GKCRYPT_GMAC_SIZE];
 	ChiakiErrorCode err = chiaki_gkcrypt_gmac(&gkcrypt, key_pos, data, sizeof(data), gmac);
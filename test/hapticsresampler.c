@@ -0,0 +1,130 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#include <munit.h>
+
+#include <chiaki/hapticsresampler.h>
+
+#include <string.h>
+
+#define OUT_SAMPLES(frames) ((frames) * CHIAKI_HAPTICS_RESAMPLER_RATIO * CHIAKI_HAPTICS_RESAMPLER_CHANNELS_OUT)
+
+static MunitResult test_impulse(const MunitParameter params[], void *user)
+{
+	ChiakiHapticsResampler resampler;
+	chiaki_haptics_resampler_init(&resampler);
+
+	int16_t in[2 * 16] = { 0 };
+	in[0] = 10000;
+	in[1] = -20000;
+	int16_t out[OUT_SAMPLES(16)];
+	chiaki_haptics_resampler_process(&resampler, out, in, 16);
+
+	for(size_t i=0; i<16 * CHIAKI_HAPTICS_RESAMPLER_RATIO; i++)
+	{
+		const int16_t *frame = out + i * CHIAKI_HAPTICS_RESAMPLER_CHANNELS_OUT;
+		munit_assert_int16(frame[0], ==, 0);
+		munit_assert_int16(frame[1], ==, 0);
+		// the input frames pass through unchanged on the first phase, delayed
+		if(i % CHIAKI_HAPTICS_RESAMPLER_RATIO == 0)
+		{
+			bool hit = i == CHIAKI_HAPTICS_RESAMPLER_DELAY * CHIAKI_HAPTICS_RESAMPLER_RATIO;
+			munit_assert_int16(frame[2], ==, hit ? 10000 : 0);
+			munit_assert_int16(frame[3], ==, hit ? -20000 : 0);
+		}
+	}
+	return MUNIT_OK;
+}
+
+static MunitResult test_gain(const MunitParameter params[], void *user)
+{
+	ChiakiHapticsResampler resampler;
+	chiaki_haptics_resampler_init(&resampler);
+
+	int16_t in[2 * 32];
+	for(size_t i=0; i<32; i++)
+	{
+		in[2 * i] = 1000;
+		in[2 * i + 1] = 20000;
+	}
+	int16_t out[OUT_SAMPLES(32)];
+
+	// constant input settles to the constant, scaled and clamped
+	static const struct { float gain; int16_t l; int16_t r; } cases[] = {
+		{ 1.0f, 1000, 20000 },
+		{ 0.5f, 500, 10000 },
+		{ 2.0f, 2000, INT16_MAX },
+		{ 10.0f, 2000, INT16_MAX },
+		{ 0.0f, 0, 0 }
+	};
+	for(size_t c=0; c<sizeof(cases) / sizeof(cases[0]); c++)
+	{
+		chiaki_haptics_resampler_set_gain(&resampler, cases[c].gain);
+		chiaki_haptics_resampler_process(&resampler, out, in, 32);
+		for(size_t i=CHIAKI_HAPTICS_RESAMPLER_TAPS * CHIAKI_HAPTICS_RESAMPLER_RATIO; i<32 * CHIAKI_HAPTICS_RESAMPLER_RATIO; i++)
+		{
+			const int16_t *frame = out + i * CHIAKI_HAPTICS_RESAMPLER_CHANNELS_OUT;
+			munit_assert_int(frame[2], >=, cases[c].l - 1);
+			munit_assert_int(frame[2], <=, cases[c].l + 1);
+			munit_assert_int(frame[3], >=, cases[c].r - 1);
+			munit_assert_int(frame[3], <=, cases[c].r + 1);
+		}
+	}
+	return MUNIT_OK;
+}
+
+static MunitResult test_stream(const MunitParameter params[], void *user)
+{
+	// splitting the input into packets of any size gives the same output as one call
+	int16_t in[2 * 150];
+	for(size_t i=0; i<sizeof(in) / sizeof(in[0]); i++)
+		in[i] = (int16_t)munit_rand_int_range(INT16_MIN, INT16_MAX);
+
+	ChiakiHapticsResampler resampler;
+	chiaki_haptics_resampler_init(&resampler);
+	chiaki_haptics_resampler_set_gain(&resampler, 1.5f);
+	static int16_t expected[OUT_SAMPLES(150)];
+	chiaki_haptics_resampler_process(&resampler, expected, in, 150);
+
+	chiaki_haptics_resampler_init(&resampler);
+	chiaki_haptics_resampler_set_gain(&resampler, 1.5f);
+	static int16_t out[OUT_SAMPLES(150)];
+	static const size_t packets[] = { 30, 1, 7, 70, 42 };
+	size_t offset = 0;
+	for(size_t i=0; i<sizeof(packets) / sizeof(packets[0]); i++)
+	{
+		chiaki_haptics_resampler_process(&resampler, out + OUT_SAMPLES(offset), in + 2 * offset, packets[i]);
+		offset += packets[i];
+	}
+	munit_assert_size(offset, ==, 150);
+	munit_assert_memory_equal(sizeof(out), out, expected);
+	return MUNIT_OK;
+}
+
+
+MunitTest tests_haptics_resampler[] = {
+	{
+		"/impulse",
+		test_impulse,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{
+		"/gain",
+		test_gain,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{
+		"/stream",
+		test_stream,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{ NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL }
+};
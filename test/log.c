@@ -0,0 +1,211 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#include <munit.h>
+
+#include <chiaki/log.h>
+#include <chiaki/thread.h>
+#include <chiaki/stoppipe.h>
+
+#include <stdio.h>
+#include <string.h>
+
+#define THREADS_COUNT 4
+#define MESSAGES_PER_THREAD 0x1000
+
+typedef struct log_async_test_t
+{
+	ChiakiLog log;
+	uint64_t received;
+	uint64_t dropped_reported;
+	int last_index[THREADS_COUNT];
+	bool out_of_order;
+	bool wrong_content;
+} LogAsyncTest;
+
+static void log_async_test_cb(ChiakiLogLevel level, const char *msg, void *user)
+{
+	LogAsyncTest *test = user;
+	unsigned long long dropped;
+	if(level == CHIAKI_LOG_WARNING && sscanf(msg, "Log dropped %llu messages", &dropped) == 1)
+	{
+		test->dropped_reported += dropped;
+		return;
+	}
+	int thread_index, index;
+	if(level != CHIAKI_LOG_INFO || sscanf(msg, "thread %d message %d", &thread_index, &index) != 2
+		|| thread_index < 0 || thread_index >= THREADS_COUNT)
+	{
+		test->wrong_content = true;
+		return;
+	}
+	if(index <= test->last_index[thread_index])
+		test->out_of_order = true;
+	test->last_index[thread_index] = index;
+	test->received++;
+}
+
+typedef struct log_async_thread_t
+{
+	LogAsyncTest *test;
+	int index;
+} LogAsyncThread;
+
+static void *log_async_thread_func(void *user)
+{
+	LogAsyncThread *thread = user;
+	for(int i=0; i<MESSAGES_PER_THREAD; i++)
+		CHIAKI_LOGI(&thread->test->log, "thread %d message %d", thread->index, i);
+	return NULL;
+}
+
+static MunitResult test_async(const MunitParameter params[], void *user)
+{
+	LogAsyncTest test;
+	memset(&test, 0, sizeof(test));
+	for(size_t i=0; i<THREADS_COUNT; i++)
+		test.last_index[i] = -1;
+	chiaki_log_init(&test.log, CHIAKI_LOG_ALL, log_async_test_cb, &test);
+
+	ChiakiErrorCode err = chiaki_log_async_start(&test.log);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+
+	ChiakiThread threads[THREADS_COUNT];
+	LogAsyncThread thread_args[THREADS_COUNT];
+	for(int i=0; i<THREADS_COUNT; i++)
+	{
+		thread_args[i].test = &test;
+		thread_args[i].index = i;
+		err = chiaki_thread_create(&threads[i], log_async_thread_func, &thread_args[i]);
+		munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+	}
+	for(int i=0; i<THREADS_COUNT; i++)
+		chiaki_thread_join(&threads[i], NULL);
+
+	// filtered by the level mask before anything is queued
+	chiaki_log_set_level(&test.log, CHIAKI_LOG_ERROR);
+	CHIAKI_LOGI(&test.log, "filtered");
+
+	uint64_t dropped = chiaki_log_async_dropped(&test.log);
+	chiaki_log_async_stop(&test.log);
+	munit_assert_null(test.log.async);
+
+	munit_assert_false(test.wrong_content);
+	munit_assert_false(test.out_of_order);
+	munit_assert_uint64(test.received + dropped, ==, THREADS_COUNT * MESSAGES_PER_THREAD);
+	munit_assert_uint64(test.dropped_reported, ==, dropped);
+
+	// synchronous again
+	chiaki_log_set_level(&test.log, CHIAKI_LOG_ALL);
+	uint64_t received = test.received;
+	CHIAKI_LOGI(&test.log, "thread 0 message %d", MESSAGES_PER_THREAD);
+	munit_assert_uint64(test.received, ==, received + 1);
+
+	return MUNIT_OK;
+}
+
+static void log_truncate_test_cb(ChiakiLogLevel level, const char *msg, void *user)
+{
+	*((size_t *)user) = strlen(msg);
+}
+
+static MunitResult test_async_truncate(const MunitParameter params[], void *user)
+{
+	size_t len = 0;
+	ChiakiLog log;
+	chiaki_log_init(&log, CHIAKI_LOG_ALL, log_truncate_test_cb, &len);
+	ChiakiErrorCode err = chiaki_log_async_start(&log);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+
+	char long_msg[CHIAKI_LOG_ASYNC_MSG_SIZE * 2];
+	memset(long_msg, 'a', sizeof(long_msg) - 1);
+	long_msg[sizeof(long_msg) - 1] = '\0';
+	CHIAKI_LOGI(&log, "%s", long_msg);
+
+	chiaki_log_async_stop(&log);
+	munit_assert_size(len, ==, CHIAKI_LOG_ASYNC_MSG_SIZE - 1);
+	return MUNIT_OK;
+}
+
+typedef struct log_rate_limit_test_t
+{
+	uint64_t messages;
+	uint64_t suppressed;
+} LogRateLimitTest;
+
+static void log_rate_limit_test_cb(ChiakiLogLevel level, const char *msg, void *user)
+{
+	LogRateLimitTest *test = user;
+	unsigned long long suppressed;
+	if(sscanf(msg, "Suppressed %llu similar messages", &suppressed) == 1)
+		test->suppressed += suppressed;
+	else
+		test->messages++;
+}
+
+static MunitResult test_rate_limit(const MunitParameter params[], void *user)
+{
+	LogRateLimitTest test = { 0 };
+	ChiakiLog log;
+	chiaki_log_init(&log, CHIAKI_LOG_ALL & ~CHIAKI_LOG_VERBOSE, log_rate_limit_test_cb, &test);
+
+	ChiakiLogRateLimit rl = { 0 };
+	for(int i=0; i<100; i++)
+	{
+		if(chiaki_log_rate_limit(&log, CHIAKI_LOG_WARNING, &rl))
+			CHIAKI_LOGW(&log, "message %d", i);
+	}
+	munit_assert_uint64(test.messages, ==, CHIAKI_LOG_RATE_LIMIT_BURST);
+	munit_assert_uint64(test.suppressed, ==, 0);
+
+	// masked levels don't count
+	munit_assert_false(chiaki_log_rate_limit(&log, CHIAKI_LOG_VERBOSE, &rl));
+
+	// after a refill, the suppressed messages are summarized once
+	ChiakiStopPipe stop_pipe;
+	ChiakiErrorCode err = chiaki_stop_pipe_init(&stop_pipe);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+	chiaki_stop_pipe_sleep(&stop_pipe, CHIAKI_LOG_RATE_LIMIT_REFILL_MS + 10);
+	chiaki_stop_pipe_fini(&stop_pipe);
+	munit_assert_true(chiaki_log_rate_limit(&log, CHIAKI_LOG_WARNING, &rl));
+	munit_assert_uint64(test.suppressed, ==, 100 - CHIAKI_LOG_RATE_LIMIT_BURST);
+	munit_assert_false(chiaki_log_rate_limit(&log, CHIAKI_LOG_WARNING, &rl));
+
+	// every call site has its own bucket
+	test.messages = 0;
+	for(int i=0; i<100; i++)
+		CHIAKI_LOGW_RL(&log, "site a %d", i);
+	for(int i=0; i<100; i++)
+		CHIAKI_LOGE_RL(&log, "site b %d", i);
+	munit_assert_uint64(test.messages, ==, 2 * CHIAKI_LOG_RATE_LIMIT_BURST);
+
+	return MUNIT_OK;
+}
+
+
+MunitTest tests_log[] = {
+	{
+		"/async",
+		test_async,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{
+		"/async_truncate",
+		test_async_truncate,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{
+		"/rate_limit",
+		test_rate_limit,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{ NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL }
+};
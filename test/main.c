@@ -2,6 +2,8 @@
 
 #include <munit.h>
 
+#include <chiaki/config.h>
+
 extern MunitTest tests_seq_num[];
 extern MunitTest tests_key_state[];
 extern MunitTest tests_reorder_queue[];
@@ -12,6 +14,24 @@ extern MunitTest tests_takion[];
 extern MunitTest tests_fec[];
 extern MunitTest tests_regist[];
 extern MunitTest tests_bitstream[];
+extern MunitTest tests_metrics[];
+extern MunitTest tests_frame_processor[];
+extern MunitTest tests_log[];
+extern MunitTest tests_audio_jitter_buffer[];
+extern MunitTest tests_audio_ring[];
+extern MunitTest tests_haptics_resampler[];
+extern MunitTest tests_echo_ring[];
+extern MunitTest tests_ref_tracker[];
+extern MunitTest tests_worker_pool[];
+extern MunitTest tests_candidate_race[];
+extern MunitTest tests_stun_query[];
+extern MunitTest tests_netprofile[];
+#if CHIAKI_LIB_ENABLE_OPUS
+extern MunitTest tests_mic_pipeline[];
+#endif
+#if CHIAKI_LIB_ENABLE_FFMPEG_DECODER
+extern MunitTest tests_recorder[];
+#endif
 
 static MunitSuite suites[] = {
 	{
@@ -84,6 +104,108 @@ static MunitSuite suites[] = {
 		1,
 		MUNIT_SUITE_OPTION_NONE
 	},
+	{
+		"/metrics",
+		tests_metrics,
+		NULL,
+		1,
+		MUNIT_SUITE_OPTION_NONE
+	},
+	{
+		"/frame_processor",
+		tests_frame_processor,
+		NULL,
+		1,
+		MUNIT_SUITE_OPTION_NONE
+	},
+	{
+		"/log",
+		tests_log,
+		NULL,
+		1,
+		MUNIT_SUITE_OPTION_NONE
+	},
+	{
+		"/audio_jitter_buffer",
+		tests_audio_jitter_buffer,
+		NULL,
+		1,
+		MUNIT_SUITE_OPTION_NONE
+	},
+	{
+		"/audio_ring",
+		tests_audio_ring,
+		NULL,
+		1,
+		MUNIT_SUITE_OPTION_NONE
+	},
+	{
+		"/haptics_resampler",
+		tests_haptics_resampler,
+		NULL,
+		1,
+		MUNIT_SUITE_OPTION_NONE
+	},
+	{
+		"/echo_ring",
+		tests_echo_ring,
+		NULL,
+		1,
+		MUNIT_SUITE_OPTION_NONE
+	},
+	{
+		"/ref_tracker",
+		tests_ref_tracker,
+		NULL,
+		1,
+		MUNIT_SUITE_OPTION_NONE
+	},
+	{
+		"/worker_pool",
+		tests_worker_pool,
+		NULL,
+		1,
+		MUNIT_SUITE_OPTION_NONE
+	},
+	{
+		"/candidate_race",
+		tests_candidate_race,
+		NULL,
+		1,
+		MUNIT_SUITE_OPTION_NONE
+	},
+	{
+		"/stun_query",
+		tests_stun_query,
+		NULL,
+		1,
+		MUNIT_SUITE_OPTION_NONE
+	},
+	{
+		"/netprofile",
+		tests_netprofile,
+		NULL,
+		1,
+		MUNIT_SUITE_OPTION_NONE
+	},
+#if CHIAKI_LIB_ENABLE_OPUS
+	{
+		"/mic_pipeline",
+		tests_mic_pipeline,
+		NULL,
+		1,
+		MUNIT_SUITE_OPTION_NONE
+	},
+#endif
+#if CHIAKI_LIB_ENABLE_FFMPEG_DECODER
+	{
+		"/recorder",
+		tests_recorder,
+		NULL,
+		1,
+		MUNIT_SUITE_OPTION_NONE
+	},
+#endif
 	{ NULL, NULL, NULL, 0, MUNIT_SUITE_OPTION_NONE }
 };
 
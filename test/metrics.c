@@ -0,0 +1,145 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#include <munit.h>
+
+#include <chiaki/metrics.h>
+
+#include <string.h>
+
+
+static MunitResult test_counters_gauges(const MunitParameter params[], void *user)
+{
+	ChiakiMetrics *metrics = chiaki_metrics_new();
+	munit_assert_not_null(metrics);
+
+	chiaki_metrics_counter_inc(metrics, CHIAKI_METRIC_FEC_ATTEMPTS);
+	chiaki_metrics_counter_add(metrics, CHIAKI_METRIC_FEC_ATTEMPTS, 4);
+	chiaki_metrics_counter_add(metrics, CHIAKI_METRIC_VIDEO_BYTES, 1337);
+	chiaki_metrics_gauge_set(metrics, CHIAKI_METRIC_BITRATE_MBPS, 12.5);
+	chiaki_metrics_gauge_set(metrics, CHIAKI_METRIC_BITRATE_MBPS, 15.25);
+
+	// wrong metric types are ignored
+	chiaki_metrics_gauge_set(metrics, CHIAKI_METRIC_FEC_ATTEMPTS, 1000.0);
+	chiaki_metrics_counter_inc(metrics, CHIAKI_METRIC_BITRATE_MBPS);
+
+	// NULL registry is a no-op
+	chiaki_metrics_counter_inc(NULL, CHIAKI_METRIC_FEC_ATTEMPTS);
+
+	ChiakiMetricsSnapshot snapshot;
+	chiaki_metrics_snapshot(metrics, &snapshot);
+	munit_assert_double(snapshot.values[CHIAKI_METRIC_FEC_ATTEMPTS].value, ==, 5.0);
+	munit_assert_double(snapshot.values[CHIAKI_METRIC_VIDEO_BYTES].value, ==, 1337.0);
+	munit_assert_double(snapshot.values[CHIAKI_METRIC_BITRATE_MBPS].value, ==, 15.25);
+	munit_assert_double(snapshot.values[CHIAKI_METRIC_FEC_SUCCESSES].value, ==, 0.0);
+
+	chiaki_metrics_reset(metrics);
+	chiaki_metrics_snapshot(metrics, &snapshot);
+	munit_assert_double(snapshot.values[CHIAKI_METRIC_FEC_ATTEMPTS].value, ==, 0.0);
+	munit_assert_double(snapshot.values[CHIAKI_METRIC_BITRATE_MBPS].value, ==, 0.0);
+
+	chiaki_metrics_free(metrics);
+	return MUNIT_OK;
+}
+
+static MunitResult test_histogram(const MunitParameter params[], void *user)
+{
+	ChiakiMetrics *metrics = chiaki_metrics_new();
+	munit_assert_not_null(metrics);
+
+	size_t bounds_count;
+	const double *bounds = chiaki_metric_histogram_bounds(CHIAKI_METRIC_DECODE_TIME_MS, &bounds_count);
+	munit_assert_not_null(bounds);
+	munit_assert_size(bounds_count, >, 1);
+	munit_assert_size(bounds_count, <=, CHIAKI_METRICS_HISTOGRAM_BUCKETS_MAX);
+	munit_assert_null(chiaki_metric_histogram_bounds(CHIAKI_METRIC_FPS, NULL));
+
+	chiaki_metrics_histogram_observe(metrics, CHIAKI_METRIC_DECODE_TIME_MS, bounds[0]); // upper bound is inclusive
+	chiaki_metrics_histogram_observe(metrics, CHIAKI_METRIC_DECODE_TIME_MS, bounds[0] + 0.01);
+	chiaki_metrics_histogram_observe(metrics, CHIAKI_METRIC_DECODE_TIME_MS, bounds[bounds_count - 1] * 2.0);
+
+	ChiakiMetricsSnapshot snapshot;
+	chiaki_metrics_snapshot(metrics, &snapshot);
+	ChiakiMetricValue *v = &snapshot.values[CHIAKI_METRIC_DECODE_TIME_MS];
+	munit_assert_uint64(v->count, ==, 3);
+	munit_assert_double_equal(v->sum, bounds[0] * 2.0 + 0.01 + bounds[bounds_count - 1] * 2.0, 6);
+	munit_assert_uint64(v->buckets[0], ==, 1);
+	munit_assert_uint64(v->buckets[1], ==, 1);
+	munit_assert_uint64(v->buckets[bounds_count], ==, 1);
+
+	chiaki_metrics_free(metrics);
+	return MUNIT_OK;
+}
+
+static MunitResult test_format(const MunitParameter params[], void *user)
+{
+	ChiakiMetrics *metrics = chiaki_metrics_new();
+	munit_assert_not_null(metrics);
+
+	chiaki_metrics_counter_add(metrics, CHIAKI_METRIC_VIDEO_FRAMES, 42);
+	chiaki_metrics_gauge_set(metrics, CHIAKI_METRIC_RTT_MS, 3.5);
+	chiaki_metrics_histogram_observe(metrics, CHIAKI_METRIC_DECODE_TIME_MS, 1.0);
+
+	ChiakiMetricsSnapshot snapshot;
+	chiaki_metrics_snapshot(metrics, &snapshot);
+
+	char buf[0x4000];
+	size_t buf_size = sizeof(buf);
+	ChiakiErrorCode err = chiaki_metrics_format_prometheus(&snapshot, "host=\"ps5\"", buf, &buf_size);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+	munit_assert_size(buf_size, ==, strlen(buf));
+	munit_assert_not_null(strstr(buf, "# TYPE chiaki_video_frames_total counter\n"));
+	munit_assert_not_null(strstr(buf, "\nchiaki_video_frames_total{host=\"ps5\"} 42\n"));
+	munit_assert_not_null(strstr(buf, "\nchiaki_rtt_ms{host=\"ps5\"} 3.5\n"));
+	munit_assert_not_null(strstr(buf, "\nchiaki_decode_time_ms_bucket{host=\"ps5\",le=\"+Inf\"} 1\n"));
+	munit_assert_not_null(strstr(buf, "\nchiaki_decode_time_ms_count{host=\"ps5\"} 1\n"));
+
+	buf_size = sizeof(buf);
+	err = chiaki_metrics_format_prometheus(&snapshot, NULL, buf, &buf_size);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+	munit_assert_not_null(strstr(buf, "\nchiaki_video_frames_total 42\n"));
+	munit_assert_not_null(strstr(buf, "\nchiaki_decode_time_ms_bucket{le=\"+Inf\"} 1\n"));
+
+	buf_size = sizeof(buf);
+	err = chiaki_metrics_format_json(&snapshot, buf, &buf_size);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+	munit_assert_char(buf[0], ==, '{');
+	munit_assert_ptr_equal(strchr(buf, '\n'), buf + buf_size - 1); // exactly one line
+	munit_assert_not_null(strstr(buf, "\"chiaki_video_frames_total\":42"));
+	munit_assert_not_null(strstr(buf, "\"chiaki_decode_time_ms\":{\"count\":1,"));
+
+	buf_size = 16;
+	err = chiaki_metrics_format_prometheus(&snapshot, NULL, buf, &buf_size);
+	munit_assert_int(err, ==, CHIAKI_ERR_BUF_TOO_SMALL);
+
+	chiaki_metrics_free(metrics);
+	return MUNIT_OK;
+}
+
+
+MunitTest tests_metrics[] = {
+	{
+		"/counters_gauges",
+		test_counters_gauges,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{
+		"/histogram",
+		test_histogram,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{
+		"/format",
+		test_format,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{ NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL }
+};
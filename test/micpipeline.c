@@ -0,0 +1,167 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#include <munit.h>
+
+#include <chiaki/config.h>
+#if CHIAKI_LIB_ENABLE_OPUS
+
+#include <chiaki/micpipeline.h>
+
+#include <string.h>
+
+#include "test_log.h"
+
+#define RATE 48000
+#define FRAME_SIZE 480
+#define FRAMES_MAX 8
+
+typedef struct received_t
+{
+	ChiakiMutex mutex;
+	ChiakiCond cond;
+	size_t count;
+	int16_t first_sample[FRAMES_MAX];
+	int16_t last_sample[FRAMES_MAX];
+	uint64_t capture_us[FRAMES_MAX];
+} Received;
+
+static int16_t *process_cb(int16_t *pcm, size_t frames, uint64_t capture_us, void *user)
+{
+	Received *received = user;
+	munit_assert_size(frames, ==, FRAME_SIZE);
+	chiaki_mutex_lock(&received->mutex);
+	if(received->count < FRAMES_MAX)
+	{
+		received->first_sample[received->count] = pcm[0];
+		received->last_sample[received->count] = pcm[frames - 1];
+		received->capture_us[received->count] = capture_us;
+	}
+	received->count++;
+	chiaki_cond_signal(&received->cond);
+	chiaki_mutex_unlock(&received->mutex);
+	return NULL; // nothing to send to
+}
+
+static bool received_check(void *user)
+{
+	Received *received = user;
+	return received->count >= 3;
+}
+
+static void push_ramp(ChiakiMicPipeline *pipeline, size_t first, size_t count, uint64_t capture_end_us)
+{
+	int16_t buf[FRAME_SIZE * 2];
+	munit_assert_size(count, <=, sizeof(buf) / sizeof(buf[0]));
+	for(size_t i=0; i<count; i++)
+		buf[i] = (int16_t)(first + i);
+	chiaki_mic_pipeline_push(pipeline, buf, count, capture_end_us);
+}
+
+static MunitResult test_frames(const MunitParameter params[], void *user)
+{
+	Received received = { 0 };
+	chiaki_mutex_init(&received.mutex, false);
+	chiaki_cond_init(&received.cond);
+
+	ChiakiOpusEncoder encoder;
+	chiaki_opus_encoder_init(&encoder, get_test_log());
+	chiaki_audio_header_set(&encoder.audio_header, 2, 16, RATE, FRAME_SIZE);
+
+	ChiakiMicPipeline pipeline;
+	ChiakiErrorCode err = chiaki_mic_pipeline_start(&pipeline, get_test_log(), &encoder, 1, RATE, process_cb, &received, NULL);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+
+	// device buffers that don't line up with the encoder frames, 10 ms of capture every 10 ms
+	const uint64_t t0 = 1000000;
+	size_t pushed = 0;
+	static const size_t sizes[] = { 300, 300, 300, 600, 300 };
+	for(size_t i=0; i<sizeof(sizes) / sizeof(sizes[0]); i++)
+	{
+		push_ramp(&pipeline, pushed, sizes[i], t0 + (pushed + sizes[i]) * 1000000 / RATE);
+		pushed += sizes[i];
+	}
+
+	chiaki_mutex_lock(&received.mutex);
+	chiaki_cond_wait_pred(&received.cond, &received.mutex, received_check, &received);
+	munit_assert_size(received.count, ==, 3); // 1800 frames, the remaining 360 wait for more
+	for(size_t f=0; f<3; f++)
+	{
+		munit_assert_int16(received.first_sample[f], ==, (int16_t)(f * FRAME_SIZE));
+		munit_assert_int16(received.last_sample[f], ==, (int16_t)(f * FRAME_SIZE + FRAME_SIZE - 1));
+		munit_assert_uint64(received.capture_us[f], ==, t0 + f * 10000);
+	}
+	chiaki_mutex_unlock(&received.mutex);
+
+	ChiakiMicPipelineStats stats;
+	chiaki_mic_pipeline_get_stats(&pipeline, &stats);
+	munit_assert_uint64(stats.frames_dropped, ==, 0);
+
+	chiaki_mic_pipeline_stop(&pipeline);
+	chiaki_opus_encoder_fini(&encoder);
+	chiaki_cond_fini(&received.cond);
+	chiaki_mutex_fini(&received.mutex);
+	return MUNIT_OK;
+}
+
+static bool received_one_check(void *user)
+{
+	Received *received = user;
+	return received->count >= 1;
+}
+
+static MunitResult test_flush(const MunitParameter params[], void *user)
+{
+	Received received = { 0 };
+	chiaki_mutex_init(&received.mutex, false);
+	chiaki_cond_init(&received.cond);
+
+	ChiakiOpusEncoder encoder;
+	chiaki_opus_encoder_init(&encoder, get_test_log());
+	chiaki_audio_header_set(&encoder.audio_header, 2, 16, RATE, FRAME_SIZE);
+
+	ChiakiMicPipeline pipeline;
+	ChiakiErrorCode err = chiaki_mic_pipeline_start(&pipeline, get_test_log(), &encoder, 1, RATE, process_cb, &received, NULL);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+
+	// the partial frame before muting must not end up in front of the audio after unmuting
+	push_ramp(&pipeline, 1000, 200, 2000000);
+	chiaki_mic_pipeline_flush(&pipeline);
+	push_ramp(&pipeline, 0, FRAME_SIZE, 3000000);
+
+	chiaki_mutex_lock(&received.mutex);
+	chiaki_cond_wait_pred(&received.cond, &received.mutex, received_one_check, &received);
+	munit_assert_int16(received.first_sample[0], ==, 0);
+	munit_assert_int16(received.last_sample[0], ==, FRAME_SIZE - 1);
+	munit_assert_uint64(received.capture_us[0], ==, 3000000 - 10000);
+	chiaki_mutex_unlock(&received.mutex);
+
+	chiaki_mic_pipeline_stop(&pipeline);
+	// the capture callback may still deliver audio after stopping
+	push_ramp(&pipeline, 0, FRAME_SIZE, 4000000);
+	chiaki_opus_encoder_fini(&encoder);
+	chiaki_cond_fini(&received.cond);
+	chiaki_mutex_fini(&received.mutex);
+	return MUNIT_OK;
+}
+
+MunitTest tests_mic_pipeline[] = {
+	{
+		"/frames",
+		test_frames,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{
+		"/flush",
+		test_flush,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{ NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL }
+};
+
+#endif
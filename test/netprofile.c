@@ -0,0 +1,94 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#include <munit.h>
+
+#include <chiaki/netprofile.h>
+#include <chiaki/senkusha.h>
+
+#include <string.h>
+
+static MunitResult test_fingerprint_loopback(const MunitParameter params[], void *user)
+{
+	char fingerprint[CHIAKI_NETWORK_FINGERPRINT_SIZE];
+	ChiakiErrorCode err = chiaki_network_fingerprint("127.0.0.1", fingerprint, sizeof(fingerprint));
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+	munit_assert_size(strlen(fingerprint), <, sizeof(fingerprint));
+	munit_assert_memory_equal(3, fingerprint, "lan");
+
+	// the same path must always be described the same way
+	char again[CHIAKI_NETWORK_FINGERPRINT_SIZE];
+	err = chiaki_network_fingerprint("127.0.0.1", again, sizeof(again));
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+	munit_assert_string_equal(again, fingerprint);
+
+	char tiny[4];
+	err = chiaki_network_fingerprint("127.0.0.1", tiny, sizeof(tiny));
+	munit_assert_int(err, ==, CHIAKI_ERR_BUF_TOO_SMALL);
+	munit_assert_size(strlen(tiny), <, sizeof(tiny));
+
+	err = chiaki_network_fingerprint("127.0.0.1", tiny, 0);
+	munit_assert_int(err, ==, CHIAKI_ERR_BUF_TOO_SMALL);
+
+	return MUNIT_OK;
+}
+
+static MunitResult test_senkusha_mtu_max(const MunitParameter params[], void *user)
+{
+	uint32_t full_in, full_out;
+	munit_assert_false(chiaki_senkusha_mtu_max(NULL, &full_in, &full_out));
+	munit_assert_uint32(full_in, ==, full_out);
+
+	// a lower cached MTU caps the search
+	ChiakiNetworkProfile cached = { 0 };
+	cached.mtu_in = full_in;
+	cached.mtu_out = 1200;
+	cached.rtt_us = 3000;
+	uint32_t mtu_in_max, mtu_out_max;
+	munit_assert_true(chiaki_senkusha_mtu_max(&cached, &mtu_in_max, &mtu_out_max));
+	munit_assert_uint32(mtu_in_max, ==, full_in);
+	munit_assert_uint32(mtu_out_max, ==, 1200);
+
+	cached.mtu_in = 1000;
+	munit_assert_true(chiaki_senkusha_mtu_max(&cached, &mtu_in_max, &mtu_out_max));
+	munit_assert_uint32(mtu_in_max, ==, 1000);
+	munit_assert_uint32(mtu_out_max, ==, 1200);
+
+	// values the tests could never have measured mean the full range is searched
+	static const uint32_t invalid[] = { 0, 576, 1455, 9000 };
+	for(size_t i=0; i<sizeof(invalid) / sizeof(invalid[0]); i++)
+	{
+		cached.mtu_in = invalid[i];
+		cached.mtu_out = 1200;
+		munit_assert_false(chiaki_senkusha_mtu_max(&cached, &mtu_in_max, &mtu_out_max));
+		munit_assert_uint32(mtu_in_max, ==, full_in);
+		munit_assert_uint32(mtu_out_max, ==, full_out);
+
+		cached.mtu_in = 1200;
+		cached.mtu_out = invalid[i];
+		munit_assert_false(chiaki_senkusha_mtu_max(&cached, &mtu_in_max, &mtu_out_max));
+		munit_assert_uint32(mtu_in_max, ==, full_in);
+		munit_assert_uint32(mtu_out_max, ==, full_out);
+	}
+
+	return MUNIT_OK;
+}
+
+MunitTest tests_netprofile[] = {
+	{
+		"/fingerprint_loopback",
+		test_fingerprint_loopback,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{
+		"/senkusha_mtu_max",
+		test_senkusha_mtu_max,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{ NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL }
+};
@@ -0,0 +1,129 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#include <munit.h>
+
+#include <chiaki/config.h>
+#if CHIAKI_LIB_ENABLE_FFMPEG_DECODER
+
+#include <chiaki/recorder.h>
+#include <libavformat/avformat.h>
+
+#include <stdio.h>
+#include <string.h>
+
+#define FRAME_US 16667
+#define AUDIO_FRAME_US 10000
+
+static const uint8_t header[] = {
+	0x00, 0x00, 0x00, 0x01, 0x67, 0x4d, 0x40, 0x32, 0x91, 0x8a, 0x01, 0xe0, 0x08, 0x9f, 0x97, 0x01,
+	0x6a, 0x02, 0x02, 0x02, 0x80, 0x00, 0x03, 0xe9, 0x00, 0x01, 0xd4, 0xc0, 0x44, 0xd0, 0xf1, 0xf1,
+	0x50, 0x00, 0x00, 0x00, 0x01, 0x68, 0xee, 0x3c, 0x80,
+	0x00, 0x00, 0x00, 0x00 // padding
+};
+
+static const uint8_t frame_idr[] = { 0x00, 0x00, 0x00, 0x01, 0x65, 0x88, 0x84, 0x00, 0x33, 0xff, 0xfe, 0xf6, 0xf0, 0xfe, 0x05, 0x36 };
+static const uint8_t frame_p[] = { 0x00, 0x00, 0x00, 0x01, 0x41, 0x9a, 0x21, 0x6c, 0x42, 0xbf, 0xfe, 0x38, 0x40, 0x00, 0x00, 0x03 };
+static const uint8_t opus_frame[] = { 0xf4, 0xff, 0xfe, 0xff, 0xfe }; // CELT 10ms stereo
+
+static void push_video(ChiakiRecorder *recorder, ChiakiBitstream *bitstream, const uint8_t *buf, size_t size, uint64_t t)
+{
+	ChiakiBitstreamNalIndex index;
+	chiaki_bitstream_index(bitstream, buf, size, &index);
+	chiaki_recorder_video_frame(recorder, buf, size, &index, t);
+}
+
+static MunitResult test_mkv(const MunitParameter params[], void *user)
+{
+	const char *path = "chiaki-recorder-test.mkv";
+	ChiakiRecorder *recorder = chiaki_recorder_new(NULL, NULL);
+	munit_assert_not_null(recorder);
+
+	ChiakiBitstream bitstream;
+	chiaki_bitstream_init(&bitstream, NULL, CHIAKI_CODEC_H264);
+	ChiakiBitstreamNalIndex index;
+	chiaki_bitstream_index(&bitstream, header, sizeof(header), &index);
+	chiaki_recorder_video_header(recorder, CHIAKI_CODEC_H264, 1280, 720, header, sizeof(header), &index);
+	ChiakiAudioHeader audio_header;
+	chiaki_audio_header_set(&audio_header, 2, 16, 48000, 480);
+	chiaki_recorder_audio_header(recorder, &audio_header);
+
+	munit_assert_int(chiaki_recorder_start(recorder, path, chiaki_recorder_format_from_path(path)), ==, CHIAKI_ERR_SUCCESS);
+
+	// nothing is recorded before the first keyframe, which is requested once
+	uint64_t t = 1000000;
+	chiaki_bitstream_index(&bitstream, frame_p, sizeof(frame_p), &index);
+	munit_assert_true(chiaki_recorder_video_frame(recorder, frame_p, sizeof(frame_p), &index, t));
+	munit_assert_false(chiaki_recorder_video_frame(recorder, frame_p, sizeof(frame_p), &index, t + FRAME_US));
+	chiaki_recorder_audio_frame(recorder, 0, opus_frame, sizeof(opus_frame), t);
+
+	t += 2 * FRAME_US;
+	push_video(recorder, &bitstream, frame_idr, sizeof(frame_idr), t);
+	for(unsigned i=1; i<30; i++)
+		push_video(recorder, &bitstream, frame_p, sizeof(frame_p), t + i * FRAME_US);
+	for(ChiakiSeqNum16 i=1; i<=50; i++)
+	{
+		if(i == 20)
+			continue; // lost
+		// arrival jitters, the timestamps must not
+		chiaki_recorder_audio_frame(recorder, i, opus_frame, sizeof(opus_frame), t + i * AUDIO_FRAME_US + (i % 3) * 3000);
+	}
+
+	chiaki_recorder_stop(recorder);
+	ChiakiRecorderStats stats;
+	chiaki_recorder_get_stats(recorder, &stats);
+	munit_assert_false(stats.recording);
+	munit_assert_false(stats.failed);
+	munit_assert_uint64(stats.video_frames, ==, 30);
+	munit_assert_uint64(stats.audio_frames, ==, 49);
+	munit_assert_uint64(stats.packets_dropped, ==, 0);
+	chiaki_recorder_free(recorder);
+
+	AVFormatContext *demuxer = NULL;
+	munit_assert_int(avformat_open_input(&demuxer, path, NULL, NULL), ==, 0);
+	munit_assert_int(avformat_find_stream_info(demuxer, NULL), >=, 0);
+	munit_assert_uint(demuxer->nb_streams, ==, 2);
+	munit_assert_int(demuxer->streams[0]->codecpar->codec_id, ==, AV_CODEC_ID_H264);
+	munit_assert_int(demuxer->streams[0]->codecpar->width, ==, 1280);
+	munit_assert_int(demuxer->streams[1]->codecpar->codec_id, ==, AV_CODEC_ID_OPUS);
+
+	unsigned int packets[2] = { 0 };
+	int64_t audio_pts_prev_us = -1;
+	AVPacket *packet = av_packet_alloc();
+	while(av_read_frame(demuxer, packet) >= 0)
+	{
+		munit_assert_int(packet->stream_index, <, 2);
+		if(!packets[packet->stream_index])
+			munit_assert_true(packet->flags & AV_PKT_FLAG_KEY);
+		if(packet->stream_index == 1)
+		{
+			AVRational tb = demuxer->streams[1]->time_base;
+			int64_t pts_us = av_rescale_q(packet->pts, tb, (AVRational){ 1, 1000000 });
+			if(audio_pts_prev_us >= 0)
+				munit_assert_int64(pts_us - audio_pts_prev_us, ==, packets[1] == 19 ? 2 * AUDIO_FRAME_US : AUDIO_FRAME_US);
+			audio_pts_prev_us = pts_us;
+		}
+		packets[packet->stream_index]++;
+		av_packet_unref(packet);
+	}
+	av_packet_free(&packet);
+	avformat_close_input(&demuxer);
+	remove(path);
+
+	munit_assert_uint(packets[0], ==, 30);
+	munit_assert_uint(packets[1], ==, 49);
+	return MUNIT_OK;
+}
+
+MunitTest tests_recorder[] = {
+	{
+		"/mkv",
+		test_mkv,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{ NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL }
+};
+
+#endif
@@ -0,0 +1,154 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#include <munit.h>
+
+#include <chiaki/reftracker.h>
+
+#define FRAME_US 16667
+
+static MunitResult test_refs(const MunitParameter params[], void *user)
+{
+	ChiakiRefTracker tracker;
+	ChiakiErrorCode err = chiaki_ref_tracker_init(&tracker, NULL);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+
+	munit_assert_false(chiaki_ref_tracker_have(&tracker, 0));
+	munit_assert_int32(chiaki_ref_tracker_sample_frame(&tracker, 0), ==, -1);
+
+	// wrapping around the 16 bit frame index
+	const ChiakiSeqNum16 first = 0xfff0;
+	uint64_t t = 1000000;
+	for(ChiakiSeqNum16 i=0; i<0x20; i++, t += FRAME_US)
+	{
+		if(i == 5)
+			continue; // lost
+		chiaki_ref_tracker_sample(&tracker, (ChiakiSeqNum16)(first + i));
+		chiaki_ref_tracker_submitted(&tracker, (ChiakiSeqNum16)(first + i), i == 0, t);
+	}
+	for(ChiakiSeqNum16 i=0; i<0x20; i++)
+		munit_assert(chiaki_ref_tracker_have(&tracker, (ChiakiSeqNum16)(first + i)) == (i != 5));
+	munit_assert_false(chiaki_ref_tracker_have(&tracker, (ChiakiSeqNum16)(first - 1)));
+	munit_assert_false(chiaki_ref_tracker_have(&tracker, (ChiakiSeqNum16)(first + 0x20)));
+
+	// the decoder failing on a frame takes everything after it with it
+	chiaki_ref_tracker_sample_decoded(&tracker, 10, true);
+	munit_assert_true(chiaki_ref_tracker_have(&tracker, (ChiakiSeqNum16)(first + 11)));
+	chiaki_ref_tracker_sample_decoded(&tracker, 20, false); // frame first + 21, as first + 5 was never sampled
+	for(ChiakiSeqNum16 i=6; i<0x20; i++)
+		munit_assert(chiaki_ref_tracker_have(&tracker, (ChiakiSeqNum16)(first + i)) == (i < 21));
+
+	// samples map back to their frames while they are in the window
+	munit_assert_int32(chiaki_ref_tracker_sample_frame(&tracker, 0), ==, first);
+	munit_assert_int32(chiaki_ref_tracker_sample_frame(&tracker, 20), ==, (ChiakiSeqNum16)(first + 21));
+	munit_assert_int32(chiaki_ref_tracker_sample_frame(&tracker, 31), ==, -1); // not sampled yet
+
+	// feedback for samples that are not frames or too old is ignored
+	chiaki_ref_tracker_sample(&tracker, -1);
+	chiaki_ref_tracker_sample_decoded(&tracker, 31, false);
+	chiaki_ref_tracker_sample_decoded(&tracker, 1000, false);
+	munit_assert_true(chiaki_ref_tracker_have(&tracker, (ChiakiSeqNum16)(first + 20)));
+
+	ChiakiRefTrackerStats stats;
+	chiaki_ref_tracker_get_stats(&tracker, &stats);
+	munit_assert_uint64(stats.decode_failures, ==, 1);
+
+	// an IDR frame makes everything before it unusable
+	chiaki_ref_tracker_submitted(&tracker, (ChiakiSeqNum16)(first + 0x22), true, t);
+	munit_assert_true(chiaki_ref_tracker_have(&tracker, (ChiakiSeqNum16)(first + 0x22)));
+	munit_assert_false(chiaki_ref_tracker_have(&tracker, (ChiakiSeqNum16)(first + 20)));
+
+	// jumping further than the window
+	chiaki_ref_tracker_submitted(&tracker, (ChiakiSeqNum16)(first + 0x22 + 100), false, t);
+	munit_assert_true(chiaki_ref_tracker_have(&tracker, (ChiakiSeqNum16)(first + 0x22 + 100)));
+	munit_assert_false(chiaki_ref_tracker_have(&tracker, (ChiakiSeqNum16)(first + 0x22)));
+
+	// samples older than the window can't be looked up anymore
+	for(unsigned i=0; i<CHIAKI_REF_TRACKER_WINDOW; i++)
+		chiaki_ref_tracker_sample(&tracker, -1);
+	munit_assert_int32(chiaki_ref_tracker_sample_frame(&tracker, 20), ==, -1);
+
+	chiaki_ref_tracker_fini(&tracker);
+	return MUNIT_OK;
+}
+
+static MunitResult test_recovery(const MunitParameter params[], void *user)
+{
+	ChiakiRefTracker tracker;
+	ChiakiErrorCode err = chiaki_ref_tracker_init(&tracker, NULL);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+
+	const uint64_t rtt_us = 20000;
+	uint64_t t = 1000000;
+	ChiakiSeqNum16 frame = 0;
+
+	// no regular IDR frames, so the only way out is asking
+	for(; frame<60; frame++, t += FRAME_US)
+		chiaki_ref_tracker_submitted(&tracker, frame, frame == 0, t);
+	munit_assert_int(chiaki_ref_tracker_recovery(&tracker, rtt_us, t), ==, CHIAKI_REF_RECOVERY_REQUEST);
+	// and only once while the answer is on its way
+	munit_assert_int(chiaki_ref_tracker_recovery(&tracker, rtt_us, t + FRAME_US), ==, CHIAKI_REF_RECOVERY_NONE);
+	// unless it doesn't come
+	munit_assert_int(chiaki_ref_tracker_recovery(&tracker, rtt_us, t + rtt_us + 5 * FRAME_US), ==, CHIAKI_REF_RECOVERY_REQUEST);
+
+	// the requested IDR frame ends the recovery, but doesn't count as a regular one
+	t += 7 * FRAME_US;
+	frame += 7;
+	chiaki_ref_tracker_submitted(&tracker, frame, true, t);
+	ChiakiRefTrackerStats stats;
+	chiaki_ref_tracker_get_stats(&tracker, &stats);
+	munit_assert_uint64(stats.iframe_interval_us, ==, 0);
+	munit_assert_uint64(stats.requests, ==, 2);
+
+	// regular IDR frames every 60 frames
+	for(unsigned i=0; i<3; i++)
+	{
+		t += 60 * FRAME_US;
+		frame += 60;
+		chiaki_ref_tracker_submitted(&tracker, frame, true, t);
+	}
+	chiaki_ref_tracker_get_stats(&tracker, &stats);
+	munit_assert_uint64(stats.iframe_interval_us, ==, 60 * FRAME_US);
+
+	// right after one, asking is faster
+	munit_assert_int(chiaki_ref_tracker_recovery(&tracker, rtt_us, t + 10 * FRAME_US), ==, CHIAKI_REF_RECOVERY_REQUEST);
+	// the regular interval starts over from the requested IDR frame
+	t += 12 * FRAME_US;
+	frame += 12;
+	chiaki_ref_tracker_submitted(&tracker, frame, true, t);
+
+	// shortly before the next one, it is cheaper to wait
+	uint64_t t_loss = t + 57 * FRAME_US;
+	munit_assert_int(chiaki_ref_tracker_recovery(&tracker, rtt_us, t_loss), ==, CHIAKI_REF_RECOVERY_WAIT_IDR);
+	munit_assert_int(chiaki_ref_tracker_recovery(&tracker, rtt_us, t_loss + FRAME_US), ==, CHIAKI_REF_RECOVERY_NONE);
+	// if it doesn't show up after all, ask
+	munit_assert_int(chiaki_ref_tracker_recovery(&tracker, rtt_us, t + 60 * FRAME_US + rtt_us + 5 * FRAME_US), ==, CHIAKI_REF_RECOVERY_REQUEST);
+
+	chiaki_ref_tracker_rewritten(&tracker);
+	chiaki_ref_tracker_get_stats(&tracker, &stats);
+	munit_assert_uint64(stats.requests, ==, 4);
+	munit_assert_uint64(stats.idr_waits, ==, 1);
+	munit_assert_uint64(stats.rewrites, ==, 1);
+
+	chiaki_ref_tracker_fini(&tracker);
+	return MUNIT_OK;
+}
+
+MunitTest tests_ref_tracker[] = {
+	{
+		"/refs",
+		test_refs,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{
+		"/recovery",
+		test_recovery,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{ NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL }
+};
@@ -0,0 +1,289 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#include <munit.h>
+
+#include <chiaki/remote/stunquery.h>
+#include <chiaki/stoppipe.h>
+#include <chiaki/thread.h>
+#include <chiaki/time.h>
+
+#include <stdio.h>
+#include <string.h>
+
+#include "test_log.h"
+#include "test_sock.h"
+
+/**
+ * A STUN server on loopback, answering binding requests after delay_ms with the address they came from,
+ * its port moved by port_offset like a NAT would.
+ */
+typedef struct stun_stand_in_t
+{
+	chiaki_socket_t sock;
+	ChiakiStopPipe stop_pipe;
+	ChiakiThread thread;
+	char host[INET6_ADDRSTRLEN];
+	uint16_t port;
+	uint16_t port_offset;
+	uint64_t delay_ms;
+} StunStandIn;
+
+static void *stand_in_thread_func(void *user)
+{
+	StunStandIn *stand_in = user;
+	while(true)
+	{
+		ChiakiErrorCode err = chiaki_stop_pipe_select_single(&stand_in->stop_pipe, stand_in->sock, false, UINT64_MAX);
+		if(err != CHIAKI_ERR_SUCCESS)
+			break;
+		uint8_t req[256];
+		struct sockaddr_storage from;
+		socklen_t from_len = sizeof(from);
+		CHIAKI_SSIZET_TYPE len = recvfrom(stand_in->sock, (CHIAKI_SOCKET_BUF_TYPE)req, sizeof(req), 0, (struct sockaddr *)&from, &from_len);
+		if(len < 0)
+			continue;
+		if(stand_in->delay_ms && chiaki_stop_pipe_sleep(&stand_in->stop_pipe, stand_in->delay_ms) != CHIAKI_ERR_TIMEOUT)
+			break;
+		struct sockaddr_storage mapped = from;
+		if(mapped.ss_family == AF_INET)
+			((struct sockaddr_in *)&mapped)->sin_port = htons(ntohs(((struct sockaddr_in *)&from)->sin_port) + stand_in->port_offset);
+		else
+			((struct sockaddr_in6 *)&mapped)->sin6_port = htons(ntohs(((struct sockaddr_in6 *)&from)->sin6_port) + stand_in->port_offset);
+		uint8_t resp[64];
+		size_t resp_len = chiaki_stun_binding_response(req, (size_t)len, (struct sockaddr *)&mapped, resp, sizeof(resp));
+		if(resp_len)
+			sendto(stand_in->sock, (CHIAKI_SOCKET_BUF_TYPE)resp, resp_len, 0, (struct sockaddr *)&from, from_len);
+	}
+	return NULL;
+}
+
+static bool stand_in_start(StunStandIn *stand_in, int family, uint16_t port_offset, uint64_t delay_ms)
+{
+	memset(stand_in, 0, sizeof(*stand_in));
+	stand_in->port_offset = port_offset;
+	stand_in->delay_ms = delay_ms;
+	snprintf(stand_in->host, sizeof(stand_in->host), family == AF_INET ? "127.0.0.1" : "::1");
+	stand_in->sock = bind_loopback(family, &stand_in->port);
+	if(CHIAKI_SOCKET_IS_INVALID(stand_in->sock))
+		return false;
+	if(chiaki_stop_pipe_init(&stand_in->stop_pipe) != CHIAKI_ERR_SUCCESS)
+		return false;
+	return chiaki_thread_create(&stand_in->thread, stand_in_thread_func, stand_in) == CHIAKI_ERR_SUCCESS;
+}
+
+static void stand_in_stop(StunStandIn *stand_in)
+{
+	chiaki_stop_pipe_stop(&stand_in->stop_pipe);
+	chiaki_thread_join(&stand_in->thread, NULL);
+	chiaki_stop_pipe_fini(&stand_in->stop_pipe);
+	CHIAKI_SOCKET_CLOSE(stand_in->sock);
+}
+
+static void stand_in_server(StunStandIn *stand_in, ChiakiStunServer *server)
+{
+	server->host = stand_in->host;
+	server->port = stand_in->port;
+}
+
+/**
+ * A loopback port nobody listens on
+ */
+static void dead_server(ChiakiStunServer *server)
+{
+	server->host = "127.0.0.1";
+	chiaki_socket_t sock = bind_loopback(AF_INET, &server->port);
+	munit_assert(!CHIAKI_SOCKET_IS_INVALID(sock));
+	CHIAKI_SOCKET_CLOSE(sock);
+}
+
+static MunitResult test_first_answer(const MunitParameter params[], void *user)
+{
+	StunStandIn stand_in;
+	munit_assert(stand_in_start(&stand_in, AF_INET, 0, 0));
+	uint16_t client_port;
+	chiaki_socket_t client = bind_loopback(AF_INET, &client_port);
+	munit_assert(!CHIAKI_SOCKET_IS_INVALID(client));
+
+	ChiakiStunServer servers[3];
+	dead_server(&servers[0]);
+	dead_server(&servers[1]);
+	stand_in_server(&stand_in, &servers[2]);
+
+	ChiakiStunQuery query;
+	chiaki_stun_query_init(&query, client, AF_INET, servers, 3, 1);
+	uint64_t start_ms = chiaki_time_now_monotonic_ms();
+	munit_assert_int(chiaki_stun_query_run(get_test_log(), &query, 1, 5000), ==, CHIAKI_ERR_SUCCESS);
+	// asked together, so the dead servers cost no time
+	munit_assert_uint64(chiaki_time_now_monotonic_ms() - start_ms, <, 500);
+	munit_assert_size(query.mappings_count, ==, 1);
+	munit_assert_string_equal(query.mappings[0].addr, "127.0.0.1");
+	munit_assert_uint(query.mappings[0].port, ==, client_port);
+	munit_assert_size(query.mappings[0].server, ==, 2);
+	munit_assert(!query.sock_failed);
+
+	CHIAKI_SOCKET_CLOSE(client);
+	stand_in_stop(&stand_in);
+	return MUNIT_OK;
+}
+
+static MunitResult test_single_server(const MunitParameter params[], void *user)
+{
+	// the second server would answer first if it was asked
+	StunStandIn stand_ins[2];
+	munit_assert(stand_in_start(&stand_ins[0], AF_INET, 10, 200));
+	munit_assert(stand_in_start(&stand_ins[1], AF_INET, 20, 0));
+	uint16_t client_port;
+	chiaki_socket_t client = bind_loopback(AF_INET, &client_port);
+	munit_assert(!CHIAKI_SOCKET_IS_INVALID(client));
+
+	ChiakiStunServer servers[2];
+	stand_in_server(&stand_ins[0], &servers[0]);
+	stand_in_server(&stand_ins[1], &servers[1]);
+
+	ChiakiStunQuery query;
+	chiaki_stun_query_init(&query, client, AF_INET, servers, 2, 1);
+	query.batch = 1;
+	munit_assert_int(chiaki_stun_query_run(get_test_log(), &query, 1, 5000), ==, CHIAKI_ERR_SUCCESS);
+	munit_assert_size(query.mappings_count, ==, 1);
+	munit_assert_size(query.mappings[0].server, ==, 0);
+	munit_assert_uint(query.mappings[0].port, ==, client_port + 10);
+	munit_assert_size(query.next_server, ==, 1);
+
+	CHIAKI_SOCKET_CLOSE(client);
+	for(size_t i=0; i<2; i++)
+		stand_in_stop(&stand_ins[i]);
+	return MUNIT_OK;
+}
+
+static MunitResult test_mappings_in_order(const MunitParameter params[], void *user)
+{
+	// answers come back in reverse order, the second server never answers
+	StunStandIn stand_ins[4];
+	for(size_t i=0; i<4; i++)
+		munit_assert(stand_in_start(&stand_ins[i], AF_INET, (uint16_t)(10 * (i + 1)), 40 * (3 - i)));
+	uint16_t client_port;
+	chiaki_socket_t client = bind_loopback(AF_INET, &client_port);
+	munit_assert(!CHIAKI_SOCKET_IS_INVALID(client));
+
+	ChiakiStunServer servers[5];
+	stand_in_server(&stand_ins[0], &servers[0]);
+	dead_server(&servers[1]);
+	stand_in_server(&stand_ins[1], &servers[2]);
+	stand_in_server(&stand_ins[2], &servers[3]);
+	stand_in_server(&stand_ins[3], &servers[4]);
+
+	ChiakiStunQuery query;
+	chiaki_stun_query_init(&query, client, AF_INET, servers, 5, 4);
+	munit_assert_int(chiaki_stun_query_run(get_test_log(), &query, 1, 5000), ==, CHIAKI_ERR_SUCCESS);
+	munit_assert_size(query.mappings_count, ==, 4);
+	size_t expected_servers[] = { 0, 2, 3, 4 };
+	for(size_t i=0; i<4; i++)
+	{
+		munit_assert_size(query.mappings[i].server, ==, expected_servers[i]);
+		munit_assert_uint(query.mappings[i].port, ==, client_port + 10 * (i + 1));
+	}
+
+	CHIAKI_SOCKET_CLOSE(client);
+	for(size_t i=0; i<4; i++)
+		stand_in_stop(&stand_ins[i]);
+	return MUNIT_OK;
+}
+
+static MunitResult test_ipv4_ipv6_parallel(const MunitParameter params[], void *user)
+{
+	StunStandIn stand_in_ipv6;
+	if(!stand_in_start(&stand_in_ipv6, AF_INET6, 0, 300))
+		return MUNIT_SKIP; // no IPv6 loopback
+	StunStandIn stand_in;
+	munit_assert(stand_in_start(&stand_in, AF_INET, 0, 300));
+	uint16_t client_port, client_port_ipv6;
+	chiaki_socket_t client = bind_loopback(AF_INET, &client_port);
+	chiaki_socket_t client_ipv6 = bind_loopback(AF_INET6, &client_port_ipv6);
+	munit_assert(!CHIAKI_SOCKET_IS_INVALID(client) && !CHIAKI_SOCKET_IS_INVALID(client_ipv6));
+
+	ChiakiStunServer server, server_ipv6;
+	stand_in_server(&stand_in, &server);
+	stand_in_server(&stand_in_ipv6, &server_ipv6);
+	ChiakiStunQuery queries[2];
+	chiaki_stun_query_init(&queries[0], client, AF_INET, &server, 1, 1);
+	chiaki_stun_query_init(&queries[1], client_ipv6, AF_INET6, &server_ipv6, 1, 1);
+	uint64_t start_ms = chiaki_time_now_monotonic_ms();
+	munit_assert_int(chiaki_stun_query_run(get_test_log(), queries, 2, 5000), ==, CHIAKI_ERR_SUCCESS);
+	// both delays overlap
+	munit_assert_uint64(chiaki_time_now_monotonic_ms() - start_ms, <, 500);
+	munit_assert_string_equal(queries[0].mappings[0].addr, "127.0.0.1");
+	munit_assert_uint(queries[0].mappings[0].port, ==, client_port);
+	munit_assert_string_equal(queries[1].mappings[0].addr, "::1");
+	munit_assert_uint(queries[1].mappings[0].port, ==, client_port_ipv6);
+
+	CHIAKI_SOCKET_CLOSE(client);
+	CHIAKI_SOCKET_CLOSE(client_ipv6);
+	stand_in_stop(&stand_in);
+	stand_in_stop(&stand_in_ipv6);
+	return MUNIT_OK;
+}
+
+static MunitResult test_timeout(const MunitParameter params[], void *user)
+{
+	uint16_t client_port;
+	chiaki_socket_t client = bind_loopback(AF_INET, &client_port);
+	munit_assert(!CHIAKI_SOCKET_IS_INVALID(client));
+	ChiakiStunServer server;
+	dead_server(&server);
+
+	ChiakiStunQuery query;
+	chiaki_stun_query_init(&query, client, AF_INET, &server, 1, 1);
+	uint64_t start_ms = chiaki_time_now_monotonic_ms();
+	munit_assert_int(chiaki_stun_query_run(get_test_log(), &query, 1, 300), ==, CHIAKI_ERR_TIMEOUT);
+	uint64_t elapsed_ms = chiaki_time_now_monotonic_ms() - start_ms;
+	munit_assert_uint64(elapsed_ms, >=, 300);
+	munit_assert_uint64(elapsed_ms, <, 1000);
+	munit_assert_size(query.mappings_count, ==, 0);
+
+	CHIAKI_SOCKET_CLOSE(client);
+	return MUNIT_OK;
+}
+
+MunitTest tests_stun_query[] = {
+	{
+		"/first_answer",
+		test_first_answer,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{
+		"/single_server",
+		test_single_server,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{
+		"/mappings_in_order",
+		test_mappings_in_order,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{
+		"/ipv4_ipv6_parallel",
+		test_ipv4_ipv6_parallel,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{
+		"/timeout",
+		test_timeout,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{ NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL }
+};
@@ -166,7 +166,7 @@ static MunitResult test_takion_format_congestion(const MunitParameter params[],
 	static const uint8_t ecdh_secret[] = { 0x00, 0x34, 0xf8, 0x21, 0xc7, 0xd9, 0xde, 0xa9, 0xe9, 0x11, 0xca, 0x5a, 0xd6, 0x7d, 0x11, 0xce, 0x4f, 0x02, 0xb1, 0xce, 0x1e, 0xe7, 0xc3, 0x8d, 0x54, 0x39, 0xfa, 0x64, 0xe3, 0xdb, 0xd8, 0x0d };
 
 	ChiakiGKCrypt gkcrypt;
-	ChiakiErrorCode err = chiaki_gkcrypt_init(&gkcrypt, NULL, 0, 2, handshake_key, ecdh_secret);
+	ChiakiErrorCode err = chiaki_gkcrypt_init(&gkcrypt, NULL, 0, NULL, 2, handshake_key, ecdh_secret);
 	if(err != CHIAKI_ERR_SUCCESS)
 		return MUNIT_ERROR;
 
@@ -0,0 +1,45 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#include "test_sock.h"
+
+#include <string.h>
+
+#ifdef _WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#else
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#endif
+
+chiaki_socket_t bind_loopback(int family, uint16_t *port)
+{
+	chiaki_socket_t sock = socket(family, SOCK_DGRAM, IPPROTO_UDP);
+	if(CHIAKI_SOCKET_IS_INVALID(sock))
+		return sock;
+	struct sockaddr_storage addr;
+	memset(&addr, 0, sizeof(addr));
+	socklen_t len;
+	if(family == AF_INET)
+	{
+		struct sockaddr_in *in = (struct sockaddr_in *)&addr;
+		in->sin_family = AF_INET;
+		in->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		len = sizeof(*in);
+	}
+	else
+	{
+		struct sockaddr_in6 *in6 = (struct sockaddr_in6 *)&addr;
+		in6->sin6_family = AF_INET6;
+		in6->sin6_addr = in6addr_loopback;
+		len = sizeof(*in6);
+	}
+	if(bind(sock, (struct sockaddr *)&addr, len) < 0 || getsockname(sock, (struct sockaddr *)&addr, &len) < 0)
+	{
+		CHIAKI_SOCKET_CLOSE(sock);
+		return CHIAKI_INVALID_SOCKET;
+	}
+	*port = ntohs(family == AF_INET ? ((struct sockaddr_in *)&addr)->sin_port : ((struct sockaddr_in6 *)&addr)->sin6_port);
+	return sock;
+}
@@ -0,0 +1,18 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#ifndef CHIAKI_TEST_SOCK_H
+#define CHIAKI_TEST_SOCK_H
+
+#include <chiaki/sock.h>
+
+#include <stdint.h>
+
+/**
+ * Bind a UDP socket to a free port on the loopback address of family.
+ * Closing it right away gives a port nobody listens on.
+ *
+ * @return the socket or CHIAKI_INVALID_SOCKET
+ */
+chiaki_socket_t bind_loopback(int family, uint16_t *port);
+
+#endif // CHIAKI_TEST_SOCK_H
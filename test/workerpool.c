@@ -0,0 +1,223 @@
+// SPDX-License-Identifier: LicenseRef-AGPL-3.0-only-OpenSSL
+
+#include <munit.h>
+
+#include <chiaki/workerpool.h>
+#include <chiaki/time.h>
+
+#include <string.h>
+
+#include "test_log.h"
+
+#define REPOSTS 100
+
+typedef struct lane_ctx_t
+{
+	ChiakiWorkerLane *lane;
+	ChiakiWorkerTask task;
+	ChiakiMutex *mutex;
+	ChiakiCond *cond;
+	unsigned int *order; // shared counter of runs across lanes
+	unsigned int runs;
+	unsigned int first_run_order;
+	unsigned int reposts;
+	unsigned int running;
+	bool overlapped;
+	bool hold; // block the first run until cleared
+} LaneCtx;
+
+static void lane_task(void *user)
+{
+	LaneCtx *ctx = user;
+	chiaki_mutex_lock(ctx->mutex);
+	if(ctx->running++)
+		ctx->overlapped = true;
+	if(!ctx->runs)
+		ctx->first_run_order = *ctx->order;
+	(*ctx->order)++;
+	ctx->runs++;
+	chiaki_cond_broadcast(ctx->cond);
+	while(ctx->hold)
+		chiaki_cond_wait(ctx->cond, ctx->mutex);
+	bool repost = ctx->reposts > 0;
+	if(repost)
+		ctx->reposts--;
+	chiaki_mutex_unlock(ctx->mutex);
+
+	// queued again while still running, which must not start it on another thread
+	if(repost)
+		chiaki_worker_lane_post(ctx->lane, &ctx->task);
+
+	chiaki_mutex_lock(ctx->mutex);
+	ctx->running--;
+	chiaki_mutex_unlock(ctx->mutex);
+	chiaki_cond_broadcast(ctx->cond);
+}
+
+static void lane_ctx_init(LaneCtx *ctx, ChiakiWorkerPool *pool, ChiakiMutex *mutex, ChiakiCond *cond, unsigned int *order, unsigned int reposts)
+{
+	memset(ctx, 0, sizeof(*ctx));
+	ctx->lane = chiaki_worker_lane_new(pool);
+	munit_assert_not_null(ctx->lane);
+	chiaki_worker_task_init(&ctx->task, lane_task, ctx);
+	ctx->mutex = mutex;
+	ctx->cond = cond;
+	ctx->order = order;
+	ctx->reposts = reposts;
+}
+
+static MunitResult test_fairness(const MunitParameter params[], void *user)
+{
+	ChiakiWorkerPool *pool = chiaki_worker_pool_new(get_test_log(), 1);
+	munit_assert_not_null(pool);
+	munit_assert_uint(chiaki_worker_pool_thread_count(pool), ==, 1);
+
+	ChiakiMutex mutex;
+	ChiakiCond cond;
+	chiaki_mutex_init(&mutex, false);
+	chiaki_cond_init(&cond);
+	unsigned int order = 0;
+
+	LaneCtx busy, quiet;
+	lane_ctx_init(&busy, pool, &mutex, &cond, &order, REPOSTS);
+	lane_ctx_init(&quiet, pool, &mutex, &cond, &order, 0);
+
+	// the quiet lane gets work while the busy one is running its first task
+	busy.hold = true;
+	chiaki_worker_lane_post(busy.lane, &busy.task);
+	chiaki_mutex_lock(&mutex);
+	while(busy.runs < 1)
+		munit_assert_int(chiaki_cond_timedwait(&cond, &mutex, 5000), !=, CHIAKI_ERR_TIMEOUT);
+	chiaki_mutex_unlock(&mutex);
+	chiaki_worker_lane_post(quiet.lane, &quiet.task);
+	chiaki_mutex_lock(&mutex);
+	busy.hold = false;
+	chiaki_mutex_unlock(&mutex);
+	chiaki_cond_broadcast(&cond);
+
+	chiaki_mutex_lock(&mutex);
+	while(busy.runs < REPOSTS + 1 || quiet.runs < 1)
+		munit_assert_int(chiaki_cond_timedwait(&cond, &mutex, 5000), !=, CHIAKI_ERR_TIMEOUT);
+	chiaki_mutex_unlock(&mutex);
+
+	munit_assert_uint(busy.runs, ==, REPOSTS + 1);
+	munit_assert_uint(quiet.runs, ==, 1);
+	// the busy lane doesn't get to run all of its tasks first
+	munit_assert_uint(quiet.first_run_order, ==, 1);
+
+	chiaki_worker_lane_free(busy.lane);
+	chiaki_worker_lane_free(quiet.lane);
+	chiaki_worker_pool_free(pool);
+	chiaki_cond_fini(&cond);
+	chiaki_mutex_fini(&mutex);
+	return MUNIT_OK;
+}
+
+static MunitResult test_serial(const MunitParameter params[], void *user)
+{
+	ChiakiWorkerPool *pool = chiaki_worker_pool_new(get_test_log(), 4);
+	munit_assert_not_null(pool);
+
+	ChiakiMutex mutex;
+	ChiakiCond cond;
+	chiaki_mutex_init(&mutex, false);
+	chiaki_cond_init(&cond);
+	unsigned int order = 0;
+
+	LaneCtx lanes[3];
+	for(size_t i=0; i<3; i++)
+	{
+		lane_ctx_init(&lanes[i], pool, &mutex, &cond, &order, REPOSTS);
+		chiaki_worker_lane_post(lanes[i].lane, &lanes[i].task);
+	}
+
+	chiaki_mutex_lock(&mutex);
+	while(order < 3 * (REPOSTS + 1))
+		munit_assert_int(chiaki_cond_timedwait(&cond, &mutex, 5000), !=, CHIAKI_ERR_TIMEOUT);
+	chiaki_mutex_unlock(&mutex);
+
+	// tasks of one lane never run concurrently, even with more threads than lanes
+	for(size_t i=0; i<3; i++)
+	{
+		munit_assert_uint(lanes[i].runs, ==, REPOSTS + 1);
+		munit_assert_false(lanes[i].overlapped);
+		chiaki_worker_lane_free(lanes[i].lane);
+	}
+	chiaki_worker_pool_free(pool);
+	chiaki_cond_fini(&cond);
+	chiaki_mutex_fini(&mutex);
+	return MUNIT_OK;
+}
+
+static void timer_func(void *user)
+{
+	LaneCtx *ctx = user;
+	chiaki_mutex_lock(ctx->mutex);
+	ctx->runs++;
+	chiaki_mutex_unlock(ctx->mutex);
+	chiaki_cond_broadcast(ctx->cond);
+}
+
+static MunitResult test_timer(const MunitParameter params[], void *user)
+{
+	ChiakiWorkerPool *pool = chiaki_worker_pool_new(get_test_log(), 2);
+	munit_assert_not_null(pool);
+
+	ChiakiMutex mutex;
+	ChiakiCond cond;
+	chiaki_mutex_init(&mutex, false);
+	chiaki_cond_init(&cond);
+	unsigned int order = 0;
+
+	LaneCtx ctx;
+	lane_ctx_init(&ctx, pool, &mutex, &cond, &order, 0);
+	uint64_t start = chiaki_time_now_monotonic_ms();
+	chiaki_worker_lane_set_timer(ctx.lane, 10, timer_func, &ctx);
+
+	chiaki_mutex_lock(&mutex);
+	while(ctx.runs < 5)
+		munit_assert_int(chiaki_cond_timedwait(&cond, &mutex, 5000), !=, CHIAKI_ERR_TIMEOUT);
+	chiaki_mutex_unlock(&mutex);
+	munit_assert_uint64(chiaki_time_now_monotonic_ms() - start, >=, 50);
+
+	// nothing runs anymore once the lane is gone
+	chiaki_worker_lane_free(ctx.lane);
+	chiaki_mutex_lock(&mutex);
+	unsigned int runs = ctx.runs;
+	chiaki_cond_timedwait(&cond, &mutex, 50);
+	munit_assert_uint(ctx.runs, ==, runs);
+	chiaki_mutex_unlock(&mutex);
+
+	chiaki_worker_pool_free(pool);
+	chiaki_cond_fini(&cond);
+	chiaki_mutex_fini(&mutex);
+	return MUNIT_OK;
+}
+
+MunitTest tests_worker_pool[] = {
+	{
+		"/fairness",
+		test_fairness,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{
+		"/serial",
+		test_serial,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{
+		"/timer",
+		test_timer,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{ NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL }
+};